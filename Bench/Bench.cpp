@@ -0,0 +1,162 @@
+// Bench.cpp: MapBench entry point, allocation counting and result reporting, see Bench.h
+
+#include "Bench.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <new>
+
+static std::atomic<unsigned long long> g_nAllocations = 0;
+// created on first use, removed at exit
+static std::filesystem::path g_tempDirectory;
+
+unsigned long long BenchAllocations()
+{
+	return g_nAllocations.load(std::memory_order_relaxed);
+}
+
+// every other form of operator new (arrays, nothrow) ends up in these two by default
+void* operator new(size_t nSize)
+{
+	g_nAllocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = malloc(nSize ? nSize : 1)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void* operator new(size_t nSize, std::align_val_t alignment)
+{
+	g_nAllocations.fetch_add(1, std::memory_order_relaxed);
+	size_t nAlignment = std::max(sizeof(void*), (size_t)alignment);
+	if (void* p = aligned_alloc(nAlignment, (nSize + nAlignment - 1) / nAlignment * nAlignment)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t, std::align_val_t) noexcept
+{
+	free(p);
+}
+
+std::wstring BenchTempDirectory()
+{
+	if (g_tempDirectory.empty()) {
+		g_tempDirectory = std::filesystem::temp_directory_path() / std::format("mapviewer-bench-{}", GetCurrentProcessId());
+		std::filesystem::remove_all(g_tempDirectory);
+		std::filesystem::create_directories(g_tempDirectory);
+	}
+	return g_tempDirectory.wstring();
+}
+
+std::vector<BenchCase>& BenchCases()
+{
+	static std::vector<BenchCase> vecCases;
+	return vecCases;
+}
+
+double BenchLatencies::Percentile(double dPercent)
+{
+	if (m_vecSamples.empty()) {
+		return 0.0;
+	}
+	if (!m_bSorted) {
+		std::sort(m_vecSamples.begin(), m_vecSamples.end());
+		m_bSorted = true;
+	}
+	size_t nIndex = (size_t)std::ceil(dPercent / 100.0 * m_vecSamples.size());
+	return (double)m_vecSamples[std::clamp<size_t>(nIndex, 1, m_vecSamples.size()) - 1];
+}
+
+static void AppendJsonString(std::string& str, std::string_view strValue)
+{
+	str += '"';
+	for (char c : strValue) {
+		if (c == '"' || c == '\\') {
+			str += '\\';
+		}
+		str += c;
+	}
+	str += '"';
+}
+
+BenchReport::BenchReport(const char* pszBench, std::string strCase)
+{
+	m_strLine = "{\"bench\":";
+	AppendJsonString(m_strLine, pszBench);
+	m_strLine += ",\"case\":";
+	AppendJsonString(m_strLine, strCase);
+}
+
+BenchReport::~BenchReport()
+{
+	m_strLine += "}\n";
+	fputs(m_strLine.c_str(), stdout);
+	fflush(stdout);
+}
+
+BenchReport& BenchReport::Add(const char* pszMetric, double dValue)
+{
+	m_strLine += ',';
+	AppendJsonString(m_strLine, pszMetric);
+	// JSON has no infinities or NaNs
+	m_strLine += std::isfinite(dValue) ? std::format(":{}", dValue) : std::string(":null");
+	return *this;
+}
+
+BenchReport& BenchReport::AddPercentiles(const char* pszPrefix, BenchLatencies& latencies)
+{
+	Add(std::format("{}_p50_ns", pszPrefix).c_str(), latencies.Percentile(50));
+	Add(std::format("{}_p99_ns", pszPrefix).c_str(), latencies.Percentile(99));
+	return Add(std::format("{}_max_ns", pszPrefix).c_str(), latencies.Percentile(100));
+}
+
+int main(int argc, char* argv[])
+{
+	BenchContext context;
+	std::vector<std::string> vecNames;
+	for (int n = 1; n < argc; n++) {
+		if (!strcmp(argv[n], "--quick")) {
+			context.bQuick = true;
+		} else {
+			vecNames.push_back(argv[n]);
+		}
+	}
+	for (const std::string& strName : vecNames) {
+		if (std::none_of(BenchCases().begin(), BenchCases().end(), [&](const BenchCase& bench) { return strName == bench.pszName; })) {
+			fprintf(stderr, "Unknown benchmark %s, there are:", strName.c_str());
+			for (const BenchCase& bench : BenchCases()) {
+				fprintf(stderr, " %s", bench.pszName);
+			}
+			fprintf(stderr, "\n");
+			return 1;
+		}
+	}
+	for (const BenchCase& bench : BenchCases()) {
+		if (vecNames.empty() || std::find(vecNames.begin(), vecNames.end(), bench.pszName) != vecNames.end()) {
+			bench.pfnBench(context);
+		}
+	}
+	if (!g_tempDirectory.empty()) {
+		std::error_code error;
+		std::filesystem::remove_all(g_tempDirectory, error);
+	}
+	return 0;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+// Bench.h: minimal benchmark harness for MapBench, for the platform-neutral modules built by
+// CMake.  BENCH(name) { ... } defines a benchmark, run by "MapBench name" (all of them without
+// arguments, and only briefly with --quick, as ctest does to keep them working).  Results are
+// printed as JSON lines, one per case, e. g. {"bench":"pixelconvert","case":"bgra32/avx2",
+// "pixels_per_ns":1.9}, for comparing runs and builds.  Heap allocations are counted by
+// replacing the global operator new (see Bench.cpp), so that allocations per operation can be
+// reported too
+
+#include "framework.h"
+
+struct BenchContext
+{
+	// a smoke run: just enough iterations to go through all the code once
+	bool bQuick = false;
+
+	// iterations for a full run scaled down for a quick one
+	size_t Iterations(size_t nFull) const { return bQuick ? std::max<size_t>(1, nFull / 1000) : nFull; }
+};
+
+struct BenchCase
+{
+	const char* pszName;
+	void (*pfnBench)(BenchContext& context);
+};
+
+// all benchmarks, in registration order
+std::vector<BenchCase>& BenchCases();
+
+struct BenchRegistration
+{
+	BenchRegistration(const char* pszName, void (*pfnBench)(BenchContext&)) { BenchCases().push_back({ pszName, pfnBench }); }
+};
+
+#define BENCH(name) \
+	static void name##Bench(BenchContext& context); \
+	static BenchRegistration name##Registration(#name, name##Bench); \
+	static void name##Bench(BenchContext& context)
+
+// heap allocations made by the whole process so far
+unsigned long long BenchAllocations();
+
+// a directory for files benchmarks need, e. g. a tile cache, removed when MapBench exits
+std::wstring BenchTempDirectory();
+
+// wall clock time since construction
+class BenchTimer
+{
+public:
+	long long ElapsedNs() const
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_tmStart).count();
+	}
+
+private:
+	std::chrono::steady_clock::time_point m_tmStart = std::chrono::steady_clock::now();
+};
+
+// durations of single operations, for percentiles.  Unlike TraceHistogram, exact, as runs
+// are short enough to keep every sample
+class BenchLatencies
+{
+public:
+	void Record(long long nNs) { m_vecSamples.push_back(nNs); }
+	size_t count() const { return m_vecSamples.size(); }
+	// duration which dPercent % of samples took at most, ns; 0 if there are no samples
+	double Percentile(double dPercent);
+
+private:
+	std::vector<long long> m_vecSamples;
+	bool m_bSorted = false;
+};
+
+// one line of results, printed when it goes out of scope
+class BenchReport
+{
+public:
+	BenchReport(const char* pszBench, std::string strCase);
+	~BenchReport();
+
+	BenchReport& Add(const char* pszMetric, double dValue);
+	// adds p50/p99 (and max) of latencies, ns, as <prefix>_p50_ns etc.
+	BenchReport& AddPercentiles(const char* pszPrefix, BenchLatencies& latencies);
+
+	BenchReport(const BenchReport&) = delete;
+	BenchReport& operator=(const BenchReport&) = delete;
+
+private:
+	std::string m_strLine;
+};
+
+// keeps the compiler from optimizing away a computation whose result is otherwise unused
+template <typename T>
+inline void BenchKeep(const T& value)
+{
+#ifdef __GNUC__
+	__asm__ __volatile__("" : : "r"(&value) : "memory");
+#else
+	static const void* volatile s_pSink;
+	s_pSink = &value;
+	_ReadWriteBarrier();
+#endif
+}
@@ -0,0 +1,112 @@
+// CanvasBench.cpp: frames drawn into a full HD SoftwareCanvas the way MapWindow::Render() draws
+// them, at every SIMD level: with every visible tile ready, drawn unscaled at whole pixels
+// (blits); and right after zooming in, with none of them ready yet, each drawn from a quarter of
+// its parent scaled up bilinearly, as DrawFallbackTile() does.  Then the crosshair, in both.
+// Tiles come from FakeTransport and FakeDecoder and are all loaded before frames are timed, so
+// this is the cost of drawing alone.  Frames per second is the inverse of the time a frame takes
+
+#include "Bench.h"
+#include "FakeTransport.h"
+#include "HttpClient.h"
+#include "TileCache.h"
+#include "DecodePool.h"
+#include "TileManager.h"
+#include "Projection.h"
+#include "SoftwareCanvas.h"
+
+#include <filesystem>
+
+static const unsigned TILE_SIZE = 256;
+static const unsigned WIDTH = 1920, HEIGHT = 1080;
+// around Prague, as in TileEngineBench.cpp
+static const MercatorPoint CENTER = { 0.5400, 0.3400 };
+
+static const char* LevelName(SimdLevel level)
+{
+	switch (level) {
+	case SIMD_SSE2: return "sse2";
+	case SIMD_AVX2: return "avx2";
+	default: return "scalar";
+	}
+}
+
+// one frame of the view, as MapWindow::Render() draws it, with the same tile placement as
+// GetTopLeftOffset() and GetTileRect().  Tiles which are not ready are drawn from their parent
+static void DrawFrame(SoftwareCanvas& canvas, TileManager& tileManager, const MapView& view, unsigned nZoom)
+{
+	int xOffset = (int)std::lround((double)view.nTopLeftX * TILE_SIZE - view.dTopLeftX);
+	int yOffset = (int)std::lround((double)view.nTopLeftY * TILE_SIZE - view.dTopLeftY);
+	for (unsigned y = 0; y <= view.nHeightInTiles; y++) {
+		for (unsigned x = 0; x <= view.nWidthInTiles; x++) {
+			TileCoords coords(view.nTopLeftX + x, view.nTopLeftY + y, nZoom);
+			float fLeft = (float)(xOffset + (int)(x * TILE_SIZE)), fTop = (float)(yOffset + (int)(y * TILE_SIZE));
+			D2D1_RECT_F rectangle = D2D1::RectF(fLeft, fTop, fLeft + TILE_SIZE, fTop + TILE_SIZE);
+			Tile* pTile = tileManager.GetTile(coords);
+			if (pTile && pTile->state() == TS_READY) {
+				canvas.DrawTile(*pTile, rectangle);
+				continue;
+			}
+			unsigned nLevels;
+			Tile* pAncestor = tileManager.GetReadyAncestor(coords, 1, nLevels);
+			if (pAncestor) {
+				float fHalf = TILE_SIZE / 2.f;
+				D2D1_RECT_F source = D2D1::RectF((coords.x & 1) * fHalf, (coords.y & 1) * fHalf,
+					((coords.x & 1) + 1) * fHalf, ((coords.y & 1) + 1) * fHalf);
+				canvas.DrawTile(*pAncestor, rectangle, &source);
+			} else {
+				canvas.FillRectangle(rectangle, D2D1::ColorF(D2D1::ColorF::White));
+			}
+		}
+	}
+	D2D1_COLOR_F color = D2D1::ColorF(D2D1::ColorF::Black);
+	canvas.DrawLine(D2D1::Point2F(WIDTH / 2.f, HEIGHT / 2.f - 100.f), D2D1::Point2F(WIDTH / 2.f, HEIGHT / 2.f + 100.f), color);
+	canvas.DrawLine(D2D1::Point2F(WIDTH / 2.f - 100.f, HEIGHT / 2.f), D2D1::Point2F(WIDTH / 2.f + 100.f, HEIGHT / 2.f), color);
+}
+
+BENCH(canvas)
+{
+	std::filesystem::path cacheDirectory = std::filesystem::path(BenchTempDirectory()) / "canvas";
+	std::filesystem::create_directories(cacheDirectory);
+	HttpClient httpClient(std::make_unique<FakeTransport>());
+	TileCache tileCache(cacheDirectory.wstring(), 64 * 1024 * 1024);
+	DecodePool decodePool;
+	size_t nLoaded = 0;
+	TileManager tileManager(httpClient, tileCache, decodePool, L"http://tiles.invalid", TILE_SIZE,
+		[&](Tile&) { nLoaded++; }, [] {});
+	tileManager.SetDecoder(std::make_unique<FakeDecoder>(TILE_SIZE));
+	tileManager.SetKeepPixels(true);
+
+	// the tiles of zoom level 12; the view one level down is drawn from them, as after zooming in
+	static const unsigned ZOOM = 12;
+	MapView view = CalculateView(CENTER, ZOOM, TILE_SIZE, WIDTH, HEIGHT);
+	tileManager.UpdateView(ZOOM, view.nTopLeftX, view.nTopLeftY, view.nWidthInTiles, view.nHeightInTiles);
+	while (nLoaded < (view.nWidthInTiles + 1) * (view.nHeightInTiles + 1)) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		tileManager.ProcessCompletions();
+	}
+
+	SoftwareCanvas canvas(WIDTH, HEIGHT);
+	const size_t nFrames = context.Iterations(300);
+	SimdLevel best = GetSimdLevel();
+	for (int nLevel = SIMD_SCALAR; nLevel <= best; nLevel++) {
+		SetSimdLevel((SimdLevel)nLevel);
+		for (unsigned nZoom : { ZOOM, ZOOM + 1 }) {
+			MapView frameView = CalculateView(CENTER, nZoom, TILE_SIZE, WIDTH, HEIGHT);
+			DrawFrame(canvas, tileManager, frameView, nZoom);
+			BenchLatencies latencies;
+			BenchTimer timer;
+			for (size_t n = 0; n < nFrames; n++) {
+				BenchTimer frameTimer;
+				DrawFrame(canvas, tileManager, frameView, nZoom);
+				BenchKeep(canvas.pixels()[n % (WIDTH * HEIGHT)]);
+				latencies.Record(frameTimer.ElapsedNs());
+			}
+			double dNs = (double)timer.ElapsedNs();
+			BenchReport("canvas", std::format("{}/{}", nZoom == ZOOM ? "tiles" : "fallback", LevelName((SimdLevel)nLevel)))
+				.Add("frames_per_s", nFrames * 1e9 / dNs)
+				.Add("ns_per_pixel", dNs / (nFrames * (double)WIDTH * HEIGHT))
+				.AddPercentiles("frame", latencies);
+		}
+	}
+	tileManager.Shutdown();
+}
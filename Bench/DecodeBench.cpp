@@ -0,0 +1,132 @@
+// DecodeBench.cpp: tile decoding throughput of PngDecoder on synthetic 256x256 tiles which look
+// like map tiles to the encoder (flat areas, roads, a little noise; RGB, palette, and a mostly
+// transparent overlay), on one thread, and through DecodePool on one and on all CPUs
+
+#include "Bench.h"
+#include "DecodePool.h"
+#include "PngDecoder.h"
+#include "PngWriter.h"
+
+static const unsigned TILE_SIZE = 256;
+static const UINT32 AREA_COLORS[] = { 0xf2efe9, 0xaad3df, 0xcdebb0, 0xe0dfdf, 0xadd19e, 0xf5dcba };
+// color indices after those of the areas
+static const unsigned ROAD_INDEX = std::size(AREA_COLORS), CASING_INDEX = ROAD_INDEX + 1, DETAIL_INDEX = ROAD_INDEX + 2;
+
+// RGB samples of a map-like tile: areas of a few flat colors, roads across them, noise here and there
+static std::vector<BYTE> MapTile(unsigned nSeed, std::vector<BYTE>& vecIndices)
+{
+	static const UINT32 ROAD_COLOR = 0xffffff, CASING_COLOR = 0xbbbbbb;
+	std::mt19937 random(nSeed);
+	std::vector<BYTE> vecRgb;
+	vecIndices.clear();
+	unsigned nRoadX = random() % TILE_SIZE, nRoadY = random() % TILE_SIZE;
+	for (unsigned y = 0; y < TILE_SIZE; y++) {
+		for (unsigned x = 0; x < TILE_SIZE; x++) {
+			// areas are cells of 64 pixels, with wavy borders
+			unsigned nCell = ((x + (y * 7 / 5) % 13) / 64 * 5 + (y + x % 11) / 64 * 3 + nSeed) % std::size(AREA_COLORS);
+			unsigned nIndex = nCell;
+			unsigned nRoadDistance = std::min<unsigned>(std::abs((int)x - (int)nRoadX), std::abs((int)((y + x / 4) % TILE_SIZE) - (int)nRoadY));
+			if (nRoadDistance < 3) {
+				nIndex = ROAD_INDEX;
+			} else if (nRoadDistance < 5) {
+				nIndex = CASING_INDEX;
+			} else if (random() % 32 == 0) {
+				// labels, symbols, antialiasing
+				nIndex = DETAIL_INDEX + random() % 32;
+			}
+			UINT32 nColor = nIndex < ROAD_INDEX ? AREA_COLORS[nIndex] : nIndex == ROAD_INDEX ? ROAD_COLOR :
+				nIndex == CASING_INDEX ? CASING_COLOR : 0x404040 + (nIndex << 18) + (nIndex << 1);
+			vecRgb.insert(vecRgb.end(), { (BYTE)(nColor >> 16), (BYTE)(nColor >> 8), (BYTE)nColor });
+			vecIndices.push_back((BYTE)nIndex);
+		}
+	}
+	return vecRgb;
+}
+
+// tiles of one kind, different ones so that it's not all the same data in cache
+static std::vector<std::vector<BYTE>> EncodeTiles(const char* pszKind, size_t nTiles)
+{
+	std::vector<std::vector<BYTE>> vecTiles;
+	for (unsigned n = 0; n < nTiles; n++) {
+		PngImage image;
+		image.nWidth = image.nHeight = TILE_SIZE;
+		std::vector<BYTE> vecIndices, vecRgb = MapTile(n, vecIndices);
+		if (!strcmp(pszKind, "rgb24")) {
+			image.vecRows = std::move(vecRgb);
+		} else if (!strcmp(pszKind, "palette8")) {
+			image.nColorType = 3;
+			image.vecRows = std::move(vecIndices);
+			for (unsigned nIndex = 0; nIndex < DETAIL_INDEX + 32; nIndex++) {
+				image.vecPalette.push_back(0xff000000 | (UINT32)nIndex * 0x050301);
+			}
+		} else {
+			// an overlay: transparent but for the roads
+			image.nColorType = 6;
+			for (size_t nPixel = 0; nPixel < vecIndices.size(); nPixel++) {
+				bool bRoad = vecIndices[nPixel] == ROAD_INDEX || vecIndices[nPixel] == CASING_INDEX;
+				image.vecRows.insert(image.vecRows.end(), { vecRgb[nPixel * 3], vecRgb[nPixel * 3 + 1], vecRgb[nPixel * 3 + 2], (BYTE)(bRoad ? 0xc0 : 0) });
+			}
+		}
+		vecTiles.push_back(PngWriter::Write(image));
+	}
+	return vecTiles;
+}
+
+BENCH(decode)
+{
+	static const size_t DISTINCT_TILES = 16;
+	const size_t nTiles = context.Iterations(2000);
+	const double dPixels = (double)TILE_SIZE * TILE_SIZE;
+	PngDecoder decoder;
+
+	for (const char* pszKind : { "rgb24", "palette8", "rgba32" }) {
+		std::vector<std::vector<BYTE>> vecTiles = EncodeTiles(pszKind, DISTINCT_TILES);
+		size_t szCompressed = 0;
+		for (const auto& vecTile : vecTiles) {
+			szCompressed += vecTile.size();
+		}
+
+		DecodedImage image;
+		decoder.Decode(vecTiles[0].data(), vecTiles[0].size(), image);
+		BenchLatencies latencies;
+		BenchTimer timer;
+		for (size_t n = 0; n < nTiles; n++) {
+			const std::vector<BYTE>& vecTile = vecTiles[n % DISTINCT_TILES];
+			BenchTimer tileTimer;
+			decoder.Decode(vecTile.data(), vecTile.size(), image);
+			BenchKeep(image.vecPixels);
+			latencies.Record(tileTimer.ElapsedNs());
+		}
+		double dNs = (double)timer.ElapsedNs();
+		BenchReport("decode", pszKind)
+			.Add("tile_bytes", (double)szCompressed / DISTINCT_TILES)
+			.Add("tiles_per_s", nTiles * 1e9 / dNs)
+			.Add("ns_per_pixel", dNs / (nTiles * dPixels))
+			.Add("compressed_mb_per_s", (double)szCompressed / DISTINCT_TILES * nTiles * 1e3 / dNs)
+			.AddPercentiles("tile", latencies);
+
+		// through the pool, each job decoding into an image of its own as TileManager's do
+		std::vector<unsigned> vecThreads = { 1 };
+		if (std::thread::hardware_concurrency() > 1) {
+			vecThreads.push_back(std::thread::hardware_concurrency());
+		}
+		for (unsigned nThreads : vecThreads) {
+			BenchTimer poolTimer;
+			{
+				DecodePool pool(nThreads, nTiles);
+				for (size_t n = 0; n < nTiles; n++) {
+					pool.Submit([&, n]() {
+						const std::vector<BYTE>& vecTile = vecTiles[n % DISTINCT_TILES];
+						DecodedImage poolImage;
+						decoder.Decode(vecTile.data(), vecTile.size(), poolImage);
+						BenchKeep(poolImage.vecPixels);
+					});
+				}
+			}
+			double dPoolNs = (double)poolTimer.ElapsedNs();
+			BenchReport("decode", std::format("{}/pool{}", pszKind, nThreads))
+				.Add("tiles_per_s", nTiles * 1e9 / dPoolNs)
+				.Add("ns_per_pixel", dPoolNs / (nTiles * dPixels));
+		}
+	}
+}
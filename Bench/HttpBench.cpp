@@ -0,0 +1,98 @@
+// HttpBench.cpp: tile download rate and latency of HttpClient with SocketTransport, against a local
+// TestHttpServer which takes a while to answer each request, as a real one across the network would,
+// with different numbers of connections and pipelining depths.  Requests are kept coming, up to a
+// window of them outstanding at a time, as while panning; latency is from Get() to the callback,
+// so it includes waiting for a connection.  Allocations per tile count the server's too, as it runs
+// in the same process; body allocations per tile are just the heap blocks ResponseBuffer took for
+// response bodies, which the pool should bring down to nothing once it has warmed up.
+// http/cancel is the cost of cancelling each of many requests in flight, as a view change does
+
+#include "Bench.h"
+#include "TestHttpServer.h"
+#include "HttpClient.h"
+#include "SocketTransport.h"
+#include "FakeTransport.h"
+
+BENCH(http)
+{
+	// responses about the size of a PNG tile
+	TestHttpServer::Options options;
+	options.nLatencyMs = context.bQuick ? 1 : 10;
+	options.szBody = 20 * 1024;
+	TestHttpServer server(options);
+	static const size_t WINDOW = 64;
+	size_t nTiles = context.Iterations(1000);
+
+	unsigned nRun = 0;
+	for (unsigned nConnections : { 1u, 2u, 8u }) {
+		for (unsigned nDepth : { 1u, 4u }) {
+			// different tiles each run, nothing is coalesced
+			std::vector<std::wstring> vecUrls;
+			for (size_t n = 0; n < nTiles; n++) {
+				vecUrls.push_back(server.Url(std::format("/{}/{}", nRun, n)));
+			}
+			nRun++;
+
+			auto pTransport = std::make_unique<SocketTransport>(nConnections, nDepth);
+			SocketTransport& transport = *pTransport;
+			HttpClient client(std::move(pTransport));
+			std::mutex mutex;
+			std::condition_variable cv;
+			size_t nOutstanding = 0, nFailed = 0;
+			BenchLatencies latencies;
+			unsigned long long nAllocations = BenchAllocations();
+			unsigned long long nBodyAllocations = ResponseBuffer::stats().nHeapAllocations;
+			BenchTimer timer;
+			for (const std::wstring& strUrl : vecUrls) {
+				{
+					std::unique_lock lock(mutex);
+					cv.wait(lock, [&] { return nOutstanding < WINDOW; });
+					nOutstanding++;
+				}
+				auto tmStart = std::chrono::steady_clock::now();
+				client.Get(strUrl, [&, tmStart](int nStatus, ResponseBuffer buffer, const HttpCacheInfo&) {
+					long long nNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - tmStart).count();
+					std::lock_guard lock(mutex);
+					latencies.Record(nNs);
+					if (nStatus != 0 || buffer.size() != options.szBody) {
+						nFailed++;
+					}
+					nOutstanding--;
+					cv.notify_all();
+				});
+			}
+			{
+				std::unique_lock lock(mutex);
+				cv.wait(lock, [&] { return nOutstanding == 0; });
+			}
+			double dNs = (double)timer.ElapsedNs();
+			SocketTransport::Stats stats = transport.stats();
+			BenchReport("http", std::format("conn{}/pipeline{}", nConnections, nDepth))
+				.Add("tiles_per_s", nTiles / (dNs / 1e9))
+				.Add("failed", (double)nFailed)
+				.Add("connections", (double)stats.nConnectionsOpened)
+				.Add("pipelined_share", (double)stats.nRequestsPipelined / std::max<unsigned long long>(stats.nRequestsSent, 1))
+				.Add("allocs_per_tile", (double)(BenchAllocations() - nAllocations) / nTiles)
+				.Add("body_allocs_per_tile", (double)(ResponseBuffer::stats().nHeapAllocations - nBodyAllocations) / nTiles)
+				.AddPercentiles("latency", latencies);
+		}
+	}
+}
+
+BENCH(http_cancel)
+{
+	// none due while the bench runs
+	size_t nRequests = context.Iterations(20000);
+	HttpClient client(std::make_unique<FakeTransport>(60 * 60 * 1000));
+	std::vector<HttpClient::RequestId> vecIds;
+	for (size_t n = 0; n < nRequests; n++) {
+		vecIds.push_back(client.Get(std::format(L"http://tiles.test/{}", n), [](int, ResponseBuffer, const HttpCacheInfo&) {}));
+	}
+	BenchTimer timer;
+	for (HttpClient::RequestId id : vecIds) {
+		client.Cancel(id);
+	}
+	double dNs = (double)timer.ElapsedNs();
+	BenchReport("http", std::format("cancel/{}", nRequests))
+		.Add("ns_per_cancel", dNs / nRequests);
+}
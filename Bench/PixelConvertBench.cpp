@@ -0,0 +1,69 @@
+// PixelConvertBench.cpp: pixel conversion throughput of every format at every SIMD level,
+// converting a whole 256x256 tile at a time, as decoders do
+
+#include "Bench.h"
+#include "PixelConvert.h"
+
+static const char* FormatName(PixelSourceFormat format)
+{
+	switch (format) {
+	case PSF_GRAY8: return "gray8";
+	case PSF_INDEXED8: return "indexed8";
+	case PSF_RGB24: return "rgb24";
+	case PSF_BGR24: return "bgr24";
+	case PSF_RGBA32: return "rgba32";
+	case PSF_BGRA32: return "bgra32";
+	case PSF_BGRX32: return "bgrx32";
+	default: return "pbgra32";
+	}
+}
+
+static const char* LevelName(SimdLevel level)
+{
+	switch (level) {
+	case SIMD_SSE2: return "sse2";
+	case SIMD_AVX2: return "avx2";
+	default: return "scalar";
+	}
+}
+
+BENCH(pixelconvert)
+{
+	const size_t nPixels = 256 * 256;
+	std::mt19937 random(1);
+	std::vector<BYTE> vecSrc(nPixels * 4);
+	for (BYTE& b : vecSrc) {
+		// mostly opaque, as tiles are, with some translucent pixels to go through the slow path
+		b = (BYTE)random();
+	}
+	for (size_t n = 3; n < vecSrc.size(); n += 4) {
+		vecSrc[n] = random() % 8 ? 255 : vecSrc[n];
+	}
+	std::vector<UINT32> vecPalette(256), vecDst(nPixels);
+	for (UINT32& nColor : vecPalette) {
+		nColor = PremultiplyColor((UINT32)random());
+	}
+
+	SimdLevel best = GetSimdLevel();
+	size_t nTiles = context.Iterations(2000);
+	for (int nLevel = SIMD_SCALAR; nLevel <= best; nLevel++) {
+		SetSimdLevel((SimdLevel)nLevel);
+		for (PixelSourceFormat format : { PSF_GRAY8, PSF_INDEXED8, PSF_RGB24, PSF_BGR24, PSF_RGBA32, PSF_BGRA32, PSF_BGRX32, PSF_PBGRA32 }) {
+			// warm up caches first
+			ConvertToPBGRA(format, vecSrc.data(), vecDst.data(), nPixels, vecPalette.data());
+			BenchLatencies latencies;
+			BenchTimer timer;
+			for (size_t n = 0; n < nTiles; n++) {
+				BenchTimer tileTimer;
+				ConvertToPBGRA(format, vecSrc.data(), vecDst.data(), nPixels, vecPalette.data());
+				BenchKeep(vecDst);
+				latencies.Record(tileTimer.ElapsedNs());
+			}
+			double dNs = (double)timer.ElapsedNs();
+			BenchReport("pixelconvert", std::format("{}/{}", FormatName(format), LevelName((SimdLevel)nLevel)))
+				.Add("pixels_per_ns", nPixels * nTiles / dNs)
+				.AddPercentiles("tile", latencies);
+		}
+	}
+	SetSimdLevel(best);
+}
@@ -0,0 +1,61 @@
+// ProjectionBench.cpp: throughput of batch projection, lat/lng to Mercator (done once per loaded
+// track point) and Mercator to screen (done for every visible point on every frame), at every SIMD level
+
+#include "Bench.h"
+#include "PixelConvert.h"
+#include "Projection.h"
+
+static const char* LevelName(SimdLevel level)
+{
+	switch (level) {
+	case SIMD_SSE2: return "sse2";
+	case SIMD_AVX2: return "avx2";
+	default: return "scalar";
+	}
+}
+
+BENCH(projection)
+{
+	// a long track's worth of points, in a few batches as TrackLoader delivers them
+	const size_t nPoints = 1 << 16;
+	std::mt19937_64 random(5);
+	std::uniform_real_distribution<double> lat(-85.0, 85.0), lng(-180.0, 180.0);
+	std::vector<double> vecLat(nPoints), vecLng(nPoints);
+	for (size_t n = 0; n < nPoints; n++) {
+		vecLat[n] = lat(random);
+		vecLng[n] = lng(random);
+	}
+	std::vector<MercatorPoint> vecPoints(nPoints);
+	std::vector<D2D1_POINT_2F> vecScreen(nPoints);
+	double dScale = WorldSize(12, 256);
+
+	SimdLevel best = GetSimdLevel();
+	size_t nRounds = context.Iterations(200);
+	for (int nLevel = SIMD_SCALAR; nLevel <= best; nLevel++) {
+		SetSimdLevel((SimdLevel)nLevel);
+		BenchLatencies latencies;
+		BenchTimer timer;
+		for (size_t n = 0; n < nRounds; n++) {
+			BenchTimer batchTimer;
+			LatLngToMercatorBatch(vecLat.data(), vecLng.data(), vecPoints.data(), nPoints);
+			BenchKeep(vecPoints);
+			latencies.Record(batchTimer.ElapsedNs());
+		}
+		BenchReport("projection", std::format("latlng_to_mercator/{}", LevelName((SimdLevel)nLevel)))
+			.Add("points_per_ns", nPoints * nRounds / (double)timer.ElapsedNs())
+			.AddPercentiles("batch", latencies);
+
+		BenchLatencies screenLatencies;
+		BenchTimer screenTimer;
+		for (size_t n = 0; n < nRounds * 10; n++) {
+			BenchTimer batchTimer;
+			MercatorToScreenBatch(vecPoints.data(), vecScreen.data(), nPoints, dScale, dScale * 0.5, dScale * 0.5);
+			BenchKeep(vecScreen);
+			screenLatencies.Record(batchTimer.ElapsedNs());
+		}
+		BenchReport("projection", std::format("mercator_to_screen/{}", LevelName((SimdLevel)nLevel)))
+			.Add("points_per_ns", nPoints * nRounds * 10 / (double)screenTimer.ElapsedNs())
+			.AddPercentiles("batch", screenLatencies);
+	}
+	SetSimdLevel(best);
+}
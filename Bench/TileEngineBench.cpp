@@ -0,0 +1,360 @@
+// TileEngineBench.cpp: the tile engine as MapWindow drives it, frame by frame, on scripted
+// workloads: continuous panning, a zoom sweep from 0 to 18 and back, window resizes, and panning
+// fast with a memory budget far too small for it (cache thrash).  Each frame does what a mouse
+// move does in MapWindow: CalculateView(), TileManager::UpdateView() and PrefetchView(), then
+// ProcessCompletions() and looks up every visible tile, with a fallback ancestor for those not
+// ready, as drawing would.  Below TileManager are the real TileScheduler, HttpClient, TileCache
+// (in a temporary directory) and DecodePool, but tiles come from FakeTransport, with no latency,
+// and are "decoded" by FakeDecoder, so this measures the engine itself rather than the network
+// or PNG decoding.  Frames are run FRAME_PACING_MS apart, eight times as fast as they would come
+// while dragging the map, which leaves the workers some time to load tiles, but not enough to
+// keep up with everything: how many of the visible tiles were ready shows how far behind they
+// are.  Frames per second is the inverse of the time frames themselves take, not counting the
+// time between them; allocations per frame count the worker threads' too, which download, cache
+// and decode the tiles requested meanwhile
+
+#include "Bench.h"
+#include "FakeTransport.h"
+#include "HttpClient.h"
+#include "TileCache.h"
+#include "DecodePool.h"
+#include "TileManager.h"
+#include "Projection.h"
+
+#include <filesystem>
+#include <random>
+
+static const unsigned TILE_SIZE = 256;
+static const unsigned MAX_ZOOM = 18;
+// as in MapWindow: frames are 16 ms apart, and the view is prefetched where it will be in 750 ms,
+// up to 3 tiles away
+static const double FRAME_MS = 16;
+static const double PREFETCH_LOOKAHEAD_MS = 750;
+static const int PREFETCH_MAX_TILES = 3;
+static const unsigned FRAME_PACING_MS = 2;
+
+// what the window shows in one frame
+struct Frame
+{
+	MercatorPoint ptCenter;
+	unsigned nZoom;
+	unsigned nWidth, nHeight;
+};
+
+// pixels per frame to Mercator units at a zoom level
+static double PixelsToMercator(double dPixels, unsigned nZoom)
+{
+	return dPixels / WorldSize(nZoom, TILE_SIZE);
+}
+
+// around Prague, away from the edges of the map at any zoom level
+static const MercatorPoint START = { 0.5400, 0.3400 };
+
+static std::vector<Frame> PanScript(size_t nFrames)
+{
+	// a steady drag, diagonally
+	std::vector<Frame> vecFrames;
+	MercatorPoint pt = START;
+	for (size_t n = 0; n < nFrames; n++) {
+		vecFrames.push_back({ pt, 12, 1920, 1080 });
+		pt.x += PixelsToMercator(9, 12);
+		pt.y += PixelsToMercator(4, 12);
+	}
+	return vecFrames;
+}
+
+static std::vector<Frame> ZoomScript(size_t nFramesPerLevel)
+{
+	std::vector<Frame> vecFrames;
+	for (unsigned nZoom = 0; nZoom <= MAX_ZOOM; nZoom++) {
+		vecFrames.insert(vecFrames.end(), nFramesPerLevel, { START, nZoom, 1920, 1080 });
+	}
+	for (unsigned nZoom = MAX_ZOOM; nZoom-- > 0; ) {
+		vecFrames.insert(vecFrames.end(), nFramesPerLevel, { START, nZoom, 1920, 1080 });
+	}
+	return vecFrames;
+}
+
+static std::vector<Frame> ResizeScript(size_t nFrames)
+{
+	// dragging the window corner back and forth between 640x480 and 2560x1440, 24 px a frame
+	std::vector<Frame> vecFrames;
+	for (size_t n = 0; n < nFrames; n++) {
+		unsigned nStep = (unsigned)(n % 160);
+		unsigned nGrow = 24 * (nStep < 80 ? nStep : 160 - nStep);
+		vecFrames.push_back({ START, 14, std::min(640 + nGrow, 2560u), std::min(480 + nGrow, 1440u) });
+	}
+	return vecFrames;
+}
+
+static std::vector<Frame> ThrashScript(size_t nFrames)
+{
+	// flinging the map around, a screen width every few frames, so that tiles are evicted long
+	// before they would be seen again
+	std::vector<Frame> vecFrames;
+	MercatorPoint pt = START;
+	for (size_t n = 0; n < nFrames; n++) {
+		vecFrames.push_back({ pt, 13, 1920, 1080 });
+		double dDirection = (n / 64 % 2) ? -1 : 1;
+		pt.x += dDirection * PixelsToMercator(600, 13);
+		pt.y += PixelsToMercator(50, 13);
+	}
+	return vecFrames;
+}
+
+static void RunScript(const char* pszCase, const std::vector<Frame>& vecFrames, size_t szMemoryBudget)
+{
+	std::filesystem::path cacheDirectory = std::filesystem::path(BenchTempDirectory()) / pszCase;
+	std::filesystem::create_directories(cacheDirectory);
+	auto pTransport = std::make_unique<FakeTransport>();
+	FakeTransport& transport = *pTransport;
+	HttpClient httpClient(std::move(pTransport));
+	TileCache tileCache(cacheDirectory.wstring(), 64 * 1024 * 1024);
+	DecodePool decodePool;
+	unsigned long long nLoaded = 0;
+	TileManager tileManager(httpClient, tileCache, decodePool, L"http://tiles.invalid", TILE_SIZE,
+		[&](Tile&) { nLoaded++; }, [] {});
+	tileManager.SetDecoder(std::make_unique<FakeDecoder>(TILE_SIZE));
+	tileManager.SetKeepPixels(true);
+	tileManager.SetMemoryBudget(szMemoryBudget);
+	tileManager.SetPrefetchBudget(TileManager::DEFAULT_PREFETCH_MAX_REQUESTS, szMemoryBudget / 4 * 3,
+		TileScheduler::DEFAULT_PREFETCH_RING, TileScheduler::DEFAULT_MAX_PREFETCH_IN_FLIGHT);
+
+	BenchLatencies latencies;
+	size_t nLookups = 0, nReady = 0, nFallbacks = 0;
+	Frame previous = vecFrames.front();
+	unsigned long long nAllocations = BenchAllocations();
+	long long nBusyNs = 0;
+	auto tmNextFrame = std::chrono::steady_clock::now();
+	for (const Frame& frame : vecFrames) {
+		std::this_thread::sleep_until(tmNextFrame);
+		tmNextFrame += std::chrono::milliseconds(FRAME_PACING_MS);
+		BenchTimer frameTimer;
+		MapView view = CalculateView(frame.ptCenter, frame.nZoom, TILE_SIZE, frame.nWidth, frame.nHeight);
+		tileManager.UpdateView(frame.nZoom, view.nTopLeftX, view.nTopLeftY, view.nWidthInTiles, view.nHeightInTiles);
+
+		// where the view is heading, as MapWindow::PrefetchTiles() works it out from mouse velocity
+		int nShiftX = 0, nShiftY = 0;
+		if (frame.nZoom == previous.nZoom) {
+			double dWorldSize = WorldSize(frame.nZoom, TILE_SIZE), dScale = PREFETCH_LOOKAHEAD_MS / FRAME_MS / TILE_SIZE;
+			nShiftX = std::clamp((int)std::lround((frame.ptCenter.x - previous.ptCenter.x) * dWorldSize * dScale), -PREFETCH_MAX_TILES, PREFETCH_MAX_TILES);
+			nShiftY = std::clamp((int)std::lround((frame.ptCenter.y - previous.ptCenter.y) * dWorldSize * dScale), -PREFETCH_MAX_TILES, PREFETCH_MAX_TILES);
+		}
+		tileManager.PrefetchView(frame.nZoom, view.nTopLeftX, view.nTopLeftY, view.nWidthInTiles, view.nHeightInTiles,
+			nShiftX, nShiftY, MAX_ZOOM);
+		tileManager.ProcessCompletions();
+
+		// drawing: every visible tile, or what there is of it a few levels up
+		unsigned nTiles = 1u << frame.nZoom;
+		for (unsigned y = view.nTopLeftY; y <= std::min(view.nTopLeftY + view.nHeightInTiles, nTiles - 1); y++) {
+			for (unsigned x = view.nTopLeftX; x <= std::min(view.nTopLeftX + view.nWidthInTiles, nTiles - 1); x++) {
+				nLookups++;
+				Tile* pTile = tileManager.GetTile({ x, y, frame.nZoom });
+				if (pTile && pTile->state() == TS_READY) {
+					nReady++;
+					continue;
+				}
+				unsigned nLevels;
+				if (tileManager.GetReadyAncestor({ x, y, frame.nZoom }, 4, nLevels)) {
+					nFallbacks++;
+				}
+			}
+		}
+		long long nFrameNs = frameTimer.ElapsedNs();
+		latencies.Record(nFrameNs);
+		nBusyNs += nFrameNs;
+		previous = frame;
+	}
+	unsigned long long nAllocated = BenchAllocations() - nAllocations;
+
+	TileManager::Stats stats = tileManager.stats();
+	BenchReport("tileengine", pszCase)
+		.Add("frames_per_s", vecFrames.size() / (nBusyNs / 1e9))
+		.Add("allocs_per_frame", (double)nAllocated / vecFrames.size())
+		.AddPercentiles("frame", latencies)
+		.Add("ready_share", (double)nReady / std::max<size_t>(nLookups, 1))
+		.Add("fallback_share", (double)nFallbacks / std::max<size_t>(nLookups, 1))
+		.Add("tiles_loaded", (double)nLoaded)
+		.Add("requests", (double)transport.requestsStarted())
+		.Add("evictions", (double)stats.nEvictions)
+		.Add("prefetch_hit_share", (double)stats.nPrefetchHits / std::max<unsigned long long>(stats.nPrefetchIssued, 1))
+		.Add("prefetch_wasted", (double)stats.nPrefetchWasted);
+	tileManager.Shutdown();
+}
+
+BENCH(tileengine)
+{
+	RunScript("pan", PanScript(context.Iterations(1500)), TileManager::DEFAULT_MEMORY_BUDGET);
+	RunScript("zoom", ZoomScript(context.bQuick ? 1 : 20), TileManager::DEFAULT_MEMORY_BUDGET);
+	RunScript("resize", ResizeScript(context.Iterations(1500)), TileManager::DEFAULT_MEMORY_BUDGET);
+	// room for about 1.5 screens of tiles
+	RunScript("thrash", ThrashScript(context.Iterations(1500)), 80 * TILE_SIZE * TILE_SIZE * 4);
+}
+
+// TileManager's tile index (see TileMap.h) at 10k+ resident tiles: lookups of tiles which are
+// there, as drawing does, and of tiles which are not, with their ready ancestors as fallbacks;
+// then trimming, both the common case of being within budget, where it is a single comparison,
+// and evicting half of the tiles through the LRU list.  Tiles are loaded for real, through the
+// fakes, but decoded to a tiny image, so that all of them fit into memory.  Last, the index on
+// its own, the same lookups in a TileMap, and, for comparison, in what it replaced: a std::map
+// by key, and before that a std::map by tile URL, which was formatted for every lookup
+BENCH(tileindex)
+{
+	// 128x128 tiles at zoom 10, or 16x16 for a quick run
+	static const unsigned ZOOM = 10;
+	unsigned nSide = context.bQuick ? 16 : 128;
+	std::filesystem::path cacheDirectory = std::filesystem::path(BenchTempDirectory()) / "tileindex";
+	std::filesystem::create_directories(cacheDirectory);
+	HttpClient httpClient(std::make_unique<FakeTransport>());
+	TileCache tileCache(cacheDirectory.wstring(), 64 * 1024 * 1024);
+	DecodePool decodePool;
+	size_t nLoaded = 0;
+	TileManager tileManager(httpClient, tileCache, decodePool, L"http://tiles.invalid", TILE_SIZE, [&](Tile&) { nLoaded++; }, [] {});
+	tileManager.SetDecoder(std::make_unique<FakeDecoder>(4));
+	tileManager.SetKeepPixels(true);
+	tileManager.UpdateView(ZOOM, 0, 0, nSide - 1, nSide - 1);
+	size_t nTiles = (size_t)nSide * nSide;
+	while (nLoaded < nTiles) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		tileManager.ProcessCompletions();
+	}
+
+	std::mt19937 random(25);
+	std::uniform_int_distribution<unsigned> coord(0, nSide - 1);
+	size_t nLookups = context.Iterations(4000000);
+	std::vector<TileCoords> vecHits, vecMisses;
+	for (size_t n = 0; n < 4096; n++) {
+		vecHits.emplace_back(coord(random), coord(random), ZOOM);
+		// two levels down from resident tiles, so the ancestor is found on the second try
+		vecMisses.emplace_back(coord(random) * 4 + 1, coord(random) * 4 + 2, ZOOM + 2);
+	}
+	{
+		size_t nFound = 0;
+		unsigned long long nAllocations = BenchAllocations();
+		BenchTimer timer;
+		for (size_t n = 0; n < nLookups; n++) {
+			nFound += tileManager.GetTile(vecHits[n % vecHits.size()]) != nullptr;
+		}
+		double dNs = (double)timer.ElapsedNs();
+		BenchReport("tileindex", "lookup/hit")
+			.Add("tiles", (double)nTiles)
+			.Add("ns_per_lookup", dNs / nLookups)
+			.Add("allocs_per_lookup", (double)(BenchAllocations() - nAllocations) / nLookups)
+			.Add("found_share", (double)nFound / nLookups);
+	}
+	{
+		size_t nFound = 0;
+		unsigned long long nAllocations = BenchAllocations();
+		BenchTimer timer;
+		for (size_t n = 0; n < nLookups; n++) {
+			TileCoords coords = vecMisses[n % vecMisses.size()];
+			unsigned nLevels;
+			if (!tileManager.GetTile(coords) && tileManager.GetReadyAncestor(coords, 4, nLevels)) {
+				nFound++;
+			}
+		}
+		double dNs = (double)timer.ElapsedNs();
+		BenchReport("tileindex", "lookup/ancestor")
+			.Add("tiles", (double)nTiles)
+			.Add("ns_per_lookup", dNs / nLookups)
+			.Add("allocs_per_lookup", (double)(BenchAllocations() - nAllocations) / nLookups)
+			.Add("found_share", (double)nFound / nLookups);
+	}
+
+	// the view moved far away, so nothing is protected
+	size_t szBytes = tileManager.stats().szBytes;
+	tileManager.SetMemoryBudget(szBytes);
+	{
+		size_t nTrims = context.Iterations(4000000);
+		BenchTimer timer;
+		for (size_t n = 0; n < nTrims; n++) {
+			tileManager.TrimTiles(ZOOM, 1000, 1000, 7, 4);
+		}
+		BenchReport("tileindex", "trim/within_budget").Add("ns_per_trim", (double)timer.ElapsedNs() / nTrims);
+	}
+	tileManager.SetMemoryBudget(szBytes / 2);
+	unsigned long long nEvictions = tileManager.stats().nEvictions;
+	unsigned long long nAllocations = BenchAllocations();
+	BenchTimer timer;
+	tileManager.TrimTiles(ZOOM, 1000, 1000, 7, 4);
+	double dNs = (double)timer.ElapsedNs();
+	nEvictions = tileManager.stats().nEvictions - nEvictions;
+	BenchReport("tileindex", "trim/evict_half")
+		.Add("tiles", (double)nTiles)
+		.Add("evicted", (double)nEvictions)
+		.Add("ns_per_eviction", dNs / std::max<unsigned long long>(nEvictions, 1))
+		.Add("allocs", (double)(BenchAllocations() - nAllocations));
+	tileManager.Shutdown();
+
+	TileMap<TileCoords> tileMap;
+	std::map<TileKey, TileCoords> mapKeys;
+	std::map<std::wstring, TileCoords> mapUrls;
+	auto url = [](TileCoords coords) { return std::format(L"http://tiles.invalid/{}/{}/{}.png", coords.zoom, coords.x, coords.y); };
+	for (unsigned y = 0; y < nSide; y++) {
+		for (unsigned x = 0; x < nSide; x++) {
+			TileCoords coords(x, y, ZOOM);
+			tileMap.TryEmplace(coords.key(), coords);
+			mapKeys.try_emplace(coords.key(), coords);
+			mapUrls.try_emplace(url(coords), coords);
+		}
+	}
+	auto lookups = [&](const char* pszCase, auto fnFind) {
+		size_t nFound = 0;
+		BenchTimer timer;
+		for (size_t n = 0; n < nLookups; n++) {
+			nFound += fnFind(vecHits[n % vecHits.size()]);
+		}
+		BenchKeep(nFound);
+		BenchReport("tileindex", pszCase)
+			.Add("tiles", (double)nTiles)
+			.Add("ns_per_lookup", (double)timer.ElapsedNs() / nLookups);
+	};
+	lookups("index/tilemap", [&](TileCoords coords) { return tileMap.Find(coords.key()) != nullptr; });
+	lookups("index/map_by_key", [&](TileCoords coords) { return mapKeys.find(coords.key()) != mapKeys.end(); });
+	lookups("index/map_by_url", [&](TileCoords coords) { return mapUrls.find(url(coords)) != mapUrls.end(); });
+}
+
+// MpscQueue on its own, as TileManager uses it: decode threads post completions, the UI thread
+// drains them all at once
+BENCH(mpscqueue)
+{
+	for (unsigned nProducers : { 1u, 4u }) {
+		size_t nItems = context.Iterations(2000000) / nProducers * nProducers;
+		MpscQueue<size_t> queue;
+		std::atomic<bool> bStart = false;
+		std::vector<std::thread> vecProducers;
+		for (unsigned n = 0; n < nProducers; n++) {
+			vecProducers.emplace_back([&] {
+				while (!bStart) {
+				}
+				for (size_t nItem = 0; nItem < nItems / nProducers; nItem++) {
+					queue.Push(nItem);
+				}
+			});
+		}
+		BenchLatencies latencies;
+		size_t nDrained = 0, nDrains = 0, nSum = 0;
+		unsigned long long nAllocations = BenchAllocations();
+		BenchTimer timer;
+		bStart = true;
+		while (nDrained < nItems) {
+			BenchTimer drainTimer;
+			size_t n = queue.Drain([&](size_t& nItem) { nSum += nItem; });
+			if (n) {
+				latencies.Record(drainTimer.ElapsedNs());
+				nDrained += n;
+				nDrains++;
+			}
+		}
+		double dNs = (double)timer.ElapsedNs();
+		for (std::thread& thread : vecProducers) {
+			thread.join();
+		}
+		BenchKeep(nSum);
+		BenchReport("mpscqueue", std::format("producers{}", nProducers))
+			.Add("items_per_s", nItems / (dNs / 1e9))
+			.Add("allocs_per_item", (double)(BenchAllocations() - nAllocations) / nItems)
+			.Add("items_per_drain", (double)nItems / std::max<size_t>(nDrains, 1))
+			.AddPercentiles("drain", latencies);
+	}
+}
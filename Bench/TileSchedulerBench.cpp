@@ -0,0 +1,86 @@
+// TileSchedulerBench.cpp: time to full screen (TileScheduler::Stats::nLastTimeToFullScreenMs),
+// the time from a zoom change until all visible tiles are loaded, over FakeTransport with a fixed
+// latency.  Each zoom change queues the visible tiles of a 1920x1080 window, and then either
+// nothing else, or also the ring around them, the covering tiles at the adjacent zoom levels and
+// prefetch requests further out, queued first, as they would be left over from before.  With
+// prioritizing working, the extra requests shouldn't make it take longer; the best it can do is
+// the latency times the number of rounds of DEFAULT_MAX_IN_FLIGHT requests the visible tiles take,
+// reported as ideal_ms
+
+#include "Bench.h"
+#include "FakeTransport.h"
+#include "HttpClient.h"
+#include "TileScheduler.h"
+
+// a 1920x1080 window in 256 px tiles, as TileManager passes it: the last column and row are
+// partly visible
+static const unsigned VIEW_WIDTH = 7, VIEW_HEIGHT = 4;
+
+BENCH(tilescheduler)
+{
+	unsigned nLatencyMs = context.bQuick ? 1 : 20;
+	size_t nZoomChanges = context.Iterations(50000) / 1000 + 1;
+	for (bool bExtra : { false, true }) {
+		HttpClient httpClient(std::make_unique<FakeTransport>(nLatencyMs));
+		TileScheduler scheduler(httpClient, [](TileCoords coords, unsigned) {
+			return std::format(L"http://tiles.invalid/{}/{}/{}.png", coords.zoom, coords.x, coords.y);
+		});
+		std::mutex mutex;
+		std::condition_variable cv;
+		size_t nVisibleLeft = 0;
+		auto fnVisible = [&](int, ResponseBuffer, const HttpCacheInfo&) {
+			std::lock_guard lock(mutex);
+			nVisibleLeft--;
+			cv.notify_all();
+		};
+		auto fnOther = [](int, ResponseBuffer, const HttpCacheInfo&) {};
+
+		BenchLatencies latencies;
+		for (size_t n = 0; n < nZoomChanges; n++) {
+			// somewhere else each time, zooming in and out
+			unsigned zoom = 12 + n % 2, x0 = 1000 + (unsigned)n * 20, y0 = 1000;
+			scheduler.SetView(zoom, x0, y0, VIEW_WIDTH, VIEW_HEIGHT);
+			if (bExtra) {
+				for (unsigned y = y0 - 4; y <= y0 + VIEW_HEIGHT + 4; y++) {
+					for (unsigned x = x0 - 4; x <= x0 + VIEW_WIDTH + 4; x++) {
+						bool bVisible = x >= x0 && x <= x0 + VIEW_WIDTH && y >= y0 && y <= y0 + VIEW_HEIGHT;
+						if (!bVisible) {
+							bool bRing = x + 1 >= x0 && x <= x0 + VIEW_WIDTH + 1 && y + 1 >= y0 && y <= y0 + VIEW_HEIGHT + 1;
+							scheduler.Request({ x, y, zoom }, 0, fnOther, false, !bRing);
+						}
+					}
+				}
+				for (unsigned y = y0 / 2; y <= (y0 + VIEW_HEIGHT) / 2; y++) {
+					for (unsigned x = x0 / 2; x <= (x0 + VIEW_WIDTH) / 2; x++) {
+						scheduler.Request({ x, y, zoom - 1 }, 0, fnOther, false);
+					}
+				}
+			}
+			{
+				std::lock_guard lock(mutex);
+				nVisibleLeft = (VIEW_WIDTH + 1) * (VIEW_HEIGHT + 1);
+			}
+			for (unsigned y = y0; y <= y0 + VIEW_HEIGHT; y++) {
+				for (unsigned x = x0; x <= x0 + VIEW_WIDTH; x++) {
+					scheduler.Request({ x, y, zoom }, 0, fnVisible, false);
+				}
+			}
+			scheduler.Dispatch();
+			{
+				std::unique_lock lock(mutex);
+				cv.wait(lock, [&] { return nVisibleLeft == 0; });
+			}
+			// the scheduler notices right after the last callback returns; make sure it has
+			scheduler.Dispatch();
+			latencies.Record((long long)scheduler.stats().nLastTimeToFullScreenMs * 1000000);
+		}
+		scheduler.CancelAll();
+
+		unsigned nRounds = ((VIEW_WIDTH + 1) * (VIEW_HEIGHT + 1) + TileScheduler::DEFAULT_MAX_IN_FLIGHT - 1) / TileScheduler::DEFAULT_MAX_IN_FLIGHT;
+		BenchReport("tilescheduler", bExtra ? "with_ring_and_prefetch" : "visible_only")
+			.Add("latency_ms", nLatencyMs)
+			.Add("ideal_ms", (double)nRounds * nLatencyMs)
+			.Add("time_to_full_screen_p50_ms", latencies.Percentile(50) / 1e6)
+			.Add("time_to_full_screen_max_ms", latencies.Percentile(100) / 1e6);
+	}
+}
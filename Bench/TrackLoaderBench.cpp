@@ -0,0 +1,64 @@
+// TrackLoaderBench.cpp: LoadTracks() throughput on synthetic GPX and GeoJSON files, recorded
+// tracks with 7-decimal coordinates as GPS devices write them (GPX with elevation and time per
+// point), parsed on one thread and on all of them.  Reports MB/s and ns per point
+
+#include "Bench.h"
+#include "TrackLoader.h"
+
+static std::string MakeFile(bool bGpx, size_t szSize)
+{
+	std::mt19937 random(1);
+	std::string str;
+	str.reserve(szSize + 4096);
+	str += bGpx ? "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<gpx version=\"1.1\" creator=\"bench\">\n" :
+		"{\"type\":\"FeatureCollection\",\"features\":[\n";
+	double dLat = 50.08, dLng = 14.42;
+	for (unsigned nTrack = 0; str.size() < szSize; nTrack++) {
+		str += bGpx ? "<trk><name>track</name><trkseg>\n" : nTrack ?
+			",{\"type\":\"Feature\",\"properties\":{},\"geometry\":{\"type\":\"LineString\",\"coordinates\":[" :
+			"{\"type\":\"Feature\",\"properties\":{},\"geometry\":{\"type\":\"LineString\",\"coordinates\":[";
+		for (unsigned n = 0; n < 5000; n++) {
+			dLat += ((int)(random() % 201) - 100) * 1e-6;
+			dLng += ((int)(random() % 201) - 100) * 1e-6;
+			if (bGpx) {
+				str += std::format("  <trkpt lat=\"{:.7f}\" lon=\"{:.7f}\">\n    <ele>{:.1f}</ele>\n"
+					"    <time>2024-06-01T10:{:02}:{:02}Z</time>\n  </trkpt>\n",
+					dLat, dLng, 200 + (random() % 4000) / 10.0, n / 60 % 60, n % 60);
+			} else {
+				str += std::format("{}[{:.7f},{:.7f}]", n ? "," : "", dLng, dLat);
+			}
+		}
+		str += bGpx ? "</trkseg></trk>\n" : "]}}\n";
+	}
+	str += bGpx ? "</gpx>\n" : "]}\n";
+	return str;
+}
+
+BENCH(trackloader)
+{
+	size_t szSize = context.bQuick ? 1024 * 1024 : 128 * 1024 * 1024;
+	unsigned nRuns = context.bQuick ? 1 : 5;
+	std::vector<unsigned> vecThreads = { 1 };
+	if (std::thread::hardware_concurrency() > 1) {
+		vecThreads.push_back(std::thread::hardware_concurrency());
+	}
+	for (bool bGpx : { true, false }) {
+		std::string str = MakeFile(bGpx, szSize);
+		for (unsigned nThreads : vecThreads) {
+			TrackData data;
+			BenchLatencies latencies;
+			for (unsigned n = 0; n < nRuns; n++) {
+				BenchTimer timer;
+				LoadTracks(str.data(), str.size(), data, nThreads);
+				BenchKeep(data);
+				latencies.Record(timer.ElapsedNs());
+			}
+			double dNs = latencies.Percentile(50);
+			BenchReport("trackloader", std::format("{}/{}threads", bGpx ? "gpx" : "geojson", nThreads))
+				.Add("mb", str.size() / 1e6)
+				.Add("points", (double)data.vecLat.size())
+				.Add("mb_per_s", str.size() / dNs * 1e3)
+				.Add("ns_per_point", dNs / data.vecLat.size());
+		}
+	}
+}
@@ -0,0 +1,120 @@
+// TrackOverlayBench.cpp: TrackOverlay with a million points of synthetic GPS tracks (random walks
+// with a few meters between points, as recorded once a second while cycling, all over a region
+// some 60 km across).  Reports how long adding them takes and how much memory the
+// simplified levels and tile indexes need per million points; then, at a few zoom levels, the
+// cost of culling (UpdateView()) and drawing (Draw()) per frame while panning across the tracks.
+// Drawing goes to a canvas which only counts what it is given, which is the overlay's own cost,
+// and to a full HD SoftwareCanvas, which is what rasterizing the lines adds on the CPU
+
+#include "Bench.h"
+#include "TrackOverlay.h"
+#include "SoftwareCanvas.h"
+
+#include <random>
+
+// takes polylines and does nothing with them but count
+class CountingCanvas : public Canvas
+{
+public:
+	D2D1_SIZE_F size() override { return D2D1::SizeF(1920, 1080); }
+	float dpiScale() override { return 1.f; }
+	void DrawTile(const Tile&, const D2D1_RECT_F&, const D2D1_RECT_F*) override {}
+	void FillRectangle(const D2D1_RECT_F&, const D2D1_COLOR_F&) override {}
+	void DrawLine(D2D1_POINT_2F, D2D1_POINT_2F, const D2D1_COLOR_F&, float) override { nPoints += 2; }
+	void DrawPolyline(const D2D1_POINT_2F* pPoints, size_t nCount, const D2D1_COLOR_F&, float) override
+	{
+		nPolylines++;
+		nPoints += nCount;
+		BenchKeep(pPoints[nCount - 1]);
+	}
+
+	size_t nPolylines = 0, nPoints = 0;
+};
+
+static const unsigned TILE_SIZE = 256;
+// a region about 60 km across, around Prague
+static const MercatorPoint REGION_CENTER = { 0.5400, 0.3400 };
+static const double REGION_SIZE = 0.0025;
+
+// random walks with some inertia, nPoints in all, in tracks of 5000 points on average
+static std::vector<std::vector<MercatorPoint>> MakeTracks(size_t nPoints)
+{
+	std::mt19937_64 random(14);
+	std::uniform_real_distribution<double> start(-REGION_SIZE / 2, REGION_SIZE / 2), turn(-.3, .3);
+	std::uniform_int_distribution<size_t> length(1000, 9000);
+	// about 5 m per step, in Mercator units at this latitude
+	const double STEP = 5.0 / 40075000 / std::cos(50 * 3.14159265358979 / 180);
+	std::vector<std::vector<MercatorPoint>> vecTracks;
+	size_t nTotal = 0;
+	while (nTotal < nPoints) {
+		std::vector<MercatorPoint> vecTrack(std::min(length(random), nPoints - nTotal));
+		MercatorPoint pt = { REGION_CENTER.x + start(random), REGION_CENTER.y + start(random) };
+		double dHeading = turn(random) * 10;
+		for (MercatorPoint& point : vecTrack) {
+			point = pt;
+			dHeading += turn(random);
+			pt.x += STEP * std::cos(dHeading);
+			pt.y += STEP * std::sin(dHeading);
+		}
+		nTotal += vecTrack.size();
+		vecTracks.push_back(std::move(vecTrack));
+	}
+	return vecTracks;
+}
+
+BENCH(trackoverlay)
+{
+	size_t nPoints = context.bQuick ? 20000 : 1000000;
+	std::vector<std::vector<MercatorPoint>> vecTracks = MakeTracks(nPoints);
+
+	TrackOverlay overlay(TILE_SIZE);
+	unsigned long long nAllocations = BenchAllocations();
+	BenchTimer timer;
+	for (const std::vector<MercatorPoint>& vecTrack : vecTracks) {
+		overlay.AddTrack(vecTrack.data(), vecTrack.size());
+	}
+	double dNs = (double)timer.ElapsedNs();
+	TrackOverlay::Stats stats = overlay.stats();
+	BenchReport("trackoverlay", "build")
+		.Add("points", (double)nPoints)
+		.Add("tracks", (double)vecTracks.size())
+		.Add("ns_per_point", dNs / nPoints)
+		.Add("mb_per_million_points", stats.szBytes / 1e6 * (1e6 / nPoints))
+		.Add("allocs_per_point", (double)(BenchAllocations() - nAllocations) / nPoints);
+
+	// panning diagonally across the whole region in full HD, the same frames at each zoom level
+	static const unsigned WIDTH = 1920, HEIGHT = 1080;
+	size_t nFrames = context.Iterations(400);
+	for (unsigned nZoom : { 6u, 10u, 13u, 16u }) {
+		double dWorldSize = WorldSize(nZoom, TILE_SIZE);
+		BenchLatencies cull, draw, software;
+		CountingCanvas counter;
+		SoftwareCanvas canvas(WIDTH, HEIGHT);
+		nAllocations = BenchAllocations();
+		for (size_t nFrame = 0; nFrame < nFrames; nFrame++) {
+			double dOffset = (double)nFrame / nFrames - .5;
+			MercatorPoint ptCenter = { REGION_CENTER.x + dOffset * REGION_SIZE, REGION_CENTER.y + dOffset * REGION_SIZE / 2 };
+			MapView view = CalculateView(ptCenter, nZoom, TILE_SIZE, WIDTH, HEIGHT);
+
+			BenchTimer cullTimer;
+			overlay.UpdateView(nZoom, view.rect);
+			cull.Record(cullTimer.ElapsedNs());
+			BenchTimer drawTimer;
+			overlay.Draw(counter, dWorldSize, view.dTopLeftX, view.dTopLeftY);
+			draw.Record(drawTimer.ElapsedNs());
+			// rasterizing is slow, so only every 8th frame
+			if (nFrame % 8 == 0) {
+				BenchTimer softwareTimer;
+				overlay.Draw(canvas, dWorldSize, view.dTopLeftX, view.dTopLeftY);
+				software.Record(softwareTimer.ElapsedNs());
+			}
+		}
+		BenchReport("trackoverlay", std::format("pan/z{}", nZoom))
+			.Add("points_drawn_per_frame", (double)counter.nPoints / nFrames)
+			.Add("polylines_per_frame", (double)counter.nPolylines / nFrames)
+			.AddPercentiles("cull", cull)
+			.AddPercentiles("draw", draw)
+			.AddPercentiles("software_draw", software)
+			.Add("allocs_per_frame", (double)(BenchAllocations() - nAllocations) / nFrames);
+	}
+}
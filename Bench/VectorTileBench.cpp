@@ -0,0 +1,140 @@
+// VectorTileBench.cpp: size, decoding and drawing time of synthetic vector tiles, a dense city
+// one and a sparse countryside one, drawn at 256 and 512 pixels
+
+#include "Bench.h"
+#include "VectorTileWriter.h"
+#include "VectorTileDecoder.h"
+
+// a jagged closed ring around a center
+static std::vector<VectorPoint> Ring(std::mt19937& random, int x, int y, int nRadius, unsigned nPoints)
+{
+	std::vector<VectorPoint> vecRing;
+	for (unsigned n = 0; n < nPoints; n++) {
+		double dAngle = 2 * std::numbers::pi * n / nPoints;
+		double dRadius = nRadius * (0.7 + 0.3 * (random() % 1000) / 1000.0);
+		vecRing.push_back({ x + (int)(std::cos(dAngle) * dRadius), y + (int)(std::sin(dAngle) * dRadius) });
+	}
+	return vecRing;
+}
+
+// a wandering line, across the tile and into its buffer
+static std::vector<VectorPoint> Line(std::mt19937& random, unsigned nPoints)
+{
+	std::vector<VectorPoint> vecLine;
+	int x = (int)(random() % 4096), y = -64;
+	int dx = (int)(random() % 200) - 100;
+	for (unsigned n = 0; n < nPoints; n++) {
+		vecLine.push_back({ x, y });
+		x += dx + (int)(random() % 61) - 30;
+		y += 4224 / (int)nPoints;
+	}
+	return vecLine;
+}
+
+// small rotated quadrilaterals, like buildings
+static std::vector<VectorPoint> Building(std::mt19937& random)
+{
+	int x = (int)(random() % 4096), y = (int)(random() % 4096);
+	int w = 20 + (int)(random() % 60), h = 20 + (int)(random() % 60), s = (int)(random() % 20);
+	return { { x, y }, { x + w, y + s }, { x + w - s, y + s + h }, { x - s, y + h } };
+}
+
+static std::vector<BYTE> MakeTile(unsigned nSeed, unsigned nBuildings, unsigned nRoads, unsigned nAreas)
+{
+	std::mt19937 random(nSeed);
+	VectorTileWriter writer;
+	writer.BeginLayer("landuse");
+	for (unsigned n = 0; n < nAreas; n++) {
+		writer.AddFeature(VGT_POLYGON, { Ring(random, random() % 4096, random() % 4096, 600, 40) });
+	}
+	writer.EndLayer();
+	writer.BeginLayer("water");
+	writer.AddFeature(VGT_POLYGON, { Ring(random, 1000, 3000, 1200, 300), Ring(random, 1000, 3000, 300, 60) });
+	writer.EndLayer();
+	writer.BeginLayer("park");
+	for (unsigned n = 0; n < nAreas / 2; n++) {
+		writer.AddFeature(VGT_POLYGON, { Ring(random, random() % 4096, random() % 4096, 400, 30) });
+	}
+	writer.EndLayer();
+	writer.BeginLayer("waterway");
+	writer.AddFeature(VGT_LINESTRING, { Line(random, 80) });
+	writer.EndLayer();
+	writer.BeginLayer("transportation");
+	for (unsigned n = 0; n < nRoads; n++) {
+		writer.AddFeature(VGT_LINESTRING, { Line(random, 4 + random() % 30) });
+	}
+	writer.EndLayer();
+	writer.BeginLayer("building");
+	for (unsigned n = 0; n < nBuildings; n++) {
+		writer.AddFeature(VGT_POLYGON, { Building(random) });
+	}
+	writer.EndLayer();
+	return writer.data();
+}
+
+BENCH(vectortile)
+{
+	struct Tiles
+	{
+		const char* pszName;
+		std::vector<std::vector<BYTE>> vecTiles;
+	};
+	// a few different tiles of each kind, so that not everything is in the branch predictor
+	Tiles kinds[] = { { "city" }, { "country" } };
+	for (unsigned nSeed = 0; nSeed < 8; nSeed++) {
+		kinds[0].vecTiles.push_back(MakeTile(nSeed, 2000, 150, 30));
+		kinds[1].vecTiles.push_back(MakeTile(nSeed, 50, 20, 10));
+	}
+
+	size_t nTiles = context.Iterations(4000);
+	for (const Tiles& kind : kinds) {
+		size_t nBytes = 0;
+		for (const std::vector<BYTE>& vecTile : kind.vecTiles) {
+			nBytes += vecTile.size();
+		}
+
+		// parsing alone
+		{
+			BenchLatencies latencies;
+			unsigned long long nAllocations = BenchAllocations();
+			BenchTimer timer;
+			for (size_t n = 0; n < nTiles; n++) {
+				const std::vector<BYTE>& vecTile = kind.vecTiles[n % kind.vecTiles.size()];
+				BenchTimer tileTimer;
+				VectorTile tile;
+				DecodeVectorTile(vecTile.data(), vecTile.size(), tile);
+				BenchKeep(tile);
+				latencies.Record(tileTimer.ElapsedNs());
+			}
+			double dNs = (double)timer.ElapsedNs();
+			BenchReport("vectortile", std::format("{}/parse", kind.pszName))
+				.Add("bytes_per_tile", (double)nBytes / kind.vecTiles.size())
+				.Add("ms_per_tile", dNs / nTiles / 1e6)
+				.Add("allocs_per_tile", (double)(BenchAllocations() - nAllocations) / nTiles)
+				.AddPercentiles("tile", latencies);
+		}
+
+		// and drawing, as the decode threads do, into an image reused from the previous tile
+		for (unsigned nPixelSize : { 256u, 512u }) {
+			VectorTileDecoder decoder(256, nPixelSize);
+			DecodedImage image;
+			decoder.Decode(kind.vecTiles[0].data(), kind.vecTiles[0].size(), image);
+			BenchLatencies latencies;
+			unsigned long long nAllocations = BenchAllocations();
+			BenchTimer timer;
+			for (size_t n = 0; n < nTiles; n++) {
+				const std::vector<BYTE>& vecTile = kind.vecTiles[n % kind.vecTiles.size()];
+				BenchTimer tileTimer;
+				decoder.Decode(vecTile.data(), vecTile.size(), image);
+				BenchKeep(image);
+				latencies.Record(tileTimer.ElapsedNs());
+			}
+			double dNs = (double)timer.ElapsedNs();
+			BenchReport("vectortile", std::format("{}/draw{}", kind.pszName, nPixelSize))
+				.Add("bytes_per_tile", (double)nBytes / kind.vecTiles.size())
+				.Add("ms_per_tile", dNs / nTiles / 1e6)
+				.Add("allocs_per_tile", (double)(BenchAllocations() - nAllocations) / nTiles)
+				.AddPercentiles("tile", latencies);
+		}
+	}
+}
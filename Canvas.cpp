@@ -0,0 +1,81 @@
+// Canvas.cpp: Canvas and D2DCanvas class implementation
+
+#include "framework.h"
+#include "TileManager.h"
+#include "Canvas.h"
+
+void Canvas::DrawPolyline(const D2D1_POINT_2F* pPoints, size_t nPoints, const D2D1_COLOR_F& color, float fWidth)
+{
+	for (size_t i = 1; i < nPoints; i++) {
+		DrawLine(pPoints[i - 1], pPoints[i], color, fWidth);
+	}
+}
+
+#ifdef _WIN32
+
+D2DCanvas::D2DCanvas(ComPtr<ID2D1RenderTarget> pRenderTarget, ComPtr<ID2D1SolidColorBrush> pBrush)
+	: m_pRenderTarget(pRenderTarget), m_pBrush(pBrush)
+{
+}
+
+D2D1_SIZE_F D2DCanvas::size()
+{
+	return m_pRenderTarget->GetSize();
+}
+
+float D2DCanvas::dpiScale()
+{
+	float dpiX, dpiY;
+	m_pRenderTarget->GetDpi(&dpiX, &dpiY);
+	return dpiX / 96.f;
+}
+
+void D2DCanvas::DrawTile(const Tile& tile, const D2D1_RECT_F& rectDest, const D2D1_RECT_F* pRectSource)
+{
+	ComPtr<ID2D1Bitmap> pBitmap = tile.d2dBitmap();
+	if (pBitmap) {
+		m_pRenderTarget->DrawBitmap(pBitmap.Get(), rectDest, 1.f, D2D1_BITMAP_INTERPOLATION_MODE_LINEAR, pRectSource);
+	}
+}
+
+void D2DCanvas::FillRectangle(const D2D1_RECT_F& rect, const D2D1_COLOR_F& color)
+{
+	m_pBrush->SetColor(color);
+	m_pRenderTarget->FillRectangle(rect, m_pBrush.Get());
+}
+
+void D2DCanvas::DrawLine(D2D1_POINT_2F ptFrom, D2D1_POINT_2F ptTo, const D2D1_COLOR_F& color, float fWidth)
+{
+	m_pBrush->SetColor(color);
+	m_pRenderTarget->DrawLine(ptFrom, ptTo, m_pBrush.Get(), fWidth);
+}
+
+void D2DCanvas::DrawPolyline(const D2D1_POINT_2F* pPoints, size_t nPoints, const D2D1_COLOR_F& color, float fWidth)
+{
+	if (nPoints < 2) {
+		return;
+	}
+
+	ComPtr<ID2D1Factory> pFactory;
+	m_pRenderTarget->GetFactory(pFactory.GetAddressOf());
+	if (!m_pRoundStrokeStyle) {
+		pFactory->CreateStrokeStyle(D2D1::StrokeStyleProperties(D2D1_CAP_STYLE_ROUND, D2D1_CAP_STYLE_ROUND,
+			D2D1_CAP_STYLE_ROUND, D2D1_LINE_JOIN_ROUND), nullptr, 0, m_pRoundStrokeStyle.GetAddressOf());
+	}
+
+	ComPtr<ID2D1PathGeometry> pGeometry;
+	ComPtr<ID2D1GeometrySink> pSink;
+	if (FAILED(pFactory->CreatePathGeometry(pGeometry.GetAddressOf())) || FAILED(pGeometry->Open(pSink.GetAddressOf()))) {
+		Canvas::DrawPolyline(pPoints, nPoints, color, fWidth);
+		return;
+	}
+	pSink->BeginFigure(pPoints[0], D2D1_FIGURE_BEGIN_HOLLOW);
+	pSink->AddLines(pPoints + 1, (UINT32)(nPoints - 1));
+	pSink->EndFigure(D2D1_FIGURE_END_OPEN);
+	pSink->Close();
+
+	m_pBrush->SetColor(color);
+	m_pRenderTarget->DrawGeometry(pGeometry.Get(), m_pBrush.Get(), fWidth, m_pRoundStrokeStyle.Get());
+}
+
+#endif
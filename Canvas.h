@@ -0,0 +1,56 @@
+#pragma once
+
+// Canvas.h: minimal drawing surface abstraction for painting the map: drawing tile images,
+// filling rectangles, drawing lines.  D2DCanvas draws to a Direct2D render target (i. e. the
+// screen), SoftwareCanvas (see SoftwareCanvas.h) into a memory buffer, with no GPU or window,
+// which is useful for measuring frame cost or comparing output against reference images.
+// Coordinates are in device independent pixels, as with Direct2D
+
+#include "ComPtr.h"
+
+class Tile;
+
+class Canvas
+{
+public:
+	virtual ~Canvas() {}
+
+	// canvas size
+	virtual D2D1_SIZE_F size() = 0;
+	// device pixels per device independent pixel
+	virtual float dpiScale() = 0;
+
+	// draws tile image scaled to rectDest, optionally only a part of it (pRectSource,
+	// in image pixels).  Scaling is bilinear.  Tiles which don't have an image suitable
+	// for this canvas are not drawn
+	virtual void DrawTile(const Tile& tile, const D2D1_RECT_F& rectDest, const D2D1_RECT_F* pRectSource = nullptr) = 0;
+	virtual void FillRectangle(const D2D1_RECT_F& rect, const D2D1_COLOR_F& color) = 0;
+	virtual void DrawLine(D2D1_POINT_2F ptFrom, D2D1_POINT_2F ptTo, const D2D1_COLOR_F& color, float fWidth = 1.f) = 0;
+	// draws connected lines through nPoints points.  By default just draws them one by one
+	virtual void DrawPolyline(const D2D1_POINT_2F* pPoints, size_t nPoints, const D2D1_COLOR_F& color, float fWidth = 1.f);
+};
+
+#ifdef _WIN32
+// Canvas drawing to a Direct2D render target, which must be between BeginDraw() and EndDraw().
+// Draws tiles' Direct2D bitmaps.  Meant to be created for the duration of a single paint
+class D2DCanvas : public Canvas
+{
+public:
+	// pBrush is any solid color brush for the render target, its color is changed as needed
+	D2DCanvas(ComPtr<ID2D1RenderTarget> pRenderTarget, ComPtr<ID2D1SolidColorBrush> pBrush);
+
+	D2D1_SIZE_F size() override;
+	float dpiScale() override;
+	void DrawTile(const Tile& tile, const D2D1_RECT_F& rectDest, const D2D1_RECT_F* pRectSource = nullptr) override;
+	void FillRectangle(const D2D1_RECT_F& rect, const D2D1_COLOR_F& color) override;
+	void DrawLine(D2D1_POINT_2F ptFrom, D2D1_POINT_2F ptTo, const D2D1_COLOR_F& color, float fWidth = 1.f) override;
+	// draws as a single path geometry, with round joins
+	void DrawPolyline(const D2D1_POINT_2F* pPoints, size_t nPoints, const D2D1_COLOR_F& color, float fWidth = 1.f) override;
+
+private:
+	ComPtr<ID2D1RenderTarget> m_pRenderTarget;
+	ComPtr<ID2D1SolidColorBrush> m_pBrush;
+	// created on first use
+	ComPtr<ID2D1StrokeStyle> m_pRoundStrokeStyle;
+};
+#endif
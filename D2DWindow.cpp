@@ -3,6 +3,7 @@
 #include "framework.h"
 #include "D2DWindow.h"
 #include "Util.h"
+#include "Trace.h"
 
 D2DWindow::D2DWindow(ComPtr<ID2D1Factory> pD2DFactory, HINSTANCE hInstance) : Window(hInstance),
     m_pD2DFactory(pD2DFactory)
@@ -39,9 +40,14 @@ void D2DWindow::OnPaint()
     if (BeginPaint(hWnd(), &ps)) {
         EnsureRenderTarget();
         if (!m_pRenderTarget->CheckWindowState() & D2D1_WINDOW_STATE_OCCLUDED) {
+            long long tmStart = TraceNow();
             m_pRenderTarget->BeginDraw();
-            OnPaintD2D();
+            OnPaintD2D(ps.rcPaint);
             HRESULT hr = m_pRenderTarget->EndDraw();
+            long long tmEnd = TraceNow();
+            TraceComplete("Frame", tmStart, tmEnd);
+            m_nLastFrameUs = tmEnd - tmStart;
+            m_frameTimes.Record(m_nLastFrameUs);
 
             // in case of device loss, discard D2D render and force a repaint.
             // They will be re-create in the next pass
@@ -85,10 +91,10 @@ void D2DWindow::CreateRenderTarget()
     _ASSERT(SUCCEEDED(hr));
     D2D1_SIZE_U size = D2D1::SizeU(rc.right - rc.left, rc.bottom - rc.top);
 
-    // create
+    // create, retaining contents so that partial repaints are possible
     hr = m_pD2DFactory->CreateHwndRenderTarget(
         renderTargetProperties,
-        D2D1::HwndRenderTargetProperties(hWnd(), size),
+        D2D1::HwndRenderTargetProperties(hWnd(), size, D2D1_PRESENT_OPTIONS_RETAIN_CONTENTS),
         m_pRenderTarget.GetAddressOf()
     );
     _ASSERT(SUCCEEDED(hr));
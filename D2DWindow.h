@@ -4,6 +4,7 @@
 
 #include "Window.h"
 #include "ComPtr.h"
+#include "Trace.h"
 
 class D2DWindow : public Window
 {
@@ -14,6 +15,10 @@ protected:
 public:
 	~D2DWindow() = 0;
 	ID2D1HwndRenderTarget* renderTarget() const { return m_pRenderTarget.Get(); }
+	// how long painting the last frame took, including EndDraw(), microseconds
+	long long lastFrameUs() const { return m_nLastFrameUs; }
+	// distribution of frame times since the window was created
+	const TraceHistogram& frameTimes() const { return m_frameTimes; }
 
 protected:
 	ComPtr<ID2D1Factory> m_pD2DFactory;
@@ -23,9 +28,10 @@ protected:
 	void OnSize(unsigned nWidth, unsigned nHeight) override;
 	void OnPaint() override;
 
-	// Function to actually repaint the (entire) window using Direct2D.
-	// Render target is set up, no Begin/EndDraw() necessary here
-	virtual void OnPaintD2D() = 0;
+	// Function to actually repaint the window using Direct2D.  Render target is set up,
+	// no Begin/EndDraw() necessary here.  Render target retains its contents between frames,
+	// so only rcPaint (the update region's bounding box) needs to be repainted
+	virtual void OnPaintD2D(const RECT& rcPaint) = 0;
 
 	// Creates and destroys Direct2D render target.  These are called as needed,
 	// but if there are any long-lived assets attached to the render target (brushes,
@@ -35,6 +41,9 @@ protected:
 	virtual void InvalidateRenderTarget();
 
 private:
+	long long m_nLastFrameUs = 0;
+	TraceHistogram m_frameTimes;
+
 	void CreateRenderTarget();
 };
 
@@ -0,0 +1,152 @@
+// DecodePool.cpp: DecodePool class implementation
+
+#include "framework.h"
+#include "Util.h"
+#include "Trace.h"
+#include "DecodePool.h"
+
+DecodePool::DecodePool(unsigned nThreads, size_t nMaxQueued)
+	: m_nMaxQueued(nMaxQueued)
+{
+	if (!nThreads) {
+		nThreads = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+	// all workers must exist before any thread starts looking for jobs to steal
+	for (unsigned i = 0; i < nThreads; i++) {
+		m_vecWorkers.push_back(std::make_unique<Worker>());
+	}
+	for (unsigned i = 0; i < nThreads; i++) {
+		m_vecWorkers[i]->thread = std::thread(&DecodePool::Run, this, i);
+	}
+}
+
+DecodePool::~DecodePool()
+{
+	{
+		std::lock_guard lock(m_mutexIdle);
+		m_bStopping = true;
+	}
+	m_cvIdle.notify_all();
+	for (auto& pWorker : m_vecWorkers) {
+		pWorker->thread.join();
+	}
+}
+
+DecodePool::JobId DecodePool::Submit(Job job)
+{
+	// counter goes up before the job is visible, so that it never goes below zero; and under
+	// the idle lock, so that a worker about to sleep cannot miss it
+	size_t nQueued;
+	{
+		std::lock_guard lock(m_mutexIdle);
+		nQueued = ++m_nQueued;
+	}
+	JobId id = ++m_nLastJobId;
+	Worker& worker = *m_vecWorkers[m_nNextWorker++ % m_vecWorkers.size()];
+	{
+		std::lock_guard lock(worker.mutex);
+		worker.deqJobs.push_back({ id, std::move(job), std::chrono::steady_clock::now() });
+	}
+	m_cvIdle.notify_one();
+
+	std::lock_guard lock(m_mutexStats);
+	m_stats.nPeakQueued = std::max(m_stats.nPeakQueued, nQueued);
+	return id;
+}
+
+bool DecodePool::Cancel(JobId id)
+{
+	// it may have been stolen, so look everywhere; queues are short
+	for (auto& pWorker : m_vecWorkers) {
+		// destroyed outside the lock, with whatever it holds
+		Job job;
+		{
+			std::lock_guard lock(pWorker->mutex);
+			auto it = std::find_if(pWorker->deqJobs.begin(), pWorker->deqJobs.end(), [=](auto& queued) { return queued.id == id; });
+			if (it == pWorker->deqJobs.end()) {
+				continue;
+			}
+			job = std::move(it->job);
+			pWorker->deqJobs.erase(it);
+			m_nQueued--;
+		}
+		std::lock_guard lock(m_mutexStats);
+		m_stats.nCancelled++;
+		return true;
+	}
+	return false;
+}
+
+DecodePool::Stats DecodePool::stats()
+{
+	std::lock_guard lock(m_mutexStats);
+	Stats stats = m_stats;
+	stats.nQueued = m_nQueued;
+	return stats;
+}
+
+void DecodePool::Run(unsigned nWorker)
+{
+	// decoders use COM (WIC)
+	HRESULT hr = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+	_ASSERT(SUCCEEDED(hr));
+	TraceSetThreadName("Decode worker");
+
+	while (true) {
+		QueuedJob job;
+		if (!TakeJob(nWorker, job)) {
+			// nothing anywhere, sleep until something is submitted; when stopping,
+			// only quit once all queues are drained
+			std::unique_lock lock(m_mutexIdle);
+			if (m_bStopping && !m_nQueued) {
+				break;
+			}
+			m_cvIdle.wait(lock, [this]() { return m_bStopping || m_nQueued > 0; });
+			continue;
+		}
+
+		auto tmStarted = std::chrono::steady_clock::now();
+		job.job();
+		auto tmFinished = std::chrono::steady_clock::now();
+
+		unsigned long long nWaitUs = std::chrono::duration_cast<std::chrono::microseconds>(tmStarted - job.tmQueued).count();
+		unsigned long long nRunUs = std::chrono::duration_cast<std::chrono::microseconds>(tmFinished - tmStarted).count();
+		std::lock_guard lock(m_mutexStats);
+		m_stats.nCompleted++;
+		m_stats.nTotalWaitUs += nWaitUs;
+		m_stats.nMaxWaitUs = std::max(m_stats.nMaxWaitUs, nWaitUs);
+		m_stats.nTotalRunUs += nRunUs;
+		m_stats.nMaxRunUs = std::max(m_stats.nMaxRunUs, nRunUs);
+	}
+
+	CoUninitialize();
+}
+
+bool DecodePool::TakeJob(unsigned nWorker, QueuedJob& job)
+{
+	// own queue first, oldest job first
+	size_t nWorkers = m_vecWorkers.size();
+	for (size_t i = 0; i < nWorkers; i++) {
+		Worker& worker = *m_vecWorkers[(nWorker + i) % nWorkers];
+		std::lock_guard lock(worker.mutex);
+		if (worker.deqJobs.empty()) {
+			continue;
+		}
+		// others' queues are robbed from the other end, so that owner and thief
+		// don't go after the same job
+		if (i == 0) {
+			job = std::move(worker.deqJobs.front());
+			worker.deqJobs.pop_front();
+		} else {
+			job = std::move(worker.deqJobs.back());
+			worker.deqJobs.pop_back();
+		}
+		m_nQueued--;
+		if (i != 0) {
+			std::lock_guard lockStats(m_mutexStats);
+			m_stats.nStolen++;
+		}
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+// DecodePool.h: pool of worker threads for decoding tile images, so that decoding
+// does not happen on (and hold up) network threads or the UI thread.
+// Every worker has its own job queue, jobs are distributed round robin, and a worker
+// which runs out of jobs steals them from the others.  The total number of queued jobs
+// has a soft limit: Submit() never blocks or drops a job, but once the limit is reached
+// isSaturated() returns true, and producers (i. e. TileScheduler) are expected to hold off
+// until it drops again.  Jobs still queued can be cancelled.  Workers are COM-initialized
+// (multithreaded apartment).
+// Thread safe; one instance per app should be enough.
+
+class DecodePool
+{
+public:
+	typedef std::function<void()> Job;
+	typedef unsigned long long JobId;
+
+	static const size_t DEFAULT_MAX_QUEUED = 64;
+
+	// nThreads = 0 means one thread per logical CPU
+	DecodePool(unsigned nThreads = 0, size_t nMaxQueued = DEFAULT_MAX_QUEUED);
+	// runs any jobs which are still queued, and stops all threads
+	~DecodePool();
+
+	// no copy/assignment
+	DecodePool& operator=(const DecodePool&) = delete;
+	DecodePool(const DecodePool&) = delete;
+
+	// queues a job to be run on one of the worker threads, returns its id for Cancel()
+	JobId Submit(Job job);
+
+	// takes a job out of the queue, so that it never runs, and returns true; false if it has been
+	// taken to run already (or was cancelled before)
+	bool Cancel(JobId id);
+
+	// whether queue is at or above the limit
+	bool isSaturated() const { return m_nQueued >= m_nMaxQueued; }
+
+	unsigned threadCount() const { return (unsigned)m_vecWorkers.size(); }
+
+	struct Stats
+	{
+		// jobs currently queued (not yet running), and the highest it has been
+		size_t nQueued, nPeakQueued;
+		unsigned long long nCompleted, nStolen, nCancelled;
+		// time spent by jobs in queue, and running, microseconds
+		unsigned long long nTotalWaitUs, nMaxWaitUs;
+		unsigned long long nTotalRunUs, nMaxRunUs;
+	};
+	Stats stats();
+
+private:
+	struct QueuedJob
+	{
+		JobId id;
+		Job job;
+		std::chrono::steady_clock::time_point tmQueued;
+	};
+
+	struct Worker
+	{
+		std::deque<QueuedJob> deqJobs;
+		std::mutex mutex;
+		std::thread thread;
+	};
+
+	std::vector<std::unique_ptr<Worker>> m_vecWorkers;
+	size_t m_nMaxQueued;
+	std::atomic<size_t> m_nQueued = 0;
+	// round robin counter for Submit()
+	std::atomic<unsigned> m_nNextWorker = 0;
+	std::atomic<JobId> m_nLastJobId = 0;
+
+	// idle workers sleep on this
+	std::mutex m_mutexIdle;
+	std::condition_variable m_cvIdle;
+	bool m_bStopping = false;
+
+	std::mutex m_mutexStats;
+	Stats m_stats = {};
+
+	// worker thread body
+	void Run(unsigned nWorker);
+	// takes a job from worker's own queue, or steals one from the others
+	bool TakeJob(unsigned nWorker, QueuedJob& job);
+};
@@ -2,155 +2,249 @@
 
 #include "framework.h"
 #include "Util.h"
+#include "Trace.h"
 #include "HttpClient.h"
 
-// TODO: should we pretend to be a browser?
-static const wchar_t USER_AGENT[] = L"MapViewer/0.1";
+#ifdef _WIN32
+#include "WinInetTransport.h"
+#else
+#include "SocketTransport.h"
+#endif
+
+HttpClient::HttpClient(unsigned nMaxConnectionsPerServer)
+#ifdef _WIN32
+	: HttpClient(std::make_unique<WinInetTransport>(nMaxConnectionsPerServer))
+#else
+	: HttpClient(std::make_unique<SocketTransport>(nMaxConnectionsPerServer))
+#endif
+{
+}
 
-HttpClient::HttpClient()
+HttpClient::HttpClient(std::unique_ptr<HttpTransport> pTransport) : m_pTransport(std::move(pTransport))
 {
-	// open main WinInet handle for async requests and all defaults, and set a callback for it
-	m_hInternet = InternetOpen(USER_AGENT, INTERNET_OPEN_TYPE_PRECONFIG,
-		nullptr, nullptr, INTERNET_FLAG_ASYNC);
-	_ASSERT(m_hInternet);
-	InternetSetStatusCallback(m_hInternet, StaticInternetStatusCallback);
 }
 
 HttpClient::~HttpClient()
 {
-	InternetCloseHandle(m_hInternet);
+	// first, as its callbacks refer to flights
+	m_pTransport.reset();
 }
 
-void HttpClient::Get(std::wstring strUrl, OnFinishCallback fnOnFinish)
+HttpClient::RequestId HttpClient::Get(std::wstring strUrl, OnFinishCallback fnOnFinish, const HttpCacheInfo* pValidators)
 {
-	// create a new HttpRequest instance to track request
-	std::lock_guard lock(m_vecRequestsMutex);
-	std::unique_ptr<HttpRequest> &pRequest = m_vecRequests.emplace_back(new HttpRequest(*this, strUrl, fnOnFinish));
-
-	// fire off async request, using all default settings.  May already return request handle or may
-	// result in ERROR_IO_PENDING, in which case the callback needs to save the handle later
-	HINTERNET hRequest = InternetOpenUrl(m_hInternet, strUrl.c_str(), nullptr, 0, 0, reinterpret_cast<DWORD_PTR>(pRequest.get()));
-	if (hRequest) {
-		pRequest->hRequest = hRequest;
-	} else {
-		_ASSERT(GetLastError() == ERROR_IO_PENDING);
+	std::wstring strServer;
+	std::wstring strKey = FlightKey(strUrl, pValidators, strServer);
+	RequestId id;
+	std::shared_ptr<Flight> pFlight;
+	bool bRejected = false;
+	{
+		std::lock_guard lock(m_mapFlightsMutex);
+		m_stats.nRequests++;
+		id = ++m_nLastRequestId;
+		// the same thing in flight already, just wait for it
+		auto it = m_mapFlights.find(strKey);
+		if (it != m_mapFlights.end()) {
+			it->second->vecWaiters.emplace_back(id, fnOnFinish);
+			m_mapWaiters.emplace(id, it->second);
+			m_stats.nCoalesced++;
+			return id;
+		}
+		bool bProbe = false;
+		if (!AdmitRequest(strServer, bProbe)) {
+			m_stats.nRejected++;
+			bRejected = true;
+		} else {
+			pFlight = std::make_shared<Flight>();
+			pFlight->strKey = strKey;
+			pFlight->strServer = strServer;
+			pFlight->bProbe = bProbe;
+			pFlight->vecWaiters.emplace_back(id, fnOnFinish);
+			m_mapFlights[strKey] = pFlight;
+			m_mapWaiters.emplace(id, pFlight);
+			m_stats.nFetches++;
+		}
+	}
+	if (bRejected) {
+		fnOnFinish(-ERROR_INTERNET_SERVER_UNREACHABLE, ResponseBuffer(), HttpCacheInfo());
+		return id;
+	}
+
+	// outside the lock, as the callback may be called synchronously
+	RequestId idRequest = StartRequest(strUrl, [this, pFlight](int nStatus, ResponseBuffer buffer, const HttpCacheInfo& cacheInfo) {
+		FinishFlight(pFlight, nStatus, std::move(buffer), cacheInfo);
+	}, pValidators);
+
+	// remember the request, unless it is finished already; and cancel it if all waiters
+	// were cancelled while we didn't have it
+	bool bCancel = false;
+	{
+		std::lock_guard lock(m_mapFlightsMutex);
+		pFlight->idRequest = idRequest;
+		bCancel = pFlight->bCancelled;
+	}
+	if (bCancel) {
+		m_pTransport->Cancel(idRequest);
 	}
+	return id;
 }
 
-void HttpClient::Terminate(HINTERNET hRequest, bool bKeepBuffer)
+void HttpClient::Cancel(RequestId id)
 {
-	// find a matching HttpRequest by its HINTERNET
-	std::lock_guard lock(m_vecRequestsMutex);
-	auto it = std::find_if(m_vecRequests.begin(), m_vecRequests.end(),
-		[=](auto& request) { return request.get() && request->hRequest == hRequest; });
-	if (it != m_vecRequests.end()) {
-		// close its subhandle, delete response buffer if present and request, and remove request from the list
-		auto request = it->get();
-		InternetCloseHandle(hRequest);
-		if (!bKeepBuffer && request->pBuffer) {
-			delete[] request->pBuffer;
+	OnFinishCallback fnOnFinish;
+	RequestId idRequest = 0;
+	{
+		std::lock_guard lock(m_mapFlightsMutex);
+		auto itWaiter = m_mapWaiters.find(id);
+		if (itWaiter != m_mapWaiters.end()) {
+			Flight& flight = *itWaiter->second;
+			// few waiters per flight, usually one
+			auto it = std::find_if(flight.vecWaiters.begin(), flight.vecWaiters.end(), [=](auto& waiter) { return waiter.first == id; });
+			fnOnFinish = std::move(it->second);
+			flight.vecWaiters.erase(it);
+			if (flight.vecWaiters.empty()) {
+				// nobody wants it anymore.  If it isn't started yet, Get() will cancel it as soon as it is
+				flight.bDone = flight.bCancelled = true;
+				idRequest = flight.idRequest;
+				m_stats.nFetchesCancelled++;
+				m_mapFlights.erase(flight.strKey);
+			}
+			m_mapWaiters.erase(itWaiter);
 		}
-		m_vecRequests.erase(std::remove(m_vecRequests.begin(), m_vecRequests.end(), *it), m_vecRequests.end());
+	}
+	if (fnOnFinish) {
+		fnOnFinish(-ERROR_INTERNET_OPERATION_CANCELLED, ResponseBuffer(), HttpCacheInfo());
+	}
+	if (idRequest) {
+		m_pTransport->Cancel(idRequest);
 	}
 }
 
-void __stdcall HttpClient::StaticInternetStatusCallback(HINTERNET hInternet, DWORD_PTR dwContext, DWORD dwInternetStatus, LPVOID lpvStatusInformation, DWORD dwStatusInformationLength)
+HttpClient::Stats HttpClient::stats()
 {
-	HttpRequest* pRequest = reinterpret_cast<HttpRequest*>(dwContext);
-	pRequest->client.InternetStatusCallback(*pRequest, hInternet, dwInternetStatus, lpvStatusInformation, dwStatusInformationLength);
+	std::lock_guard lock(m_mapFlightsMutex);
+	Stats stats = m_stats;
+	stats.nServersDown = std::count_if(m_mapServers.begin(), m_mapServers.end(), [](auto& kv) { return kv.second.bOpen; });
+	return stats;
 }
 
-void HttpClient::InternetStatusCallback(HttpRequest &request, HINTERNET hInternet, DWORD dwInternetStatus, LPVOID lpvStatusInformation, DWORD dwStatusInformationLength)
+bool HttpClient::IsServerAvailable(const std::wstring& strUrl)
 {
-	//PrintLnDebug(L"InternetStatusCallback HINTERNET = 0{:x} dwInternetStatus = {}", (intptr_t) hInternet, dwInternetStatus);
+	return ServerRetryTime(strUrl) == 0;
+}
 
-	switch (dwInternetStatus)
-	{
-	case INTERNET_STATUS_HANDLE_CREATED: {
-		// store request handle in HttpRequest
-		INTERNET_ASYNC_RESULT* pResult = reinterpret_cast<INTERNET_ASYNC_RESULT*>(lpvStatusInformation);
-		request.hRequest = reinterpret_cast<HINTERNET>(pResult->dwResult);
-		break;
-	}
-
-	case INTERNET_STATUS_REQUEST_COMPLETE: {
-		INTERNET_ASYNC_RESULT* pResult = reinterpret_cast<INTERNET_ASYNC_RESULT*>(lpvStatusInformation);
-		if (pResult->dwResult) {
-			// successul callback
-
-			// response buffer not yet allocated, must be a first callback
-			if (!request.buffers.dwBufferTotal) {
-				DWORD dw = 0;
-				DWORD dwLength = sizeof(dw);
-				DWORD dwIndex = 0;
-
-				// check HTTP status
-				bool statusCodeRetrieved = HttpQueryInfo(request.hRequest, HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER, &dw, &dwLength, &dwIndex);
-				_ASSERT(statusCodeRetrieved);
-				// allow only 2xx status, otherwise bail out and don't bother reading response
-				if (dw < 200 || dw > 299) {
-					request.fnOnFinish(dw, nullptr, (size_t)0);
-					Terminate(request.hRequest);
-					return;
-				}
-
-				// TODO: assume Content-Length header exists, which should be the case for our use but not in general.  Assert out if it doesn't
-				bool contentLengthRetrieved = HttpQueryInfo(request.hRequest, HTTP_QUERY_CONTENT_LENGTH | HTTP_QUERY_FLAG_NUMBER, &dw, &dwLength, &dwIndex);
-				_ASSERT(contentLengthRetrieved);
-
-				// allocate buffer and set up INTERNET_BUFFERS according to Content-Length received
-				request.pBuffer = new char[dw];
-				request.buffers.lpvBuffer = request.pBuffer;
-				request.sizeLength = dw;
-				request.buffers.dwBufferTotal = dw;
-				request.buffers.dwBufferLength = dw;
-			}
+ULONGLONG HttpClient::ServerRetryTime(const std::wstring& strUrl)
+{
+	std::wstring strServer;
+	FlightKey(strUrl, nullptr, strServer);
+	std::lock_guard lock(m_mapFlightsMutex);
+	auto it = m_mapServers.find(strServer);
+	if (it == m_mapServers.end() || !it->second.bOpen) {
+		return 0;
+	}
+	ULONGLONG tmNow = now();
+	if (it->second.bProbing) {
+		return tmNow + CIRCUIT_PROBE_RECHECK_MS;
+	}
+	return tmNow >= it->second.tmOpenUntil ? 0 : it->second.tmOpenUntil;
+}
 
-			if (request.buffers.dwBufferLength > 0) {
-				// dwBufferLength > 0 --> need to issue a read request (first or subsequent)
-
-				// this condition is true in case there was a read but it was incomplete, in that case need to adjust
-				// pointer and length in INTERNET_BUFFERS to point to the part that's not yet read
-				if (request.buffers.dwBufferLength < request.buffers.dwBufferTotal) {
-					request.buffers.lpvBuffer =
-						reinterpret_cast<char*>(request.buffers.lpvBuffer) + request.buffers.dwBufferLength;
-					size_t downloadedBytes =
-						reinterpret_cast<char*>(request.buffers.lpvBuffer) -
-						reinterpret_cast<char*>(request.pBuffer);
-					request.buffers.dwBufferLength = (DWORD) (request.sizeLength - downloadedBytes);
-				}
-
-				// issue read request
-				bool readSuccess = InternetReadFileEx(request.hRequest, &request.buffers, IRF_ASYNC, reinterpret_cast<DWORD_PTR>(&request));
-				if (readSuccess) {
-					// despite async mode it can actually return already synchronously anyway
-					request.fnOnFinish(0, request.pBuffer, request.sizeLength);
-					Terminate(request.hRequest, true);
-				} else {
-					// otherwise expect ERROR_IO_PENDING, any other error is an acual error
-					unsigned error = GetLastError();
-					if (error != ERROR_IO_PENDING) {
-						request.fnOnFinish(-(int)pResult->dwError, nullptr, (size_t)0);
-						Terminate(request.hRequest);
-						return;
-					}
-				}
-			} else {
-				// last dwBufferLength == 0 -> all read successfully
-				request.fnOnFinish(0, request.pBuffer, request.sizeLength);
-				Terminate(request.hRequest, true);
-			}
-		} else {
-			// error callback, report and wrap up
-			request.fnOnFinish(-(int)pResult->dwError, nullptr, (size_t)0);
-			Terminate(request.hRequest);
+bool HttpClient::AdmitRequest(const std::wstring& strServer, bool& bProbe)
+{
+	ServerHealth& server = m_mapServers[strServer];
+	if (!server.bOpen) {
+		return true;
+	}
+	if (server.bProbing || now() < server.tmOpenUntil) {
+		return false;
+	}
+	server.bProbing = true;
+	bProbe = true;
+	return true;
+}
+
+void HttpClient::RecordOutcome(Flight& flight, int nStatus, const HttpCacheInfo& cacheInfo)
+{
+	ServerHealth& server = m_mapServers[flight.strServer];
+	if (flight.bProbe) {
+		server.bProbing = false;
+	}
+	if (nStatus == -ERROR_INTERNET_OPERATION_CANCELLED) {
+		// tells nothing about the server
+		return;
+	}
+	// the server answering anything else, e. g. 404 for a tile it doesn't have, means it is fine
+	bool bFailure = nStatus < 0 || nStatus == HTTP_STATUS_TOO_MANY_REQUESTS || nStatus >= HTTP_STATUS_SERVER_ERROR;
+	if (!bFailure) {
+		if (server.bOpen) {
+			PrintLnDebug(L"Server {} is back, closing circuit", flight.strServer);
 		}
-		break;
+		server = ServerHealth();
+		return;
 	}
 
-	case INTERNET_STATUS_HANDLE_CLOSING: {
-		//Terminate(request.hRequest);  // might already be done
-		break;
+	server.nFailures++;
+	unsigned nOpenMs = 0;
+	if (server.bOpen) {
+		// only the probe gets here while open, or fetches already in flight when it opened
+		nOpenMs = flight.bProbe ? std::min(server.nOpenMs * 2, CIRCUIT_MAX_OPEN_MS) : server.nOpenMs;
+	} else if (server.nFailures >= CIRCUIT_FAILURE_THRESHOLD || cacheInfo.nRetryAfter) {
+		nOpenMs = CIRCUIT_OPEN_MS;
+		m_stats.nCircuitsOpened++;
+		PrintLnDebug(L"Server {} failed {} times in a row, opening circuit", flight.strServer, server.nFailures);
+	}
+	if (nOpenMs) {
+		// the server knows best how long it needs, within reason
+		nOpenMs = std::max(nOpenMs, std::min(cacheInfo.nRetryAfter, CIRCUIT_MAX_OPEN_MS / 1000) * 1000);
+		server.bOpen = true;
+		server.nOpenMs = nOpenMs;
+		server.tmOpenUntil = now() + nOpenMs;
 	}
+}
+
+std::wstring HttpClient::FlightKey(const std::wstring& strUrl, const HttpCacheInfo* pValidators, std::wstring& strServer)
+{
+	std::wstring strKey;
+	HttpUrl url;
+	if (ParseUrl(strUrl, url)) {
+		strServer = std::format(L"{}://{}:{}", url.strScheme, url.strHost, url.nPort);
+		strKey = strServer + url.strPath;
+	} else {
+		// will fail anyway, but the same way for everyone
+		strServer = strKey = strUrl;
 	}
+	// a conditional request may be answered with no body, so it only goes with the same one
+	if (pValidators) {
+		strKey += L"\n" + std::wstring(pValidators->strETag.begin(), pValidators->strETag.end()) +
+			L"\n" + std::wstring(pValidators->strLastModified.begin(), pValidators->strLastModified.end());
+	}
+	return strKey;
+}
+
+void HttpClient::FinishFlight(std::shared_ptr<Flight> pFlight, int nStatus, ResponseBuffer buffer, const HttpCacheInfo& cacheInfo)
+{
+	std::vector<std::pair<RequestId, OnFinishCallback>> vecWaiters;
+	{
+		std::lock_guard lock(m_mapFlightsMutex);
+		if (!pFlight->bDone) {
+			pFlight->bDone = true;
+			m_mapFlights.erase(pFlight->strKey);
+		}
+		RecordOutcome(*pFlight, nStatus, cacheInfo);
+		vecWaiters = std::move(pFlight->vecWaiters);
+		pFlight->vecWaiters.clear();
+		for (auto& waiter : vecWaiters) {
+			m_mapWaiters.erase(waiter.first);
+		}
+	}
+	// the buffer is reference counted, all waiters share it without a copy
+	for (auto& waiter : vecWaiters) {
+		waiter.second(nStatus, buffer, cacheInfo);
+	}
+}
+
+HttpClient::RequestId HttpClient::StartRequest(const std::wstring& strUrl, OnFinishCallback fnOnFinish, const HttpCacheInfo* pValidators)
+{
+	RequestId id = ++m_nLastRequestId;
+	m_pTransport->Start(id, strUrl, pValidators, std::move(fnOnFinish));
+	return id;
 }
@@ -1,69 +1,154 @@
 #pragma once
 
-// HttpClient.h: simple asynchronous HTTP client class, wrapping WinInet API.
+// HttpClient.h: simple asynchronous HTTP client class.
 // For the purposes of this project we only need to make simple GET requests (for map tile images)
-// without any customization, but we need to make a lot of them.  Very conveniently WinInet has
-// built-in caching support, which is exactly what we want for fetching tiles.
-// No more than one instance per app should be necessary.
+// without much customization, but we need to make a lot of them.  Requests are sent by a transport
+// (see HttpTransport.h): WinInet on Windows, our own sockets and epoll elsewhere.  Neither caches
+// anything, as tiles are kept in TileCache; instead, caching headers of responses are reported to
+// the caller (HttpCacheInfo), and requests can be made conditional on them, to revalidate a cached tile.
+// Response bodies are read into pooled buffers (see ResponseBuffer.h), whether their length is
+// known up front or not.
+// Identical requests made while one is already in flight (e. g. the same tile wanted by two windows,
+// or by the view and the seeder at once) are coalesced: they attach to the fetch in flight as waiters,
+// all get its response, and it is cancelled only once all of its waiters are cancelled.
+// Each server has a circuit breaker: after several failures in a row (network errors, 429 or 5xx),
+// or when told to back off with Retry-After, requests to it fail right away, without touching the
+// network, until a single probe request every now and then gets through and succeeds.
+// Both transports keep a pool of persistent (keep-alive) connections per server, whose size is
+// configurable.  No more than one instance per app should be necessary.
+
+#include "HttpTransport.h"
 
 class HttpClient
 {
 public:
-	HttpClient();
+	// with the platform's transport.  nMaxConnectionsPerServer limits the number of simultaneous
+	// connections to one server (with WinInet, this is a process-wide setting)
+	HttpClient(unsigned nMaxConnectionsPerServer = DEFAULT_MAX_CONNECTIONS_PER_SERVER);
+	// with a transport of the caller's choice, e. g. one configured differently
+	explicit HttpClient(std::unique_ptr<HttpTransport> pTransport);
 	~HttpClient();
 
+	static const unsigned DEFAULT_MAX_CONNECTIONS_PER_SERVER = 8;
+
 	// Callback type
 	// nStatus = 0: request successful (2xx status, do not distinguish between them), pBuffer/szLength contain response
-	// nStatus > 0: server reported error, nStatus equals error code.  pBuffer is null (do not save response in this case)
-	// nStatus < 0: error making request, nStatus equals -(INTERNET_ASYNC_RESULT::dwError).  pBuffer is null
-	typedef std::function<void(int nStatus, void *pBuffer, size_t szLength)> OnFinishCallback;
+	// nStatus > 0: server reported error, nStatus equals error code.  pBuffer is null (do not save response in this case).
+	//     This includes HTTP_STATUS_NOT_MODIFIED (304) for conditional requests
+	// nStatus < 0: error making request, nStatus equals -(ERROR_INTERNET_* code, whichever the transport).  pBuffer is null
+	// nStatus = -ERROR_INTERNET_SERVER_UNREACHABLE: not even tried, the circuit breaker for the server is open
+	// buffer is empty unless nStatus = 0.  cacheInfo has caching headers for 2xx and 304 responses, Retry-After
+	// for 429 and 503, and is empty otherwise
+	typedef HttpTransport::OnFinishCallback OnFinishCallback;
 
-	// Main/only entry point, only gets an URL to fetch and a callback to call when the request is finished
+	// Request identifier, unique for the lifetime of HttpClient (0 is never used)
+	typedef HttpTransport::RequestId RequestId;
+
+	// Main entry point, only gets an URL to fetch and a callback to call when the request is finished
 	// (whether successfully or not).  Note that the callback will execute on a different, worker thread!
-	void Get(std::wstring strUrl, OnFinishCallback fnOnFinish);
+	// The callback is called exactly once per request.  If pValidators is given, the request is
+	// conditional on its ETag/Last-Modified, and is answered with 304 if the resource hasn't changed
+	RequestId Get(std::wstring strUrl, OnFinishCallback fnOnFinish, const HttpCacheInfo* pValidators = nullptr);
+
+	// Cancels a request, if it is still active.  The callback is called synchronously in this case
+	// with nStatus = -ERROR_INTERNET_OPERATION_CANCELLED.  The fetch itself goes on as long as
+	// other requests coalesced with it are still waiting for it
+	void Cancel(RequestId id);
+
+	struct Stats
+	{
+		// requests made (Get() calls), fetches actually sent, and requests which attached
+		// to a fetch already in flight instead
+		unsigned long long nRequests, nFetches, nCoalesced;
+		// fetches cancelled because all of their waiters were
+		unsigned long long nFetchesCancelled;
+		// requests failed right away because of an open circuit breaker, times a breaker has
+		// opened, and servers whose breaker is open now
+		unsigned long long nRejected, nCircuitsOpened;
+		size_t nServersDown;
+	};
+	Stats stats();
+
+	// whether requests to the server of strUrl would be sent, rather than failed right away by its
+	// circuit breaker.  E. g. for bulk downloads to hold off instead of failing everything
+	bool IsServerAvailable(const std::wstring& strUrl);
+	// when requests to the server of strUrl may be sent again (now()), or 0 if they
+	// would be sent now.  While the probe is out, that is unknown, so it is a short while from now
+	ULONGLONG ServerRetryTime(const std::wstring& strUrl);
+
+	// clock for circuit breakers, ms: GetTickCount64() unless replaced, e. g. by tests which
+	// would rather not wait for a server to be tried again.  Whoever compares times with
+	// ServerRetryTime() should use now() too.  Must be set before any requests are made
+	typedef std::function<ULONGLONG()> Clock;
+	void SetClock(Clock fnClock) { m_fnClock = std::move(fnClock); }
+	ULONGLONG now() const { return m_fnClock(); }
+
+	// consecutive failures after which a server's circuit breaker opens, and how long it stays
+	// open before a probe request is let through; doubled after each failed probe, up to the max.
+	// Retry-After is honored up to the max too
+	static constexpr unsigned CIRCUIT_FAILURE_THRESHOLD = 5;
+	static constexpr unsigned CIRCUIT_OPEN_MS = 5000;
+	static constexpr unsigned CIRCUIT_MAX_OPEN_MS = 5 * 60 * 1000;
+	// how often to ask again, ms, while waiting for the probe (see ServerRetryTime())
+	static constexpr unsigned CIRCUIT_PROBE_RECHECK_MS = 250;
 
 private:
-	// base WinInet handle
-	HINTERNET m_hInternet;
+	std::unique_ptr<HttpTransport> m_pTransport;
+
+	// a fetch in flight, and the requests waiting for it (at least one, until it is cancelled)
+	struct Flight
+	{
+		std::wstring strKey;
+		// underlying request, 0 until it is started
+		RequestId idRequest = 0;
+		std::vector<std::pair<RequestId, OnFinishCallback>> vecWaiters;
+		// finished or cancelled, and no longer in m_mapFlights
+		bool bDone = false;
+		bool bCancelled = false;
+		// server (scheme://host:port) for its circuit breaker, and whether this is its probe
+		std::wstring strServer;
+		bool bProbe = false;
+	};
 
-	// structure for keeping track of a request
-	struct HttpRequest
+	// circuit breaker state of a server
+	struct ServerHealth
 	{
-		HttpClient& client;
-		std::wstring strUrl;
-		OnFinishCallback fnOnFinish;
-		HINTERNET hRequest = nullptr;
-		INTERNET_BUFFERS buffers = { sizeof(INTERNET_BUFFERS) };
-		void* pBuffer = nullptr;
-		size_t sizeLength = 0;
-
-		HttpRequest(HttpClient& client, std::wstring strUrl, OnFinishCallback fnOnFinish) :
-			client(client), strUrl(strUrl), fnOnFinish(fnOnFinish) {}
+		// failures in a row
+		unsigned nFailures = 0;
+		// open: requests fail right away until tmOpenUntil (now()), and then a single
+		// probe is let through; nOpenMs is how long it was open for the last time
+		bool bOpen = false;
+		bool bProbing = false;
+		ULONGLONG tmOpenUntil = 0;
+		unsigned nOpenMs = 0;
 	};
 
-	// async callback, dwContext should be a pointer to HttpRequest
-	static void StaticInternetStatusCallback(
-		HINTERNET hInternet,
-		DWORD_PTR dwContext,
-		DWORD dwInternetStatus,
-		LPVOID lpvStatusInformation,
-		DWORD dwStatusInformationLength
-	);
-
-	// wrapped callback
-	void InternetStatusCallback(
-		HttpRequest &request,
-		HINTERNET hInternet,
-		DWORD dwInternetStatus,
-		LPVOID lpvStatusInformation,
-		DWORD dwStatusInformationLength
-	);
-
-	// stop a request (if active) and delete HttpRequest structure
-	void Terminate(HINTERNET hRequest, bool bKeepBuffer = false);
-
-	// currently active requests, and a mutex to sync changes to it
-	std::vector<std::unique_ptr<HttpRequest>> m_vecRequests;
-	std::mutex m_vecRequestsMutex;
+	// fetches in flight by key, see FlightKey()
+	std::unordered_map<std::wstring, std::shared_ptr<Flight>> m_mapFlights;
+	// the flight each waiting request is in, so that Cancel() doesn't search all of them (a view
+	// change cancels many requests at once); under the same lock as flights
+	std::unordered_map<RequestId, std::shared_ptr<Flight>> m_mapWaiters;
+	// by server, under the same lock as flights
+	std::unordered_map<std::wstring, ServerHealth> m_mapServers;
+	std::mutex m_mapFlightsMutex;
+	Stats m_stats = {};
+	Clock m_fnClock = []() { return GetTickCount64(); };
+
+	// identity of a request, for coalescing: the URL, with case-insensitive parts (scheme and host)
+	// lowercased and the port made explicit, plus validators, if any.  strServer is set to
+	// scheme://host:port of it, normalized likewise
+	static std::wstring FlightKey(const std::wstring& strUrl, const HttpCacheInfo* pValidators, std::wstring& strServer);
+	// whether a request to the server may go now, and if it is to be the probe.  Under lock
+	bool AdmitRequest(const std::wstring& strServer, bool& bProbe);
+	// updates circuit breaker of a server with the outcome of a fetch.  Under lock
+	void RecordOutcome(Flight& flight, int nStatus, const HttpCacheInfo& cacheInfo);
+	// hands the response of a fetch over to all of its waiters
+	void FinishFlight(std::shared_ptr<Flight> pFlight, int nStatus, ResponseBuffer buffer, const HttpCacheInfo& cacheInfo);
+
+	// starts an actual request on the transport, with its own id, not coalesced with anything
+	RequestId StartRequest(const std::wstring& strUrl, OnFinishCallback fnOnFinish, const HttpCacheInfo* pValidators);
+
+	// shared by coalesced requests and actual ones, taken without any lock
+	std::atomic<RequestId> m_nLastRequestId = 0;
 };
 
@@ -0,0 +1,181 @@
+// HttpTransport.cpp: URL parsing and caching headers, shared by all transports
+
+#include "framework.h"
+#include "Util.h"
+#include "HttpTransport.h"
+
+bool ParseUrl(const std::wstring& strUrl, HttpUrl& url)
+{
+	size_t nSchemeEnd = strUrl.find(L"://");
+	if (nSchemeEnd == std::wstring::npos || nSchemeEnd == 0) {
+		return false;
+	}
+	url.strScheme = strUrl.substr(0, nSchemeEnd);
+	std::transform(url.strScheme.begin(), url.strScheme.end(), url.strScheme.begin(), towlower);
+	if (url.strScheme == L"http") {
+		url.nPort = 80;
+	} else if (url.strScheme == L"https") {
+		url.nPort = 443;
+	} else {
+		return false;
+	}
+
+	size_t nAuthority = nSchemeEnd + 3;
+	size_t nPathStart = strUrl.find_first_of(L"/?#", nAuthority);
+	if (nPathStart == std::wstring::npos) {
+		nPathStart = strUrl.size();
+	}
+	std::wstring strAuthority = strUrl.substr(nAuthority, nPathStart - nAuthority);
+	// user info, if any, is not ours to send anywhere
+	size_t nAt = strAuthority.rfind(L'@');
+	if (nAt != std::wstring::npos) {
+		strAuthority.erase(0, nAt + 1);
+	}
+	// port after the host; IPv6 addresses are in brackets, as they have colons of their own
+	size_t nHostEnd = strAuthority.size();
+	if (!strAuthority.empty() && strAuthority[0] == L'[') {
+		size_t nBracket = strAuthority.find(L']');
+		if (nBracket == std::wstring::npos) {
+			return false;
+		}
+		url.strHost = strAuthority.substr(1, nBracket - 1);
+		nHostEnd = nBracket + 1;
+		if (nHostEnd < strAuthority.size() && strAuthority[nHostEnd] != L':') {
+			return false;
+		}
+	} else {
+		nHostEnd = std::min(strAuthority.find(L':'), strAuthority.size());
+		url.strHost = strAuthority.substr(0, nHostEnd);
+	}
+	if (url.strHost.empty()) {
+		return false;
+	}
+	std::transform(url.strHost.begin(), url.strHost.end(), url.strHost.begin(), towlower);
+	if (nHostEnd + 1 < strAuthority.size()) {
+		unsigned nPort = 0;
+		for (size_t n = nHostEnd + 1; n < strAuthority.size(); n++) {
+			if (strAuthority[n] < L'0' || strAuthority[n] > L'9' || (nPort = nPort * 10 + (strAuthority[n] - L'0')) > 65535) {
+				return false;
+			}
+		}
+		if (!nPort) {
+			return false;
+		}
+		url.nPort = (unsigned short)nPort;
+	}
+
+	// the fragment is only for the client
+	url.strPath = strUrl.substr(nPathStart, strUrl.find(L'#', nPathStart) - nPathStart);
+	if (url.strPath.empty() || url.strPath[0] != L'/') {
+		url.strPath.insert(0, 1, L'/');
+	}
+	return true;
+}
+
+// days since 1970-01-01 of a date in the proleptic Gregorian calendar
+static long long DaysFromCivil(int nYear, unsigned nMonth, unsigned nDay)
+{
+	nYear -= nMonth <= 2;
+	int nEra = (nYear >= 0 ? nYear : nYear - 399) / 400;
+	unsigned nYearOfEra = (unsigned)(nYear - nEra * 400);
+	unsigned nDayOfYear = (153 * (nMonth > 2 ? nMonth - 3 : nMonth + 9) + 2) / 5 + nDay - 1;
+	unsigned nDayOfEra = nYearOfEra * 365 + nYearOfEra / 4 - nYearOfEra / 100 + nDayOfYear;
+	return (long long)nEra * 146097 + nDayOfEra - 719468;
+}
+
+long long ParseHttpDate(const std::string& strDate)
+{
+	// all three formats have the day before the year, and a month name and a time somewhere:
+	// "Sun, 06 Nov 1994 08:49:37 GMT", "Sunday, 06-Nov-94 08:49:37 GMT", "Sun Nov  6 08:49:37 1994"
+	static const char* const MONTHS[] = { "jan", "feb", "mar", "apr", "may", "jun", "jul", "aug", "sep", "oct", "nov", "dec" };
+	int nDay = -1, nYear = -1, nMonth = -1, nHour = -1, nMinute = -1, nSecond = -1;
+	size_t n = 0;
+	while (n < strDate.size()) {
+		size_t nEnd = strDate.find_first_of(" ,-", n);
+		if (nEnd == std::string::npos) {
+			nEnd = strDate.size();
+		}
+		std::string_view token(strDate.data() + n, nEnd - n);
+		n = nEnd + 1;
+		if (token.empty()) {
+			continue;
+		}
+		if (token.find(':') != std::string_view::npos) {
+			if (token.size() != 8 || token[2] != ':' || token[5] != ':' ||
+				std::from_chars(token.data(), token.data() + 2, nHour).ec != std::errc() ||
+				std::from_chars(token.data() + 3, token.data() + 5, nMinute).ec != std::errc() ||
+				std::from_chars(token.data() + 6, token.data() + 8, nSecond).ec != std::errc()) {
+				return 0;
+			}
+		} else if (token[0] >= '0' && token[0] <= '9') {
+			int nValue = 0;
+			if (std::from_chars(token.data(), token.data() + token.size(), nValue).ec != std::errc()) {
+				return 0;
+			}
+			if (nDay < 0) {
+				nDay = nValue;
+			} else if (nYear < 0) {
+				// two-digit years of RFC 850
+				nYear = token.size() <= 2 ? nValue + (nValue < 70 ? 2000 : 1900) : nValue;
+			}
+		} else if (token.size() == 3) {
+			std::string strMonth(token);
+			std::transform(strMonth.begin(), strMonth.end(), strMonth.begin(), [](char c) { return (char)tolower(c); });
+			for (int nIndex = 0; nIndex < 12; nIndex++) {
+				if (strMonth == MONTHS[nIndex]) {
+					nMonth = nIndex + 1;
+				}
+			}
+		}
+	}
+	if (nDay < 1 || nDay > 31 || nMonth < 1 || nYear < 1970 || nHour < 0 || nHour > 23 || nMinute < 0 || nMinute > 59 || nSecond < 0 || nSecond > 60) {
+		return 0;
+	}
+	return DaysFromCivil(nYear, nMonth, nDay) * 86400 + nHour * 3600 + nMinute * 60 + nSecond;
+}
+
+void ParseCacheHeaders(unsigned nStatus, const std::function<std::string(const char* pszName)>& fnHeader, HttpCacheInfo& cacheInfo)
+{
+	if (nStatus == HTTP_STATUS_TOO_MANY_REQUESTS || nStatus == HTTP_STATUS_SERVICE_UNAVAIL) {
+		// either a number of seconds, or a date, relative to the server's clock if it says what time it is
+		std::string strRetryAfter = fnHeader("Retry-After");
+		unsigned nSeconds = 0;
+		if (std::from_chars(strRetryAfter.c_str(), strRetryAfter.c_str() + strRetryAfter.size(), nSeconds).ec == std::errc()) {
+			cacheInfo.nRetryAfter = nSeconds;
+		} else if (long long llRetryAfter = ParseHttpDate(strRetryAfter)) {
+			long long llDate = ParseHttpDate(fnHeader("Date"));
+			cacheInfo.nRetryAfter = (unsigned)std::clamp(llRetryAfter - (llDate ? llDate : GetUnixTime()), 0ll, (long long)UINT_MAX);
+		}
+		return;
+	}
+	if (nStatus != HTTP_STATUS_NOT_MODIFIED && (nStatus < 200 || nStatus > 299)) {
+		return;
+	}
+
+	cacheInfo.strETag = fnHeader("ETag");
+	cacheInfo.strLastModified = fnHeader("Last-Modified");
+
+	// freshness is relative to the server's clock: Expires against Date, max-age against the age
+	// the response already had in caches on the way
+	long long llNow = GetUnixTime();
+	long long llDate = ParseHttpDate(fnHeader("Date"));
+	std::string strCacheControl = fnHeader("Cache-Control");
+	std::transform(strCacheControl.begin(), strCacheControl.end(), strCacheControl.begin(), [](char c) { return (char)tolower(c); });
+	size_t nMaxAge = strCacheControl.find("max-age=");
+	if (strCacheControl.find("no-cache") != std::string::npos || strCacheControl.find("no-store") != std::string::npos) {
+		cacheInfo.llExpires = 0;
+	} else if (nMaxAge != std::string::npos) {
+		long long llMaxAge = 0, llAge = 0;
+		const char* p = strCacheControl.c_str() + nMaxAge + 8;
+		std::from_chars(p, strCacheControl.c_str() + strCacheControl.size(), llMaxAge);
+		std::string strAge = fnHeader("Age");
+		std::from_chars(strAge.c_str(), strAge.c_str() + strAge.size(), llAge);
+		cacheInfo.llExpires = llNow + std::max(llMaxAge - llAge, 0ll);
+	} else if (long long llExpires = ParseHttpDate(fnHeader("Expires"))) {
+		cacheInfo.llExpires = llNow + std::max(llExpires - (llDate ? llDate : llNow), 0ll);
+	} else if (long long llLastModified = ParseHttpDate(cacheInfo.strLastModified)) {
+		cacheInfo.llExpires = llNow + std::max((llDate ? llDate : llNow) - llLastModified, 0ll) / 10;
+	} else {
+		cacheInfo.llExpires = 0;
+	}
+}
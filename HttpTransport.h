@@ -0,0 +1,70 @@
+#pragma once
+
+// HttpTransport.h: the part of HttpClient which actually talks to servers, behind an interface so
+// that there can be more than one: WinInetTransport on Windows, and SocketTransport (non-blocking
+// sockets and epoll) elsewhere.  A transport only sends single GET requests and reports their
+// responses; coalescing of identical requests and circuit breakers are up to HttpClient, on top.
+// Also here: what all transports need to do the same way, URL parsing and interpreting caching
+// headers of responses.
+
+// not in older SDKs' wininet.h
+#ifndef HTTP_STATUS_TOO_MANY_REQUESTS
+#define HTTP_STATUS_TOO_MANY_REQUESTS 429
+#endif
+
+// caching headers of a response, or validators for a conditional request.  Also carries
+// Retry-After, which isn't about caching, but is about when to ask again
+struct HttpCacheInfo
+{
+	// ETag and Last-Modified header values as received, empty if none
+	std::string strETag, strLastModified;
+	// until when the response is fresh, seconds since 1970 (see GetUnixTime()): from Cache-Control
+	// max-age or Expires, or a tenth of the time since Last-Modified (as RFC 7234 suggests) if
+	// neither is there.  0 if the server says nothing, which means it should always be revalidated
+	long long llExpires = 0;
+	// for 429 and 503 responses, seconds to wait before trying again, from Retry-After; 0 if none
+	unsigned nRetryAfter = 0;
+};
+
+#include "ResponseBuffer.h"
+
+class HttpTransport
+{
+public:
+	virtual ~HttpTransport() {}
+
+	// see HttpClient::OnFinishCallback, which is the same
+	typedef std::function<void(int nStatus, ResponseBuffer buffer, const HttpCacheInfo& cacheInfo)> OnFinishCallback;
+	typedef unsigned long long RequestId;
+
+	// starts a GET request, identified by id from then on (ids are chosen by the caller and never
+	// reused).  The callback is called exactly once, on a worker thread, or right away from Start()
+	// if the request can't even be started.  If pValidators is given, the request is conditional
+	virtual void Start(RequestId id, const std::wstring& strUrl, const HttpCacheInfo* pValidators, OnFinishCallback fnOnFinish) = 0;
+
+	// cancels a request, if it is still active.  The callback is called synchronously in this
+	// case with nStatus = -ERROR_INTERNET_OPERATION_CANCELLED
+	virtual void Cancel(RequestId id) = 0;
+};
+
+// parts of an URL that matter for making a request
+struct HttpUrl
+{
+	// lowercase, as scheme and host are case-insensitive
+	std::wstring strScheme, strHost;
+	// explicit or default for the scheme
+	unsigned short nPort = 0;
+	// path and query, "/" if there is neither; without the fragment
+	std::wstring strPath;
+};
+
+// splits an absolute http or https URL into parts; false if it isn't one
+bool ParseUrl(const std::wstring& strUrl, HttpUrl& url);
+
+// an HTTP date (RFC 7231 IMF-fixdate, or the obsolete RFC 850 and asctime formats) as seconds
+// since 1970, or 0 if it isn't one
+long long ParseHttpDate(const std::string& strDate);
+
+// fills cacheInfo from headers of a response with nStatus: caching headers for 2xx and 304,
+// Retry-After for 429 and 503.  fnHeader gets the value of a header by name, empty if none
+void ParseCacheHeaders(unsigned nStatus, const std::function<std::string(const char* pszName)>& fnHeader, HttpCacheInfo& cacheInfo);
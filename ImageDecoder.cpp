@@ -0,0 +1,148 @@
+// ImageDecoder.cpp: WicImageDecoder implementation
+
+#include "framework.h"
+#include "Util.h"
+#include "ImageDecoder.h"
+#include "PixelConvert.h"
+
+WicImageDecoder::WicImageDecoder()
+{
+	HRESULT hr = CoCreateInstance(CLSID_WICImagingFactory,
+		nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(m_pWICFactory.GetAddressOf()));
+	_ASSERT(SUCCEEDED(hr));
+}
+
+bool WicImageDecoder::Decode(const void* pData, size_t szLength, DecodedImage& image)
+{
+	// will use a bunch of objects from WIC
+	HRESULT hr;
+	ComPtr<IWICStream> pStream;
+	ComPtr<IWICBitmapDecoder> pDecoder;
+	ComPtr<IWICBitmapFrameDecode> pFrame;
+	ComPtr<IWICFormatConverter> pConverter;
+
+	// wrap buffer into a stream which WIC expects.  Unlike SHCreateMemStream(), this
+	// does not copy the data, which might be coming directly from the cache file mapping
+	hr = m_pWICFactory->CreateStream(pStream.GetAddressOf());
+	_ASSERT(SUCCEEDED(hr));
+	hr = pStream->InitializeFromMemory(const_cast<BYTE*>(reinterpret_cast<const BYTE*>(pData)), (DWORD)szLength);
+	_ASSERT(SUCCEEDED(hr));
+
+	// some straightforward WIC stuff, just keep track of errors at every stip
+	hr = m_pWICFactory->CreateDecoderFromStream(pStream.Get(), nullptr, WICDecodeMetadataCacheOnDemand, pDecoder.GetAddressOf());
+	if (FAILED(hr)) {
+		PrintLnDebug(L"Failed to create decoder for buffer 0x{:x}, HRESULT = {}", (intptr_t)pData, (intptr_t)hr);
+		return false;
+	}
+	hr = pDecoder->GetFrame(0, pFrame.GetAddressOf());
+	if (FAILED(hr)) {
+		PrintLnDebug(L"Failed to retrieve frame for buffer 0x{:x}, HRESULT = {}", (intptr_t)pData, (intptr_t)hr);
+		return false;
+	}
+	UINT nWidth, nHeight;
+	hr = pFrame->GetSize(&nWidth, &nHeight);
+	if (FAILED(hr)) {
+		return false;
+	}
+	image.nWidth = nWidth;
+	image.nHeight = nHeight;
+	image.vecPixels.resize((size_t)image.stride() * nHeight);
+
+	// formats tile servers commonly send are converted by our own code, anything else by WIC
+	WICPixelFormatGUID pixelFormat;
+	hr = pFrame->GetPixelFormat(&pixelFormat);
+	PixelSourceFormat sourceFormat;
+	if (SUCCEEDED(hr) && GetSourceFormat(pixelFormat, sourceFormat)) {
+		return CopyPixels(pFrame.Get(), sourceFormat, image);
+	}
+
+	hr = m_pWICFactory->CreateFormatConverter(pConverter.GetAddressOf());
+	_ASSERT(SUCCEEDED(hr));  // surely cannot fail
+	hr = pConverter->Initialize(
+		pFrame.Get(),                    // Input bitmap to convert
+		GUID_WICPixelFormat32bppPBGRA,   // Destination pixel format
+		WICBitmapDitherTypeNone,         // Specified dither pattern
+		nullptr,                         // Specify a particular palette 
+		0.f,                             // Alpha threshold
+		WICBitmapPaletteTypeCustom       // Palette translation type
+	);
+	if (FAILED(hr)) {
+		PrintLnDebug(L"Failed to initialize converter for buffer 0x{:x}, HRESULT = {}", (intptr_t)pData, (intptr_t)hr);
+		return false;
+	}
+	hr = pConverter->CopyPixels(nullptr, image.stride(), (UINT)image.vecPixels.size(), image.vecPixels.data());
+	if (FAILED(hr)) {
+		PrintLnDebug(L"Failed to decode pixels for buffer 0x{:x}, HRESULT = {}", (intptr_t)pData, (intptr_t)hr);
+		return false;
+	}
+	return true;
+}
+
+bool WicImageDecoder::GetSourceFormat(const WICPixelFormatGUID& pixelFormat, PixelSourceFormat& sourceFormat)
+{
+	static const struct {
+		const GUID* pGuid;
+		PixelSourceFormat format;
+	} FORMATS[] = {
+		{ &GUID_WICPixelFormat8bppGray, PSF_GRAY8 },
+		{ &GUID_WICPixelFormat8bppIndexed, PSF_INDEXED8 },
+		{ &GUID_WICPixelFormat24bppRGB, PSF_RGB24 },
+		{ &GUID_WICPixelFormat24bppBGR, PSF_BGR24 },
+		{ &GUID_WICPixelFormat32bppRGBA, PSF_RGBA32 },
+		{ &GUID_WICPixelFormat32bppBGRA, PSF_BGRA32 },
+		{ &GUID_WICPixelFormat32bppBGR, PSF_BGRX32 },
+		{ &GUID_WICPixelFormat32bppPBGRA, PSF_PBGRA32 },
+	};
+	for (auto& entry : FORMATS) {
+		if (IsEqualGUID(pixelFormat, *entry.pGuid)) {
+			sourceFormat = entry.format;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool WicImageDecoder::CopyPixels(IWICBitmapFrameDecode* pFrame, PixelSourceFormat sourceFormat, DecodedImage& image)
+{
+	HRESULT hr;
+
+	// palette, converted to premultiplied BGRA upfront
+	UINT32 palette[256] = {};
+	if (sourceFormat == PSF_INDEXED8) {
+		ComPtr<IWICPalette> pPalette;
+		hr = m_pWICFactory->CreatePalette(pPalette.GetAddressOf());
+		_ASSERT(SUCCEEDED(hr));
+		UINT nColors = 0;
+		hr = pFrame->CopyPalette(pPalette.Get());
+		if (SUCCEEDED(hr)) {
+			hr = pPalette->GetColors(256, reinterpret_cast<WICColor*>(palette), &nColors);
+		}
+		if (FAILED(hr)) {
+			PrintLnDebug(L"Failed to get palette, HRESULT = {}", (intptr_t)hr);
+			return false;
+		}
+		for (UINT i = 0; i < nColors; i++) {
+			palette[i] = PremultiplyColor(palette[i]);
+		}
+	}
+
+	// 32bpp formats are decoded right into the destination and converted in place,
+	// others go through a temporary buffer
+	unsigned nSourceStride = image.nWidth * PixelSourceBytes(sourceFormat);
+	std::vector<BYTE> vecSource;
+	BYTE* pSource = image.vecPixels.data();
+	if (nSourceStride != image.stride()) {
+		vecSource.resize((size_t)nSourceStride * image.nHeight);
+		pSource = vecSource.data();
+	}
+	hr = pFrame->CopyPixels(nullptr, nSourceStride, nSourceStride * image.nHeight, pSource);
+	if (FAILED(hr)) {
+		PrintLnDebug(L"Failed to decode pixels, HRESULT = {}", (intptr_t)hr);
+		return false;
+	}
+	for (unsigned y = 0; y < image.nHeight; y++) {
+		ConvertToPBGRA(sourceFormat, pSource + (size_t)y * nSourceStride,
+			reinterpret_cast<UINT32*>(image.vecPixels.data() + (size_t)y * image.stride()), image.nWidth, palette);
+	}
+	return true;
+}
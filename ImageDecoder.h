@@ -0,0 +1,49 @@
+#pragma once
+
+// ImageDecoder.h: interface for decoding tile images into raw pixels, and its default
+// implementation using WIC (Windows Imaging Component).  Decoders are used from
+// DecodePool worker threads, so Decode() must be thread safe.
+
+#include "ComPtr.h"
+#include "PixelConvert.h"
+
+// Decoded image, always 32bpp premultiplied BGRA (what Direct2D wants), rows tightly packed
+struct DecodedImage
+{
+	unsigned nWidth = 0;
+	unsigned nHeight = 0;
+	std::vector<BYTE> vecPixels;
+
+	unsigned stride() const { return nWidth * 4; }
+};
+
+class ImageDecoder
+{
+public:
+	virtual ~ImageDecoder() {}
+
+	// decodes image from memory, returns false on failure
+	virtual bool Decode(const void* pData, size_t szLength, DecodedImage& image) = 0;
+};
+
+#ifdef _WIN32
+// Decodes any image format WIC supports (in practice, PNG and JPEG are what tile servers send).
+// Common pixel formats are converted to premultiplied BGRA with our own SIMD code (see PixelConvert.h),
+// and only the rest with WIC's generic format converter
+class WicImageDecoder : public ImageDecoder
+{
+public:
+	WicImageDecoder();
+
+	bool Decode(const void* pData, size_t szLength, DecodedImage& image) override;
+
+private:
+	// maps WIC pixel format to one we can convert ourselves, returns false if we can't
+	static bool GetSourceFormat(const WICPixelFormatGUID& pixelFormat, PixelSourceFormat& sourceFormat);
+	// gets pixels from frame in its native format and converts them
+	bool CopyPixels(IWICBitmapFrameDecode* pFrame, PixelSourceFormat sourceFormat, DecodedImage& image);
+
+	// WIC imaging factory is free-threaded, so one instance can be shared by all threads
+	ComPtr<IWICImagingFactory> m_pWICFactory;
+};
+#endif
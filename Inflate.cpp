@@ -0,0 +1,392 @@
+// Inflate.cpp: zlib stream decompression
+
+#include "framework.h"
+#include "Inflate.h"
+
+// codes up to this long are decoded by one table lookup, longer ones bit by bit
+static const unsigned FAST_BITS = 10;
+static const unsigned MAX_CODE_BITS = 15;
+
+// lengths and distances of matches: base values of their symbols, and extra bits that follow
+static const uint16_t LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const BYTE LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t DISTANCE_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const BYTE DISTANCE_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+// order in which a dynamic block sends the code lengths of its code length code
+static const BYTE CODE_LENGTH_ORDER[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+// canonical Huffman code, as DEFLATE defines one by the code lengths of its symbols
+struct HuffmanCode
+{
+	// by the next FAST_BITS bits of input: symbol | length << 9, or 0 for codes longer than that
+	uint16_t fast[1 << FAST_BITS];
+	// number of codes of each length, and symbols in the order of their codes, for longer codes
+	uint16_t count[MAX_CODE_BITS + 1];
+	uint16_t symbols[288];
+
+	// fails if the lengths don't make a code, i. e. there are more codes of some length than
+	// there is room for.  Incomplete codes are fine (e. g. a single distance code), input which
+	// uses the codes that are missing fails to decode
+	bool Build(const BYTE* pLengths, unsigned nSymbols)
+	{
+		memset(count, 0, sizeof(count));
+		for (unsigned n = 0; n < nSymbols; n++) {
+			count[pLengths[n]]++;
+		}
+		count[0] = 0;
+		int nLeft = 1;
+		for (unsigned nBits = 1; nBits <= MAX_CODE_BITS; nBits++) {
+			nLeft = nLeft * 2 - count[nBits];
+			if (nLeft < 0) {
+				return false;
+			}
+		}
+		uint16_t offsets[MAX_CODE_BITS + 1];
+		offsets[1] = 0;
+		for (unsigned nBits = 1; nBits < MAX_CODE_BITS; nBits++) {
+			offsets[nBits + 1] = offsets[nBits] + count[nBits];
+		}
+		for (unsigned n = 0; n < nSymbols; n++) {
+			if (pLengths[n]) {
+				symbols[offsets[pLengths[n]]++] = (uint16_t)n;
+			}
+		}
+
+		// codes come most significant bit first, and input is taken from the low bits up, so
+		// the table is indexed by codes reversed; an entry for every value of the bits after them
+		memset(fast, 0, sizeof(fast));
+		unsigned nCode = 0, nIndex = 0;
+		for (unsigned nBits = 1; nBits <= FAST_BITS; nBits++) {
+			for (unsigned n = 0; n < count[nBits]; n++, nCode++, nIndex++) {
+				unsigned nReversed = 0;
+				for (unsigned nBit = 0; nBit < nBits; nBit++) {
+					nReversed |= ((nCode >> nBit) & 1) << (nBits - 1 - nBit);
+				}
+				for (unsigned nEntry = nReversed; nEntry < (1u << FAST_BITS); nEntry += 1u << nBits) {
+					fast[nEntry] = (uint16_t)(symbols[nIndex] | nBits << 9);
+				}
+			}
+			nCode <<= 1;
+		}
+		return true;
+	}
+};
+
+// DEFLATE input, bits taken from the low end of each byte first.  All reads fail (return false)
+// rather than go past the end
+class BitReader
+{
+public:
+	BitReader(const BYTE* p, const BYTE* pEnd) : m_p(p), m_pEnd(pEnd) {}
+
+	// fills the bit buffer up to at least 57 bits, as far as there is input
+	void Refill()
+	{
+		if (m_pEnd - m_p >= 8) {
+			// a whole word at once (little endian): the bytes which don't fit now are read
+			// again next time
+			uint64_t nWord;
+			memcpy(&nWord, m_p, 8);
+			m_nBuffer |= nWord << m_nBits;
+			m_p += (63 - m_nBits) >> 3;
+			m_nBits |= 56;
+			return;
+		}
+		while (m_nBits <= 56 && m_p < m_pEnd) {
+			m_nBuffer |= (uint64_t)*m_p++ << m_nBits;
+			m_nBits += 8;
+		}
+	}
+
+	// nBits bits (up to 32) as a number, the first one lowest
+	bool Read(unsigned nBits, unsigned& nValue)
+	{
+		if (m_nBits < nBits) {
+			Refill();
+			if (m_nBits < nBits) {
+				return false;
+			}
+		}
+		nValue = (unsigned)(m_nBuffer & ((1ull << nBits) - 1));
+		m_nBuffer >>= nBits;
+		m_nBits -= nBits;
+		return true;
+	}
+
+	bool Decode(const HuffmanCode& code, unsigned& nSymbol)
+	{
+		if (m_nBits < MAX_CODE_BITS) {
+			Refill();
+		}
+		// bits past the end of the input may be anything, hence the check of the length
+		unsigned nEntry = code.fast[m_nBuffer & ((1u << FAST_BITS) - 1)];
+		if (nEntry) {
+			unsigned nBits = nEntry >> 9;
+			if (nBits > m_nBits) {
+				return false;
+			}
+			m_nBuffer >>= nBits;
+			m_nBits -= nBits;
+			nSymbol = nEntry & 511;
+			return true;
+		}
+		// a longer code (or none): the canonical way, a bit at a time.  nCode is what has been
+		// read so far, nFirst the first code of that length, and nIndex its symbol
+		int nCode = 0, nFirst = 0, nIndex = 0;
+		for (unsigned nBits = 1; nBits <= MAX_CODE_BITS && nBits <= m_nBits; nBits++) {
+			nCode |= (int)((m_nBuffer >> (nBits - 1)) & 1);
+			int nCount = code.count[nBits];
+			if (nCode - nCount < nFirst) {
+				m_nBuffer >>= nBits;
+				m_nBits -= nBits;
+				nSymbol = code.symbols[nIndex + (nCode - nFirst)];
+				return true;
+			}
+			nIndex += nCount;
+			nFirst = (nFirst + nCount) << 1;
+			nCode <<= 1;
+		}
+		return false;
+	}
+
+	// skips to the next byte boundary, for stored blocks and the checksum
+	void AlignToByte()
+	{
+		m_nBuffer >>= m_nBits & 7;
+		m_nBits &= ~7u;
+	}
+
+	// copies whole bytes, once aligned
+	bool ReadBytes(BYTE* pOut, size_t szLength)
+	{
+		for (; szLength && m_nBits; szLength--) {
+			*pOut++ = (BYTE)m_nBuffer;
+			m_nBuffer >>= 8;
+			m_nBits -= 8;
+		}
+		if (!szLength) {
+			return true;
+		}
+		if (szLength > (size_t)(m_pEnd - m_p)) {
+			return false;
+		}
+		memcpy(pOut, m_p, szLength);
+		m_p += szLength;
+		// the buffer is empty now, so bits left in it from a word read aren't valid anymore
+		m_nBuffer = 0;
+		return true;
+	}
+
+private:
+	const BYTE* m_p;
+	const BYTE* m_pEnd;
+	uint64_t m_nBuffer = 0;
+	unsigned m_nBits = 0;
+};
+
+// codes of blocks compressed with the fixed codes, built once
+struct FixedCodes
+{
+	HuffmanCode literals, distances;
+
+	FixedCodes()
+	{
+		BYTE lengths[288];
+		std::fill_n(lengths, 144, 8);
+		std::fill_n(lengths + 144, 112, 9);
+		std::fill_n(lengths + 256, 24, 7);
+		std::fill_n(lengths + 280, 8, 8);
+		literals.Build(lengths, 288);
+		std::fill_n(lengths, 30, 5);
+		distances.Build(lengths, 30);
+	}
+};
+
+// reads the codes of a block compressed with dynamic codes, which come first in it
+static bool ReadDynamicCodes(BitReader& reader, HuffmanCode& literals, HuffmanCode& distances)
+{
+	unsigned nLiterals, nDistances, nCodeLengths;
+	if (!reader.Read(5, nLiterals) || !reader.Read(5, nDistances) || !reader.Read(4, nCodeLengths)) {
+		return false;
+	}
+	nLiterals += 257;
+	nDistances += 1;
+	nCodeLengths += 4;
+	if (nLiterals > 286 || nDistances > 30) {
+		return false;
+	}
+
+	// code lengths are themselves Huffman coded
+	BYTE lengths[286 + 30] = {};
+	for (unsigned n = 0; n < nCodeLengths; n++) {
+		unsigned nLength;
+		if (!reader.Read(3, nLength)) {
+			return false;
+		}
+		lengths[CODE_LENGTH_ORDER[n]] = (BYTE)nLength;
+	}
+	HuffmanCode lengthCode;
+	if (!lengthCode.Build(lengths, 19)) {
+		return false;
+	}
+
+	// literal/length and distance code lengths as one sequence, runs of repeats allowed across
+	unsigned nTotal = nLiterals + nDistances;
+	memset(lengths, 0, sizeof(lengths));
+	for (unsigned n = 0; n < nTotal; ) {
+		unsigned nSymbol;
+		if (!reader.Decode(lengthCode, nSymbol)) {
+			return false;
+		}
+		if (nSymbol < 16) {
+			lengths[n++] = (BYTE)nSymbol;
+			continue;
+		}
+		BYTE nLength = 0;
+		unsigned nRepeat;
+		bool bRead;
+		if (nSymbol == 16) {
+			// the previous length, 3-6 times
+			if (!n) {
+				return false;
+			}
+			nLength = lengths[n - 1];
+			bRead = reader.Read(2, nRepeat);
+			nRepeat += 3;
+		} else if (nSymbol == 17) {
+			bRead = reader.Read(3, nRepeat);
+			nRepeat += 3;
+		} else {
+			bRead = reader.Read(7, nRepeat);
+			nRepeat += 11;
+		}
+		if (!bRead || nRepeat > nTotal - n) {
+			return false;
+		}
+		std::fill_n(lengths + n, nRepeat, nLength);
+		n += nRepeat;
+	}
+	// a block without an end is no block
+	if (!lengths[256]) {
+		return false;
+	}
+	return literals.Build(lengths, nLiterals) && distances.Build(lengths + nLiterals, nDistances);
+}
+
+// decodes the data of a compressed block, up to its end symbol
+static bool InflateBlock(BitReader& reader, const HuffmanCode& literals, const HuffmanCode& distances,
+	BYTE* pOut, size_t szOut, size_t& nPos)
+{
+	while (true) {
+		unsigned nSymbol;
+		if (!reader.Decode(literals, nSymbol)) {
+			return false;
+		}
+		if (nSymbol < 256) {
+			if (nPos == szOut) {
+				return false;
+			}
+			pOut[nPos++] = (BYTE)nSymbol;
+			continue;
+		}
+		if (nSymbol == 256) {
+			return true;
+		}
+
+		// a match: length, then distance back into what has been decoded so far
+		nSymbol -= 257;
+		unsigned nExtra, nDistanceSymbol;
+		if (nSymbol >= 29 || !reader.Read(LENGTH_EXTRA[nSymbol], nExtra)) {
+			return false;
+		}
+		size_t nLength = LENGTH_BASE[nSymbol] + nExtra;
+		if (!reader.Decode(distances, nDistanceSymbol) || nDistanceSymbol >= 30 || !reader.Read(DISTANCE_EXTRA[nDistanceSymbol], nExtra)) {
+			return false;
+		}
+		size_t nDistance = DISTANCE_BASE[nDistanceSymbol] + nExtra;
+		if (nDistance > nPos || nLength > szOut - nPos) {
+			return false;
+		}
+		BYTE* pDst = pOut + nPos;
+		const BYTE* pSrc = pDst - nDistance;
+		if (nDistance >= nLength) {
+			memcpy(pDst, pSrc, nLength);
+		} else {
+			// overlapping: repeats the last nDistance bytes, e. g. a run of one byte for distance 1
+			for (size_t n = 0; n < nLength; n++) {
+				pDst[n] = pSrc[n];
+			}
+		}
+		nPos += nLength;
+	}
+}
+
+static uint32_t Adler32(const BYTE* p, size_t sz)
+{
+	uint32_t a = 1, b = 0;
+	while (sz) {
+		// the most bytes after which b can't have overflowed yet
+		size_t nRun = std::min<size_t>(sz, 5552);
+		sz -= nRun;
+		for (; nRun; nRun--) {
+			a += *p++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return b << 16 | a;
+}
+
+bool ZlibInflate(const BYTE* pData, size_t szLength, BYTE* pOut, size_t szOut)
+{
+	// header: DEFLATE with a window of up to 32 KB, no preset dictionary
+	if (szLength < 2 || (pData[0] & 0x0f) != 8 || (pData[0] >> 4) > 7 || (pData[0] << 8 | pData[1]) % 31 || (pData[1] & 0x20)) {
+		return false;
+	}
+
+	static const FixedCodes fixedCodes;
+	BitReader reader(pData + 2, pData + szLength);
+	size_t nPos = 0;
+	unsigned nLast, nType;
+	do {
+		if (!reader.Read(1, nLast) || !reader.Read(2, nType)) {
+			return false;
+		}
+		if (nType == 0) {
+			// stored
+			unsigned nLength, nComplement;
+			reader.AlignToByte();
+			if (!reader.Read(16, nLength) || !reader.Read(16, nComplement) || nLength != (~nComplement & 0xffff) ||
+				nLength > szOut - nPos || !reader.ReadBytes(pOut + nPos, nLength)) {
+				return false;
+			}
+			nPos += nLength;
+		} else if (nType == 1) {
+			if (!InflateBlock(reader, fixedCodes.literals, fixedCodes.distances, pOut, szOut, nPos)) {
+				return false;
+			}
+		} else if (nType == 2) {
+			HuffmanCode literals, distances;
+			if (!ReadDynamicCodes(reader, literals, distances) || !InflateBlock(reader, literals, distances, pOut, szOut, nPos)) {
+				return false;
+			}
+		} else {
+			return false;
+		}
+	} while (!nLast);
+
+	// checksum of the output, most significant byte first
+	reader.AlignToByte();
+	uint32_t nChecksum = 0;
+	for (unsigned n = 0; n < 4; n++) {
+		unsigned nByte;
+		if (!reader.Read(8, nByte)) {
+			return false;
+		}
+		nChecksum = nChecksum << 8 | nByte;
+	}
+	return nPos == szOut && nChecksum == Adler32(pOut, szOut);
+}
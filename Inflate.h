@@ -0,0 +1,12 @@
+#pragma once
+
+// Inflate.h: decompression of zlib streams (RFC 1950): DEFLATE (RFC 1951) with a two byte header
+// and an Adler-32 checksum, which is what the image data of PNG is.  There's no zlib here, and
+// DEFLATE is small enough to decode by hand.  The size of the output must be known up front, as
+// it is for PNG (rows of a known size, each with a filter byte), so it goes straight into the
+// caller's buffer.  Huffman codes are decoded by looking up their first bits in a table, which
+// covers all but the rarest symbols; input is read into a 64-bit buffer a word at a time.
+
+// decompresses a zlib stream into pOut, which must be exactly szOut bytes long.  Fails if the
+// stream is damaged, or its checksum doesn't match, or if it decompresses into more or fewer bytes
+bool ZlibInflate(const BYTE* pData, size_t szLength, BYTE* pOut, size_t szOut);
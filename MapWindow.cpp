@@ -3,32 +3,143 @@
 #include "framework.h"
 #include "Util.h"
 #include "TileManager.h"
+#include "Canvas.h"
+#include "DecodePool.h"
+#include "Trace.h"
+#include "TrackLoader.h"
 #include "Resource.h"
 #include "MapWindow.h"
 
 INT_PTR CALLBACK About(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam);
 
-MapWindow::MapWindow(HttpClient& httpClient, std::wstring strBaseUrl, unsigned nTileSize, ComPtr<ID2D1Factory> pD2DFactory, HINSTANCE hInstance) : D2DWindow(pD2DFactory, hInstance),
-    m_tileManager(httpClient, strBaseUrl, nTileSize, [=](Tile& tile) { Invalidate(); })
+MapWindow::MapWindow(HttpClient& httpClient, TileCache& tileCache, DecodePool& decodePool, std::wstring strBaseUrl, unsigned nTileSize, ComPtr<ID2D1Factory> pD2DFactory, HINSTANCE hInstance) : D2DWindow(pD2DFactory, hInstance),
+    m_tileManager(httpClient, tileCache, decodePool, strBaseUrl, nTileSize, [=](Tile& tile) { OnTileLoaded(tile.coords()); },
+        [=]() { OnTileCompletion(); }),
+    m_decodePool(decodePool), m_httpClient(httpClient), m_trackOverlay(nTileSize), m_tileSeeder(httpClient, tileCache, strBaseUrl, GetAppDataDirectory() + L"\\seed.dat")
 {
+    m_foregroundColor = D2D1::ColorF(D2D1::ColorF::Black, .7f);
+    m_backgroundColor = D2D1::ColorF(GetSysColor(COLOR_3DFACE), .7f);
+
+    // pace repaints to the display refresh rate, if it is known
+    HDC hdc = GetDC(nullptr);
+    int nRefreshRate = GetDeviceCaps(hdc, VREFRESH);
+    ReleaseDC(nullptr, hdc);
+    if (nRefreshRate > 1) {
+        m_nFrameIntervalMs = 1000 / nRefreshRate;
+    }
 }
 
 MapWindow::~MapWindow()
 {
+    // tile loads still running call OnTileCompletion(), which uses members destroyed before
+    // the tile manager
+    m_tileManager.Shutdown();
+    if (m_trackLoaderThread.joinable()) {
+        m_trackLoaderThread.join();
+    }
 }
 
 void MapWindow::Move(double dLat, double dLng, unsigned nZoom)
 {
     _ASSERT(dLat >= -90.0 && dLat <= 90.0);
-    _ASSERT(dLng >= -180.0 && dLat <= 180.0);
-    _ASSERT(nZoom >= 0 && nZoom <= 18);
-    m_dLat = dLat;
-    m_dLng = dLng;
+    _ASSERT(dLng >= -180.0 && dLng <= 180.0);
+    _ASSERT(nZoom >= 0 && nZoom <= MAX_ZOOM);
+    // the map ends there
+    MoveTo(LatLngToMercator(std::clamp(dLat, -MERCATOR_MAX_LATITUDE, MERCATOR_MAX_LATITUDE), dLng), nZoom);
+}
+
+void MapWindow::MoveTo(MercatorPoint ptCenter, unsigned nZoom)
+{
+    m_ptCenter = ptCenter;
     m_nZoom = nZoom;
     UpdateView();
     Invalidate();
 }
 
+void MapWindow::AddTrack(const MercatorPoint* pPoints, size_t nPoints)
+{
+    m_trackOverlay.AddTrack(pPoints, nPoints);
+    m_trackOverlay.UpdateView(m_nZoom, m_rectView);
+    Invalidate();
+}
+
+void MapWindow::LoadTracks(std::wstring strPath)
+{
+    // one file at a time
+    if (m_trackLoaderThread.joinable()) {
+        m_trackLoaderThread.join();
+    }
+    m_trackLoaderThread = std::thread([=]() {
+        TraceSetThreadName("Track loader");
+        TrackData data;
+        if (!::LoadTracks(strPath, data) || data.vecLat.empty()) {
+            return;
+        }
+        // projecting is as expensive as parsing, do it here too
+        std::vector<MercatorPoint> vecPoints(data.vecLat.size());
+        LatLngToMercatorBatch(data.vecLat.data(), data.vecLng.data(), vecPoints.data(), vecPoints.size());
+        {
+            std::lock_guard lock(m_loadedTracksMutex);
+            m_vecLoadedTrackPoints = std::move(vecPoints);
+            m_vecLoadedTrackStarts = std::move(data.vecTrackStarts);
+            m_dLoadedMinLat = data.dMinLat;
+            m_dLoadedMinLng = data.dMinLng;
+            m_dLoadedMaxLat = data.dMaxLat;
+            m_dLoadedMaxLng = data.dMaxLng;
+        }
+        PostMessage(hWnd(), WM_TRACKSLOADED, 0, 0);
+    });
+}
+
+void MapWindow::OnTracksLoaded()
+{
+    std::vector<MercatorPoint> vecPoints;
+    std::vector<size_t> vecTrackStarts;
+    double dMinLat, dMinLng, dMaxLat, dMaxLng;
+    {
+        std::lock_guard lock(m_loadedTracksMutex);
+        vecPoints.swap(m_vecLoadedTrackPoints);
+        vecTrackStarts.swap(m_vecLoadedTrackStarts);
+        dMinLat = m_dLoadedMinLat;
+        dMinLng = m_dLoadedMinLng;
+        dMaxLat = m_dLoadedMaxLat;
+        dMaxLng = m_dLoadedMaxLng;
+    }
+    if (vecPoints.empty()) {
+        return;
+    }
+
+    for (size_t i = 0; i < vecTrackStarts.size(); i++) {
+        size_t nStart = vecTrackStarts[i];
+        size_t nEnd = i + 1 < vecTrackStarts.size() ? vecTrackStarts[i + 1] : vecPoints.size();
+        // a single point is not a track
+        if (nEnd - nStart >= 2) {
+            m_trackOverlay.AddTrack(vecPoints.data() + nStart, nEnd - nStart);
+        }
+    }
+    FitBounds(dMinLat, dMinLng, dMaxLat, dMaxLng);
+}
+
+void MapWindow::FitBounds(double dMinLat, double dMinLng, double dMaxLat, double dMaxLng)
+{
+    RECT rect;
+    GetClientRect(hWnd(), &rect);
+    MercatorPoint ptTopLeft = LatLngToMercator(dMaxLat, dMinLng), ptBottomRight = LatLngToMercator(dMinLat, dMaxLng);
+
+    // highest zoom level at which bounds fit in the window
+    unsigned nZoom = MAX_ZOOM;
+    while (nZoom > 0) {
+        double dWorldSize = WorldSize(nZoom, m_tileManager.tileSize());
+        if ((ptBottomRight.x - ptTopLeft.x) * dWorldSize <= rect.right &&
+            (ptBottomRight.y - ptTopLeft.y) * dWorldSize <= rect.bottom) {
+            break;
+        }
+        nZoom--;
+    }
+
+    MoveTo({ (ptTopLeft.x + ptBottomRight.x) / 2, (ptTopLeft.y + ptBottomRight.y) / 2 }, nZoom);
+}
+
 std::wstring MapWindow::WndClassName()
 {
     return L"MapWindow";
@@ -73,7 +184,15 @@ LRESULT MapWindow::WndProc(UINT uMsg, WPARAM wParam, LPARAM lParam)
         }
     }
     break;
+    case WM_FLUSHTILES:
+        ScheduleFlush();
+        break;
+    case WM_TRACKSLOADED:
+        OnTracksLoaded();
+        break;
     case WM_DESTROY:
+        KillTimer(hWnd(), FLUSH_TIMER_ID);
+        KillTimer(hWnd(), RETRY_TIMER_ID);
         PostQuitMessage(0);
         break;
     default:
@@ -87,18 +206,11 @@ void MapWindow::EnsureRenderTarget()
     D2DWindow::EnsureRenderTarget();
     m_tileManager.SetRenderTarget(m_pRenderTarget);
 
-    // [re]create brushes
-    if (!m_pForegroundBrush) {
-        m_pRenderTarget->CreateSolidColorBrush(
-            D2D1::ColorF(D2D1::ColorF::Black, .7f),
-            m_pForegroundBrush.GetAddressOf()
-        );
-    }
-    if (!m_pBackgroundBrush) {
-        DWORD bgColor = GetSysColor(COLOR_3DFACE);
+    // [re]create brush, its color is changed as needed by D2DCanvas
+    if (!m_pBrush) {
         m_pRenderTarget->CreateSolidColorBrush(
-            D2D1::ColorF(bgColor, .7f),
-            m_pBackgroundBrush.GetAddressOf()
+            m_foregroundColor,
+            m_pBrush.GetAddressOf()
         );
     }
 }
@@ -107,8 +219,9 @@ void MapWindow::InvalidateRenderTarget()
 {
     D2DWindow::InvalidateRenderTarget();
     m_tileManager.InvalidateRenderTarget();
-    m_pForegroundBrush.Reset();
-    m_pBackgroundBrush.Reset();
+    // prefetched tiles which were loaded are gone too
+    m_bPrefetchComplete = false;
+    m_pBrush.Reset();
 }
 
 void MapWindow::OnSize(unsigned nWidth, unsigned nHeight)
@@ -123,13 +236,17 @@ void MapWindow::OnLButtonDown(WORD wFlags, int x, int y)
     m_bIsPanning = true;
     m_nPanningOriginX = x;
     m_nPanningOriginY = y;
-    m_dPanningOriginLat = m_dLat;
-    m_dPanningOriginLng = m_dLng;
+    m_ptPanningOrigin = m_ptCenter;
+    m_dVelocityX = m_dVelocityY = 0.0;
+    m_nLastMoveX = x;
+    m_nLastMoveY = y;
+    m_tmLastMove = GetTickCount64();
 }
 
 void MapWindow::OnLButtonUp(WORD wFlags, int x, int y)
 {
     m_bIsPanning = false;
+    m_dVelocityX = m_dVelocityY = 0.0;
 }
 
 void MapWindow::OnMouseWheel(WORD wFlags, int x, int y, int delta)
@@ -141,10 +258,10 @@ void MapWindow::OnMouseWheel(WORD wFlags, int x, int y, int delta)
     if (zoom < 0) {
         zoom = 0;
     }
-    if (zoom > 18) {
-        zoom = 18;
+    if (zoom > (int)MAX_ZOOM) {
+        zoom = MAX_ZOOM;
     }
-    Move(m_dLat, m_dLng, (unsigned)zoom);
+    MoveTo(m_ptCenter, (unsigned)zoom);
 }
 
 void MapWindow::OnMouseMove(WORD wFlags, int x, int y)
@@ -152,114 +269,478 @@ void MapWindow::OnMouseMove(WORD wFlags, int x, int y)
     // move map if we're currently in a panning mode (left mouse button pressed),
     // relative to the origin recorded when the button was pressed
     if (m_bIsPanning) {
-        int xDiff = m_nPanningOriginX - x, yDiff = y - m_nPanningOriginY;        
-        Move(m_dPanningOriginLat + yDiff * m_ldPixelSizeLat, m_dPanningOriginLng + xDiff * m_ldPixelSizeLng, m_nZoom);
+        // track velocity for prefetching, smoothing out jitter a bit
+        ULONGLONG tmNow = GetTickCount64();
+        if (tmNow > m_tmLastMove) {
+            double dt = (double)(tmNow - m_tmLastMove);
+            m_dVelocityX = m_dVelocityX * 0.5 + (x - m_nLastMoveX) / dt * 0.5;
+            m_dVelocityY = m_dVelocityY * 0.5 + (y - m_nLastMoveY) / dt * 0.5;
+            m_nLastMoveX = x;
+            m_nLastMoveY = y;
+            m_tmLastMove = tmNow;
+        }
+
+        // pixel offsets are exact in world pixels at the current zoom level
+        double dWorldSize = WorldSize(m_nZoom, m_tileManager.tileSize());
+        MercatorPoint ptCenter = {
+            std::clamp(m_ptPanningOrigin.x + (m_nPanningOriginX - x) / dWorldSize, 0.0, 1.0),
+            std::clamp(m_ptPanningOrigin.y + (m_nPanningOriginY - y) / dWorldSize, 0.0, 1.0)
+        };
+        MoveTo(ptCenter, m_nZoom);
+    }
+}
+
+void MapWindow::OnKeyDown(UINT nVirtKey)
+{
+    // F12 would be more traditional, but it is reserved for breaking into debugger
+    switch (nVirtKey)
+    {
+    case VK_F2:
+        ToggleOverlay();
+        break;
+    case VK_F5:
+        ToggleSeeding();
+        break;
+    case VK_F6:
+        CycleLayerOpacity();
+        break;
+    case VK_F8:
+        DumpStats();
+        break;
+    case VK_F9:
+        DumpTrace();
+        break;
     }
 }
 
-void MapWindow::OnPaintD2D()
+void MapWindow::OnTimer(UINT_PTR nTimerId)
 {
+    if (nTimerId == FLUSH_TIMER_ID) {
+        KillTimer(hWnd(), FLUSH_TIMER_ID);
+        FlushLoadedTiles();
+    } else if (nTimerId == OVERLAY_TIMER_ID) {
+        RECT rect = { (LONG)OVERLAY_RECT.left, (LONG)OVERLAY_RECT.top, (LONG)OVERLAY_RECT.right, (LONG)OVERLAY_RECT.bottom };
+        InvalidateRect(hWnd(), &rect, FALSE);
+    } else if (nTimerId == RETRY_TIMER_ID) {
+        ScheduleRetry();
+    }
+}
+
+void MapWindow::OnPaintD2D(const RECT& rcPaint)
+{
+    TRACE_SCOPE("OnPaintD2D");
+
+    // count frames, and update the per second rate once a second
+    ULONGLONG tmNow = GetTickCount64();
+    m_nFrames++;
+    if (tmNow - m_tmSecondStart >= 1000) {
+        m_nFramesPerSecond = (unsigned)((m_nFrames - m_nFramesAtSecondStart) * 1000 / (tmNow - m_tmSecondStart));
+        m_nFramesAtSecondStart = m_nFrames;
+        m_tmSecondStart = tmNow;
+    }
+
+    // render target retains its contents, so repaint only the update region.  It is
+    // cleared first, as background is drawn semi-transparent
+    D2D1_RECT_F rectUpdate = D2D1::RectF((float)rcPaint.left, (float)rcPaint.top, (float)rcPaint.right, (float)rcPaint.bottom);
     m_pRenderTarget->SetTransform(D2D1::Matrix3x2F::Identity());
+    m_pRenderTarget->PushAxisAlignedClip(rectUpdate, D2D1_ANTIALIAS_MODE_ALIASED);
+    m_pRenderTarget->Clear(D2D1::ColorF(m_backgroundColor.r, m_backgroundColor.g, m_backgroundColor.b));
+    D2DCanvas canvas(m_pRenderTarget, m_pBrush);
+    Render(canvas, &rectUpdate);
+    if (m_bShowOverlay) {
+        DrawOverlay();
+    }
+    m_pRenderTarget->PopAxisAlignedClip();
+}
+
+void MapWindow::ToggleOverlay()
+{
+    m_bShowOverlay = !m_bShowOverlay;
+    if (m_bShowOverlay) {
+        // DirectWrite objects don't depend on render target, so are created once, on first use
+        if (!m_pOverlayTextFormat) {
+            HRESULT hr = DWriteCreateFactory(DWRITE_FACTORY_TYPE_SHARED, __uuidof(IDWriteFactory),
+                reinterpret_cast<IUnknown**>(m_pDWriteFactory.GetAddressOf()));
+            if (SUCCEEDED(hr)) {
+                hr = m_pDWriteFactory->CreateTextFormat(L"Consolas", nullptr, DWRITE_FONT_WEIGHT_NORMAL,
+                    DWRITE_FONT_STYLE_NORMAL, DWRITE_FONT_STRETCH_NORMAL, 12.f, L"en-us", m_pOverlayTextFormat.GetAddressOf());
+            }
+            if (FAILED(hr)) {
+                PrintLnDebug(L"Failed to set up DirectWrite for overlay, HRESULT = {}", (intptr_t)hr);
+                m_bShowOverlay = false;
+                return;
+            }
+        }
+        SetTimer(hWnd(), OVERLAY_TIMER_ID, OVERLAY_REFRESH_MS, nullptr);
+        OnTimer(OVERLAY_TIMER_ID);
+    } else {
+        KillTimer(hWnd(), OVERLAY_TIMER_ID);
+        Invalidate();
+    }
+}
+
+void MapWindow::DrawOverlay()
+{
+    TileManager::Stats tileStats = m_tileManager.stats();
+    TileScheduler::Stats schedulerStats = m_tileManager.schedulerStats();
+    DecodePool::Stats decodeStats = m_decodePool.stats();
+    TrackOverlay::Stats trackStats = m_trackOverlay.stats();
+    TileSeeder::Stats seedStats = m_tileSeeder.stats();
+    ResponseBuffer::Stats bufferStats = ResponseBuffer::stats();
+    HttpClient::Stats httpStats = m_httpClient.stats();
+    unsigned long long nLookups = tileStats.nHits + tileStats.nMisses;
+    std::wstring strText = std::format(
+        L"Frame: {:.1f} ms, {} fps\nTiles in flight: {} ({} queued)\nCache hit rate: {:.0f}%\nDecode queue: {}, {:.2f} ms/tile\n"
+        L"Downloaded: {} tiles, {:.1f} KB avg\nRevalidated: {} tiles, {} not modified\nCoalesced: {} of {} requests\nBuffers: {} heap allocs, {} reused, {} KB pooled\n"
+        L"Failures: {} loads, {} waiting, {} servers down\n"
+        L"Tracks: {}/{} pts, cull {:.1f} ms, draw {:.1f} ms\nSeeding: {}",
+        lastFrameUs() / 1000.0, m_nFramesPerSecond,
+        schedulerStats.nInFlight, schedulerStats.nQueued,
+        nLookups ? tileStats.nHits * 100.0 / nLookups : 0.0,
+        decodeStats.nQueued, tileStats.nDecoded ? tileStats.ullDecodeUs / 1000.0 / tileStats.nDecoded : 0.0,
+        tileStats.nDownloaded, tileStats.nDownloaded ? tileStats.ullDownloadedBytes / 1024.0 / tileStats.nDownloaded : 0.0,
+        tileStats.nRevalidated, tileStats.nNotModified,
+        httpStats.nCoalesced, httpStats.nRequests,
+        bufferStats.nHeapAllocations, bufferStats.nReused, bufferStats.szPooled / 1024,
+        tileStats.nFailures, tileStats.nBackingOff, httpStats.nServersDown,
+        trackStats.nVisiblePoints, trackStats.nPoints, trackStats.nLastCullUs / 1000.0, trackStats.nLastDrawUs / 1000.0,
+        seedStats.bRunning ? std::format(L"{}/{} tiles, {:.1f}/s, {:.0f} KB/s", seedStats.nDone, seedStats.nTotal,
+            seedStats.dTilesPerSecond, seedStats.dBytesPerSecond / 1024.0) : std::wstring(L"off"));
+
+    m_pBrush->SetColor(m_backgroundColor);
+    m_pRenderTarget->FillRectangle(OVERLAY_RECT, m_pBrush.Get());
+    m_pBrush->SetColor(m_foregroundColor);
+    D2D1_RECT_F rectText = D2D1::RectF(OVERLAY_RECT.left + 6.f, OVERLAY_RECT.top + 4.f, OVERLAY_RECT.right - 6.f, OVERLAY_RECT.bottom - 4.f);
+    m_pRenderTarget->DrawText(strText.c_str(), (UINT32)strText.size(), m_pOverlayTextFormat.Get(), rectText, m_pBrush.Get());
+}
 
-    // get lat/lng of left top corner of the top left tile
-    double n = std::pow(2, m_nZoom);
-    long double lng = m_nTopLeftX / n * 360.0 - 180.0;
-    long double latRad = std::atan(std::sinh(std::numbers::pi * (1.0 - 2.0 * m_nTopLeftY / n)));
-    long double lat = latRad * 180.0 / std::numbers::pi;
+void MapWindow::ToggleSeeding()
+{
+    if (m_tileSeeder.stats().bRunning) {
+        m_tileSeeder.Stop();
+        return;
+    }
+    if (m_tileSeeder.Resume()) {
+        return;
+    }
 
-    // difference in degrees with lat/lng of top left corner of the window
-    long double lngDiff = lng - m_dTopLeftLng;
-    long double latDiff = lat - m_dTopLeftLat;
+    double dMinLat, dMinLng, dMaxLat, dMaxLng;
+    MercatorToLatLng({ m_rectView.left, m_rectView.bottom }, dMinLat, dMinLng);
+    MercatorToLatLng({ m_rectView.right, m_rectView.top }, dMaxLat, dMaxLng);
+    SeedRegion region = { dMinLat, std::max(dMinLng, -180.0), dMaxLat, std::min(dMaxLng, 180.0),
+        m_nZoom, std::min(m_nZoom + SEED_ZOOM_LEVELS, MAX_ZOOM) };
+    TileSeeder::Estimate estimate = TileSeeder::EstimateRegion(region);
+    PrintLnDebug(L"Seeding estimate: {} tiles, {} MB", estimate.nTiles, estimate.ullBytes / (1024 * 1024));
+    m_tileSeeder.Start(region);
+}
 
-    // difference in pixels
-    int xOffset = (int)(lngDiff / m_ldPixelSizeLng);
-    int yOffset = -(int)(latDiff / m_ldPixelSizeLat);
+void MapWindow::CycleLayerOpacity()
+{
+    unsigned nLayers = m_tileManager.layerCount();
+    if (nLayers < 2) {
+        return;
+    }
+    float fOpacity = m_tileManager.layerOpacity(nLayers - 1) - LAYER_OPACITY_STEP;
+    m_tileManager.SetLayerOpacity(nLayers - 1, fOpacity < -.01f ? 1.f : fOpacity);
+}
+
+void MapWindow::DumpTrace()
+{
+    SYSTEMTIME time;
+    GetLocalTime(&time);
+    std::wstring strPath = std::format(L"{}\\trace-{:04}{:02}{:02}-{:02}{:02}{:02}.json", GetAppDataDirectory(),
+        time.wYear, time.wMonth, time.wDay, time.wHour, time.wMinute, time.wSecond);
+    if (TraceDump(strPath)) {
+        PrintLnDebug(L"Trace written to {}", strPath);
+    } else {
+        PrintLnDebug(L"Failed to write trace to {}, error {}", strPath, GetLastError());
+    }
+}
+
+void MapWindow::DumpStats()
+{
+    TileManager::Stats tileStats = m_tileManager.stats();
+    TileScheduler::Stats schedulerStats = m_tileManager.schedulerStats();
+    DecodePool::Stats decodeStats = m_decodePool.stats();
+    ResponseBuffer::Stats bufferStats = ResponseBuffer::stats();
+    HttpClient::Stats httpStats = m_httpClient.stats();
+    TrackOverlay::Stats trackStats = m_trackOverlay.stats();
+
+    // rate over the whole run, and how many per second the UI thread could do back to back
+    double dSeconds = std::max(GetTickCount64() - m_tmCreated, 1ull) / 1000.0;
+    auto histogram = [dSeconds](const TraceHistogram& times) {
+        double dMeanUs = times.count() ? (double)times.totalUs() / times.count() : 0.0;
+        return std::format("{{\"count\":{},\"per_second\":{:.2f},\"ops_per_second\":{:.0f},\"mean_us\":{:.1f},"
+            "\"p50_us\":{},\"p99_us\":{},\"max_us\":{}}}",
+            times.count(), times.count() / dSeconds, dMeanUs > 0.0 ? 1e6 / dMeanUs : 0.0, dMeanUs,
+            times.Percentile(50), times.Percentile(99), times.maxUs());
+    };
+    std::string strJson = std::format("{{\n\"uptime_s\":{:.1f},\n\"zoom\":{},\"tiles_in_view\":{},\n", dSeconds, m_nZoom,
+        (m_nWidthInTiles + 1) * (m_nHeightInTiles + 1));
+    strJson += std::format("\"latency\":{{\"frame\":{},\n\"update_view\":{},\n\"flush_tiles\":{}}},\n",
+        histogram(frameTimes()), histogram(m_viewUpdateTimes), histogram(m_flushTimes));
+    strJson += std::format("\"tiles\":{{\"hits\":{},\"misses\":{},\"evictions\":{},\"count\":{},\"bytes\":{},\"budget\":{},"
+        "\"prefetch_issued\":{},\"prefetch_hits\":{},\"prefetch_wasted\":{},\"downloaded\":{},\"downloaded_bytes\":{},"
+        "\"decoded\":{},\"decode_us\":{},\"revalidated\":{},\"not_modified\":{},\"completions\":{},\"dropped_completions\":{},"
+        "\"failures\":{},\"retries\":{},\"backing_off\":{}}},\n",
+        tileStats.nHits, tileStats.nMisses, tileStats.nEvictions, tileStats.nTiles, tileStats.szBytes, tileStats.szBudget,
+        tileStats.nPrefetchIssued, tileStats.nPrefetchHits, tileStats.nPrefetchWasted, tileStats.nDownloaded, tileStats.ullDownloadedBytes,
+        tileStats.nDecoded, tileStats.ullDecodeUs, tileStats.nRevalidated, tileStats.nNotModified, tileStats.nCompletions,
+        tileStats.nDroppedCompletions, tileStats.nFailures, tileStats.nRetries, tileStats.nBackingOff);
+    strJson += std::format("\"scheduler\":{{\"queued\":{},\"in_flight\":{},\"parked\":{},\"started\":{},\"completed\":{},\"cancelled\":{},"
+        "\"timed_out\":{},\"throttled\":{},\"prefetch_started\":{},\"last_time_to_full_screen_ms\":{}}},\n",
+        schedulerStats.nQueued, schedulerStats.nInFlight, schedulerStats.nParked, schedulerStats.nStarted, schedulerStats.nCompleted, schedulerStats.nCancelled,
+        schedulerStats.nTimedOut, schedulerStats.nThrottled, schedulerStats.nPrefetchStarted, schedulerStats.nLastTimeToFullScreenMs);
+    strJson += std::format("\"decode\":{{\"queued\":{},\"peak_queued\":{},\"completed\":{},\"stolen\":{},"
+        "\"wait_us\":{},\"max_wait_us\":{},\"run_us\":{},\"max_run_us\":{}}},\n",
+        decodeStats.nQueued, decodeStats.nPeakQueued, decodeStats.nCompleted, decodeStats.nStolen,
+        decodeStats.nTotalWaitUs, decodeStats.nMaxWaitUs, decodeStats.nTotalRunUs, decodeStats.nMaxRunUs);
+    strJson += std::format("\"http\":{{\"requests\":{},\"fetches\":{},\"coalesced\":{},\"fetches_cancelled\":{},"
+        "\"rejected\":{},\"circuits_opened\":{},\"servers_down\":{}}},\n",
+        httpStats.nRequests, httpStats.nFetches, httpStats.nCoalesced, httpStats.nFetchesCancelled,
+        httpStats.nRejected, httpStats.nCircuitsOpened, httpStats.nServersDown);
+    // heap allocations per download are what the pool is for, should go towards 0 once warmed up
+    strJson += std::format("\"buffers\":{{\"heap_allocations\":{},\"heap_frees\":{},\"reused\":{},\"in_use_bytes\":{},"
+        "\"pooled_bytes\":{},\"heap_allocations_per_download\":{:.3f}}},\n",
+        bufferStats.nHeapAllocations, bufferStats.nHeapFrees, bufferStats.nReused, bufferStats.szInUse, bufferStats.szPooled,
+        tileStats.nDownloaded ? (double)bufferStats.nHeapAllocations / tileStats.nDownloaded : 0.0);
+    strJson += std::format("\"tracks\":{{\"tracks\":{},\"points\":{},\"bytes\":{},\"build_us\":{},\"visible_points\":{},"
+        "\"visible_polylines\":{},\"last_cull_us\":{},\"last_draw_us\":{}}}\n}}\n",
+        trackStats.nTracks, trackStats.nPoints, trackStats.szBytes, trackStats.nBuildUs, trackStats.nVisiblePoints,
+        trackStats.nVisiblePolylines, trackStats.nLastCullUs, trackStats.nLastDrawUs);
+
+    SYSTEMTIME time;
+    GetLocalTime(&time);
+    std::wstring strPath = std::format(L"{}\\stats-{:04}{:02}{:02}-{:02}{:02}{:02}.json", GetAppDataDirectory(),
+        time.wYear, time.wMonth, time.wDay, time.wHour, time.wMinute, time.wSecond);
+    if (WriteWholeFile(strPath, strJson)) {
+        PrintLnDebug(L"Stats written to {}", strPath);
+    } else {
+        PrintLnDebug(L"Failed to write stats to {}, error {}", strPath, GetLastError());
+    }
+}
+
+void MapWindow::Render(Canvas& canvas, const D2D1_RECT_F* pUpdateRect)
+{
+    int xOffset, yOffset;
+    GetTopLeftOffset(xOffset, yOffset);
 
     // loop through tiles visible on screen
     for (unsigned y = 0; y <= m_nHeightInTiles; y++) {
         for (unsigned x = 0; x <= m_nWidthInTiles; x++) {
-            // determine where the tile lands on screen
-            int windowX = xOffset + x * m_tileManager.tileSize(), windowY = yOffset + y * m_tileManager.tileSize();
-            D2D1_RECT_F rectangle = D2D1::RectF(windowX * 1.f, windowY * 1.f,
-                windowX + m_tileManager.tileSize() * 1.f, windowY + m_tileManager.tileSize() * 1.f);
+            // determine where the tile lands on screen, and skip it if it is not to be repainted
+            TileCoords coords(x + m_nTopLeftX, y + m_nTopLeftY, m_nZoom);
+            D2D1_RECT_F rectangle = GetTileRect(coords, xOffset, yOffset);
+            if (pUpdateRect && (rectangle.right <= pUpdateRect->left || rectangle.left >= pUpdateRect->right ||
+                rectangle.bottom <= pUpdateRect->top || rectangle.top >= pUpdateRect->bottom)) {
+                continue;
+            }
 
             // must be loaded
-            Tile *tile = m_tileManager.GetTile({ x + m_nTopLeftX, y + m_nTopLeftY, m_nZoom });
+            Tile *tile = m_tileManager.GetTile(coords);
             if (tile && tile->state() == TS_READY) {
                 // draw the tile
-                m_pRenderTarget->DrawBitmap(tile->d2dBitmap().Get(), rectangle);
+                canvas.DrawTile(*tile, rectangle);
             } else {
-                // display not loaded tile (still loading or load error) as a background-colored rectable
-                m_pRenderTarget->FillRectangle(rectangle, m_pBackgroundBrush.Get());
+                // not loaded tile (still loading or load error), draw whatever we have instead
+                DrawFallbackTile(canvas, coords, rectangle);
             }
         }
     }
 
-    // draw "crosshairs" in the middle with the foreground brush
-    D2D_SIZE_F size = m_pRenderTarget->GetSize();
-    float dpiX, dpiY;
-    m_pRenderTarget->GetDpi(&dpiX, &dpiY);
-    dpiX /= 96.f;
-    dpiY /= 96.f;
-    m_pRenderTarget->DrawLine(
-        D2D1::Point2F(std::round(size.width / 2.f), std::round(size.height / 2.f - 100.f * dpiY)),
-        D2D1::Point2F(std::round(size.width / 2.f), std::round(size.height / 2.f + 100.f * dpiY)),
-        m_pForegroundBrush.Get());
-    m_pRenderTarget->DrawLine(
-        D2D1::Point2F(std::round(size.width / 2.f - 100.f * dpiX), std::round(size.height / 2.f)),
-        D2D1::Point2F(std::round(size.width / 2.f + 100.f * dpiX), std::round(size.height / 2.f)),
-        m_pForegroundBrush.Get());
+    // tracks over tiles
+    m_trackOverlay.Draw(canvas, WorldSize(m_nZoom, m_tileManager.tileSize()), m_dTopLeftX, m_dTopLeftY, pUpdateRect);
+
+    // draw "crosshairs" in the middle with the foreground color
+    D2D_SIZE_F size = canvas.size();
+    float dpi = canvas.dpiScale();
+    canvas.DrawLine(
+        D2D1::Point2F(std::round(size.width / 2.f), std::round(size.height / 2.f - 100.f * dpi)),
+        D2D1::Point2F(std::round(size.width / 2.f), std::round(size.height / 2.f + 100.f * dpi)),
+        m_foregroundColor);
+    canvas.DrawLine(
+        D2D1::Point2F(std::round(size.width / 2.f - 100.f * dpi), std::round(size.height / 2.f)),
+        D2D1::Point2F(std::round(size.width / 2.f + 100.f * dpi), std::round(size.height / 2.f)),
+        m_foregroundColor);
+}
+
+void MapWindow::GetTopLeftOffset(int& xOffset, int& yOffset)
+{
+    // difference in world pixels between top left corner of the top left tile and of the window,
+    // rounded so that tiles are aligned to screen pixels
+    unsigned tileSize = m_tileManager.tileSize();
+    xOffset = (int)std::lround((double)m_nTopLeftX * tileSize - m_dTopLeftX);
+    yOffset = (int)std::lround((double)m_nTopLeftY * tileSize - m_dTopLeftY);
+}
+
+D2D1_RECT_F MapWindow::GetTileRect(TileCoords coords, int xOffset, int yOffset)
+{
+    // size of the tile in tiles of the current zoom level
+    double dScale = std::ldexp(1.0, (int)m_nZoom - (int)coords.zoom);
+    double dSize = m_tileManager.tileSize() * dScale;
+    double dLeft = xOffset + (coords.x * dScale - m_nTopLeftX) * m_tileManager.tileSize();
+    double dTop = yOffset + (coords.y * dScale - m_nTopLeftY) * m_tileManager.tileSize();
+    return D2D1::RectF((float)dLeft, (float)dTop, (float)(dLeft + dSize), (float)(dTop + dSize));
+}
+
+void MapWindow::OnTileCompletion()
+{
+    // called on a worker thread, so just have the results picked up on the UI thread; a burst
+    // of tiles is then applied and repainted at once, at most once per frame
+    std::lock_guard lock(m_loadedTilesMutex);
+    if (!m_bFlushPosted) {
+        m_bFlushPosted = true;
+        PostMessage(hWnd(), WM_FLUSHTILES, 0, 0);
+    }
+}
+
+void MapWindow::OnTileLoaded(TileCoords coords)
+{
+    // called from ProcessCompletions(), on the UI thread
+    m_vecLoadedTiles.push_back(coords);
+}
+
+void MapWindow::ScheduleFlush()
+{
+    ULONGLONG tmSinceFlush = GetTickCount64() - m_tmLastFlush;
+    if (tmSinceFlush >= m_nFrameIntervalMs) {
+        FlushLoadedTiles();
+    } else {
+        SetTimer(hWnd(), FLUSH_TIMER_ID, (UINT)(m_nFrameIntervalMs - tmSinceFlush), nullptr);
+    }
+}
+
+void MapWindow::FlushLoadedTiles()
+{
+    // anything completed from now on needs another flush
+    {
+        std::lock_guard lock(m_loadedTilesMutex);
+        m_bFlushPosted = false;
+    }
+    m_tmLastFlush = GetTickCount64();
+    long long tmStart = TraceNow();
+    m_tileManager.ProcessCompletions();
+    ScheduleRetry();
+    m_flushTimes.Record(TraceNow() - tmStart);
+    std::vector<TileCoords> vecTiles;
+    vecTiles.swap(m_vecLoadedTiles);
+
+    // invalidate only where the tiles are (or would be drawn as fallbacks), if that is on screen.
+    // Rectangles are rounded outwards
+    int xOffset, yOffset;
+    GetTopLeftOffset(xOffset, yOffset);
+    RECT rectClient;
+    GetClientRect(hWnd(), &rectClient);
+    for (TileCoords coords : vecTiles) {
+        D2D1_RECT_F rectangle = GetTileRect(coords, xOffset, yOffset);
+        RECT rect = {
+            (LONG)std::max(std::floor(rectangle.left), (float)rectClient.left),
+            (LONG)std::max(std::floor(rectangle.top), (float)rectClient.top),
+            (LONG)std::min(std::ceil(rectangle.right), (float)rectClient.right),
+            (LONG)std::min(std::ceil(rectangle.bottom), (float)rectClient.bottom)
+        };
+        if (rect.left < rect.right && rect.top < rect.bottom) {
+            InvalidateRect(hWnd(), &rect, FALSE);
+        }
+    }
+}
+
+void MapWindow::ScheduleRetry()
+{
+    // one timer for the earliest retry; it is set again after each flush, as tiles fail
+    unsigned nDelayMs = m_tileManager.RetryTiles();
+    if (nDelayMs) {
+        SetTimer(hWnd(), RETRY_TIMER_ID, nDelayMs, nullptr);
+    } else {
+        KillTimer(hWnd(), RETRY_TIMER_ID);
+    }
+}
+
+void MapWindow::DrawFallbackTile(Canvas& canvas, TileCoords coords, D2D1_RECT_F rectangle)
+{
+    // nearest loaded ancestor, scaled up from the matching part of it,
+    // or a background-colored rectangle if there's none
+    unsigned nLevels;
+    Tile *ancestor = m_tileManager.GetReadyAncestor(coords, MAX_FALLBACK_LEVELS, nLevels);
+    if (ancestor) {
+        float fSize = (float)m_tileManager.tileSize();
+        float fScale = 1.f / (1 << nLevels);
+        unsigned nMask = (1 << nLevels) - 1;
+        D2D1_RECT_F source = D2D1::RectF(
+            (coords.x & nMask) * fSize * fScale, (coords.y & nMask) * fSize * fScale,
+            ((coords.x & nMask) + 1) * fSize * fScale, ((coords.y & nMask) + 1) * fSize * fScale);
+        canvas.DrawTile(*ancestor, rectangle, &source);
+    } else {
+        canvas.FillRectangle(rectangle, m_backgroundColor);
+    }
+
+    // and any loaded children on top of that, scaled down, as they are more detailed
+    if (coords.zoom >= MAX_ZOOM) {
+        return;
+    }
+    float fHalfWidth = (rectangle.right - rectangle.left) / 2.f, fHalfHeight = (rectangle.bottom - rectangle.top) / 2.f;
+    for (unsigned y = 0; y < 2; y++) {
+        for (unsigned x = 0; x < 2; x++) {
+            Tile *child = m_tileManager.GetTile({ coords.x * 2 + x, coords.y * 2 + y, coords.zoom + 1 });
+            if (child && child->state() == TS_READY) {
+                D2D1_RECT_F quarter = D2D1::RectF(rectangle.left + x * fHalfWidth, rectangle.top + y * fHalfHeight,
+                    rectangle.left + (x + 1) * fHalfWidth, rectangle.top + (y + 1) * fHalfHeight);
+                canvas.DrawTile(*child, quarter);
+            }
+        }
+    }
 }
 
 void MapWindow::UpdateView()
 {
+    TRACE_SCOPE("UpdateView");
+    long long tmStart = TraceNow();
+
     // recalculate stuff
     UpdateNumbers();
 
-    // remove invisible tiles
-    m_tileManager.TrimTiles(m_nTopLeftX, m_nTopLeftY, m_nWidthInTiles, m_nHeightInTiles);
+    // remove invisible tiles and ensure all visible tiles are loaded
+    m_tileManager.UpdateView(m_nZoom, m_nTopLeftX, m_nTopLeftY, m_nWidthInTiles, m_nHeightInTiles);
+    m_trackOverlay.UpdateView(m_nZoom, m_rectView);
 
-    // ensure all visible tiles are loaded
-    for (unsigned y = m_nTopLeftY; y <= m_nTopLeftY + m_nHeightInTiles; y++) {
-        for (unsigned x = m_nTopLeftX; x <= m_nTopLeftX + m_nWidthInTiles; x++) {
-            m_tileManager.AddTile({ x, y, m_nZoom });
-        }
+    // and then some more tiles
+    PrefetchTiles();
+    m_viewUpdateTimes.Record(TraceNow() - tmStart);
+}
+
+void MapWindow::PrefetchTiles()
+{
+    // the map moves opposite to the mouse.  Predicted displacement in tiles, only taken
+    // seriously if it is at least half a tile
+    int tileSize = (int)m_tileManager.tileSize();
+    int nShiftX = (int)std::lround(-m_dVelocityX * PREFETCH_LOOKAHEAD_MS / tileSize);
+    int nShiftY = (int)std::lround(-m_dVelocityY * PREFETCH_LOOKAHEAD_MS / tileSize);
+    nShiftX = std::clamp(nShiftX, -PREFETCH_MAX_TILES, PREFETCH_MAX_TILES);
+    nShiftY = std::clamp(nShiftY, -PREFETCH_MAX_TILES, PREFETCH_MAX_TILES);
+    PrefetchWindow window = { m_nZoom, m_nTopLeftX, m_nTopLeftY, m_nWidthInTiles, m_nHeightInTiles, nShiftX, nShiftY };
+    if (m_bPrefetchComplete && window == m_lastPrefetch) {
+        return;
     }
+    m_lastPrefetch = window;
+    m_bPrefetchComplete = m_tileManager.PrefetchView(m_nZoom, m_nTopLeftX, m_nTopLeftY, m_nWidthInTiles, m_nHeightInTiles,
+        nShiftX, nShiftY, MAX_ZOOM);
 }
 
 void MapWindow::UpdateNumbers()
 {
-    unsigned tileSize = m_tileManager.tileSize();
-
     // get window size in pixels
     RECT rect;
     bool result = GetClientRect(hWnd(), &rect);
     _ASSERT(result);
-    unsigned windowWidth = rect.right, windowHeight = rect.bottom;
-
-    // window size in tiles
-    // add one to make sure we cover it
-    m_nWidthInTiles = windowWidth / tileSize + 1,
-    m_nHeightInTiles = windowHeight / tileSize + 1;
-
-    // entire map width/height in tiles
-    double n = std::pow(2, m_nZoom);
-
-    // pixel size in map degrees
-    // longitude is easy
-    m_ldPixelSizeLng = 360.0 / n / tileSize;
-    // latitude depends on where we are
-    long double latRad = m_dLat * (std::numbers::pi / 180.0);
-    m_ldPixelSizeLat = m_ldPixelSizeLng * std::cos(latRad);
-
-    // top left corner map coords
-    m_dTopLeftLng = m_dLng - (windowWidth / 2.0 * m_ldPixelSizeLng);
-    m_dTopLeftLat = m_dLat + (windowHeight / 2.0 * m_ldPixelSizeLat);
-
-    // top left corner tile coords
-    m_nTopLeftX = (unsigned) std::floor(n * ((m_dTopLeftLng + 180.0) / 360.0));
-    double topLeftLatRad = m_dTopLeftLat * (std::numbers::pi / 180.0);
-    m_nTopLeftY = (unsigned) std::floor(n * (1.0 - (std::log(std::tan(topLeftLatRad) + 1.0 / std::cos(topLeftLatRad)) / std::numbers::pi)) / 2.0);
+
+    MapView view = CalculateView(m_ptCenter, m_nZoom, m_tileManager.tileSize(), rect.right, rect.bottom);
+    m_dTopLeftX = view.dTopLeftX;
+    m_dTopLeftY = view.dTopLeftY;
+    m_rectView = view.rect;
+    m_nTopLeftX = view.nTopLeftX;
+    m_nTopLeftY = view.nTopLeftY;
+    m_nWidthInTiles = view.nWidthInTiles;
+    m_nHeightInTiles = view.nHeightInTiles;
 }
 
 // TODO: remove, message handler for about box, from original MSVC project template
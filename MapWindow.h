@@ -4,18 +4,46 @@
 
 #include "ComPtr.h"
 #include "D2DWindow.h"
+#include "Trace.h"
+#include "TileCoords.h"
+#include "Projection.h"
+#include "TrackOverlay.h"
+#include "TileSeeder.h"
 
 class TileManager;
+class Canvas;
+class TileCache;
+class DecodePool;
 
 class MapWindow : public D2DWindow
 {
 public:
-	MapWindow(HttpClient& httpClient, std::wstring strBaseUrl, unsigned nTileSize, ComPtr<ID2D1Factory> pD2DFactory, HINSTANCE hInstance);
+	MapWindow(HttpClient& httpClient, TileCache& tileCache, DecodePool& decodePool, std::wstring strBaseUrl, unsigned nTileSize, ComPtr<ID2D1Factory> pD2DFactory, HINSTANCE hInstance);
 	~MapWindow();
 
 	// Centers the map at a specified spot
 	void Move(double dLat, double dLng, unsigned nZoom);
 
+	// Paints the current view onto any canvas, e. g. a SoftwareCanvas (in which case the
+	// tile manager must be set to keep pixels, see TileManager::SetKeepPixels()).
+	// If pUpdateRect is given, tiles entirely outside of it are skipped
+	void Render(Canvas& canvas, const D2D1_RECT_F* pUpdateRect = nullptr);
+
+	TileManager& tileManager() { return m_tileManager; }
+
+	// adds a track to be drawn over the map, in Mercator coordinates
+	void AddTrack(const MercatorPoint* pPoints, size_t nPoints);
+	TrackOverlay& trackOverlay() { return m_trackOverlay; }
+	// loads tracks from a GPX or GeoJSON file (see TrackLoader.h) on a background thread,
+	// adds them and moves the map to show them all
+	void LoadTracks(std::wstring strPath);
+	// moves the map to show an area, at the highest zoom level it fits in
+	void FitBounds(double dMinLat, double dMinLng, double dMaxLat, double dMaxLng);
+
+	// number of frames painted so far, and over the last full second
+	unsigned long long frameCount() const { return m_nFrames; }
+	unsigned framesPerSecond() const { return m_nFramesPerSecond; }
+
 private:
 	// Window setup and window procedure
 	std::wstring WndClassName() override;
@@ -33,38 +61,165 @@ private:
 	void OnLButtonUp(WORD wFlags, int x, int y) override;
 	void OnMouseWheel(WORD wFlags, int x, int y, int delta) override;
 	void OnMouseMove(WORD wFlags, int x, int y) override;
+	void OnKeyDown(UINT nVirtKey) override;
+	void OnTimer(UINT_PTR nTimerId) override;
 
 	// Paint handler
-	void OnPaintD2D() override;
+	void OnPaintD2D(const RECT& rcPaint) override;
 
 	// source of tiles
 	TileManager m_tileManager;
-
-	// current coords
-	double m_dLat = 0.0, m_dLng = 0.0;
+	// where they are decoded, only for stats here
+	DecodePool& m_decodePool;
+	// and downloaded, likewise
+	HttpClient& m_httpClient;
+	// tracks drawn over tiles
+	TrackOverlay m_trackOverlay;
+	// offline seeding of the visible area, toggled by F5
+	TileSeeder m_tileSeeder;
+	// thread loading tracks from a file, and its results, already in Mercator coordinates,
+	// waiting for WM_TRACKSLOADED to be added on the UI thread
+	std::thread m_trackLoaderThread;
+	std::mutex m_loadedTracksMutex;
+	std::vector<MercatorPoint> m_vecLoadedTrackPoints;
+	std::vector<size_t> m_vecLoadedTrackStarts;
+	double m_dLoadedMinLat = 0.0, m_dLoadedMinLng = 0.0, m_dLoadedMaxLat = 0.0, m_dLoadedMaxLng = 0.0;
+
+	// current coords, kept in Mercator, which panning works in, so that it needs no
+	// conversions from and to latitude/longitude
+	MercatorPoint m_ptCenter = { 0.5, 0.5 };
 	unsigned m_nZoom = 1;
 
 	// various derived numbers
-	// map coordinates of top left corner of the window
-	double m_dTopLeftLat = 0.0, m_dTopLeftLng = 0.0;
+	// world pixel coordinates (see Projection.h) of the top left corner of the window
+	double m_dTopLeftX = 0.0, m_dTopLeftY = 0.0;
+	// visible part of the map
+	MercatorRect m_rectView = {};
 	// tile coordinates of top left corner of the window
 	unsigned m_nTopLeftX = 0, m_nTopLeftY = 0;
-	// size of one screen pixel in map degrees
-	long double m_ldPixelSizeLat = 0.0, m_ldPixelSizeLng = 0.0;
 	// window size in tiles
 	unsigned m_nWidthInTiles = 0, m_nHeightInTiles = 0;
 
 	// tracking the map while panning
 	bool m_bIsPanning = false;
 	int m_nPanningOriginX = 0, m_nPanningOriginY = 0;
-	double m_dPanningOriginLat = 0.0, m_dPanningOriginLng = 0.0;
+	MercatorPoint m_ptPanningOrigin = { 0.5, 0.5 };
+	// smoothed mouse velocity while panning, in pixels per ms, and the last mouse position
+	double m_dVelocityX = 0.0, m_dVelocityY = 0.0;
+	int m_nLastMoveX = 0, m_nLastMoveY = 0;
+	ULONGLONG m_tmLastMove = 0;
 
 	// drawing resources
-	ComPtr<ID2D1SolidColorBrush> m_pForegroundBrush, m_pBackgroundBrush;
-
+	D2D1_COLOR_F m_foregroundColor, m_backgroundColor;
+	ComPtr<ID2D1SolidColorBrush> m_pBrush;
+
+	// whether a WM_FLUSHTILES message for tile loads done on worker threads is already on its way,
+	// and tiles set ready by the last flush, to be repainted
+	std::mutex m_loadedTilesMutex;
+	bool m_bFlushPosted = false;
+	std::vector<TileCoords> m_vecLoadedTiles;
+	// when loaded tiles were last invalidated, and the minimum interval between that,
+	// which is one frame at the display refresh rate
+	ULONGLONG m_tmLastFlush = 0;
+	unsigned m_nFrameIntervalMs = 16;
+
+	// frame counter
+	unsigned long long m_nFrames = 0, m_nFramesAtSecondStart = 0;
+	ULONGLONG m_tmSecondStart = 0;
+	unsigned m_nFramesPerSecond = 0;
+
+	// how long view updates (one per mouse move while panning) and flushes of loaded tiles take,
+	// for DumpStats(); and when the window was created, for rates
+	TraceHistogram m_viewUpdateTimes, m_flushTimes;
+	ULONGLONG m_tmCreated = GetTickCount64();
+
+	// statistics overlay, toggled by F2, drawn with DirectWrite over everything else.
+	// Refreshed periodically while shown
+	bool m_bShowOverlay = false;
+	ComPtr<IDWriteFactory> m_pDWriteFactory;
+	ComPtr<IDWriteTextFormat> m_pOverlayTextFormat;
+	static constexpr D2D1_RECT_F OVERLAY_RECT = { 8.f, 8.f, 288.f, 188.f };
+	static const UINT OVERLAY_REFRESH_MS = 500;
+
+	// posted to itself when there are loaded tiles to repaint
+	static const UINT WM_FLUSHTILES = WM_APP + 1;
+	// posted to itself when tracks have been loaded
+	static const UINT WM_TRACKSLOADED = WM_APP + 2;
+	static const UINT_PTR FLUSH_TIMER_ID = 1;
+	static const UINT_PTR OVERLAY_TIMER_ID = 2;
+	static const UINT_PTR RETRY_TIMER_ID = 3;
+
+	// highest zoom level supported
+	static const unsigned MAX_ZOOM = 18;
+	// how many zoom levels up to look for a loaded tile to draw in place of a missing one
+	static const unsigned MAX_FALLBACK_LEVELS = 5;
+	// how many zoom levels below the current one are seeded by F5
+	static const unsigned SEED_ZOOM_LEVELS = 4;
+	// how much F6 takes off opacity of the top tile layer each time, going back to opaque after 0
+	static constexpr float LAYER_OPACITY_STEP = .25f;
+	// how far ahead, ms, to predict panning for prefetching tiles, and at most how many tiles ahead;
+	// the latter should be within TileScheduler's prefetch ring
+	static const unsigned PREFETCH_LOOKAHEAD_MS = 750;
+	static const int PREFETCH_MAX_TILES = 3;
+
+	// the window of tiles and predicted shift PrefetchTiles() last went all the way through for,
+	// without running out of prefetch budget; while they stay the same, there is nothing new to prefetch
+	struct PrefetchWindow
+	{
+		unsigned nZoom, x, y, width, height;
+		int nShiftX, nShiftY;
+		bool operator==(const PrefetchWindow&) const = default;
+	};
+	PrefetchWindow m_lastPrefetch = {};
+	bool m_bPrefetchComplete = false;
+
+	// screen position of the top left visible tile at the current zoom level
+	void GetTopLeftOffset(int& xOffset, int& yOffset);
+	// screen rectangle of a tile at any zoom level, given the offset above
+	D2D1_RECT_F GetTileRect(TileCoords coords, int xOffset, int yOffset);
+
+	// called on a worker thread when tile loads are done, posts WM_FLUSHTILES to pick them up
+	void OnTileCompletion();
+	// called on the UI thread when a tile has been set ready, queues it for repainting
+	void OnTileLoaded(TileCoords coords);
+	// flushes loaded tiles right away if a frame interval has passed since the last
+	// time, or sets a timer to do that otherwise
+	void ScheduleFlush();
+	// applies tile loads done so far (see TileManager::ProcessCompletions()), and invalidates
+	// screen rectangles of tiles loaded
+	void FlushLoadedTiles();
+	// retries failed tiles which are due, and sets a timer for when the next ones are
+	void ScheduleRetry();
+	// adds tracks loaded by LoadTracks() and fits the view to them
+	void OnTracksLoaded();
+
+	// shows or hides statistics overlay
+	void ToggleOverlay();
+	// draws statistics overlay, frame time, requests, cache and decoding
+	void DrawOverlay();
+	// stops seeding if it is running; otherwise resumes the saved seeding job, if any,
+	// or starts seeding the visible area from the current zoom level down
+	void ToggleSeeding();
+	// steps opacity of the top tile layer down, if there is more than one layer
+	void CycleLayerOpacity();
+	// writes trace recorded so far to a timestamped file in app data directory
+	void DumpTrace();
+	// writes statistics of all components, and latency percentiles of UI thread work, to a
+	// timestamped JSON file in app data directory, for comparing runs and builds
+	void DumpStats();
+
+	// draws placeholder for a tile which is not loaded: part of a loaded tile from a lower zoom
+	// level scaled up, and/or loaded tiles from the next zoom level scaled down
+	void DrawFallbackTile(Canvas& canvas, TileCoords coords, D2D1_RECT_F rectangle);
+
+	// centers the map at a point, given in Mercator coordinates
+	void MoveTo(MercatorPoint ptCenter, unsigned nZoom);
 	// ensures tiles are loaded for the current view
 	void UpdateView();
 	// recalculates derived numbers above for the current view
 	void UpdateNumbers();
+	// requests tiles which will likely be needed soon: along the predicted panning
+	// trajectory, and at adjacent zoom levels around the center
+	void PrefetchTiles();
 };
 
@@ -0,0 +1,66 @@
+#pragma once
+
+// MpscQueue.h: lock-free queue for many producer threads and a single consumer thread.  Producers
+// push onto an intrusive stack with compare-and-swap; the consumer takes the whole stack at once
+// with an exchange, and reverses it into the order items were pushed in.  Neither side ever waits
+// for the other, so e. g. a decode thread posting a result never blocks on the UI thread.
+// Since the consumer never takes single nodes off the stack, there is no ABA problem.
+
+template <typename T>
+class MpscQueue
+{
+public:
+	MpscQueue() = default;
+	// drops any items left
+	~MpscQueue() { Drain([](T&) {}); }
+
+	// no copy/assignment
+	MpscQueue& operator=(const MpscQueue&) = delete;
+	MpscQueue(const MpscQueue&) = delete;
+
+	// adds an item, from any thread.  Returns true if the queue was empty before
+	bool Push(T item)
+	{
+		Node* pHead = m_pHead.load(std::memory_order_relaxed);
+		Node* pNode = new Node{ std::move(item), pHead };
+		while (!m_pHead.compare_exchange_weak(pHead, pNode, std::memory_order_release, std::memory_order_relaxed)) {
+			pNode->pNext = pHead;
+		}
+		// not pNode->pNext: once pushed, the node belongs to the consumer, which may have taken it
+		// (and relinked or freed it) already
+		return pHead == nullptr;
+	}
+
+	// calls fn(T&) for every item pushed so far, oldest first, and removes them.  Items pushed
+	// meanwhile are left for the next call.  Consumer thread only.  Returns number of items
+	template <typename F>
+	size_t Drain(F fn)
+	{
+		Node* pNode = m_pHead.exchange(nullptr, std::memory_order_acquire);
+		Node* pOldest = nullptr;
+		while (pNode) {
+			Node* pNext = pNode->pNext;
+			pNode->pNext = pOldest;
+			pOldest = pNode;
+			pNode = pNext;
+		}
+		size_t nItems = 0;
+		while (pOldest) {
+			std::unique_ptr<Node> pDone(pOldest);
+			pOldest = pDone->pNext;
+			fn(pDone->item);
+			nItems++;
+		}
+		return nItems;
+	}
+
+	bool empty() const { return m_pHead.load(std::memory_order_relaxed) == nullptr; }
+
+private:
+	struct Node
+	{
+		T item;
+		Node* pNext;
+	};
+	std::atomic<Node*> m_pHead = nullptr;
+};
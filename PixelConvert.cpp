@@ -0,0 +1,401 @@
+// PixelConvert.cpp: pixel conversion kernels and runtime dispatch
+
+#include "framework.h"
+#include "PixelConvert.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#ifdef _WIN32
+#include <intrin.h>
+#endif
+#define PIXELCONVERT_X86
+#endif
+
+// converts a row of pixels of one specific format
+typedef void (*RowConverter)(const BYTE* pSrc, UINT32* pDst, size_t nPixels);
+
+// Scalar reference versions.  Also used for the leftover pixels at the end of a row by SIMD versions
+
+// x / 255, rounded to nearest, exact for x <= 255 * 255
+static inline UINT32 Div255(UINT32 x)
+{
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+static inline UINT32 MakePBGRA(UINT32 r, UINT32 g, UINT32 b, UINT32 a)
+{
+	if (a != 255) {
+		r = Div255(r * a);
+		g = Div255(g * a);
+		b = Div255(b * a);
+	}
+	return b | (g << 8) | (r << 16) | (a << 24);
+}
+
+static void Gray8Scalar(const BYTE* pSrc, UINT32* pDst, size_t nPixels)
+{
+	for (size_t i = 0; i < nPixels; i++) {
+		pDst[i] = 0xff000000 | (pSrc[i] * 0x010101u);
+	}
+}
+
+static void Rgb24Scalar(const BYTE* pSrc, UINT32* pDst, size_t nPixels)
+{
+	for (size_t i = 0; i < nPixels; i++, pSrc += 3) {
+		pDst[i] = 0xff000000 | (pSrc[0] << 16) | (pSrc[1] << 8) | pSrc[2];
+	}
+}
+
+static void Bgr24Scalar(const BYTE* pSrc, UINT32* pDst, size_t nPixels)
+{
+	for (size_t i = 0; i < nPixels; i++, pSrc += 3) {
+		pDst[i] = 0xff000000 | (pSrc[2] << 16) | (pSrc[1] << 8) | pSrc[0];
+	}
+}
+
+static void Rgba32Scalar(const BYTE* pSrc, UINT32* pDst, size_t nPixels)
+{
+	for (size_t i = 0; i < nPixels; i++, pSrc += 4) {
+		pDst[i] = MakePBGRA(pSrc[0], pSrc[1], pSrc[2], pSrc[3]);
+	}
+}
+
+static void Bgra32Scalar(const BYTE* pSrc, UINT32* pDst, size_t nPixels)
+{
+	for (size_t i = 0; i < nPixels; i++, pSrc += 4) {
+		pDst[i] = MakePBGRA(pSrc[2], pSrc[1], pSrc[0], pSrc[3]);
+	}
+}
+
+static void Bgrx32Scalar(const BYTE* pSrc, UINT32* pDst, size_t nPixels)
+{
+	for (size_t i = 0; i < nPixels; i++, pSrc += 4) {
+		pDst[i] = 0xff000000 | (pSrc[2] << 16) | (pSrc[1] << 8) | pSrc[0];
+	}
+}
+
+#ifdef PIXELCONVERT_X86
+
+// SSE2 versions, 4 pixels (16 for grayscale) at a time
+
+// swaps bytes 0 and 2 in every pixel, i. e. RGBA <-> BGRA
+static inline __m128i SwapRedBlueSSE2(__m128i v)
+{
+	__m128i ag = _mm_and_si128(v, _mm_set1_epi32((int)0xff00ff00));
+	__m128i rb = _mm_and_si128(v, _mm_set1_epi32(0x00ff00ff));
+	rb = _mm_or_si128(_mm_srli_epi32(rb, 16), _mm_slli_epi32(rb, 16));
+	return _mm_or_si128(ag, rb);
+}
+
+// multiplies color components of 4 BGRA pixels by their alpha
+static inline __m128i PremultiplySSE2(__m128i v)
+{
+	// skip the math if all pixels are opaque, which is by far the most common case for map tiles
+	__m128i opaque = _mm_cmpeq_epi32(_mm_or_si128(v, _mm_set1_epi32(0x00ffffff)), _mm_set1_epi32(-1));
+	if (_mm_movemask_epi8(opaque) == 0xffff) {
+		return v;
+	}
+
+	// widen to 16 bits per component, 2 pixels per register
+	const __m128i zero = _mm_setzero_si128();
+	__m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+	// multiplier is alpha for color components, and 255 for alpha itself so that it stays the same
+	const __m128i alpha255 = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+	__m128i alo = _mm_or_si128(_mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3)), alpha255);
+	__m128i ahi = _mm_or_si128(_mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3)), alpha255);
+	// same as Div255(), fits in unsigned 16 bits
+	const __m128i half = _mm_set1_epi16(128);
+	lo = _mm_add_epi16(_mm_mullo_epi16(lo, alo), half);
+	hi = _mm_add_epi16(_mm_mullo_epi16(hi, ahi), half);
+	lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+	hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+	return _mm_packus_epi16(lo, hi);
+}
+
+static void Gray8SSE2(const BYTE* pSrc, UINT32* pDst, size_t nPixels)
+{
+	const __m128i ones = _mm_set1_epi8(-1);
+	size_t i = 0;
+	for (; i + 16 <= nPixels; i += 16) {
+		__m128i g = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc + i));
+		// gg and ga pairs, then interleaved into ggga
+		__m128i ggLo = _mm_unpacklo_epi8(g, g), ggHi = _mm_unpackhi_epi8(g, g);
+		__m128i gaLo = _mm_unpacklo_epi8(g, ones), gaHi = _mm_unpackhi_epi8(g, ones);
+		__m128i* p = reinterpret_cast<__m128i*>(pDst + i);
+		_mm_storeu_si128(p, _mm_unpacklo_epi16(ggLo, gaLo));
+		_mm_storeu_si128(p + 1, _mm_unpackhi_epi16(ggLo, gaLo));
+		_mm_storeu_si128(p + 2, _mm_unpacklo_epi16(ggHi, gaHi));
+		_mm_storeu_si128(p + 3, _mm_unpackhi_epi16(ggHi, gaHi));
+	}
+	Gray8Scalar(pSrc + i, pDst + i, nPixels - i);
+}
+
+// loads 4 pixels of 3 bytes into 4 dwords, with 4th byte set to 255.  Reads 16 bytes
+static inline __m128i Load24SSE2(const BYTE* pSrc)
+{
+	__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc));
+	__m128i p01 = _mm_unpacklo_epi32(v, _mm_srli_si128(v, 3));
+	__m128i p23 = _mm_unpacklo_epi32(_mm_srli_si128(v, 6), _mm_srli_si128(v, 9));
+	v = _mm_unpacklo_epi64(p01, p23);
+	return _mm_or_si128(v, _mm_set1_epi32((int)0xff000000));
+}
+
+static void Rgb24SSE2(const BYTE* pSrc, UINT32* pDst, size_t nPixels)
+{
+	// 16 bytes are read for every 12, so stop early enough not to read past the end
+	size_t i = 0;
+	for (; (nPixels - i) * 3 >= 16; i += 4) {
+		__m128i v = SwapRedBlueSSE2(Load24SSE2(pSrc + i * 3));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(pDst + i), v);
+	}
+	Rgb24Scalar(pSrc + i * 3, pDst + i, nPixels - i);
+}
+
+static void Bgr24SSE2(const BYTE* pSrc, UINT32* pDst, size_t nPixels)
+{
+	size_t i = 0;
+	for (; (nPixels - i) * 3 >= 16; i += 4) {
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(pDst + i), Load24SSE2(pSrc + i * 3));
+	}
+	Bgr24Scalar(pSrc + i * 3, pDst + i, nPixels - i);
+}
+
+static void Rgba32SSE2(const BYTE* pSrc, UINT32* pDst, size_t nPixels)
+{
+	size_t i = 0;
+	for (; i + 4 <= nPixels; i += 4) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc + i * 4));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(pDst + i), PremultiplySSE2(SwapRedBlueSSE2(v)));
+	}
+	Rgba32Scalar(pSrc + i * 4, pDst + i, nPixels - i);
+}
+
+static void Bgra32SSE2(const BYTE* pSrc, UINT32* pDst, size_t nPixels)
+{
+	size_t i = 0;
+	for (; i + 4 <= nPixels; i += 4) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc + i * 4));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(pDst + i), PremultiplySSE2(v));
+	}
+	Bgra32Scalar(pSrc + i * 4, pDst + i, nPixels - i);
+}
+
+static void Bgrx32SSE2(const BYTE* pSrc, UINT32* pDst, size_t nPixels)
+{
+	const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+	size_t i = 0;
+	for (; i + 4 <= nPixels; i += 4) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc + i * 4));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(pDst + i), _mm_or_si128(v, alpha));
+	}
+	Bgrx32Scalar(pSrc + i * 4, pDst + i, nPixels - i);
+}
+
+// AVX2 versions, 8 pixels at a time.  Grayscale just uses the SSE2 version, it is bound
+// by memory bandwidth anyway.  GCC and Clang only allow AVX2 intrinsics in code compiled for it
+
+#ifdef __GNUC__
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+
+static inline __m256i PremultiplyAVX2(__m256i v)
+{
+	__m256i opaque = _mm256_cmpeq_epi32(_mm256_or_si256(v, _mm256_set1_epi32(0x00ffffff)), _mm256_set1_epi32(-1));
+	if (_mm256_movemask_epi8(opaque) == -1) {
+		return v;
+	}
+
+	// same as PremultiplySSE2(), unpack and pack work within 128-bit lanes so the order is preserved
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i lo = _mm256_unpacklo_epi8(v, zero), hi = _mm256_unpackhi_epi8(v, zero);
+	const __m256i alpha255 = _mm256_set_epi16(255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0, 255, 0, 0, 0);
+	__m256i alo = _mm256_or_si256(_mm256_shufflehi_epi16(_mm256_shufflelo_epi16(lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3)), alpha255);
+	__m256i ahi = _mm256_or_si256(_mm256_shufflehi_epi16(_mm256_shufflelo_epi16(hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3)), alpha255);
+	const __m256i half = _mm256_set1_epi16(128);
+	lo = _mm256_add_epi16(_mm256_mullo_epi16(lo, alo), half);
+	hi = _mm256_add_epi16(_mm256_mullo_epi16(hi, ahi), half);
+	lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+	hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+	return _mm256_packus_epi16(lo, hi);
+}
+
+// loads 8 pixels of 3 bytes into 8 dwords, with 4th byte set to 255 and optionally
+// swapping bytes 0 and 2.  Reads 32 bytes
+static inline __m256i Load24AVX2(const BYTE* pSrc, bool bSwap)
+{
+	// bytes 0..11 go to the lower lane, 12..23 to the upper one, then spread within lanes
+	__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pSrc));
+	v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0));
+	const __m256i spread = bSwap ?
+		_mm256_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1) :
+		_mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	v = _mm256_shuffle_epi8(v, spread);
+	return _mm256_or_si256(v, _mm256_set1_epi32((int)0xff000000));
+}
+
+static void Rgb24AVX2(const BYTE* pSrc, UINT32* pDst, size_t nPixels)
+{
+	size_t i = 0;
+	for (; (nPixels - i) * 3 >= 32; i += 8) {
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(pDst + i), Load24AVX2(pSrc + i * 3, true));
+	}
+	Rgb24Scalar(pSrc + i * 3, pDst + i, nPixels - i);
+}
+
+static void Bgr24AVX2(const BYTE* pSrc, UINT32* pDst, size_t nPixels)
+{
+	size_t i = 0;
+	for (; (nPixels - i) * 3 >= 32; i += 8) {
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(pDst + i), Load24AVX2(pSrc + i * 3, false));
+	}
+	Bgr24Scalar(pSrc + i * 3, pDst + i, nPixels - i);
+}
+
+static void Rgba32AVX2(const BYTE* pSrc, UINT32* pDst, size_t nPixels)
+{
+	const __m256i swap = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+		2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+	size_t i = 0;
+	for (; i + 8 <= nPixels; i += 8) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pSrc + i * 4));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(pDst + i), PremultiplyAVX2(_mm256_shuffle_epi8(v, swap)));
+	}
+	Rgba32Scalar(pSrc + i * 4, pDst + i, nPixels - i);
+}
+
+static void Bgra32AVX2(const BYTE* pSrc, UINT32* pDst, size_t nPixels)
+{
+	size_t i = 0;
+	for (; i + 8 <= nPixels; i += 8) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pSrc + i * 4));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(pDst + i), PremultiplyAVX2(v));
+	}
+	Bgra32Scalar(pSrc + i * 4, pDst + i, nPixels - i);
+}
+
+static void Bgrx32AVX2(const BYTE* pSrc, UINT32* pDst, size_t nPixels)
+{
+	const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+	size_t i = 0;
+	for (; i + 8 <= nPixels; i += 8) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pSrc + i * 4));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(pDst + i), _mm256_or_si256(v, alpha));
+	}
+	Bgrx32Scalar(pSrc + i * 4, pDst + i, nPixels - i);
+}
+
+#ifdef __GNUC__
+#pragma GCC pop_options
+#endif
+
+#endif // PIXELCONVERT_X86
+
+// kernels for every SIMD level
+struct Kernels
+{
+	RowConverter fnGray8, fnRgb24, fnBgr24, fnRgba32, fnBgra32, fnBgrx32;
+};
+
+static const Kernels KERNELS[] = {
+	{ Gray8Scalar, Rgb24Scalar, Bgr24Scalar, Rgba32Scalar, Bgra32Scalar, Bgrx32Scalar },
+#ifdef PIXELCONVERT_X86
+	{ Gray8SSE2, Rgb24SSE2, Bgr24SSE2, Rgba32SSE2, Bgra32SSE2, Bgrx32SSE2 },
+	{ Gray8SSE2, Rgb24AVX2, Bgr24AVX2, Rgba32AVX2, Bgra32AVX2, Bgrx32AVX2 },
+#endif
+};
+
+#if defined(PIXELCONVERT_X86) && defined(__GNUC__)
+__attribute__((target("xsave")))
+#endif
+static SimdLevel DetectSimdLevel()
+{
+#ifdef PIXELCONVERT_X86
+	int info[4];
+	__cpuid(info, 0);
+	int nMaxLeaf = info[0];
+	__cpuid(info, 1);
+	bool bSSE2 = (info[3] & (1 << 26)) != 0;
+	// AVX2 needs the OS to save YMM registers too (OSXSAVE + XCR0 bits 1 and 2)
+	bool bAVX = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+	if (bAVX && nMaxLeaf >= 7) {
+		__cpuidex(info, 7, 0);
+		if (info[1] & (1 << 5)) {
+			return SIMD_AVX2;
+		}
+	}
+	return bSSE2 ? SIMD_SSE2 : SIMD_SCALAR;
+#else
+	return SIMD_SCALAR;
+#endif
+}
+
+static const SimdLevel s_simdSupported = DetectSimdLevel();
+static std::atomic<SimdLevel> s_simdLevel = s_simdSupported;
+
+unsigned PixelSourceBytes(PixelSourceFormat format)
+{
+	switch (format) {
+	case PSF_GRAY8:
+	case PSF_INDEXED8:
+		return 1;
+	case PSF_RGB24:
+	case PSF_BGR24:
+		return 3;
+	default:
+		return 4;
+	}
+}
+
+void ConvertToPBGRA(PixelSourceFormat format, const BYTE* pSrc, UINT32* pDst, size_t nPixels, const UINT32* pPalette)
+{
+	const Kernels& kernels = KERNELS[s_simdLevel];
+	switch (format) {
+	case PSF_GRAY8:
+		kernels.fnGray8(pSrc, pDst, nPixels);
+		break;
+	case PSF_INDEXED8:
+		// plain table lookup, nothing to gain from SIMD here without gather
+		_ASSERT(pPalette);
+		for (size_t i = 0; i < nPixels; i++) {
+			pDst[i] = pPalette[pSrc[i]];
+		}
+		break;
+	case PSF_RGB24:
+		kernels.fnRgb24(pSrc, pDst, nPixels);
+		break;
+	case PSF_BGR24:
+		kernels.fnBgr24(pSrc, pDst, nPixels);
+		break;
+	case PSF_RGBA32:
+		kernels.fnRgba32(pSrc, pDst, nPixels);
+		break;
+	case PSF_BGRA32:
+		kernels.fnBgra32(pSrc, pDst, nPixels);
+		break;
+	case PSF_BGRX32:
+		kernels.fnBgrx32(pSrc, pDst, nPixels);
+		break;
+	case PSF_PBGRA32:
+		// an empty row may come with null pointers, which memcpy() doesn't take even then
+		if (nPixels && reinterpret_cast<const BYTE*>(pDst) != pSrc) {
+			memcpy(pDst, pSrc, nPixels * 4);
+		}
+		break;
+	}
+}
+
+UINT32 PremultiplyColor(UINT32 nColor)
+{
+	return MakePBGRA((nColor >> 16) & 0xff, (nColor >> 8) & 0xff, nColor & 0xff, nColor >> 24);
+}
+
+SimdLevel GetSimdLevel()
+{
+	return s_simdLevel;
+}
+
+void SetSimdLevel(SimdLevel level)
+{
+	s_simdLevel = std::min(level, s_simdSupported);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+// PixelConvert.h: conversion of rows of decoded pixels from the formats tile servers actually
+// send into 32bpp premultiplied BGRA, which is what Direct2D wants.  There are scalar
+// reference implementations and SSE2/AVX2 ones; the best version supported by the CPU
+// is picked at runtime.  Premultiplication rounds exactly, i. e. c * a / 255 rounded to nearest,
+// so all versions produce identical results.
+
+// source pixel formats, byte order as in memory
+enum PixelSourceFormat
+{
+	PSF_GRAY8,		// 8bpp grayscale
+	PSF_INDEXED8,	// 8bpp palette indices
+	PSF_RGB24,
+	PSF_BGR24,
+	PSF_RGBA32,		// straight (not premultiplied) alpha
+	PSF_BGRA32,		// straight alpha
+	PSF_BGRX32,		// 4th byte unused
+	PSF_PBGRA32		// already what we want, just copied
+};
+
+enum SimdLevel
+{
+	SIMD_SCALAR = 0,
+	SIMD_SSE2 = 1,
+	SIMD_AVX2 = 2
+};
+
+// bytes per pixel for a source format
+unsigned PixelSourceBytes(PixelSourceFormat format);
+
+// converts nPixels pixels from pSrc to premultiplied BGRA in pDst.  For 32bpp formats, pDst may
+// be the same as pSrc (in place conversion), otherwise the buffers must not overlap.  For
+// PSF_INDEXED8, pPalette must point to 256 colors already in premultiplied BGRA (see PremultiplyColor())
+void ConvertToPBGRA(PixelSourceFormat format, const BYTE* pSrc, UINT32* pDst, size_t nPixels, const UINT32* pPalette = nullptr);
+
+// premultiplies a single color in straight BGRA (0xAARRGGBB, e. g. WICColor)
+UINT32 PremultiplyColor(UINT32 nColor);
+
+// SIMD level in use, which is the best one supported by the CPU unless lowered by SetSimdLevel()
+SimdLevel GetSimdLevel();
+// forces a lower SIMD level, to compare versions against each other.  Levels
+// not supported by the CPU are ignored
+void SetSimdLevel(SimdLevel level);
@@ -0,0 +1,249 @@
+// PngDecoder.cpp: PngDecoder class implementation
+
+#include "framework.h"
+#include "Util.h"
+#include "Trace.h"
+#include "Inflate.h"
+#include "PngDecoder.h"
+
+static const BYTE PNG_SIGNATURE[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+// color types, as in IHDR
+enum PngColorType
+{
+	PCT_GRAY = 0,
+	PCT_RGB = 2,
+	PCT_PALETTE = 3,
+	PCT_GRAY_ALPHA = 4,
+	PCT_RGBA = 6
+};
+
+static uint32_t ReadBigEndian32(const BYTE* p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// undoes the filter of a row (filter byte first), given the row above, already unfiltered (all
+// zeros for the first row); nBpp is bytes per complete pixel, at least 1
+static bool Unfilter(BYTE* pRow, const BYTE* pAbove, size_t szRow, unsigned nBpp)
+{
+	BYTE nFilter = *pRow++;
+	switch (nFilter) {
+	case 0:
+		break;
+	case 1:
+		// sub: from the pixel to the left
+		for (size_t n = nBpp; n < szRow; n++) {
+			pRow[n] += pRow[n - nBpp];
+		}
+		break;
+	case 2:
+		// up
+		for (size_t n = 0; n < szRow; n++) {
+			pRow[n] += pAbove[n];
+		}
+		break;
+	case 3:
+		// average of left and up
+		for (size_t n = 0; n < nBpp && n < szRow; n++) {
+			pRow[n] += pAbove[n] >> 1;
+		}
+		for (size_t n = nBpp; n < szRow; n++) {
+			pRow[n] += (BYTE)((pRow[n - nBpp] + pAbove[n]) >> 1);
+		}
+		break;
+	case 4:
+		// Paeth: whichever of left, up and up left is closest to left + up - up left
+		for (size_t n = 0; n < nBpp && n < szRow; n++) {
+			pRow[n] += pAbove[n];
+		}
+		for (size_t n = nBpp; n < szRow; n++) {
+			int a = pRow[n - nBpp], b = pAbove[n], c = pAbove[n - nBpp];
+			int pa = std::abs(b - c), pb = std::abs(a - c), pc = std::abs(a + b - 2 * c);
+			pRow[n] += (BYTE)(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+		}
+		break;
+	default:
+		return false;
+	}
+	return true;
+}
+
+bool PngDecoder::Decode(const void* pData, size_t szLength, DecodedImage& image)
+{
+	TRACE_SCOPE("DecodePng");
+	const BYTE* p = reinterpret_cast<const BYTE*>(pData);
+	const BYTE* pEnd = p + szLength;
+	if (szLength < sizeof(PNG_SIGNATURE) || memcmp(p, PNG_SIGNATURE, sizeof(PNG_SIGNATURE))) {
+		PrintLnDebug(L"Not a PNG image at 0x{:x}", (intptr_t)pData);
+		return false;
+	}
+	p += sizeof(PNG_SIGNATURE);
+
+	unsigned nWidth = 0, nHeight = 0, nBitDepth = 0, nColorType = 0;
+	// straight 0xAARRGGBB until premultiplied below
+	UINT32 palette[256];
+	std::fill_n(palette, 256, 0xff000000);
+	// image data: where it is if there's one IDAT chunk, as usual, otherwise all of them joined
+	const BYTE* pImageData = nullptr;
+	size_t szImageData = 0;
+	thread_local std::vector<BYTE> vecImageData;
+	vecImageData.clear();
+	bool bEnd = false;
+	while (!bEnd) {
+		if (pEnd - p < 12) {
+			PrintLnDebug(L"PNG image at 0x{:x} is truncated", (intptr_t)pData);
+			return false;
+		}
+		uint32_t nLength = ReadBigEndian32(p);
+		if (nLength > (size_t)(pEnd - p) - 12) {
+			PrintLnDebug(L"PNG image at 0x{:x} is truncated", (intptr_t)pData);
+			return false;
+		}
+		const BYTE* pType = p + 4;
+		const BYTE* pChunk = p + 8;
+		p += 12 + nLength;
+
+		if (!memcmp(pType, "IHDR", 4)) {
+			if (nLength != 13) {
+				return false;
+			}
+			nWidth = ReadBigEndian32(pChunk);
+			nHeight = ReadBigEndian32(pChunk + 4);
+			nBitDepth = pChunk[8];
+			nColorType = pChunk[9];
+			bool bDepthValid;
+			switch (nColorType) {
+			case PCT_GRAY:
+				bDepthValid = nBitDepth == 1 || nBitDepth == 2 || nBitDepth == 4 || nBitDepth == 8 || nBitDepth == 16;
+				break;
+			case PCT_PALETTE:
+				bDepthValid = nBitDepth == 1 || nBitDepth == 2 || nBitDepth == 4 || nBitDepth == 8;
+				break;
+			case PCT_RGB:
+			case PCT_GRAY_ALPHA:
+			case PCT_RGBA:
+				bDepthValid = nBitDepth == 8 || nBitDepth == 16;
+				break;
+			default:
+				bDepthValid = false;
+			}
+			// compression and filter method 0 are the only ones there are
+			if (!nWidth || !nHeight || nWidth > MAX_SIZE || nHeight > MAX_SIZE || !bDepthValid || pChunk[10] || pChunk[11]) {
+				PrintLnDebug(L"PNG image at 0x{:x} has an invalid header", (intptr_t)pData);
+				return false;
+			}
+			if (pChunk[12]) {
+				PrintLnDebug(L"PNG image at 0x{:x} is interlaced, which is not supported", (intptr_t)pData);
+				return false;
+			}
+		} else if (!nWidth) {
+			// IHDR must be first
+			return false;
+		} else if (!memcmp(pType, "PLTE", 4)) {
+			if (nLength % 3 || nLength > 256 * 3) {
+				return false;
+			}
+			for (unsigned n = 0; n < nLength / 3; n++) {
+				palette[n] = 0xff000000 | (UINT32)pChunk[n * 3] << 16 | (UINT32)pChunk[n * 3 + 1] << 8 | pChunk[n * 3 + 2];
+			}
+		} else if (!memcmp(pType, "tRNS", 4)) {
+			if (nColorType == PCT_PALETTE) {
+				for (unsigned n = 0; n < nLength && n < 256; n++) {
+					palette[n] = (palette[n] & 0x00ffffff) | (UINT32)pChunk[n] << 24;
+				}
+			}
+		} else if (!memcmp(pType, "IDAT", 4)) {
+			if (!pImageData && vecImageData.empty()) {
+				pImageData = pChunk;
+				szImageData = nLength;
+			} else {
+				if (pImageData) {
+					vecImageData.assign(pImageData, pImageData + szImageData);
+					pImageData = nullptr;
+				}
+				vecImageData.insert(vecImageData.end(), pChunk, pChunk + nLength);
+			}
+		} else if (!memcmp(pType, "IEND", 4)) {
+			bEnd = true;
+		} else if (!(pType[0] & 0x20)) {
+			// a critical chunk we don't know, the image can't be decoded without it
+			PrintLnDebug(L"PNG image at 0x{:x} has an unknown critical chunk", (intptr_t)pData);
+			return false;
+		}
+	}
+	if (!pImageData) {
+		pImageData = vecImageData.data();
+		szImageData = vecImageData.size();
+	}
+
+	// rows as stored, each with its filter byte first; the buffer is reused across images on
+	// the same decode thread
+	static const unsigned CHANNELS[7] = { 1, 0, 3, 1, 2, 0, 4 };
+	unsigned nBitsPerPixel = CHANNELS[nColorType] * nBitDepth;
+	size_t szRow = ((size_t)nWidth * nBitsPerPixel + 7) / 8;
+	unsigned nBpp = std::max(nBitsPerPixel / 8, 1u);
+	thread_local std::vector<BYTE> vecRows;
+	vecRows.resize((szRow + 1) * nHeight);
+	{
+		TRACE_SCOPE("InflatePng");
+		if (!ZlibInflate(pImageData, szImageData, vecRows.data(), vecRows.size())) {
+			PrintLnDebug(L"PNG image at 0x{:x} has damaged image data", (intptr_t)pData);
+			return false;
+		}
+	}
+
+	PixelSourceFormat format = nColorType == PCT_GRAY ? PSF_GRAY8 : nColorType == PCT_PALETTE ? PSF_INDEXED8 :
+		nColorType == PCT_RGB ? PSF_RGB24 : PSF_RGBA32;
+	for (UINT32& nColor : palette) {
+		nColor = PremultiplyColor(nColor);
+	}
+	image.nWidth = nWidth;
+	image.nHeight = nHeight;
+	image.vecPixels.resize((size_t)image.stride() * nHeight);
+	// a row of 8-bit samples, for what isn't stored that way
+	thread_local std::vector<BYTE> vecSamples;
+	vecSamples.resize((size_t)nWidth * 4);
+	thread_local std::vector<BYTE> vecZeros;
+	vecZeros.assign(szRow, 0);
+	const BYTE* pAbove = vecZeros.data();
+	for (unsigned y = 0; y < nHeight; y++) {
+		BYTE* pRow = vecRows.data() + (szRow + 1) * y;
+		if (!Unfilter(pRow, pAbove, szRow, nBpp)) {
+			PrintLnDebug(L"PNG image at 0x{:x} has an invalid filter", (intptr_t)pData);
+			return false;
+		}
+		pRow++;
+		pAbove = pRow;
+
+		const BYTE* pSamples = pRow;
+		size_t nSamples = (size_t)nWidth * CHANNELS[nColorType];
+		if (nBitDepth == 16) {
+			// the most significant byte of each
+			for (size_t n = 0; n < nSamples; n++) {
+				vecSamples[n] = pRow[n * 2];
+			}
+			pSamples = vecSamples.data();
+		} else if (nBitDepth < 8) {
+			// packed, the leftmost pixel in the high bits; gray is scaled to 0..255
+			unsigned nMask = (1u << nBitDepth) - 1, nScale = nColorType == PCT_GRAY ? 255 / nMask : 1;
+			for (size_t n = 0; n < nSamples; n++) {
+				size_t nBit = n * nBitDepth;
+				vecSamples[n] = (BYTE)(((pRow[nBit / 8] >> (8 - nBitDepth - nBit % 8)) & nMask) * nScale);
+			}
+			pSamples = vecSamples.data();
+		}
+		if (nColorType == PCT_GRAY_ALPHA) {
+			// as RGBA, backwards so that it can be done in place
+			BYTE* pRgba = vecSamples.data();
+			for (size_t n = nWidth; n-- > 0; ) {
+				BYTE nGray = pSamples[n * 2], nAlpha = pSamples[n * 2 + 1];
+				pRgba[n * 4] = pRgba[n * 4 + 1] = pRgba[n * 4 + 2] = nGray;
+				pRgba[n * 4 + 3] = nAlpha;
+			}
+			pSamples = pRgba;
+		}
+		ConvertToPBGRA(format, pSamples, reinterpret_cast<UINT32*>(image.vecPixels.data() + (size_t)image.stride() * y), nWidth, palette);
+	}
+	return true;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+// PngDecoder.h: ImageDecoder for PNG, which doesn't need WIC, so that tiles can be decoded (and
+// decoding measured) on any platform; it's what TileManager decodes with where there is no WIC.
+// All color types and bit depths are supported, with palette transparency; not supported are
+// interlaced images (tile servers don't send them) and transparency by color key (tRNS for gray
+// and truecolor images is ignored, such pixels come out opaque).  Pixels are converted with
+// PixelConvert, as WicImageDecoder does.  Chunk CRCs are not checked, the zlib checksum covers
+// the image data (see Inflate.h)
+
+#include "ImageDecoder.h"
+
+class PngDecoder : public ImageDecoder
+{
+public:
+	bool Decode(const void* pData, size_t szLength, DecodedImage& image) override;
+
+	// images larger than this either way are refused
+	static const unsigned MAX_SIZE = 16384;
+};
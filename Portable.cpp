@@ -0,0 +1,390 @@
+// Portable.cpp: POSIX implementation of the Windows functions declared in Portable.h.
+// Not part of the Windows build
+
+#include "framework.h"
+
+#ifndef _WIN32
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstdio>
+
+// a file handle: a descriptor; a mapping handle: the descriptor of its file (duplicated, so that
+// the file may be closed first, as on Windows), with the protection the mapping is for
+struct PortableHandle
+{
+	int fd;
+	bool bMapping;
+	DWORD dwProtect;
+};
+
+static thread_local DWORD t_dwLastError = ERROR_SUCCESS;
+
+// views mapped by MapViewOfFile(), with their lengths, for UnmapViewOfFile()
+static std::mutex g_viewsMutex;
+static std::map<const void*, size_t> g_mapViews;
+
+static DWORD ErrnoToError(int nErrno)
+{
+	switch (nErrno) {
+	case ENOENT: return ERROR_FILE_NOT_FOUND;
+	case EACCES: case EPERM: return ERROR_ACCESS_DENIED;
+	case EBADF: return ERROR_INVALID_HANDLE;
+	case ENOMEM: return ERROR_NOT_ENOUGH_MEMORY;
+	case EEXIST: return ERROR_ALREADY_EXISTS;
+	default: return 0x20000000 | (DWORD)nErrno;
+	}
+}
+
+// sets last error from errno, and returns FALSE, for failure paths
+static BOOL Fail()
+{
+	t_dwLastError = ErrnoToError(errno);
+	return FALSE;
+}
+
+static int HandleFd(HANDLE h)
+{
+	return (h && h != INVALID_HANDLE_VALUE) ? static_cast<PortableHandle*>(h)->fd : -1;
+}
+
+static std::string WideToUtf8(std::wstring_view strText)
+{
+	std::string str;
+	str.reserve(strText.size());
+	for (wchar_t c : strText) {
+		unsigned n = (unsigned)c;
+		if (n < 0x80) {
+			str += (char)n;
+		} else if (n < 0x800) {
+			str += (char)(0xc0 | (n >> 6));
+			str += (char)(0x80 | (n & 0x3f));
+		} else if (n < 0x10000) {
+			str += (char)(0xe0 | (n >> 12));
+			str += (char)(0x80 | ((n >> 6) & 0x3f));
+			str += (char)(0x80 | (n & 0x3f));
+		} else {
+			str += (char)(0xf0 | (n >> 18));
+			str += (char)(0x80 | ((n >> 12) & 0x3f));
+			str += (char)(0x80 | ((n >> 6) & 0x3f));
+			str += (char)(0x80 | (n & 0x3f));
+		}
+	}
+	return str;
+}
+
+std::string PortablePath(const std::wstring& strPath)
+{
+	std::string str = WideToUtf8(strPath);
+	std::replace(str.begin(), str.end(), '\\', '/');
+	return str;
+}
+
+std::wstring WidePath(const std::string& strPath)
+{
+	std::wstring str;
+	str.reserve(strPath.size());
+	for (size_t n = 0; n < strPath.size(); ) {
+		unsigned char c = (unsigned char)strPath[n++];
+		unsigned nChar = c, nMore = 0;
+		if (c >= 0xf0) {
+			nChar = c & 0x07;
+			nMore = 3;
+		} else if (c >= 0xe0) {
+			nChar = c & 0x0f;
+			nMore = 2;
+		} else if (c >= 0xc0) {
+			nChar = c & 0x1f;
+			nMore = 1;
+		}
+		for (; nMore && n < strPath.size(); nMore--) {
+			nChar = (nChar << 6) | ((unsigned char)strPath[n++] & 0x3f);
+		}
+		str += (wchar_t)nChar;
+	}
+	return str;
+}
+
+HANDLE CreateFile(LPCWSTR pszPath, DWORD dwAccess, DWORD dwShareMode, void* pSecurity,
+	DWORD dwCreation, DWORD dwFlags, HANDLE hTemplate)
+{
+	int nFlags = (dwAccess & GENERIC_WRITE) ? ((dwAccess & GENERIC_READ) ? O_RDWR : O_WRONLY) : O_RDONLY;
+	switch (dwCreation) {
+	case CREATE_ALWAYS: nFlags |= O_CREAT | O_TRUNC; break;
+	case OPEN_ALWAYS: nFlags |= O_CREAT; break;
+	}
+	int fd = open(PortablePath(pszPath).c_str(), nFlags | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		Fail();
+		return INVALID_HANDLE_VALUE;
+	}
+	t_dwLastError = ERROR_SUCCESS;
+	return new PortableHandle{ fd, false, 0 };
+}
+
+BOOL ReadFile(HANDLE hFile, void* pBuffer, DWORD dwToRead, DWORD* pdwRead, void* pOverlapped)
+{
+	size_t nRead = 0;
+	while (nRead < dwToRead) {
+		ssize_t n = read(HandleFd(hFile), static_cast<char*>(pBuffer) + nRead, dwToRead - nRead);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			return Fail();
+		}
+		if (n == 0) {
+			break;
+		}
+		nRead += n;
+	}
+	*pdwRead = (DWORD)nRead;
+	return TRUE;
+}
+
+BOOL WriteFile(HANDLE hFile, const void* pBuffer, DWORD dwToWrite, DWORD* pdwWritten, void* pOverlapped)
+{
+	size_t nWritten = 0;
+	while (nWritten < dwToWrite) {
+		ssize_t n = write(HandleFd(hFile), static_cast<const char*>(pBuffer) + nWritten, dwToWrite - nWritten);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			return Fail();
+		}
+		nWritten += n;
+	}
+	*pdwWritten = (DWORD)nWritten;
+	return TRUE;
+}
+
+BOOL GetFileSizeEx(HANDLE hFile, LARGE_INTEGER* pSize)
+{
+	struct stat st;
+	if (fstat(HandleFd(hFile), &st) < 0) {
+		return Fail();
+	}
+	pSize->QuadPart = st.st_size;
+	return TRUE;
+}
+
+BOOL SetFilePointerEx(HANDLE hFile, LARGE_INTEGER liDistance, LARGE_INTEGER* pNewPointer, DWORD dwMethod)
+{
+	off_t pos = lseek(HandleFd(hFile), (off_t)liDistance.QuadPart, dwMethod == FILE_BEGIN ? SEEK_SET : SEEK_CUR);
+	if (pos < 0) {
+		return Fail();
+	}
+	if (pNewPointer) {
+		pNewPointer->QuadPart = pos;
+	}
+	return TRUE;
+}
+
+BOOL SetEndOfFile(HANDLE hFile)
+{
+	int fd = HandleFd(hFile);
+	off_t pos = lseek(fd, 0, SEEK_CUR);
+	if (pos < 0 || ftruncate(fd, pos) < 0) {
+		return Fail();
+	}
+	return TRUE;
+}
+
+BOOL FlushFileBuffers(HANDLE hFile)
+{
+	return fsync(HandleFd(hFile)) < 0 ? Fail() : TRUE;
+}
+
+HANDLE CreateFileMapping(HANDLE hFile, void* pSecurity, DWORD dwProtect, DWORD dwMaxSizeHigh, DWORD dwMaxSizeLow, LPCWSTR pszName)
+{
+	// only whole files are mapped here, as the callers do
+	_ASSERT(!dwMaxSizeHigh && !dwMaxSizeLow && !pszName);
+	int fd = dup(HandleFd(hFile));
+	if (fd < 0) {
+		Fail();
+		return nullptr;
+	}
+	return new PortableHandle{ fd, true, dwProtect };
+}
+
+void* MapViewOfFile(HANDLE hMapping, DWORD dwAccess, DWORD dwOffsetHigh, DWORD dwOffsetLow, SIZE_T nBytes)
+{
+	_ASSERT(!dwOffsetHigh && !dwOffsetLow && !nBytes);
+	PortableHandle* pMapping = static_cast<PortableHandle*>(hMapping);
+	struct stat st;
+	if (fstat(pMapping->fd, &st) < 0) {
+		Fail();
+		return nullptr;
+	}
+	int nProtect = pMapping->dwProtect == PAGE_READWRITE && dwAccess == FILE_MAP_ALL_ACCESS ? PROT_READ | PROT_WRITE : PROT_READ;
+	void* pView = mmap(nullptr, (size_t)st.st_size, nProtect, MAP_SHARED, pMapping->fd, 0);
+	if (pView == MAP_FAILED) {
+		Fail();
+		return nullptr;
+	}
+	std::lock_guard lock(g_viewsMutex);
+	g_mapViews[pView] = (size_t)st.st_size;
+	return pView;
+}
+
+BOOL UnmapViewOfFile(LPCVOID pView)
+{
+	size_t nLength;
+	{
+		std::lock_guard lock(g_viewsMutex);
+		auto it = g_mapViews.find(pView);
+		if (it == g_mapViews.end()) {
+			t_dwLastError = ERROR_INVALID_HANDLE;
+			return FALSE;
+		}
+		nLength = it->second;
+		g_mapViews.erase(it);
+	}
+	return munmap(const_cast<void*>(pView), nLength) < 0 ? Fail() : TRUE;
+}
+
+BOOL FlushViewOfFile(LPCVOID pAddress, SIZE_T nBytes)
+{
+	// msync wants a page aligned start; a length of 0 means the whole view, as on Windows
+	uintptr_t nPageSize = (uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t nStart = (uintptr_t)pAddress & ~(nPageSize - 1);
+	size_t nLength = nBytes + ((uintptr_t)pAddress - nStart);
+	if (!nBytes) {
+		std::lock_guard lock(g_viewsMutex);
+		auto it = g_mapViews.find(pAddress);
+		if (it == g_mapViews.end()) {
+			t_dwLastError = ERROR_INVALID_HANDLE;
+			return FALSE;
+		}
+		nLength = it->second;
+	}
+	return msync((void*)nStart, nLength, MS_ASYNC) < 0 ? Fail() : TRUE;
+}
+
+BOOL CloseHandle(HANDLE hObject)
+{
+	if (!hObject || hObject == INVALID_HANDLE_VALUE) {
+		t_dwLastError = ERROR_INVALID_HANDLE;
+		return FALSE;
+	}
+	PortableHandle* pHandle = static_cast<PortableHandle*>(hObject);
+	int nResult = close(pHandle->fd);
+	delete pHandle;
+	return nResult < 0 ? Fail() : TRUE;
+}
+
+BOOL DeleteFile(LPCWSTR pszPath)
+{
+	return unlink(PortablePath(pszPath).c_str()) < 0 ? Fail() : TRUE;
+}
+
+BOOL MoveFileEx(LPCWSTR pszFrom, LPCWSTR pszTo, DWORD dwFlags)
+{
+	std::string strTo = PortablePath(pszTo);
+	if (!(dwFlags & MOVEFILE_REPLACE_EXISTING) && access(strTo.c_str(), F_OK) == 0) {
+		t_dwLastError = ERROR_ALREADY_EXISTS;
+		return FALSE;
+	}
+	return rename(PortablePath(pszFrom).c_str(), strTo.c_str()) < 0 ? Fail() : TRUE;
+}
+
+BOOL CreateDirectory(LPCWSTR pszPath, void* pSecurity)
+{
+	return mkdir(PortablePath(pszPath).c_str(), 0755) < 0 ? Fail() : TRUE;
+}
+
+// a timer thread, calling the callback every dwPeriod ms (or once, if 0) until deleted
+struct PortableTimer
+{
+	WAITORTIMERCALLBACK pfnCallback;
+	PVOID pParameter;
+	DWORD dwDueTime, dwPeriod;
+	std::mutex mutex;
+	std::condition_variable cvDeleted;
+	bool bDeleted = false;
+	std::thread thread;
+};
+
+BOOL CreateTimerQueueTimer(PHANDLE phNewTimer, HANDLE hTimerQueue, WAITORTIMERCALLBACK pfnCallback,
+	PVOID pParameter, DWORD dwDueTime, DWORD dwPeriod, ULONG nFlags)
+{
+	PortableTimer* pTimer = new PortableTimer{ pfnCallback, pParameter, dwDueTime, dwPeriod };
+	pTimer->thread = std::thread([pTimer]() {
+		std::unique_lock lock(pTimer->mutex);
+		auto tmNext = std::chrono::steady_clock::now() + std::chrono::milliseconds(pTimer->dwDueTime);
+		while (!pTimer->cvDeleted.wait_until(lock, tmNext, [pTimer]() { return pTimer->bDeleted; })) {
+			lock.unlock();
+			pTimer->pfnCallback(pTimer->pParameter, TRUE);
+			lock.lock();
+			if (!pTimer->dwPeriod) {
+				break;
+			}
+			tmNext += std::chrono::milliseconds(pTimer->dwPeriod);
+		}
+	});
+	*phNewTimer = pTimer;
+	return TRUE;
+}
+
+BOOL DeleteTimerQueueTimer(HANDLE hTimerQueue, HANDLE hTimer, HANDLE hCompletionEvent)
+{
+	PortableTimer* pTimer = static_cast<PortableTimer*>(hTimer);
+	{
+		std::lock_guard lock(pTimer->mutex);
+		pTimer->bDeleted = true;
+	}
+	pTimer->cvDeleted.notify_one();
+	// only waiting for callbacks to finish is supported, which is what the callers do
+	_ASSERT(hCompletionEvent == INVALID_HANDLE_VALUE);
+	pTimer->thread.join();
+	delete pTimer;
+	return TRUE;
+}
+
+ULONGLONG GetTickCount64()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ULONGLONG)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+DWORD GetCurrentThreadId()
+{
+	return (DWORD)gettid();
+}
+
+DWORD GetCurrentProcessId()
+{
+	return (DWORD)getpid();
+}
+
+DWORD GetLastError()
+{
+	return t_dwLastError;
+}
+
+void SetLastError(DWORD dwError)
+{
+	t_dwLastError = dwError;
+}
+
+void GetSystemTimeAsFileTime(FILETIME* pFileTime)
+{
+	// 100 ns intervals since 1601
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	unsigned long long ull = ((unsigned long long)ts.tv_sec + 11644473600ull) * 10000000 + ts.tv_nsec / 100;
+	pFileTime->dwLowDateTime = (DWORD)ull;
+	pFileTime->dwHighDateTime = (DWORD)(ull >> 32);
+}
+
+void OutputDebugString(LPCWSTR pszText)
+{
+	fputs(WideToUtf8(pszText).c_str(), stderr);
+}
+
+#endif
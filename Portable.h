@@ -0,0 +1,500 @@
+#pragma once
+
+// Portable.h: stand-ins for the parts of Windows, Direct2D and WinInet headers which the
+// platform-neutral modules use (tile management and scheduling, caching, decoding pool,
+// projection, pixel conversion, rasterization, tracing), so that they build on other
+// systems too, e. g. for tests and benchmarks on Linux.  Only what is actually used is
+// here, declared the same way as in the SDK; file, mapping and timer functions are
+// implemented on POSIX in Portable.cpp.  Included by framework.h in place of the
+// Windows headers when not building for Windows.
+
+#include <cassert>
+#include <cstdint>
+#include <cstddef>
+#include <climits>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <array>
+#include <atomic>
+#include <stdexcept>
+#include <type_traits>
+#include <charconv>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// basic types
+
+typedef unsigned char BYTE;
+typedef unsigned short WORD;
+typedef uint32_t DWORD;
+typedef uint32_t UINT32;
+typedef unsigned int UINT;
+typedef int BOOL;
+typedef BYTE BOOLEAN;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef int32_t HRESULT;
+typedef unsigned long long ULONGLONG;
+typedef uintptr_t DWORD_PTR;
+typedef uintptr_t UINT_PTR;
+typedef intptr_t LONG_PTR;
+typedef size_t SIZE_T;
+typedef void* PVOID;
+typedef void* LPVOID;
+typedef const void* LPCVOID;
+typedef void* HANDLE;
+typedef HANDLE* PHANDLE;
+typedef wchar_t* PWSTR;
+typedef const wchar_t* LPCWSTR;
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#define WINAPI
+#define __stdcall
+#define CALLBACK
+#define VOID void
+
+#define S_OK ((HRESULT)0)
+#define E_FAIL ((HRESULT)0x80004005L)
+#define SUCCEEDED(hr) (((HRESULT)(hr)) >= 0)
+#define FAILED(hr) (((HRESULT)(hr)) < 0)
+
+#ifndef _ASSERT
+#ifdef NDEBUG
+// still "uses" variables only checked by assertions, as MSVC doesn't warn about them
+#define _ASSERT(expr) ((void)sizeof(!(expr)))
+#else
+#define _ASSERT(expr) assert(expr)
+#endif
+#endif
+
+#define INVALID_HANDLE_VALUE ((HANDLE)(LONG_PTR)-1)
+
+inline void MemoryBarrier() { std::atomic_thread_fence(std::memory_order_seq_cst); }
+
+struct FILETIME
+{
+	DWORD dwLowDateTime;
+	DWORD dwHighDateTime;
+};
+
+union LARGE_INTEGER
+{
+	struct
+	{
+		DWORD LowPart;
+		LONG HighPart;
+	} u;
+	long long QuadPart;
+};
+
+// error codes, as returned by GetLastError() and reported by WinInet
+
+#define ERROR_SUCCESS 0
+#define ERROR_FILE_NOT_FOUND 2
+#define ERROR_ACCESS_DENIED 5
+#define ERROR_INVALID_HANDLE 6
+#define ERROR_NOT_ENOUGH_MEMORY 8
+#define ERROR_ALREADY_EXISTS 183
+#define ERROR_IO_PENDING 997
+#define ERROR_INTERNET_TIMEOUT 12002
+#define ERROR_INTERNET_INVALID_URL 12005
+#define ERROR_INTERNET_UNRECOGNIZED_SCHEME 12006
+#define ERROR_INTERNET_NAME_NOT_RESOLVED 12007
+#define ERROR_INTERNET_OPERATION_CANCELLED 12017
+#define ERROR_INTERNET_CANNOT_CONNECT 12029
+#define ERROR_INTERNET_CONNECTION_ABORTED 12030
+#define ERROR_INTERNET_CONNECTION_RESET 12031
+#define ERROR_HTTP_INVALID_SERVER_RESPONSE 12152
+#define ERROR_INTERNET_SERVER_UNREACHABLE 12164
+
+#define HTTP_STATUS_OK 200
+#define HTTP_STATUS_NOT_MODIFIED 304
+#define HTTP_STATUS_NOT_FOUND 404
+#define HTTP_STATUS_SERVER_ERROR 500
+#define HTTP_STATUS_SERVICE_UNAVAIL 503
+
+// files and mappings.  Paths are converted to UTF-8, with backslashes taken as separators
+
+#define GENERIC_READ 0x80000000u
+#define GENERIC_WRITE 0x40000000u
+#define FILE_SHARE_READ 0x00000001u
+#define CREATE_ALWAYS 2
+#define OPEN_EXISTING 3
+#define OPEN_ALWAYS 4
+#define FILE_ATTRIBUTE_NORMAL 0x00000080u
+#define FILE_FLAG_RANDOM_ACCESS 0x10000000u
+#define FILE_FLAG_SEQUENTIAL_SCAN 0x08000000u
+#define FILE_BEGIN 0
+#define PAGE_READONLY 0x02u
+#define PAGE_READWRITE 0x04u
+#define FILE_MAP_READ 0x0004u
+#define FILE_MAP_ALL_ACCESS 0x000f001fu
+#define MOVEFILE_REPLACE_EXISTING 0x00000001u
+
+HANDLE CreateFile(LPCWSTR pszPath, DWORD dwAccess, DWORD dwShareMode, void* pSecurity,
+	DWORD dwCreation, DWORD dwFlags, HANDLE hTemplate);
+BOOL ReadFile(HANDLE hFile, void* pBuffer, DWORD dwToRead, DWORD* pdwRead, void* pOverlapped);
+BOOL WriteFile(HANDLE hFile, const void* pBuffer, DWORD dwToWrite, DWORD* pdwWritten, void* pOverlapped);
+BOOL GetFileSizeEx(HANDLE hFile, LARGE_INTEGER* pSize);
+BOOL SetFilePointerEx(HANDLE hFile, LARGE_INTEGER liDistance, LARGE_INTEGER* pNewPointer, DWORD dwMethod);
+BOOL SetEndOfFile(HANDLE hFile);
+BOOL FlushFileBuffers(HANDLE hFile);
+HANDLE CreateFileMapping(HANDLE hFile, void* pSecurity, DWORD dwProtect, DWORD dwMaxSizeHigh, DWORD dwMaxSizeLow, LPCWSTR pszName);
+void* MapViewOfFile(HANDLE hMapping, DWORD dwAccess, DWORD dwOffsetHigh, DWORD dwOffsetLow, SIZE_T nBytes);
+BOOL UnmapViewOfFile(LPCVOID pView);
+BOOL FlushViewOfFile(LPCVOID pAddress, SIZE_T nBytes);
+BOOL CloseHandle(HANDLE hObject);
+BOOL DeleteFile(LPCWSTR pszPath);
+BOOL MoveFileEx(LPCWSTR pszFrom, LPCWSTR pszTo, DWORD dwFlags);
+BOOL CreateDirectory(LPCWSTR pszPath, void* pSecurity);
+
+// UTF-8 path for a Windows style one, and back (without turning separators back)
+std::string PortablePath(const std::wstring& strPath);
+std::wstring WidePath(const std::string& strPath);
+
+// timer queue timers, each one running on a thread of its own
+
+typedef void (CALLBACK* WAITORTIMERCALLBACK)(PVOID lpParameter, BOOLEAN bTimerOrWaitFired);
+#define WT_EXECUTEDEFAULT 0x00000000u
+
+BOOL CreateTimerQueueTimer(PHANDLE phNewTimer, HANDLE hTimerQueue, WAITORTIMERCALLBACK pfnCallback,
+	PVOID pParameter, DWORD dwDueTime, DWORD dwPeriod, ULONG nFlags);
+// with hCompletionEvent = INVALID_HANDLE_VALUE, waits for a callback in progress, as on Windows
+BOOL DeleteTimerQueueTimer(HANDLE hTimerQueue, HANDLE hTimer, HANDLE hCompletionEvent);
+
+// miscellaneous
+
+ULONGLONG GetTickCount64();
+DWORD GetCurrentThreadId();
+DWORD GetCurrentProcessId();
+DWORD GetLastError();
+void SetLastError(DWORD dwError);
+void GetSystemTimeAsFileTime(FILETIME* pFileTime);
+// written to stderr
+void OutputDebugString(LPCWSTR pszText);
+
+// COM initialization is a no-op
+#define COINIT_MULTITHREADED 0
+inline HRESULT CoInitializeEx(void*, DWORD) { return S_OK; }
+inline void CoUninitialize() {}
+
+#if defined(__x86_64__) || defined(__i386__)
+// as in MSVC's <intrin.h>; _xgetbv() is in <immintrin.h>, callable from code compiled for XSAVE
+inline void __cpuidex(int info[4], int nFunction, int nSubfunction)
+{
+	__asm__ __volatile__ ("cpuid" : "=a"(info[0]), "=b"(info[1]), "=c"(info[2]), "=d"(info[3]) : "a"(nFunction), "c"(nSubfunction));
+}
+inline void __cpuid(int info[4], int nFunction)
+{
+	__cpuidex(info, nFunction, 0);
+}
+#endif
+
+// Direct2D: geometry types, and just enough of bitmaps and render targets for tiles to be made
+// into bitmaps (see TileManager::SetRenderTarget()), with any implementation of them
+
+struct D2D1_POINT_2F { float x, y; };
+struct D2D1_RECT_F { float left, top, right, bottom; };
+struct D2D1_SIZE_F { float width, height; };
+struct D2D1_SIZE_U { UINT32 width, height; };
+struct D2D1_COLOR_F { float r, g, b, a; };
+
+enum DXGI_FORMAT { DXGI_FORMAT_UNKNOWN = 0, DXGI_FORMAT_B8G8R8A8_UNORM = 87 };
+enum D2D1_ALPHA_MODE { D2D1_ALPHA_MODE_UNKNOWN = 0, D2D1_ALPHA_MODE_PREMULTIPLIED = 1, D2D1_ALPHA_MODE_STRAIGHT = 2, D2D1_ALPHA_MODE_IGNORE = 3 };
+struct D2D1_PIXEL_FORMAT { DXGI_FORMAT format; D2D1_ALPHA_MODE alphaMode; };
+struct D2D1_BITMAP_PROPERTIES { D2D1_PIXEL_FORMAT pixelFormat; float dpiX, dpiY; };
+
+namespace D2D1
+{
+	inline D2D1_SIZE_U SizeU(UINT32 width = 0, UINT32 height = 0) { return { width, height }; }
+	inline D2D1_SIZE_F SizeF(float width = 0.f, float height = 0.f) { return { width, height }; }
+	inline D2D1_POINT_2F Point2F(float x = 0.f, float y = 0.f) { return { x, y }; }
+	inline D2D1_RECT_F RectF(float left = 0.f, float top = 0.f, float right = 0.f, float bottom = 0.f) { return { left, top, right, bottom }; }
+	inline D2D1_PIXEL_FORMAT PixelFormat(DXGI_FORMAT format = DXGI_FORMAT_UNKNOWN, D2D1_ALPHA_MODE alphaMode = D2D1_ALPHA_MODE_UNKNOWN)
+	{
+		return { format, alphaMode };
+	}
+	inline D2D1_BITMAP_PROPERTIES BitmapProperties(const D2D1_PIXEL_FORMAT& pixelFormat = PixelFormat(), float dpiX = 96.f, float dpiY = 96.f)
+	{
+		return { pixelFormat, dpiX, dpiY };
+	}
+
+	class ColorF : public D2D1_COLOR_F
+	{
+	public:
+		enum Enum { Black = 0x000000, Red = 0xff0000, White = 0xffffff };
+
+		ColorF(UINT32 nRgb, float a = 1.f) :
+			D2D1_COLOR_F{ ((nRgb >> 16) & 0xff) / 255.f, ((nRgb >> 8) & 0xff) / 255.f, (nRgb & 0xff) / 255.f, a } {}
+		ColorF(float r, float g, float b, float a = 1.f) : D2D1_COLOR_F{ r, g, b, a } {}
+	};
+}
+
+// reference counted base, for ComPtr
+class IUnknown
+{
+public:
+	virtual ULONG AddRef() = 0;
+	virtual ULONG Release() = 0;
+protected:
+	virtual ~IUnknown() {}
+};
+
+class ID2D1Bitmap : public IUnknown
+{
+public:
+	virtual D2D1_SIZE_U GetPixelSize() const = 0;
+};
+
+class ID2D1RenderTarget : public IUnknown
+{
+public:
+	virtual HRESULT CreateBitmap(D2D1_SIZE_U size, const void* pSrcData, UINT32 nPitch,
+		const D2D1_BITMAP_PROPERTIES* pProperties, ID2D1Bitmap** ppBitmap) = 0;
+	HRESULT CreateBitmap(D2D1_SIZE_U size, const void* pSrcData, UINT32 nPitch,
+		const D2D1_BITMAP_PROPERTIES& properties, ID2D1Bitmap** ppBitmap)
+	{
+		return CreateBitmap(size, pSrcData, nPitch, &properties, ppBitmap);
+	}
+};
+
+class ID2D1SolidColorBrush;
+class ID2D1StrokeStyle;
+
+// std::format, for standard libraries which don't have <format> yet (libstdc++ before 13).
+// Supports what this project formats: integers (also hex), floating point (also with fixed
+// precision), booleans, characters and strings of the format's own character type; zero
+// padding and width.  Format strings aren't checked at compile time
+#if !__has_include(<format>)
+namespace std
+{
+	namespace portable_format
+	{
+		template <typename CharT>
+		struct Arg
+		{
+			enum Kind { K_INT, K_UINT, K_DOUBLE, K_BOOL, K_CHAR, K_STRING } kind;
+			long long i = 0;
+			unsigned long long u = 0;
+			double d = 0.0;
+			basic_string_view<CharT> s;
+		};
+
+		template <typename CharT, typename T>
+		Arg<CharT> MakeArg(const T& value)
+		{
+			typedef remove_cvref_t<T> V;
+			Arg<CharT> arg;
+			if constexpr (is_same_v<V, bool>) {
+				arg.kind = Arg<CharT>::K_BOOL;
+				arg.u = value;
+			} else if constexpr (is_same_v<V, CharT> || is_same_v<V, char>) {
+				arg.kind = Arg<CharT>::K_CHAR;
+				arg.u = (unsigned long long)(make_unsigned_t<V>)value;
+			} else if constexpr (is_integral_v<V> && is_signed_v<V>) {
+				arg.kind = Arg<CharT>::K_INT;
+				arg.i = value;
+			} else if constexpr (is_integral_v<V>) {
+				arg.kind = Arg<CharT>::K_UINT;
+				arg.u = value;
+			} else if constexpr (is_floating_point_v<V>) {
+				arg.kind = Arg<CharT>::K_DOUBLE;
+				arg.d = value;
+			} else if constexpr (is_convertible_v<const T&, basic_string_view<CharT>>) {
+				arg.kind = Arg<CharT>::K_STRING;
+				arg.s = value;
+			} else {
+				static_assert(is_same_v<V, void>, "type not supported by the std::format stand-in");
+			}
+			return arg;
+		}
+
+		template <typename CharT, size_t N>
+		struct ArgStore
+		{
+			array<Arg<CharT>, N> args;
+		};
+
+		// appends a formatted argument.  Spec is what follows ':' in the replacement field
+		template <typename CharT>
+		void FormatArg(basic_string<CharT>& str, const Arg<CharT>& arg, basic_string_view<CharT> spec)
+		{
+			bool bZeroPad = false;
+			size_t nWidth = 0;
+			int nPrecision = -1;
+			CharT type = 0;
+			size_t n = 0;
+			if (n < spec.size() && spec[n] == '0') {
+				bZeroPad = true;
+				n++;
+			}
+			while (n < spec.size() && spec[n] >= '0' && spec[n] <= '9') {
+				nWidth = nWidth * 10 + (spec[n++] - '0');
+			}
+			if (n < spec.size() && spec[n] == '.') {
+				nPrecision = 0;
+				while (++n < spec.size() && spec[n] >= '0' && spec[n] <= '9') {
+					nPrecision = nPrecision * 10 + (spec[n] - '0');
+				}
+			}
+			if (n < spec.size()) {
+				type = spec[n++];
+			}
+			if (n != spec.size()) {
+				throw invalid_argument("unsupported format spec");
+			}
+
+			char buffer[64];
+			to_chars_result result = { buffer, errc() };
+			int nBase = (type == 'x' || type == 'X') ? 16 : (type == 'b' ? 2 : 10);
+			switch (arg.kind) {
+			case Arg<CharT>::K_INT:
+				result = to_chars(buffer, buffer + sizeof(buffer), arg.i, nBase);
+				break;
+			case Arg<CharT>::K_UINT:
+				result = to_chars(buffer, buffer + sizeof(buffer), arg.u, nBase);
+				break;
+			case Arg<CharT>::K_DOUBLE:
+				result = nPrecision >= 0 ? to_chars(buffer, buffer + sizeof(buffer), arg.d, chars_format::fixed, nPrecision) :
+					to_chars(buffer, buffer + sizeof(buffer), arg.d);
+				break;
+			case Arg<CharT>::K_BOOL:
+				result.ptr = (char*)memcpy(buffer, arg.u ? "true" : "false", arg.u ? 4 : 5) + (arg.u ? 4 : 5);
+				break;
+			case Arg<CharT>::K_CHAR:
+				if (nWidth > 1) {
+					str.append(nWidth - 1, CharT(' '));
+				}
+				str += (CharT)arg.u;
+				return;
+			case Arg<CharT>::K_STRING:
+				str += arg.s;
+				if (nWidth > arg.s.size()) {
+					str.append(nWidth - arg.s.size(), CharT(' '));
+				}
+				return;
+			}
+			if (type == 'X') {
+				for (char* p = buffer; p < result.ptr; p++) {
+					*p = (char)toupper(*p);
+				}
+			}
+			// numbers are aligned right, zero padding goes after the sign
+			basic_string<CharT> strNumber(buffer, result.ptr);
+			if (nWidth > strNumber.size()) {
+				strNumber.insert(bZeroPad && buffer[0] == '-' ? 1 : 0, nWidth - strNumber.size(), CharT(bZeroPad ? '0' : ' '));
+			}
+			str += strNumber;
+		}
+
+		template <typename CharT>
+		basic_string<CharT> VFormat(basic_string_view<CharT> fmt, const Arg<CharT>* pArgs, size_t nArgs)
+		{
+			basic_string<CharT> str;
+			str.reserve(fmt.size() + nArgs * 8);
+			size_t nNextArg = 0;
+			for (size_t n = 0; n < fmt.size(); n++) {
+				CharT c = fmt[n];
+				if (c == '}') {
+					if (n + 1 >= fmt.size() || fmt[n + 1] != '}') {
+						throw invalid_argument("unmatched } in format string");
+					}
+					str += c;
+					n++;
+				} else if (c != '{') {
+					str += c;
+				} else if (n + 1 < fmt.size() && fmt[n + 1] == '{') {
+					str += c;
+					n++;
+				} else {
+					size_t nEnd = fmt.find(CharT('}'), n);
+					if (nEnd == basic_string_view<CharT>::npos) {
+						throw invalid_argument("unmatched { in format string");
+					}
+					basic_string_view<CharT> field = fmt.substr(n + 1, nEnd - n - 1);
+					size_t nColon = field.find(CharT(':'));
+					basic_string_view<CharT> index = field.substr(0, nColon);
+					size_t nArg = nNextArg++;
+					if (!index.empty()) {
+						nArg = 0;
+						for (CharT d : index) {
+							nArg = nArg * 10 + (d - '0');
+						}
+					}
+					if (nArg >= nArgs) {
+						throw invalid_argument("format argument index out of range");
+					}
+					FormatArg(str, pArgs[nArg], nColon == basic_string_view<CharT>::npos ? basic_string_view<CharT>() : field.substr(nColon + 1));
+					n = nEnd;
+				}
+			}
+			return str;
+		}
+	}
+
+	template <typename CharT>
+	class basic_format_args
+	{
+	public:
+		template <size_t N>
+		basic_format_args(const portable_format::ArgStore<CharT, N>& store) : m_pArgs(store.args.data()), m_nArgs(N) {}
+		const portable_format::Arg<CharT>* m_pArgs;
+		size_t m_nArgs;
+	};
+	typedef basic_format_args<char> format_args;
+	typedef basic_format_args<wchar_t> wformat_args;
+
+	template <typename CharT, typename... Args>
+	class basic_format_string
+	{
+	public:
+		template <typename T> requires is_convertible_v<const T&, basic_string_view<CharT>>
+		basic_format_string(const T& str) : m_str(str) {}
+		basic_string_view<CharT> get() const noexcept { return m_str; }
+	private:
+		basic_string_view<CharT> m_str;
+	};
+	template <typename... Args>
+	using format_string = basic_format_string<char, type_identity_t<Args>...>;
+	template <typename... Args>
+	using wformat_string = basic_format_string<wchar_t, type_identity_t<Args>...>;
+
+	template <typename... Args>
+	portable_format::ArgStore<char, sizeof...(Args)> make_format_args(const Args&... args)
+	{
+		return { { portable_format::MakeArg<char>(args)... } };
+	}
+	template <typename... Args>
+	portable_format::ArgStore<wchar_t, sizeof...(Args)> make_wformat_args(const Args&... args)
+	{
+		return { { portable_format::MakeArg<wchar_t>(args)... } };
+	}
+
+	inline string vformat(string_view fmt, format_args args)
+	{
+		return portable_format::VFormat(fmt, args.m_pArgs, args.m_nArgs);
+	}
+	inline wstring vformat(wstring_view fmt, wformat_args args)
+	{
+		return portable_format::VFormat(fmt, args.m_pArgs, args.m_nArgs);
+	}
+
+	template <typename... Args>
+	string format(format_string<Args...> fmt, Args&&... args)
+	{
+		return vformat(fmt.get(), make_format_args(args...));
+	}
+	template <typename... Args>
+	wstring format(wformat_string<Args...> fmt, Args&&... args)
+	{
+		return vformat(fmt.get(), make_wformat_args(args...));
+	}
+}
+#endif
@@ -1,9 +1,14 @@
 // Program.cpp: MapViewer entry point
 
 #include "framework.h"
+#include "Util.h"
 #include "HttpClient.h"
 #include "TileManager.h"
+#include "TileCache.h"
+#include "DecodePool.h"
 #include "MapWindow.h"
+#include "VectorTileDecoder.h"
+#include "Trace.h"
 #include "Resource.h"
 
 // set up libraries to link with using pragmas
@@ -11,7 +16,9 @@
 #pragma comment(lib, "Shlwapi.lib")
 #pragma comment(lib, "WinInet.lib")
 #pragma comment(lib, "D2d1.lib")
+#pragma comment(lib, "Dwrite.lib")
 #pragma comment(lib, "Windowscodecs.lib")
+#pragma comment(lib, "Shell32.lib")
 // turn on visual styles in a manifest (DPI awareness is turned on in project settings
 // but apparently still no setting for this?)
 #pragma comment(linker, "\"/manifestdependency:type='win32' \
@@ -27,6 +34,7 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
     UNREFERENCED_PARAMETER(lpCmdLine);
 
     // initialize various stuff
+    TraceSetThreadName("UI");
     // frame window accelerators
     HACCEL hAccelTable = LoadAccelerators(hInstance, MAKEINTRESOURCE(IDC_MAPVIEWER));
     // common controls (needed to turn on visual styles)
@@ -40,13 +48,64 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
     _ASSERT(SUCCEEDED(hr));
     // our WinInet wrapper
     HttpClient httpClient;
+    // and our own disk cache for tiles
+    TileCache tileCache(GetAppDataDirectory());
+    // and threads to decode tile images
+    DecodePool decodePool;
+
+    // command line: /tiles:<URL template> for another tile server (see FormatTileUrl()),
+    // /layer:<URL template>[|opacity] for each tile layer to draw over it, and a GPX or GeoJSON
+    // file to show over the map
+    std::wstring strTileUrl = L"https://tile.openstreetmap.org", strTrackPath;
+    std::vector<std::pair<std::wstring, float>> vecLayers;
+    int nArgs;
+    LPWSTR* pArgs = CommandLineToArgvW(GetCommandLineW(), &nArgs);
+    if (pArgs) {
+        for (int i = 1; i < nArgs; i++) {
+            std::wstring strArg = pArgs[i];
+            if (strArg.starts_with(L"/tiles:")) {
+                strTileUrl = strArg.substr(7);
+            } else if (strArg.starts_with(L"/layer:")) {
+                std::wstring strUrl = strArg.substr(7);
+                float fOpacity = 1.f;
+                size_t nBar = strUrl.rfind(L'|');
+                if (nBar != std::wstring::npos) {
+                    fOpacity = wcstof(strUrl.c_str() + nBar + 1, nullptr);
+                    strUrl.resize(nBar);
+                }
+                vecLayers.push_back({ strUrl, fOpacity });
+            } else {
+                strTrackPath = strArg;
+            }
+        }
+        LocalFree(pArgs);
+    }
 
     // create and show a map window, set up to load basic OpenStreetMap, and center it
     // at a point at the outskirts of Smedsby village in Korsholm, Ostrobothnia region in Finland
-    MapWindow mapWindow(httpClient, L"https://tile.openstreetmap.org", 256, pD2DFactory, hInstance);
+    const unsigned nTileSize = 256;
+    MapWindow mapWindow(httpClient, tileCache, decodePool, strTileUrl, nTileSize, pD2DFactory, hInstance);
+    // vector tiles are rasterized at the display resolution
+    auto isVectorTiles = [](const std::wstring& strUrl) {
+        return strUrl.find(L".pbf") != std::wstring::npos || strUrl.find(L".mvt") != std::wstring::npos;
+    };
+    if (isVectorTiles(strTileUrl)) {
+        mapWindow.tileManager().SetDecoder(std::make_unique<VectorTileDecoder>(nTileSize, MulDiv(nTileSize, GetDpiForSystem(), 96)));
+    }
+    for (auto& [strUrl, fOpacity] : vecLayers) {
+        unsigned nLayer = mapWindow.tileManager().AddLayer(strUrl, fOpacity);
+        if (isVectorTiles(strUrl)) {
+            // transparent background, so that layers below show through
+            mapWindow.tileManager().SetDecoder(std::make_unique<VectorTileDecoder>(nTileSize, MulDiv(nTileSize, GetDpiForSystem(), 96),
+                VectorTileDecoder::DefaultStyle(), 0), nLayer);
+        }
+    }
     mapWindow.Create();
     mapWindow.Show(nCmdShow);
     mapWindow.Move(63.119671111, 21.712313611, 13);
+    if (!strTrackPath.empty()) {
+        mapWindow.LoadTracks(strTrackPath);
+    }
 
     // kick of main message loop
     MSG msg;
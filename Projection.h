@@ -0,0 +1,63 @@
+#pragma once
+
+// Projection.h: Web Mercator (EPSG:3857) projection, as used by OpenStreetMap and pretty much every
+// other tile server.  Points are converted to normalized Mercator coordinates, where the whole
+// world is [0, 1] x [0, 1], x growing to the east and y to the south.  World pixel coordinates
+// at a zoom level are simply these times WorldSize(), and tile coordinates are world pixels
+// divided by tile size.  All math is exact (no small angle or constant scale approximations),
+// in doubles, which is precise to well under a pixel at any zoom level we support.
+// For overlays with many points, the (expensive) trigonometry is meant to be done once, with
+// LatLngToMercatorBatch(), and then only MercatorToScreenBatch() is done on every frame,
+// which is a simple scale and offset with SSE2/AVX2 versions (see PixelConvert.h for SIMD level).
+
+#include "TileCoords.h"
+
+// normalized Mercator coordinates
+struct MercatorPoint
+{
+	double x, y;
+};
+
+// rectangle in normalized Mercator coordinates
+struct MercatorRect
+{
+	double left, top, right, bottom;
+};
+
+// highest latitude, either way, which can be projected; this is where the map becomes square
+const double MERCATOR_MAX_LATITUDE = 85.051128779806592;
+
+// size of the whole world in pixels at a zoom level
+double WorldSize(unsigned nZoom, unsigned nTileSize);
+
+// converts lat/lng in degrees to Mercator coordinates; latitude is clamped to MERCATOR_MAX_LATITUDE
+MercatorPoint LatLngToMercator(double dLat, double dLng);
+// and back
+void MercatorToLatLng(MercatorPoint pt, double& dLat, double& dLng);
+
+// tile containing a point at a zoom level, clamped to the map
+TileCoords MercatorToTile(MercatorPoint pt, unsigned nZoom);
+// top left corner of a tile
+MercatorPoint TileToMercator(TileCoords coords);
+
+// what a window of nWidth x nHeight pixels shows with ptCenter in its middle, at a zoom level
+struct MapView
+{
+	// top left corner in world pixels, and the part of the world in the window
+	double dTopLeftX, dTopLeftY;
+	MercatorRect rect;
+	// tiles covering the window: the top left one, and how many across and down (one more than
+	// fit, to cover partial tiles).  The window may extend past the edges of the map when zoomed
+	// out, tiles start from the edge then
+	unsigned nTopLeftX, nTopLeftY, nWidthInTiles, nHeightInTiles;
+};
+MapView CalculateView(MercatorPoint ptCenter, unsigned nZoom, unsigned nTileSize, unsigned nWidth, unsigned nHeight);
+
+// converts nPoints lat/lng pairs to Mercator coordinates.  The AVX2 version approximates sin() and
+// atanh() with polynomials, so y may differ from LatLngToMercator() by up to 1e-14; x is identical
+void LatLngToMercatorBatch(const double* pLat, const double* pLng, MercatorPoint* pDst, size_t nPoints);
+// converts nPoints Mercator points to screen coordinates: scaled by dScale (normally world
+// size at the current zoom level) with screen origin in the same scaled coordinates subtracted.
+// Results of all SIMD versions are identical
+void MercatorToScreenBatch(const MercatorPoint* pSrc, D2D1_POINT_2F* pDst, size_t nPoints,
+	double dScale, double dOriginX, double dOriginY);
@@ -0,0 +1,156 @@
+// Rasterizer.cpp: Rasterizer class implementation
+
+#include "framework.h"
+#include "Rasterizer.h"
+
+void Rasterizer::SetTarget(DecodedImage* pImage)
+{
+	m_pImage = pImage;
+	m_nStride = pImage->nWidth + 2;
+	m_vecCoverage.assign((size_t)m_nStride * pImage->nHeight, 0.f);
+	m_nMinX = m_nMinY = INT_MAX;
+	m_nMaxX = m_nMaxY = -1;
+}
+
+void Rasterizer::AddPolygon(const D2D1_POINT_2F* pPoints, size_t nPoints)
+{
+	if (nPoints < 3) {
+		return;
+	}
+	for (size_t i = 0; i + 1 < nPoints; i++) {
+		AddEdge(pPoints[i], pPoints[i + 1]);
+	}
+	AddEdge(pPoints[nPoints - 1], pPoints[0]);
+}
+
+void Rasterizer::AddPolyline(const D2D1_POINT_2F* pPoints, size_t nPoints, float fWidth)
+{
+	float fHalf = fWidth / 2.f;
+	for (size_t i = 0; i + 1 < nPoints; i++) {
+		D2D1_POINT_2F pt0 = pPoints[i], pt1 = pPoints[i + 1];
+		float dx = pt1.x - pt0.x, dy = pt1.y - pt0.y;
+		float fLength = std::sqrt(dx * dx + dy * dy);
+		if (fLength == 0.f) {
+			continue;
+		}
+		// the segment extended by half width at both ends, so that joins have no gaps, and
+		// offset by half width both ways.  Corners always go the same way around relative to
+		// the direction of the segment, so all rectangles have the same orientation
+		float ex = dx / fLength * fHalf, ey = dy / fLength * fHalf;
+		D2D1_POINT_2F corners[4] = {
+			{ pt0.x - ex - ey, pt0.y - ey + ex },
+			{ pt1.x + ex - ey, pt1.y + ey + ex },
+			{ pt1.x + ex + ey, pt1.y + ey - ex },
+			{ pt0.x - ex + ey, pt0.y - ey - ex }
+		};
+		AddPolygon(corners, 4);
+	}
+}
+
+void Rasterizer::AddEdge(D2D1_POINT_2F pt0, D2D1_POINT_2F pt1)
+{
+	if (pt0.y == pt1.y) {
+		return;
+	}
+	// always go down, with direction (winding) as a sign
+	float fDirection = 1.f;
+	if (pt0.y > pt1.y) {
+		std::swap(pt0, pt1);
+		fDirection = -1.f;
+	}
+	int nHeight = (int)m_pImage->nHeight;
+	float fWidth = (float)m_pImage->nWidth;
+	if (pt1.y <= 0.f || pt0.y >= nHeight) {
+		return;
+	}
+
+	// walk rows the edge crosses.  x is where the edge enters the row; it is clamped to the image
+	// horizontally, so that edges left of it still count fully for winding, and edges right of it
+	// only affect the extra columns
+	float dxdy = (pt1.x - pt0.x) / (pt1.y - pt0.y);
+	int y0 = std::max((int)pt0.y, 0), y1 = std::min((int)std::ceil(pt1.y), nHeight);
+	float x = pt0.x + (std::max(pt0.y, 0.f) - pt0.y) * dxdy;
+	for (int y = y0; y < y1; y++) {
+		float dy = std::min((float)y + 1.f, pt1.y) - std::max((float)y, pt0.y);
+		float xNext = x + dxdy * dy;
+		float d = dy * fDirection;
+		float xa = std::clamp(std::min(x, xNext), 0.f, fWidth), xb = std::clamp(std::max(x, xNext), 0.f, fWidth);
+		float* pRow = m_vecCoverage.data() + (size_t)y * m_nStride;
+
+		float xaFloor = std::floor(xa);
+		int xai = (int)xaFloor, xbi = (int)std::ceil(xb);
+		if (xbi <= xai + 1) {
+			// within a single pixel: the area right of the edge is split between it and the next one
+			float xMid = (xa + xb) * 0.5f - xaFloor;
+			pRow[xai] += d - d * xMid;
+			pRow[xai + 1] += d * xMid;
+		} else {
+			// across several pixels: triangle in the first one, trapezoids in the middle, and
+			// the rest in the last one
+			float s = 1.f / (xb - xa);
+			float xaFrac = xa - xaFloor;
+			float a0 = 0.5f * s * (1.f - xaFrac) * (1.f - xaFrac);
+			float xbFrac = xb - (float)xbi + 1.f;
+			float am = 0.5f * s * xbFrac * xbFrac;
+			pRow[xai] += d * a0;
+			if (xbi == xai + 2) {
+				pRow[xai + 1] += d * (1.f - a0 - am);
+			} else {
+				float a1 = s * (1.5f - xaFrac);
+				pRow[xai + 1] += d * (a1 - a0);
+				for (int xi = xai + 2; xi < xbi - 1; xi++) {
+					pRow[xi] += d * s;
+				}
+				float a2 = a1 + (float)(xbi - xai - 3) * s;
+				pRow[xbi - 1] += d * (1.f - a2 - am);
+			}
+			pRow[xbi] += d * am;
+		}
+
+		m_nMinX = std::min(m_nMinX, xai);
+		m_nMaxX = std::max(m_nMaxX, xbi + 1);
+		x = xNext;
+	}
+	m_nMinY = std::min(m_nMinY, y0);
+	m_nMaxY = std::max(m_nMaxY, y1 - 1);
+}
+
+void Rasterizer::Fill(UINT32 nColor)
+{
+	if (m_nMaxY < 0) {
+		return;
+	}
+	// color components scaled by alpha, 0..255
+	float fAlpha = (nColor >> 24) / 255.f;
+	float fB = (nColor & 0xff) * fAlpha, fG = ((nColor >> 8) & 0xff) * fAlpha, fR = ((nColor >> 16) & 0xff) * fAlpha;
+	int nWidth = (int)m_pImage->nWidth;
+	int xEnd = std::min(m_nMaxX, nWidth - 1);
+
+	for (int y = m_nMinY; y <= m_nMaxY; y++) {
+		float* pRow = m_vecCoverage.data() + (size_t)y * m_nStride;
+		UINT32* pDst = reinterpret_cast<UINT32*>(m_pImage->vecPixels.data() + (size_t)y * m_pImage->stride());
+		float fAccum = 0.f;
+		for (int x = m_nMinX; x <= xEnd; x++) {
+			fAccum += pRow[x];
+			pRow[x] = 0.f;
+			float fCoverage = std::min(std::abs(fAccum), 1.f);
+			if (fCoverage < 1.f / 512.f) {
+				continue;
+			}
+			// source-over with premultiplied source color times coverage
+			UINT32 d = pDst[x];
+			float m = 1.f - fAlpha * fCoverage;
+			UINT32 b = (UINT32)(fB * fCoverage + (d & 0xff) * m + 0.5f);
+			UINT32 g = (UINT32)(fG * fCoverage + ((d >> 8) & 0xff) * m + 0.5f);
+			UINT32 r = (UINT32)(fR * fCoverage + ((d >> 16) & 0xff) * m + 0.5f);
+			UINT32 a = (UINT32)(255.f * fAlpha * fCoverage + (d >> 24) * m + 0.5f);
+			pDst[x] = std::min(b, 255u) | (std::min(g, 255u) << 8) | (std::min(r, 255u) << 16) | (std::min(a, 255u) << 24);
+		}
+		// the extra columns
+		for (int x = xEnd + 1; x <= m_nMaxX; x++) {
+			pRow[x] = 0.f;
+		}
+	}
+	m_nMinX = m_nMinY = INT_MAX;
+	m_nMaxX = m_nMaxY = -1;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+// Rasterizer.h: antialiased CPU rasterizer of filled paths into a DecodedImage, for drawing
+// vector tiles.  Edges are accumulated into a buffer of signed coverage (how much each edge
+// changes winding within each pixel, computed exactly from the area to the right of the edge in
+// the pixel); a running sum along each row then gives coverage of every pixel, which is blended
+// with the fill color.  This is the technique of font rasterizers like font-rs/stb_truetype, and
+// needs no sorting of edges or scanline lists, just one pass per edge and one per pixel.
+// The fill rule is non-zero (sum of coverage clamped to 1), so rings of opposite orientation
+// cut holes, and overlapping shapes of the same orientation just merge, which is what makes
+// strokes work: every line segment is added as a rectangle, all with the same orientation.
+// Only the bounding box of what was added is swept and cleared on Fill().  Not thread safe,
+// use one per thread.
+
+#include "ImageDecoder.h"
+
+class Rasterizer
+{
+public:
+	// sets the target image, which must be of fixed size until the next call
+	void SetTarget(DecodedImage* pImage);
+
+	// adds a closed polygon (the last point is connected to the first one), in pixels
+	void AddPolygon(const D2D1_POINT_2F* pPoints, size_t nPoints);
+	// adds a polyline stroked with the given width, with square ends and joins
+	void AddPolyline(const D2D1_POINT_2F* pPoints, size_t nPoints, float fWidth);
+
+	// blends everything added since the last Fill() into the target with a color (straight
+	// alpha 0xAARRGGBB), and clears it
+	void Fill(UINT32 nColor);
+
+private:
+	DecodedImage* m_pImage = nullptr;
+	// coverage accumulation buffer, row by row, with 2 extra columns at the right for edges
+	// ending at or past the right edge of the image
+	std::vector<float> m_vecCoverage;
+	unsigned m_nStride = 0;
+	// rows and columns touched since the last Fill()
+	int m_nMinX = INT_MAX, m_nMaxX = -1, m_nMinY = INT_MAX, m_nMaxY = -1;
+
+	void AddEdge(D2D1_POINT_2F pt0, D2D1_POINT_2F pt1);
+};
@@ -0,0 +1,223 @@
+// ResponseBuffer.cpp: ResponseBuffer and ResponseBuilder classes implementation
+
+#include "framework.h"
+#include "ResponseBuffer.h"
+
+// header of a block, followed by its data
+struct alignas(16) ResponseBuffer::Block
+{
+	std::atomic<unsigned> nRefs;
+	// size class, or NO_CLASS for blocks larger than the largest one
+	unsigned nClass;
+	size_t szCapacity;
+	size_t szLength;
+	// next block on a free list, or in a ResponseBuilder chain
+	Block* pNext;
+
+	BYTE* data() { return reinterpret_cast<BYTE*>(this + 1); }
+};
+
+static const unsigned NO_CLASS = ~0u;
+static const unsigned CLASS_COUNT = 9;
+static_assert(ResponseBuffer::MIN_CLASS_SIZE << (CLASS_COUNT - 1) == ResponseBuffer::MAX_CLASS_SIZE);
+
+// free lists, one per size class, all under one lock; it is only held for a few pointer moves
+struct ResponseBuffer::Pool
+{
+	std::mutex mutex;
+	Block* pFree[CLASS_COUNT] = {};
+	size_t szFree[CLASS_COUNT] = {};
+	std::atomic<unsigned long long> nHeapAllocations = 0, nHeapFrees = 0, nReused = 0;
+	std::atomic<size_t> szInUse = 0;
+};
+ResponseBuffer::Pool ResponseBuffer::s_pool;
+
+ResponseBuffer::ResponseBuffer(const ResponseBuffer& other)
+	: m_pBlock(other.m_pBlock)
+{
+	if (m_pBlock) {
+		m_pBlock->nRefs++;
+	}
+}
+
+ResponseBuffer::ResponseBuffer(ResponseBuffer&& other) noexcept
+	: m_pBlock(other.m_pBlock)
+{
+	other.m_pBlock = nullptr;
+}
+
+ResponseBuffer& ResponseBuffer::operator=(ResponseBuffer other) noexcept
+{
+	std::swap(m_pBlock, other.m_pBlock);
+	return *this;
+}
+
+ResponseBuffer::~ResponseBuffer()
+{
+	if (m_pBlock && --m_pBlock->nRefs == 0) {
+		ReleaseBlock(m_pBlock);
+	}
+}
+
+ResponseBuffer ResponseBuffer::Allocate(size_t szCapacity)
+{
+	return ResponseBuffer(AllocateBlock(szCapacity));
+}
+
+BYTE* ResponseBuffer::data() const
+{
+	return m_pBlock ? m_pBlock->data() : nullptr;
+}
+
+size_t ResponseBuffer::size() const
+{
+	return m_pBlock ? m_pBlock->szLength : 0;
+}
+
+size_t ResponseBuffer::capacity() const
+{
+	return m_pBlock ? m_pBlock->szCapacity : 0;
+}
+
+void ResponseBuffer::SetSize(size_t szLength)
+{
+	_ASSERT(m_pBlock && szLength <= m_pBlock->szCapacity);
+	m_pBlock->szLength = szLength;
+}
+
+ResponseBuffer::Stats ResponseBuffer::stats()
+{
+	Stats stats;
+	stats.nHeapAllocations = s_pool.nHeapAllocations;
+	stats.nHeapFrees = s_pool.nHeapFrees;
+	stats.nReused = s_pool.nReused;
+	stats.szInUse = s_pool.szInUse;
+	std::lock_guard lock(s_pool.mutex);
+	stats.szPooled = 0;
+	for (size_t szFree : s_pool.szFree) {
+		stats.szPooled += szFree;
+	}
+	return stats;
+}
+
+ResponseBuffer::Block* ResponseBuffer::AllocateBlock(size_t szCapacity)
+{
+	unsigned nClass = 0;
+	while (nClass < CLASS_COUNT && (MIN_CLASS_SIZE << nClass) < szCapacity) {
+		nClass++;
+	}
+
+	Block* pBlock = nullptr;
+	if (nClass < CLASS_COUNT) {
+		szCapacity = MIN_CLASS_SIZE << nClass;
+		std::lock_guard lock(s_pool.mutex);
+		pBlock = s_pool.pFree[nClass];
+		if (pBlock) {
+			s_pool.pFree[nClass] = pBlock->pNext;
+			s_pool.szFree[nClass] -= szCapacity;
+		}
+	} else {
+		nClass = NO_CLASS;
+	}
+	if (pBlock) {
+		s_pool.nReused++;
+	} else {
+		pBlock = reinterpret_cast<Block*>(::operator new(sizeof(Block) + szCapacity, std::align_val_t(alignof(Block))));
+		s_pool.nHeapAllocations++;
+	}
+	pBlock->nRefs = 1;
+	pBlock->nClass = nClass;
+	pBlock->szCapacity = szCapacity;
+	pBlock->szLength = 0;
+	pBlock->pNext = nullptr;
+	s_pool.szInUse += szCapacity;
+	return pBlock;
+}
+
+void ResponseBuffer::ReleaseBlock(Block* pBlock)
+{
+	s_pool.szInUse -= pBlock->szCapacity;
+	if (pBlock->nClass != NO_CLASS) {
+		std::lock_guard lock(s_pool.mutex);
+		if (s_pool.szFree[pBlock->nClass] + pBlock->szCapacity <= MAX_POOLED_PER_CLASS) {
+			pBlock->pNext = s_pool.pFree[pBlock->nClass];
+			s_pool.pFree[pBlock->nClass] = pBlock;
+			s_pool.szFree[pBlock->nClass] += pBlock->szCapacity;
+			return;
+		}
+	}
+	::operator delete(pBlock, std::align_val_t(alignof(Block)));
+	s_pool.nHeapFrees++;
+}
+
+ResponseBuilder::~ResponseBuilder()
+{
+	Clear();
+}
+
+void ResponseBuilder::Reset(size_t szExpected)
+{
+	Clear();
+	// one byte more than expected, so that the read which finds the end of the body still has
+	// room to go into, and doesn't need another block.  Not more than the largest size class though:
+	// what the server says isn't necessarily true, and 1 MB covers any tile
+	m_first = ResponseBuffer::Allocate(szExpected ? std::min(szExpected, ResponseBuffer::MAX_CLASS_SIZE - 1) + 1 : FIRST_CHAIN_BLOCK);
+	m_pLast = m_first.m_pBlock;
+}
+
+BYTE* ResponseBuilder::GetSpace(size_t& szSpace)
+{
+	if (!m_pLast) {
+		Reset(0);
+	}
+	if (m_pLast->szLength == m_pLast->szCapacity) {
+		ResponseBuffer::Block* pBlock = ResponseBuffer::AllocateBlock(std::clamp(m_pLast->szCapacity * 2, (size_t)FIRST_CHAIN_BLOCK, (size_t)ResponseBuffer::MAX_CLASS_SIZE));
+		m_pLast->pNext = pBlock;
+		m_pLast = pBlock;
+	}
+	szSpace = m_pLast->szCapacity - m_pLast->szLength;
+	return m_pLast->data() + m_pLast->szLength;
+}
+
+void ResponseBuilder::Commit(size_t szLength)
+{
+	_ASSERT(m_pLast && m_pLast->szLength + szLength <= m_pLast->szCapacity);
+	m_pLast->szLength += szLength;
+	m_szTotal += szLength;
+}
+
+ResponseBuffer ResponseBuilder::Finish()
+{
+	ResponseBuffer buffer;
+	if (m_first && !m_first.m_pBlock->pNext) {
+		// all in one block, which is the point of sizing it by the expected length
+		buffer = std::move(m_first);
+	} else if (m_first) {
+		buffer = ResponseBuffer::Allocate(m_szTotal);
+		BYTE* p = buffer.data();
+		for (ResponseBuffer::Block* pBlock = m_first.m_pBlock; pBlock; pBlock = pBlock->pNext) {
+			memcpy(p, pBlock->data(), pBlock->szLength);
+			p += pBlock->szLength;
+		}
+		buffer.SetSize(m_szTotal);
+	}
+	Clear();
+	return buffer;
+}
+
+void ResponseBuilder::Clear()
+{
+	// blocks after the first one are owned by the chain itself
+	if (m_first) {
+		ResponseBuffer::Block* pBlock = m_first.m_pBlock->pNext;
+		m_first.m_pBlock->pNext = nullptr;
+		while (pBlock) {
+			ResponseBuffer::Block* pNext = pBlock->pNext;
+			ResponseBuffer::ReleaseBlock(pBlock);
+			pBlock = pNext;
+		}
+	}
+	m_first = ResponseBuffer();
+	m_pLast = nullptr;
+	m_szTotal = 0;
+}
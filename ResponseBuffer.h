@@ -0,0 +1,96 @@
+#pragma once
+
+// ResponseBuffer.h: pooled memory for HTTP response bodies.  Tiles are a few to a few hundred KB,
+// and arrive at a high rate while panning, so rather than allocating a new buffer for each, blocks
+// of a few size classes (powers of two, 4 KB to 1 MB) are kept on free lists and reused; once the
+// pool has warmed up, the body of a tile takes no heap allocation (see stats()).  That is only the
+// body: the request itself (HttpClient's record of it, its URL and callback, the transport's
+// request message) still makes a few small allocations per tile.  Larger bodies get blocks of
+// their own, which are freed right away.
+// ResponseBuffer is a reference counted handle to a block, so it can be passed around by value,
+// e. g. captured into a decode job; the block goes back to its free list with the last handle.
+// Bodies of unknown length (chunked, or compressed, where Content-Length isn't the length we
+// get) are read with ResponseBuilder into a chain of growing blocks, joined at the end.
+// Thread safe.
+
+class ResponseBuffer
+{
+public:
+	ResponseBuffer() = default;
+	ResponseBuffer(const ResponseBuffer& other);
+	ResponseBuffer(ResponseBuffer&& other) noexcept;
+	ResponseBuffer& operator=(ResponseBuffer other) noexcept;
+	~ResponseBuffer();
+
+	// gets a buffer with room for at least szCapacity bytes, and size 0
+	static ResponseBuffer Allocate(size_t szCapacity);
+
+	BYTE* data() const;
+	size_t size() const;
+	size_t capacity() const;
+	void SetSize(size_t szLength);
+	explicit operator bool() const { return m_pBlock != nullptr; }
+
+	// pool statistics: blocks taken from and given back to the heap, and blocks reused from
+	// free lists; bytes of blocks in use, and idle on free lists
+	struct Stats
+	{
+		unsigned long long nHeapAllocations, nHeapFrees, nReused;
+		size_t szInUse, szPooled;
+	};
+	static Stats stats();
+
+	static const size_t MIN_CLASS_SIZE = 4 * 1024;
+	static const size_t MAX_CLASS_SIZE = 1024 * 1024;
+	// at most this much memory is kept idle on each free list
+	static const size_t MAX_POOLED_PER_CLASS = 4 * 1024 * 1024;
+
+private:
+	friend class ResponseBuilder;
+
+	struct Block;
+	struct Pool;
+	static Pool s_pool;
+	Block* m_pBlock = nullptr;
+
+	explicit ResponseBuffer(Block* pBlock) : m_pBlock(pBlock) {}
+	static Block* AllocateBlock(size_t szCapacity);
+	static void ReleaseBlock(Block* pBlock);
+};
+
+// Accumulates a body as it is read, into space it hands out: one block, if the expected length
+// is known and right, or otherwise a chain of blocks, each twice as large as the one before.
+// Not thread safe, meant to be used by one request
+class ResponseBuilder
+{
+public:
+	ResponseBuilder() = default;
+	~ResponseBuilder();
+
+	// no copy/assignment
+	ResponseBuilder& operator=(const ResponseBuilder&) = delete;
+	ResponseBuilder(const ResponseBuilder&) = delete;
+
+	// starts a new body; szExpected is its length if known (e. g. Content-Length), or 0.  Only up
+	// to MAX_CLASS_SIZE of it is allocated up front, as it comes from the server; a longer body
+	// goes on in a chain
+	void Reset(size_t szExpected);
+	// gets space to read the next bytes into, never empty
+	BYTE* GetSpace(size_t& szSpace);
+	// marks bytes read into the space from GetSpace() as used
+	void Commit(size_t szLength);
+	// gets the whole body in one buffer; the builder is empty afterwards
+	ResponseBuffer Finish();
+	// length of the body so far
+	size_t size() const { return m_szTotal; }
+
+	static const size_t FIRST_CHAIN_BLOCK = 16 * 1024;
+
+private:
+	ResponseBuffer m_first;
+	// the block being filled, owned by the chain from m_first
+	ResponseBuffer::Block* m_pLast = nullptr;
+	size_t m_szTotal = 0;
+
+	void Clear();
+};
@@ -0,0 +1,760 @@
+// SocketTransport.cpp: SocketTransport class implementation
+
+#include "framework.h"
+#include "Util.h"
+#include "Trace.h"
+#include "SocketTransport.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <cerrno>
+
+static const char USER_AGENT[] = "MapViewer/0.1";
+
+// URL path as sent: anything not printable ASCII percent-encoded, as UTF-8
+static std::string EncodePath(const std::wstring& strPath)
+{
+	std::string strEncoded;
+	for (wchar_t c : strPath) {
+		if (c > L' ' && c < 0x7f) {
+			strEncoded += (char)c;
+			continue;
+		}
+		// wchar_t is a whole code point here
+		unsigned nCode = (unsigned)c;
+		BYTE utf8[4];
+		size_t szUtf8;
+		if (nCode < 0x80) {
+			utf8[0] = (BYTE)nCode;
+			szUtf8 = 1;
+		} else if (nCode < 0x800) {
+			utf8[0] = (BYTE)(0xc0 | (nCode >> 6));
+			utf8[1] = (BYTE)(0x80 | (nCode & 0x3f));
+			szUtf8 = 2;
+		} else if (nCode < 0x10000) {
+			utf8[0] = (BYTE)(0xe0 | (nCode >> 12));
+			utf8[1] = (BYTE)(0x80 | ((nCode >> 6) & 0x3f));
+			utf8[2] = (BYTE)(0x80 | (nCode & 0x3f));
+			szUtf8 = 3;
+		} else {
+			utf8[0] = (BYTE)(0xf0 | (nCode >> 18));
+			utf8[1] = (BYTE)(0x80 | ((nCode >> 12) & 0x3f));
+			utf8[2] = (BYTE)(0x80 | ((nCode >> 6) & 0x3f));
+			utf8[3] = (BYTE)(0x80 | (nCode & 0x3f));
+			szUtf8 = 4;
+		}
+		for (size_t n = 0; n < szUtf8; n++) {
+			strEncoded += std::format("%{:02X}", (unsigned)utf8[n]);
+		}
+	}
+	return strEncoded;
+}
+
+SocketTransport::SocketTransport(unsigned nMaxConnectionsPerServer, unsigned nPipelineDepth)
+	: m_nMaxConnectionsPerServer(std::max(nMaxConnectionsPerServer, 1u)), m_nPipelineDepth(std::max(nPipelineDepth, 1u)),
+	m_vecReadBuffer(64 * 1024)
+{
+	m_epoll = epoll_create1(EPOLL_CLOEXEC);
+	m_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	_ASSERT(m_epoll >= 0 && m_event >= 0);
+	epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.ptr = nullptr;
+	epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_event, &event);
+	m_thread = std::thread(&SocketTransport::IoThread, this);
+}
+
+SocketTransport::~SocketTransport()
+{
+	{
+		std::lock_guard lock(m_mutex);
+		m_bStop = true;
+	}
+	unsigned long long n = 1;
+	write(m_event, &n, sizeof(n));
+	m_thread.join();
+	for (auto& kv : m_mapServers) {
+		for (auto& pConnection : kv.second->vecConnections) {
+			close(pConnection->fd);
+		}
+	}
+	close(m_event);
+	close(m_epoll);
+}
+
+void SocketTransport::Start(RequestId id, const std::wstring& strUrl, const HttpCacheInfo* pValidators, OnFinishCallback fnOnFinish)
+{
+	TraceAsyncBegin("HttpRequest", id);
+	HttpUrl url;
+	int nError = 0;
+	if (!ParseUrl(strUrl, url) || std::any_of(url.strHost.begin(), url.strHost.end(), [](wchar_t c) { return c >= 0x80; })) {
+		nError = ERROR_INTERNET_INVALID_URL;
+	} else if (url.strScheme != L"http") {
+		// no TLS here
+		nError = ERROR_INTERNET_UNRECOGNIZED_SCHEME;
+	}
+	if (nError) {
+		PrintLnDebug(L"Failed to start request for {}, error {}", strUrl, nError);
+		TraceAsyncEnd("HttpRequest", id);
+		fnOnFinish(-nError, ResponseBuffer(), HttpCacheInfo());
+		return;
+	}
+
+	std::string strHost(url.strHost.begin(), url.strHost.end());
+	std::string strHostHeader = strHost.find(':') != std::string::npos ? "[" + strHost + "]" : strHost;
+	if (url.nPort != 80) {
+		strHostHeader += std::format(":{}", url.nPort);
+	}
+	auto pRequest = std::make_unique<Request>();
+	pRequest->id = id;
+	pRequest->fnOnFinish = std::move(fnOnFinish);
+	pRequest->strMessage = std::format("GET {} HTTP/1.1\r\nHost: {}\r\nUser-Agent: {}\r\nAccept-Encoding: identity\r\n",
+		EncodePath(url.strPath), strHostHeader, USER_AGENT);
+	// validators are ASCII, per the spec
+	if (pValidators) {
+		if (!pValidators->strETag.empty()) {
+			pRequest->strMessage += "If-None-Match: " + pValidators->strETag + "\r\n";
+		}
+		if (!pValidators->strLastModified.empty()) {
+			pRequest->strMessage += "If-Modified-Since: " + pValidators->strLastModified + "\r\n";
+		}
+	}
+	pRequest->strMessage += "\r\n";
+
+	{
+		std::lock_guard lock(m_mutex);
+		std::unique_ptr<Server>& pServer = m_mapServers[strHostHeader];
+		if (!pServer) {
+			pServer = std::make_unique<Server>();
+			pServer->strHost = strHost;
+			pServer->nPort = url.nPort;
+		}
+		pRequest->pServer = pServer.get();
+		pServer->queue.push_back(pRequest.get());
+		m_mapRequests[id] = std::move(pRequest);
+	}
+	// the I/O thread sends it; one wakeup does for any number of requests
+	if (!m_bWakePending.exchange(true)) {
+		unsigned long long n = 1;
+		write(m_event, &n, sizeof(n));
+	}
+}
+
+void SocketTransport::Cancel(RequestId id)
+{
+	OnFinishCallback fnOnFinish;
+	{
+		std::lock_guard lock(m_mutex);
+		auto it = m_mapRequests.find(id);
+		if (it == m_mapRequests.end() || it->second->bFinished) {
+			return;
+		}
+		Request& request = *it->second;
+		request.bFinished = true;
+		fnOnFinish = std::move(request.fnOnFinish);
+		// if it's been sent, its response still comes, and is dropped then
+		if (!request.pConnection) {
+			std::erase(request.pServer->queue, &request);
+			m_mapRequests.erase(it);
+		}
+	}
+	TraceAsyncEnd("HttpRequest", id);
+	fnOnFinish(-ERROR_INTERNET_OPERATION_CANCELLED, ResponseBuffer(), HttpCacheInfo());
+}
+
+SocketTransport::Stats SocketTransport::stats()
+{
+	std::lock_guard lock(m_mutex);
+	Stats stats = m_stats;
+	stats.nConnectionsOpen = 0;
+	for (auto& kv : m_mapServers) {
+		stats.nConnectionsOpen += kv.second->vecConnections.size();
+	}
+	return stats;
+}
+
+void SocketTransport::IoThread()
+{
+	epoll_event events[64];
+	int nTimeout = -1;
+	while (true) {
+		int nEvents = epoll_wait(m_epoll, events, (int)std::size(events), nTimeout);
+		std::vector<Completion> vecCompletions;
+		{
+			std::unique_lock lock(m_mutex);
+			if (m_bStop) {
+				return;
+			}
+			ULONGLONG tmNow = GetTickCount64();
+			for (int n = 0; n < nEvents; n++) {
+				if (!events[n].data.ptr) {
+					unsigned long long nCount;
+					read(m_event, &nCount, sizeof(nCount));
+					m_bWakePending = false;
+					continue;
+				}
+				Connection& connection = *static_cast<Connection*>(events[n].data.ptr);
+				// unless closed while handling an earlier event
+				if (connection.fd >= 0) {
+					HandleEvents(connection, events[n].events, tmNow);
+				}
+			}
+			CheckDeadlines(tmNow);
+			for (auto& kv : m_mapServers) {
+				if (!kv.second->queue.empty()) {
+					Dispatch(*kv.second, tmNow);
+				}
+			}
+			m_vecClosed.clear();
+			nTimeout = Timeout(tmNow);
+			vecCompletions.swap(m_vecCompletions);
+		}
+		for (Completion& completion : vecCompletions) {
+			completion.fnOnFinish(completion.nStatus, std::move(completion.buffer), completion.cacheInfo);
+		}
+	}
+}
+
+int SocketTransport::Timeout(ULONGLONG tmNow)
+{
+	ULONGLONG tmNearest = ULLONG_MAX;
+	for (auto& kv : m_mapServers) {
+		for (auto& pConnection : kv.second->vecConnections) {
+			tmNearest = std::min(tmNearest, pConnection->tmDeadline);
+		}
+	}
+	// a little late rather than early, so as not to wake up just before it
+	return tmNearest == ULLONG_MAX ? -1 : (int)std::min<ULONGLONG>(tmNearest > tmNow ? tmNearest - tmNow + 1 : 0, INT_MAX);
+}
+
+void SocketTransport::CheckDeadlines(ULONGLONG tmNow)
+{
+	for (auto& kv : m_mapServers) {
+		// failing a connection removes it from the server
+		std::vector<Connection*> vecExpired;
+		for (auto& pConnection : kv.second->vecConnections) {
+			if (tmNow >= pConnection->tmDeadline) {
+				vecExpired.push_back(pConnection.get());
+			}
+		}
+		for (Connection* pConnection : vecExpired) {
+			if (pConnection->pipeline.empty()) {
+				CloseConnection(*pConnection);
+			} else {
+				FailConnection(*pConnection, -ERROR_INTERNET_TIMEOUT);
+			}
+		}
+	}
+}
+
+void SocketTransport::Dispatch(Server& server, ULONGLONG tmNow)
+{
+	while (!server.queue.empty()) {
+		// an idle connection; or a new one; or the least busy one known to be kept alive
+		Connection* pConnection = nullptr;
+		for (auto& p : server.vecConnections) {
+			if (p->pipeline.empty()) {
+				pConnection = p.get();
+				break;
+			}
+		}
+		if (!pConnection && server.vecConnections.size() < m_nMaxConnectionsPerServer) {
+			int nError = 0;
+			pConnection = Connect(server, tmNow, nError);
+			if (!pConnection) {
+				if (nError == -ERROR_INTERNET_NAME_NOT_RESOLVED) {
+					// no point in trying any of them
+					while (!server.queue.empty()) {
+						FinishRequest(*server.queue.front(), nError);
+					}
+				} else {
+					FinishRequest(*server.queue.front(), nError);
+				}
+				continue;
+			}
+		}
+		if (!pConnection) {
+			for (auto& p : server.vecConnections) {
+				if (p->bConnected && p->nResponses && p->bKeepAlive && p->pipeline.size() < m_nPipelineDepth &&
+					(!pConnection || p->pipeline.size() < pConnection->pipeline.size())) {
+					pConnection = p.get();
+				}
+			}
+		}
+		if (!pConnection) {
+			break;
+		}
+		Request& request = *server.queue.front();
+		server.queue.pop_front();
+		Send(*pConnection, request, tmNow);
+	}
+}
+
+SocketTransport::Connection* SocketTransport::Connect(Server& server, ULONGLONG tmNow, int& nError)
+{
+	if (!server.bResolved) {
+		addrinfo hints = {};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_NUMERICSERV;
+		addrinfo* pResult = nullptr;
+		if (getaddrinfo(server.strHost.c_str(), std::to_string(server.nPort).c_str(), &hints, &pResult) || !pResult) {
+			PrintLnDebug(L"Failed to resolve {}", std::wstring(server.strHost.begin(), server.strHost.end()));
+			nError = -ERROR_INTERNET_NAME_NOT_RESOLVED;
+			return nullptr;
+		}
+		const BYTE* pAddress = reinterpret_cast<const BYTE*>(pResult->ai_addr);
+		server.vecAddress.assign(pAddress, pAddress + pResult->ai_addrlen);
+		server.bResolved = true;
+		freeaddrinfo(pResult);
+	}
+
+	const sockaddr* pAddress = reinterpret_cast<const sockaddr*>(server.vecAddress.data());
+	int fd = socket(pAddress->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		nError = -ERROR_INTERNET_CANNOT_CONNECT;
+		return nullptr;
+	}
+	// requests are small and we want them out right away
+	int nNoDelay = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nNoDelay, sizeof(nNoDelay));
+	if (connect(fd, pAddress, (socklen_t)server.vecAddress.size()) && errno != EINPROGRESS) {
+		close(fd);
+		// resolved again next time, in case it's moved
+		server.bResolved = false;
+		nError = -ERROR_INTERNET_CANNOT_CONNECT;
+		return nullptr;
+	}
+
+	auto pConnection = std::make_unique<Connection>();
+	pConnection->pServer = &server;
+	pConnection->fd = fd;
+	pConnection->tmDeadline = tmNow + CONNECT_TIMEOUT_MS;
+	// writable once connected
+	epoll_event event = {};
+	event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+	event.data.ptr = pConnection.get();
+	epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event);
+	m_stats.nConnectionsOpened++;
+	return server.vecConnections.emplace_back(std::move(pConnection)).get();
+}
+
+void SocketTransport::Send(Connection& connection, Request& request, ULONGLONG tmNow)
+{
+	if (connection.pipeline.empty()) {
+		if (connection.bConnected) {
+			connection.tmDeadline = tmNow + RECEIVE_TIMEOUT_MS;
+		}
+	} else {
+		m_stats.nRequestsPipelined++;
+	}
+	m_stats.nRequestsSent++;
+	request.nAttempts++;
+	request.pConnection = &connection;
+	connection.pipeline.push_back(&request);
+	connection.strOutput += request.strMessage;
+	if (connection.bConnected) {
+		Flush(connection);
+	}
+}
+
+bool SocketTransport::Flush(Connection& connection)
+{
+	while (connection.szOutputSent < connection.strOutput.size()) {
+		ssize_t n = send(connection.fd, connection.strOutput.data() + connection.szOutputSent,
+			connection.strOutput.size() - connection.szOutputSent, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				WantWrite(connection, true);
+				return true;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			FailConnection(connection, -ERROR_INTERNET_CONNECTION_RESET);
+			return false;
+		}
+		connection.szOutputSent += n;
+	}
+	connection.strOutput.clear();
+	connection.szOutputSent = 0;
+	WantWrite(connection, false);
+	return true;
+}
+
+void SocketTransport::WantWrite(Connection& connection, bool bWantWrite)
+{
+	if (connection.bWantWrite == bWantWrite) {
+		return;
+	}
+	connection.bWantWrite = bWantWrite;
+	epoll_event event = {};
+	event.events = EPOLLIN | EPOLLRDHUP | (bWantWrite ? EPOLLOUT : 0);
+	event.data.ptr = &connection;
+	epoll_ctl(m_epoll, EPOLL_CTL_MOD, connection.fd, &event);
+}
+
+void SocketTransport::HandleEvents(Connection& connection, unsigned nEvents, ULONGLONG tmNow)
+{
+	if (!connection.bConnected) {
+		if (!(nEvents & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+			return;
+		}
+		int nSocketError = 0;
+		socklen_t nLength = sizeof(nSocketError);
+		if (getsockopt(connection.fd, SOL_SOCKET, SO_ERROR, &nSocketError, &nLength) || nSocketError) {
+			connection.pServer->bResolved = false;
+			FailConnection(connection, -ERROR_INTERNET_CANNOT_CONNECT);
+			return;
+		}
+		connection.bConnected = true;
+		connection.tmDeadline = tmNow + (connection.pipeline.empty() ? IDLE_TIMEOUT_MS : RECEIVE_TIMEOUT_MS);
+		for (Request* pRequest : connection.pipeline) {
+			TraceAsyncStep("HttpRequest", pRequest->id, "connected");
+		}
+	}
+	if ((nEvents & EPOLLOUT) && !Flush(connection)) {
+		return;
+	}
+	if (!(nEvents & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+		return;
+	}
+	// read all there is, level-triggered epoll would wake up again for anything left anyway
+	while (true) {
+		ssize_t n = recv(connection.fd, m_vecReadBuffer.data(), m_vecReadBuffer.size(), 0);
+		if (n > 0) {
+			if (!Receive(connection, m_vecReadBuffer.data(), n, tmNow) || connection.fd < 0) {
+				return;
+			}
+			continue;
+		}
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		}
+		if (n == 0 && connection.state == RS_UNTIL_CLOSE && !connection.pipeline.empty()) {
+			// the end of the body is the end of the connection
+			connection.bKeepAlive = false;
+			CompleteResponse(connection, tmNow);
+		} else {
+			FailConnection(connection, n == 0 ? -ERROR_INTERNET_CONNECTION_ABORTED : -ERROR_INTERNET_CONNECTION_RESET);
+		}
+		return;
+	}
+}
+
+bool SocketTransport::Receive(Connection& connection, const char* p, size_t szLength, ULONGLONG tmNow)
+{
+	connection.tmDeadline = tmNow + RECEIVE_TIMEOUT_MS;
+	while (szLength) {
+		if (connection.pipeline.empty()) {
+			// nothing was asked for
+			FailConnection(connection, -ERROR_HTTP_INVALID_SERVER_RESPONSE);
+			return false;
+		}
+		if (!connection.bResponseStarted) {
+			connection.bResponseStarted = true;
+			TraceAsyncStep("HttpRequest", connection.pipeline.front()->id, "first byte");
+		}
+		switch (connection.state) {
+		case RS_HEADERS: {
+			// up to the empty line which ends them
+			size_t szOld = connection.strLine.size();
+			connection.strLine.append(p, szLength);
+			size_t nEnd = connection.strLine.find("\r\n\r\n", szOld >= 3 ? szOld - 3 : 0);
+			if (nEnd == std::string::npos) {
+				if (connection.strLine.size() > MAX_HEADER_SIZE) {
+					FailConnection(connection, -ERROR_HTTP_INVALID_SERVER_RESPONSE);
+					return false;
+				}
+				return true;
+			}
+			connection.strLine.resize(nEnd + 4);
+			size_t szUsed = nEnd + 4 - szOld;
+			p += szUsed;
+			szLength -= szUsed;
+			if (!ParseHead(connection)) {
+				FailConnection(connection, -ERROR_HTTP_INVALID_SERVER_RESPONSE);
+				return false;
+			}
+			connection.strLine.clear();
+			// interim responses (100 Continue and such) are followed by the actual one
+			if (connection.nStatus >= 200) {
+				StartBody(connection, tmNow);
+			}
+			break;
+		}
+
+		case RS_BODY:
+		case RS_CHUNK_DATA: {
+			size_t szTake = std::min(szLength, connection.szRemaining);
+			if (!AppendBody(connection, p, szTake)) {
+				FailConnection(connection, -ERROR_HTTP_INVALID_SERVER_RESPONSE);
+				return false;
+			}
+			p += szTake;
+			szLength -= szTake;
+			connection.szRemaining -= szTake;
+			if (!connection.szRemaining) {
+				if (connection.state == RS_BODY) {
+					CompleteResponse(connection, tmNow);
+				} else {
+					connection.state = RS_CHUNK_END;
+				}
+			}
+			break;
+		}
+
+		case RS_CHUNK_SIZE:
+			if (ReadLine(connection, p, szLength)) {
+				// hex size, maybe followed by extensions
+				size_t szChunk = 0;
+				const char* pLine = connection.strLine.c_str();
+				auto result = std::from_chars(pLine, pLine + connection.strLine.size(), szChunk, 16);
+				if (result.ec != std::errc() || (result.ptr < pLine + connection.strLine.size() && *result.ptr != ';' && *result.ptr != ' ')) {
+					FailConnection(connection, -ERROR_HTTP_INVALID_SERVER_RESPONSE);
+					return false;
+				}
+				connection.strLine.clear();
+				connection.szRemaining = szChunk;
+				connection.state = szChunk ? RS_CHUNK_DATA : RS_TRAILERS;
+			}
+			break;
+
+		case RS_CHUNK_END:
+			if (ReadLine(connection, p, szLength)) {
+				if (!connection.strLine.empty()) {
+					FailConnection(connection, -ERROR_HTTP_INVALID_SERVER_RESPONSE);
+					return false;
+				}
+				connection.state = RS_CHUNK_SIZE;
+			}
+			break;
+
+		case RS_TRAILERS:
+			// ignored, up to an empty line
+			if (ReadLine(connection, p, szLength)) {
+				bool bEnd = connection.strLine.empty();
+				connection.strLine.clear();
+				if (bEnd) {
+					CompleteResponse(connection, tmNow);
+				}
+			}
+			break;
+
+		case RS_UNTIL_CLOSE:
+			if (!AppendBody(connection, p, szLength)) {
+				FailConnection(connection, -ERROR_HTTP_INVALID_SERVER_RESPONSE);
+				return false;
+			}
+			szLength = 0;
+			break;
+		}
+		if (connection.fd < 0) {
+			// closed after the response, as the server asked
+			return true;
+		}
+		if (connection.strLine.size() > MAX_HEADER_SIZE) {
+			FailConnection(connection, -ERROR_HTTP_INVALID_SERVER_RESPONSE);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool SocketTransport::ReadLine(Connection& connection, const char*& p, size_t& szLength)
+{
+	const char* pEnd = static_cast<const char*>(memchr(p, '\n', szLength));
+	size_t szTake = pEnd ? pEnd - p + 1 : szLength;
+	connection.strLine.append(p, szTake);
+	p += szTake;
+	szLength -= szTake;
+	if (!pEnd) {
+		return false;
+	}
+	connection.strLine.pop_back();
+	if (!connection.strLine.empty() && connection.strLine.back() == '\r') {
+		connection.strLine.pop_back();
+	}
+	return true;
+}
+
+// header value by name (case-insensitive) from a header block, empty if there is none
+static std::string FindHeader(const std::string& strHead, const char* pszName)
+{
+	size_t szName = strlen(pszName);
+	for (size_t nLine = strHead.find("\r\n"); nLine != std::string::npos && nLine + 2 < strHead.size(); nLine = strHead.find("\r\n", nLine + 2)) {
+		size_t nStart = nLine + 2;
+		if (strHead.size() > nStart + szName && strHead[nStart + szName] == ':' && strncasecmp(strHead.c_str() + nStart, pszName, szName) == 0) {
+			size_t nValue = strHead.find_first_not_of(" \t", nStart + szName + 1);
+			size_t nEnd = strHead.find("\r\n", nStart);
+			if (nValue == std::string::npos || nValue > nEnd) {
+				return std::string();
+			}
+			size_t nLast = strHead.find_last_not_of(" \t", nEnd - 1);
+			return strHead.substr(nValue, nLast + 1 - nValue);
+		}
+	}
+	return std::string();
+}
+
+// whether a comma-separated header value has a token (case-insensitive)
+static bool HasToken(const std::string& strValue, const char* pszToken)
+{
+	std::string strLower = strValue;
+	std::transform(strLower.begin(), strLower.end(), strLower.begin(), [](char c) { return (char)tolower(c); });
+	return strLower.find(pszToken) != std::string::npos;
+}
+
+bool SocketTransport::ParseHead(Connection& connection)
+{
+	const std::string& strHead = connection.strLine;
+	// "HTTP/1.1 200 OK"
+	unsigned nMinor = 0, nStatus = 0;
+	if (strHead.compare(0, 7, "HTTP/1.") || strHead.size() < 12 ||
+		std::from_chars(strHead.c_str() + 7, strHead.c_str() + 8, nMinor).ec != std::errc() || strHead[8] != ' ' ||
+		std::from_chars(strHead.c_str() + 9, strHead.c_str() + 12, nStatus).ec != std::errc() || nStatus < 100 || nStatus > 999) {
+		return false;
+	}
+	connection.nStatus = nStatus;
+	if (nStatus < 200) {
+		return true;
+	}
+
+	std::string strConnection = FindHeader(strHead, "Connection");
+	connection.bKeepAlive = nMinor >= 1 ? !HasToken(strConnection, "close") : HasToken(strConnection, "keep-alive");
+	connection.cacheInfo = HttpCacheInfo();
+	ParseCacheHeaders(nStatus, [&](const char* pszName) { return FindHeader(strHead, pszName); }, connection.cacheInfo);
+
+	connection.bKeepBody = nStatus >= 200 && nStatus <= 299;
+	std::string strLength = FindHeader(strHead, "Content-Length");
+	if (nStatus == 204 || nStatus == HTTP_STATUS_NOT_MODIFIED) {
+		connection.state = RS_BODY;
+		connection.szRemaining = 0;
+	} else if (HasToken(FindHeader(strHead, "Transfer-Encoding"), "chunked")) {
+		connection.state = RS_CHUNK_SIZE;
+	} else if (!strLength.empty()) {
+		if (std::from_chars(strLength.c_str(), strLength.c_str() + strLength.size(), connection.szRemaining).ec != std::errc() ||
+			connection.szRemaining > MAX_BODY_SIZE) {
+			return false;
+		}
+		connection.state = RS_BODY;
+	} else {
+		connection.state = RS_UNTIL_CLOSE;
+		connection.bKeepAlive = false;
+	}
+	return true;
+}
+
+void SocketTransport::StartBody(Connection& connection, ULONGLONG tmNow)
+{
+	if (connection.bKeepBody) {
+		connection.body.Reset(connection.state == RS_BODY ? connection.szRemaining : 0);
+	}
+	if (connection.state == RS_BODY && !connection.szRemaining) {
+		CompleteResponse(connection, tmNow);
+	}
+}
+
+bool SocketTransport::AppendBody(Connection& connection, const char* p, size_t szLength)
+{
+	// Content-Length is checked up front, chunked bodies and bodies ending with the connection
+	// as they come.  Bodies of error responses are not kept, so they don't matter
+	if (!connection.bKeepBody) {
+		return true;
+	}
+	if (szLength > MAX_BODY_SIZE - connection.body.size()) {
+		return false;
+	}
+	while (szLength) {
+		size_t szSpace;
+		BYTE* pSpace = connection.body.GetSpace(szSpace);
+		size_t szCopy = std::min(szSpace, szLength);
+		memcpy(pSpace, p, szCopy);
+		connection.body.Commit(szCopy);
+		p += szCopy;
+		szLength -= szCopy;
+	}
+	return true;
+}
+
+void SocketTransport::CompleteResponse(Connection& connection, ULONGLONG tmNow)
+{
+	Request& request = *connection.pipeline.front();
+	connection.pipeline.pop_front();
+	connection.nResponses++;
+	connection.state = RS_HEADERS;
+	connection.bResponseStarted = false;
+	connection.strLine.clear();
+	if (connection.bKeepBody) {
+		connection.bKeepBody = false;
+		FinishRequest(request, 0, connection.body.Finish(), connection.cacheInfo);
+	} else {
+		FinishRequest(request, (int)connection.nStatus, ResponseBuffer(), connection.cacheInfo);
+	}
+
+	if (!connection.bKeepAlive) {
+		// whatever else was sent on it goes again on another one
+		FailConnection(connection, -ERROR_INTERNET_CONNECTION_ABORTED);
+		return;
+	}
+	connection.tmDeadline = tmNow + (connection.pipeline.empty() ? IDLE_TIMEOUT_MS : RECEIVE_TIMEOUT_MS);
+}
+
+void SocketTransport::FailConnection(Connection& connection, int nError)
+{
+	Server& server = *connection.pServer;
+	// the one whose response was being read can only have been the cause if something came
+	// back for it, or if the connection had never worked
+	bool bFront = true;
+	std::vector<Request*> vecRetry;
+	for (Request* pRequest : connection.pipeline) {
+		pRequest->pConnection = nullptr;
+		bool bInnocent = !bFront || (!connection.bResponseStarted && connection.nResponses > 0);
+		bFront = false;
+		if (pRequest->bFinished) {
+			// cancelled, and nobody waits for its response any longer
+			m_mapRequests.erase(pRequest->id);
+		} else if (bInnocent && pRequest->nAttempts < MAX_ATTEMPTS) {
+			vecRetry.push_back(pRequest);
+		} else {
+			FinishRequest(*pRequest, nError);
+		}
+	}
+	connection.pipeline.clear();
+	// ahead of those which were never sent, in the order they were
+	server.queue.insert(server.queue.begin(), vecRetry.begin(), vecRetry.end());
+	m_stats.nRequestsRetried += vecRetry.size();
+	CloseConnection(connection);
+}
+
+void SocketTransport::CloseConnection(Connection& connection)
+{
+	_ASSERT(connection.pipeline.empty());
+	epoll_ctl(m_epoll, EPOLL_CTL_DEL, connection.fd, nullptr);
+	close(connection.fd);
+	connection.fd = -1;
+	std::vector<std::unique_ptr<Connection>>& vecConnections = connection.pServer->vecConnections;
+	auto it = std::find_if(vecConnections.begin(), vecConnections.end(), [&](auto& p) { return p.get() == &connection; });
+	m_vecClosed.push_back(std::move(*it));
+	vecConnections.erase(it);
+}
+
+void SocketTransport::FinishRequest(Request& request, int nStatus, ResponseBuffer buffer, const HttpCacheInfo& cacheInfo)
+{
+	if (!request.pConnection) {
+		std::erase(request.pServer->queue, &request);
+	}
+	if (!request.bFinished) {
+		TraceAsyncEnd("HttpRequest", request.id);
+		m_vecCompletions.push_back({ std::move(request.fnOnFinish), nStatus, std::move(buffer), cacheInfo });
+	}
+	m_mapRequests.erase(request.id);
+}
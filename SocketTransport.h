@@ -0,0 +1,206 @@
+#pragma once
+
+// SocketTransport.h: HttpTransport on non-blocking sockets and epoll, for where there is no
+// WinInet (Linux).  Plain HTTP/1.1 only: there's no TLS, so https URLs fail right away, and no
+// decompression, so responses are asked for uncompressed (tiles are compressed images anyway).
+// All I/O is done by one thread, waiting on all sockets at once with epoll; requests are handed
+// over to it under a lock, with a wakeup through an eventfd, and callbacks are called on it.
+// Each server (host and port) has a pool of persistent (keep-alive) connections, up to a
+// configurable number of them, and a queue of requests waiting for one.  A request goes to an
+// idle connection if there is one; or to a new one, if the server has fewer connections than
+// that; or else it is pipelined, sent right behind requests already sent on the connection with
+// the fewest of them, up to a configurable depth, once that connection has shown that the server
+// keeps it alive.  Responses come back in the order their requests were sent, and are read as
+// they arrive, by Content-Length, chunked, or until the connection closes.
+// Servers close idle connections after a while, which is only found out when a request is sent
+// on one: requests which got no response on a connection that closed (or failed after the
+// response before theirs) are sent again on another, up to MAX_ATTEMPTS times.
+// Host names are resolved on the I/O thread, once per server, blocking it meanwhile.
+// Requests still active when the transport is destroyed are dropped, without callbacks.
+
+#include "HttpTransport.h"
+
+class SocketTransport : public HttpTransport
+{
+public:
+	// nMaxConnectionsPerServer limits the number of simultaneous connections to one server, and
+	// nPipelineDepth the number of requests sent on one connection without waiting for responses
+	// (1 means no pipelining)
+	SocketTransport(unsigned nMaxConnectionsPerServer, unsigned nPipelineDepth = DEFAULT_PIPELINE_DEPTH);
+	~SocketTransport();
+
+	// no copy/assignment
+	SocketTransport& operator=(const SocketTransport&) = delete;
+	SocketTransport(const SocketTransport&) = delete;
+
+	void Start(RequestId id, const std::wstring& strUrl, const HttpCacheInfo* pValidators, OnFinishCallback fnOnFinish) override;
+	void Cancel(RequestId id) override;
+
+	static const unsigned DEFAULT_PIPELINE_DEPTH = 4;
+	// how long to wait for a connection, for (the rest of) a response, ms, and how long to keep
+	// an idle connection open
+	static const unsigned CONNECT_TIMEOUT_MS = 10000;
+	static const unsigned RECEIVE_TIMEOUT_MS = 30000;
+	static const unsigned IDLE_TIMEOUT_MS = 30000;
+	// times a request is sent at most, see above
+	static const unsigned MAX_ATTEMPTS = 3;
+	// response headers longer than this are an error, and so are bodies (tiles are a few hundred
+	// KB at most; whatever says it is longer is broken, and would only exhaust memory)
+	static constexpr size_t MAX_HEADER_SIZE = 64 * 1024;
+	static constexpr size_t MAX_BODY_SIZE = 64 * 1024 * 1024;
+
+	struct Stats
+	{
+		// connections opened, and open now
+		unsigned long long nConnectionsOpened;
+		size_t nConnectionsOpen;
+		// requests sent (including again), sent behind others on a connection, and sent again
+		unsigned long long nRequestsSent, nRequestsPipelined, nRequestsRetried;
+	};
+	Stats stats();
+
+private:
+	struct Server;
+	struct Connection;
+
+	struct Request
+	{
+		RequestId id;
+		Server* pServer;
+		// the whole request message
+		std::string strMessage;
+		OnFinishCallback fnOnFinish;
+		// sent on this connection, null while queued
+		Connection* pConnection = nullptr;
+		unsigned nAttempts = 0;
+		// callback called or about to be (completed, failed or cancelled).  A request cancelled
+		// after it was sent still waits for its response, to keep the connection's order
+		bool bFinished = false;
+	};
+
+	// where a connection is at in reading a response
+	enum ReadState
+	{
+		RS_HEADERS,
+		RS_BODY,
+		RS_CHUNK_SIZE,
+		RS_CHUNK_DATA,
+		RS_CHUNK_END,
+		RS_TRAILERS,
+		RS_UNTIL_CLOSE
+	};
+
+	struct Connection
+	{
+		Server* pServer;
+		int fd;
+		bool bConnected = false;
+		// whether epoll waits for it to be writable, which it does only while there's output left
+		bool bWantWrite = true;
+		// requests sent (or being sent), whose responses are due in this order
+		std::deque<Request*> pipeline;
+		// output not sent yet
+		std::string strOutput;
+		size_t szOutputSent = 0;
+		// responses read on it, so that it's known to be kept alive when > 0
+		unsigned nResponses = 0;
+		// when to give up connecting or waiting for a response, or to close it when idle
+		ULONGLONG tmDeadline = 0;
+
+		// the response being read: its status, and framing
+		ReadState state = RS_HEADERS;
+		// header block, or a chunk size or trailer line, as it comes in
+		std::string strLine;
+		// anything of the response in yet (if not, a request can be sent again)
+		bool bResponseStarted = false;
+		unsigned nStatus = 0;
+		bool bKeepAlive = true;
+		// body bytes left of Content-Length or a chunk
+		size_t szRemaining = 0;
+		// bodies are only kept for 2xx responses, others are read and dropped
+		bool bKeepBody = false;
+		ResponseBuilder body;
+		HttpCacheInfo cacheInfo;
+	};
+
+	struct Server
+	{
+		std::string strHost;
+		unsigned short nPort;
+		// requests waiting for a connection
+		std::deque<Request*> queue;
+		std::vector<std::unique_ptr<Connection>> vecConnections;
+		// resolved address, once it is
+		bool bResolved = false;
+		std::vector<BYTE> vecAddress;
+	};
+
+	// a callback to call once out of the lock
+	struct Completion
+	{
+		OnFinishCallback fnOnFinish;
+		int nStatus;
+		ResponseBuffer buffer;
+		HttpCacheInfo cacheInfo;
+	};
+
+	const unsigned m_nMaxConnectionsPerServer;
+	const unsigned m_nPipelineDepth;
+
+	int m_epoll = -1;
+	int m_event = -1;
+	// whether the eventfd has been signalled and the I/O thread hasn't seen it yet
+	std::atomic<bool> m_bWakePending = false;
+	std::thread m_thread;
+
+	// everything below is under this lock
+	std::mutex m_mutex;
+	bool m_bStop = false;
+	std::unordered_map<RequestId, std::unique_ptr<Request>> m_mapRequests;
+	// by host:port
+	std::unordered_map<std::string, std::unique_ptr<Server>> m_mapServers;
+	// closed while handling a batch of events, deleted after it, as the batch may refer to them
+	std::vector<std::unique_ptr<Connection>> m_vecClosed;
+	// callbacks to call after handling a batch of events
+	std::vector<Completion> m_vecCompletions;
+	// I/O thread's buffer for reading into
+	std::vector<char> m_vecReadBuffer;
+	Stats m_stats = {};
+
+	void IoThread();
+	// how long epoll may wait, until the nearest deadline; -1 if there is none
+	int Timeout(ULONGLONG tmNow);
+	// fails connections past their deadline, and closes idle ones
+	void CheckDeadlines(ULONGLONG tmNow);
+
+	// sends queued requests of a server on whatever connections it can
+	void Dispatch(Server& server, ULONGLONG tmNow);
+	// opens a new connection to a server; null, with nError set, if it fails right away
+	Connection* Connect(Server& server, ULONGLONG tmNow, int& nError);
+	void Send(Connection& connection, Request& request, ULONGLONG tmNow);
+	// sends output, as much as the socket takes.  False if the connection failed
+	bool Flush(Connection& connection);
+	void WantWrite(Connection& connection, bool bWantWrite);
+
+	void HandleEvents(Connection& connection, unsigned nEvents, ULONGLONG tmNow);
+	// takes bytes received.  False if the connection failed (bad response)
+	bool Receive(Connection& connection, const char* p, size_t szLength, ULONGLONG tmNow);
+	// collects a line from input into strLine; true once it is all there, without the line end
+	bool ReadLine(Connection& connection, const char*& p, size_t& szLength);
+	// interprets the status line and headers of a response, false if they are not valid
+	bool ParseHead(Connection& connection);
+	// starts reading the body, or completes the response if there's none
+	void StartBody(Connection& connection, ULONGLONG tmNow);
+	// adds bytes to the body being read.  False if it gets longer than MAX_BODY_SIZE
+	bool AppendBody(Connection& connection, const char* p, size_t szLength);
+	// the response at the front of the pipeline is complete
+	void CompleteResponse(Connection& connection, ULONGLONG tmNow);
+
+	// the connection failed, or the server closed it: the request whose response was being read
+	// fails with nError (unless it can be sent again), and the rest are sent again
+	void FailConnection(Connection& connection, int nError);
+	// closes the connection, whose pipeline must be empty by now
+	void CloseConnection(Connection& connection);
+	// reports the outcome of a request (unless it was cancelled) and forgets it
+	void FinishRequest(Request& request, int nStatus, ResponseBuffer buffer = ResponseBuffer(), const HttpCacheInfo& cacheInfo = HttpCacheInfo());
+};
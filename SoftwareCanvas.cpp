@@ -0,0 +1,326 @@
+// SoftwareCanvas.cpp: SoftwareCanvas class implementation, and row kernels for it
+
+#include "framework.h"
+#include "TileManager.h"
+#include "PixelConvert.h"
+#include "SoftwareCanvas.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#ifdef _WIN32
+#include <intrin.h>
+#endif
+#define SOFTWARECANVAS_X86
+#endif
+
+// x / 255, rounded to nearest, exact for x <= 255 * 255
+static inline UINT32 Div255(UINT32 x)
+{
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+// converts color to premultiplied BGRA
+static UINT32 ColorToPBGRA(const D2D1_COLOR_F& color)
+{
+	auto toByte = [](float f) { return (UINT32)std::lround(std::clamp(f, 0.f, 1.f) * 255.f); };
+	UINT32 a = toByte(color.a);
+	return Div255(toByte(color.b) * a) | (Div255(toByte(color.g) * a) << 8) | (Div255(toByte(color.r) * a) << 16) | (a << 24);
+}
+
+// Source-over blending of a row of premultiplied pixels: dst = src + dst * (1 - src alpha)
+
+static void BlendRowScalar(const UINT32* pSrc, UINT32* pDst, size_t nPixels)
+{
+	for (size_t i = 0; i < nPixels; i++) {
+		UINT32 s = pSrc[i], sa = s >> 24;
+		if (sa == 255) {
+			pDst[i] = s;
+		} else if (sa) {
+			UINT32 d = pDst[i], m = 255 - sa;
+			pDst[i] = s + (Div255((d & 0xff) * m) | (Div255(((d >> 8) & 0xff) * m) << 8) |
+				(Div255(((d >> 16) & 0xff) * m) << 16) | (Div255((d >> 24) * m) << 24));
+		}
+	}
+}
+
+// Bilinear sampling of a row: every output pixel i is interpolated between columns
+// pColumns0[i] and pColumns1[i] with weight pWeights[i] (of 256) for the latter, and
+// between rows pRow0 and pRow1 with weight nWeightY
+
+static void BilinearRowScalar(const UINT32* pRow0, const UINT32* pRow1, unsigned nWeightY,
+	const unsigned* pColumns0, const unsigned* pColumns1, const BYTE* pWeights, UINT32* pDst, size_t nPixels)
+{
+	for (size_t i = 0; i < nPixels; i++) {
+		UINT32 t00 = pRow0[pColumns0[i]], t01 = pRow0[pColumns1[i]];
+		UINT32 t10 = pRow1[pColumns0[i]], t11 = pRow1[pColumns1[i]];
+		UINT32 wx = pWeights[i], wy = nWeightY, result = 0;
+		for (unsigned shift = 0; shift < 32; shift += 8) {
+			UINT32 top = (((t00 >> shift) & 0xff) * (256 - wx) + ((t01 >> shift) & 0xff) * wx) >> 8;
+			UINT32 bottom = (((t10 >> shift) & 0xff) * (256 - wx) + ((t11 >> shift) & 0xff) * wx) >> 8;
+			result |= ((top * (256 - wy) + bottom * wy) >> 8) << shift;
+		}
+		pDst[i] = result;
+	}
+}
+
+#ifdef SOFTWARECANVAS_X86
+
+static inline __m128i Div255SSE2(__m128i x)
+{
+	x = _mm_add_epi16(x, _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+static void BlendRowSSE2(const UINT32* pSrc, UINT32* pDst, size_t nPixels)
+{
+	const __m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi16(255);
+	const __m128i alphaMask = _mm_set1_epi32((int)0xff000000);
+	size_t i = 0;
+	for (; i + 4 <= nPixels; i += 4) {
+		__m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc + i));
+		// all opaque (the usual case for tiles) or all transparent are easy
+		__m128i alpha = _mm_and_si128(s, alphaMask);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(alpha, alphaMask)) == 0xffff) {
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(pDst + i), s);
+			continue;
+		}
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(alpha, zero)) == 0xffff) {
+			continue;
+		}
+		__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pDst + i));
+		__m128i slo = _mm_unpacklo_epi8(s, zero), shi = _mm_unpackhi_epi8(s, zero);
+		// 255 - source alpha, for every component
+		__m128i mlo = _mm_sub_epi16(ones, _mm_shufflehi_epi16(_mm_shufflelo_epi16(slo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3)));
+		__m128i mhi = _mm_sub_epi16(ones, _mm_shufflehi_epi16(_mm_shufflelo_epi16(shi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3)));
+		__m128i dlo = Div255SSE2(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), mlo));
+		__m128i dhi = Div255SSE2(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), mhi));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(pDst + i), _mm_adds_epu8(s, _mm_packus_epi16(dlo, dhi)));
+	}
+	BlendRowScalar(pSrc + i, pDst + i, nPixels - i);
+}
+
+static void BilinearRowSSE2(const UINT32* pRow0, const UINT32* pRow1, unsigned nWeightY,
+	const unsigned* pColumns0, const unsigned* pColumns1, const BYTE* pWeights, UINT32* pDst, size_t nPixels)
+{
+	// one pixel at a time, 16 bits per component: left texel in the low half of a register,
+	// right texel in the high half; then top row in the low half, bottom row in the high half
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i wy = _mm_set_epi16((short)nWeightY, (short)nWeightY, (short)nWeightY, (short)nWeightY,
+		(short)(256 - nWeightY), (short)(256 - nWeightY), (short)(256 - nWeightY), (short)(256 - nWeightY));
+	for (size_t i = 0; i < nPixels; i++) {
+		short w = pWeights[i];
+		__m128i wx = _mm_set_epi16(w, w, w, w, 256 - w, 256 - w, 256 - w, 256 - w);
+		__m128i top = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128((int)pRow0[pColumns0[i]]), _mm_cvtsi32_si128((int)pRow0[pColumns1[i]])), zero);
+		__m128i bottom = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128((int)pRow1[pColumns0[i]]), _mm_cvtsi32_si128((int)pRow1[pColumns1[i]])), zero);
+		top = _mm_mullo_epi16(top, wx);
+		bottom = _mm_mullo_epi16(bottom, wx);
+		top = _mm_srli_epi16(_mm_add_epi16(top, _mm_srli_si128(top, 8)), 8);
+		bottom = _mm_srli_epi16(_mm_add_epi16(bottom, _mm_srli_si128(bottom, 8)), 8);
+		__m128i v = _mm_mullo_epi16(_mm_unpacklo_epi64(top, bottom), wy);
+		v = _mm_srli_epi16(_mm_add_epi16(v, _mm_srli_si128(v, 8)), 8);
+		pDst[i] = (UINT32)_mm_cvtsi128_si32(_mm_packus_epi16(v, zero));
+	}
+}
+
+// GCC and Clang only allow AVX2 intrinsics in code compiled for it
+#ifdef __GNUC__
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+
+static inline __m256i Div255AVX2(__m256i x)
+{
+	x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+	return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+static void BlendRowAVX2(const UINT32* pSrc, UINT32* pDst, size_t nPixels)
+{
+	// same as BlendRowSSE2(), 8 pixels at a time
+	const __m256i zero = _mm256_setzero_si256(), ones = _mm256_set1_epi16(255);
+	const __m256i alphaMask = _mm256_set1_epi32((int)0xff000000);
+	size_t i = 0;
+	for (; i + 8 <= nPixels; i += 8) {
+		__m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pSrc + i));
+		__m256i alpha = _mm256_and_si256(s, alphaMask);
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(alpha, alphaMask)) == -1) {
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(pDst + i), s);
+			continue;
+		}
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(alpha, zero)) == -1) {
+			continue;
+		}
+		__m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pDst + i));
+		__m256i slo = _mm256_unpacklo_epi8(s, zero), shi = _mm256_unpackhi_epi8(s, zero);
+		__m256i mlo = _mm256_sub_epi16(ones, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(slo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3)));
+		__m256i mhi = _mm256_sub_epi16(ones, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(shi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3)));
+		__m256i dlo = Div255AVX2(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), mlo));
+		__m256i dhi = Div255AVX2(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), mhi));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(pDst + i), _mm256_adds_epu8(s, _mm256_packus_epi16(dlo, dhi)));
+	}
+	BlendRowScalar(pSrc + i, pDst + i, nPixels - i);
+}
+
+#ifdef __GNUC__
+#pragma GCC pop_options
+#endif
+
+#endif // SOFTWARECANVAS_X86
+
+static void BlendRow(const UINT32* pSrc, UINT32* pDst, size_t nPixels)
+{
+#ifdef SOFTWARECANVAS_X86
+	switch (GetSimdLevel()) {
+	case SIMD_AVX2:
+		BlendRowAVX2(pSrc, pDst, nPixels);
+		return;
+	case SIMD_SSE2:
+		BlendRowSSE2(pSrc, pDst, nPixels);
+		return;
+	default:
+		break;
+	}
+#endif
+	BlendRowScalar(pSrc, pDst, nPixels);
+}
+
+static void BilinearRow(const UINT32* pRow0, const UINT32* pRow1, unsigned nWeightY,
+	const unsigned* pColumns0, const unsigned* pColumns1, const BYTE* pWeights, UINT32* pDst, size_t nPixels)
+{
+#ifdef SOFTWARECANVAS_X86
+	if (GetSimdLevel() >= SIMD_SSE2) {
+		BilinearRowSSE2(pRow0, pRow1, nWeightY, pColumns0, pColumns1, pWeights, pDst, nPixels);
+		return;
+	}
+#endif
+	BilinearRowScalar(pRow0, pRow1, nWeightY, pColumns0, pColumns1, pWeights, pDst, nPixels);
+}
+
+SoftwareCanvas::SoftwareCanvas(unsigned nWidth, unsigned nHeight)
+	: m_nWidth(nWidth), m_nHeight(nHeight), m_vecPixels((size_t)nWidth * nHeight, 0), m_vecRow(nWidth)
+{
+}
+
+void SoftwareCanvas::Clear(const D2D1_COLOR_F& color)
+{
+	std::fill(m_vecPixels.begin(), m_vecPixels.end(), ColorToPBGRA(color));
+}
+
+D2D1_SIZE_F SoftwareCanvas::size()
+{
+	return D2D1::SizeF((float)m_nWidth, (float)m_nHeight);
+}
+
+float SoftwareCanvas::dpiScale()
+{
+	return 1.f;
+}
+
+void SoftwareCanvas::DrawTile(const Tile& tile, const D2D1_RECT_F& rectDest, const D2D1_RECT_F* pRectSource)
+{
+	std::shared_ptr<const DecodedImage> pImage = tile.pixels();
+	int x0, y0, x1, y1;
+	if (!pImage || !pImage->nWidth || !pImage->nHeight || !ClipRect(rectDest, x0, y0, x1, y1)) {
+		return;
+	}
+	const UINT32* pImagePixels = reinterpret_cast<const UINT32*>(pImage->vecPixels.data());
+	D2D1_RECT_F rectSource = pRectSource ? *pRectSource : D2D1::RectF(0.f, 0.f, (float)pImage->nWidth, (float)pImage->nHeight);
+	float fScaleX = (rectSource.right - rectSource.left) / (rectDest.right - rectDest.left);
+	float fScaleY = (rectSource.bottom - rectSource.top) / (rectDest.bottom - rectDest.top);
+	float fOffsetX = rectSource.left - rectDest.left, fOffsetY = rectSource.top - rectDest.top;
+
+	// unscaled and aligned to whole pixels: straight blit, clipped to the image
+	if (fScaleX == 1.f && fScaleY == 1.f && fOffsetX == std::floor(fOffsetX) && fOffsetY == std::floor(fOffsetY)) {
+		int dx = (int)fOffsetX, dy = (int)fOffsetY;
+		x0 = std::max(x0, -dx);
+		y0 = std::max(y0, -dy);
+		x1 = std::min(x1, (int)pImage->nWidth - dx);
+		y1 = std::min(y1, (int)pImage->nHeight - dy);
+		for (int y = y0; y < y1; y++) {
+			BlendRow(pImagePixels + (size_t)(y + dy) * pImage->nWidth + x0 + dx, m_vecPixels.data() + (size_t)y * m_nWidth + x0, x1 - x0);
+		}
+		return;
+	}
+
+	// otherwise bilinear scaling.  Samples are clamped to the source rectangle, so that
+	// nothing bleeds in from outside of it
+	int nMaxX = std::min((int)std::ceil(rectSource.right) - 1, (int)pImage->nWidth - 1);
+	int nMaxY = std::min((int)std::ceil(rectSource.bottom) - 1, (int)pImage->nHeight - 1);
+	int nMinX = std::clamp((int)rectSource.left, 0, nMaxX), nMinY = std::clamp((int)rectSource.top, 0, nMaxY);
+	auto sample = [](float f, int nMin, int nMax, unsigned& n0, unsigned& n1, unsigned& nWeight) {
+		float fFloor = std::floor(f);
+		int n = (int)fFloor;
+		nWeight = (unsigned)((f - fFloor) * 256.f);
+		if (n < nMin) {
+			n = nMin;
+			nWeight = 0;
+		} else if (n >= nMax) {
+			n = nMax;
+			nWeight = 0;
+		}
+		n0 = n;
+		n1 = std::min(n + 1, nMax);
+	};
+
+	// columns are the same for all rows
+	size_t nPixels = x1 - x0;
+	m_vecColumns0.resize(nPixels);
+	m_vecColumns1.resize(nPixels);
+	m_vecColumnWeights.resize(nPixels);
+	for (size_t i = 0; i < nPixels; i++) {
+		unsigned nWeight;
+		sample((x0 + i + 0.5f - rectDest.left) * fScaleX + rectSource.left - 0.5f, nMinX, nMaxX, m_vecColumns0[i], m_vecColumns1[i], nWeight);
+		m_vecColumnWeights[i] = (BYTE)nWeight;
+	}
+	for (int y = y0; y < y1; y++) {
+		unsigned nRow0, nRow1, nWeightY;
+		sample((y + 0.5f - rectDest.top) * fScaleY + rectSource.top - 0.5f, nMinY, nMaxY, nRow0, nRow1, nWeightY);
+		BilinearRow(pImagePixels + (size_t)nRow0 * pImage->nWidth, pImagePixels + (size_t)nRow1 * pImage->nWidth, nWeightY,
+			m_vecColumns0.data(), m_vecColumns1.data(), m_vecColumnWeights.data(), m_vecRow.data(), nPixels);
+		BlendRow(m_vecRow.data(), m_vecPixels.data() + (size_t)y * m_nWidth + x0, nPixels);
+	}
+}
+
+void SoftwareCanvas::FillRectangle(const D2D1_RECT_F& rect, const D2D1_COLOR_F& color)
+{
+	int x0, y0, x1, y1;
+	if (!ClipRect(rect, x0, y0, x1, y1)) {
+		return;
+	}
+	UINT32 nColor = ColorToPBGRA(color);
+	std::fill(m_vecRow.begin(), m_vecRow.begin() + (x1 - x0), nColor);
+	for (int y = y0; y < y1; y++) {
+		BlendRow(m_vecRow.data(), m_vecPixels.data() + (size_t)y * m_nWidth + x0, x1 - x0);
+	}
+}
+
+void SoftwareCanvas::DrawLine(D2D1_POINT_2F ptFrom, D2D1_POINT_2F ptTo, const D2D1_COLOR_F& color, float fWidth)
+{
+	// horizontal and vertical lines are just rectangles
+	float fHalf = fWidth / 2.f;
+	if (ptFrom.x == ptTo.x || ptFrom.y == ptTo.y) {
+		FillRectangle(D2D1::RectF(std::min(ptFrom.x, ptTo.x) - (ptFrom.x == ptTo.x ? fHalf : 0.f),
+			std::min(ptFrom.y, ptTo.y) - (ptFrom.y == ptTo.y ? fHalf : 0.f),
+			std::max(ptFrom.x, ptTo.x) + (ptFrom.x == ptTo.x ? fHalf : 0.f),
+			std::max(ptFrom.y, ptTo.y) + (ptFrom.y == ptTo.y ? fHalf : 0.f)), color);
+		return;
+	}
+
+	// anything else is stepped along the longer axis, one square per step, no antialiasing
+	float dx = ptTo.x - ptFrom.x, dy = ptTo.y - ptFrom.y;
+	int nSteps = (int)std::ceil(std::max(std::abs(dx), std::abs(dy)));
+	for (int i = 0; i <= nSteps; i++) {
+		float x = ptFrom.x + dx * i / nSteps, y = ptFrom.y + dy * i / nSteps;
+		FillRectangle(D2D1::RectF(x - fHalf, y - fHalf, x + fHalf, y + fHalf), color);
+	}
+}
+
+bool SoftwareCanvas::ClipRect(const D2D1_RECT_F& rect, int& x0, int& y0, int& x1, int& y1)
+{
+	// pixel i is covered if its center i + 0.5 is within [left, right)
+	x0 = (int)std::max(std::ceil(rect.left - 0.5f), 0.f);
+	y0 = (int)std::max(std::ceil(rect.top - 0.5f), 0.f);
+	x1 = (int)std::min(std::ceil(rect.right - 0.5f), (float)m_nWidth);
+	y1 = (int)std::min(std::ceil(rect.bottom - 0.5f), (float)m_nHeight);
+	return x0 < x1 && y0 < y1;
+}
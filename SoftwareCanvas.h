@@ -0,0 +1,41 @@
+#pragma once
+
+// SoftwareCanvas.h: Canvas implementation which draws into an in-memory 32bpp premultiplied
+// BGRA buffer on the CPU.  Tiles are drawn from their decoded pixels (see TileManager::SetKeepPixels()),
+// scaled bilinearly if needed, and everything is composited with source-over blending.
+// Rows are processed with SSE2/AVX2 kernels where the CPU supports it (see PixelConvert.h).
+// Scale is always 1 device pixel per device independent pixel.  Not thread safe.
+
+#include "Canvas.h"
+
+class SoftwareCanvas : public Canvas
+{
+public:
+	SoftwareCanvas(unsigned nWidth, unsigned nHeight);
+
+	// fills entire canvas with a color (without blending)
+	void Clear(const D2D1_COLOR_F& color);
+
+	unsigned width() const { return m_nWidth; }
+	unsigned height() const { return m_nHeight; }
+	// canvas contents, rows top to bottom, tightly packed
+	const UINT32* pixels() const { return m_vecPixels.data(); }
+
+	D2D1_SIZE_F size() override;
+	float dpiScale() override;
+	void DrawTile(const Tile& tile, const D2D1_RECT_F& rectDest, const D2D1_RECT_F* pRectSource = nullptr) override;
+	void FillRectangle(const D2D1_RECT_F& rect, const D2D1_COLOR_F& color) override;
+	void DrawLine(D2D1_POINT_2F ptFrom, D2D1_POINT_2F ptTo, const D2D1_COLOR_F& color, float fWidth = 1.f) override;
+
+private:
+	unsigned m_nWidth, m_nHeight;
+	std::vector<UINT32> m_vecPixels;
+	// scratch buffers for a single row
+	std::vector<UINT32> m_vecRow;
+	std::vector<unsigned> m_vecColumns0, m_vecColumns1;
+	std::vector<BYTE> m_vecColumnWeights;
+
+	// converts rectangle to a range of pixels whose centers are inside it, clipped
+	// to the canvas; returns false if empty
+	bool ClipRect(const D2D1_RECT_F& rect, int& x0, int& y0, int& x1, int& y1);
+};
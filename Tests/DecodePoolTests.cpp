@@ -0,0 +1,244 @@
+// DecodePoolTests.cpp: DecodePool running jobs in order on one thread and each exactly once on
+// several, stealing, the soft limit, Cancel(), and the destructor running what's still queued;
+// also PngDecoder on all workers at once decoding the same as on one thread
+
+#include "Test.h"
+#include "DecodePool.h"
+#include "PngDecoder.h"
+#include "PngWriter.h"
+
+// holds workers up in a job until released
+class Gate
+{
+public:
+	void Wait()
+	{
+		std::unique_lock lock(m_mutex);
+		m_nWaiting++;
+		m_cv.notify_all();
+		m_cv.wait(lock, [this]() { return m_bOpen; });
+	}
+
+	// waits until n jobs are held up
+	void WaitForWaiting(unsigned n)
+	{
+		std::unique_lock lock(m_mutex);
+		m_cv.wait(lock, [&]() { return m_nWaiting >= n; });
+	}
+
+	void Open()
+	{
+		std::lock_guard lock(m_mutex);
+		m_bOpen = true;
+		m_cv.notify_all();
+	}
+
+private:
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	unsigned m_nWaiting = 0;
+	bool m_bOpen = false;
+};
+
+TEST(InOrderOnOneThread)
+{
+	std::vector<int> vecOrder;
+	{
+		Gate gate;
+		DecodePool pool(1);
+		pool.Submit([&]() { gate.Wait(); });
+		gate.WaitForWaiting(1);
+		for (int n = 0; n < 100; n++) {
+			pool.Submit([&vecOrder, n]() { vecOrder.push_back(n); });
+		}
+		gate.Open();
+	}
+	REQUIRE(vecOrder.size() == 100);
+	for (int n = 0; n < 100; n++) {
+		CHECK_EQ(vecOrder[n], n);
+	}
+}
+
+TEST(EachJobOnce)
+{
+	static const unsigned JOBS = 10000;
+	std::vector<std::atomic<unsigned>> vecRuns(JOBS);
+	DecodePool::Stats stats;
+	{
+		DecodePool pool(4);
+		for (unsigned n = 0; n < JOBS; n++) {
+			pool.Submit([&vecRuns, n]() { vecRuns[n]++; });
+		}
+		// submitted from worker threads too
+		for (unsigned n = 0; n < 100; n++) {
+			pool.Submit([&pool, &vecRuns, n]() {
+				pool.Submit([&vecRuns, n]() { vecRuns[n]++; });
+			});
+		}
+		while (pool.stats().nCompleted < JOBS + 200) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		stats = pool.stats();
+	}
+	for (unsigned n = 0; n < JOBS; n++) {
+		CHECK_EQ(vecRuns[n].load(), n < 100 ? 2u : 1u);
+	}
+	CHECK_EQ(stats.nCompleted, JOBS + 200ull);
+	CHECK_EQ(stats.nQueued, 0u);
+	CHECK_EQ(stats.nCancelled, 0ull);
+}
+
+TEST(Stealing)
+{
+	Gate gate;
+	DecodePool pool(2);
+	// round robin: the blocker goes to one worker, and every other job after it to the same one,
+	// which is busy, so the other worker has to take them from it
+	pool.Submit([&]() { gate.Wait(); });
+	gate.WaitForWaiting(1);
+	std::atomic<unsigned> nRuns = 0;
+	for (int n = 0; n < 20; n++) {
+		pool.Submit([&]() { nRuns++; });
+	}
+	while (nRuns < 20) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	CHECK(pool.stats().nStolen >= 10);
+	gate.Open();
+}
+
+TEST(Saturation)
+{
+	Gate gate;
+	DecodePool pool(1, 8);
+	pool.Submit([&]() { gate.Wait(); });
+	gate.WaitForWaiting(1);
+	CHECK(!pool.isSaturated());
+	// the limit is soft, nothing is turned down
+	std::atomic<unsigned> nRuns = 0;
+	for (int n = 0; n < 10; n++) {
+		CHECK_EQ(pool.isSaturated(), n >= 8);
+		pool.Submit([&]() { nRuns++; });
+	}
+	CHECK(pool.isSaturated());
+	DecodePool::Stats stats = pool.stats();
+	CHECK_EQ(stats.nQueued, 10u);
+	CHECK_EQ(stats.nPeakQueued, 10u);
+	gate.Open();
+	while (nRuns < 10) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	CHECK(!pool.isSaturated());
+	CHECK_EQ(pool.stats().nPeakQueued, 10u);
+}
+
+TEST(Cancel)
+{
+	std::atomic<unsigned> nRuns = 0;
+	// what a job holds goes with it when it's cancelled
+	auto pHeld = std::make_shared<int>(0);
+	DecodePool::Stats stats;
+	{
+		Gate gate;
+		DecodePool pool(2);
+		pool.Submit([&]() { gate.Wait(); });
+		pool.Submit([&]() { gate.Wait(); });
+		gate.WaitForWaiting(2);
+		std::vector<DecodePool::JobId> vecIds;
+		for (int n = 0; n < 10; n++) {
+			vecIds.push_back(pool.Submit([&nRuns, n, pHeld]() { nRuns += 1 << n; }));
+		}
+		CHECK_EQ(pHeld.use_count(), 11l);
+		// every other one
+		for (size_t n = 0; n < vecIds.size(); n += 2) {
+			CHECK(pool.Cancel(vecIds[n]));
+			CHECK(!pool.Cancel(vecIds[n]));
+		}
+		CHECK_EQ(pHeld.use_count(), 6l);
+		CHECK_EQ(pool.stats().nQueued, 5u);
+		CHECK(!pool.Cancel(0));
+		gate.Open();
+		while (pool.stats().nCompleted < 7) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		// too late, it's run
+		CHECK(!pool.Cancel(vecIds[1]));
+		stats = pool.stats();
+	}
+	CHECK_EQ(nRuns.load(), 0x2aau);
+	CHECK_EQ(stats.nCancelled, 5ull);
+	CHECK_EQ(stats.nCompleted, 7ull);
+	CHECK_EQ(pHeld.use_count(), 1l);
+}
+
+TEST(ShutdownRunsQueuedJobs)
+{
+	std::atomic<unsigned> nRuns = 0;
+	Gate gate;
+	std::thread opener;
+	{
+		DecodePool pool(2);
+		pool.Submit([&]() { gate.Wait(); });
+		pool.Submit([&]() { gate.Wait(); });
+		gate.WaitForWaiting(2);
+		for (int n = 0; n < 50; n++) {
+			pool.Submit([&]() {
+				// queued while stopping
+				if (++nRuns <= 5) {
+					pool.Submit([&]() { nRuns++; });
+				}
+			});
+		}
+		// the destructor starts stopping with all of them still queued
+		opener = std::thread([&]() {
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			gate.Open();
+		});
+	}
+	opener.join();
+	CHECK_EQ(nRuns.load(), 55u);
+}
+
+TEST(ConcurrentDecodes)
+{
+	// tiles of each kind, decoded on one thread first
+	std::vector<std::vector<BYTE>> vecPngs;
+	std::vector<DecodedImage> vecExpected;
+	std::mt19937 random(1);
+	for (BYTE nColorType : { 0, 2, 3, 4, 6 }) {
+		PngImage image;
+		image.nWidth = image.nHeight = 64;
+		image.nColorType = nColorType;
+		image.vecRows.resize(image.rowBytes() * image.nHeight);
+		for (size_t n = 0; n < image.vecRows.size(); n++) {
+			image.vecRows[n] = (BYTE)(n % 7 ? n / 5 : random());
+		}
+		if (nColorType == 3) {
+			for (int n = 0; n < 256; n++) {
+				image.vecPalette.push_back((UINT32)random());
+			}
+		}
+		vecPngs.push_back(PngWriter::Write(image));
+		vecExpected.emplace_back();
+		REQUIRE(PngDecoder().Decode(vecPngs.back().data(), vecPngs.back().size(), vecExpected.back()));
+	}
+
+	// the same decoder on all threads, as TileManager has one per layer
+	static const size_t JOBS = 500;
+	PngDecoder decoder;
+	std::vector<DecodedImage> vecImages(JOBS);
+	std::vector<char> vecDecoded(JOBS);
+	{
+		DecodePool pool(4);
+		for (size_t n = 0; n < JOBS; n++) {
+			pool.Submit([&, n]() {
+				const std::vector<BYTE>& vecPng = vecPngs[n % vecPngs.size()];
+				vecDecoded[n] = decoder.Decode(vecPng.data(), vecPng.size(), vecImages[n]);
+			});
+		}
+	}
+	for (size_t n = 0; n < JOBS; n++) {
+		CHECK(vecDecoded[n]);
+		CHECK(vecImages[n].vecPixels == vecExpected[n % vecPngs.size()].vecPixels);
+	}
+}
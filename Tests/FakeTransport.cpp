@@ -0,0 +1,107 @@
+// FakeTransport.cpp: FakeTransport class implementation
+
+#include "framework.h"
+#include "Util.h"
+#include "FakeTransport.h"
+
+FakeTransport::FakeTransport(unsigned nLatencyMs, size_t szBody) : m_latency(nLatencyMs), m_szBody(szBody)
+{
+	m_thread = std::thread(&FakeTransport::WorkerThread, this);
+}
+
+FakeTransport::~FakeTransport()
+{
+	{
+		std::lock_guard lock(m_mutex);
+		m_bStop = true;
+	}
+	m_cv.notify_all();
+	m_thread.join();
+}
+
+void FakeTransport::Start(RequestId id, const std::wstring& strUrl, const HttpCacheInfo* pValidators, OnFinishCallback fnOnFinish)
+{
+	{
+		std::lock_guard lock(m_mutex);
+		m_mapRequests.emplace(id, Request{ std::chrono::steady_clock::now() + m_latency, m_nStatus, m_nRetryAfter, std::move(fnOnFinish) });
+		m_nStarted++;
+	}
+	m_cv.notify_all();
+}
+
+void FakeTransport::Cancel(RequestId id)
+{
+	OnFinishCallback fnOnFinish;
+	{
+		std::lock_guard lock(m_mutex);
+		auto pos = m_mapRequests.find(id);
+		if (pos == m_mapRequests.end()) {
+			return;
+		}
+		fnOnFinish = std::move(pos->second.fnOnFinish);
+		m_mapRequests.erase(pos);
+	}
+	fnOnFinish(-ERROR_INTERNET_OPERATION_CANCELLED, ResponseBuffer(), HttpCacheInfo());
+}
+
+void FakeTransport::SetStatus(int nStatus, unsigned nRetryAfter)
+{
+	std::lock_guard lock(m_mutex);
+	m_nStatus = nStatus;
+	m_nRetryAfter = nRetryAfter;
+}
+
+unsigned long long FakeTransport::requestsStarted()
+{
+	std::lock_guard lock(m_mutex);
+	return m_nStarted;
+}
+
+unsigned long long FakeTransport::requestsCompleted()
+{
+	std::lock_guard lock(m_mutex);
+	return m_nCompleted;
+}
+
+void FakeTransport::WorkerThread()
+{
+	std::unique_lock lock(m_mutex);
+	while (!m_bStop) {
+		if (m_mapRequests.empty()) {
+			m_cv.wait(lock);
+			continue;
+		}
+		auto pos = m_mapRequests.begin();
+		// a copy: the request may be cancelled (and erased) while waiting
+		auto tmDue = pos->second.tmDue;
+		if (std::chrono::steady_clock::now() < tmDue) {
+			m_cv.wait_until(lock, tmDue);
+			continue;
+		}
+		RequestId id = pos->first;
+		int nStatus = pos->second.nStatus;
+		unsigned nRetryAfter = pos->second.nRetryAfter;
+		OnFinishCallback fnOnFinish = std::move(pos->second.fnOnFinish);
+		m_mapRequests.erase(pos);
+		m_nCompleted++;
+		lock.unlock();
+
+		if (nStatus) {
+			HttpCacheInfo cacheInfo;
+			cacheInfo.nRetryAfter = nRetryAfter;
+			fnOnFinish(nStatus, ResponseBuffer(), cacheInfo);
+			lock.lock();
+			continue;
+		}
+		// a body which differs by request, so that tiles differ too
+		ResponseBuffer buffer = ResponseBuffer::Allocate(m_szBody);
+		memset(buffer.data(), 0, m_szBody);
+		memcpy(buffer.data(), &id, std::min(sizeof(id), m_szBody));
+		buffer.SetSize(m_szBody);
+		HttpCacheInfo cacheInfo;
+		cacheInfo.llExpires = GetUnixTime() + 3600;
+		fnOnFinish(0, std::move(buffer), cacheInfo);
+
+		lock.lock();
+	}
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+// FakeTransport.h: HttpTransport which makes no connections, for testing and benchmarking what is
+// above HttpClient (TileManager, TileScheduler) without a network or a server.  Every request
+// succeeds after a fixed latency with a made-up body of a fixed size, fresh for an hour (or
+// fails, see SetStatus()); requests are completed in the order they are due by one worker thread,
+// which calls the callbacks.
+// FakeDecoder goes with it, see below.
+
+#include "HttpTransport.h"
+#include "ImageDecoder.h"
+
+class FakeTransport : public HttpTransport
+{
+public:
+	FakeTransport(unsigned nLatencyMs = 0, size_t szBody = DEFAULT_BODY_SIZE);
+	// requests still active are dropped, without callbacks
+	~FakeTransport();
+
+	// no copy/assignment
+	FakeTransport& operator=(const FakeTransport&) = delete;
+	FakeTransport(const FakeTransport&) = delete;
+
+	void Start(RequestId id, const std::wstring& strUrl, const HttpCacheInfo* pValidators, OnFinishCallback fnOnFinish) override;
+	void Cancel(RequestId id) override;
+
+	// status requests started from now on finish with, without a body unless it is 0 (the default),
+	// e. g. HTTP_STATUS_SERVICE_UNAVAIL to make HttpClient open the server's circuit breaker; and
+	// the Retry-After they come with, seconds
+	void SetStatus(int nStatus, unsigned nRetryAfter = 0);
+
+	// about the size of a PNG tile
+	static const size_t DEFAULT_BODY_SIZE = 16 * 1024;
+
+	// requests started, and completed (not cancelled)
+	unsigned long long requestsStarted();
+	unsigned long long requestsCompleted();
+
+private:
+	struct Request
+	{
+		std::chrono::steady_clock::time_point tmDue;
+		int nStatus;
+		unsigned nRetryAfter;
+		OnFinishCallback fnOnFinish;
+	};
+
+	std::chrono::milliseconds m_latency;
+	size_t m_szBody;
+	int m_nStatus = 0;
+	unsigned m_nRetryAfter = 0;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	// by id, which increases with start time, so with the same latency also in the order due
+	std::map<RequestId, Request> m_mapRequests;
+	unsigned long long m_nStarted = 0, m_nCompleted = 0;
+	bool m_bStop = false;
+	std::thread m_thread;
+
+	void WorkerThread();
+};
+
+// ImageDecoder which decodes anything into a tile of a given size, filled with a color taken
+// from the first bytes of the data
+class FakeDecoder : public ImageDecoder
+{
+public:
+	explicit FakeDecoder(unsigned nTileSize) : m_nTileSize(nTileSize) {}
+
+	bool Decode(const void* pData, size_t szLength, DecodedImage& image) override
+	{
+		if (szLength < 4) {
+			return false;
+		}
+		uint32_t nColor;
+		memcpy(&nColor, pData, sizeof(nColor));
+		nColor |= 0xff000000;
+		image.nWidth = image.nHeight = m_nTileSize;
+		image.vecPixels.resize((size_t)m_nTileSize * m_nTileSize * 4);
+		std::fill_n(reinterpret_cast<uint32_t*>(image.vecPixels.data()), (size_t)m_nTileSize * m_nTileSize, nColor);
+		return true;
+	}
+
+private:
+	unsigned m_nTileSize;
+};
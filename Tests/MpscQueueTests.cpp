@@ -0,0 +1,95 @@
+// MpscQueueTests.cpp: MpscQueue under contention: several producers pushing as fast as they can
+// while the consumer drains, checking that every item comes out exactly once and in the order
+// each producer pushed it.  Meant to be run under ThreadSanitizer too (-DMAPVIEWER_SANITIZE=thread)
+
+#include "Test.h"
+#include "MpscQueue.h"
+
+TEST(Order)
+{
+	MpscQueue<int> queue;
+	CHECK(queue.empty());
+	CHECK(queue.Push(1));
+	CHECK(!queue.Push(2));
+	CHECK(!queue.Push(3));
+	CHECK(!queue.empty());
+	std::vector<int> vecItems;
+	CHECK_EQ(queue.Drain([&](int& n) { vecItems.push_back(n); }), 3u);
+	CHECK(vecItems == std::vector<int>({ 1, 2, 3 }));
+	CHECK(queue.empty());
+	CHECK_EQ(queue.Drain([&](int&) {}), 0u);
+	// empty again, so the consumer would have to be woken up again
+	CHECK(queue.Push(4));
+}
+
+TEST(ItemsLeftAreDestroyed)
+{
+	auto pItem = std::make_shared<int>(1);
+	{
+		MpscQueue<std::shared_ptr<int>> queue;
+		queue.Push(pItem);
+		queue.Push(pItem);
+		CHECK_EQ(pItem.use_count(), 3);
+	}
+	CHECK_EQ(pItem.use_count(), 1);
+}
+
+TEST(Stress)
+{
+	static const unsigned PRODUCERS = 4;
+	static const unsigned ITEMS = 200000;
+	struct Item
+	{
+		unsigned nProducer, nSequence;
+		// something to free, so that a node lost or freed twice shows up under sanitizers
+		std::unique_ptr<unsigned> pPayload;
+	};
+	MpscQueue<Item> queue;
+	std::atomic<unsigned> nReady = 0;
+	std::atomic<unsigned> nWakeups = 0;
+	std::vector<std::thread> vecProducers;
+	for (unsigned nProducer = 0; nProducer < PRODUCERS; nProducer++) {
+		vecProducers.emplace_back([&, nProducer] {
+			nReady++;
+			while (nReady < PRODUCERS) {
+				std::this_thread::yield();
+			}
+			for (unsigned n = 0; n < ITEMS; n++) {
+				if (queue.Push({ nProducer, n, std::make_unique<unsigned>(n) })) {
+					nWakeups++;
+				}
+			}
+		});
+	}
+
+	// the next sequence number expected from each producer
+	std::vector<unsigned> vecNext(PRODUCERS);
+	size_t nReceived = 0, nDrains = 0, nBad = 0;
+	auto tmGiveUp = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+	while (nReceived < (size_t)PRODUCERS * ITEMS && std::chrono::steady_clock::now() < tmGiveUp) {
+		size_t n = queue.Drain([&](Item& item) {
+			if (item.nProducer >= PRODUCERS || item.nSequence != vecNext[item.nProducer] || *item.pPayload != item.nSequence) {
+				nBad++;
+			} else {
+				vecNext[item.nProducer]++;
+			}
+		});
+		if (n) {
+			nReceived += n;
+			nDrains++;
+		} else {
+			std::this_thread::yield();
+		}
+	}
+	for (std::thread& thread : vecProducers) {
+		thread.join();
+	}
+	CHECK_EQ(nReceived, (size_t)PRODUCERS * ITEMS);
+	CHECK_EQ(nBad, 0u);
+	for (unsigned nNext : vecNext) {
+		CHECK_EQ(nNext, ITEMS);
+	}
+	CHECK(queue.empty());
+	// each non-empty drain found the queue woken up by exactly one push
+	CHECK_EQ((size_t)nWakeups, nDrains);
+}
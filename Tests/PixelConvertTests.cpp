@@ -0,0 +1,147 @@
+// PixelConvertTests.cpp: every SIMD level of PixelConvert against an independent reference,
+// exhaustively for premultiplication, and for every row length around the vector widths
+
+#include "Test.h"
+#include "TestSimd.h"
+
+// c * a / 255 rounded to nearest, which is never a tie since 255 is odd
+static UINT32 Premultiply(UINT32 c, UINT32 a)
+{
+	return (2 * c * a + 255) / 510;
+}
+
+static UINT32 ReferencePixel(PixelSourceFormat format, const BYTE* p, const UINT32* pPalette)
+{
+	UINT32 r, g, b, a = 255;
+	switch (format) {
+	case PSF_GRAY8: r = g = b = p[0]; break;
+	case PSF_INDEXED8: return pPalette[p[0]];
+	case PSF_RGB24: r = p[0]; g = p[1]; b = p[2]; break;
+	case PSF_BGR24: b = p[0]; g = p[1]; r = p[2]; break;
+	case PSF_RGBA32: r = p[0]; g = p[1]; b = p[2]; a = p[3]; break;
+	case PSF_BGRA32: b = p[0]; g = p[1]; r = p[2]; a = p[3]; break;
+	case PSF_BGRX32: b = p[0]; g = p[1]; r = p[2]; break;
+	default: return p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT32)p[3] << 24);
+	}
+	return Premultiply(b, a) | (Premultiply(g, a) << 8) | (Premultiply(r, a) << 16) | (a << 24);
+}
+
+static const PixelSourceFormat ALL_FORMATS[] = { PSF_GRAY8, PSF_INDEXED8, PSF_RGB24, PSF_BGR24, PSF_RGBA32, PSF_BGRA32, PSF_BGRX32, PSF_PBGRA32 };
+
+static std::vector<UINT32> MakePalette()
+{
+	std::vector<UINT32> vecPalette(256);
+	for (UINT32 n = 0; n < 256; n++) {
+		vecPalette[n] = PremultiplyColor((n << 24) | ((255 - n) << 16) | (n * 7 % 256 << 8) | (n ^ 0x5a));
+	}
+	return vecPalette;
+}
+
+// all 256 x 256 combinations of a color component and alpha, with the three components
+// different from each other so that swapped channels show up
+TEST(PremultiplyExhaustive)
+{
+	std::vector<BYTE> vecRgba(256 * 256 * 4), vecBgra(256 * 256 * 4);
+	for (UINT32 a = 0; a < 256; a++) {
+		for (UINT32 c = 0; c < 256; c++) {
+			BYTE* pRgba = &vecRgba[(a * 256 + c) * 4];
+			BYTE* pBgra = &vecBgra[(a * 256 + c) * 4];
+			BYTE r = (BYTE)c, g = (BYTE)(255 - c), b = (BYTE)(c ^ 0xa5);
+			pRgba[0] = r; pRgba[1] = g; pRgba[2] = b; pRgba[3] = (BYTE)a;
+			pBgra[0] = b; pBgra[1] = g; pBgra[2] = r; pBgra[3] = (BYTE)a;
+		}
+	}
+
+	std::vector<UINT32> vecDst(256 * 256);
+	for (SimdLevel level : TestSimdLevels()) {
+		SetSimdLevel(level);
+		CHECK_EQ((int)GetSimdLevel(), (int)level);
+		for (PixelSourceFormat format : { PSF_RGBA32, PSF_BGRA32 }) {
+			const std::vector<BYTE>& vecSrc = format == PSF_RGBA32 ? vecRgba : vecBgra;
+			ConvertToPBGRA(format, vecSrc.data(), vecDst.data(), vecDst.size());
+			unsigned nMismatches = 0;
+			for (size_t n = 0; n < vecDst.size(); n++) {
+				if (vecDst[n] != ReferencePixel(format, &vecSrc[n * 4], nullptr) && !nMismatches++) {
+					TestFail(__FILE__, __LINE__, std::format("level {}, format {}, pixel {}: {:x} != {:x}",
+						(int)level, (int)format, n, vecDst[n], ReferencePixel(format, &vecSrc[n * 4], nullptr)));
+				}
+			}
+			CHECK_EQ(nMismatches, 0u);
+		}
+		// and in place, as decoders do
+		std::vector<BYTE> vecInPlace = vecBgra;
+		ConvertToPBGRA(PSF_BGRA32, vecInPlace.data(), reinterpret_cast<UINT32*>(vecInPlace.data()), 256 * 256);
+		ConvertToPBGRA(PSF_BGRA32, vecBgra.data(), vecDst.data(), vecDst.size());
+		CHECK(memcmp(vecInPlace.data(), vecDst.data(), vecInPlace.size()) == 0);
+	}
+	SetSimdLevel(SIMD_AVX2);
+}
+
+TEST(PremultiplyColor)
+{
+	for (UINT32 a = 0; a < 256; a++) {
+		for (UINT32 c = 0; c < 256; c += 5) {
+			UINT32 nColor = (a << 24) | (c << 16) | ((255 - c) << 8) | (c ^ 0x3c);
+			UINT32 nExpected = (a << 24) | (Premultiply(c, a) << 16) | (Premultiply(255 - c, a) << 8) | Premultiply(c ^ 0x3c, a);
+			if (!CHECK_EQ(PremultiplyColor(nColor), nExpected)) {
+				return;
+			}
+		}
+	}
+}
+
+// every format, for row lengths 0..31 past any multiple of the vector width (and a longer
+// row), starting at every alignment, with source buffers ending right at the row so that
+// reading past them would be caught by sanitizers; pixels past the row must not be written
+TEST(TailLengths)
+{
+	std::vector<UINT32> vecPalette = MakePalette();
+	std::mt19937 random(7);
+	for (SimdLevel level : TestSimdLevels()) {
+		SetSimdLevel(level);
+		for (PixelSourceFormat format : ALL_FORMATS) {
+			unsigned nBytes = PixelSourceBytes(format);
+			for (size_t nBase : { (size_t)0, (size_t)64 }) {
+				for (size_t nTail = 0; nTail < 32; nTail++) {
+					for (size_t nOffset = 0; nOffset < 4; nOffset++) {
+						size_t nPixels = nBase + nTail;
+						std::vector<BYTE> vecSrc(nOffset + nPixels * nBytes);
+						for (BYTE& b : vecSrc) {
+							b = (BYTE)random();
+						}
+						const BYTE* pSrc = vecSrc.data() + nOffset;
+						std::vector<UINT32> vecDst(nOffset + nPixels + 8, 0xdeadbeef);
+						UINT32* pDst = vecDst.data() + nOffset;
+						ConvertToPBGRA(format, pSrc, pDst, nPixels, vecPalette.data());
+						bool bMatch = true;
+						for (size_t n = 0; n < nPixels && bMatch; n++) {
+							bMatch = pDst[n] == ReferencePixel(format, pSrc + n * nBytes, vecPalette.data());
+						}
+						for (size_t n = 0; n < nOffset; n++) {
+							bMatch = bMatch && vecDst[n] == 0xdeadbeef;
+						}
+						for (size_t n = nPixels; n < nPixels + 8; n++) {
+							bMatch = bMatch && pDst[n] == 0xdeadbeef;
+						}
+						if (!bMatch) {
+							TestFail(__FILE__, __LINE__, std::format("level {}, format {}, {} pixels at offset {}",
+								(int)level, (int)format, nPixels, nOffset));
+							SetSimdLevel(SIMD_AVX2);
+							return;
+						}
+					}
+				}
+			}
+		}
+	}
+	SetSimdLevel(SIMD_AVX2);
+}
+
+TEST(SetSimdLevelClampsToSupported)
+{
+	SimdLevel best = TestSimdLevels().back();
+	SetSimdLevel(SIMD_SCALAR);
+	CHECK_EQ((int)GetSimdLevel(), (int)SIMD_SCALAR);
+	SetSimdLevel(SIMD_AVX2);
+	CHECK_EQ((int)GetSimdLevel(), (int)best);
+}
@@ -0,0 +1,301 @@
+// PngDecoderTests.cpp: PngDecoder round trips through PngWriter for every color type, bit depth,
+// filter and kind of DEFLATE block, checked against pixels worked out here; the output of zlib
+// itself; Huffman codes long enough to miss the lookup table; and damaged or unsupported images,
+// which must fail rather than crash
+
+#include "Test.h"
+#include "Inflate.h"
+#include "PngDecoder.h"
+#include "PngWriter.h"
+
+// an image with smooth rows, which filters and matching do well on, and noisy ones, which they don't
+static PngImage MakeImage(unsigned nWidth, unsigned nHeight, BYTE nColorType, BYTE nBitDepth, unsigned nSeed)
+{
+	std::mt19937 random(nSeed);
+	PngImage image;
+	image.nWidth = nWidth;
+	image.nHeight = nHeight;
+	image.nColorType = nColorType;
+	image.nBitDepth = nBitDepth;
+	size_t szRow = image.rowBytes();
+	image.vecRows.resize(szRow * nHeight);
+	for (unsigned y = 0; y < nHeight; y++) {
+		for (size_t n = 0; n < szRow; n++) {
+			image.vecRows[szRow * y + n] = (BYTE)(y % 3 == 2 ? random() : n * 3 + y * 5);
+		}
+	}
+	if (nColorType == 3) {
+		// every index the bit depth allows is in the palette, some of them partly transparent
+		for (unsigned n = 0; n < 1u << nBitDepth; n++) {
+			UINT32 nAlpha = n % 4 ? 0xff : (UINT32)random() & 0xff;
+			image.vecPalette.push_back(nAlpha << 24 | ((UINT32)random() & 0xffffff));
+		}
+	}
+	return image;
+}
+
+// what PngDecoder should make of an image: premultiplied BGRA, samples reduced to 8 bits
+static std::vector<UINT32> ExpectedPixels(const PngImage& image)
+{
+	std::vector<UINT32> vecPixels;
+	size_t szRow = image.rowBytes();
+	unsigned nChannels = image.channels(), nMask = (1u << std::min<unsigned>(image.nBitDepth, 8)) - 1;
+	for (unsigned y = 0; y < image.nHeight; y++) {
+		const BYTE* pRow = image.vecRows.data() + szRow * y;
+		for (unsigned x = 0; x < image.nWidth; x++) {
+			unsigned samples[4];
+			for (unsigned n = 0; n < nChannels; n++) {
+				size_t nSample = (size_t)x * nChannels + n;
+				if (image.nBitDepth == 16) {
+					samples[n] = pRow[nSample * 2];
+				} else {
+					size_t nBit = nSample * image.nBitDepth;
+					samples[n] = (pRow[nBit / 8] >> (8 - image.nBitDepth - nBit % 8)) & nMask;
+				}
+			}
+			UINT32 nColor;
+			switch (image.nColorType) {
+			case 0: {
+				UINT32 nGray = samples[0] * 255 / nMask;
+				nColor = 0xff000000 | nGray << 16 | nGray << 8 | nGray;
+				break;
+			}
+			case 2:
+				nColor = 0xff000000 | samples[0] << 16 | samples[1] << 8 | samples[2];
+				break;
+			case 3:
+				nColor = image.vecPalette[samples[0]];
+				break;
+			case 4:
+				nColor = samples[1] << 24 | samples[0] << 16 | samples[0] << 8 | samples[0];
+				break;
+			default:
+				nColor = samples[3] << 24 | samples[0] << 16 | samples[1] << 8 | samples[2];
+			}
+			vecPixels.push_back(PremultiplyColor(nColor));
+		}
+	}
+	return vecPixels;
+}
+
+static bool Decode(const std::vector<BYTE>& vecPng, DecodedImage& decoded)
+{
+	PngDecoder decoder;
+	return decoder.Decode(vecPng.data(), vecPng.size(), decoded);
+}
+
+static bool DecodesTo(const std::vector<BYTE>& vecPng, const PngImage& image)
+{
+	DecodedImage decoded;
+	if (!Decode(vecPng, decoded) || decoded.nWidth != image.nWidth || decoded.nHeight != image.nHeight) {
+		return false;
+	}
+	std::vector<UINT32> vecExpected = ExpectedPixels(image);
+	return !memcmp(decoded.vecPixels.data(), vecExpected.data(), vecExpected.size() * sizeof(UINT32));
+}
+
+// the image data of a PNG with one IDAT chunk, to be damaged by tests
+static std::pair<size_t, size_t> FindImageData(const std::vector<BYTE>& vecPng)
+{
+	static const BYTE IDAT[4] = { 'I', 'D', 'A', 'T' };
+	auto it = std::search(vecPng.begin(), vecPng.end(), IDAT, IDAT + 4);
+	size_t nPos = it - vecPng.begin();
+	size_t szLength = (size_t)vecPng[nPos - 4] << 24 | (size_t)vecPng[nPos - 3] << 16 | (size_t)vecPng[nPos - 2] << 8 | vecPng[nPos - 1];
+	return { nPos + 4, szLength };
+}
+
+TEST(ColorTypesAndBitDepths)
+{
+	static const struct
+	{
+		BYTE nColorType;
+		std::vector<BYTE> vecBitDepths;
+	} FORMATS[] = {
+		{ 0, { 1, 2, 4, 8, 16 } },
+		{ 2, { 8, 16 } },
+		{ 3, { 1, 2, 4, 8 } },
+		{ 4, { 8, 16 } },
+		{ 6, { 8, 16 } },
+	};
+	unsigned nSeed = 0;
+	for (const auto& format : FORMATS) {
+		for (BYTE nBitDepth : format.vecBitDepths) {
+			// an odd width, so that packed rows end in the middle of a byte
+			PngImage image = MakeImage(37, 11, format.nColorType, nBitDepth, nSeed++);
+			for (int nFilter = PNG_FILTER_BEST; nFilter <= 4; nFilter++) {
+				for (DeflateMode mode : { DEFLATE_STORED, DEFLATE_FIXED, DEFLATE_DYNAMIC }) {
+					if (!DecodesTo(PngWriter::Write(image, nFilter, mode), image)) {
+						TestFail(__FILE__, __LINE__, std::format("color type {}, bit depth {}, filter {}, mode {}",
+							format.nColorType, nBitDepth, nFilter, (int)mode));
+					}
+				}
+			}
+		}
+	}
+}
+
+TEST(TileSized)
+{
+	PngImage image = MakeImage(256, 256, 2, 8, 1);
+	CHECK(DecodesTo(PngWriter::Write(image), image));
+	image = MakeImage(256, 256, 3, 8, 2);
+	CHECK(DecodesTo(PngWriter::Write(image), image));
+	// stored blocks are at most 64 KB, so this takes several
+	image = MakeImage(256, 256, 6, 8, 3);
+	CHECK(DecodesTo(PngWriter::Write(image, 0, DEFLATE_STORED), image));
+}
+
+TEST(SplitImageData)
+{
+	PngImage image = MakeImage(64, 64, 6, 8, 4);
+	for (size_t szChunk : { 1, 7, 100, 4096 }) {
+		CHECK(DecodesTo(PngWriter::Write(image, PNG_FILTER_BEST, DEFLATE_DYNAMIC, szChunk), image));
+	}
+}
+
+TEST(Zlib)
+{
+	// zlib.compress(bytes(((i * i * 4) >> 5) & 0x3f | 0x40 for i in range(1500)), 9), which is
+	// one block of dynamic codes, as zlib makes them
+	static const BYTE ZLIB[] = {
+		0x78, 0xda, 0xed, 0xcf, 0x01, 0xba, 0x01, 0x21, 0x14, 0x40, 0xe1, 0xad, 0x25, 0x83, 0x8b, 0x90,
+		0x84, 0x41, 0xb8, 0x32, 0x08, 0x61, 0x24, 0x84, 0xb0, 0xf5, 0xf7, 0xde, 0x36, 0xde, 0x37, 0xe7,
+		0xac, 0xe0, 0x27, 0x84, 0x94, 0x68, 0x39, 0xa9, 0x42, 0x83, 0x75, 0x44, 0x3f, 0x55, 0x98, 0x99,
+		0x83, 0xbb, 0x47, 0x0a, 0x6d, 0x39, 0xd1, 0xdb, 0x3c, 0x10, 0xe0, 0x23, 0xbd, 0xf7, 0x1f, 0x10,
+		0x6a, 0xe3, 0xde, 0x20, 0xd1, 0x86, 0x8a, 0x98, 0xdb, 0x27, 0x0c, 0xb2, 0x0b, 0xed, 0x62, 0x4e,
+		0x38, 0x9e, 0x69, 0x2f, 0xbb, 0xc1, 0xd8, 0x7e, 0xc5, 0x2a, 0x30, 0xf4, 0x30, 0x75, 0x35, 0xe5,
+		0x60, 0xe6, 0x9b, 0xfa, 0xc1, 0x0d, 0x49, 0xf3, 0xba, 0x7e, 0xc9, 0x23, 0xe8, 0x38, 0x74, 0x2d,
+		0x93, 0x60, 0x4c, 0xaf, 0xe2, 0xc4, 0x76, 0xb0, 0x4e, 0x96, 0x74, 0x41, 0xf0, 0xf7, 0x05, 0x5d,
+		0x26, 0x6b, 0xd8, 0xb1, 0x93, 0xb8, 0xa6, 0x11, 0x13, 0xd3, 0x72, 0xc3, 0xa8, 0xe1, 0x28, 0x5f,
+		0xba, 0x9e, 0xa7, 0xc4, 0xf0, 0x87, 0x6e, 0xfa, 0x19, 0x38, 0x55, 0x73, 0x53, 0xf0, 0xc8, 0xc2,
+		0x4a, 0x7c, 0xed, 0x18, 0x6e, 0x59, 0x8f, 0x9e, 0x91, 0x93, 0x1c, 0xbb, 0xf4, 0x92, 0x0d, 0xe0,
+		0x69, 0xe7, 0xa2, 0x12, 0x2c, 0x4a, 0x78, 0xbb, 0x8d, 0x12, 0xf0, 0xf1, 0x7b, 0x3d, 0xe2, 0x40,
+		0x42, 0xbe, 0xd5, 0x13, 0xd9, 0x06, 0x1a, 0xef, 0xee, 0x60, 0x32, 0x54, 0x69, 0x5f, 0x74, 0x58,
+		0x03, 0xaa, 0x49, 0x99, 0x96, 0xc8, 0x5f, 0x85, 0xbf, 0xf0, 0x17, 0xfe, 0xc2, 0xff, 0xef, 0xfc,
+		0x3f, 0x4a, 0x81, 0x1b, 0xfc,
+	};
+	std::vector<BYTE> vecOut(1500);
+	REQUIRE(ZlibInflate(ZLIB, sizeof(ZLIB), vecOut.data(), vecOut.size()));
+	for (size_t n = 0; n < vecOut.size(); n++) {
+		REQUIRE(vecOut[n] == ((((n * n * 4) >> 5) & 0x3f) | 0x40));
+	}
+	// the size must be exactly right
+	CHECK(!ZlibInflate(ZLIB, sizeof(ZLIB), vecOut.data(), vecOut.size() - 1));
+	vecOut.resize(1501);
+	CHECK(!ZlibInflate(ZLIB, sizeof(ZLIB), vecOut.data(), vecOut.size()));
+}
+
+TEST(LongCodes)
+{
+	// literals only, byte n twice as often as byte n - 1: the optimal code would have codes up to
+	// 18 bits, so the encoder limits it to 15, and the rarest are too long for the lookup table
+	std::vector<BYTE> vecData;
+	for (unsigned n = 0; n < 18; n++) {
+		vecData.insert(vecData.end(), (size_t)1 << n, (BYTE)n);
+	}
+	std::shuffle(vecData.begin(), vecData.end(), std::mt19937(5));
+	std::vector<BYTE> vecZlib = PngWriter::ZlibCompress(vecData.data(), vecData.size(), DEFLATE_DYNAMIC, false);
+	// about 2 bits a byte, i. e. the code does fit the counts
+	CHECK(vecZlib.size() < vecData.size() / 3);
+	std::vector<BYTE> vecOut(vecData.size());
+	REQUIRE(ZlibInflate(vecZlib.data(), vecZlib.size(), vecOut.data(), vecOut.size()));
+	CHECK(vecOut == vecData);
+}
+
+TEST(DamagedImageData)
+{
+	PngImage image = MakeImage(32, 32, 2, 8, 6);
+	std::vector<BYTE> vecFiltered = PngWriter::Filter(image, PNG_FILTER_BEST);
+	std::vector<BYTE> vecOut(vecFiltered.size());
+	for (DeflateMode mode : { DEFLATE_STORED, DEFLATE_FIXED, DEFLATE_DYNAMIC }) {
+		std::vector<BYTE> vecZlib = PngWriter::ZlibCompress(vecFiltered.data(), vecFiltered.size(), mode);
+		REQUIRE(ZlibInflate(vecZlib.data(), vecZlib.size(), vecOut.data(), vecOut.size()));
+		// cut short anywhere
+		for (size_t szLength = 0; szLength < vecZlib.size(); szLength++) {
+			CHECK(!ZlibInflate(vecZlib.data(), szLength, vecOut.data(), vecOut.size()));
+		}
+		// the checksum wrong
+		std::vector<BYTE> vecDamaged = vecZlib;
+		vecDamaged.back() ^= 1;
+		CHECK(!ZlibInflate(vecDamaged.data(), vecDamaged.size(), vecOut.data(), vecOut.size()));
+		// a bit flipped anywhere: whatever it decodes to, the checksum doesn't match it, unless it
+		// is the same after all (a match with another distance, but the same bytes there)
+		for (size_t n = 2; n < vecZlib.size(); n++) {
+			vecDamaged = vecZlib;
+			vecDamaged[n] ^= 1 << (n % 8);
+			CHECK(!ZlibInflate(vecDamaged.data(), vecDamaged.size(), vecOut.data(), vecOut.size()) || vecOut == vecFiltered);
+		}
+	}
+	// not a zlib header
+	std::vector<BYTE> vecZlib = PngWriter::ZlibCompress(vecFiltered.data(), vecFiltered.size());
+	vecZlib[0] = 0x79;
+	CHECK(!ZlibInflate(vecZlib.data(), vecZlib.size(), vecOut.data(), vecOut.size()));
+}
+
+TEST(DamagedImages)
+{
+	PngImage image = MakeImage(16, 16, 6, 8, 7);
+	std::vector<BYTE> vecPng = PngWriter::Write(image, 0, DEFLATE_STORED);
+	DecodedImage decoded;
+	REQUIRE(Decode(vecPng, decoded));
+
+	for (size_t szLength = 0; szLength < vecPng.size(); szLength++) {
+		CHECK(!Decode(std::vector<BYTE>(vecPng.begin(), vecPng.begin() + szLength), decoded));
+	}
+
+	std::vector<BYTE> vecDamaged = vecPng;
+	vecDamaged[1] = 'J';
+	CHECK(!Decode(vecDamaged, decoded));
+
+	// a filter which doesn't exist, with the checksum made to match
+	vecDamaged = vecPng;
+	auto [nData, szData] = FindImageData(vecDamaged);
+	// zlib header, then the header of the one stored block
+	BYTE* pRows = vecDamaged.data() + nData + 2 + 5;
+	size_t szRows = szData - 2 - 5 - 4;
+	pRows[0] = 5;
+	uint32_t nAdler = PngWriter::Adler32(pRows, szRows);
+	for (int n = 0; n < 4; n++) {
+		pRows[szRows + n] = (BYTE)(nAdler >> (24 - n * 8));
+	}
+	CHECK(!Decode(vecDamaged, decoded));
+	pRows[0] = 0;
+	nAdler = PngWriter::Adler32(pRows, szRows);
+	for (int n = 0; n < 4; n++) {
+		pRows[szRows + n] = (BYTE)(nAdler >> (24 - n * 8));
+	}
+	CHECK(Decode(vecDamaged, decoded));
+}
+
+TEST(Unsupported)
+{
+	PngImage image = MakeImage(16, 16, 2, 8, 8);
+	std::vector<BYTE> vecPng = PngWriter::Write(image);
+	DecodedImage decoded;
+	REQUIRE(Decode(vecPng, decoded));
+
+	// interlaced: the last byte of IHDR (chunk CRCs aren't checked)
+	std::vector<BYTE> vecDamaged = vecPng;
+	vecDamaged[8 + 8 + 12] = 1;
+	CHECK(!Decode(vecDamaged, decoded));
+
+	// a bit depth RGB can't have
+	vecDamaged = vecPng;
+	vecDamaged[8 + 8 + 8] = 4;
+	CHECK(!Decode(vecDamaged, decoded));
+
+	// too large
+	vecDamaged = vecPng;
+	vecDamaged[8 + 8 + 1] = 0x01;
+	CHECK(!Decode(vecDamaged, decoded));
+
+	// a critical chunk before IEND which the decoder doesn't know; an ancillary one is skipped
+	static const BYTE CRITICAL[12] = { 0, 0, 0, 0, 'Q', 'U', 'U', 'X', 0, 0, 0, 0 };
+	vecDamaged = vecPng;
+	vecDamaged.insert(vecDamaged.end() - 12, CRITICAL, CRITICAL + 12);
+	CHECK(!Decode(vecDamaged, decoded));
+	vecDamaged = vecPng;
+	vecDamaged.insert(vecDamaged.end() - 12, CRITICAL, CRITICAL + 12);
+	vecDamaged[vecDamaged.size() - 24 + 4] = 'q';
+	CHECK(Decode(vecDamaged, decoded));
+}
@@ -0,0 +1,470 @@
+#pragma once
+
+// PngWriter.h: encoding of PNG images, the reverse of PngDecoder.cpp, for making images in tests
+// and benchmarks.  Any color type and bit depth, rows filtered with a given filter or with the
+// one which suits each row best, as encoders usually pick them.  Compressed with greedy
+// matching into one DEFLATE block, with dynamic codes as real encoders mostly do, or with the
+// fixed codes; or stored
+
+// image to write: rows of samples as PNG has them (packed to a byte below 8 bits per sample,
+// most significant byte first for 16), without filter bytes
+struct PngImage
+{
+	unsigned nWidth = 0, nHeight = 0;
+	BYTE nBitDepth = 8;
+	// 0 gray, 2 RGB, 3 palette, 4 gray and alpha, 6 RGBA
+	BYTE nColorType = 2;
+	std::vector<BYTE> vecRows;
+	// for palette images, straight 0xAARRGGBB; some alpha below 0xff gets a tRNS chunk written
+	std::vector<UINT32> vecPalette;
+
+	unsigned channels() const
+	{
+		static const unsigned CHANNELS[7] = { 1, 0, 3, 1, 2, 0, 4 };
+		return CHANNELS[nColorType];
+	}
+	size_t rowBytes() const { return ((size_t)nWidth * channels() * nBitDepth + 7) / 8; }
+	// bytes per pixel, as filters see it
+	unsigned bpp() const { return std::max(channels() * nBitDepth / 8, 1u); }
+};
+
+// filter for all rows, or PNG_FILTER_BEST to pick one for each
+static const int PNG_FILTER_BEST = -1;
+
+enum DeflateMode
+{
+	DEFLATE_STORED,
+	DEFLATE_FIXED,
+	DEFLATE_DYNAMIC
+};
+
+class PngWriter
+{
+public:
+	// encodes an image; szChunk splits the image data into IDAT chunks of at most that size
+	static std::vector<BYTE> Write(const PngImage& image, int nFilter = PNG_FILTER_BEST, DeflateMode mode = DEFLATE_DYNAMIC, size_t szChunk = 0)
+	{
+		std::vector<BYTE> vecPng = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+		std::vector<BYTE> vecHeader;
+		AppendBigEndian32(vecHeader, image.nWidth);
+		AppendBigEndian32(vecHeader, image.nHeight);
+		vecHeader.insert(vecHeader.end(), { image.nBitDepth, image.nColorType, 0, 0, 0 });
+		AppendChunk(vecPng, "IHDR", vecHeader);
+		if (!image.vecPalette.empty()) {
+			std::vector<BYTE> vecPalette, vecAlpha;
+			for (UINT32 nColor : image.vecPalette) {
+				vecPalette.insert(vecPalette.end(), { (BYTE)(nColor >> 16), (BYTE)(nColor >> 8), (BYTE)nColor });
+				vecAlpha.push_back((BYTE)(nColor >> 24));
+			}
+			AppendChunk(vecPng, "PLTE", vecPalette);
+			if (std::any_of(vecAlpha.begin(), vecAlpha.end(), [](BYTE nAlpha) { return nAlpha != 0xff; })) {
+				AppendChunk(vecPng, "tRNS", vecAlpha);
+			}
+		}
+		// a chunk the decoder doesn't know, but may skip
+		AppendChunk(vecPng, "tEXt", { 'C', 'o', 'm', 'm', 'e', 'n', 't', 0, 't', 'e', 's', 't' });
+
+		std::vector<BYTE> vecFiltered = Filter(image, nFilter);
+		std::vector<BYTE> vecData = ZlibCompress(vecFiltered.data(), vecFiltered.size(), mode);
+		if (!szChunk) {
+			szChunk = vecData.size();
+		}
+		for (size_t n = 0; n < vecData.size(); n += szChunk) {
+			AppendChunk(vecPng, "IDAT", std::vector<BYTE>(vecData.begin() + n, vecData.begin() + std::min(n + szChunk, vecData.size())));
+		}
+		AppendChunk(vecPng, "IEND", {});
+		return vecPng;
+	}
+
+	// rows with a filter byte each, filtered
+	static std::vector<BYTE> Filter(const PngImage& image, int nFilter)
+	{
+		size_t szRow = image.rowBytes();
+		unsigned nBpp = image.bpp();
+		std::vector<BYTE> vecZeros(szRow), vecFiltered, vecRow(szRow + 1);
+		for (unsigned y = 0; y < image.nHeight; y++) {
+			const BYTE* pRow = image.vecRows.data() + szRow * y;
+			const BYTE* pAbove = y ? pRow - szRow : vecZeros.data();
+			int nBest = nFilter;
+			if (nFilter == PNG_FILTER_BEST) {
+				// the one with the smallest sum of differences, as signed bytes
+				unsigned long long nBestSum = ~0ull;
+				for (int nTry = 0; nTry <= 4; nTry++) {
+					FilterRow(pRow, pAbove, szRow, nBpp, nTry, vecRow.data());
+					unsigned long long nSum = 0;
+					for (size_t n = 1; n <= szRow; n++) {
+						nSum += std::abs((int)(signed char)vecRow[n]);
+					}
+					if (nSum < nBestSum) {
+						nBestSum = nSum;
+						nBest = nTry;
+					}
+				}
+			}
+			FilterRow(pRow, pAbove, szRow, nBpp, nBest, vecRow.data());
+			vecFiltered.insert(vecFiltered.end(), vecRow.begin(), vecRow.end());
+		}
+		return vecFiltered;
+	}
+
+	// a zlib stream, one compressed block or as many stored ones as it takes.  bMatch = false
+	// leaves out matches, so that it's all literals: with dynamic codes, skewed data then gets
+	// long codes
+	static std::vector<BYTE> ZlibCompress(const BYTE* pData, size_t szLength, DeflateMode mode = DEFLATE_DYNAMIC, bool bMatch = true)
+	{
+		std::vector<BYTE> vecOut = { 0x78, 0x01 };
+		if (mode == DEFLATE_STORED) {
+			size_t nPos = 0;
+			do {
+				size_t szBlock = std::min<size_t>(szLength - nPos, 65535);
+				vecOut.push_back(nPos + szBlock == szLength ? 1 : 0);
+				vecOut.insert(vecOut.end(), { (BYTE)szBlock, (BYTE)(szBlock >> 8), (BYTE)~szBlock, (BYTE)(~szBlock >> 8) });
+				vecOut.insert(vecOut.end(), pData + nPos, pData + nPos + szBlock);
+				nPos += szBlock;
+			} while (nPos < szLength);
+		} else {
+			std::vector<Token> vecTokens = Match(pData, szLength, bMatch);
+			std::vector<BYTE> vecLiteralLengths(286), vecDistanceLengths(30);
+			BitWriter writer(vecOut);
+			writer.Put(1, 1);
+			if (mode == DEFLATE_FIXED) {
+				writer.Put(1, 2);
+				// all 288 of them, even if 286 and 287 are never used, or the 9 bit codes come out wrong
+				vecLiteralLengths.resize(288);
+				std::fill(vecLiteralLengths.begin(), vecLiteralLengths.begin() + 144, (BYTE)8);
+				std::fill(vecLiteralLengths.begin() + 144, vecLiteralLengths.begin() + 256, (BYTE)9);
+				std::fill(vecLiteralLengths.begin() + 256, vecLiteralLengths.begin() + 280, (BYTE)7);
+				std::fill(vecLiteralLengths.begin() + 280, vecLiteralLengths.end(), (BYTE)8);
+				std::fill(vecDistanceLengths.begin(), vecDistanceLengths.end(), (BYTE)5);
+			} else {
+				writer.Put(2, 2);
+				std::vector<unsigned> vecLiteralCounts(286), vecDistanceCounts(30);
+				for (const Token& token : vecTokens) {
+					vecLiteralCounts[token.nSymbol]++;
+					if (token.nSymbol > 256) {
+						vecDistanceCounts[token.nDistanceSymbol]++;
+					}
+				}
+				vecLiteralLengths = CodeLengths(vecLiteralCounts, 15);
+				vecDistanceLengths = CodeLengths(vecDistanceCounts, 15);
+				WriteCodeLengths(writer, vecLiteralLengths, vecDistanceLengths);
+			}
+			std::vector<unsigned> vecLiteralCodes = Codes(vecLiteralLengths), vecDistanceCodes = Codes(vecDistanceLengths);
+			for (const Token& token : vecTokens) {
+				writer.PutCode(vecLiteralCodes[token.nSymbol], vecLiteralLengths[token.nSymbol]);
+				if (token.nSymbol > 256) {
+					writer.Put(token.nLengthExtra, LENGTH_EXTRA[token.nSymbol - 257]);
+					writer.PutCode(vecDistanceCodes[token.nDistanceSymbol], vecDistanceLengths[token.nDistanceSymbol]);
+					writer.Put(token.nDistanceExtra, DISTANCE_EXTRA[token.nDistanceSymbol]);
+				}
+			}
+			writer.Flush();
+		}
+		AppendBigEndian32(vecOut, Adler32(pData, szLength));
+		return vecOut;
+	}
+
+	static uint32_t Adler32(const BYTE* p, size_t sz)
+	{
+		uint32_t a = 1, b = 0;
+		for (size_t n = 0; n < sz; n++) {
+			a = (a + p[n]) % 65521;
+			b = (b + a) % 65521;
+		}
+		return b << 16 | a;
+	}
+
+	static uint32_t Crc32(const BYTE* p, size_t sz)
+	{
+		uint32_t nCrc = 0xffffffff;
+		for (size_t n = 0; n < sz; n++) {
+			nCrc ^= p[n];
+			for (int nBit = 0; nBit < 8; nBit++) {
+				nCrc = nCrc >> 1 ^ (0xedb88320 & (0 - (nCrc & 1)));
+			}
+		}
+		return ~nCrc;
+	}
+
+private:
+	static constexpr unsigned LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	static constexpr unsigned LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	static constexpr unsigned DISTANCE_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+	static constexpr unsigned DISTANCE_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+	static constexpr BYTE CODE_LENGTH_ORDER[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+	// a literal (below 256), the end of the block (256), or a match with its length and distance
+	// codes and their extra bits
+	struct Token
+	{
+		unsigned nSymbol, nLengthExtra;
+		unsigned nDistanceSymbol, nDistanceExtra;
+	};
+
+	// DEFLATE output, the first bit lowest
+	class BitWriter
+	{
+	public:
+		explicit BitWriter(std::vector<BYTE>& vecOut) : m_vecOut(vecOut) {}
+
+		void Put(unsigned nValue, unsigned nBits)
+		{
+			m_nBuffer |= (uint64_t)nValue << m_nBits;
+			m_nBits += nBits;
+			while (m_nBits >= 8) {
+				m_vecOut.push_back((BYTE)m_nBuffer);
+				m_nBuffer >>= 8;
+				m_nBits -= 8;
+			}
+		}
+
+		// Huffman codes go most significant bit first
+		void PutCode(unsigned nCode, unsigned nBits)
+		{
+			unsigned nReversed = 0;
+			for (unsigned n = 0; n < nBits; n++) {
+				nReversed |= ((nCode >> n) & 1) << (nBits - 1 - n);
+			}
+			Put(nReversed, nBits);
+		}
+
+		void Flush()
+		{
+			if (m_nBits) {
+				Put(0, 8 - m_nBits);
+			}
+		}
+
+	private:
+		std::vector<BYTE>& m_vecOut;
+		uint64_t m_nBuffer = 0;
+		unsigned m_nBits = 0;
+	};
+
+	// greedy matching, the longest of the last few places the next 3 bytes were seen at
+	static std::vector<Token> Match(const BYTE* pData, size_t szLength, bool bMatch)
+	{
+		static const size_t WINDOW = 32768, MAX_CHAIN = 32;
+		std::vector<Token> vecTokens;
+		std::vector<int> vecHead(1 << 15, -1), vecPrevious(WINDOW, -1);
+		auto hash = [&](size_t n) { return ((pData[n] << 10) ^ (pData[n + 1] << 5) ^ pData[n + 2]) & 0x7fff; };
+		auto insert = [&](size_t n) {
+			if (n + 3 <= szLength) {
+				unsigned nHash = hash(n);
+				vecPrevious[n % WINDOW] = vecHead[nHash];
+				vecHead[nHash] = (int)n;
+			}
+		};
+		for (size_t n = 0; n < szLength; ) {
+			size_t nBestLength = 0, nBestDistance = 0;
+			if (bMatch && n + 3 <= szLength) {
+				int nCandidate = vecHead[hash(n)];
+				for (size_t nChain = 0; nCandidate >= 0 && n - nCandidate <= WINDOW - 1 && nChain < MAX_CHAIN; nChain++) {
+					size_t nLength = 0;
+					while (nLength < 258 && n + nLength < szLength && pData[nCandidate + nLength] == pData[n + nLength]) {
+						nLength++;
+					}
+					if (nLength > nBestLength) {
+						nBestLength = nLength;
+						nBestDistance = n - nCandidate;
+					}
+					int nNext = vecPrevious[nCandidate % WINDOW];
+					if (nNext >= nCandidate) {
+						break;
+					}
+					nCandidate = nNext;
+				}
+			}
+			if (nBestLength < 3) {
+				vecTokens.push_back({ pData[n], 0, 0, 0 });
+				insert(n);
+				n++;
+				continue;
+			}
+			unsigned nLength = 28, nDistance = 29;
+			while (LENGTH_BASE[nLength] > nBestLength) {
+				nLength--;
+			}
+			while (DISTANCE_BASE[nDistance] > nBestDistance) {
+				nDistance--;
+			}
+			vecTokens.push_back({ 257 + nLength, (unsigned)nBestLength - LENGTH_BASE[nLength], nDistance, (unsigned)nBestDistance - DISTANCE_BASE[nDistance] });
+			for (size_t nEnd = n + nBestLength; n < nEnd; n++) {
+				insert(n);
+			}
+		}
+		vecTokens.push_back({ 256, 0, 0, 0 });
+		return vecTokens;
+	}
+
+	// Huffman code lengths for symbol counts, none longer than nMaxBits: where the optimal code
+	// has longer ones, the counts are halved until it doesn't.  There are always at least two
+	// codes, so that the code is complete
+	static std::vector<BYTE> CodeLengths(std::vector<unsigned> vecCounts, unsigned nMaxBits)
+	{
+		for (size_t n = 0; std::count_if(vecCounts.begin(), vecCounts.end(), [](unsigned nCount) { return nCount != 0; }) < 2; n++) {
+			vecCounts[n] = std::max(vecCounts[n], 1u);
+		}
+		while (true) {
+			// leaves first, then the nodes joining them; the two lightest of those not yet joined
+			// are joined until there's one left, the root
+			std::vector<unsigned long long> vecWeights(vecCounts.begin(), vecCounts.end());
+			std::vector<size_t> vecParents(vecCounts.size(), SIZE_MAX), vecOpen;
+			for (size_t n = 0; n < vecCounts.size(); n++) {
+				if (vecCounts[n]) {
+					vecOpen.push_back(n);
+				}
+			}
+			while (vecOpen.size() > 1) {
+				size_t nNode = vecWeights.size();
+				vecWeights.push_back(0);
+				vecParents.push_back(SIZE_MAX);
+				for (int nChild = 0; nChild < 2; nChild++) {
+					auto it = std::min_element(vecOpen.begin(), vecOpen.end(), [&](size_t n1, size_t n2) { return vecWeights[n1] < vecWeights[n2]; });
+					vecParents[*it] = nNode;
+					vecWeights[nNode] += vecWeights[*it];
+					vecOpen.erase(it);
+				}
+				vecOpen.push_back(nNode);
+			}
+			std::vector<BYTE> vecLengths(vecCounts.size());
+			bool bFits = true;
+			for (size_t n = 0; n < vecCounts.size(); n++) {
+				if (vecCounts[n]) {
+					unsigned nDepth = 0;
+					for (size_t nNode = n; vecParents[nNode] != SIZE_MAX; nNode = vecParents[nNode]) {
+						nDepth++;
+					}
+					vecLengths[n] = (BYTE)nDepth;
+					bFits = bFits && nDepth <= nMaxBits;
+				}
+			}
+			if (bFits) {
+				return vecLengths;
+			}
+			for (unsigned& nCount : vecCounts) {
+				nCount = (nCount + 1) / 2;
+			}
+		}
+	}
+
+	// canonical codes for code lengths, as RFC 1951 assigns them
+	static std::vector<unsigned> Codes(const std::vector<BYTE>& vecLengths)
+	{
+		unsigned counts[16] = {}, next[16] = {};
+		for (BYTE nLength : vecLengths) {
+			counts[nLength]++;
+		}
+		counts[0] = 0;
+		for (unsigned nBits = 1, nCode = 0; nBits < 16; nBits++) {
+			nCode = (nCode + counts[nBits - 1]) << 1;
+			next[nBits] = nCode;
+		}
+		std::vector<unsigned> vecCodes(vecLengths.size());
+		for (size_t n = 0; n < vecLengths.size(); n++) {
+			if (vecLengths[n]) {
+				vecCodes[n] = next[vecLengths[n]]++;
+			}
+		}
+		return vecCodes;
+	}
+
+	// the header of a dynamic block: the code lengths, with runs shortened, in a code of their own
+	static void WriteCodeLengths(BitWriter& writer, const std::vector<BYTE>& vecLiteralLengths, const std::vector<BYTE>& vecDistanceLengths)
+	{
+		size_t nLiterals = vecLiteralLengths.size(), nDistances = vecDistanceLengths.size();
+		while (nLiterals > 257 && !vecLiteralLengths[nLiterals - 1]) {
+			nLiterals--;
+		}
+		while (nDistances > 1 && !vecDistanceLengths[nDistances - 1]) {
+			nDistances--;
+		}
+		std::vector<BYTE> vecLengths(vecLiteralLengths.begin(), vecLiteralLengths.begin() + nLiterals);
+		vecLengths.insert(vecLengths.end(), vecDistanceLengths.begin(), vecDistanceLengths.begin() + nDistances);
+		// (symbol, its extra bits): 16 repeats the previous length, 17 and 18 are runs of zeros
+		std::vector<std::pair<unsigned, unsigned>> vecSymbols;
+		for (size_t n = 0; n < vecLengths.size(); ) {
+			size_t nRun = 1;
+			while (n + nRun < vecLengths.size() && vecLengths[n + nRun] == vecLengths[n]) {
+				nRun++;
+			}
+			if (!vecLengths[n] && nRun >= 11) {
+				nRun = std::min<size_t>(nRun, 138);
+				vecSymbols.push_back({ 18, (unsigned)nRun - 11 });
+			} else if (!vecLengths[n] && nRun >= 3) {
+				vecSymbols.push_back({ 17, (unsigned)nRun - 3 });
+			} else if (n && vecLengths[n] == vecLengths[n - 1] && nRun >= 3) {
+				nRun = std::min<size_t>(nRun, 6);
+				vecSymbols.push_back({ 16, (unsigned)nRun - 3 });
+			} else {
+				nRun = 1;
+				vecSymbols.push_back({ vecLengths[n], 0 });
+			}
+			n += nRun;
+		}
+		std::vector<unsigned> vecCounts(19);
+		for (const auto& symbol : vecSymbols) {
+			vecCounts[symbol.first]++;
+		}
+		std::vector<BYTE> vecCodeLengths = CodeLengths(vecCounts, 7);
+		std::vector<unsigned> vecCodes = Codes(vecCodeLengths);
+		unsigned nCodeLengths = 19;
+		while (nCodeLengths > 4 && !vecCodeLengths[CODE_LENGTH_ORDER[nCodeLengths - 1]]) {
+			nCodeLengths--;
+		}
+
+		writer.Put((unsigned)nLiterals - 257, 5);
+		writer.Put((unsigned)nDistances - 1, 5);
+		writer.Put(nCodeLengths - 4, 4);
+		for (unsigned n = 0; n < nCodeLengths; n++) {
+			writer.Put(vecCodeLengths[CODE_LENGTH_ORDER[n]], 3);
+		}
+		static const unsigned EXTRA_BITS[3] = { 2, 3, 7 };
+		for (const auto& symbol : vecSymbols) {
+			writer.PutCode(vecCodes[symbol.first], vecCodeLengths[symbol.first]);
+			if (symbol.first >= 16) {
+				writer.Put(symbol.second, EXTRA_BITS[symbol.first - 16]);
+			}
+		}
+	}
+
+	static void FilterRow(const BYTE* pRow, const BYTE* pAbove, size_t szRow, unsigned nBpp, int nFilter, BYTE* pOut)
+	{
+		pOut[0] = (BYTE)nFilter;
+		for (size_t n = 0; n < szRow; n++) {
+			int a = n >= nBpp ? pRow[n - nBpp] : 0, b = pAbove[n], c = n >= nBpp ? pAbove[n - nBpp] : 0;
+			int nPredicted = 0;
+			switch (nFilter) {
+			case 1:
+				nPredicted = a;
+				break;
+			case 2:
+				nPredicted = b;
+				break;
+			case 3:
+				nPredicted = (a + b) / 2;
+				break;
+			case 4: {
+				int pa = std::abs(b - c), pb = std::abs(a - c), pc = std::abs(a + b - 2 * c);
+				nPredicted = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+				break;
+			}
+			}
+			pOut[n + 1] = (BYTE)(pRow[n] - nPredicted);
+		}
+	}
+
+	static void AppendBigEndian32(std::vector<BYTE>& vec, uint32_t n)
+	{
+		vec.insert(vec.end(), { (BYTE)(n >> 24), (BYTE)(n >> 16), (BYTE)(n >> 8), (BYTE)n });
+	}
+
+	static void AppendChunk(std::vector<BYTE>& vecPng, const char* pszType, const std::vector<BYTE>& vecData)
+	{
+		AppendBigEndian32(vecPng, (uint32_t)vecData.size());
+		size_t nStart = vecPng.size();
+		vecPng.insert(vecPng.end(), pszType, pszType + 4);
+		vecPng.insert(vecPng.end(), vecData.begin(), vecData.end());
+		AppendBigEndian32(vecPng, Crc32(vecPng.data() + nStart, vecPng.size() - nStart));
+	}
+};
@@ -0,0 +1,170 @@
+// ProjectionTests.cpp: Web Mercator projection against reference values, and batch versions
+// at every SIMD level against the scalar functions
+
+#include "Test.h"
+#include "TestSimd.h"
+#include "Projection.h"
+
+// the textbook formula, y = ln(tan(pi/4 + lat/2)), in long double
+static MercatorPoint ReferenceMercator(double dLat, double dLng)
+{
+	long double latRad = std::clamp(dLat, -MERCATOR_MAX_LATITUDE, MERCATOR_MAX_LATITUDE) * (std::numbers::pi_v<long double> / 180);
+	long double y = std::log(std::tan(std::numbers::pi_v<long double> / 4 + latRad / 2));
+	return { (double)(dLng / 360.0L + 0.5L), (double)(0.5L - y / (2 * std::numbers::pi_v<long double>)) };
+}
+
+static bool Near(double a, double b, double dTolerance)
+{
+	return std::fabs(a - b) <= dTolerance;
+}
+
+TEST(ReferenceValues)
+{
+	MercatorPoint pt = LatLngToMercator(0.0, 0.0);
+	CHECK_EQ(pt.x, 0.5);
+	CHECK_EQ(pt.y, 0.5);
+	// the map is square: the max latitude is the top edge
+	pt = LatLngToMercator(MERCATOR_MAX_LATITUDE, 180.0);
+	CHECK_EQ(pt.x, 1.0);
+	CHECK(Near(pt.y, 0.0, 1e-15));
+	pt = LatLngToMercator(-MERCATOR_MAX_LATITUDE, -180.0);
+	CHECK_EQ(pt.x, 0.0);
+	CHECK(Near(pt.y, 1.0, 1e-15));
+	// and anything beyond it is clamped
+	pt = LatLngToMercator(90.0, 0.0);
+	CHECK(Near(pt.y, 0.0, 1e-15));
+
+	const double places[][2] = { { 51.5074, -0.1278 }, { 40.7128, -74.0060 }, { -33.8688, 151.2093 }, { 64.1466, -21.9426 },
+		{ -54.8019, -68.3030 }, { 1e-9, 1e-9 }, { 85.0, 179.999 } };
+	for (const auto& place : places) {
+		MercatorPoint ptReference = ReferenceMercator(place[0], place[1]);
+		pt = LatLngToMercator(place[0], place[1]);
+		CHECK(Near(pt.x, ptReference.x, 1e-15));
+		CHECK(Near(pt.y, ptReference.y, 1e-15));
+		double dLat, dLng;
+		MercatorToLatLng(pt, dLat, dLng);
+		CHECK(Near(dLat, place[0], 1e-12));
+		CHECK(Near(dLng, place[1], 1e-12));
+	}
+}
+
+TEST(Tiles)
+{
+	CHECK_EQ(WorldSize(0, 256), 256.0);
+	CHECK_EQ(WorldSize(18, 256), 256.0 * (1 << 18));
+	// London at zoom 10, as on openstreetmap.org
+	TileCoords coords = MercatorToTile(LatLngToMercator(51.5074, -0.1278), 10);
+	CHECK_EQ(coords.x, 511u);
+	CHECK_EQ(coords.y, 340u);
+	CHECK_EQ(coords.zoom, 10u);
+	// clamped to the map
+	coords = MercatorToTile({ 1.0, -0.5 }, 3);
+	CHECK_EQ(coords.x, 7u);
+	CHECK_EQ(coords.y, 0u);
+	MercatorPoint pt = TileToMercator(TileCoords(3, 5, 3));
+	CHECK_EQ(pt.x, 3.0 / 8);
+	CHECK_EQ(pt.y, 5.0 / 8);
+	// a tile's corner is in that tile
+	coords = MercatorToTile(pt, 3);
+	CHECK_EQ(coords.x, 3u);
+	CHECK_EQ(coords.y, 5u);
+}
+
+TEST(View)
+{
+	// 800x600 in the middle of a 1024x1024 world
+	MapView view = CalculateView({ 0.5, 0.5 }, 2, 256, 800, 600);
+	CHECK_EQ(view.dTopLeftX, 112.0);
+	CHECK_EQ(view.dTopLeftY, 212.0);
+	CHECK_EQ(view.rect.left, 112.0 / 1024);
+	CHECK_EQ(view.rect.bottom, 812.0 / 1024);
+	CHECK_EQ(view.nTopLeftX, 0u);
+	CHECK_EQ(view.nTopLeftY, 0u);
+	CHECK_EQ(view.nWidthInTiles, 4u);
+	CHECK_EQ(view.nHeightInTiles, 3u);
+	view = CalculateView({ 0.75, 0.25 }, 4, 256, 1000, 400);
+	CHECK_EQ(view.nTopLeftX, 10u);
+	CHECK_EQ(view.nTopLeftY, 3u);
+	// the window is larger than the world, tiles start from the edge
+	view = CalculateView({ 0.5, 0.5 }, 0, 256, 1000, 1000);
+	CHECK_EQ(view.dTopLeftX, -372.0);
+	CHECK_EQ(view.nTopLeftX, 0u);
+	CHECK_EQ(view.nTopLeftY, 0u);
+	CHECK_EQ(view.nWidthInTiles, 4u);
+}
+
+// edge cases first, then random points all over the map and beyond it
+static void MakePoints(size_t nPoints, std::vector<double>& vecLat, std::vector<double>& vecLng)
+{
+	std::mt19937_64 random(13);
+	std::uniform_real_distribution<double> lat(-89.9, 89.9), lng(-180.0, 180.0);
+	vecLat.clear();
+	vecLng.clear();
+	for (double dLat : { 0.0, -0.0, 1e-12, -1e-12, MERCATOR_MAX_LATITUDE, -MERCATOR_MAX_LATITUDE, 90.0, -90.0, 45.0, 85.0 }) {
+		vecLat.push_back(dLat);
+		vecLng.push_back(-dLat * 2);
+	}
+	while (vecLat.size() < nPoints) {
+		vecLat.push_back(lat(random));
+		vecLng.push_back(lng(random));
+	}
+	vecLat.resize(nPoints);
+	vecLng.resize(nPoints);
+}
+
+TEST(LatLngBatchMatchesScalar)
+{
+	std::vector<double> vecLat, vecLng;
+	MakePoints(100000, vecLat, vecLng);
+	std::vector<MercatorPoint> vecPoints(vecLat.size());
+	for (SimdLevel level : TestSimdLevels()) {
+		SetSimdLevel(level);
+		LatLngToMercatorBatch(vecLat.data(), vecLng.data(), vecPoints.data(), vecPoints.size());
+		double dMaxError = 0.0;
+		for (size_t n = 0; n < vecPoints.size(); n++) {
+			MercatorPoint pt = LatLngToMercator(vecLat[n], vecLng[n]);
+			CHECK_EQ(vecPoints[n].x, pt.x);
+			dMaxError = std::max(dMaxError, std::fabs(vecPoints[n].y - pt.y));
+		}
+		// see LatLngToMercatorAVX2(); the scalar version must be exactly itself
+		CHECK(dMaxError <= (level == SIMD_AVX2 ? 1e-14 : 0.0));
+
+		// and every tail length, not writing past the end
+		for (size_t nPoints = 0; nPoints < 12; nPoints++) {
+			std::vector<MercatorPoint> vecTail(nPoints + 1, MercatorPoint{ -1.0, -1.0 });
+			LatLngToMercatorBatch(vecLat.data() + 3, vecLng.data() + 3, vecTail.data(), nPoints);
+			for (size_t n = 0; n < nPoints; n++) {
+				CHECK(Near(vecTail[n].y, LatLngToMercator(vecLat[n + 3], vecLng[n + 3]).y, 1e-14));
+			}
+			CHECK_EQ(vecTail[nPoints].x, -1.0);
+		}
+	}
+	SetSimdLevel(SIMD_AVX2);
+}
+
+TEST(ScreenBatchMatchesScalar)
+{
+	std::vector<double> vecLat, vecLng;
+	MakePoints(1000, vecLat, vecLng);
+	std::vector<MercatorPoint> vecPoints(vecLat.size());
+	for (size_t n = 0; n < vecPoints.size(); n++) {
+		vecPoints[n] = LatLngToMercator(vecLat[n], vecLng[n]);
+	}
+	double dScale = WorldSize(14, 256), dOriginX = dScale * 0.51234, dOriginY = dScale * 0.3321;
+	for (SimdLevel level : TestSimdLevels()) {
+		SetSimdLevel(level);
+		for (size_t nPoints : { (size_t)0, (size_t)1, (size_t)3, (size_t)5, (size_t)7, (size_t)1000 }) {
+			std::vector<D2D1_POINT_2F> vecScreen(nPoints + 1, D2D1_POINT_2F{ -1.f, -1.f });
+			MercatorToScreenBatch(vecPoints.data(), vecScreen.data(), nPoints, dScale, dOriginX, dOriginY);
+			// identical at every level, see Projection.h
+			unsigned nMismatches = 0;
+			for (size_t n = 0; n < nPoints; n++) {
+				nMismatches += vecScreen[n].x != (float)(vecPoints[n].x * dScale - dOriginX) ||
+					vecScreen[n].y != (float)(vecPoints[n].y * dScale - dOriginY);
+			}
+			CHECK_EQ(nMismatches, 0u);
+			CHECK_EQ(vecScreen[nPoints].x, -1.f);
+		}
+	}
+	SetSimdLevel(SIMD_AVX2);
+}
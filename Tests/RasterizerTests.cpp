@@ -0,0 +1,221 @@
+// RasterizerTests.cpp: coverage of filled and stroked paths, against exact areas, and the
+// non-zero fill rule
+
+#include "Test.h"
+#include "Rasterizer.h"
+
+static DecodedImage MakeImage(unsigned nWidth, unsigned nHeight, UINT32 nColor)
+{
+	DecodedImage image;
+	image.nWidth = nWidth;
+	image.nHeight = nHeight;
+	image.vecPixels.resize((size_t)image.stride() * nHeight);
+	std::fill_n(reinterpret_cast<UINT32*>(image.vecPixels.data()), (size_t)nWidth * nHeight, nColor);
+	return image;
+}
+
+static UINT32 Pixel(const DecodedImage& image, unsigned x, unsigned y)
+{
+	return reinterpret_cast<const UINT32*>(image.vecPixels.data())[(size_t)y * image.nWidth + x];
+}
+
+// rectangle from (x0, y0) to (x1, y1), clockwise on screen (y down), or counterclockwise
+static std::vector<D2D1_POINT_2F> Rectangle(float x0, float y0, float x1, float y1, bool bClockwise = true)
+{
+	std::vector<D2D1_POINT_2F> vecPoints = { { x0, y0 }, { x1, y0 }, { x1, y1 }, { x0, y1 } };
+	if (!bClockwise) {
+		std::reverse(vecPoints.begin(), vecPoints.end());
+	}
+	return vecPoints;
+}
+
+// sum of coverage of an image drawn with opaque white on transparent black, in pixels, and how
+// many pixels were drawn at all
+static double CoveredArea(const DecodedImage& image, unsigned* pnPixels = nullptr)
+{
+	double dArea = 0.0;
+	unsigned nPixels = 0;
+	for (unsigned y = 0; y < image.nHeight; y++) {
+		for (unsigned x = 0; x < image.nWidth; x++) {
+			UINT32 nAlpha = Pixel(image, x, y) >> 24;
+			dArea += nAlpha / 255.0;
+			nPixels += nAlpha != 0;
+		}
+	}
+	if (pnPixels) {
+		*pnPixels = nPixels;
+	}
+	return dArea;
+}
+
+TEST(FullPixelsGetExactColor)
+{
+	DecodedImage image = MakeImage(16, 16, 0);
+	Rasterizer rasterizer;
+	rasterizer.SetTarget(&image);
+	std::vector<D2D1_POINT_2F> vecRect = Rectangle(2.f, 3.f, 10.f, 7.f);
+	rasterizer.AddPolygon(vecRect.data(), vecRect.size());
+	rasterizer.Fill(0xff336699);
+	unsigned nMismatches = 0;
+	for (unsigned y = 0; y < 16; y++) {
+		for (unsigned x = 0; x < 16; x++) {
+			bool bInside = x >= 2 && x < 10 && y >= 3 && y < 7;
+			nMismatches += Pixel(image, x, y) != (bInside ? 0xff336699 : 0u);
+		}
+	}
+	CHECK_EQ(nMismatches, 0u);
+
+	// translucent colors are premultiplied and blended over what is there
+	rasterizer.AddPolygon(vecRect.data(), vecRect.size());
+	rasterizer.Fill(0x80ffffff);
+	UINT32 nPixel = Pixel(image, 5, 5);
+	CHECK_EQ(nPixel >> 24, 0xffu);
+	CHECK_EQ(nPixel & 0xff, (0x99u * 127 + 255 * 128 + 127) / 255);
+	CHECK_EQ(Pixel(image, 1, 5), 0u);
+}
+
+TEST(PartialPixelsGetCoverage)
+{
+	DecodedImage image = MakeImage(8, 2, 0xff000000);
+	Rasterizer rasterizer;
+	rasterizer.SetTarget(&image);
+	std::vector<D2D1_POINT_2F> vecRect = Rectangle(2.5f, 0.f, 5.5f, 1.f);
+	rasterizer.AddPolygon(vecRect.data(), vecRect.size());
+	rasterizer.Fill(0xffffffff);
+	CHECK_EQ(Pixel(image, 1, 0), 0xff000000u);
+	CHECK_EQ(Pixel(image, 2, 0), 0xff808080u);
+	CHECK_EQ(Pixel(image, 3, 0), 0xffffffffu);
+	CHECK_EQ(Pixel(image, 4, 0), 0xffffffffu);
+	CHECK_EQ(Pixel(image, 5, 0), 0xff808080u);
+	CHECK_EQ(Pixel(image, 6, 0), 0xff000000u);
+	CHECK_EQ(Pixel(image, 3, 1), 0xff000000u);
+}
+
+// coverage adds up to the exact area of triangles, with edges at any angle, either way around
+TEST(CoverageIsArea)
+{
+	std::mt19937 random(17);
+	std::uniform_real_distribution<float> coordinate(0.f, 32.f);
+	for (unsigned nTriangle = 0; nTriangle < 200; nTriangle++) {
+		DecodedImage image = MakeImage(32, 32, 0);
+		Rasterizer rasterizer;
+		rasterizer.SetTarget(&image);
+		D2D1_POINT_2F points[3];
+		for (D2D1_POINT_2F& pt : points) {
+			pt = { coordinate(random), coordinate(random) };
+		}
+		rasterizer.AddPolygon(points, 3);
+		rasterizer.Fill(0xffffffff);
+		double dArea = std::fabs(((double)points[1].x - points[0].x) * ((double)points[2].y - points[0].y) -
+			((double)points[2].x - points[0].x) * ((double)points[1].y - points[0].y)) / 2;
+		// every partially covered pixel is rounded to 1/255
+		unsigned nPixels;
+		double dCovered = CoveredArea(image, &nPixels);
+		if (std::fabs(dCovered - dArea) > nPixels * 0.5 / 255 + 1e-3) {
+			TestFail(__FILE__, __LINE__, std::format("triangle {}: area {}, covered {}", nTriangle, dArea, dCovered));
+			return;
+		}
+	}
+}
+
+TEST(NonZeroFillRule)
+{
+	// a ring the other way around cuts a hole
+	DecodedImage image = MakeImage(12, 12, 0);
+	Rasterizer rasterizer;
+	rasterizer.SetTarget(&image);
+	std::vector<D2D1_POINT_2F> vecOuter = Rectangle(1.f, 1.f, 11.f, 11.f), vecInner = Rectangle(4.f, 4.f, 8.f, 8.f, false);
+	rasterizer.AddPolygon(vecOuter.data(), vecOuter.size());
+	rasterizer.AddPolygon(vecInner.data(), vecInner.size());
+	rasterizer.Fill(0xffffffff);
+	CHECK_EQ(Pixel(image, 2, 2), 0xffffffffu);
+	CHECK_EQ(Pixel(image, 5, 5), 0u);
+	CHECK_EQ(CoveredArea(image), 100.0 - 16.0);
+
+	// the same way around, it doesn't; neither do overlapping shapes blend twice
+	image = MakeImage(12, 12, 0);
+	rasterizer.SetTarget(&image);
+	vecInner = Rectangle(4.f, 4.f, 8.f, 8.f);
+	std::vector<D2D1_POINT_2F> vecOverlapping = Rectangle(6.f, 6.f, 12.f, 12.f);
+	rasterizer.AddPolygon(vecOuter.data(), vecOuter.size());
+	rasterizer.AddPolygon(vecInner.data(), vecInner.size());
+	rasterizer.AddPolygon(vecOverlapping.data(), vecOverlapping.size());
+	rasterizer.Fill(0x80ffffff);
+	CHECK_EQ(Pixel(image, 2, 2), 0x80808080u);
+	CHECK_EQ(Pixel(image, 5, 5), 0x80808080u);
+	CHECK_EQ(Pixel(image, 7, 7), 0x80808080u);
+	CHECK_EQ(Pixel(image, 11, 11), 0x80808080u);
+	CHECK_EQ(Pixel(image, 0, 0), 0u);
+}
+
+TEST(Polylines)
+{
+	// a horizontal line, extended by half its width at both ends
+	DecodedImage image = MakeImage(16, 16, 0);
+	Rasterizer rasterizer;
+	rasterizer.SetTarget(&image);
+	D2D1_POINT_2F line[] = { { 2.f, 8.f }, { 12.f, 8.f } };
+	rasterizer.AddPolyline(line, 2, 2.f);
+	rasterizer.Fill(0xffffffff);
+	CHECK_EQ(CoveredArea(image), 12.0 * 2.0);
+	CHECK_EQ(Pixel(image, 1, 7), 0xffffffffu);
+	CHECK_EQ(Pixel(image, 12, 8), 0xffffffffu);
+	CHECK_EQ(Pixel(image, 0, 8), 0u);
+	CHECK_EQ(Pixel(image, 5, 6), 0u);
+	CHECK_EQ(Pixel(image, 5, 9), 0u);
+
+	// joins overlap but don't blend twice: an L is two rectangles minus the square they share
+	image = MakeImage(16, 16, 0);
+	rasterizer.SetTarget(&image);
+	D2D1_POINT_2F corner[] = { { 2.f, 2.f }, { 12.f, 2.f }, { 12.f, 12.f } };
+	rasterizer.AddPolyline(corner, 3, 2.f);
+	rasterizer.Fill(0xffffffff);
+	CHECK_EQ(CoveredArea(image), 12.0 * 2.0 * 2.0 - 4.0);
+
+	// a diagonal one, of area (length + width) * width
+	image = MakeImage(32, 32, 0);
+	rasterizer.SetTarget(&image);
+	D2D1_POINT_2F diagonal[] = { { 5.f, 5.f }, { 25.f, 20.f } };
+	rasterizer.AddPolyline(diagonal, 2, 1.5f);
+	rasterizer.Fill(0xffffffff);
+	unsigned nPixels;
+	double dCovered = CoveredArea(image, &nPixels);
+	CHECK(std::fabs(dCovered - (25.0 + 1.5) * 1.5) <= nPixels * 0.5 / 255 + 1e-3);
+
+	// and degenerate ones draw nothing
+	image = MakeImage(8, 8, 0);
+	rasterizer.SetTarget(&image);
+	D2D1_POINT_2F point[] = { { 4.f, 4.f }, { 4.f, 4.f } };
+	rasterizer.AddPolyline(point, 2, 2.f);
+	rasterizer.AddPolyline(point, 1, 2.f);
+	rasterizer.AddPolygon(point, 2);
+	rasterizer.Fill(0xffffffff);
+	CHECK_EQ(CoveredArea(image), 0.0);
+}
+
+// shapes partly or entirely outside the image are clipped to it, and still fill inside it
+TEST(Clipping)
+{
+	DecodedImage image = MakeImage(8, 8, 0);
+	Rasterizer rasterizer;
+	rasterizer.SetTarget(&image);
+	std::vector<D2D1_POINT_2F> vecAll = Rectangle(-100.f, -50.f, 100.f, 1000.f);
+	rasterizer.AddPolygon(vecAll.data(), vecAll.size());
+	rasterizer.Fill(0xffffffff);
+	CHECK_EQ(CoveredArea(image), 64.0);
+
+	for (auto [vecRect, dArea] : { std::pair(Rectangle(-5.f, 2.f, 3.f, 4.f), 6.0), std::pair(Rectangle(5.f, 2.f, 50.f, 4.f), 6.0),
+		std::pair(Rectangle(2.f, -9.f, 4.f, 1.f), 2.0), std::pair(Rectangle(2.f, 7.f, 4.f, 90.f), 2.0),
+		std::pair(Rectangle(-9.f, -9.f, -1.f, 20.f), 0.0), std::pair(Rectangle(8.f, 2.f, 20.f, 4.f), 0.0),
+		std::pair(Rectangle(2.f, 8.f, 4.f, 20.f), 0.0), std::pair(Rectangle(2.f, -20.f, 4.f, 0.f), 0.0) }) {
+		image = MakeImage(8, 8, 0);
+		rasterizer.SetTarget(&image);
+		rasterizer.AddPolygon(vecRect.data(), vecRect.size());
+		rasterizer.Fill(0xffffffff);
+		CHECK_EQ(CoveredArea(image), dArea);
+	}
+
+	// nothing is left over for the next fill
+	rasterizer.Fill(0xffffffff);
+	CHECK_EQ(CoveredArea(image), 0.0);
+}
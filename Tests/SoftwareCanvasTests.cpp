@@ -0,0 +1,293 @@
+// SoftwareCanvasTests.cpp: SoftwareCanvas primitives against values worked out by hand (fills,
+// blending, clipping, unscaled and bilinear tile drawing, lines), and a scene with all of them
+// against a golden image, Golden/SoftwareCanvas.png, at every SIMD level.  When the scene is
+// meant to change, run with MAPVIEWER_UPDATE_GOLDEN=1 to write the golden image again, and look
+// at it before committing it; when it doesn't match, what was drawn is written to the current
+// directory as SoftwareCanvas.actual.png
+
+#include "Test.h"
+#include "TestSimd.h"
+#include "FakeTransport.h"
+#include "PngWriter.h"
+#include "HttpClient.h"
+#include "TileCache.h"
+#include "DecodePool.h"
+#include "TileManager.h"
+#include "PngDecoder.h"
+#include "SoftwareCanvas.h"
+
+#include <filesystem>
+#include <fstream>
+
+static const unsigned TILE_SIZE = 16;
+
+// channel * alpha / 255, rounded, as premultiplied pixels are
+static UINT32 Premultiply(UINT32 nChannel, UINT32 nAlpha)
+{
+	return (nChannel * nAlpha + 127) / 255;
+}
+
+// what PatternDecoder puts at x, y of a tile: red increasing to the right, green down, blue
+// constant, opaque but for a translucent square in the middle
+static UINT32 PatternPixel(unsigned x, unsigned y)
+{
+	UINT32 a = x >= 4 && x < 12 && y >= 4 && y < 12 ? 0x80 : 0xff;
+	return Premultiply(0x60, a) | (Premultiply(y * 17, a) << 8) | (Premultiply(x * 17, a) << 16) | (a << 24);
+}
+
+class PatternDecoder : public ImageDecoder
+{
+public:
+	bool Decode(const void*, size_t, DecodedImage& image) override
+	{
+		image.nWidth = image.nHeight = TILE_SIZE;
+		image.vecPixels.resize((size_t)image.stride() * TILE_SIZE);
+		UINT32* pPixels = reinterpret_cast<UINT32*>(image.vecPixels.data());
+		for (unsigned y = 0; y < TILE_SIZE; y++) {
+			for (unsigned x = 0; x < TILE_SIZE; x++) {
+				pPixels[y * TILE_SIZE + x] = PatternPixel(x, y);
+			}
+		}
+		return true;
+	}
+};
+
+// a tile with the pattern above, loaded through TileManager, as only it can give a tile pixels
+class PatternTile
+{
+public:
+	PatternTile() :
+		m_httpClient(std::make_unique<FakeTransport>()), m_tileCache(Directory(), 1024 * 1024), m_decodePool(1),
+		m_tileManager(m_httpClient, m_tileCache, m_decodePool, L"http://tiles.invalid", TILE_SIZE, [](Tile&) {}, [] {})
+	{
+		m_tileManager.SetDecoder(std::make_unique<PatternDecoder>());
+		m_tileManager.SetKeepPixels(true);
+	}
+
+	// null if it won't load
+	const Tile* Load()
+	{
+		Tile& tile = m_tileManager.AddTile({ 0, 0, 0 });
+		auto tmGiveUp = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		while (tile.state() != TS_READY && std::chrono::steady_clock::now() < tmGiveUp) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			m_tileManager.ProcessCompletions();
+		}
+		return tile.state() == TS_READY ? &tile : nullptr;
+	}
+
+private:
+	static std::wstring Directory()
+	{
+		static unsigned s_nTiles = 0;
+		std::filesystem::path directory = std::filesystem::path(TestTempDirectory()) / std::format("PatternTile{}", s_nTiles++);
+		std::filesystem::create_directories(directory);
+		return directory.wstring();
+	}
+
+	HttpClient m_httpClient;
+	TileCache m_tileCache;
+	DecodePool m_decodePool;
+	TileManager m_tileManager;
+};
+
+static UINT32 Pixel(const SoftwareCanvas& canvas, unsigned x, unsigned y)
+{
+	return canvas.pixels()[(size_t)y * canvas.width() + x];
+}
+
+// pixels which are not nColor, in a rectangle of the canvas
+static unsigned CountOther(const SoftwareCanvas& canvas, unsigned x0, unsigned y0, unsigned x1, unsigned y1, UINT32 nColor)
+{
+	unsigned nOther = 0;
+	for (unsigned y = y0; y < y1; y++) {
+		for (unsigned x = x0; x < x1; x++) {
+			nOther += Pixel(canvas, x, y) != nColor;
+		}
+	}
+	return nOther;
+}
+
+static const UINT32 GRAY = 0xff808080;
+static const D2D1_COLOR_F GRAY_COLOR = D2D1::ColorF(128 / 255.f, 128 / 255.f, 128 / 255.f);
+
+TEST(Fills)
+{
+	for (SimdLevel level : TestSimdLevels()) {
+		SetSimdLevel(level);
+		SoftwareCanvas canvas(32, 24);
+		canvas.Clear(GRAY_COLOR);
+		CHECK_EQ(CountOther(canvas, 0, 0, 32, 24, GRAY), 0u);
+
+		// pixels whose centers are inside, opaque replaces
+		canvas.FillRectangle(D2D1::RectF(3.4f, 2.6f, 9.5f, 5.5f), D2D1::ColorF(1.f, 0.f, 0.f));
+		CHECK_EQ(CountOther(canvas, 3, 3, 9, 5, 0xffff0000), 0u);
+		CHECK_EQ(CountOther(canvas, 0, 0, 32, 24, GRAY), 6u * 2);
+
+		// half white over gray: 0x80 + 0x80 * 0x7f / 0xff
+		canvas.FillRectangle(D2D1::RectF(10.f, 0.f, 18.f, 24.f), D2D1::ColorF(1.f, 1.f, 1.f, .5f));
+		CHECK_EQ(CountOther(canvas, 10, 0, 18, 24, 0xffc0c0c0), 0u);
+		// and over that again, alpha stays opaque
+		canvas.FillRectangle(D2D1::RectF(10.f, 0.f, 18.f, 12.f), D2D1::ColorF(0.f, 0.f, 1.f, .25f));
+		UINT32 nBlue = 0x40 + Premultiply(0xc0, 0xff - 0x40), nOther = Premultiply(0xc0, 0xff - 0x40);
+		CHECK_EQ(CountOther(canvas, 10, 0, 18, 12, 0xff000000 | (nOther << 16) | (nOther << 8) | nBlue), 0u);
+		// transparent does nothing
+		canvas.FillRectangle(D2D1::RectF(0.f, 0.f, 32.f, 24.f), D2D1::ColorF(1.f, 1.f, 1.f, 0.f));
+		CHECK_EQ(CountOther(canvas, 10, 12, 18, 24, 0xffc0c0c0), 0u);
+
+		// clipped to the canvas, on all sides
+		canvas.Clear(GRAY_COLOR);
+		canvas.FillRectangle(D2D1::RectF(-10.f, -10.f, 2.f, 1.f), D2D1::ColorF(0.f, 1.f, 0.f));
+		canvas.FillRectangle(D2D1::RectF(30.f, 22.f, 100.f, 100.f), D2D1::ColorF(0.f, 1.f, 0.f));
+		CHECK_EQ(CountOther(canvas, 0, 0, 2, 1, 0xff00ff00), 0u);
+		CHECK_EQ(CountOther(canvas, 30, 22, 32, 24, 0xff00ff00), 0u);
+		CHECK_EQ(CountOther(canvas, 0, 0, 32, 24, GRAY), 2u + 4);
+		// and nothing at all
+		canvas.FillRectangle(D2D1::RectF(40.f, 0.f, 50.f, 10.f), D2D1::ColorF(0.f, 1.f, 0.f));
+		canvas.FillRectangle(D2D1::RectF(5.f, 5.f, 5.2f, 5.2f), D2D1::ColorF(0.f, 1.f, 0.f));
+		CHECK_EQ(CountOther(canvas, 0, 0, 32, 24, GRAY), 2u + 4);
+	}
+	SetSimdLevel(SIMD_AVX2);
+}
+
+TEST(Lines)
+{
+	for (SimdLevel level : TestSimdLevels()) {
+		SetSimdLevel(level);
+		SoftwareCanvas canvas(32, 24);
+		canvas.Clear(GRAY_COLOR);
+		// horizontal and vertical ones are rectangles around them, as wide as the line
+		canvas.DrawLine(D2D1::Point2F(3.f, 5.f), D2D1::Point2F(20.f, 5.f), D2D1::ColorF(0.f, 0.f, 0.f), 2.f);
+		CHECK_EQ(CountOther(canvas, 3, 4, 20, 6, 0xff000000), 0u);
+		CHECK_EQ(CountOther(canvas, 0, 0, 32, 24, GRAY), 17u * 2);
+		canvas.DrawLine(D2D1::Point2F(25.f, 20.f), D2D1::Point2F(25.f, 8.f), D2D1::ColorF(0.f, 0.f, 0.f), 1.f);
+		CHECK_EQ(CountOther(canvas, 24, 8, 25, 20, 0xff000000), 0u);
+		CHECK_EQ(CountOther(canvas, 0, 0, 32, 24, GRAY), 17u * 2 + 12);
+
+		// a diagonal one is a square at each step, one pixel for a line one pixel wide
+		canvas.Clear(GRAY_COLOR);
+		canvas.DrawLine(D2D1::Point2F(2.5f, 2.5f), D2D1::Point2F(12.5f, 12.5f), D2D1::ColorF(0.f, 0.f, 0.f), 1.f);
+		for (unsigned n = 2; n <= 12; n++) {
+			CHECK_EQ(Pixel(canvas, n, n), 0xff000000u);
+		}
+		CHECK_EQ(CountOther(canvas, 0, 0, 32, 24, GRAY), 11u);
+	}
+	SetSimdLevel(SIMD_AVX2);
+}
+
+TEST(Tiles)
+{
+	PatternTile patternTile;
+	const Tile* pTile = patternTile.Load();
+	REQUIRE(pTile);
+	for (SimdLevel level : TestSimdLevels()) {
+		SetSimdLevel(level);
+		// unscaled at whole pixels: the tile's pixels blended over the background, clipped to
+		// the canvas
+		SoftwareCanvas canvas(24, 20);
+		canvas.Clear(GRAY_COLOR);
+		canvas.DrawTile(*pTile, D2D1::RectF(10.f, 6.f, 26.f, 22.f));
+		for (unsigned y = 0; y < 20; y++) {
+			for (unsigned x = 0; x < 24; x++) {
+				UINT32 nExpected = GRAY;
+				if (x >= 10 && y >= 6) {
+					UINT32 s = PatternPixel(x - 10, y - 6), m = 0xff - (s >> 24);
+					nExpected = 0xff000000 | (s + Premultiply(0x80, m) * 0x010101);
+				}
+				CHECK_EQ(Pixel(canvas, x, y), nExpected);
+			}
+		}
+
+		// half a pixel off: bilinear, each pixel half way between two texels but the first, which
+		// doesn't go past the first texel; and the last pixel isn't covered by more than half
+		canvas.Clear(D2D1::ColorF(0.f, 0.f, 0.f));
+		canvas.DrawTile(*pTile, D2D1::RectF(0.5f, 0.f, 16.5f, 16.f));
+		for (unsigned x = 0; x < 16; x++) {
+			UINT32 nLeft = (std::max(x, 1u) - 1) * 17, nRight = x * 17;
+			UINT32 nRed = (nLeft * 128 + nRight * 128) >> 8;
+			CHECK_EQ(Pixel(canvas, x, 0), 0xff000000 | (nRed << 16) | 0x60);
+		}
+		CHECK_EQ(Pixel(canvas, 16, 0), 0xff000000u);
+
+		// part of the tile twice as large, as fallback tiles are drawn: a quarter of a texel in
+		// from the edges, the samples are clamped to the part, so its edge pixels repeat
+		canvas.Clear(D2D1::ColorF(0.f, 0.f, 0.f));
+		D2D1_RECT_F rectSource = D2D1::RectF(0.f, 0.f, 4.f, 4.f);
+		canvas.DrawTile(*pTile, D2D1::RectF(0.f, 0.f, 8.f, 8.f), &rectSource);
+		CHECK_EQ(Pixel(canvas, 0, 0), PatternPixel(0, 0));
+		CHECK_EQ(Pixel(canvas, 7, 7), PatternPixel(3, 3));
+		// (x + 0.5) / 2 - 0.5: a quarter of the way from texel 0 to texel 1
+		CHECK_EQ(Pixel(canvas, 1, 0), 0xff000000 | (((0 * 192 + 17 * 64) >> 8) << 16) | 0x60);
+		CHECK_EQ(CountOther(canvas, 8, 0, 24, 20, 0xff000000), 0u);
+		CHECK_EQ(CountOther(canvas, 0, 8, 8, 20, 0xff000000), 0u);
+	}
+	SetSimdLevel(SIMD_AVX2);
+}
+
+// everything at once, somewhat like a map with a fallback tile, tracks and the crosshair
+static void DrawScene(SoftwareCanvas& canvas, const Tile& tile)
+{
+	canvas.Clear(D2D1::ColorF(.9f, .88f, .85f));
+	// unscaled, scaled up, part of it scaled up, at a fraction of a pixel and clipped
+	canvas.DrawTile(tile, D2D1::RectF(2.f, 2.f, 18.f, 18.f));
+	canvas.DrawTile(tile, D2D1::RectF(22.f, 2.f, 53.f, 33.f));
+	D2D1_RECT_F rectSource = D2D1::RectF(4.f, 4.f, 12.f, 12.f);
+	canvas.DrawTile(tile, D2D1::RectF(2.f, 22.f, 18.f, 38.f), &rectSource);
+	canvas.DrawTile(tile, D2D1::RectF(56.3f, 36.7f, 72.3f, 52.7f));
+	canvas.FillRectangle(D2D1::RectF(38.f, 36.f, 52.f, 44.f), D2D1::ColorF(.2f, .4f, .8f));
+	canvas.FillRectangle(D2D1::RectF(10.f, 10.f, 30.f, 30.f), D2D1::ColorF(1.f, .5f, 0.f, .4f));
+	canvas.DrawLine(D2D1::Point2F(0.f, 46.f), D2D1::Point2F(64.f, 46.f), D2D1::ColorF(0.f, 0.f, 0.f));
+	canvas.DrawLine(D2D1::Point2F(60.f, 0.f), D2D1::Point2F(60.f, 30.f), D2D1::ColorF(.8f, 0.f, .2f, .7f), 2.f);
+	canvas.DrawLine(D2D1::Point2F(1.f, 46.f), D2D1::Point2F(35.f, 20.f), D2D1::ColorF(0.f, .3f, 1.f, .6f), 1.5f);
+}
+
+TEST(GoldenImage)
+{
+	static const unsigned WIDTH = 64, HEIGHT = 48;
+	PatternTile patternTile;
+	const Tile* pTile = patternTile.Load();
+	REQUIRE(pTile);
+	std::filesystem::path goldenPath = std::filesystem::path(GOLDEN_DIRECTORY) / "SoftwareCanvas.png";
+
+	for (SimdLevel level : TestSimdLevels()) {
+		SetSimdLevel(level);
+		SoftwareCanvas canvas(WIDTH, HEIGHT);
+		DrawScene(canvas, *pTile);
+		// the background is opaque, so the scene is too, and goes into RGB without loss
+		PngImage image;
+		image.nWidth = WIDTH;
+		image.nHeight = HEIGHT;
+		for (size_t n = 0; n < (size_t)WIDTH * HEIGHT; n++) {
+			UINT32 nPixel = canvas.pixels()[n];
+			REQUIRE(nPixel >> 24 == 0xff);
+			image.vecRows.insert(image.vecRows.end(), { (BYTE)(nPixel >> 16), (BYTE)(nPixel >> 8), (BYTE)nPixel });
+		}
+		if (getenv("MAPVIEWER_UPDATE_GOLDEN")) {
+			std::vector<BYTE> vecPng = PngWriter::Write(image);
+			std::ofstream(goldenPath, std::ios::binary).write(reinterpret_cast<const char*>(vecPng.data()), vecPng.size());
+			continue;
+		}
+
+		std::ifstream file(goldenPath, std::ios::binary);
+		std::vector<BYTE> vecGolden((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		DecodedImage golden;
+		REQUIRE(PngDecoder().Decode(vecGolden.data(), vecGolden.size(), golden));
+		REQUIRE(golden.nWidth == WIDTH && golden.nHeight == HEIGHT);
+		const UINT32* pGolden = reinterpret_cast<const UINT32*>(golden.vecPixels.data());
+		unsigned nDifferent = 0;
+		for (unsigned y = 0; y < HEIGHT; y++) {
+			for (unsigned x = 0; x < WIDTH; x++) {
+				if (Pixel(canvas, x, y) != pGolden[y * WIDTH + x] && nDifferent++ == 0) {
+					TestFail(__FILE__, __LINE__, std::format("SIMD level {}: first different pixel at {}, {}: {:08x}, golden {:08x}",
+						(int)level, x, y, Pixel(canvas, x, y), pGolden[y * WIDTH + x]));
+				}
+			}
+		}
+		if (nDifferent) {
+			TestFail(__FILE__, __LINE__, std::format("SIMD level {}: {} pixels different, see SoftwareCanvas.actual.png", (int)level, nDifferent));
+			std::vector<BYTE> vecPng = PngWriter::Write(image);
+			std::ofstream("SoftwareCanvas.actual.png", std::ios::binary).write(reinterpret_cast<const char*>(vecPng.data()), vecPng.size());
+		}
+	}
+	SetSimdLevel(SIMD_AVX2);
+}
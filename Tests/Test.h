@@ -0,0 +1,56 @@
+#pragma once
+
+// Test.h: minimal unit test harness, for the platform-neutral modules built by CMake.
+// TEST(name) { ... } defines a test case, registered at startup; CHECK() records a failure
+// and goes on, REQUIRE() also ends the test case.  Each test executable links TestMain.cpp,
+// which runs all of its cases, or only those whose names contain the first argument
+
+#include "framework.h"
+
+struct TestCase
+{
+	const char* pszName;
+	void (*pfnTest)();
+};
+
+// all test cases of the executable, in registration order
+std::vector<TestCase>& TestCases();
+
+struct TestRegistration
+{
+	TestRegistration(const char* pszName, void (*pfnTest)()) { TestCases().push_back({ pszName, pfnTest }); }
+};
+
+// records a failure of the test case being run
+void TestFail(const char* pszFile, int nLine, const std::string& strMessage);
+
+#define TEST(name) \
+	static void name(); \
+	static TestRegistration name##Registration(#name, name); \
+	static void name()
+
+#define CHECK(expr) ((expr) ? (void)0 : TestFail(__FILE__, __LINE__, #expr))
+
+// checks that two numbers (or anything else std::format can print) are equal, printing both if not
+#define CHECK_EQ(a, b) TestCheckEqual((a), (b), #a " == " #b, __FILE__, __LINE__)
+
+#define REQUIRE(expr) \
+	do { \
+		if (!(expr)) { \
+			TestFail(__FILE__, __LINE__, #expr); \
+			return; \
+		} \
+	} while (false)
+
+template <typename A, typename B>
+bool TestCheckEqual(const A& a, const B& b, const char* pszExpr, const char* pszFile, int nLine)
+{
+	if (a == b) {
+		return true;
+	}
+	TestFail(pszFile, nLine, std::format("{} ({} != {})", pszExpr, a, b));
+	return false;
+}
+
+// directory for files a test creates, empty and unique to the test executable run
+std::wstring TestTempDirectory();
@@ -0,0 +1,252 @@
+// TestHttpServer.cpp: TestHttpServer class implementation
+
+#include "framework.h"
+#include "TestHttpServer.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+
+// threads check for m_bStop at least this often, ms
+static const int POLL_INTERVAL_MS = 50;
+
+TestHttpServer::TestHttpServer() : TestHttpServer(Options())
+{
+}
+
+TestHttpServer::TestHttpServer(const Options& options) : m_options(options)
+{
+	m_listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t nLength = sizeof(address);
+	if (m_listener < 0 || bind(m_listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) ||
+		listen(m_listener, SOMAXCONN) || getsockname(m_listener, reinterpret_cast<sockaddr*>(&address), &nLength)) {
+		throw std::runtime_error("TestHttpServer: can't listen on a local port");
+	}
+	m_nPort = ntohs(address.sin_port);
+	m_acceptThread = std::thread(&TestHttpServer::AcceptThread, this);
+}
+
+TestHttpServer::~TestHttpServer()
+{
+	m_bStop = true;
+	m_acceptThread.join();
+	// no new ones, now that accepting has stopped
+	for (std::thread& thread : m_vecThreads) {
+		thread.join();
+	}
+	close(m_listener);
+}
+
+std::wstring TestHttpServer::Url(const std::string& strPath) const
+{
+	return std::format(L"http://127.0.0.1:{}", m_nPort) + std::wstring(strPath.begin(), strPath.end());
+}
+
+static uint32_t HashPath(const std::string& strPath)
+{
+	// FNV-1a
+	uint32_t nHash = 2166136261u;
+	for (char c : strPath) {
+		nHash = (nHash ^ (BYTE)c) * 16777619u;
+	}
+	return nHash;
+}
+
+std::string TestHttpServer::Body(const std::string& strPath, size_t szBody)
+{
+	std::string strBody(szBody, ' ');
+	uint32_t nState = HashPath(strPath);
+	for (char& c : strBody) {
+		nState = nState * 1664525u + 1013904223u;
+		c = (char)('a' + (nState >> 24) % 26);
+	}
+	return strBody;
+}
+
+std::string TestHttpServer::ETag(const std::string& strPath)
+{
+	return std::format("\"{:x}\"", HashPath(strPath));
+}
+
+TestHttpServer::Stats TestHttpServer::stats()
+{
+	std::lock_guard lock(m_mutex);
+	return m_stats;
+}
+
+void TestHttpServer::AcceptThread()
+{
+	while (!m_bStop) {
+		pollfd pfd = { m_listener, POLLIN, 0 };
+		if (poll(&pfd, 1, POLL_INTERVAL_MS) <= 0) {
+			continue;
+		}
+		int fd = accept4(m_listener, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd < 0) {
+			continue;
+		}
+		std::lock_guard lock(m_mutex);
+		m_stats.nConnections++;
+		m_stats.nMaxConnectionsOpen = std::max(m_stats.nMaxConnectionsOpen, ++m_nConnectionsOpen);
+		m_vecThreads.emplace_back(&TestHttpServer::ConnectionThread, this, fd);
+	}
+}
+
+static bool SendAll(int fd, const std::string& strData)
+{
+	size_t szSent = 0;
+	while (szSent < strData.size()) {
+		ssize_t n = send(fd, strData.data() + szSent, strData.size() - szSent, MSG_NOSIGNAL);
+		if (n <= 0) {
+			return false;
+		}
+		szSent += n;
+	}
+	return true;
+}
+
+void TestHttpServer::ConnectionThread(int fd)
+{
+	struct Pending
+	{
+		std::string strRequest;
+		std::chrono::steady_clock::time_point tmDue;
+	};
+	std::deque<Pending> pending;
+	std::string strInput;
+	unsigned nResponses = 0;
+	// whether to close gracefully, letting the client read all responses first
+	bool bGraceful = false;
+	while (!m_bStop) {
+		auto tmNow = std::chrono::steady_clock::now();
+		bool bDone = false;
+		while (!bDone && !pending.empty() && tmNow >= pending.front().tmDue) {
+			bool bLast = m_options.nMaxRequestsPerConnection && nResponses + 1 == m_options.nMaxRequestsPerConnection;
+			bool bClose = bLast;
+			std::string strResponse = Respond(pending.front().strRequest, bLast && m_options.bAnnounceClose, bClose);
+			pending.pop_front();
+			if (strResponse.empty() || !SendAll(fd, strResponse)) {
+				bDone = true;
+				break;
+			}
+			nResponses++;
+			if (bClose) {
+				bDone = bGraceful = true;
+			}
+		}
+		if (bDone) {
+			break;
+		}
+
+		int nTimeout = POLL_INTERVAL_MS;
+		if (!pending.empty()) {
+			long long nDue = std::chrono::duration_cast<std::chrono::milliseconds>(pending.front().tmDue - tmNow).count() + 1;
+			nTimeout = (int)std::clamp(nDue, 0ll, (long long)POLL_INTERVAL_MS);
+		}
+		pollfd pfd = { fd, POLLIN, 0 };
+		if (poll(&pfd, 1, nTimeout) <= 0) {
+			continue;
+		}
+		char buffer[16 * 1024];
+		ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+		if (n <= 0) {
+			break;
+		}
+		strInput.append(buffer, n);
+		tmNow = std::chrono::steady_clock::now();
+		size_t nEnd;
+		while ((nEnd = strInput.find("\r\n\r\n")) != std::string::npos) {
+			pending.push_back({ strInput.substr(0, nEnd + 4), tmNow + std::chrono::milliseconds(m_options.nLatencyMs) });
+			strInput.erase(0, nEnd + 4);
+			std::lock_guard lock(m_mutex);
+			m_stats.nRequests++;
+			m_stats.nMaxPipelined = std::max(m_stats.nMaxPipelined, (unsigned)pending.size());
+		}
+	}
+
+	if (bGraceful) {
+		// the client sees the end of the stream after all that was sent; closing with its
+		// requests unread would reset the connection, and could lose responses not read yet
+		shutdown(fd, SHUT_WR);
+		auto tmGiveUp = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+		while (!m_bStop && std::chrono::steady_clock::now() < tmGiveUp) {
+			pollfd pfd = { fd, POLLIN, 0 };
+			char buffer[4096];
+			if (poll(&pfd, 1, POLL_INTERVAL_MS) > 0 && recv(fd, buffer, sizeof(buffer), 0) <= 0) {
+				break;
+			}
+		}
+	}
+	close(fd);
+	std::lock_guard lock(m_mutex);
+	m_nConnectionsOpen--;
+}
+
+std::string TestHttpServer::Respond(const std::string& strRequest, bool bAnnounceClose, bool& bClose)
+{
+	// "GET /path?query HTTP/1.1"
+	size_t nPathStart = strRequest.find(' ') + 1;
+	size_t nPathEnd = strRequest.find(' ', nPathStart);
+	std::string strTarget = strRequest.substr(nPathStart, nPathEnd - nPathStart);
+	std::string strPath = strTarget.substr(0, strTarget.find('?'));
+	size_t szBody = m_options.szBody;
+	size_t nSize = strTarget.find("size=", strPath.size());
+	if (nSize != std::string::npos) {
+		std::from_chars(strTarget.c_str() + nSize + 5, strTarget.c_str() + strTarget.size(), szBody);
+	}
+
+	if (strPath == "/close") {
+		return std::string();
+	}
+	if (strPath.compare(0, 8, "/length/") == 0) {
+		bClose = true;
+		return std::format("HTTP/1.1 200 OK\r\nContent-Length: {}\r\n\r\nshort", strPath.substr(8));
+	}
+	unsigned nStatus = 200;
+	if (strPath.compare(0, 8, "/status/") == 0) {
+		std::from_chars(strPath.c_str() + 8, strPath.c_str() + strPath.size(), nStatus);
+	}
+	std::string strHead = std::format("HTTP/1.1 {} {}\r\n", nStatus, nStatus == 200 ? "OK" : "Status");
+	if (bAnnounceClose) {
+		strHead += "Connection: close\r\n";
+	}
+	std::string strBody;
+	if (nStatus == 200) {
+		std::string strETag = ETag(strPath);
+		strHead += "ETag: " + strETag + "\r\nLast-Modified: Sun, 06 Nov 1994 08:49:37 GMT\r\nCache-Control: public, max-age=3600\r\n";
+		if (strRequest.find("If-None-Match: " + strETag + "\r\n") != std::string::npos) {
+			return std::format("HTTP/1.1 304 Not Modified\r\n{}\r\n", strHead.substr(strHead.find("\r\n") + 2));
+		}
+		strBody = Body(strPath, szBody);
+	} else {
+		if (nStatus == 429 || nStatus == 503) {
+			strHead += "Retry-After: 7\r\n";
+		}
+		strBody = "error";
+	}
+
+	switch (m_options.framing) {
+	case FRAMING_LENGTH:
+		return std::format("{}Content-Length: {}\r\n\r\n", strHead, strBody.size()) + strBody;
+
+	case FRAMING_CHUNKED: {
+		std::string strResponse = strHead + "Transfer-Encoding: chunked\r\n\r\n";
+		for (size_t n = 0; n < strBody.size(); n += 4096) {
+			size_t szChunk = std::min<size_t>(4096, strBody.size() - n);
+			// an extension on the first one, which is to be ignored
+			strResponse += std::format("{:x}{}\r\n", szChunk, n ? "" : ";name=value") + strBody.substr(n, szChunk) + "\r\n";
+		}
+		return strResponse + "0\r\nX-Trailer: yes\r\n\r\n";
+	}
+
+	case FRAMING_CLOSE:
+	default:
+		bClose = true;
+		return strHead + "\r\n" + strBody;
+	}
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+// TestHttpServer.h: a stand-in tile server for testing and benchmarking HttpClient, on a local
+// port (POSIX sockets, one thread per connection).  It serves any path with a made-up body (see
+// Body()), keeps connections alive, answers pipelined requests in order, and can be set up to
+// misbehave the ways real servers do: respond slowly, close connections after a number of
+// requests (saying so or not), frame bodies as chunks or by closing.  Some paths are special:
+//   /status/NNN  responds with that status (and Retry-After: 7 for 429 and 503)
+//   /close       closes the connection instead of responding
+//   /length/N    responds with Content-Length: N (as given, however large), but a few bytes of
+//                body, and closes the connection
+// Responses to other paths have an ETag and are fresh for an hour, and a request with that ETag
+// in If-None-Match gets 304.  A "size=N" query parameter sets the body length for the request
+
+class TestHttpServer
+{
+public:
+	enum Framing
+	{
+		FRAMING_LENGTH,
+		FRAMING_CHUNKED,
+		// no length, the body ends with the connection
+		FRAMING_CLOSE
+	};
+
+	struct Options
+	{
+		// how long each response takes, from when its request came in (so responses to
+		// pipelined requests take it at the same time, rather than one after another)
+		unsigned nLatencyMs = 0;
+		size_t szBody = 1000;
+		Framing framing = FRAMING_LENGTH;
+		// connections are closed after this many responses, 0 for never; with "Connection: close"
+		// on the last one if bAnnounceClose, or else as if it had been idle too long
+		unsigned nMaxRequestsPerConnection = 0;
+		bool bAnnounceClose = true;
+	};
+
+	TestHttpServer();
+	explicit TestHttpServer(const Options& options);
+	~TestHttpServer();
+
+	// no copy/assignment
+	TestHttpServer& operator=(const TestHttpServer&) = delete;
+	TestHttpServer(const TestHttpServer&) = delete;
+
+	unsigned short port() const { return m_nPort; }
+	// URL of a path on this server
+	std::wstring Url(const std::string& strPath) const;
+
+	// the body served for a path (without the query)
+	static std::string Body(const std::string& strPath, size_t szBody);
+	static std::string ETag(const std::string& strPath);
+
+	struct Stats
+	{
+		// connections accepted, and open at most at once
+		unsigned nConnections, nMaxConnectionsOpen;
+		// requests received, and received on one connection but not responded to yet at most
+		unsigned nRequests, nMaxPipelined;
+	};
+	Stats stats();
+
+private:
+	Options m_options;
+	int m_listener = -1;
+	unsigned short m_nPort = 0;
+	std::atomic<bool> m_bStop = false;
+	std::thread m_acceptThread;
+
+	std::mutex m_mutex;
+	std::vector<std::thread> m_vecThreads;
+	unsigned m_nConnectionsOpen = 0;
+	Stats m_stats = {};
+
+	void AcceptThread();
+	void ConnectionThread(int fd);
+	// the response to a request, empty to close instead; bClose is set if the connection is to be
+	// closed after it
+	std::string Respond(const std::string& strRequest, bool bLast, bool& bClose);
+};
@@ -0,0 +1,59 @@
+// TestMain.cpp: runs test cases registered with TEST(), see Test.h
+
+#include "Test.h"
+
+#include <cstdio>
+#include <filesystem>
+
+static const char* g_pszCurrentTest = nullptr;
+static unsigned g_nFailures = 0;
+// created on first use, removed at exit
+static std::filesystem::path g_tempDirectory;
+
+std::vector<TestCase>& TestCases()
+{
+	static std::vector<TestCase> vecCases;
+	return vecCases;
+}
+
+void TestFail(const char* pszFile, int nLine, const std::string& strMessage)
+{
+	fprintf(stderr, "%s:%d: %s: check failed: %s\n", pszFile, nLine, g_pszCurrentTest, strMessage.c_str());
+	g_nFailures++;
+}
+
+std::wstring TestTempDirectory()
+{
+	if (g_tempDirectory.empty()) {
+		g_tempDirectory = std::filesystem::temp_directory_path() / std::format("mapviewer-test-{}", GetCurrentProcessId());
+		std::filesystem::remove_all(g_tempDirectory);
+		std::filesystem::create_directories(g_tempDirectory);
+	}
+	return g_tempDirectory.wstring();
+}
+
+int main(int argc, char* argv[])
+{
+	const char* pszFilter = argc > 1 ? argv[1] : "";
+	unsigned nRun = 0, nFailed = 0;
+	for (const TestCase& test : TestCases()) {
+		if (!strstr(test.pszName, pszFilter)) {
+			continue;
+		}
+		g_pszCurrentTest = test.pszName;
+		unsigned nFailuresBefore = g_nFailures;
+		auto tmStart = std::chrono::steady_clock::now();
+		test.pfnTest();
+		long long nMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - tmStart).count();
+		bool bPassed = g_nFailures == nFailuresBefore;
+		printf("%s %s (%lld ms)\n", bPassed ? "[  OK  ]" : "[ FAIL ]", test.pszName, nMs);
+		nRun++;
+		nFailed += bPassed ? 0 : 1;
+	}
+	printf("%u test cases, %u failed\n", nRun, nFailed);
+	if (!g_tempDirectory.empty()) {
+		std::error_code error;
+		std::filesystem::remove_all(g_tempDirectory, error);
+	}
+	return nFailed || !nRun ? 1 : 0;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+// TestSimd.h: for running tests at every SIMD level, see SetSimdLevel()
+
+#include "PixelConvert.h"
+
+// SIMD levels the CPU supports, the best one last.  Must first be called before any test lowers the level
+inline const std::vector<SimdLevel>& TestSimdLevels()
+{
+	static const std::vector<SimdLevel> vecLevels = []() {
+		std::vector<SimdLevel> vecLevels;
+		for (int n = SIMD_SCALAR; n <= GetSimdLevel(); n++) {
+			vecLevels.push_back((SimdLevel)n);
+		}
+		return vecLevels;
+	}();
+	return vecLevels;
+}
@@ -0,0 +1,280 @@
+// TileCacheTests.cpp: TileCache round trips, eviction when the pack file wraps around, records
+// which don't match their checksum, the index starting over when its header is corrupt or from
+// another version or capacity, Refresh() and HTTP validators, also across reopening
+
+#include "Test.h"
+#include "HttpClient.h"
+#include "TileCache.h"
+
+#include <filesystem>
+#include <fstream>
+
+static const unsigned SOURCE_ID = 12345;
+
+// a cache directory of its own
+static std::filesystem::path Directory(const char* pszName)
+{
+	std::filesystem::path directory = std::filesystem::path(TestTempDirectory()) / pszName;
+	std::filesystem::create_directories(directory);
+	return directory;
+}
+
+// tile data, different for every tile and size
+static std::string TileData(unsigned x, size_t szLength)
+{
+	std::mt19937 random(x);
+	std::string str(szLength, '\0');
+	for (char& ch : str) {
+		ch = (char)random();
+	}
+	return str;
+}
+
+// reads a tile into str, true if it was there and intact
+static bool ReadTile(TileCache& cache, TileCoords coords, std::string& str, unsigned nSourceId = SOURCE_ID)
+{
+	str.clear();
+	bool bCalled = false;
+	bool bRead = cache.Read(nSourceId, coords, [&](const void* pData, size_t szLength) {
+		bCalled = true;
+		str.assign(static_cast<const char*>(pData), szLength);
+	});
+	CHECK(bRead == bCalled);
+	return bRead;
+}
+
+static std::string ReadFile(const std::filesystem::path& path)
+{
+	std::ifstream file(path, std::ios::binary);
+	return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+static void WriteFile(const std::filesystem::path& path, const std::string& str)
+{
+	std::ofstream file(path, std::ios::binary);
+	file << str;
+}
+
+TEST(RoundTrip)
+{
+	std::filesystem::path directory = Directory("roundtrip");
+	{
+		TileCache cache(directory.wstring(), 4 * 1024 * 1024);
+		REQUIRE(cache.isOpen());
+		std::string str;
+		CHECK(!ReadTile(cache, { 1, 2, 3 }, str));
+		CHECK(!cache.Contains(SOURCE_ID, { 1, 2, 3 }));
+		for (unsigned x = 0; x < 100; x++) {
+			cache.Write(SOURCE_ID, { x, 2, 10 }, TileData(x, 100 + x * 37).data(), 100 + x * 37);
+		}
+		// a newer version replaces the old one
+		cache.Write(SOURCE_ID, { 5, 2, 10 }, TileData(1000, 5000).data(), 5000);
+		// empty tiles and those over a sixteenth of the capacity are not stored
+		cache.Write(SOURCE_ID, { 200, 2, 10 }, "", 0);
+		cache.Write(SOURCE_ID, { 201, 2, 10 }, TileData(201, 300 * 1024).data(), 300 * 1024);
+		CHECK(!cache.Contains(SOURCE_ID, { 200, 2, 10 }));
+		CHECK(!cache.Contains(SOURCE_ID, { 201, 2, 10 }));
+	}
+
+	// all there after reopening, and apart by source
+	TileCache cache(directory.wstring(), 4 * 1024 * 1024);
+	for (unsigned x = 0; x < 100; x++) {
+		std::string str;
+		REQUIRE(ReadTile(cache, { x, 2, 10 }, str));
+		CHECK(str == (x == 5 ? TileData(1000, 5000) : TileData(x, 100 + x * 37)));
+		CHECK(!ReadTile(cache, { x, 2, 10 }, str, SOURCE_ID + 1));
+		CHECK(!ReadTile(cache, { x, 2, 11 }, str));
+	}
+
+	// a cache which couldn't be opened misses everything
+	TileCache disabled((directory / "missing").wstring(), 4 * 1024 * 1024);
+	CHECK(!disabled.isOpen());
+	disabled.Write(SOURCE_ID, { 1, 2, 3 }, "tile", 4);
+	std::string str;
+	CHECK(!ReadTile(disabled, { 1, 2, 3 }, str));
+}
+
+TEST(Wraparound)
+{
+	// tiles of up to 60 kB in 1 MB, so that the pack file wraps around several times, and records
+	// which don't fit at its end go to its start
+	const unsigned long long ullCapacity = 1024 * 1024;
+	TileCache cache(Directory("wraparound").wstring(), ullCapacity);
+	REQUIRE(cache.isOpen());
+	std::vector<std::string> vecTiles;
+	std::mt19937 random(1);
+	for (unsigned x = 0; x < 100; x++) {
+		vecTiles.push_back(TileData(x, 20000 + random() % 40000));
+		cache.Write(SOURCE_ID, { x, 0, 12 }, vecTiles[x].data(), vecTiles[x].size());
+
+		// whatever is readable is intact, the latest tiles which fit into the capacity are all
+		// there, anything older than the capacity is gone
+		size_t szNewer = 0;
+		for (unsigned n = x + 1; n-- > 0; ) {
+			std::string str;
+			bool bRead = ReadTile(cache, { n, 0, 12 }, str);
+			CHECK(bRead == cache.Contains(SOURCE_ID, { n, 0, 12 }));
+			CHECK(!bRead || str == vecTiles[n]);
+			szNewer += vecTiles[n].size() + 64;
+			if (szNewer <= ullCapacity / 2) {
+				CHECK(bRead);
+			} else if (szNewer > ullCapacity) {
+				CHECK(!bRead);
+			}
+		}
+	}
+}
+
+TEST(ChecksumMismatch)
+{
+	// a record with the index entry in place but data not, as after a crash while writing it
+	std::filesystem::path directory = Directory("checksum");
+	std::string strData = TileData(7, 10000);
+	{
+		TileCache cache(directory.wstring(), 4 * 1024 * 1024);
+		cache.Write(SOURCE_ID, { 7, 7, 7 }, strData.data(), strData.size());
+		cache.Write(SOURCE_ID, { 8, 7, 7 }, TileData(8, 10000).data(), 10000);
+	}
+	std::string strPack = ReadFile(directory / "tiles.pack");
+	size_t nPos = strPack.find(strData);
+	REQUIRE(nPos != std::string::npos);
+	strPack[nPos + 5000] ^= 1;
+	WriteFile(directory / "tiles.pack", strPack);
+
+	TileCache cache(directory.wstring(), 4 * 1024 * 1024);
+	std::string str;
+	CHECK(!ReadTile(cache, { 7, 7, 7 }, str));
+	CHECK(ReadTile(cache, { 8, 7, 7 }, str));
+	CHECK(str == TileData(8, 10000));
+	// and is fine again once written anew
+	cache.Write(SOURCE_ID, { 7, 7, 7 }, strData.data(), strData.size());
+	CHECK(ReadTile(cache, { 7, 7, 7 }, str));
+	CHECK(str == strData);
+}
+
+TEST(IndexReset)
+{
+	std::filesystem::path directory = Directory("index");
+	auto fill = [&]() {
+		TileCache cache(directory.wstring(), 4 * 1024 * 1024);
+		for (unsigned x = 0; x < 10; x++) {
+			cache.Write(SOURCE_ID, { x, 1, 5 }, TileData(x, 1000).data(), 1000);
+		}
+	};
+	auto count = [&](unsigned long long ullCapacity) {
+		TileCache cache(directory.wstring(), ullCapacity);
+		unsigned nFound = 0;
+		for (unsigned x = 0; x < 10; x++) {
+			nFound += cache.Contains(SOURCE_ID, { x, 1, 5 });
+		}
+		// writing works either way
+		cache.Write(SOURCE_ID, { 99, 1, 5 }, "tile", 4);
+		std::string str;
+		CHECK(ReadTile(cache, { 99, 1, 5 }, str));
+		CHECK(str == "tile");
+		return nFound;
+	};
+	fill();
+	CHECK_EQ(count(4 * 1024 * 1024), 10u);
+
+	// corrupt magic, another version: the header is at the start of the index file, magic first
+	for (size_t nOffset : { 0, 4 }) {
+		fill();
+		std::string strIndex = ReadFile(directory / "tiles.idx");
+		strIndex[nOffset] ^= 0x40;
+		WriteFile(directory / "tiles.idx", strIndex);
+		CHECK_EQ(count(4 * 1024 * 1024), 0u);
+	}
+
+	// another capacity, which would put tiles elsewhere
+	fill();
+	CHECK_EQ(count(8 * 1024 * 1024), 0u);
+	CHECK_EQ(std::filesystem::file_size(directory / "tiles.pack"), 8u * 1024 * 1024);
+
+	// an index cut short in the header, e. g. by a full disk
+	fill();
+	std::filesystem::resize_file(directory / "tiles.idx", 12);
+	CHECK_EQ(count(4 * 1024 * 1024), 0u);
+}
+
+TEST(Validators)
+{
+	std::filesystem::path directory = Directory("validators");
+	HttpCacheInfo cacheInfo;
+	cacheInfo.strETag = "\"abc123\"";
+	cacheInfo.strLastModified = "Wed, 21 Oct 2015 07:28:00 GMT";
+	cacheInfo.llExpires = 1700000000;
+	HttpCacheInfo longETag;
+	longETag.strETag = std::string(2000, 'e');
+	longETag.strLastModified = "Thu, 22 Oct 2015 07:28:00 GMT";
+	{
+		TileCache cache(directory.wstring(), 4 * 1024 * 1024);
+		cache.Write(SOURCE_ID, { 1, 1, 1 }, "tile one", 8, &cacheInfo);
+		cache.Write(SOURCE_ID, { 2, 1, 1 }, "tile two", 8);
+		cache.Write(SOURCE_ID, { 3, 1, 1 }, "tile three", 10, &longETag);
+	}
+
+	TileCache cache(directory.wstring(), 4 * 1024 * 1024);
+	HttpCacheInfo read;
+	REQUIRE(cache.ReadCacheInfo(SOURCE_ID, { 1, 1, 1 }, read));
+	CHECK(read.strETag == cacheInfo.strETag);
+	CHECK(read.strLastModified == cacheInfo.strLastModified);
+	CHECK_EQ(read.llExpires, 1700000000ll);
+	long long llExpires = 0;
+	CHECK(cache.Contains(SOURCE_ID, { 1, 1, 1 }, &llExpires));
+	CHECK_EQ(llExpires, 1700000000ll);
+	// validators are not part of the tile
+	std::string str;
+	CHECK(ReadTile(cache, { 1, 1, 1 }, str));
+	CHECK(str == "tile one");
+
+	// none, which means revalidating always
+	REQUIRE(cache.ReadCacheInfo(SOURCE_ID, { 2, 1, 1 }, read));
+	CHECK(read.strETag.empty());
+	CHECK(read.strLastModified.empty());
+	CHECK_EQ(read.llExpires, 0ll);
+
+	// an unreasonably long one is dropped, the tile and the other one are kept
+	REQUIRE(cache.ReadCacheInfo(SOURCE_ID, { 3, 1, 1 }, read));
+	CHECK(read.strETag.empty());
+	CHECK(read.strLastModified == longETag.strLastModified);
+	CHECK(ReadTile(cache, { 3, 1, 1 }, str));
+	CHECK(str == "tile three");
+
+	CHECK(!cache.ReadCacheInfo(SOURCE_ID, { 4, 1, 1 }, read));
+}
+
+TEST(Refresh)
+{
+	std::filesystem::path directory = Directory("refresh");
+	HttpCacheInfo cacheInfo;
+	cacheInfo.strETag = "\"v1\"";
+	cacheInfo.llExpires = 1000;
+	{
+		TileCache cache(directory.wstring(), 4 * 1024 * 1024);
+		cache.Write(SOURCE_ID, { 1, 1, 1 }, "tile", 4, &cacheInfo);
+		CHECK(!cache.Refresh(SOURCE_ID, { 2, 1, 1 }, 2000));
+		CHECK(cache.Refresh(SOURCE_ID, { 1, 1, 1 }, 2000));
+		long long llExpires = 0;
+		CHECK(cache.Contains(SOURCE_ID, { 1, 1, 1 }, &llExpires));
+		CHECK_EQ(llExpires, 2000ll);
+	}
+
+	// kept, and nothing else changed
+	TileCache cache(directory.wstring(), 4 * 1024 * 1024);
+	HttpCacheInfo read;
+	REQUIRE(cache.ReadCacheInfo(SOURCE_ID, { 1, 1, 1 }, read));
+	CHECK_EQ(read.llExpires, 2000ll);
+	CHECK(read.strETag == "\"v1\"");
+	std::string str;
+	CHECK(ReadTile(cache, { 1, 1, 1 }, str));
+	CHECK(str == "tile");
+
+	// expiry is kept in 32 bits, clamped
+	CHECK(cache.Refresh(SOURCE_ID, { 1, 1, 1 }, -5));
+	REQUIRE(cache.ReadCacheInfo(SOURCE_ID, { 1, 1, 1 }, read));
+	CHECK_EQ(read.llExpires, 0ll);
+	CHECK(cache.Refresh(SOURCE_ID, { 1, 1, 1 }, 1ll << 40));
+	REQUIRE(cache.ReadCacheInfo(SOURCE_ID, { 1, 1, 1 }, read));
+	CHECK_EQ(read.llExpires, (long long)UINT_MAX);
+}
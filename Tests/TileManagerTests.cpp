@@ -0,0 +1,594 @@
+// TileManagerTests.cpp: TileManager over FakeTransport and FakeDecoder, with the real scheduler,
+// disk cache and decode pool: loading a view; that panning adds only the tiles which came into
+// view, and zooming all of them; that prefetched tiles count against the prefetch budget until
+// loaded, and become visible ones when panned onto; that results of loads are only ever applied to
+// the tile they were for, not to one evicted and created again at the same coords meanwhile (see
+// TileHandle); zooming in and out with loads finishing on other threads all the while; that a
+// TileManager can go while responses to its requests are being handed out; and, on a clock which
+// only moves when the test moves it, failed tiles backing off, and tiles parked while their server
+// is down; and layers composited pixel for pixel as they should be, with their opacity, bottom
+// up.  Meant to be run under ThreadSanitizer too
+
+#include "Test.h"
+#include "FakeTransport.h"
+#include "HttpClient.h"
+#include "TileCache.h"
+#include "DecodePool.h"
+#include "TileManager.h"
+
+#include <filesystem>
+
+static const unsigned TILE_SIZE = 256;
+
+// a TileManager with everything under it, with its disk cache in a directory of its own
+struct TestEngine
+{
+	explicit TestEngine(const char* pszName, unsigned nLatencyMs = 0) :
+		pTransport(new FakeTransport(nLatencyMs)), httpClient(std::unique_ptr<HttpTransport>(pTransport)), tileCache(Directory(pszName), 16 * 1024 * 1024), decodePool(2),
+		tileManager(httpClient, tileCache, decodePool, L"http://tiles.invalid", TILE_SIZE, [this](Tile&) { nLoaded++; }, [] {})
+	{
+		tileManager.SetDecoder(std::make_unique<FakeDecoder>(TILE_SIZE));
+		tileManager.SetKeepPixels(true);
+	}
+
+	static std::wstring Directory(const char* pszName)
+	{
+		std::filesystem::path directory = std::filesystem::path(TestTempDirectory()) / pszName;
+		std::filesystem::create_directories(directory);
+		return directory.wstring();
+	}
+
+	// processes completions until fnDone() is true, or it takes too long; returns fnDone()
+	template <typename F>
+	bool WaitFor(F fnDone)
+	{
+		auto tmGiveUp = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		while (!fnDone() && std::chrono::steady_clock::now() < tmGiveUp) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			tileManager.ProcessCompletions();
+		}
+		return fnDone();
+	}
+
+	bool IsReady(TileCoords coords)
+	{
+		Tile* pTile = tileManager.GetTile(coords);
+		return pTile && pTile->state() == TS_READY;
+	}
+
+	// makes HttpClient, and everything above it, go by tmNow, which only moves when the test moves
+	// it.  Before any tiles are loaded
+	void StopClock()
+	{
+		tmNow = GetTickCount64();
+		httpClient.SetClock([this]() { return tmNow.load(); });
+	}
+
+	FakeTransport* pTransport;
+	std::atomic<ULONGLONG> tmNow = 0;
+	HttpClient httpClient;
+	TileCache tileCache;
+	DecodePool decodePool;
+	unsigned nLoaded = 0;
+	TileManager tileManager;
+};
+
+TEST(LoadsView)
+{
+	TestEngine engine("LoadsView");
+	// all 4 tiles of zoom level 1
+	engine.tileManager.UpdateView(1, 0, 0, 1, 1);
+	REQUIRE(engine.WaitFor([&] { return engine.nLoaded == 4; }));
+	for (unsigned y = 0; y < 2; y++) {
+		for (unsigned x = 0; x < 2; x++) {
+			CHECK(engine.IsReady({ x, y, 1 }));
+			Tile* pTile = engine.tileManager.GetTile({ x, y, 1 });
+			REQUIRE(pTile && pTile->pixels());
+			CHECK_EQ(pTile->pixels()->nWidth, TILE_SIZE);
+		}
+	}
+	TileManager::Stats stats = engine.tileManager.stats();
+	CHECK_EQ(stats.nTiles, 4u);
+	CHECK_EQ(stats.nDownloaded, 4u);
+	CHECK_EQ(stats.nCompletions, 4u);
+	CHECK_EQ(stats.nDroppedCompletions, 0u);
+}
+
+TEST(StaleCompletionIsDropped)
+{
+	TestEngine engine("StaleCompletionIsDropped");
+	engine.tileManager.UpdateView(0, 0, 0, 0, 0);
+	REQUIRE(engine.WaitFor([&] { return engine.IsReady({ 0, 0, 0 }); }));
+
+	// the ready tile is composited again in the background, and meanwhile erased and created anew
+	// at the same coords.  Completions are only processed here, so the old tile's result is still
+	// queued when the new tile exists, whatever the timing of the workers
+	engine.tileManager.SetLayerOpacity(0, .5f);
+	engine.tileManager.InvalidateRenderTarget();
+	CHECK(engine.tileManager.GetTile({ 0, 0, 0 }) == nullptr);
+	engine.tileManager.UpdateView(0, 0, 0, 0, 0);
+	Tile* pNew = engine.tileManager.GetTile({ 0, 0, 0 });
+	REQUIRE(pNew);
+	CHECK(pNew->state() == TS_LOADING);
+
+	REQUIRE(engine.WaitFor([&] {
+		TileManager::Stats stats = engine.tileManager.stats();
+		return stats.nCompletions + stats.nDroppedCompletions == 3;
+	}));
+	TileManager::Stats stats = engine.tileManager.stats();
+	// the first load and the new tile's, but not the old tile's second one
+	CHECK_EQ(stats.nCompletions, 2u);
+	CHECK_EQ(stats.nDroppedCompletions, 1u);
+	CHECK(engine.IsReady({ 0, 0, 0 }));
+	CHECK_EQ(engine.nLoaded, 2u);
+}
+
+TEST(EvictedTileStaysGone)
+{
+	TestEngine engine("EvictedTileStaysGone");
+	engine.tileManager.UpdateView(0, 0, 0, 0, 0);
+	REQUIRE(engine.WaitFor([&] { return engine.IsReady({ 0, 0, 0 }); }));
+	engine.tileManager.SetLayerOpacity(0, .5f);
+	engine.tileManager.InvalidateRenderTarget();
+	// the result of compositing it again doesn't bring it back
+	REQUIRE(engine.WaitFor([&] { return engine.tileManager.stats().nDroppedCompletions == 1; }));
+	CHECK(engine.tileManager.GetTile({ 0, 0, 0 }) == nullptr);
+	CHECK_EQ(engine.tileManager.stats().nTiles, 0u);
+	CHECK_EQ(engine.nLoaded, 1u);
+}
+
+TEST(DestroyedWhileRequestsFinish)
+{
+	// the client, cache and pool outlive the managers, as in the app (one per window).  The fake
+	// answers right away, so some of each manager's requests are always being finished by
+	// HttpClient, too late to be cancelled, when it is destroyed
+	HttpClient httpClient(std::make_unique<FakeTransport>());
+	TileCache tileCache(TestEngine::Directory("DestroyedWhileRequestsFinish"), 64 * 1024 * 1024);
+	DecodePool decodePool(4);
+	for (unsigned n = 0; n < 200; n++) {
+		TileManager tileManager(httpClient, tileCache, decodePool, L"http://tiles.invalid", TILE_SIZE, [](Tile&) {}, [] {});
+		tileManager.SetDecoder(std::make_unique<FakeDecoder>(TILE_SIZE));
+		tileManager.SetKeepPixels(true);
+		// tiles not in the disk cache yet, so that they are all requested
+		tileManager.UpdateView(12, 100 + n * 8, 100, 7, 5);
+	}
+	// at least the first requests of each, up to the scheduler's limit, were sent
+	CHECK(httpClient.stats().nRequests >= 200u * TileScheduler::DEFAULT_MAX_IN_FLIGHT);
+}
+
+TEST(ZoomStress)
+{
+	// zooming in and out as fast as the UI thread can, while responses come in on the transport's
+	// thread and tiles are decoded and composited on the pool's; now and then all tiles are
+	// thrown away (as when the render target is lost) or composited again, and every round ends
+	// with the manager destroyed in the middle of it all.  Then, left alone, the view loads
+	static const unsigned ROUNDS = 4, STEPS = 240;
+	unsigned long long nEvictions = 0, nDroppedCompletions = 0;
+	for (unsigned nRound = 0; nRound < ROUNDS; nRound++) {
+		TestEngine engine(std::format("ZoomStress{}", nRound).c_str(), 1);
+		// a screen of tiles, so that tiles are evicted too
+		engine.tileManager.SetMemoryBudget(48 * TILE_SIZE * TILE_SIZE * 4);
+		auto setView = [&](unsigned zoom) {
+			// the same spot at every zoom, 8x6 tiles
+			engine.tileManager.UpdateView(zoom, (550u << zoom >> 10) - 4, (350u << zoom >> 10) - 3, 7, 5);
+		};
+		for (unsigned nStep = 0; nStep < STEPS; nStep++) {
+			// 10 to 15 and back
+			unsigned nPhase = nStep % 10;
+			setView(10 + (nPhase < 5 ? nPhase : 10 - nPhase));
+			engine.tileManager.ProcessCompletions();
+			if (nStep % 97 == 96) {
+				engine.tileManager.InvalidateRenderTarget();
+			} else if (nStep % 53 == 52) {
+				engine.tileManager.SetLayerOpacity(0, nStep % 2 ? 1.f : .5f);
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+		}
+		if (nRound == ROUNDS - 1) {
+			setView(12);
+			CHECK(engine.WaitFor([&] {
+				unsigned nReady = 0;
+				for (unsigned y = 0; y < 6; y++) {
+					for (unsigned x = 0; x < 8; x++) {
+						nReady += engine.IsReady({ (550u << 2) - 4 + x, (350u << 2) - 3 + y, 12 });
+					}
+				}
+				return nReady == 48;
+			}));
+			CHECK_EQ(engine.tileManager.schedulerStats().nInFlight + engine.tileManager.schedulerStats().nQueued, 0u);
+		}
+		nEvictions += engine.tileManager.stats().nEvictions;
+		nDroppedCompletions += engine.tileManager.stats().nDroppedCompletions;
+	}
+	// it did go through all of that
+	CHECK(nEvictions > 0);
+	CHECK(nDroppedCompletions > 0);
+}
+
+// a tile which failed once more, since the last time it was loaded; null if it hasn't yet
+static Tile* WaitForFailure(TestEngine& engine, TileCoords coords, unsigned long long nFailures)
+{
+	bool bFailed = engine.WaitFor([&] {
+		Tile* pTile = engine.tileManager.GetTile(coords);
+		return pTile && pTile->state() == TS_ERROR && engine.tileManager.stats().nFailures == nFailures;
+	});
+	return bFailed ? engine.tileManager.GetTile(coords) : nullptr;
+}
+
+TEST(BackOff)
+{
+	TestEngine engine("BackOff");
+	engine.StopClock();
+	engine.pTransport->SetStatus(HTTP_STATUS_SERVER_ERROR);
+	engine.tileManager.UpdateView(0, 0, 0, 0, 0);
+	std::vector<double> vecJitter;
+	for (unsigned nFailures = 1; nFailures <= 9; nFailures++) {
+		Tile* pTile = WaitForFailure(engine, { 0, 0, 0 }, nFailures);
+		REQUIRE(pTile);
+		// half to all of the backoff, which doubles up to the max
+		unsigned nBackOffMs = std::min(TileManager::RETRY_BASE_MS << (nFailures - 1), TileManager::RETRY_MAX_MS);
+		ULONGLONG nDelayMs = pTile->retryTime() - engine.tmNow;
+		CHECK(nDelayMs >= nBackOffMs / 2 && nDelayMs <= nBackOffMs);
+		vecJitter.push_back((double)nDelayMs / nBackOffMs);
+		CHECK_EQ(engine.tileManager.stats().nBackingOff, 1u);
+
+		// a tile of the same server loading fine meanwhile, so that its circuit breaker doesn't
+		// open after so many failures in a row, which is not what this is about
+		engine.pTransport->SetStatus(0);
+		engine.tileManager.AddTile({ nFailures, 0, 5 });
+		REQUIRE(engine.WaitFor([&] { return engine.IsReady({ nFailures, 0, 5 }); }));
+		engine.pTransport->SetStatus(HTTP_STATUS_SERVER_ERROR);
+
+		// not a moment early
+		engine.tmNow = pTile->retryTime() - 1;
+		CHECK_EQ(engine.tileManager.RetryTiles(), 1u);
+		engine.tileManager.AddTile({ 0, 0, 0 });
+		CHECK(pTile->state() == TS_ERROR);
+		engine.tmNow++;
+		CHECK_EQ(engine.tileManager.RetryTiles(), 0u);
+		CHECK(pTile->state() == TS_LOADING);
+		CHECK_EQ(engine.tileManager.stats().nRetries, (unsigned long long)nFailures);
+	}
+	// tiles failing together are not retried together
+	CHECK(*std::max_element(vecJitter.begin(), vecJitter.end()) - *std::min_element(vecJitter.begin(), vecJitter.end()) > .1);
+	CHECK_EQ(engine.httpClient.stats().nCircuitsOpened, 0ull);
+
+	// and once loaded, a tile starts over
+	Tile* pTile = WaitForFailure(engine, { 0, 0, 0 }, 10);
+	REQUIRE(pTile);
+	engine.pTransport->SetStatus(0);
+	engine.tmNow = pTile->retryTime();
+	engine.tileManager.RetryTiles();
+	REQUIRE(engine.WaitFor([&] { return engine.IsReady({ 0, 0, 0 }); }));
+	CHECK_EQ(engine.tileManager.GetTile({ 0, 0, 0 })->retryTime(), 0ull);
+	CHECK_EQ(engine.tileManager.stats().nBackingOff, 0u);
+}
+
+TEST(RetryAfter)
+{
+	TestEngine engine("RetryAfter");
+	engine.StopClock();
+	std::wstring strUrl = engine.tileManager.GetTileURL({ 0, 0, 0 });
+	// longer than the backoff: the server knows better
+	engine.pTransport->SetStatus(HTTP_STATUS_SERVICE_UNAVAIL, 30);
+	engine.tileManager.UpdateView(0, 0, 0, 0, 0);
+	Tile* pTile = WaitForFailure(engine, { 0, 0, 0 }, 1);
+	REQUIRE(pTile);
+	CHECK_EQ(pTile->retryTime(), engine.tmNow + 30 * 1000);
+	// the server's circuit breaker opens right away, for as long
+	CHECK_EQ(engine.httpClient.ServerRetryTime(strUrl), engine.tmNow + 30 * 1000);
+
+	// more than we care to wait is capped, for the tile and for the server
+	engine.pTransport->SetStatus(HTTP_STATUS_SERVICE_UNAVAIL, 24 * 60 * 60);
+	engine.tmNow += 30 * 1000;
+	CHECK_EQ(engine.tileManager.RetryTiles(), 0u);
+	pTile = WaitForFailure(engine, { 0, 0, 0 }, 2);
+	REQUIRE(pTile);
+	CHECK_EQ(pTile->retryTime(), engine.tmNow + TileManager::RETRY_AFTER_MAX_S * 1000);
+	CHECK_EQ(engine.httpClient.ServerRetryTime(strUrl), engine.tmNow + HttpClient::CIRCUIT_MAX_OPEN_MS);
+}
+
+TEST(ParkedUntilServerIsBack)
+{
+	// slow enough for the probe to be seen going out before it's back
+	TestEngine engine("ParkedUntilServerIsBack", 200);
+	engine.StopClock();
+	ULONGLONG tmStart = engine.tmNow;
+	engine.pTransport->SetStatus(HTTP_STATUS_SERVICE_UNAVAIL, 10);
+	engine.tileManager.UpdateView(0, 0, 0, 0, 0);
+	REQUIRE(WaitForFailure(engine, { 0, 0, 0 }, 1));
+	engine.pTransport->SetStatus(0);
+
+	// tiles wanted while the server is down wait for it, rather than being sent to fail
+	engine.tileManager.UpdateView(1, 0, 0, 1, 1);
+	CHECK(engine.WaitFor([&] { return engine.tileManager.schedulerStats().nParked == 4; }));
+	CHECK_EQ(engine.pTransport->requestsStarted(), 1ull);
+	// anything that starts requests (here another tile) lets parked ones go when their time has
+	// come, but not a moment early
+	engine.tmNow = tmStart + 10 * 1000 - 1;
+	engine.tileManager.AddTile({ 0, 0, 5 });
+	CHECK_EQ(engine.tileManager.schedulerStats().nParked, 5u);
+	CHECK_EQ(engine.pTransport->requestsStarted(), 1ull);
+	CHECK_EQ(engine.httpClient.stats().nRejected, 0ull);
+
+	// then just one goes, a probe, while the rest wait a little more to see how it does
+	engine.tmNow++;
+	engine.tileManager.AddTile({ 1, 0, 5 });
+	CHECK_EQ(engine.pTransport->requestsStarted(), 2ull);
+	CHECK_EQ(engine.tileManager.schedulerStats().nParked, 5u);
+	// it did fine, so they all go once they look again
+	CHECK(engine.WaitFor([&] { return engine.nLoaded == 1; }));
+	CHECK_EQ(engine.tileManager.schedulerStats().nParked, 5u);
+	engine.tmNow += HttpClient::CIRCUIT_PROBE_RECHECK_MS;
+	engine.tileManager.AddTile({ 2, 0, 5 });
+	CHECK(engine.WaitFor([&] { return engine.nLoaded == 7; }));
+	CHECK_EQ(engine.tileManager.schedulerStats().nParked, 0u);
+	CHECK_EQ(engine.httpClient.stats().nRejected, 0ull);
+	for (unsigned y = 0; y < 2; y++) {
+		for (unsigned x = 0; x < 2; x++) {
+			CHECK(engine.IsReady({ x, y, 1 }));
+		}
+	}
+}
+
+TEST(IncrementalView)
+{
+	TestEngine engine("IncrementalView");
+	// tiles added (looked up, loaded if not yet) and requested since the last call
+	unsigned long long nLastAdded = 0, nLastStarted = 0;
+	auto added = [&]() {
+		TileManager::Stats stats = engine.tileManager.stats();
+		unsigned long long nAdded = stats.nHits + stats.nMisses - nLastAdded;
+		nLastAdded += nAdded;
+		return nAdded;
+	};
+	// once they're all done: not all of them need to have been started right away
+	auto started = [&]() {
+		unsigned long long nStarted = engine.pTransport->requestsStarted() - nLastStarted;
+		nLastStarted += nStarted;
+		return nStarted;
+	};
+
+	// 3x3 tiles
+	engine.tileManager.UpdateView(4, 2, 2, 2, 2);
+	REQUIRE(engine.WaitFor([&] { return engine.nLoaded == 9; }));
+	CHECK_EQ(added(), 9ull);
+	CHECK_EQ(started(), 9ull);
+
+	// a pan adds only what came into view: a column
+	engine.tileManager.UpdateView(4, 3, 2, 2, 2);
+	CHECK_EQ(added(), 3ull);
+	REQUIRE(engine.WaitFor([&] { return engine.nLoaded == 12; }));
+	CHECK_EQ(started(), 3ull);
+	for (unsigned y = 2; y <= 4; y++) {
+		CHECK(engine.tileManager.GetTile({ 5, y, 4 }));
+	}
+	// a column and a row
+	engine.tileManager.UpdateView(4, 4, 3, 2, 2);
+	CHECK_EQ(added(), 5ull);
+	REQUIRE(engine.WaitFor([&] { return engine.nLoaded == 17; }));
+	CHECK_EQ(started(), 5ull);
+	// nothing at all
+	engine.tileManager.UpdateView(4, 4, 3, 2, 2);
+	CHECK_EQ(added(), 0ull);
+
+	// a zoom changes all tiles, even those at the same x and y
+	engine.tileManager.UpdateView(5, 4, 3, 2, 2);
+	CHECK_EQ(added(), 9ull);
+	REQUIRE(engine.WaitFor([&] { return engine.nLoaded == 26; }));
+	CHECK_EQ(started(), 9ull);
+	// and back: all of them are added again, though they're all still there and nothing is loaded
+	engine.tileManager.UpdateView(4, 4, 3, 2, 2);
+	CHECK_EQ(added(), 9ull);
+	CHECK_EQ(started(), 0ull);
+	CHECK_EQ(engine.tileManager.stats().nMisses, 26ull);
+	// and a pan from there is a pan again
+	engine.tileManager.UpdateView(4, 4, 4, 2, 2);
+	CHECK_EQ(added(), 3ull);
+	REQUIRE(engine.WaitFor([&] { return engine.nLoaded == 29; }));
+	CHECK_EQ(started(), 3ull);
+}
+
+TEST(PrefetchLimitsAndPromotion)
+{
+	// slow enough for nothing to finish while it's being looked at
+	TestEngine engine("PrefetchLimitsAndPromotion", 1000);
+	// 4 prefetched tiles loading at most, 1 of them in flight
+	engine.tileManager.SetPrefetchBudget(4, 64 * 1024 * 1024, 2, 1);
+	engine.tileManager.UpdateView(3, 2, 2, 1, 1);
+	CHECK_EQ(engine.pTransport->requestsStarted(), 4ull);
+
+	// shifting the view right by 2 would show 2 columns, the second of which fits only just, and
+	// then there's no budget left for other zoom levels
+	CHECK(!engine.tileManager.PrefetchView(3, 2, 2, 1, 1, 2, 0, 18));
+	CHECK(!engine.tileManager.Prefetch({ 1, 1, 2 }));
+	TileManager::Stats stats = engine.tileManager.stats();
+	CHECK_EQ(stats.nPrefetchIssued, 4ull);
+	for (unsigned y = 2; y <= 3; y++) {
+		for (unsigned x = 4; x <= 5; x++) {
+			CHECK(engine.tileManager.GetTile({ x, y, 3 }));
+		}
+	}
+	CHECK(!engine.tileManager.GetTile({ 1, 1, 2 }));
+	CHECK_EQ(engine.pTransport->requestsStarted(), 5ull);
+	TileScheduler::Stats schedulerStats = engine.tileManager.schedulerStats();
+	CHECK_EQ(schedulerStats.nPrefetchStarted, 1ull);
+	CHECK_EQ(schedulerStats.nQueued, 3u);
+
+	// panning onto the first column makes its tiles visible ones: the queued one starts at once,
+	// and the one in flight no longer takes up the only prefetch slot, so the next one starts too
+	engine.tileManager.UpdateView(3, 3, 2, 1, 1);
+	stats = engine.tileManager.stats();
+	CHECK_EQ(stats.nPrefetchHits, 2ull);
+	CHECK_EQ(stats.nMisses, 6ull);
+	CHECK_EQ(engine.pTransport->requestsStarted(), 7ull);
+	schedulerStats = engine.tileManager.schedulerStats();
+	CHECK_EQ(schedulerStats.nPrefetchStarted, 2ull);
+	CHECK_EQ(schedulerStats.nQueued, 1u);
+
+	// once they're loaded the budget is back
+	REQUIRE(engine.WaitFor([&] { return engine.nLoaded == 8; }));
+	CHECK(engine.tileManager.Prefetch({ 1, 1, 2 }));
+	REQUIRE(engine.WaitFor([&] { return engine.nLoaded == 9; }));
+	CHECK_EQ(engine.tileManager.stats().nPrefetchIssued, 5ull);
+
+	// and memory counts too: here there's room for one more tile only
+	engine.tileManager.SetPrefetchBudget(4, engine.tileManager.stats().szBytes + 1, 2, 1);
+	CHECK(engine.tileManager.Prefetch({ 2, 1, 2 }));
+	CHECK(!engine.tileManager.Prefetch({ 1, 2, 2 }));
+	CHECK_EQ(engine.tileManager.stats().nPrefetchIssued, 6ull);
+	CHECK(engine.WaitFor([&] { return engine.nLoaded == 10; }));
+}
+
+// decodes every tile of a layer to the same image
+class LayerDecoder : public ImageDecoder
+{
+public:
+	explicit LayerDecoder(DecodedImage image) : m_image(std::move(image)) {}
+
+	bool Decode(const void*, size_t, DecodedImage& image) override
+	{
+		image = m_image;
+		return true;
+	}
+
+private:
+	DecodedImage m_image;
+};
+
+// an image of nSize x nSize premultiplied pixels, fnPixel(x) across, the same in every row
+template <typename F>
+static DecodedImage LayerImage(unsigned nSize, F fnPixel)
+{
+	DecodedImage image;
+	image.nWidth = image.nHeight = nSize;
+	image.vecPixels.resize((size_t)image.stride() * nSize);
+	UINT32* pPixels = reinterpret_cast<UINT32*>(image.vecPixels.data());
+	for (unsigned y = 0; y < nSize; y++) {
+		for (unsigned x = 0; x < nSize; x++) {
+			pPixels[y * nSize + x] = fnPixel(x);
+		}
+	}
+	return image;
+}
+
+// source over destination with the source's opacity scaled by nOpacity / 255, per channel, each
+// product rounded to nearest, as compositing layers is meant to work out
+static UINT32 BlendPixel(UINT32 d, UINT32 s, UINT32 nOpacity)
+{
+	UINT32 sa = ((s >> 24) * nOpacity + 127) / 255, nResult = 0;
+	for (unsigned nShift = 0; nShift < 32; nShift += 8) {
+		UINT32 sc = (((s >> nShift) & 0xff) * nOpacity + 127) / 255, dc = (d >> nShift) & 0xff;
+		nResult |= (sc + (dc * (255 - sa) + 127) / 255) << nShift;
+	}
+	return nResult;
+}
+
+// layer opacity in 255ths, as TileManager rounds it
+static UINT32 Opacity(float fOpacity)
+{
+	return (UINT32)std::lround(fOpacity * 255.f);
+}
+
+// the image of a tile of layers, bottom first, each with its opacity
+static std::shared_ptr<const DecodedImage> Composite(const char* pszName, const std::vector<std::pair<DecodedImage, float>>& vecLayers)
+{
+	TestEngine engine(pszName);
+	for (unsigned nLayer = 0; nLayer < vecLayers.size(); nLayer++) {
+		if (nLayer) {
+			engine.tileManager.AddLayer(std::format(L"http://layer{}.invalid", nLayer), vecLayers[nLayer].second);
+		} else {
+			engine.tileManager.SetLayerOpacity(0, vecLayers[0].second);
+		}
+		engine.tileManager.SetDecoder(std::make_unique<LayerDecoder>(vecLayers[nLayer].first), nLayer);
+	}
+	engine.tileManager.AddTile({ 0, 0, 0 });
+	if (!engine.WaitFor([&] { return engine.IsReady({ 0, 0, 0 }); })) {
+		return nullptr;
+	}
+	return engine.tileManager.GetTile({ 0, 0, 0 })->pixels();
+}
+
+// compares the first row of an image (they're all the same) with fnExpected(x)
+template <typename F>
+static void CheckRow(const DecodedImage& image, F fnExpected, const char* pszFile, int nLine)
+{
+	const UINT32* pPixels = reinterpret_cast<const UINT32*>(image.vecPixels.data());
+	unsigned nDifferent = 0;
+	for (unsigned x = 0; x < image.nWidth; x++) {
+		if (pPixels[x] != fnExpected(x) && nDifferent++ == 0) {
+			TestFail(pszFile, nLine, std::format("first different pixel at {}: {:08x}, expected {:08x}", x, pPixels[x], fnExpected(x)));
+		}
+	}
+	if (nDifferent) {
+		TestFail(pszFile, nLine, std::format("{} pixels different", nDifferent));
+	}
+}
+
+// an opaque base map, and overlays with every alpha, premultiplied, increasing and decreasing
+// across, whose colors don't commute
+static UINT32 BasePixel(unsigned x)
+{
+	return 0xff000000 | (((x * 7) & 0xff) << 16) | ((255 - x) << 8) | x;
+}
+
+static UINT32 OverlayPixel(unsigned x)
+{
+	UINT32 a = x;
+	return (a << 24) | (a << 16) | ((a / 2) << 8) | (a * (x % 5) / 4);
+}
+
+static UINT32 SecondOverlayPixel(unsigned x)
+{
+	UINT32 a = 255 - x;
+	return (a << 24) | ((a / 3) << 8) | a;
+}
+
+TEST(LayerOpacity)
+{
+	// an overlay at half opacity over the base
+	auto pImage = Composite("LayerOpacity1", { { LayerImage(TILE_SIZE, BasePixel), 1.f }, { LayerImage(TILE_SIZE, OverlayPixel), .5f } });
+	REQUIRE(pImage && pImage->nWidth == TILE_SIZE && pImage->nHeight == TILE_SIZE);
+	CheckRow(*pImage, [](unsigned x) { return BlendPixel(BasePixel(x), OverlayPixel(x), Opacity(.5f)); }, __FILE__, __LINE__);
+	// which is not the same as without it, or with all of it
+	CHECK(BlendPixel(BasePixel(200), OverlayPixel(200), Opacity(.5f)) != BasePixel(200));
+	CHECK(BlendPixel(BasePixel(200), OverlayPixel(200), Opacity(.5f)) != BlendPixel(BasePixel(200), OverlayPixel(200), 255));
+
+	// the base itself translucent: over nothing, and then an opaque overlay over that
+	pImage = Composite("LayerOpacity2", { { LayerImage(TILE_SIZE, BasePixel), .3f }, { LayerImage(TILE_SIZE, SecondOverlayPixel), 1.f } });
+	REQUIRE(pImage);
+	CheckRow(*pImage, [](unsigned x) { return BlendPixel(BlendPixel(0, BasePixel(x), Opacity(.3f)), SecondOverlayPixel(x), 255); }, __FILE__, __LINE__);
+
+	// a layer at opacity 0 is left out, and one of twice the size is sampled nearest, every
+	// other pixel
+	pImage = Composite("LayerOpacity3", { { LayerImage(TILE_SIZE, BasePixel), 1.f }, { LayerImage(TILE_SIZE, SecondOverlayPixel), 0.f },
+		{ LayerImage(TILE_SIZE * 2, [](unsigned x) { return x % 2 ? 0xffff0000 : OverlayPixel(x / 2); }), .8f } });
+	REQUIRE(pImage && pImage->nWidth == TILE_SIZE);
+	CheckRow(*pImage, [](unsigned x) { return BlendPixel(BasePixel(x), OverlayPixel(x), Opacity(.8f)); }, __FILE__, __LINE__);
+}
+
+TEST(LayerOrder)
+{
+	// each over what's below, bottom up
+	auto pImage = Composite("LayerOrder1", { { LayerImage(TILE_SIZE, BasePixel), 1.f }, { LayerImage(TILE_SIZE, OverlayPixel), .5f },
+		{ LayerImage(TILE_SIZE, SecondOverlayPixel), .8f } });
+	REQUIRE(pImage);
+	auto fnExpected = [](unsigned x) {
+		return BlendPixel(BlendPixel(BasePixel(x), OverlayPixel(x), Opacity(.5f)), SecondOverlayPixel(x), Opacity(.8f));
+	};
+	CheckRow(*pImage, fnExpected, __FILE__, __LINE__);
+
+	// and the other way around is different
+	pImage = Composite("LayerOrder2", { { LayerImage(TILE_SIZE, BasePixel), 1.f }, { LayerImage(TILE_SIZE, SecondOverlayPixel), .8f },
+		{ LayerImage(TILE_SIZE, OverlayPixel), .5f } });
+	REQUIRE(pImage);
+	auto fnSwapped = [](unsigned x) {
+		return BlendPixel(BlendPixel(BasePixel(x), SecondOverlayPixel(x), Opacity(.8f)), OverlayPixel(x), Opacity(.5f));
+	};
+	CheckRow(*pImage, fnSwapped, __FILE__, __LINE__);
+	unsigned nSame = 0;
+	for (unsigned x = 0; x < TILE_SIZE; x++) {
+		nSame += fnExpected(x) == fnSwapped(x);
+	}
+	CHECK(nSame < TILE_SIZE / 2);
+}
@@ -0,0 +1,66 @@
+// TileMapTests.cpp: TileMap against std::map, through random inserts and erases of keys which
+// collide a lot, and pointers staying valid while the table grows
+
+#include "Test.h"
+#include "TileMap.h"
+
+TEST(AgainstMap)
+{
+	// few distinct keys, so that there are many hits, erases of keys in the middle of probe
+	// sequences, and erases of keys which aren't there
+	std::mt19937 random(1);
+	TileMap<unsigned> tileMap;
+	std::map<TileKey, unsigned> mapExpected;
+	for (unsigned n = 0; n < 200000; n++) {
+		TileCoords coords(random() % 40, random() % 40, 8 + random() % 3);
+		TileKey key = coords.key();
+		if (random() % 3) {
+			auto [pValue, bCreated] = tileMap.TryEmplace(key, n);
+			auto [it, bInserted] = mapExpected.try_emplace(key, n);
+			CHECK_EQ(bCreated, bInserted);
+			REQUIRE(pValue);
+			CHECK_EQ(*pValue, it->second);
+		} else {
+			tileMap.Erase(key);
+			mapExpected.erase(key);
+		}
+		CHECK_EQ(tileMap.size(), mapExpected.size());
+		if (n % 1000 == 0) {
+			for (unsigned y = 0; y < 40; y++) {
+				for (unsigned x = 0; x < 40; x++) {
+					for (unsigned zoom = 8; zoom < 11; zoom++) {
+						TileKey keyCheck = TileCoords::MakeKey(x, y, zoom);
+						auto it = mapExpected.find(keyCheck);
+						unsigned* pValue = tileMap.Find(keyCheck);
+						REQUIRE((pValue != nullptr) == (it != mapExpected.end()));
+						CHECK(!pValue || *pValue == it->second);
+					}
+				}
+			}
+		}
+	}
+}
+
+TEST(StablePointers)
+{
+	TileMap<TileCoords> tileMap;
+	CHECK(!tileMap.Find(0));
+	tileMap.Erase(0);
+	std::vector<TileCoords*> vecTiles;
+	for (unsigned x = 0; x < 10000; x++) {
+		vecTiles.push_back(tileMap.TryEmplace(TileCoords::MakeKey(x, x / 7, 15), x, x / 7, 15).first);
+	}
+	CHECK_EQ(tileMap.size(), 10000u);
+	for (unsigned x = 0; x < 10000; x++) {
+		CHECK(tileMap.Find(TileCoords::MakeKey(x, x / 7, 15)) == vecTiles[x]);
+		CHECK_EQ(vecTiles[x]->x, x);
+	}
+	for (unsigned x = 0; x < 10000; x += 2) {
+		tileMap.Erase(TileCoords::MakeKey(x, x / 7, 15));
+	}
+	CHECK_EQ(tileMap.size(), 5000u);
+	for (unsigned x = 1; x < 10000; x += 2) {
+		CHECK(tileMap.Find(TileCoords::MakeKey(x, x / 7, 15)) == vecTiles[x]);
+		CHECK(!tileMap.Find(TileCoords::MakeKey(x - 1, (x - 1) / 7, 15)));
+	}
+}
@@ -0,0 +1,264 @@
+// TileSchedulerTests.cpp: TileScheduler over HttpClient and FakeTransport: the order tiers go in,
+// cancelling tiles no longer wanted on SetView(), time to full screen after a zoom change,
+// cancelling requests which miss their deadline, limits on prefetch requests, and parking
+// requests while the server's circuit breaker is open
+
+#include "Test.h"
+#include "FakeTransport.h"
+#include "HttpClient.h"
+#include "TileScheduler.h"
+
+// one minute, so that requests stay in flight for as long as a test needs them to
+static const unsigned LATENCY_FOREVER_MS = 60 * 1000;
+
+// a TileScheduler with HttpClient and FakeTransport under it, recording which tiles were sent in
+// which order, and the status each one finished with
+struct TestScheduler
+{
+	explicit TestScheduler(unsigned nLatencyMs, unsigned nMaxInFlight = TileScheduler::DEFAULT_MAX_IN_FLIGHT,
+		unsigned nDeadlineMs = TileScheduler::DEFAULT_DEADLINE_MS) :
+		pTransport(new FakeTransport(nLatencyMs)), httpClient(std::unique_ptr<HttpTransport>(pTransport)),
+		scheduler(httpClient, [this](TileCoords coords, unsigned) { return Url(coords); }, nMaxInFlight, nDeadlineMs)
+	{
+	}
+
+	std::wstring Url(TileCoords coords)
+	{
+		std::lock_guard lock(mutex);
+		vecSent.push_back(Name(coords));
+		return std::format(L"http://tiles.test/{}/{}/{}.png", coords.zoom, coords.x, coords.y);
+	}
+
+	static std::string Name(TileCoords coords)
+	{
+		return std::format("{}/{}/{}", coords.zoom, coords.x, coords.y);
+	}
+
+	void Request(TileCoords coords, bool bPrefetch = false)
+	{
+		scheduler.Request(coords, 0, [this, coords](int nStatus, ResponseBuffer, const HttpCacheInfo&) {
+			std::lock_guard lock(mutex);
+			mapStatus[Name(coords)].push_back(nStatus);
+		}, false, bPrefetch);
+	}
+
+	// statuses the tile has finished with so far, at most one if all is well
+	std::vector<int> Status(TileCoords coords)
+	{
+		std::lock_guard lock(mutex);
+		auto it = mapStatus.find(Name(coords));
+		return it != mapStatus.end() ? it->second : std::vector<int>();
+	}
+
+	size_t Finished()
+	{
+		std::lock_guard lock(mutex);
+		return mapStatus.size();
+	}
+
+	// waits until fnDone() is true, or it takes too long; returns fnDone()
+	template <typename F>
+	bool WaitFor(F fnDone)
+	{
+		auto tmGiveUp = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		while (!fnDone() && std::chrono::steady_clock::now() < tmGiveUp) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		return fnDone();
+	}
+
+	FakeTransport* pTransport;
+	HttpClient httpClient;
+	std::mutex mutex;
+	std::vector<std::string> vecSent;
+	std::map<std::string, std::vector<int>> mapStatus;
+	TileScheduler scheduler;
+};
+
+static const std::vector<int> OK = { 0 };
+static const std::vector<int> CANCELLED = { -ERROR_INTERNET_OPERATION_CANCELLED };
+
+TEST(TierOrder)
+{
+	// one at a time, so that they are sent in the order of their priorities
+	TestScheduler test(0, 1);
+	test.scheduler.SetView(10, 100, 100, 2, 2);
+	std::vector<TileCoords> vecTiles = {
+		{ 97, 101, 10 },	// prefetch, 3 tiles out
+		{ 203, 203, 11 },	// zoom level below, off center
+		{ 99, 101, 10 },	// ring
+		{ 50, 50, 9 },		// zoom level above
+		{ 100, 100, 10 },	// visible, corner
+		{ 101, 101, 10 },	// visible, center
+	};
+	for (TileCoords coords : vecTiles) {
+		test.Request(coords, coords.x == 97);
+	}
+	test.scheduler.Dispatch();
+	REQUIRE(test.WaitFor([&] { return test.Finished() == vecTiles.size(); }));
+	std::vector<std::string> vecExpected = { "10/101/101", "10/100/100", "10/99/101", "9/50/50", "11/203/203", "10/97/101" };
+	std::lock_guard lock(test.mutex);
+	CHECK(test.vecSent == vecExpected);
+	for (auto& [strTile, vecStatus] : test.mapStatus) {
+		CHECK(vecStatus == OK);
+	}
+}
+
+TEST(CancelledOnSetView)
+{
+	TestScheduler test(LATENCY_FOREVER_MS, 4);
+	test.scheduler.SetView(10, 0, 0, 3, 3);
+	for (unsigned y = 0; y <= 3; y++) {
+		for (unsigned x = 0; x <= 3; x++) {
+			test.Request({ x, y, 10 });
+		}
+	}
+	test.scheduler.Dispatch();
+	TileScheduler::Stats stats = test.scheduler.stats();
+	CHECK_EQ(stats.nInFlight, 4u);
+	CHECK_EQ(stats.nQueued, 12u);
+
+	// the four in the middle went first.  Moving the view three tiles right and down leaves only
+	// the bottom right corner in it or its ring; the rest are cancelled whether queued or in
+	// flight, with the callback called before SetView() returns
+	test.scheduler.SetView(10, 3, 3, 3, 3);
+	for (unsigned y = 0; y <= 3; y++) {
+		for (unsigned x = 0; x <= 3; x++) {
+			CHECK(test.Status({ x, y, 10 }) == (x <= 1 || y <= 1 ? CANCELLED : std::vector<int>()));
+		}
+	}
+	stats = test.scheduler.stats();
+	CHECK_EQ(stats.nCancelled, 12ull);
+	// nothing new is started until Dispatch()
+	CHECK_EQ(stats.nInFlight, 1u);
+	CHECK_EQ(stats.nQueued, 3u);
+	CHECK_EQ(test.pTransport->requestsCompleted(), 0ull);
+
+	// a zoom level up and far away: nothing is wanted anymore
+	test.scheduler.SetView(9, 200, 200, 3, 3);
+	CHECK_EQ(test.Finished(), 16u);
+	stats = test.scheduler.stats();
+	CHECK_EQ(stats.nCancelled, 16ull);
+	CHECK_EQ(stats.nInFlight + stats.nQueued, 0u);
+	CHECK_EQ(test.httpClient.stats().nFetchesCancelled, test.pTransport->requestsStarted());
+}
+
+TEST(TimeToFullScreen)
+{
+	TestScheduler test(50);
+	test.scheduler.SetView(10, 0, 0, 1, 1);
+	test.Request({ 0, 0, 10 });
+	test.Request({ 1, 1, 10 });
+	test.scheduler.Dispatch();
+	// zoomed in before those are loaded: they are cancelled, which doesn't count as the new view
+	// being loaded, before its tiles are even there
+	test.scheduler.SetView(11, 100, 100, 1, 1);
+	CHECK_EQ(test.Finished(), 2u);
+	test.Request({ 100, 100, 11 });
+	test.Request({ 101, 101, 11 });
+	test.scheduler.Dispatch();
+	REQUIRE(test.WaitFor([&] { return test.Finished() == 4; }));
+	CHECK(test.Status({ 101, 101, 11 }) == OK);
+	REQUIRE(test.WaitFor([&] { return test.scheduler.stats().nLastTimeToFullScreenMs != 0; }));
+	CHECK(test.scheduler.stats().nLastTimeToFullScreenMs >= 45);
+}
+
+TEST(DeadlineMissed)
+{
+	TestScheduler test(LATENCY_FOREVER_MS, 8, 50);
+	test.scheduler.SetView(10, 0, 0, 1, 1);
+	test.Request({ 0, 0, 10 });
+	test.Request({ 1, 1, 10 });
+	test.scheduler.Dispatch();
+	// not late yet
+	test.scheduler.CheckDeadlines();
+	CHECK_EQ(test.Finished(), 0u);
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	test.scheduler.CheckDeadlines();
+	CHECK(test.Status({ 0, 0, 10 }) == CANCELLED);
+	CHECK(test.Status({ 1, 1, 10 }) == CANCELLED);
+	TileScheduler::Stats stats = test.scheduler.stats();
+	CHECK_EQ(stats.nTimedOut, 2ull);
+	CHECK_EQ(stats.nInFlight, 0u);
+	// the slots are free for what is queued next
+	test.Request({ 1, 0, 10 });
+	test.scheduler.Dispatch();
+	CHECK_EQ(test.scheduler.stats().nInFlight, 1u);
+}
+
+TEST(PrefetchLimits)
+{
+	TestScheduler test(LATENCY_FOREVER_MS);
+	test.scheduler.SetPrefetchLimits(2, 1);
+	test.scheduler.SetView(10, 100, 100, 1, 1);
+	// around the view, up to two tiles out, and one three tiles out, which is beyond the ring
+	for (unsigned x = 98; x <= 103; x++) {
+		test.Request({ x, 98, 10 }, true);
+	}
+	test.Request({ 97, 100, 10 }, true);
+	test.scheduler.Dispatch();
+	TileScheduler::Stats stats = test.scheduler.stats();
+	CHECK_EQ(stats.nInFlight, 1u);
+	CHECK_EQ(stats.nPrefetchStarted, 1ull);
+
+	// prefetch requests for visible tiles, and anything else needed, go regardless
+	test.Request({ 100, 100, 10 }, true);
+	test.Request({ 99, 99, 10 });
+	test.scheduler.Dispatch();
+	stats = test.scheduler.stats();
+	CHECK_EQ(stats.nInFlight, 3u);
+	CHECK_EQ(stats.nPrefetchStarted, 1ull);
+
+	// more slots for prefetching
+	test.scheduler.SetPrefetchLimits(2, 3);
+	test.scheduler.Dispatch();
+	stats = test.scheduler.stats();
+	CHECK_EQ(stats.nInFlight, 5u);
+	CHECK_EQ(stats.nPrefetchStarted, 3ull);
+
+	// the one out of the ring is dropped as soon as the view is looked at again; the others stay
+	test.scheduler.SetView(10, 100, 100, 1, 1);
+	CHECK(test.Status({ 97, 100, 10 }) == CANCELLED);
+	CHECK_EQ(test.Finished(), 1u);
+	stats = test.scheduler.stats();
+	CHECK_EQ(stats.nQueued, 3u);
+	CHECK_EQ(stats.nInFlight, 5u);
+}
+
+TEST(ParkedWhileServerIsDown)
+{
+	// one at a time, so that the circuit breaker opens after the failures it takes, with the
+	// rest still queued
+	TestScheduler test(0, 1);
+	test.pTransport->SetStatus(HTTP_STATUS_SERVICE_UNAVAIL);
+	test.scheduler.SetView(10, 0, 0, 3, 3);
+	for (unsigned x = 0; x <= 3; x++) {
+		test.Request({ x, 0, 10 });
+		test.Request({ x, 1, 10 });
+	}
+	test.scheduler.Dispatch();
+	REQUIRE(test.WaitFor([&] { return test.scheduler.stats().nParked == 8 - HttpClient::CIRCUIT_FAILURE_THRESHOLD; }));
+	CHECK_EQ(test.Finished(), (size_t)HttpClient::CIRCUIT_FAILURE_THRESHOLD);
+	CHECK_EQ(test.pTransport->requestsStarted(), (unsigned long long)HttpClient::CIRCUIT_FAILURE_THRESHOLD);
+	HttpClient::Stats httpStats = test.httpClient.stats();
+	CHECK_EQ(httpStats.nCircuitsOpened, 1ull);
+	// parked, rather than sent to be failed by the breaker
+	CHECK_EQ(httpStats.nRejected, 0ull);
+	TileScheduler::Stats stats = test.scheduler.stats();
+	CHECK_EQ(stats.nQueued, 0u);
+	CHECK_EQ(stats.nInFlight, 0u);
+
+	// nor are they sent on anything else happening before the server may be tried again
+	test.Request({ 0, 2, 10 });
+	test.scheduler.Dispatch();
+	test.scheduler.CheckDeadlines();
+	CHECK_EQ(test.scheduler.stats().nParked, 9u - HttpClient::CIRCUIT_FAILURE_THRESHOLD);
+	CHECK_EQ(test.pTransport->requestsStarted(), (unsigned long long)HttpClient::CIRCUIT_FAILURE_THRESHOLD);
+
+	// and dropped like queued requests when they are no longer wanted
+	test.scheduler.SetView(10, 100, 100, 3, 3);
+	CHECK_EQ(test.Finished(), 9u);
+	stats = test.scheduler.stats();
+	CHECK_EQ(stats.nParked, 0u);
+	CHECK_EQ(stats.nCancelled, 9ull - HttpClient::CIRCUIT_FAILURE_THRESHOLD);
+}
@@ -0,0 +1,173 @@
+// TileSeederTests.cpp: TileSeeder downloading a region from TestHttpServer into a TileCache:
+// every tile once, then none of them again; resuming a stopped job from the state file; and
+// failed tiles, which leave the job to be resumed without anything cached for them
+
+#include "Test.h"
+#include "TestHttpServer.h"
+#include "HttpClient.h"
+#include "SocketTransport.h"
+#include "TileCache.h"
+#include "TileSeeder.h"
+#include "Projection.h"
+
+#include <filesystem>
+
+// a bit of Prague: 2x2 tiles at zoom 10 and 11, 3x2 at 12 and 6x4 at 13
+static const SeedRegion REGION = { 50.03, 14.35, 50.12, 14.55, 10, 13 };
+
+// a cache and a state file in a directory of their own
+static std::wstring Directory(const char* pszName)
+{
+	std::filesystem::path directory = std::filesystem::path(TestTempDirectory()) / pszName;
+	std::filesystem::create_directories(directory);
+	return directory.wstring();
+}
+
+// waits for the job to finish, true if it did in time
+static bool WaitDone(TileSeeder& seeder)
+{
+	auto tmGiveUp = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+	while (seeder.stats().bRunning && std::chrono::steady_clock::now() < tmGiveUp) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	return !seeder.stats().bRunning;
+}
+
+// calls fn(coords) for every tile of the region
+template <typename F>
+static void ForEachTile(const SeedRegion& region, F fn)
+{
+	MercatorPoint ptTopLeft = LatLngToMercator(region.dMaxLat, region.dMinLng);
+	MercatorPoint ptBottomRight = LatLngToMercator(region.dMinLat, region.dMaxLng);
+	for (unsigned nZoom = region.nMinZoom; nZoom <= region.nMaxZoom; nZoom++) {
+		TileCoords topLeft = MercatorToTile(ptTopLeft, nZoom), bottomRight = MercatorToTile(ptBottomRight, nZoom);
+		for (unsigned y = topLeft.y; y <= bottomRight.y; y++) {
+			for (unsigned x = topLeft.x; x <= bottomRight.x; x++) {
+				fn(TileCoords(x, y, nZoom));
+			}
+		}
+	}
+}
+
+TEST(SeedsRegion)
+{
+	TestHttpServer server;
+	HttpClient client(std::make_unique<SocketTransport>(4));
+	std::wstring strDirectory = Directory("SeedsRegion");
+	TileCache cache(strDirectory, 16 * 1024 * 1024);
+	std::wstring strBaseUrl = server.Url("/tiles");
+	std::wstring strStatePath = strDirectory + L"/seed.dat";
+	TileSeeder seeder(client, cache, strBaseUrl, strStatePath, 4, 1000.0);
+
+	unsigned long long nTotal = TileSeeder::EstimateRegion(REGION).nTiles;
+	CHECK_EQ(nTotal, 38u);
+	seeder.Start(REGION);
+	REQUIRE(WaitDone(seeder));
+	TileSeeder::Stats stats = seeder.stats();
+	CHECK_EQ(stats.nTotal, nTotal);
+	CHECK_EQ(stats.nDone, nTotal);
+	CHECK_EQ(stats.nDownloaded, nTotal);
+	CHECK_EQ(stats.nSkipped, 0u);
+	CHECK_EQ(stats.nFailed, 0u);
+	CHECK_EQ(stats.ullBytes, nTotal * 1000);
+	CHECK_EQ(server.stats().nRequests, (unsigned)nTotal);
+	// done and nothing failed, so there is nothing to resume
+	CHECK(!std::filesystem::exists(strStatePath));
+	CHECK(!seeder.Resume());
+
+	// every tile is in the cache, with what the server sent for it
+	unsigned nSourceId = TileCache::SourceId(strBaseUrl);
+	size_t nCached = 0, nIntact = 0;
+	ForEachTile(REGION, [&](TileCoords coords) {
+		std::string strExpected = TestHttpServer::Body(std::format("/tiles/{}/{}/{}.png", coords.zoom, coords.x, coords.y), 1000);
+		nCached += cache.Read(nSourceId, coords, [&](const void* pData, size_t szLength) {
+			nIntact += std::string(static_cast<const char*>(pData), szLength) == strExpected;
+		});
+	});
+	CHECK_EQ(nCached, nTotal);
+	CHECK_EQ(nIntact, nTotal);
+
+	// all of it is skipped the second time, without a single request
+	seeder.Start(REGION);
+	REQUIRE(WaitDone(seeder));
+	stats = seeder.stats();
+	CHECK_EQ(stats.nSkipped, nTotal);
+	CHECK_EQ(stats.nDownloaded, 0u);
+	CHECK_EQ(server.stats().nRequests, (unsigned)nTotal);
+}
+
+TEST(ResumesStoppedJob)
+{
+	TestHttpServer server;
+	HttpClient client(std::make_unique<SocketTransport>(4));
+	std::wstring strDirectory = Directory("ResumesStoppedJob");
+	TileCache cache(strDirectory, 16 * 1024 * 1024);
+	std::wstring strBaseUrl = server.Url("/tiles");
+	std::wstring strStatePath = strDirectory + L"/seed.dat";
+	unsigned long long nTotal = TileSeeder::EstimateRegion(REGION).nTiles;
+	unsigned long long nFirstRun;
+	{
+		// slowly, so that it can be stopped halfway through
+		TileSeeder seeder(client, cache, strBaseUrl, strStatePath, 2, 100.0);
+		seeder.Start(REGION);
+		auto tmGiveUp = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		while (seeder.stats().nDownloaded < 20 && std::chrono::steady_clock::now() < tmGiveUp) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		}
+		seeder.Stop();
+		TileSeeder::Stats stats = seeder.stats();
+		CHECK(!stats.bRunning);
+		nFirstRun = stats.nDownloaded;
+		CHECK(nFirstRun >= 20 && nFirstRun < nTotal);
+		CHECK(std::filesystem::exists(strStatePath));
+	}
+
+	// as if the app was started again
+	TileSeeder seeder(client, cache, strBaseUrl, strStatePath, 4, 1000.0);
+	REQUIRE(seeder.Resume());
+	REQUIRE(WaitDone(seeder));
+	TileSeeder::Stats stats = seeder.stats();
+	CHECK_EQ(stats.nDone, nTotal);
+	CHECK_EQ(stats.nFailed, 0u);
+	// counters carry over; tiles just before the saved cursor may be skipped as cached
+	CHECK_EQ(stats.nDownloaded + stats.nSkipped, nTotal);
+	CHECK(stats.nDownloaded >= nFirstRun);
+	// nothing downloaded twice, except requests cancelled by Stop() after they were sent
+	CHECK(server.stats().nRequests <= nTotal + 2);
+	size_t nCached = 0;
+	ForEachTile(REGION, [&](TileCoords coords) { nCached += cache.Contains(TileCache::SourceId(strBaseUrl), coords); });
+	CHECK_EQ(nCached, nTotal);
+	CHECK(!std::filesystem::exists(strStatePath));
+}
+
+TEST(FailedTilesAreLeftToResume)
+{
+	TestHttpServer server;
+	HttpClient client(std::make_unique<SocketTransport>(4));
+	std::wstring strDirectory = Directory("FailedTilesAreLeftToResume");
+	TileCache cache(strDirectory, 16 * 1024 * 1024);
+	// a server which has none of these tiles; 404 doesn't open the circuit breaker
+	std::wstring strBaseUrl = server.Url("/status/404/{z}/{x}/{y}.png");
+	std::wstring strStatePath = strDirectory + L"/seed.dat";
+	SeedRegion region = REGION;
+	region.nMaxZoom = 11;
+	unsigned long long nTotal = TileSeeder::EstimateRegion(region).nTiles;
+
+	TileSeeder seeder(client, cache, strBaseUrl, strStatePath, 4, 1000.0);
+	seeder.Start(region);
+	REQUIRE(WaitDone(seeder));
+	TileSeeder::Stats stats = seeder.stats();
+	CHECK_EQ(stats.nDownloaded, 0u);
+	// rewound for retrying
+	CHECK_EQ(stats.nDone, 0u);
+	CHECK(std::filesystem::exists(strStatePath));
+	// error responses are not tiles
+	size_t nCached = 0;
+	ForEachTile(region, [&](TileCoords coords) { nCached += cache.Contains(TileCache::SourceId(strBaseUrl), coords); });
+	CHECK_EQ(nCached, 0u);
+
+	// resuming tries all of them again
+	REQUIRE(seeder.Resume());
+	REQUIRE(WaitDone(seeder));
+	CHECK_EQ(server.stats().nRequests, (unsigned)nTotal * 2);
+}
@@ -0,0 +1,250 @@
+// TrackLoaderTests.cpp: GPX and GeoJSON parsing, numbers against from_chars(), and large files
+// split into chunks at different places, which must give the same tracks as parsing in one go
+
+#include "Test.h"
+#include "TestSimd.h"
+#include "TrackLoader.h"
+
+#include <filesystem>
+#include <fstream>
+
+static bool Load(const std::string& str, TrackData& data, unsigned nThreads = 1)
+{
+	return LoadTracks(str.data(), str.size(), data, nThreads);
+}
+
+static bool SameTracks(const TrackData& a, const TrackData& b)
+{
+	return a.vecLat == b.vecLat && a.vecLng == b.vecLng && a.vecTrackStarts == b.vecTrackStarts &&
+		a.dMinLat == b.dMinLat && a.dMaxLat == b.dMaxLat && a.dMinLng == b.dMinLng && a.dMaxLng == b.dMaxLng;
+}
+
+static double FromChars(const std::string& str)
+{
+	double d = 0;
+	std::from_chars(str.data() + (str[0] == '+'), str.data() + str.size(), d);
+	return d;
+}
+
+// formats numbers as "{:.{}f}" and "{:e}" would, which the std::format stand-in in Portable.h lacks
+static std::string ToChars(double d, std::chars_format format, int nPrecision = -1)
+{
+	char buffer[400];
+	auto result = nPrecision >= 0 ? std::to_chars(buffer, buffer + sizeof(buffer), d, format, nPrecision) :
+		std::to_chars(buffer, buffer + sizeof(buffer), d, format);
+	return std::string(buffer, result.ptr);
+}
+
+TEST(Gpx)
+{
+	// attributes in either order and quotes, waypoints and elevations ignored, route points too
+	const std::string str =
+		"\xEF\xBB\xBF<?xml version=\"1.0\"?>\n"
+		"<gpx version=\"1.1\" creator=\"test\">\n"
+		"<wpt lat=\"1\" lon=\"2\"><name>not a track</name></wpt>\n"
+		"<trk><name>first</name><trkseg>\n"
+		"  <trkpt lat=\"48.1234567\" lon=\"11.5\"><ele>520.5</ele></trkpt>\n"
+		"  <trkpt lon='11.6' lat='48.2'/>\n"
+		"  <trkpt\tlat = \"-48.25\"\n lon=\"-11.75\" />\n"
+		"</trkseg><trkseg>\n"
+		"  <trkpt lat=\"10\" lon=\"20\"></trkpt>\n"
+		"</trkseg></trk>\n"
+		"<rte><rtept lat=\"1.5\" lon=\"179.25\"/><rtept lat=\"2.5\" lon=\"-179.5\"/></rte>\n"
+		"</gpx>\n";
+	TrackData data;
+	REQUIRE(Load(str, data));
+	CHECK_EQ(data.trackCount(), 3u);
+	CHECK_EQ(data.trackSize(0), 3u);
+	CHECK_EQ(data.trackSize(1), 1u);
+	CHECK_EQ(data.trackSize(2), 2u);
+	CHECK(data.vecLat == std::vector<double>({ 48.1234567, 48.2, -48.25, 10, 1.5, 2.5 }));
+	CHECK(data.vecLng == std::vector<double>({ 11.5, 11.6, -11.75, 20, 179.25, -179.5 }));
+	CHECK_EQ(data.dMinLat, -48.25);
+	CHECK_EQ(data.dMaxLat, 48.2);
+	CHECK_EQ(data.dMinLng, -179.5);
+	CHECK_EQ(data.dMaxLng, 179.25);
+
+	// points missing a coordinate are skipped, attributes only ending in lat/lon don't count
+	REQUIRE(Load("<gpx><trk><trkseg><trkpt lat=\"1\"/><trkpt xlat=\"3\" lat=\"4\" lon=\"5\" xlon=\"6\"/></trkseg></trk></gpx>", data));
+	CHECK(data.vecLat == std::vector<double>({ 4 }));
+	CHECK(data.vecLng == std::vector<double>({ 5 }));
+
+	CHECK(Load("<gpx></gpx>", data));
+	CHECK_EQ(data.trackCount(), 0u);
+	CHECK(data.dMinLat > data.dMaxLat);
+}
+
+TEST(GeoJson)
+{
+	const std::string str =
+		"{\"type\":\"FeatureCollection\",\"features\":[\n"
+		"{\"type\":\"Feature\",\"properties\":{\"name\":\"line\",\"bbox\":[1,2]},\n"
+		" \"geometry\":{\"type\":\"LineString\",\"coordinates\":[[11.5,48.1,520],[11.6, 48.2], [ -11.75 , -48.25 ]]}},\n"
+		"{\"type\":\"Feature\",\"geometry\":{\"type\":\"MultiLineString\",\"coordinates\":\n"
+		"  [[[1,2],[3,4]],\n   [[5,6]]]}},\n"
+		"{\"type\":\"Feature\",\"geometry\":{\"type\":\"Polygon\",\"coordinates\":[[[0,0],[1e1,0],[10,1.0E1],[0,0]]]}}\n"
+		"]}\n";
+	TrackData data;
+	REQUIRE(Load(str, data));
+	CHECK_EQ(data.trackCount(), 4u);
+	CHECK_EQ(data.trackSize(0), 3u);
+	CHECK_EQ(data.trackSize(1), 2u);
+	CHECK_EQ(data.trackSize(2), 1u);
+	CHECK_EQ(data.trackSize(3), 4u);
+	CHECK(data.vecLat == std::vector<double>({ 48.1, 48.2, -48.25, 2, 4, 6, 0, 0, 10, 0 }));
+	CHECK(data.vecLng == std::vector<double>({ 11.5, 11.6, -11.75, 1, 3, 5, 0, 10, 10, 0 }));
+	CHECK_EQ(data.dMinLng, -11.75);
+	CHECK_EQ(data.dMaxLat, 48.2);
+
+	// a bare geometry
+	REQUIRE(Load("[{\"coordinates\":[[1,2],[3,4]]}]", data));
+	CHECK_EQ(data.trackCount(), 1u);
+	CHECK_EQ(data.trackSize(0), 2u);
+
+	CHECK(!Load("", data));
+	CHECK(!Load("  \n", data));
+	CHECK(!Load("lat,lon\n1,2\n", data));
+}
+
+TEST(Numbers)
+{
+	// all kinds of numbers, as GeoJSON positions, must come out just as from_chars() parses them:
+	// short and long fractions, exponents, leading zeros and plus, integers beyond 2^53
+	std::mt19937_64 random(1);
+	std::vector<std::string> vecNumbers = { "0", "-0", "+1.5", "007.25", "5.", "-0.0000001", "9007199254740993",
+		"18446744073709551617", "0.30000000000000004", "1.7976931348623157e308", "4.9e-324", "12345678.12345678" };
+	for (int n = 0; n < 2000; n++) {
+		double d = std::uniform_real_distribution<double>(-1000, 1000)(random) * std::pow(10.0, (int)(n % 13) - 6);
+		switch (n % 5) {
+		case 0: vecNumbers.push_back(std::format("{}", d)); break;
+		case 1: vecNumbers.push_back(ToChars(d, std::chars_format::fixed, n % 23)); break;
+		case 2: vecNumbers.push_back(ToChars(d, std::chars_format::scientific)); break;
+		case 3: vecNumbers.push_back(std::format("{:.7f}", d / 10)); break;
+		default: vecNumbers.push_back(std::format("{:.30f}", d)); break;
+		}
+	}
+	std::string str = "{\"coordinates\":[";
+	for (const std::string& strNumber : vecNumbers) {
+		str += std::format("[{},{}],", strNumber, strNumber);
+	}
+	str.back() = ']';
+	str += "}";
+	TrackData data;
+	REQUIRE(Load(str, data));
+	REQUIRE(data.vecLat.size() == vecNumbers.size());
+	for (size_t n = 0; n < vecNumbers.size(); n++) {
+		if (!CHECK_EQ(data.vecLat[n], FromChars(vecNumbers[n]))) {
+			TestFail(__FILE__, __LINE__, vecNumbers[n]);
+		}
+	}
+}
+
+TEST(NumberAtEnd)
+{
+	// a truncated file ending in a long number, in a buffer of just its size, so that reading
+	// past the end shows up in sanitizer builds
+	for (const char* psz : { "{\"coordinates\":[[1.23456789012,2.1234567890123",
+			"<gpx><trk><trkseg><trkpt lat=\"1.23456789012\" lon=\"2.1234567890123" }) {
+		for (size_t szCut = 0; szCut < 8; szCut++) {
+			size_t szLength = strlen(psz) - szCut;
+			std::unique_ptr<char[]> pData(new char[szLength]);
+			memcpy(pData.get(), psz, szLength);
+			TrackData data;
+			REQUIRE(LoadTracks(pData.get(), szLength, data, 1));
+			REQUIRE(data.vecLat.size() == 1u);
+			// GeoJSON has longitude first
+			bool bGpx = psz[0] == '<';
+			CHECK_EQ(bGpx ? data.vecLat[0] : data.vecLng[0], 1.23456789012);
+			CHECK_EQ(bGpx ? data.vecLng[0] : data.vecLat[0], FromChars(std::string(psz + szLength - 15 + szCut, 15 - szCut)));
+		}
+	}
+}
+
+// a large file: tracks of varying length, with numbers of varying length, and a long stretch
+// without points in the middle of a track, so that some chunks have none
+static std::string MakeFile(bool bGpx, TrackData& expected)
+{
+	std::mt19937 random(bGpx ? 1 : 2);
+	std::string str;
+	str.reserve(40 * 1024 * 1024);
+	str += bGpx ? "<?xml version=\"1.0\"?>\n<gpx>\n" : "{\"type\":\"FeatureCollection\",\"features\":[\n";
+	expected = TrackData();
+	for (unsigned nTrack = 0; str.size() < 30 * 1024 * 1024; nTrack++) {
+		str += bGpx ? "<trk><trkseg>\n" : nTrack ? ",{\"type\":\"Feature\",\"geometry\":{\"type\":\"LineString\",\"coordinates\":[" :
+			"{\"type\":\"Feature\",\"geometry\":{\"type\":\"LineString\",\"coordinates\":[";
+		expected.vecTrackStarts.push_back(expected.vecLat.size());
+		unsigned nPoints = random() % 8 ? 1 + random() % 5000 : 1;
+		for (unsigned n = 0; n < nPoints; n++) {
+			std::string strLat = ToChars((int)(random() % 180000000 - 90000000) / 1e6, std::chars_format::fixed, 1 + random() % 9);
+			std::string strLng = ToChars((int)(random() % 360000000 - 180000000) / 1e6, std::chars_format::fixed, 1 + random() % 9);
+			expected.vecLat.push_back(FromChars(strLat));
+			expected.vecLng.push_back(FromChars(strLng));
+			if (bGpx) {
+				str += std::format("  <trkpt lat=\"{}\" lon=\"{}\"><ele>{}</ele></trkpt>\n", strLat, strLng, random() % 3000);
+			} else {
+				str += std::format("{}[{},{},{}]", n ? "," : "", strLng, strLat, random() % 3000);
+			}
+			if (nTrack == 30 && n == nPoints / 2) {
+				str += bGpx ? "<!--" + std::string(12 * 1024 * 1024, ' ') + "-->\n" : std::string(12 * 1024 * 1024, ' ');
+			}
+		}
+		str += bGpx ? "</trkseg></trk>\n" : "]}}\n";
+	}
+	str += bGpx ? "</gpx>\n" : "]}\n";
+	for (size_t n = 0; n < expected.vecLat.size(); n++) {
+		expected.dMinLat = std::min(expected.dMinLat, expected.vecLat[n]);
+		expected.dMaxLat = std::max(expected.dMaxLat, expected.vecLat[n]);
+		expected.dMinLng = std::min(expected.dMinLng, expected.vecLng[n]);
+		expected.dMaxLng = std::max(expected.dMaxLng, expected.vecLng[n]);
+	}
+	return str;
+}
+
+TEST(Chunks)
+{
+	for (bool bGpx : { true, false }) {
+		TrackData expected;
+		std::string str = MakeFile(bGpx, expected);
+		// chunks start at nominal positions which land anywhere, in numbers, tags, and the gap
+		for (unsigned nThreads : { 1, 2, 3, 4, 7 }) {
+			TrackData data;
+			REQUIRE(Load(str, data, nThreads));
+			if (!SameTracks(data, expected)) {
+				TestFail(__FILE__, __LINE__, std::format("{}, {} threads: {} points in {} tracks, expected {} in {}",
+					bGpx ? "GPX" : "GeoJSON", nThreads, data.vecLat.size(), data.trackCount(),
+					expected.vecLat.size(), expected.trackCount()));
+			}
+		}
+	}
+}
+
+TEST(SimdLevels)
+{
+	// byte scanning with and without SSE2
+	TrackData expected;
+	std::string str = MakeFile(true, expected);
+	for (SimdLevel level : TestSimdLevels()) {
+		SetSimdLevel(level);
+		TrackData data;
+		REQUIRE(Load(str, data, 2));
+		CHECK(SameTracks(data, expected));
+	}
+	SetSimdLevel(TestSimdLevels().back());
+}
+
+TEST(File)
+{
+	std::filesystem::path path = std::filesystem::path(TestTempDirectory()) / "track.gpx";
+	{
+		std::ofstream file(path, std::ios::binary);
+		file << "<gpx><trk><trkseg><trkpt lat=\"1\" lon=\"2\"/><trkpt lat=\"3\" lon=\"4\"/></trkseg></trk></gpx>";
+	}
+	TrackData data;
+	REQUIRE(LoadTracks(path.wstring(), data));
+	CHECK(data.vecLat == std::vector<double>({ 1, 3 }));
+	CHECK(data.vecLng == std::vector<double>({ 2, 4 }));
+
+	CHECK(!LoadTracks((std::filesystem::path(TestTempDirectory()) / "missing.gpx").wstring(), data));
+	std::ofstream(std::filesystem::path(TestTempDirectory()) / "empty.gpx");
+	CHECK(!LoadTracks((std::filesystem::path(TestTempDirectory()) / "empty.gpx").wstring(), data));
+}
@@ -0,0 +1,229 @@
+// VectorTileTests.cpp: decoding of tiles made by VectorTileWriter, of malformed ones, and
+// drawing them with VectorTileDecoder
+
+#include "Test.h"
+#include "VectorTileWriter.h"
+#include "VectorTileDecoder.h"
+
+static bool SamePoints(const VectorLayer& layer, unsigned nPath, const std::vector<VectorPoint>& vecPoints)
+{
+	if (layer.pathEnd(nPath) - layer.pathStart(nPath) != vecPoints.size()) {
+		return false;
+	}
+	for (size_t n = 0; n < vecPoints.size(); n++) {
+		const VectorPoint& pt = layer.vecPoints[layer.pathStart(nPath) + n];
+		if (pt.x != vecPoints[n].x || pt.y != vecPoints[n].y) {
+			return false;
+		}
+	}
+	return true;
+}
+
+TEST(RoundTrip)
+{
+	// a polygon with a hole, a line with a second part going back and outside the tile, points
+	const std::vector<VectorPoint> vecOuter = { { 0, 0 }, { 4096, 0 }, { 4096, 2048 }, { 0, 2048 } };
+	const std::vector<VectorPoint> vecHole = { { 100, 100 }, { 100, 200 }, { 200, 200 }, { 200, 100 } };
+	const std::vector<VectorPoint> vecLine = { { 10, 4000 }, { 3000, 20 }, { 3001, 21 } };
+	const std::vector<VectorPoint> vecBack = { { -64, 4160 }, { -10, -30 } };
+	const std::vector<VectorPoint> vecPoints = { { 7, 8 } };
+	VectorTileWriter writer;
+	writer.BeginLayer("water");
+	writer.AddFeature(VGT_POLYGON, { vecOuter, vecHole });
+	writer.EndLayer();
+	writer.BeginLayer("road", 512);
+	writer.AddFeature(VGT_LINESTRING, { vecLine, vecBack });
+	writer.AddFeature(VGT_POINT, { vecPoints, vecPoints });
+	// no geometry, which is dropped
+	writer.AddFeature(VGT_POINT, {});
+	writer.EndLayer();
+
+	VectorTile tile;
+	REQUIRE(DecodeVectorTile(writer.data().data(), writer.data().size(), tile));
+	REQUIRE(tile.vecLayers.size() == 2);
+	CHECK(tile.layer("building") == nullptr);
+
+	const VectorLayer* pWater = tile.layer("water");
+	REQUIRE(pWater);
+	CHECK_EQ(pWater->nExtent, 4096u);
+	REQUIRE(pWater->vecFeatures.size() == 1);
+	CHECK_EQ((int)pWater->vecFeatures[0].type, (int)VGT_POLYGON);
+	CHECK_EQ(pWater->vecFeatures[0].nFirstPath, 0u);
+	REQUIRE(pWater->vecFeatures[0].nPaths == 2);
+	// ClosePath adds no point
+	CHECK(SamePoints(*pWater, 0, vecOuter));
+	CHECK(SamePoints(*pWater, 1, vecHole));
+
+	const VectorLayer* pRoad = tile.layer("road");
+	REQUIRE(pRoad);
+	CHECK_EQ(pRoad->nExtent, 512u);
+	REQUIRE(pRoad->vecFeatures.size() == 2);
+	CHECK_EQ((int)pRoad->vecFeatures[0].type, (int)VGT_LINESTRING);
+	CHECK_EQ(pRoad->vecFeatures[0].nPaths, 2u);
+	CHECK(SamePoints(*pRoad, 0, vecLine));
+	CHECK(SamePoints(*pRoad, 1, vecBack));
+	CHECK_EQ((int)pRoad->vecFeatures[1].type, (int)VGT_POINT);
+	CHECK_EQ(pRoad->vecFeatures[1].nFirstPath, 2u);
+	CHECK_EQ(pRoad->vecFeatures[1].nPaths, 2u);
+	CHECK(SamePoints(*pRoad, 3, vecPoints));
+	CHECK_EQ(pRoad->vecPoints.size(), vecLine.size() + vecBack.size() + 2);
+
+	// an empty tile is valid too
+	VectorTile empty;
+	CHECK(DecodeVectorTile(nullptr, 0, empty));
+	CHECK(empty.vecLayers.empty());
+}
+
+TEST(UnknownFieldsAreSkipped)
+{
+	VectorTileWriter writer;
+	writer.BeginLayer("water");
+	writer.AddFeature(VGT_POLYGON, { { { 0, 0 }, { 10, 0 }, { 10, 10 } } });
+	writer.EndLayer();
+	std::vector<BYTE> vecTile;
+	// fields of every wire type, before and after the layer
+	VectorTileWriter::AppendVarintField(vecTile, 9, 1ull << 60);
+	VectorTileWriter::AppendKey(vecTile, 10, 1);
+	vecTile.insert(vecTile.end(), 8, 0xee);
+	vecTile.insert(vecTile.end(), writer.data().begin(), writer.data().end());
+	VectorTileWriter::AppendKey(vecTile, 11, 5);
+	vecTile.insert(vecTile.end(), 4, 0xee);
+	VectorTileWriter::AppendString(vecTile, 12, "extension");
+	// and a layer (field 3) with the wrong wire type
+	VectorTileWriter::AppendVarintField(vecTile, 3, 5);
+
+	VectorTile tile;
+	REQUIRE(DecodeVectorTile(vecTile.data(), vecTile.size(), tile));
+	REQUIRE(tile.vecLayers.size() == 1);
+	REQUIRE(tile.vecLayers[0].vecFeatures.size() == 1);
+	CHECK_EQ(tile.vecLayers[0].vecPoints.size(), 3u);
+	CHECK_EQ(tile.vecLayers[0].vecPoints[2].y, 10);
+
+	// unknown geometry types are kept, as unknown
+	writer = VectorTileWriter();
+	writer.BeginLayer("x");
+	writer.AddFeature((VectorGeometryType)9, { { { 1, 1 } } });
+	writer.EndLayer();
+	tile = VectorTile();
+	REQUIRE(DecodeVectorTile(writer.data().data(), writer.data().size(), tile));
+	REQUIRE(tile.vecLayers[0].vecFeatures.size() == 1);
+	CHECK_EQ((int)tile.vecLayers[0].vecFeatures[0].type, (int)VGT_UNKNOWN);
+}
+
+// a tile cut anywhere but between layers fails to decode, and never reads past the end
+TEST(Truncated)
+{
+	VectorTileWriter writer;
+	for (const char* pszLayer : { "water", "road", "building" }) {
+		writer.BeginLayer(pszLayer);
+		writer.AddFeature(VGT_POLYGON, { { { 0, 0 }, { 300, 0 }, { 300, 300 } }, { { 10, 10 }, { 10, 20 }, { 20, 20 } } });
+		writer.AddFeature(VGT_LINESTRING, { { { 5000, -100 }, { -100, 5000 } } });
+		writer.EndLayer();
+	}
+	const std::vector<BYTE>& vecTile = writer.data();
+	for (size_t nLength = 0; nLength <= vecTile.size(); nLength++) {
+		// a copy of just that much, so that reading past it is caught by sanitizers
+		std::vector<BYTE> vecPrefix(vecTile.begin(), vecTile.begin() + nLength);
+		VectorTile tile;
+		bool bValid = nLength == 0 || std::count(writer.layerEnds().begin(), writer.layerEnds().end(), nLength);
+		if (!CHECK_EQ(DecodeVectorTile(vecPrefix.data(), vecPrefix.size(), tile), bValid)) {
+			TestFail(__FILE__, __LINE__, std::format("cut at {} of {}", nLength, vecTile.size()));
+			return;
+		}
+	}
+}
+
+static bool DecodeGeometry(const std::vector<BYTE>& vecGeometry)
+{
+	std::vector<BYTE> vecFeature, vecLayer, vecTile;
+	VectorTileWriter::AppendBytes(vecFeature, 4, vecGeometry);
+	VectorTileWriter::AppendBytes(vecLayer, 2, vecFeature);
+	VectorTileWriter::AppendBytes(vecTile, 3, vecLayer);
+	VectorTile tile;
+	return DecodeVectorTile(vecTile.data(), vecTile.size(), tile);
+}
+
+TEST(Malformed)
+{
+	using Writer = VectorTileWriter;
+	// LineTo without MoveTo, an unknown command, a missing coordinate, and a valid one for comparison
+	CHECK(!DecodeGeometry({ (BYTE)Writer::Command(2, 1), 2, 2 }));
+	CHECK(!DecodeGeometry({ (BYTE)Writer::Command(3, 1), 2, 2 }));
+	CHECK(!DecodeGeometry({ (BYTE)Writer::Command(1, 1), 2 }));
+	CHECK(!DecodeGeometry({ (BYTE)Writer::Command(1, 2), 2, 2 }));
+	CHECK(DecodeGeometry({ (BYTE)Writer::Command(1, 1), 2, 2, (BYTE)Writer::Command(7, 1) }));
+
+	// groups (wire types 3 and 4), which MVT doesn't use, and varints of more than 64 bits
+	std::vector<BYTE> vecTile;
+	VectorTile tile;
+	Writer::AppendKey(vecTile, 1, 3);
+	CHECK(!DecodeVectorTile(vecTile.data(), vecTile.size(), tile));
+	vecTile = { 0x08 };
+	vecTile.insert(vecTile.end(), 10, 0xff);
+	vecTile.push_back(0x01);
+	CHECK(!DecodeVectorTile(vecTile.data(), vecTile.size(), tile));
+
+	// random garbage may or may not decode, but must not crash
+	std::mt19937 random(5);
+	for (unsigned nRun = 0; nRun < 2000; nRun++) {
+		std::vector<BYTE> vecGarbage(random() % 200);
+		for (BYTE& b : vecGarbage) {
+			b = (BYTE)random();
+		}
+		tile = VectorTile();
+		DecodeVectorTile(vecGarbage.data(), vecGarbage.size(), tile);
+	}
+}
+
+static UINT32 Pixel(const DecodedImage& image, unsigned x, unsigned y)
+{
+	return reinterpret_cast<const UINT32*>(image.vecPixels.data())[(size_t)y * image.nWidth + x];
+}
+
+TEST(DecoderDrawsStyledLayers)
+{
+	// a road over the left half covered with water, listed first but drawn on top by the style
+	VectorTileWriter writer;
+	writer.BeginLayer("road");
+	// at y = 192.5 px, so that a 1.5 px line covers all of row 192
+	writer.AddFeature(VGT_LINESTRING, { { { -100, 3080 }, { 5000, 3080 } } });
+	writer.EndLayer();
+	writer.BeginLayer("water");
+	writer.AddFeature(VGT_POLYGON, { { { 0, 0 }, { 2048, 0 }, { 2048, 4096 }, { 0, 4096 } } });
+	writer.EndLayer();
+	writer.BeginLayer("unstyled");
+	writer.AddFeature(VGT_POLYGON, { { { 0, 0 }, { 4096, 0 }, { 4096, 4096 } } });
+	writer.EndLayer();
+
+	VectorTileDecoder decoder(256, 256);
+	DecodedImage image;
+	REQUIRE(decoder.Decode(writer.data().data(), writer.data().size(), image));
+	REQUIRE(image.nWidth == 256 && image.nHeight == 256);
+	REQUIRE(image.vecPixels.size() == 256 * 256 * 4);
+	CHECK_EQ(Pixel(image, 10, 10), 0xffaad3dfu);
+	CHECK_EQ(Pixel(image, 127, 100), 0xffaad3dfu);
+	CHECK_EQ(Pixel(image, 128, 100), 0xfff2efe9u);
+	CHECK_EQ(Pixel(image, 255, 255), 0xfff2efe9u);
+	CHECK_EQ(Pixel(image, 10, 192), 0xffffffffu);
+	CHECK_EQ(Pixel(image, 200, 192), 0xffffffffu);
+	CHECK(Pixel(image, 200, 191) != 0xffffffffu && Pixel(image, 200, 191) != 0xfff2efe9u);
+	CHECK_EQ(Pixel(image, 200, 190), 0xfff2efe9u);
+
+	// drawn at twice the size, lines are twice as wide, and the background is premultiplied
+	VectorTileDecoder large(256, 512, { { "water", 0x80000000, 0, 0.f }, { "road", 0, 0xffff0000, 1.f } }, 0x80ffffff);
+	REQUIRE(large.Decode(writer.data().data(), writer.data().size(), image));
+	REQUIRE(image.nWidth == 512 && image.nHeight == 512);
+	CHECK_EQ(Pixel(image, 511, 0), 0x80808080u);
+	CHECK_EQ(Pixel(image, 20, 20), 0xc0404040u);
+	// the line is from 384 to 386 px
+	CHECK_EQ(Pixel(image, 400, 384), 0xffff0000u);
+	CHECK_EQ(Pixel(image, 400, 385), 0xffff0000u);
+	CHECK_EQ(Pixel(image, 400, 383), 0x80808080u);
+	CHECK_EQ(Pixel(image, 400, 386), 0x80808080u);
+
+	// an empty tile is just background; a gzip compressed one fails
+	REQUIRE(decoder.Decode(nullptr, 0, image));
+	CHECK_EQ(Pixel(image, 128, 128), 0xfff2efe9u);
+	const BYTE gzip[] = { 0x1f, 0x8b, 8, 0 };
+	CHECK(!decoder.Decode(gzip, sizeof(gzip), image));
+}
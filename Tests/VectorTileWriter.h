@@ -0,0 +1,111 @@
+#pragma once
+
+// VectorTileWriter.h: encoding of Mapbox Vector Tiles, the reverse of VectorTile.cpp, for making
+// tiles in tests and benchmarks.  Writes what real tiles have (version, feature ids, attribute
+// keys, values and tags) besides geometry, so that decoding goes through skipping them too
+
+#include "VectorTile.h"
+
+class VectorTileWriter
+{
+public:
+	// starts a layer; every layer has one attribute, class=<strName>, which all features have
+	void BeginLayer(const std::string& strName, unsigned nExtent = 4096)
+	{
+		m_vecLayer.clear();
+		AppendString(m_vecLayer, 1, strName);
+		AppendVarintField(m_vecLayer, 15, 2);
+		AppendVarintField(m_vecLayer, 5, nExtent);
+		m_strLayerName = strName;
+		m_nFeatureId = 1;
+	}
+
+	// adds a feature.  Each path is encoded as MoveTo and LineTo of the rest of its points, and
+	// polygon rings also get a ClosePath, as the spec requires
+	void AddFeature(VectorGeometryType type, const std::vector<std::vector<VectorPoint>>& vecPaths)
+	{
+		std::vector<BYTE> vecGeometry;
+		int x = 0, y = 0;
+		for (const std::vector<VectorPoint>& vecPath : vecPaths) {
+			for (size_t n = 0; n < vecPath.size(); n++) {
+				if (n == 0) {
+					AppendVarint(vecGeometry, Command(1, 1));
+				} else if (n == 1) {
+					AppendVarint(vecGeometry, Command(2, (unsigned)vecPath.size() - 1));
+				}
+				AppendVarint(vecGeometry, ZigZag(vecPath[n].x - x));
+				AppendVarint(vecGeometry, ZigZag(vecPath[n].y - y));
+				x = vecPath[n].x;
+				y = vecPath[n].y;
+			}
+			if (type == VGT_POLYGON) {
+				AppendVarint(vecGeometry, Command(7, 1));
+			}
+		}
+
+		std::vector<BYTE> vecFeature;
+		AppendVarintField(vecFeature, 1, m_nFeatureId++);
+		// tags: key 0, value 0, packed
+		AppendBytes(vecFeature, 2, std::vector<BYTE>{ 0, 0 });
+		AppendVarintField(vecFeature, 3, type);
+		AppendBytes(vecFeature, 4, vecGeometry);
+		AppendBytes(m_vecLayer, 2, vecFeature);
+	}
+
+	void EndLayer()
+	{
+		AppendString(m_vecLayer, 3, "class");
+		std::vector<BYTE> vecValue;
+		AppendString(vecValue, 1, m_strLayerName);
+		AppendBytes(m_vecLayer, 4, vecValue);
+		AppendBytes(m_vecTile, 3, m_vecLayer);
+		m_vecLayerEnds.push_back(m_vecTile.size());
+	}
+
+	// the tile so far
+	const std::vector<BYTE>& data() const { return m_vecTile; }
+	// offsets in data() where each layer ends, the only places the tile can be cut and still be valid
+	const std::vector<size_t>& layerEnds() const { return m_vecLayerEnds; }
+
+	// protocol buffer encoding, also for making malformed tiles by hand
+	static void AppendVarint(std::vector<BYTE>& vec, unsigned long long n)
+	{
+		for (; n >= 0x80; n >>= 7) {
+			vec.push_back((BYTE)(n | 0x80));
+		}
+		vec.push_back((BYTE)n);
+	}
+
+	static void AppendKey(std::vector<BYTE>& vec, unsigned nField, unsigned nWireType)
+	{
+		AppendVarint(vec, (nField << 3) | nWireType);
+	}
+
+	static void AppendVarintField(std::vector<BYTE>& vec, unsigned nField, unsigned long long n)
+	{
+		AppendKey(vec, nField, 0);
+		AppendVarint(vec, n);
+	}
+
+	static void AppendBytes(std::vector<BYTE>& vec, unsigned nField, const std::vector<BYTE>& vecValue)
+	{
+		AppendKey(vec, nField, 2);
+		AppendVarint(vec, vecValue.size());
+		vec.insert(vec.end(), vecValue.begin(), vecValue.end());
+	}
+
+	static void AppendString(std::vector<BYTE>& vec, unsigned nField, const std::string& str)
+	{
+		AppendBytes(vec, nField, std::vector<BYTE>(str.begin(), str.end()));
+	}
+
+	static unsigned Command(unsigned nCommand, unsigned nCount) { return nCommand | (nCount << 3); }
+	static unsigned ZigZag(int n) { return ((unsigned)n << 1) ^ (unsigned)(n >> 31); }
+
+private:
+	std::vector<BYTE> m_vecTile;
+	std::vector<BYTE> m_vecLayer;
+	std::vector<size_t> m_vecLayerEnds;
+	std::string m_strLayerName;
+	unsigned m_nFeatureId = 1;
+};
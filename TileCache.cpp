@@ -0,0 +1,412 @@
+// TileCache.cpp: TileCache class implementation
+
+#include "framework.h"
+#include "Util.h"
+#include "HttpClient.h"
+#include "TileCache.h"
+
+// file format identifiers, bump version on any change of the structures below
+static const unsigned INDEX_MAGIC = 0x54564d49;  // "IMVT"
+static const unsigned RECORD_MAGIC = 0x54564d52; // "RMVT"
+static const unsigned VERSION = 3;
+// slots per hash table bucket
+static const unsigned BUCKET_SIZE = 8;
+// expected average tile size, to size the hash table
+static const unsigned AVERAGE_TILE_SIZE = 8192;
+// records are aligned to this
+static const unsigned RECORD_ALIGN = 16;
+// longest ETag or Last-Modified value kept with a tile
+static const size_t MAX_VALIDATOR_LENGTH = 1024;
+
+struct TileCache::IndexHeader
+{
+	unsigned nMagic;
+	unsigned nVersion;
+	unsigned long long ullCapacity;
+	unsigned nBuckets;
+	unsigned nReserved;
+	// logical write position in the pack file
+	volatile unsigned long long ullHead;
+	unsigned long long ullReserved[4];
+};
+
+struct TileCache::IndexEntry
+{
+	TileKey key;
+	// logical position of the record in the pack file
+	unsigned long long ullPos;
+	unsigned nSourceId;
+	// length of the record after the header, 0 = empty slot
+	unsigned nLength;
+	// until when the tile is fresh, seconds since 1970 (0 = revalidate always)
+	unsigned nExpires;
+	// checksum of the above, written last
+	volatile unsigned nCheck;
+};
+
+// followed by nLength bytes of data, and then ETag and Last-Modified values
+struct TileCache::RecordHeader
+{
+	unsigned nMagic;
+	unsigned nLength;
+	TileKey key;
+	unsigned nSourceId;
+	unsigned short nETagLength, nLastModifiedLength;
+	// checksum of the data and validators, see DataChecksum()
+	unsigned nDataCheck;
+	unsigned nReserved;
+};
+
+// FNV-1a, good enough for hashing small things
+static unsigned Fnv1a(const void* pData, size_t szLength, unsigned nHash = 2166136261u)
+{
+	const BYTE* p = reinterpret_cast<const BYTE*>(pData);
+	for (size_t i = 0; i < szLength; i++) {
+		nHash = (nHash ^ p[i]) * 16777619u;
+	}
+	return nHash;
+}
+
+static unsigned EntryChecksum(TileKey key, unsigned long long ullPos, unsigned nSourceId, unsigned nLength, unsigned nExpires)
+{
+	unsigned nHash = Fnv1a(&key, sizeof(key));
+	nHash = Fnv1a(&ullPos, sizeof(ullPos), nHash);
+	nHash = Fnv1a(&nSourceId, sizeof(nSourceId), nHash);
+	nHash = Fnv1a(&nLength, sizeof(nLength), nHash);
+	nHash = Fnv1a(&nExpires, sizeof(nExpires), nHash);
+	// never 0, which is reserved for "being written"
+	return nHash ? nHash : 1;
+}
+
+static unsigned DataChecksum(const void* pData, size_t szLength)
+{
+	return Fnv1a(pData, szLength);
+}
+
+unsigned long long TileCache::RecordSize(size_t szLength)
+{
+	return (sizeof(RecordHeader) + szLength + RECORD_ALIGN - 1) / RECORD_ALIGN * RECORD_ALIGN;
+}
+
+TileCache::TileCache(std::wstring strDirectory, unsigned long long ullCapacity)
+	: m_ullCapacity(ullCapacity)
+{
+	// hash table size is a power of two, roughly matching the number of tiles that fit
+	m_nBuckets = 1;
+	while ((unsigned long long)m_nBuckets * BUCKET_SIZE * AVERAGE_TILE_SIZE < m_ullCapacity) {
+		m_nBuckets <<= 1;
+	}
+	unsigned long long ullIndexSize = sizeof(IndexHeader) + (unsigned long long)m_nBuckets * BUCKET_SIZE * sizeof(IndexEntry);
+
+	m_pIndex = reinterpret_cast<IndexHeader*>(MapFile(strDirectory + L"\\tiles.idx", ullIndexSize, m_hIndexFile, m_hIndexMapping));
+	m_pPack = reinterpret_cast<BYTE*>(MapFile(strDirectory + L"\\tiles.pack", m_ullCapacity, m_hPackFile, m_hPackMapping));
+	if (!m_pIndex || !m_pPack) {
+		PrintLnDebug(L"Failed to open tile cache in {}, caching disabled", strDirectory);
+		Close();
+		return;
+	}
+
+	// start from scratch if the index is from an incompatible version, or just new
+	// (files are zero-filled when extended)
+	if (m_pIndex->nMagic != INDEX_MAGIC || m_pIndex->nVersion != VERSION ||
+		m_pIndex->ullCapacity != m_ullCapacity || m_pIndex->nBuckets != m_nBuckets) {
+		PrintLnDebug(L"Initializing tile cache in {}", strDirectory);
+		memset(m_pIndex, 0, (size_t)ullIndexSize);
+		m_pIndex->ullCapacity = m_ullCapacity;
+		m_pIndex->nBuckets = m_nBuckets;
+		m_pIndex->nVersion = VERSION;
+		m_pIndex->nMagic = INDEX_MAGIC;
+	}
+}
+
+TileCache::~TileCache()
+{
+	Close();
+}
+
+unsigned TileCache::SourceId(const std::wstring& strBaseUrl)
+{
+	return Fnv1a(strBaseUrl.data(), strBaseUrl.size() * sizeof(wchar_t));
+}
+
+bool TileCache::Read(unsigned nSourceId, TileCoords coords, OnReadCallback fnOnRead)
+{
+	if (!isOpen()) {
+		return false;
+	}
+
+	// the record is copied out, so that writers are not held up while the callback decodes it.
+	// Decoding straight from the mapping, and checking afterwards whether the record was
+	// overwritten meanwhile as a seqlock reader would, does not work here: a writer fills the space
+	// it reserved without the lock, and decoders aren't written for input changing under them (a
+	// length read twice can differ the second time), which no check afterwards can undo.  The copy
+	// costs less than the checksum, which reads all of the record anyway, and next to decoding
+	// both are small.  A buffer per thread, as reads happen on decode threads, one tile after another
+	static thread_local std::vector<BYTE> t_vecData;
+	unsigned nDataCheck;
+	size_t szLength, szTotal;
+	{
+		std::shared_lock lock(m_mutex);
+		IndexEntry* pEntry = Find(nSourceId, coords.key());
+		RecordHeader* pRecord = pEntry ? Record(*pEntry) : nullptr;
+		if (!pRecord) {
+			return false;
+		}
+		nDataCheck = pRecord->nDataCheck;
+		szLength = pRecord->nLength;
+		szTotal = pEntry->nLength;
+		t_vecData.resize(szTotal);
+		memcpy(t_vecData.data(), pRecord + 1, szTotal);
+	}
+	// a record torn by a crash while it was being written has an index entry which looks fine
+	// if the entry made it to disk and the data didn't all make it
+	if (DataChecksum(t_vecData.data(), szTotal) != nDataCheck) {
+		PrintLnDebug(L"Tile cache record checksum mismatch for tile {}/{}/{}", coords.zoom, coords.x, coords.y);
+		return false;
+	}
+	fnOnRead(t_vecData.data(), szLength);
+	return true;
+}
+
+bool TileCache::Contains(unsigned nSourceId, TileCoords coords, long long* pllExpires)
+{
+	if (!isOpen()) {
+		return false;
+	}
+
+	std::shared_lock lock(m_mutex);
+	IndexEntry* pEntry = Find(nSourceId, coords.key());
+	if (pEntry && pllExpires) {
+		*pllExpires = pEntry->nExpires;
+	}
+	return pEntry != nullptr;
+}
+
+bool TileCache::ReadCacheInfo(unsigned nSourceId, TileCoords coords, HttpCacheInfo& cacheInfo)
+{
+	if (!isOpen()) {
+		return false;
+	}
+
+	std::shared_lock lock(m_mutex);
+	IndexEntry* pEntry = Find(nSourceId, coords.key());
+	RecordHeader* pRecord = pEntry ? Record(*pEntry) : nullptr;
+	if (!pRecord) {
+		return false;
+	}
+	const char* pValidators = reinterpret_cast<const char*>(pRecord + 1) + pRecord->nLength;
+	cacheInfo.strETag.assign(pValidators, pRecord->nETagLength);
+	cacheInfo.strLastModified.assign(pValidators + pRecord->nETagLength, pRecord->nLastModifiedLength);
+	cacheInfo.llExpires = pEntry->nExpires;
+	return true;
+}
+
+void TileCache::Write(unsigned nSourceId, TileCoords coords, const void* pData, size_t szLength, const HttpCacheInfo* pCacheInfo)
+{
+	// validators which are unreasonably long (they are short quoted hashes or dates normally) are
+	// not kept, tiles will just be downloaded again in full when they expire
+	std::string_view svETag, svLastModified;
+	unsigned nExpires = 0;
+	if (pCacheInfo) {
+		if (pCacheInfo->strETag.size() <= MAX_VALIDATOR_LENGTH) {
+			svETag = pCacheInfo->strETag;
+		}
+		if (pCacheInfo->strLastModified.size() <= MAX_VALIDATOR_LENGTH) {
+			svLastModified = pCacheInfo->strLastModified;
+		}
+		nExpires = (unsigned)std::clamp(pCacheInfo->llExpires, 0ll, (long long)UINT_MAX);
+	}
+	size_t szTotal = szLength + svETag.size() + svLastModified.size();
+
+	// refuse to store empty or unreasonably large tiles
+	unsigned long long ullSize = RecordSize(szTotal);
+	if (!isOpen() || !szLength || ullSize > m_ullCapacity / 16) {
+		return;
+	}
+
+	TileKey key = coords.key();
+	unsigned long long ullPos, ullOffset;
+	{
+		std::unique_lock lock(m_mutex);
+		// find physical position for the record; records are never split, so skip
+		// the remainder of the pack file if the record doesn't fit there
+		ullPos = m_pIndex->ullHead;
+		ullOffset = ullPos % m_ullCapacity;
+		if (ullOffset + ullSize > m_ullCapacity) {
+			ullPos += m_ullCapacity - ullOffset;
+			ullOffset = 0;
+		}
+
+		// advance write position first, this invalidates records which are about to be overwritten.
+		// The space is ours then, and is written without the lock: nothing refers to it until
+		// the index entry below
+		m_pIndex->ullHead = ullPos + ullSize;
+		MemoryBarrier();
+	}
+
+	// write the record, with a checksum of its data
+	RecordHeader* pRecord = reinterpret_cast<RecordHeader*>(m_pPack + ullOffset);
+	pRecord->nMagic = RECORD_MAGIC;
+	pRecord->nLength = (unsigned)szLength;
+	pRecord->key = key;
+	pRecord->nSourceId = nSourceId;
+	pRecord->nETagLength = (unsigned short)svETag.size();
+	pRecord->nLastModifiedLength = (unsigned short)svLastModified.size();
+	char* pRecordData = reinterpret_cast<char*>(pRecord + 1);
+	memcpy(pRecordData, pData, szLength);
+	// not memcpy(), which must not be given the null data() of an empty view
+	std::copy(svETag.begin(), svETag.end(), pRecordData + szLength);
+	std::copy(svLastModified.begin(), svLastModified.end(), pRecordData + szLength + svETag.size());
+	pRecord->nDataCheck = DataChecksum(pRecordData, szTotal);
+	// dirty pages of a mapping are written out in no particular order, so the index entry could
+	// reach the disk before the record does.  Have the record written to the file first
+	FlushViewOfFile(pRecord, (SIZE_T)ullSize);
+
+	std::unique_lock lock(m_mutex);
+	// find a slot for the index entry: the one with the same tile, an empty or invalid one,
+	// or otherwise the one pointing to the oldest record
+	IndexEntry* pBucket = Bucket(nSourceId, key);
+	IndexEntry* pSlot = nullptr;
+	for (unsigned i = 0; i < BUCKET_SIZE; i++) {
+		IndexEntry& entry = pBucket[i];
+		if (!IsValid(entry) || (entry.key == key && entry.nSourceId == nSourceId)) {
+			pSlot = &entry;
+			break;
+		}
+		if (!pSlot || entry.ullPos < pSlot->ullPos) {
+			pSlot = &entry;
+		}
+	}
+
+	// and write the index entry, checksum last
+	pSlot->nCheck = 0;
+	MemoryBarrier();
+	pSlot->key = key;
+	pSlot->ullPos = ullPos;
+	pSlot->nSourceId = nSourceId;
+	pSlot->nLength = (unsigned)szTotal;
+	pSlot->nExpires = nExpires;
+	MemoryBarrier();
+	pSlot->nCheck = EntryChecksum(key, ullPos, nSourceId, (unsigned)szTotal, nExpires);
+}
+
+bool TileCache::Refresh(unsigned nSourceId, TileCoords coords, long long llExpires)
+{
+	if (!isOpen()) {
+		return false;
+	}
+
+	// the entry is rewritten like a new one, checksum last
+	std::unique_lock lock(m_mutex);
+	IndexEntry* pEntry = Find(nSourceId, coords.key());
+	if (!pEntry) {
+		return false;
+	}
+	pEntry->nCheck = 0;
+	MemoryBarrier();
+	pEntry->nExpires = (unsigned)std::clamp(llExpires, 0ll, (long long)UINT_MAX);
+	MemoryBarrier();
+	pEntry->nCheck = EntryChecksum(pEntry->key, pEntry->ullPos, pEntry->nSourceId, pEntry->nLength, pEntry->nExpires);
+	return true;
+}
+
+void* TileCache::MapFile(const std::wstring& strPath, unsigned long long ullSize, HANDLE& hFile, HANDLE& hMapping)
+{
+	hFile = CreateFile(strPath.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+		OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return nullptr;
+	}
+
+	// resize file if needed; newly allocated space is zero-filled.  Index would be
+	// reinitialized in this case because the capacity won't match
+	LARGE_INTEGER liSize;
+	if (!GetFileSizeEx(hFile, &liSize)) {
+		return nullptr;
+	}
+	if ((unsigned long long)liSize.QuadPart != ullSize) {
+		liSize.QuadPart = ullSize;
+		if (!SetFilePointerEx(hFile, liSize, nullptr, FILE_BEGIN) || !SetEndOfFile(hFile)) {
+			return nullptr;
+		}
+	}
+
+	hMapping = CreateFileMapping(hFile, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+	if (!hMapping) {
+		return nullptr;
+	}
+	return MapViewOfFile(hMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+}
+
+void TileCache::Close()
+{
+	// and the files to the disk, with whatever the system hasn't written out yet
+	if (m_pIndex && m_pPack) {
+		FlushViewOfFile(m_pPack, 0);
+		FlushViewOfFile(m_pIndex, 0);
+		FlushFileBuffers(m_hPackFile);
+		FlushFileBuffers(m_hIndexFile);
+	}
+	if (m_pIndex) {
+		UnmapViewOfFile(m_pIndex);
+		m_pIndex = nullptr;
+	}
+	if (m_pPack) {
+		UnmapViewOfFile(m_pPack);
+		m_pPack = nullptr;
+	}
+	for (HANDLE* pHandle : { &m_hIndexMapping, &m_hPackMapping }) {
+		if (*pHandle) {
+			CloseHandle(*pHandle);
+			*pHandle = nullptr;
+		}
+	}
+	for (HANDLE* pHandle : { &m_hIndexFile, &m_hPackFile }) {
+		if (*pHandle != INVALID_HANDLE_VALUE) {
+			CloseHandle(*pHandle);
+			*pHandle = INVALID_HANDLE_VALUE;
+		}
+	}
+}
+
+TileCache::IndexEntry* TileCache::Bucket(unsigned nSourceId, TileKey key)
+{
+	unsigned nHash = Fnv1a(&key, sizeof(key), nSourceId);
+	IndexEntry* pEntries = reinterpret_cast<IndexEntry*>(m_pIndex + 1);
+	return pEntries + (size_t)(nHash & (m_nBuckets - 1)) * BUCKET_SIZE;
+}
+
+bool TileCache::IsValid(const IndexEntry& entry)
+{
+	if (!entry.nLength || entry.nCheck != EntryChecksum(entry.key, entry.ullPos, entry.nSourceId, entry.nLength, entry.nExpires)) {
+		return false;
+	}
+	// record must be entirely written (before head), and not overwritten (within capacity of head)
+	unsigned long long ullHead = m_pIndex->ullHead;
+	unsigned long long ullEnd = entry.ullPos + RecordSize(entry.nLength);
+	return ullEnd <= ullHead && entry.ullPos + m_ullCapacity >= ullHead;
+}
+
+TileCache::IndexEntry* TileCache::Find(unsigned nSourceId, TileKey key)
+{
+	IndexEntry* pBucket = Bucket(nSourceId, key);
+	for (unsigned i = 0; i < BUCKET_SIZE; i++) {
+		IndexEntry& entry = pBucket[i];
+		if (entry.key == key && entry.nSourceId == nSourceId && IsValid(entry)) {
+			return &entry;
+		}
+	}
+	return nullptr;
+}
+
+TileCache::RecordHeader* TileCache::Record(const IndexEntry& entry)
+{
+	// double check record header too, in case something went wrong with the index
+	RecordHeader* pRecord = reinterpret_cast<RecordHeader*>(m_pPack + entry.ullPos % m_ullCapacity);
+	if (pRecord->nMagic != RECORD_MAGIC || pRecord->key != entry.key || pRecord->nSourceId != entry.nSourceId ||
+		(unsigned long long)pRecord->nLength + pRecord->nETagLength + pRecord->nLastModifiedLength != entry.nLength) {
+		PrintLnDebug(L"Tile cache record mismatch at {}", entry.ullPos);
+		return nullptr;
+	}
+	return pRecord;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+// TileCache.h: persistent on-disk cache of tile images, independent from WinInet's own cache.
+// Consists of two files, both memory-mapped in their entirety:
+//  - a pack file of fixed capacity, used as a circular append-only log of tile records
+//    (small header + image bytes).  When the end is reached, writing wraps around and
+//    starts overwriting the oldest records, which bounds total size
+//  - an index file, which is a hash table of (source, zoom, x, y) -> record position.
+//    Hash table is set-associative: every key maps to a bucket of a few slots, and
+//    on insert the oldest slot in the bucket is replaced if there's no free one
+// Records also keep HTTP validators (ETag, Last-Modified) of tiles, and index entries their expiry,
+// so that stale tiles can be told apart without touching the pack file, and revalidated.
+// Positions in the pack file are "logical", that is they grow forever and the physical
+// position is logical modulo capacity; a record is valid as long as it is not further
+// than capacity behind the write position.  Write position is advanced before the data
+// is written, records are flushed to the file before their index entries are written, and
+// both index entries and record data are checksummed, so whichever parts of them reach the disk
+// if the application or the system crashes, the worst outcome is a lost tile and not a corrupt one.
+// Thread safe; no more than one instance per app should be necessary.
+
+#include "TileCoords.h"
+
+struct HttpCacheInfo;
+
+class TileCache
+{
+public:
+	// strDirectory must exist and be writable.  ullCapacity is the size of pack file in bytes,
+	// which is preallocated on disk.  If the files cannot be opened/created, the cache is
+	// disabled, i. e. all reads miss and all writes do nothing
+	TileCache(std::wstring strDirectory, unsigned long long ullCapacity = DEFAULT_CAPACITY);
+	~TileCache();
+
+	// no copy/assignment
+	TileCache& operator=(const TileCache&) = delete;
+	TileCache(const TileCache&) = delete;
+
+	static const unsigned long long DEFAULT_CAPACITY = 256ull * 1024 * 1024;
+
+	// callback type for a cache hit.  pData points to a copy of the tile, which is only valid for
+	// the duration of the callback; the cache is not locked meanwhile
+	typedef std::function<void(const void* pData, size_t szLength)> OnReadCallback;
+
+	// gets a numeric source identifier for a tile server base URL, to be used
+	// to separate tiles from different servers in the cache
+	static unsigned SourceId(const std::wstring& strBaseUrl);
+
+	// looks up a tile, and if found and intact, calls fnOnRead synchronously and returns true
+	bool Read(unsigned nSourceId, TileCoords coords, OnReadCallback fnOnRead);
+
+	// checks whether a tile is in the cache, without reading it.  The tile might still be
+	// evicted before it is actually read.  If pllExpires is given, it is set to until when the
+	// tile is fresh (see HttpCacheInfo::llExpires)
+	bool Contains(unsigned nSourceId, TileCoords coords, long long* pllExpires = nullptr);
+
+	// gets HTTP validators and expiry of a tile, for revalidating it; returns false if not found
+	bool ReadCacheInfo(unsigned nSourceId, TileCoords coords, HttpCacheInfo& cacheInfo);
+
+	// stores a tile, possibly overwriting an older version of it and evicting
+	// the oldest tiles from the cache.  pCacheInfo has HTTP caching headers it came with, if any
+	void Write(unsigned nSourceId, TileCoords coords, const void* pData, size_t szLength, const HttpCacheInfo* pCacheInfo = nullptr);
+
+	// sets new expiry for a tile which was revalidated, in place; returns false if not found
+	bool Refresh(unsigned nSourceId, TileCoords coords, long long llExpires);
+
+	bool isOpen() const { return m_pIndex != nullptr; }
+
+private:
+	struct IndexHeader;
+	struct IndexEntry;
+	struct RecordHeader;
+
+	HANDLE m_hIndexFile = INVALID_HANDLE_VALUE, m_hIndexMapping = nullptr;
+	HANDLE m_hPackFile = INVALID_HANDLE_VALUE, m_hPackMapping = nullptr;
+	IndexHeader* m_pIndex = nullptr;
+	BYTE* m_pPack = nullptr;
+	unsigned long long m_ullCapacity;
+	unsigned m_nBuckets = 0;
+
+	// readers lock it shared, writers exclusive
+	std::shared_mutex m_mutex;
+
+	// maps a file of given size, (re)creating it if needed; returns pointer to mapped view or null
+	static void* MapFile(const std::wstring& strPath, unsigned long long ullSize, HANDLE& hFile, HANDLE& hMapping);
+	void Close();
+
+	// size of a record in the pack file, including header and alignment
+	static unsigned long long RecordSize(size_t szLength);
+
+	IndexEntry* Bucket(unsigned nSourceId, TileKey key);
+	// checks if an index entry is valid and points to a record that was not overwritten yet
+	bool IsValid(const IndexEntry& entry);
+	// finds a valid index entry for a tile, null if there is none.  Must be called under the lock
+	IndexEntry* Find(unsigned nSourceId, TileKey key);
+	// gets the record an index entry points to, double checking its header, null on mismatch
+	RecordHeader* Record(const IndexEntry& entry);
+};
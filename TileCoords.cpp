@@ -0,0 +1,63 @@
+// TileCoords.cpp: TileCoords implementation
+
+#include "framework.h"
+#include "TileCoords.h"
+
+// spreads lower 28 bits of n to even bits of the result
+static unsigned long long SpreadBits(unsigned n)
+{
+	unsigned long long v = n & 0x0fffffff;
+	v = (v | (v << 16)) & 0x0000ffff0000ffffull;
+	v = (v | (v << 8)) & 0x00ff00ff00ff00ffull;
+	v = (v | (v << 4)) & 0x0f0f0f0f0f0f0f0full;
+	v = (v | (v << 2)) & 0x3333333333333333ull;
+	v = (v | (v << 1)) & 0x5555555555555555ull;
+	return v;
+}
+
+// reverse of SpreadBits(), collects even bits of v
+static unsigned CompactBits(unsigned long long v)
+{
+	v &= 0x5555555555555555ull;
+	v = (v | (v >> 1)) & 0x3333333333333333ull;
+	v = (v | (v >> 2)) & 0x0f0f0f0f0f0f0f0full;
+	v = (v | (v >> 4)) & 0x00ff00ff00ff00ffull;
+	v = (v | (v >> 8)) & 0x0000ffff0000ffffull;
+	v = (v | (v >> 16)) & 0x00000000ffffffffull;
+	return (unsigned)v;
+}
+
+TileKey TileCoords::MakeKey(unsigned x, unsigned y, unsigned zoom)
+{
+	_ASSERT(x < (1u << 28) && y < (1u << 28) && zoom < 256);
+	return ((TileKey)zoom << 56) | SpreadBits(x) | (SpreadBits(y) << 1);
+}
+
+TileCoords TileCoords::FromKey(TileKey key)
+{
+	TileKey morton = key & 0x00ffffffffffffffull;
+	return TileCoords(CompactBits(morton), CompactBits(morton >> 1), (unsigned)(key >> 56));
+}
+
+std::wstring FormatTileUrl(const std::wstring& strUrl, TileCoords coords)
+{
+	if (strUrl.find(L'{') == std::wstring::npos) {
+		return std::format(L"{}/{}/{}/{}.png", strUrl, coords.zoom, coords.x, coords.y);
+	}
+	std::wstring strResult;
+	strResult.reserve(strUrl.size() + 16);
+	for (size_t i = 0; i < strUrl.size(); i++) {
+		if (strUrl.compare(i, 3, L"{z}") == 0) {
+			strResult += std::to_wstring(coords.zoom);
+		} else if (strUrl.compare(i, 3, L"{x}") == 0) {
+			strResult += std::to_wstring(coords.x);
+		} else if (strUrl.compare(i, 3, L"{y}") == 0) {
+			strResult += std::to_wstring(coords.y);
+		} else {
+			strResult += strUrl[i];
+			continue;
+		}
+		i += 2;
+	}
+	return strResult;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+// TileCoords.h: coordinates of a map tile, and their packed form for use as a key
+
+// Tiles are indexed by a packed 64-bit key: zoom in the top 8 bits, and x/y interleaved
+// bitwise (Morton order, aka Z-order curve) in the lower 56 bits.  This makes tiles of one
+// zoom level contiguous in key order, and tiles close to each other on the map mostly close
+// to each other in it too.  Building the key is a few bit operations and looking it up
+// allocates nothing.  (TileManager keeps tiles in a hash table by key, see TileMap.h)
+typedef unsigned long long TileKey;
+
+struct TileCoords
+{
+	unsigned x;
+	unsigned y;
+	unsigned zoom;
+	TileCoords(unsigned x, unsigned y, unsigned zoom) : x(x), y(y), zoom(zoom) {}
+
+	// packs/unpacks coords into a TileKey.  x and y must fit into 28 bits,
+	// which is plenty for any real zoom level (up to 28)
+	TileKey key() const { return MakeKey(x, y, zoom); }
+	static TileKey MakeKey(unsigned x, unsigned y, unsigned zoom);
+	static TileCoords FromKey(TileKey key);
+};
+
+// builds a tile URL from a template with {z}, {x} and {y} placeholders, e. g.
+// https://example.com/tiles/{z}/{x}/{y}.pbf.  A URL without any placeholders is taken
+// as a base URL (without trailing slash) in the standard .../{z}/{x}/{y}.png layout
+std::wstring FormatTileUrl(const std::wstring& strUrl, TileCoords coords);
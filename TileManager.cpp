@@ -2,181 +2,914 @@
 
 #include "framework.h"
 #include "Util.h"
+#include "Trace.h"
 #include "HttpClient.h"
-#include "D2DWindow.h"
 #include "TileManager.h"
+#include "TileCache.h"
+#include "DecodePool.h"
+#include "PngDecoder.h"
 
-TileManager::TileManager(HttpClient& httpClient, std::wstring strBaseUrl, unsigned nTileSize, OnTileLoadedCallback fnTileLoadedCallback)
-	: m_httpClient(httpClient), m_strBaseUrl(strBaseUrl), m_nTileSize(nTileSize), m_fnTileLoadedCallback(fnTileLoadedCallback)
+TileManager::TileManager(HttpClient& httpClient, TileCache& tileCache, DecodePool& decodePool, std::wstring strBaseUrl, unsigned nTileSize, OnTileLoadedCallback fnTileLoadedCallback,
+	OnCompletionCallback fnCompletionCallback)
+	: m_httpClient(httpClient), m_tileCache(tileCache), m_decodePool(decodePool), m_nTileSize(nTileSize), m_fnTileLoadedCallback(fnTileLoadedCallback),
+	m_fnCompletionCallback(fnCompletionCallback),
+	m_scheduler(httpClient, [this](TileCoords coords, unsigned nLayer) { return GetTileURL(coords, nLayer); })
 {
-	HRESULT hr = CoCreateInstance(CLSID_WICImagingFactory,
-		nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(m_pWICFactory.GetAddressOf()));
-	_ASSERT(SUCCEEDED(hr));
+	AddLayer(strBaseUrl);
+	// don't download faster than we can decode
+	m_scheduler.SetThrottle([this]() { return m_decodePool.isSaturated(); });
 }
 
 TileManager::~TileManager()
 {
+	Shutdown();
+}
+
+void TileManager::Shutdown()
+{
+	{
+		// waits for callbacks in progress
+		std::unique_lock lock(m_shutdownMutex);
+		m_bShuttingDown = true;
+	}
+	// no new requests or decode jobs after this: jobs still running finish their layers as
+	// cancelled.  This waits for request callbacks already under way too, which may still submit
+	// decode jobs, so those are waited for after it.  Requests which got past the check just
+	// before are cancelled again when the scheduler is destroyed
+	m_scheduler.CancelAll();
+	for (unsigned n; (n = m_nDecodeJobs) != 0; ) {
+		m_nDecodeJobs.wait(n);
+	}
+}
+
+void TileManager::SetDecoder(std::unique_ptr<ImageDecoder> pDecoder, unsigned nLayer)
+{
+	m_vecLayers[nLayer]->pDecoder = std::move(pDecoder);
+}
+
+unsigned TileManager::AddLayer(std::wstring strUrl, float fOpacity)
+{
+	auto pLayer = std::make_unique<Layer>();
+	pLayer->strUrl = strUrl;
+	pLayer->nSourceId = TileCache::SourceId(strUrl);
+#ifdef _WIN32
+	pLayer->pDecoder = std::make_unique<WicImageDecoder>();
+#else
+	pLayer->pDecoder = std::make_unique<PngDecoder>();
+#endif
+	pLayer->fOpacity = std::clamp(fOpacity, 0.f, 1.f);
+	m_vecLayers.push_back(std::move(pLayer));
+	return (unsigned)m_vecLayers.size() - 1;
+}
+
+void TileManager::SetLayerOpacity(unsigned nLayer, float fOpacity)
+{
+	m_vecLayers[nLayer]->fOpacity = std::clamp(fOpacity, 0.f, 1.f);
+	// tiles still loading pick up the new opacity when they are composited; ready ones are loaded
+	// again.  Their layers are mostly in the disk cache, so this is just decoding
+	for (Tile* pTile = m_pLruHead; pTile; pTile = pTile->m_pLruNext) {
+		if (pTile->state() == TS_READY && !pTile->m_bComposing) {
+			LoadTile(*pTile, false);
+		}
+	}
+	m_scheduler.Dispatch();
 }
 
 void TileManager::SetRenderTarget(ComPtr<ID2D1RenderTarget> pRenderTarget)
 {
 	if (!m_pRenderTarget || m_pRenderTarget.Get() != pRenderTarget.Get()) {
 		InvalidateRenderTarget();
+		std::lock_guard lock(m_renderTargetMutex);
 		m_pRenderTarget = pRenderTarget;
 	}
 }
 
 void TileManager::InvalidateRenderTarget()
 {
-	// remove all tiles that are already loaded
-	std::erase_if(m_mapTiles, [](auto kv) { return kv.second.state() == TS_READY; });
+	// remove all tiles that are already loaded.  Jobs still working on any of them just have
+	// their results dropped, and so do jobs which made bitmaps for the old render target (see
+	// ProcessCompletions())
+	for (Tile* pTile = m_pLruHead; pTile; ) {
+		Tile& tile = *pTile;
+		pTile = pTile->m_pLruNext;
+		if (tile.state() == TS_READY) {
+			EraseTile(tile);
+		}
+	}
+	// visible tiles among them too, so the next UpdateView() needs to look at all of them
+	m_bViewLoaded = false;
+	std::lock_guard lock(m_renderTargetMutex);
 	m_pRenderTarget.Reset();
+	m_nRenderTarget++;
 }
 
-std::wstring TileManager::GetTileURL(TileCoords coords)
+std::wstring TileManager::GetTileURL(TileCoords coords, unsigned nLayer)
 {
-	return std::format(L"{}/{}/{}/{}.png", m_strBaseUrl, coords.zoom, coords.x, coords.y);
+	return FormatTileUrl(m_vecLayers[nLayer]->strUrl, coords);
 }
 
-Tile& TileManager::AddTile(TileCoords coords)
+Tile& TileManager::AddTile(TileCoords coords, bool bDispatch)
 {
 	// create a Tile instance, if not exists
 	// if already exists and its state is not error, then don't need to do anything;
 	// otherwise kick off loading
-	std::wstring url = GetTileURL(coords);
-	auto [pos, success] = m_mapTiles.try_emplace(url, coords, url);
-	if (success || pos->second.state() == TS_ERROR) {
-		LoadTile(pos->second);
+	auto [pTile, success] = m_mapTiles.TryEmplace(coords.key(), coords);
+	Tile& tile = *pTile;
+	if (success) {
+		tile.m_nGeneration = ++m_nLastGeneration;
+		tile.m_szBytes = TILE_OVERHEAD;
+		m_szBytes += tile.m_szBytes;
+	}
+	TouchTile(tile, success);
+	if (tile.state() == TS_READY) {
+		m_nHits++;
+	} else {
+		m_nMisses++;
+	}
+	if (tile.m_bPrefetched) {
+		// speculation paid off, whether the tile has finished loading or not
+		tile.m_bPrefetched = false;
+		m_nPrefetchHits++;
+	}
+	if (success || (tile.state() == TS_ERROR && !tile.m_bComposing && m_httpClient.now() >= tile.m_tmRetry)) {
+		if (tile.m_nFailures) {
+			m_nRetries++;
+		}
+		LoadTile(tile, bDispatch);
 	}
-	return pos->second;
+	return tile;
 }
 
 Tile* TileManager::GetTile(TileCoords coords)
 {
-	std::wstring url = GetTileURL(coords);
-	auto tile = m_mapTiles.find(url);
-	if (tile != m_mapTiles.end()) {
-		return &tile->second;
+	Tile* pTile = m_mapTiles.Find(coords.key());
+	if (pTile) {
+		TouchTile(*pTile);
+	}
+	return pTile;
+}
+
+Tile* TileManager::GetReadyAncestor(TileCoords coords, unsigned nMaxLevels, unsigned& nLevels)
+{
+	for (unsigned nLevel = 1; nLevel <= nMaxLevels && nLevel <= coords.zoom; nLevel++) {
+		Tile* pTile = m_mapTiles.Find(TileCoords::MakeKey(coords.x >> nLevel, coords.y >> nLevel, coords.zoom - nLevel));
+		if (pTile && pTile->state() == TS_READY) {
+			// being used, so keep it around
+			TouchTile(*pTile);
+			nLevels = nLevel;
+			return pTile;
+		}
 	}
 	return nullptr;
 }
 
-void TileManager::TrimTiles(unsigned x, unsigned y, unsigned width, unsigned height)
+void TileManager::UpdateView(unsigned zoom, unsigned x, unsigned y, unsigned width, unsigned height)
 {
-	// get all tiles which are not currently displayed
-	std::vector<std::pair<std::wstring, Tile*>> deleteCandidates;
-	for (auto& kv : m_mapTiles) {
-		if (kv.second.x() < x || kv.second.x() > x + width ||
-			kv.second.y() < y || kv.second.y() > y + height) {
-			deleteCandidates.emplace_back(kv.first, &kv.second);
+	// remove invisible tiles.  This is cheap while within the budget, so it is done every time:
+	// tiles loaded since the last call may have taken us over it
+	TrimTiles(zoom, x, y, width, height);
+
+	// same window: every tile in it has been added already, and request priorities, which
+	// depend on the window only, stay the same
+	View previous = m_view;
+	bool bSameZoom = m_bViewLoaded && zoom == previous.zoom;
+	if (bSameZoom && x == previous.x && y == previous.y && width == previous.width && height == previous.height) {
+		return;
+	}
+	m_view = { zoom, x, y, width, height };
+	m_bHaveView = true;
+
+	// reprioritize HTTP requests, and queue requests for visible tiles which were not visible
+	// before (all of them after zooming), and only then start them, in order of priority.  Tiles
+	// which went out of view need nothing: they are just not protected from eviction anymore
+	m_scheduler.SetView(zoom, x, y, width, height);
+	for (unsigned ty = y; ty <= y + height; ty++) {
+		for (unsigned tx = x; tx <= x + width; tx++) {
+			if (!bSameZoom || !IsInView({ tx, ty, zoom }, previous)) {
+				AddTile({ tx, ty, zoom }, false);
+			}
+		}
+	}
+	m_bViewLoaded = true;
+	m_scheduler.Dispatch();
+}
+
+void TileManager::TrimTiles(unsigned zoom, unsigned x, unsigned y, unsigned width, unsigned height)
+{
+	// evict least recently used tiles, starting from the tail of LRU list, until we fit into the budget.
+	// Tiles which are protected (see IsProtected()) or still loading are not evicted but moved to the head
+	// instead, so that they are not looked at again until every other tile is.  Each tile
+	// is looked at most once per call.  A ready tile being composited again can go, whatever
+	// its jobs come up with is dropped then
+	size_t nChecked = 0, nCount = m_mapTiles.size();
+	Tile* pTile = m_pLruTail;
+	while (m_szBytes > m_szBudget && pTile && nChecked < nCount) {
+		Tile* pPrev = pTile->m_pLruPrev;
+		if (pTile->state() == TS_LOADING || IsProtected(pTile->m_coords, zoom, x, y, width, height)) {
+			TouchTile(*pTile);
+		} else {
+			if (pTile->m_bPrefetched) {
+				m_nPrefetchWasted++;
+			}
+			EraseTile(*pTile);
+			m_nEvictions++;
+		}
+		pTile = pPrev;
+		nChecked++;
+	}
+}
+
+void TileManager::SetKeepPixels(bool bKeepPixels)
+{
+	m_bKeepPixels = bKeepPixels;
+}
+
+void TileManager::SetMemoryBudget(size_t szBudget)
+{
+	m_szBudget = szBudget;
+}
+
+bool TileManager::Prefetch(TileCoords coords)
+{
+	if (m_nPrefetchPending >= m_nPrefetchMaxRequests || m_szBytes >= m_szPrefetchMaxBytes) {
+		return false;
+	}
+
+	// tiles which exist already, even failed ones, are left alone
+	auto [pTile, success] = m_mapTiles.TryEmplace(coords.key(), coords);
+	if (!success) {
+		return true;
+	}
+	Tile& tile = *pTile;
+	tile.m_nGeneration = ++m_nLastGeneration;
+	tile.m_szBytes = TILE_OVERHEAD;
+	m_szBytes += tile.m_szBytes;
+	TouchTile(tile, true);
+
+	tile.m_bPrefetched = true;
+	tile.m_bPrefetchPending = true;
+	m_nPrefetchPending++;
+	m_nPrefetchIssued++;
+	LoadTile(tile, true, true);
+	return true;
+}
+
+bool TileManager::PrefetchView(unsigned zoom, unsigned left, unsigned top, unsigned width, unsigned height,
+	int nShiftX, int nShiftY, unsigned nMaxZoom)
+{
+	// tiles in the predicted window which are not in the current one, nearest first
+	unsigned nTiles = 1u << zoom;
+	int nSteps = std::max(std::abs(nShiftX), std::abs(nShiftY));
+	for (int nStep = 1; nStep <= nSteps; nStep++) {
+		int dx = nShiftX * nStep / nSteps, dy = nShiftY * nStep / nSteps;
+		for (int y = (int)top + dy; y <= (int)(top + height) + dy; y++) {
+			for (int x = (int)left + dx; x <= (int)(left + width) + dx; x++) {
+				bool bVisible = x >= (int)left && x <= (int)(left + width) &&
+					y >= (int)top && y <= (int)(top + height);
+				if (bVisible || x < 0 || y < 0 || x >= (int)nTiles || y >= (int)nTiles) {
+					continue;
+				}
+				if (!Prefetch({ (unsigned)x, (unsigned)y, zoom })) {
+					return false;
+				}
+			}
+		}
+	}
+
+	// adjacent zoom levels: the tiles covering the window one level up, and the tiles
+	// around the center one level down, which is where zooming in would land
+	if (zoom > 0) {
+		// the window may reach past the edge of the map, which is at nTiles / 2 one level up
+		unsigned nLastUp = nTiles / 2 - 1;
+		for (unsigned y = top / 2; y <= std::min((top + height) / 2, nLastUp); y++) {
+			for (unsigned x = left / 2; x <= std::min((left + width) / 2, nLastUp); x++) {
+				if (!Prefetch({ x, y, zoom - 1 })) {
+					return false;
+				}
+			}
 		}
 	}
+	if (zoom < nMaxZoom) {
+		unsigned nCenterX = (left * 2 + width), nCenterY = (top * 2 + height);
+		for (unsigned y = nCenterY - std::min(nCenterY, 1u); y <= std::min(nCenterY + 2, nTiles * 2 - 1); y++) {
+			for (unsigned x = nCenterX - std::min(nCenterX, 1u); x <= std::min(nCenterX + 2, nTiles * 2 - 1); x++) {
+				if (!Prefetch({ x, y, zoom + 1 })) {
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+void TileManager::SetPrefetchBudget(unsigned nMaxRequests, size_t szMaxBytes, unsigned nRing, unsigned nMaxInFlight)
+{
+	m_nPrefetchMaxRequests = nMaxRequests;
+	m_szPrefetchMaxBytes = szMaxBytes;
+	m_scheduler.SetPrefetchLimits(nRing, nMaxInFlight);
+}
+
+TileManager::Stats TileManager::stats() const
+{
+	Stats stats;
+	stats.nHits = m_nHits;
+	stats.nMisses = m_nMisses;
+	stats.nEvictions = m_nEvictions;
+	stats.nTiles = m_mapTiles.size();
+	stats.szBytes = m_szBytes;
+	stats.szBudget = m_szBudget;
+	stats.nPrefetchIssued = m_nPrefetchIssued;
+	stats.nPrefetchHits = m_nPrefetchHits;
+	stats.nPrefetchWasted = m_nPrefetchWasted;
+	stats.nDownloaded = m_nDownloaded;
+	stats.ullDownloadedBytes = m_ullDownloadedBytes;
+	stats.nDecoded = m_nDecoded;
+	stats.ullDecodeUs = m_ullDecodeUs;
+	stats.nRevalidated = m_nRevalidated;
+	stats.nNotModified = m_nNotModified;
+	stats.nCompletions = m_nCompletions;
+	stats.nDroppedCompletions = m_nDroppedCompletions;
+	stats.nFailures = m_nFailures;
+	stats.nRetries = m_nRetries;
+	stats.nBackingOff = m_nBackingOff;
+	return stats;
+}
 
-	// sort by age, newest first
-	std::sort(deleteCandidates.begin(), deleteCandidates.end(),
-		[](std::pair<std::wstring, Tile*> kv1, std::pair<std::wstring, Tile*> kv2) { return kv1.second->created() > kv2.second->created(); });
+bool TileManager::IsInView(TileCoords coords, const View& view)
+{
+	return coords.zoom == view.zoom && coords.x >= view.x && coords.x <= view.x + view.width &&
+		coords.y >= view.y && coords.y <= view.y + view.height;
+}
 
-	// keep some cache of newest invisible tiles, equal to the number of already displayed tiles
-	unsigned keep = width * height;
+bool TileManager::IsProtected(TileCoords coords, unsigned zoom, unsigned x, unsigned y, unsigned width, unsigned height)
+{
+	// window itself plus one tile around it at the current zoom
+	if (coords.zoom == zoom) {
+		return coords.x + 1 >= x && coords.x <= x + width + 1 &&
+			coords.y + 1 >= y && coords.y <= y + height + 1;
+	}
+	// tiles covering the window at one zoom level above, useful as a fallback
+	// and when zooming out
+	if (coords.zoom + 1 == zoom) {
+		return coords.x >= x / 2 && coords.x <= (x + width) / 2 &&
+			coords.y >= y / 2 && coords.y <= (y + height) / 2;
+	}
+	// and one zoom level below, for zooming in
+	if (coords.zoom == zoom + 1) {
+		return coords.x >= x * 2 && coords.x <= (x + width) * 2 + 1 &&
+			coords.y >= y * 2 && coords.y <= (y + height) * 2 + 1;
+	}
+	return false;
+}
 
-	// and delete the rest, if there are any
-	if (deleteCandidates.size() > keep) {
-		for (auto p = deleteCandidates.begin() + (width * height); p < deleteCandidates.end(); p++) {
-			m_mapTiles.erase(p->first);
+void TileManager::TouchTile(Tile& tile, bool bNew)
+{
+	// move (or insert) tile to the head of LRU list
+	if (!bNew) {
+		if (m_pLruHead == &tile) {
+			return;
 		}
+		UnlinkTile(tile);
+	}
+	tile.m_pLruPrev = nullptr;
+	tile.m_pLruNext = m_pLruHead;
+	if (m_pLruHead) {
+		m_pLruHead->m_pLruPrev = &tile;
+	}
+	m_pLruHead = &tile;
+	if (!m_pLruTail) {
+		m_pLruTail = &tile;
 	}
 }
 
-void TileManager::LoadTile(Tile& tile)
+void TileManager::UnlinkTile(Tile& tile)
 {
-	tile.m_state = TS_LOADING;
-	// start HTTP download, everything else happens asyncronously in callback
-	m_httpClient.Get(tile.m_strUrl, [&](int nStatus, void* pBuffer, size_t szLength) {
-		LoadTileCallback(tile, nStatus, pBuffer, szLength);
+	if (tile.m_pLruPrev) {
+		tile.m_pLruPrev->m_pLruNext = tile.m_pLruNext;
+	} else {
+		m_pLruHead = tile.m_pLruNext;
+	}
+	if (tile.m_pLruNext) {
+		tile.m_pLruNext->m_pLruPrev = tile.m_pLruPrev;
+	} else {
+		m_pLruTail = tile.m_pLruPrev;
+	}
+	tile.m_pLruPrev = tile.m_pLruNext = nullptr;
+}
+
+void TileManager::EraseTile(Tile& tile)
+{
+	// results of a prefetch still loading won't be applied to this tile anymore
+	EndPrefetch(tile);
+	SetBackingOff(tile, false);
+	UnlinkTile(tile);
+	m_szBytes -= tile.m_szBytes;
+	m_mapTiles.Erase(tile.m_coords.key());
+}
+
+void TileManager::SetTileReady(Tile& tile, ComPtr<ID2D1Bitmap> pBitmap, std::shared_ptr<const DecodedImage> pPixels)
+{
+	ReleaseTileImage(tile);
+	// account for bitmap and pixels memory, 4 bytes per pixel
+	size_t szBytes = 0;
+	if (pBitmap) {
+		D2D1_SIZE_U size = pBitmap->GetPixelSize();
+		szBytes += (size_t)size.width * size.height * 4;
+	}
+	if (pPixels) {
+		szBytes += pPixels->vecPixels.size();
+	}
+	m_szBytes += szBytes;
+	tile.m_szBytes += szBytes;
+	tile.m_pD2dBitmap = pBitmap;
+	tile.m_pPixels = pPixels;
+	tile.m_state = TS_READY;
+}
+
+void TileManager::ReleaseTileImage(Tile& tile)
+{
+	m_szBytes -= tile.m_szBytes - TILE_OVERHEAD;
+	tile.m_szBytes = TILE_OVERHEAD;
+	tile.m_pD2dBitmap.Reset();
+	tile.m_pPixels.reset();
+}
+
+void TileManager::ProcessCompletions()
+{
+	m_completions.Drain([this](std::shared_ptr<Composition>& pComposition) {
+		Tile* pTile = ResolveHandle(pComposition->handle);
+		if (pTile) {
+			m_nCompletions++;
+			ApplyCompletion(*pTile, *pComposition);
+		} else {
+			// evicted while loading, maybe even loaded again since; nothing to do
+			m_nDroppedCompletions++;
+		}
 	});
 }
 
-void TileManager::LoadTileCallback(Tile &tile, int nStatus, void* pBuffer, size_t sizeLength)
+unsigned TileManager::RetryTiles()
+{
+	if (!m_bHaveView) {
+		return 0;
+	}
+	ULONGLONG tmNow = m_httpClient.now(), tmNext = 0;
+	bool bRetried = false;
+	for (Tile* pTile = m_pLruHead; pTile; pTile = pTile->m_pLruNext) {
+		Tile& tile = *pTile;
+		if (tile.m_state != TS_ERROR || tile.m_bComposing || !tile.m_tmRetry ||
+			!IsProtected(tile.m_coords, m_view.zoom, m_view.x, m_view.y, m_view.width, m_view.height)) {
+			continue;
+		}
+		if (tmNow >= tile.m_tmRetry) {
+			m_nRetries++;
+			LoadTile(tile, false);
+			bRetried = true;
+		} else if (!tmNext || tile.m_tmRetry < tmNext) {
+			tmNext = tile.m_tmRetry;
+		}
+	}
+	if (bRetried) {
+		m_scheduler.Dispatch();
+	}
+	return tmNext ? (unsigned)(tmNext - tmNow) : 0;
+}
+
+TileManager::TileHandle TileManager::MakeHandle(const Tile& tile)
+{
+	return { tile.m_coords, tile.m_nGeneration };
+}
+
+Tile* TileManager::ResolveHandle(const TileHandle& handle)
+{
+	Tile* pTile = m_mapTiles.Find(handle.coords.key());
+	if (!pTile || pTile->m_nGeneration != handle.nGeneration) {
+		return nullptr;
+	}
+	return pTile;
+}
+
+void TileManager::LoadTile(Tile& tile, bool bDispatch, bool bPrefetch)
+{
+	if (tile.m_state != TS_READY) {
+		tile.m_state = TS_LOADING;
+	}
+	SetBackingOff(tile, false);
+	tile.m_bComposing = true;
+	auto pComposition = std::make_shared<Composition>();
+	pComposition->handle = MakeHandle(tile);
+	pComposition->bPrefetch = bPrefetch;
+	pComposition->vecImages.resize(m_vecLayers.size());
+	pComposition->nRemaining = (unsigned)m_vecLayers.size();
+
+	// try disk cache first.  Only the index is checked here, the data is read and decoded
+	// on a decode thread.  Stale tiles are used all the same, and revalidated later
+	std::vector<bool> vecCached(m_vecLayers.size());
+	pComposition->vecStale.resize(m_vecLayers.size());
+	long long llNow = GetUnixTime();
+	for (unsigned nLayer = 0; nLayer < m_vecLayers.size(); nLayer++) {
+		long long llExpires;
+		vecCached[nLayer] = m_tileCache.Contains(m_vecLayers[nLayer]->nSourceId, tile.m_coords, &llExpires);
+		pComposition->vecStale[nLayer] = vecCached[nLayer] && llExpires <= llNow;
+	}
+	for (unsigned nLayer = 0; nLayer < m_vecLayers.size(); nLayer++) {
+		if (vecCached[nLayer]) {
+			SubmitDecode(pComposition, nLayer, ResponseBuffer());
+		} else {
+			RequestTile(pComposition, nLayer, bDispatch, bPrefetch);
+		}
+	}
+}
+
+void TileManager::RequestTile(std::shared_ptr<Composition> pComposition, unsigned nLayer, bool bDispatch, bool bPrefetch,
+	std::shared_ptr<const HttpCacheInfo> pValidators)
+{
+	{
+		std::shared_lock lock(m_shutdownMutex);
+		if (m_bShuttingDown) {
+			lock.unlock();
+			pComposition->bFailed = true;
+			pComposition->bCancelled = true;
+			FinishLayer(pComposition);
+			return;
+		}
+	}
+	// queue HTTP download, everything else happens asyncronously in callback
+	m_scheduler.Request(pComposition->handle.coords, nLayer, [this, pComposition, nLayer](int nStatus, ResponseBuffer buffer, const HttpCacheInfo& cacheInfo) {
+		LoadTileCallback(pComposition, nLayer, nStatus, std::move(buffer), cacheInfo);
+	}, bDispatch, bPrefetch, pValidators);
+}
+
+void TileManager::RevalidateTile(Tile& tile, const std::vector<bool>& vecStale)
+{
+	// the tile stays composing until all answers are in
+	tile.m_bComposing = true;
+	auto pComposition = std::make_shared<Composition>();
+	pComposition->handle = MakeHandle(tile);
+	pComposition->bRevalidation = true;
+	pComposition->vecImages.resize(m_vecLayers.size());
+	pComposition->nRemaining = (unsigned)std::count(vecStale.begin(), vecStale.end(), true);
+	for (unsigned nLayer = 0; nLayer < m_vecLayers.size(); nLayer++) {
+		if (vecStale[nLayer]) {
+			// without validators (e. g. the tile was evicted from the cache meanwhile), this is just a download
+			auto pValidators = std::make_shared<HttpCacheInfo>();
+			if (!m_tileCache.ReadCacheInfo(m_vecLayers[nLayer]->nSourceId, tile.m_coords, *pValidators)) {
+				pValidators.reset();
+			}
+			m_nRevalidated++;
+			RequestTile(pComposition, nLayer, true, false, pValidators);
+		}
+	}
+}
+
+void TileManager::BackOff(Tile& tile, unsigned nRetryAfter)
+{
+	tile.m_nFailures++;
+	m_nFailures++;
+	// anywhere between half and all of the backoff, so that tiles which failed together
+	// are not all retried together
+	unsigned nDelayMs = std::min(RETRY_BASE_MS << std::min(tile.m_nFailures - 1, 16u), RETRY_MAX_MS);
+	nDelayMs = nDelayMs / 2 + m_random() % (nDelayMs / 2 + 1);
+	nDelayMs = std::max(nDelayMs, std::min(nRetryAfter, RETRY_AFTER_MAX_S) * 1000);
+	tile.m_tmRetry = m_httpClient.now() + nDelayMs;
+	SetBackingOff(tile, true);
+}
+
+void TileManager::SetBackingOff(Tile& tile, bool bBackingOff)
+{
+	if (tile.m_bBackingOff != bBackingOff) {
+		tile.m_bBackingOff = bBackingOff;
+		if (bBackingOff) {
+			m_nBackingOff++;
+		} else {
+			m_nBackingOff--;
+		}
+	}
+}
+
+void TileManager::EndPrefetch(Tile& tile)
+{
+	if (tile.m_bPrefetchPending) {
+		tile.m_bPrefetchPending = false;
+		m_nPrefetchPending--;
+	}
+}
+
+void TileManager::LoadTileCallback(std::shared_ptr<Composition> pComposition, unsigned nLayer, int nStatus, ResponseBuffer buffer,
+	const HttpCacheInfo& cacheInfo)
 {
 	// this is a callback executing on a different (worker) thread!
-	// this should be working fine as long as Direct2D is initialized in multithread mode,
+	// Decoding is not done here but handed over to the decode pool, so that
+	// it does not hold up the network
+	TileCoords coords = pComposition->handle.coords;
+	if (buffer) {
+		m_nDownloaded++;
+		m_ullDownloadedBytes += buffer.size();
+		SubmitDecode(pComposition, nLayer, std::move(buffer), std::make_shared<HttpCacheInfo>(cacheInfo));
+	} else if (nStatus == HTTP_STATUS_NOT_MODIFIED) {
+		// the cached tile is still good, and is what is shown already
+		m_nNotModified++;
+		m_tileCache.Refresh(m_vecLayers[nLayer]->nSourceId, coords, cacheInfo.llExpires);
+		FinishLayer(pComposition);
+	} else {
+		// cancelled requests are just no longer needed, but this is not an error per se;
+		// the tile will be requested again if it is needed again
+		if (nStatus != -ERROR_INTERNET_OPERATION_CANCELLED) {
+			PrintLnDebug(L"Downloading tile {}/{}/{} of layer {} failed: nStatus = {}\n", coords.zoom, coords.x, coords.y, nLayer, nStatus);
+		}
+		// the server not having a tile (HTTP error) is common for overlays, e. g. no hillshading
+		// over the sea, so the layer is just left out.  Without a response, or with one saying the
+		// server is overloaded or broken, we don't know
+		if (nStatus <= 0 || nStatus == HTTP_STATUS_TOO_MANY_REQUESTS || nStatus >= HTTP_STATUS_SERVER_ERROR) {
+			pComposition->bFailed = true;
+		}
+		// the circuit breaker turning a request down says nothing about the tile, it is the server
+		// which is backing off.  Requests are only turned down in a race with it opening, the
+		// scheduler holds them until it closes otherwise
+		if (nStatus == -ERROR_INTERNET_OPERATION_CANCELLED || nStatus == -ERROR_INTERNET_SERVER_UNREACHABLE) {
+			pComposition->bCancelled = true;
+		}
+		for (unsigned n = pComposition->nRetryAfter; n < cacheInfo.nRetryAfter && !pComposition->nRetryAfter.compare_exchange_weak(n, cacheInfo.nRetryAfter); ) {
+		}
+		FinishLayer(pComposition);
+	}
+}
+
+void TileManager::SubmitDecode(std::shared_ptr<Composition> pComposition, unsigned nLayer, ResponseBuffer buffer,
+	std::shared_ptr<const HttpCacheInfo> pCacheInfo)
+{
+	{
+		std::shared_lock lock(m_shutdownMutex);
+		if (!m_bShuttingDown) {
+			// counted before Shutdown() can start waiting for jobs
+			m_nDecodeJobs++;
+		} else {
+			lock.unlock();
+			pComposition->bFailed = true;
+			pComposition->bCancelled = true;
+			FinishLayer(pComposition);
+			return;
+		}
+	}
+	auto tmQueued = std::chrono::steady_clock::now();
+	m_decodePool.Submit([this, pComposition, nLayer, buffer, pCacheInfo, tmQueued]() {
+		DecodeTile(pComposition, nLayer, buffer, pCacheInfo, tmQueued);
+	});
+}
+
+void TileManager::DecodeTile(std::shared_ptr<Composition> pComposition, unsigned nLayer, ResponseBuffer buffer,
+	std::shared_ptr<const HttpCacheInfo> pCacheInfo, std::chrono::steady_clock::time_point tmQueued)
+{
+	// this is running on a decode thread.
+	// This should be working fine as long as Direct2D is initialized in multithread mode,
 	// since we're accessing it here across threads
+	auto tmStarted = std::chrono::steady_clock::now();
+	TRACE_SCOPE("DecodeTile");
+	Layer& layer = *m_vecLayers[nLayer];
+	TileCoords coords = pComposition->handle.coords;
+	// each job has an image of its own to decode into
+	DecodedImage& image = pComposition->vecImages[nLayer];
+	bool bDecoded = false;
+	if (buffer) {
+		// only successfully decoded tiles go into the disk cache, so that we don't keep any garbage
+		bDecoded = layer.pDecoder->Decode(buffer.data(), buffer.size(), image);
+		if (bDecoded) {
+			m_tileCache.Write(layer.nSourceId, coords, buffer.data(), buffer.size(), pCacheInfo.get());
+			pComposition->bChanged = true;
+		}
+	} else {
+		bool bCached = m_tileCache.Read(layer.nSourceId, coords, [&](const void* pData, size_t szLength) {
+			bDecoded = layer.pDecoder->Decode(pData, szLength, image);
+		});
+		if (!bCached) {
+			// overwritten in the cache since LoadTile() checked it, download after all
+			RequestTile(pComposition, nLayer, true, pComposition->bPrefetch);
+			FinishDecodeJob();
+			return;
+		}
+	}
 
-	if (pBuffer) {
-		// can't do much if no render target exists right now
-		if (!m_pRenderTarget) {
-			OutputDebugString(L"Tile loaded but no render target, discarding");
-			delete[] pBuffer;
-			tile.m_state = TS_ERROR;
+	auto tmFinished = std::chrono::steady_clock::now();
+	unsigned nWaitUs = (unsigned)std::chrono::duration_cast<std::chrono::microseconds>(tmStarted - tmQueued).count();
+	unsigned nDecodeUs = (unsigned)std::chrono::duration_cast<std::chrono::microseconds>(tmFinished - tmStarted).count();
+	if (bDecoded) {
+		m_nDecoded++;
+		m_ullDecodeUs += nDecodeUs;
+	} else {
+		// the layer is left out, whatever the decoder left behind
+		image = DecodedImage();
+	}
+	pComposition->nDecodeUs += nDecodeUs;
+	for (unsigned n = pComposition->nDecodeWaitUs; n < nWaitUs && !pComposition->nDecodeWaitUs.compare_exchange_weak(n, nWaitUs); ) {
+	}
+	FinishLayer(pComposition);
+	FinishDecodeJob();
+}
+
+void TileManager::FinishLayer(std::shared_ptr<Composition> pComposition)
+{
+	Composition& composition = *pComposition;
+	if (--composition.nRemaining != 0) {
+		return;
+	}
+
+	// some layers of a tile being revalidated have changed, and are decoded already.  Decode the
+	// others from the disk cache into the same composition, which turns into an ordinary load then,
+	// and composite the tile when they are done, without a round trip through the UI thread.
+	// Whatever was stale has just been revalidated, so the result is not revalidated again: layers
+	// which say nothing about their expiry would be stale forever otherwise
+	if (composition.bRevalidation && composition.bChanged) {
+		std::vector<unsigned> vecUnchanged;
+		for (unsigned nLayer = 0; nLayer < composition.vecImages.size(); nLayer++) {
+			if (!composition.vecImages[nLayer].nWidth) {
+				vecUnchanged.push_back(nLayer);
+			}
+		}
+		composition.bRevalidation = false;
+		composition.bFailed = false;
+		composition.bCancelled = false;
+		composition.nRetryAfter = 0;
+		composition.vecStale.assign(composition.vecImages.size(), false);
+		if (!vecUnchanged.empty()) {
+			composition.nRemaining = (unsigned)vecUnchanged.size();
+			for (unsigned nLayer : vecUnchanged) {
+				SubmitDecode(pComposition, nLayer, ResponseBuffer());
+			}
 			return;
 		}
+	}
 
-		// will use a bunch of objects from WIC and then a target bitmap
-		HRESULT hr;
-		ComPtr<IStream> pStream;
-		ComPtr<IWICBitmapDecoder> pDecoder;
-		ComPtr<IWICBitmapFrameDecode> pFrame;
-		ComPtr<IWICFormatConverter> pConverter;
-		ComPtr<ID2D1Bitmap> pBitmap;
-
-		// wrap buffer into an IStream which WIC expects
-		pStream.Attach(SHCreateMemStream(reinterpret_cast<BYTE*>(pBuffer), (UINT)sizeLength));
-		_ASSERT(pStream.Get());
-
-		// some straightforward WIC stuff, just keep track of errors at every stip
-		hr = m_pWICFactory->CreateDecoderFromStream(pStream.Get(), nullptr, WICDecodeMetadataCacheOnDemand, pDecoder.GetAddressOf());
-		if (SUCCEEDED(hr)) {
-			hr = pDecoder->GetFrame(0, pFrame.GetAddressOf());
-			if (SUCCEEDED(hr)) {
-				hr = m_pWICFactory->CreateFormatConverter(pConverter.GetAddressOf());
-				_ASSERT(SUCCEEDED(hr));  // surely cannot fail
-				hr = pConverter->Initialize(
-					pFrame.Get(),                    // Input bitmap to convert
-					GUID_WICPixelFormat32bppPBGRA,   // Destination pixel format
-					WICBitmapDitherTypeNone,         // Specified dither pattern
-					nullptr,                         // Specify a particular palette 
-					0.f,                             // Alpha threshold
-					WICBitmapPaletteTypeCustom       // Palette translation type
-				);
-				if (SUCCEEDED(hr)) {
-					hr = m_pRenderTarget->CreateBitmapFromWicBitmap(pConverter.Get(), pBitmap.GetAddressOf());
-					if (!SUCCEEDED(hr)) {
-						PrintLnDebug(L"Failed to create D2D bitmap for buffer 0x{:x}, HRESULT = {}", (intptr_t)pBuffer, (intptr_t)hr);
-					}
-				} else {
-					PrintLnDebug(L"Failed to initialize converter for buffer 0x{:x}, HRESULT = {}\n", (intptr_t)pBuffer, (intptr_t)hr);
+	// composite and make the bitmap here, off the UI thread; only handing the result over to
+	// the tile is left for ProcessCompletions().  Revalidation which found nothing changed has
+	// nothing to composite
+	if (!composition.bRevalidation && !composition.bFailed) {
+		DecodedImage image;
+		composition.bReady = CompositeLayers(composition, image) && SetTileImage(composition, image);
+	}
+	// the images are of no use anymore, and the composition may sit in the queue for a while
+	composition.vecImages.clear();
+	m_completions.Push(std::move(pComposition));
+	std::shared_lock lock(m_shutdownMutex);
+	if (!m_bShuttingDown) {
+		m_fnCompletionCallback();
+	}
+}
+
+void TileManager::ApplyCompletion(Tile& tile, Composition& composition)
+{
+	tile.m_bComposing = false;
+	if (composition.bRevalidation) {
+		// nothing has changed, the tile is left as it is, with no decoding at all.  Changed tiles
+		// come back as ordinary loads (see FinishLayer())
+		return;
+	}
+
+	tile.m_nDecodeWaitUs = composition.nDecodeWaitUs;
+	tile.m_nDecodeUs = composition.nDecodeUs;
+	EndPrefetch(tile);
+	// a bitmap made for a render target which is gone since is no good
+	bool bStaleBitmap;
+	{
+		std::lock_guard lock(m_renderTargetMutex);
+		bStaleBitmap = composition.bReady && composition.nRenderTarget != m_nRenderTarget;
+	}
+	if (!composition.bReady || bStaleBitmap) {
+		// a tile which was ready already keeps its previous bitmap if it couldn't be composited again
+		if (tile.m_state != TS_READY) {
+			tile.m_state = TS_ERROR;
+			// not wanted anymore, or the bitmap was lost: nothing wrong with the tile itself.  If it is
+			// in view (again), UpdateView() won't look at it until it goes out and back in, so load it now
+			if (composition.bCancelled || bStaleBitmap) {
+				tile.m_tmRetry = 0;
+				if (m_bHaveView && IsInView(tile.m_coords, m_view)) {
+					LoadTile(tile, true);
 				}
 			} else {
-				PrintLnDebug(L"Failed to retrieve frame for buffer 0x{:x}, HRESULT = {}\n", (intptr_t)pBuffer, (intptr_t)hr);
+				BackOff(tile, composition.nRetryAfter);
 			}
-		} else {
-			PrintLnDebug(L"Failed to create decoder for buffer 0x{:x}, HRESULT = {}\n", (intptr_t)pBuffer, (intptr_t)hr);
 		}
+		return;
+	}
+	tile.m_nFailures = 0;
+	tile.m_tmRetry = 0;
+	SetTileReady(tile, std::move(composition.pBitmap), std::move(composition.pPixels));
+	m_fnTileLoadedCallback(tile);
+	// shown, so now check whether what is shown is still current
+	if (std::find(composition.vecStale.begin(), composition.vecStale.end(), true) != composition.vecStale.end()) {
+		RevalidateTile(tile, composition.vecStale);
+	}
+}
 
-		// at this point we either have a loaded bitmap or not, if errored out along the way
-		// discard the original buffer either way
-		delete[] pBuffer;
-		if (pBitmap.Get()) {
-			tile.m_state = TS_READY;
-			tile.m_pD2dBitmap = pBitmap;
-			m_fnTileLoadedCallback(tile);
-		} else {
-			tile.m_state = TS_ERROR;
+// scales all 4 channels of a color by n / 255, rounded, two channels at a time
+static inline UINT32 ScaleColor(UINT32 nColor, UINT32 n)
+{
+	UINT32 rb = (nColor & 0x00ff00ff) * n + 0x00800080;
+	rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+	UINT32 ag = ((nColor >> 8) & 0x00ff00ff) * n + 0x00800080;
+	ag = (ag + ((ag >> 8) & 0x00ff00ff)) & 0xff00ff00;
+	return rb | ag;
+}
+
+// blends premultiplied source over destination with extra opacity.  Source of a different size
+// (e. g. a 512px layer over 256px tiles) is scaled to the destination, nearest neighbor
+static void BlendLayer(DecodedImage& dst, const DecodedImage& src, float fOpacity)
+{
+	UINT32 nOpacity = (UINT32)std::lround(std::clamp(fOpacity, 0.f, 1.f) * 255.f);
+	if (!nOpacity) {
+		return;
+	}
+	for (unsigned y = 0; y < dst.nHeight; y++) {
+		const UINT32* pSrc = reinterpret_cast<const UINT32*>(src.vecPixels.data() + (size_t)(y * src.nHeight / dst.nHeight) * src.stride());
+		UINT32* pDst = reinterpret_cast<UINT32*>(dst.vecPixels.data() + (size_t)y * dst.stride());
+		for (unsigned x = 0; x < dst.nWidth; x++) {
+			UINT32 s = pSrc[src.nWidth == dst.nWidth ? x : x * src.nWidth / dst.nWidth];
+			if (nOpacity < 255) {
+				s = ScaleColor(s, nOpacity);
+			}
+			// source-over: channels can't overflow, as premultiplied color never exceeds alpha
+			UINT32 nInverse = 255 - (s >> 24);
+			if (nInverse == 0) {
+				pDst[x] = s;
+			} else if (nInverse < 255) {
+				pDst[x] = s + ScaleColor(pDst[x], nInverse);
+			}
 		}
+	}
+}
+
+bool TileManager::CompositeLayers(Composition& composition, DecodedImage& image)
+{
+	// the bottom layer that is there sets the size of the tile image
+	std::vector<DecodedImage>& vecImages = composition.vecImages;
+	unsigned nBase = 0;
+	while (nBase < vecImages.size() && !vecImages[nBase].nWidth) {
+		nBase++;
+	}
+	if (nBase == vecImages.size()) {
+		return false;
+	}
+
+	// a single opaque layer, which is the common case, is just taken as it is
+	TRACE_SCOPE("CompositeLayers");
+	if (m_vecLayers[nBase]->fOpacity >= 1.f) {
+		image = std::move(vecImages[nBase]);
 	} else {
-		PrintLnDebug(L"Downloading tile {} failed: nStatus = {}\n", tile.m_strUrl, nStatus);
-		tile.m_state = TS_ERROR;
+		image.nWidth = vecImages[nBase].nWidth;
+		image.nHeight = vecImages[nBase].nHeight;
+		image.vecPixels.assign((size_t)image.stride() * image.nHeight, 0);
+		BlendLayer(image, vecImages[nBase], m_vecLayers[nBase]->fOpacity);
 	}
+	for (unsigned nLayer = nBase + 1; nLayer < vecImages.size(); nLayer++) {
+		if (vecImages[nLayer].nWidth) {
+			BlendLayer(image, vecImages[nLayer], m_vecLayers[nLayer]->fOpacity);
+		}
+	}
+	return true;
+}
+
+bool TileManager::SetTileImage(Composition& composition, DecodedImage& image)
+{
+	// can't do much if no render target exists right now, unless we keep pixels.  Keep the lock
+	// until the bitmap is made, so that it is for the render target recorded with it
+	std::lock_guard lock(m_renderTargetMutex);
+	composition.nRenderTarget = m_nRenderTarget;
+	if (!m_pRenderTarget && !m_bKeepPixels) {
+		OutputDebugString(L"Tile loaded but no render target, discarding");
+		return false;
+	}
+
+	ComPtr<ID2D1Bitmap> pBitmap;
+	if (m_pRenderTarget) {
+		TRACE_SCOPE("CreateBitmap");
+		HRESULT hr = m_pRenderTarget->CreateBitmap(D2D1::SizeU(image.nWidth, image.nHeight), image.vecPixels.data(), image.stride(),
+			D2D1::BitmapProperties(D2D1::PixelFormat(DXGI_FORMAT_B8G8R8A8_UNORM, D2D1_ALPHA_MODE_PREMULTIPLIED)), pBitmap.GetAddressOf());
+		if (FAILED(hr)) {
+			TileCoords coords = composition.handle.coords;
+			PrintLnDebug(L"Failed to create D2D bitmap for tile {}/{}/{}, HRESULT = {}", coords.zoom, coords.x, coords.y, (intptr_t)hr);
+			return false;
+		}
+	}
+	if (m_bKeepPixels) {
+		composition.pPixels = std::make_shared<DecodedImage>(std::move(image));
+	}
+	composition.pBitmap = pBitmap;
+	return true;
 }
 
-Tile::Tile(TileCoords coords, std::wstring strUrl)
-	: m_coords(coords), m_state(TS_LOADING), m_strUrl(strUrl)
+void TileManager::FinishDecodeJob()
+{
+	// there might be room in the decode queue now
+	m_scheduler.Pump();
+	if (--m_nDecodeJobs == 0) {
+		m_nDecodeJobs.notify_all();
+	}
+}
+
+Tile::Tile(TileCoords coords)
+	: m_coords(coords), m_state(TS_LOADING)
 {
-	FILETIME ft;
-	GetSystemTimeAsFileTime(&ft);
-	m_tmCreated = (((long long) ft.dwHighDateTime) << 32) + ft.dwLowDateTime;
 }
 
 Tile::~Tile()
 {
-}
\ No newline at end of file
+}
@@ -2,66 +2,356 @@
 
 // TileManager.h: class responsible for fetching map tiles from the Internet,
 // loading them into Direct2D bitmaps, and keeping around as needed.
-// Uses our HttpClient class for HTTP requests and WIC (Windows Imaging Component) API
-// to decode tile images (PNGs) into bitmaps.
+// Uses our HttpClient class for HTTP requests, TileCache to keep downloaded tiles on disk,
+// and an ImageDecoder (WIC by default) to decode tile images (PNGs) into bitmaps.  Decoding
+// runs on DecodePool threads, both for downloaded and for cached tiles.
+// Cached tiles past their HTTP expiry are shown right away, and revalidated in the background with
+// a conditional request: "not modified" just refreshes the expiry in the cache, and only a tile
+// which has actually changed is decoded again.
+// Tiles can be made of several layers from different sources (see AddLayer()), e. g. a base map
+// with hillshading or transit lines over it.  Each layer is downloaded and cached on its own, and
+// the decode job which finishes the last layer of a tile composites all of them into one image,
+// so drawing a tile is always a single bitmap.
+// Tiles themselves are only ever touched on the UI thread.  Jobs loading a tile refer to it by
+// a handle (coords and a generation, which tells apart a tile evicted and created again); their
+// result is posted to a lock-free queue, and applied by ProcessCompletions() if the tile is still
+// there, or just dropped otherwise.
+// A tile which failed to load (network error, server overloaded or broken) is not requested again
+// until its retry time: exponential backoff with jitter, or later if the server said so with
+// Retry-After.  RetryTiles() retries those that are due and still wanted.
 // One TileManager is meant to be used by one MapWindow
 
 #include "ComPtr.h"
+#include "TileCoords.h"
+#include "TileMap.h"
+#include "TileScheduler.h"
+#include "ImageDecoder.h"
+#include "MpscQueue.h"
 
 class Tile;
 class HttpClient;
-struct TileCoords;
+class TileCache;
+class DecodePool;
 
 class TileManager
 {
 public:
-	// callback type to call on a successful tile load
+	// callback type to call on a successful tile load, on the UI thread (see ProcessCompletions())
 	typedef std::function<void(Tile& tile)> OnTileLoadedCallback;
+	// callback type to call, on a worker thread, whenever a tile load is done, so that
+	// ProcessCompletions() gets called soon
+	typedef std::function<void()> OnCompletionCallback;
 
-	// strBaseUrl should be a base URL (without trailing slash) for tiles in
-	// the standard .../{ZOOM}/{X}/{Y}.png layout.  nTileSize is in pixels (tiles must be square)
-	TileManager(HttpClient& httpClient, std::wstring strBaseUrl, unsigned nTileSize,
-		OnTileLoadedCallback fnTileLoadedCallback);
+	// strBaseUrl should be a base URL (without trailing slash) for tiles in the standard
+	// .../{ZOOM}/{X}/{Y}.png layout, or a URL template (see FormatTileUrl()).  nTileSize is
+	// in pixels (tiles must be square)
+	TileManager(HttpClient& httpClient, TileCache& tileCache, DecodePool& decodePool, std::wstring strBaseUrl, unsigned nTileSize,
+		OnTileLoadedCallback fnTileLoadedCallback, OnCompletionCallback fnCompletionCallback);
+	// see Shutdown()
 	~TileManager();
 
+	// stops loading tiles: cancels all requests and waits for decoding of any tiles to finish.
+	// No callbacks are called anymore once it returns.  Called by the destructor; an owner whose
+	// callbacks use its own members should call it before those are destroyed
+	void Shutdown();
+
+	// replaces image decoder of a layer (WicImageDecoder by default on Windows, PngDecoder
+	// elsewhere).  Must be called before any tiles are loaded
+	void SetDecoder(std::unique_ptr<ImageDecoder> pDecoder, unsigned nLayer = 0);
+
+	// adds a layer drawn over the existing ones with given opacity (0..1), from tiles at strUrl (as
+	// the base URL given to the constructor, which is layer 0).  Tiles missing from the server (HTTP
+	// errors) are just left out.  Must be called before any tiles are loaded.  Returns layer index
+	unsigned AddLayer(std::wstring strUrl, float fOpacity = 1.f);
+	// changes opacity of a layer.  Tiles already loaded keep their bitmaps until they are
+	// composited again, which is done in the background from the disk cache
+	void SetLayerOpacity(unsigned nLayer, float fOpacity);
+	unsigned layerCount() const { return (unsigned)m_vecLayers.size(); }
+	float layerOpacity(unsigned nLayer) const { return m_vecLayers[nLayer]->fOpacity; }
+
 	// Direct2D render target set/reset.  Tiles are loaded into Direct2D bitmaps,
 	// which must be attached to a valid render target.  Invalidating render target
 	// deletes all loaded tiles and means any newly loaded tiles will just be discarded
 	void SetRenderTarget(ComPtr<ID2D1RenderTarget> pRenderTarget);
 	void InvalidateRenderTarget();
 
-	// gets URL for certain tile coords
-	std::wstring GetTileURL(TileCoords coords);
+	// gets URL for certain tile coords of a layer.  Only needed when actually making a request
+	std::wstring GetTileURL(TileCoords coords, unsigned nLayer = 0);
 
 	// tries to load a tile with given coords, kicking of HTTP request
 	// if a tile is alread loaded, does nothing
-	// if a tile failed to load previously (TS_ERROR) state, reloads
-	Tile& AddTile(TileCoords coords);
+	// if a tile failed to load previously (TS_ERROR) state, reloads, unless it is backing off
+	// if bDispatch is false, HTTP request is only queued, see TileScheduler::Request()
+	Tile& AddTile(TileCoords coords, bool bDispatch = true);
+
+	// sets the current view, as a window of tiles at a given zoom: removes unnecessary tiles
+	// (see TrimTiles()), cancels requests for tiles that are not wanted anymore, and loads
+	// all tiles in the window, most important first.  Only tiles which came into the window
+	// since the last call are looked at, and if the window is the same, nothing is done at all
+	// (the view changes by a few pixels at a time while panning, mostly keeping the same tiles)
+	void UpdateView(unsigned zoom, unsigned x, unsigned y, unsigned width, unsigned height);
+
+	// applies results of tile loads done since the last call: sets tiles ready (calling
+	// OnTileLoadedCallback) or failed.  Results for tiles which have been evicted meanwhile are
+	// dropped.  Must be called on the UI thread, e. g. once per frame
+	void ProcessCompletions();
+
+	// loads again failed tiles in or around the current view (see UpdateView()) whose retry time has
+	// come.  Returns ms until the next one is due, or 0 if no tiles are waiting to be retried
+	unsigned RetryTiles();
 
 	// gets a tile at give coords, if it exists, and null otherwise
 	Tile* GetTile(TileCoords coords);
 
-	// removes unnecessary tiles outside of the specified window
-	// in practice, keeps some more tiles in case user moves back
-	void TrimTiles(unsigned x, unsigned y, unsigned width, unsigned height);
+	// finds the nearest loaded ancestor of a tile, at most nMaxLevels zoom levels up, e. g. to draw
+	// a part of it scaled up in place of a tile which is not loaded yet.  Returns null if there is none,
+	// otherwise nLevels is set to how many levels up it is.  Just a few map lookups, cheap enough to do
+	// for every missing tile on every paint
+	Tile* GetReadyAncestor(TileCoords coords, unsigned nMaxLevels, unsigned& nLevels);
+
+	// removes least recently used tiles while the total memory used by tiles is over budget.
+	// Tiles inside or directly around the specified window at the specified zoom, or covering it
+	// at adjacent zoom levels, are never removed
+	void TrimTiles(unsigned zoom, unsigned x, unsigned y, unsigned width, unsigned height);
+
+	// whether to keep decoded pixels of tiles in memory, besides Direct2D bitmaps, for drawing
+	// with SoftwareCanvas.  Tiles are also loaded without a render target then.  Affects only tiles
+	// loaded after the call
+	void SetKeepPixels(bool bKeepPixels);
+
+	// sets memory budget, in bytes, for TrimTiles()
+	void SetMemoryBudget(size_t szBudget);
+
+	// speculatively loads a tile which is not visible but likely to be soon, at the lowest priority.
+	// Does nothing if the tile exists already.  Returns false if the prefetch budget is used up,
+	// meaning that there's no point in trying to prefetch anything else right now
+	bool Prefetch(TileCoords coords);
+
+	// prefetches what is likely to be wanted next around a view of tiles (as given to UpdateView()):
+	// the tiles it would be shifted by nShiftX, nShiftY onto, nearest first, the tiles covering it one
+	// zoom level up and the ones around its center one level down, if not past nMaxZoom.  Returns
+	// false if it ran out of prefetch budget before all of them were requested
+	bool PrefetchView(unsigned zoom, unsigned left, unsigned top, unsigned width, unsigned height,
+		int nShiftX, int nShiftY, unsigned nMaxZoom);
+
+	// sets prefetch budget: how many prefetched tiles may be loading at once, and
+	// how much memory tiles may use at most before we stop prefetching.  nRing and nMaxInFlight
+	// are passed to TileScheduler::SetPrefetchLimits()
+	void SetPrefetchBudget(unsigned nMaxRequests, size_t szMaxBytes, unsigned nRing, unsigned nMaxInFlight);
+
+	// memory cache statistics
+	struct Stats
+	{
+		// AddTile() calls for already loaded/not yet loaded tiles
+		unsigned long long nHits, nMisses;
+		// tiles removed by TrimTiles()
+		unsigned long long nEvictions;
+		// number of tiles currently kept, and memory used by them
+		size_t nTiles, szBytes;
+		size_t szBudget;
+		// tiles prefetched, how many of them were later wanted by UpdateView()/AddTile(),
+		// and how many were evicted without ever being wanted
+		unsigned long long nPrefetchIssued, nPrefetchHits, nPrefetchWasted;
+		// tiles downloaded and their size in bytes, as received; tiles decoded (downloaded or
+		// from disk cache) and total time spent decoding them, microseconds.  Counted per layer
+		unsigned long long nDownloaded, ullDownloadedBytes;
+		unsigned long long nDecoded, ullDecodeUs;
+		// conditional requests for stale cached tiles, and how many of them were not modified
+		unsigned long long nRevalidated, nNotModified;
+		// results of tile loads applied to their tiles, and dropped because the tile was gone
+		unsigned long long nCompletions, nDroppedCompletions;
+		// tile loads failed (and backed off after), and failed tiles loaded again; tiles
+		// waiting to be retried now
+		unsigned long long nFailures, nRetries;
+		size_t nBackingOff;
+	};
+	Stats stats() const;
+	// HTTP request queue statistics
+	TileScheduler::Stats schedulerStats() { return m_scheduler.stats(); }
 	
 	unsigned tileSize() const { return m_nTileSize; }
 
+	static const size_t DEFAULT_MEMORY_BUDGET = 128 * 1024 * 1024;
+	static const unsigned DEFAULT_PREFETCH_MAX_REQUESTS = 16;
+	static const size_t DEFAULT_PREFETCH_MAX_BYTES = DEFAULT_MEMORY_BUDGET / 4 * 3;
+	// backoff after the first failure of a tile, doubled after each one after, up to the max;
+	// and the most of Retry-After we honor
+	static constexpr unsigned RETRY_BASE_MS = 1000;
+	static constexpr unsigned RETRY_MAX_MS = 60 * 1000;
+	static constexpr unsigned RETRY_AFTER_MAX_S = 10 * 60;
+
 private:
 	HttpClient& m_httpClient;
-	// base WIC component to decode images
-	ComPtr<IWICImagingFactory> m_pWICFactory;
-	std::wstring m_strBaseUrl;
+	TileCache& m_tileCache;
+	DecodePool& m_decodePool;
+	struct Layer
+	{
+		std::wstring strUrl;
+		// identifies the tile server in the disk cache
+		unsigned nSourceId;
+		std::unique_ptr<ImageDecoder> pDecoder;
+		// read by decode threads when compositing
+		std::atomic<float> fOpacity;
+	};
+	// layers bottom to top, fixed once tiles start loading
+	std::vector<std::unique_ptr<Layer>> m_vecLayers;
+	// decode jobs submitted to the pool and not yet finished
+	std::atomic<unsigned> m_nDecodeJobs = 0;
+	// set by Shutdown(), after which no decode jobs, requests or callbacks are started.  Jobs hold
+	// the lock shared while they start those, Shutdown() takes it exclusively to set the flag
+	std::shared_mutex m_shutdownMutex;
+	bool m_bShuttingDown = false;
 	unsigned m_nTileSize;
-	// URL -> tile map
-	std::unordered_map<std::wstring, Tile> m_mapTiles;
+	// all tiles by key; they are visited all at once through the LRU list below
+	TileMap<Tile> m_mapTiles;
+	// generation of the last tile created
+	unsigned long long m_nLastGeneration = 0;
 	OnTileLoadedCallback m_fnTileLoadedCallback;
+	OnCompletionCallback m_fnCompletionCallback;
 	ComPtr<ID2D1RenderTarget> m_pRenderTarget;
+	// render target is used from decode threads too; it is counted, so that bitmaps made for
+	// one which is gone are recognized
+	std::mutex m_renderTargetMutex;
+	unsigned m_nRenderTarget = 0;
+	bool m_bKeepPixels = false;
+
+	// all tiles are also kept in a doubly-linked LRU list, most recently used first
+	Tile* m_pLruHead = nullptr;
+	Tile* m_pLruTail = nullptr;
+	// memory used by tiles, updated from worker threads too
+	std::atomic<size_t> m_szBytes = 0;
+	size_t m_szBudget = DEFAULT_MEMORY_BUDGET;
+	unsigned long long m_nHits = 0, m_nMisses = 0, m_nEvictions = 0;
+
+	// prefetch budget and stats
+	unsigned m_nPrefetchMaxRequests = DEFAULT_PREFETCH_MAX_REQUESTS;
+	size_t m_szPrefetchMaxBytes = DEFAULT_PREFETCH_MAX_BYTES;
+	// prefetched tiles still loading
+	unsigned m_nPrefetchPending = 0;
+	unsigned long long m_nPrefetchIssued = 0, m_nPrefetchHits = 0, m_nPrefetchWasted = 0;
+	// download and decode stats, updated from worker threads
+	std::atomic<unsigned long long> m_nDownloaded = 0, m_ullDownloadedBytes = 0, m_nDecoded = 0, m_ullDecodeUs = 0;
+	std::atomic<unsigned long long> m_nRevalidated = 0, m_nNotModified = 0;
+	unsigned long long m_nCompletions = 0, m_nDroppedCompletions = 0;
+	unsigned long long m_nFailures = 0, m_nRetries = 0;
+	// tiles failed and waiting for their retry time, kept up by SetBackingOff()
+	size_t m_nBackingOff = 0;
+	// for retry jitter
+	std::minstd_rand m_random;
+
+	// the last view given to UpdateView()
+	struct View
+	{
+		unsigned zoom, x, y, width, height;
+	};
+	View m_view = { 0, 0, 0, 0, 0 };
+	bool m_bHaveView = false;
+	// whether all tiles in m_view have been added; not anymore once tiles are removed for
+	// another reason than being out of view (see InvalidateRenderTarget())
+	bool m_bViewLoaded = false;
+
+	// estimate of memory used by a tile itself, not including bitmap
+	static const size_t TILE_OVERHEAD = 128;
+
+	// a tile as referred to from worker threads, which may outlive it
+	struct TileHandle
+	{
+		TileCoords coords = TileCoords(0, 0, 0);
+		unsigned long long nGeneration = 0;
+	};
+
+	// layer images of a tile being loaded, shared by the jobs loading them.  Whichever job finishes
+	// the last layer composites the images into a bitmap, and posts the result for the UI thread
+	struct Composition
+	{
+		TileHandle handle;
+		bool bPrefetch = false;
+		// empty (0x0) for layers which failed to decode or are missing on the server
+		std::vector<DecodedImage> vecImages;
+		std::atomic<unsigned> nRemaining;
+		// set if any layer could not be loaded at all (cancelled, network error, server error), so
+		// that the tile is not complete and is left to be loaded again later; right away if it was
+		// just cancelled, otherwise after backing off, for at least nRetryAfter seconds
+		std::atomic<bool> bFailed = false;
+		std::atomic<bool> bCancelled = false;
+		std::atomic<unsigned> nRetryAfter = 0;
+		std::atomic<unsigned> nDecodeWaitUs = 0, nDecodeUs = 0;
+		// layers loaded from the disk cache which are past their expiry; set before any job starts
+		std::vector<bool> vecStale;
+		// revalidating stale layers of a tile that is ready, rather than loading it; and whether
+		// any of them turned out to have changed.  Changed layers are decoded into vecImages, and
+		// the composition goes on to load the rest (see FinishLayer())
+		bool bRevalidation = false;
+		std::atomic<bool> bChanged = false;
+		// the result: bitmap made for render target number nRenderTarget, and/or pixels
+		bool bReady = false;
+		ComPtr<ID2D1Bitmap> pBitmap;
+		std::shared_ptr<const DecodedImage> pPixels;
+		unsigned nRenderTarget = 0;
+	};
+	// finished compositions, for ProcessCompletions()
+	MpscQueue<std::shared_ptr<Composition>> m_completions;
 
-	void LoadTile(Tile& tile);
+	// queue for HTTP requests.  Declared after the tiles and the completion queue, so that it is
+	// destroyed (cancelling all requests, which may still post results) before them
+	TileScheduler m_scheduler;
 
-	// callback for HttpClient
-	void LoadTileCallback(Tile &tile, int nStatus, void* pBuffer, size_t sizeLength);
+	static bool IsProtected(TileCoords coords, unsigned zoom, unsigned x, unsigned y, unsigned width, unsigned height);
+	static bool IsInView(TileCoords coords, const View& view);
+	// LRU list and tile map maintenance
+	void TouchTile(Tile& tile, bool bNew = false);
+	void UnlinkTile(Tile& tile);
+	void EraseTile(Tile& tile);
+	static TileHandle MakeHandle(const Tile& tile);
+	// gets the tile a handle refers to, or null if it is gone
+	Tile* ResolveHandle(const TileHandle& handle);
+	// sets a tile as loaded, replacing its previous bitmap if any
+	void SetTileReady(Tile& tile, ComPtr<ID2D1Bitmap> pBitmap, std::shared_ptr<const DecodedImage> pPixels);
+	// drops bitmap and pixels of a tile, which is not ready anymore
+	void ReleaseTileImage(Tile& tile);
+
+	// loads all layers of a tile, each decoded from disk cache if it is there, or downloaded
+	// otherwise.  A tile which is ready stays so, with its current bitmap, until it is loaded
+	void LoadTile(Tile& tile, bool bDispatch, bool bPrefetch = false);
+	// starts HTTP request for a layer of a tile, conditional if pValidators is given
+	void RequestTile(std::shared_ptr<Composition> pComposition, unsigned nLayer, bool bDispatch, bool bPrefetch,
+		std::shared_ptr<const HttpCacheInfo> pValidators = nullptr);
+	// revalidates stale layers of a tile which was just composited from the disk cache, and
+	// composites it again if any of them has changed
+	void RevalidateTile(Tile& tile, const std::vector<bool>& vecStale);
+	// releases prefetch budget taken by a tile when it is done loading, one way or another
+	void EndPrefetch(Tile& tile);
+	// sets when a tile which has just failed to load is to be tried again
+	void BackOff(Tile& tile, unsigned nRetryAfter);
+	// marks a tile as waiting for its retry time, or not anymore (loading again, or gone), and
+	// counts such tiles
+	void SetBackingOff(Tile& tile, bool bBackingOff);
+
+	// callback for HttpClient (through TileScheduler)
+	void LoadTileCallback(std::shared_ptr<Composition> pComposition, unsigned nLayer, int nStatus, ResponseBuffer buffer,
+		const HttpCacheInfo& cacheInfo);
+
+	// queues layer image to be decoded on the decode pool.  If buffer is null, the image is read
+	// from disk cache instead, directly in the decode thread; otherwise it is stored there with pCacheInfo
+	void SubmitDecode(std::shared_ptr<Composition> pComposition, unsigned nLayer, ResponseBuffer buffer,
+		std::shared_ptr<const HttpCacheInfo> pCacheInfo = nullptr);
+	// decode job itself, running on a decode thread
+	void DecodeTile(std::shared_ptr<Composition> pComposition, unsigned nLayer, ResponseBuffer buffer,
+		std::shared_ptr<const HttpCacheInfo> pCacheInfo, std::chrono::steady_clock::time_point tmQueued);
+	// bookkeeping for a layer of a tile being done, one way or another.  When it is the last one,
+	// composites the layers and posts the result
+	void FinishLayer(std::shared_ptr<Composition> pComposition);
+	// hands a posted result over to its tile: sets it ready, or failed, and starts revalidating it
+	// if stale.  UI thread only
+	void ApplyCompletion(Tile& tile, Composition& composition);
+	// blends layer images bottom to top with the current opacities of the layers into one image.
+	// Returns false if there is nothing to show
+	bool CompositeLayers(Composition& composition, DecodedImage& image);
+	// creates Direct2D bitmap from decoded pixels and/or keeps the pixels themselves, for the
+	// composition's result.  Returns false on failure
+	bool SetTileImage(Composition& composition, DecodedImage& image);
+	// bookkeeping for the end of a decode job
+	void FinishDecodeJob();
 };
 
 enum TileState
@@ -71,36 +361,53 @@ enum TileState
 	TS_ERROR = 2	// failed to load for whatever reason
 };
 
-struct TileCoords
-{
-	unsigned x;
-	unsigned y;
-	unsigned zoom;
-	TileCoords(unsigned x, unsigned y, unsigned zoom) : x(x), y(y), zoom(zoom) {}
-};
-
 // Class wrapping a single tile, which might be in a loaded state (with attached bitmap) or not.
-// Holds also a timestamp of instantiation, which helps TileManager::TrimTiles() to remove the "oldest" tiles.
+// Also links tiles into TileManager's LRU list.
 class Tile
 {
 public:
-	Tile(TileCoords coords, std::wstring strUrl);
+	Tile(TileCoords coords);
 	~Tile();
 
 	unsigned x() const { return m_coords.x; }
 	unsigned y() const { return m_coords.y; }
 	unsigned zoom() const { return m_coords.zoom; }
-	const std::wstring& url() const { return m_strUrl; }
+	TileCoords coords() const { return m_coords; }
 	TileState state() const { return m_state; }
 	ComPtr<ID2D1Bitmap> d2dBitmap() const { return m_pD2dBitmap; }
-	long created() const { return m_tmCreated; }
+	// decoded pixels, only if TileManager is set to keep them
+	std::shared_ptr<const DecodedImage> pixels() const { return m_pPixels; }
+	// how long the tile waited in decode queue, and how long it took to decode it
+	// (not including creating bitmap), microseconds; 0 if not decoded yet.  For tiles with
+	// several layers, the longest wait and the total decoding time of all layers
+	unsigned decodeWaitUs() const { return m_nDecodeWaitUs; }
+	unsigned decodeUs() const { return m_nDecodeUs; }
+	// when a tile which failed to load may be loaded again (HttpClient::now()), 0 if it hasn't
+	// failed since it last loaded
+	ULONGLONG retryTime() const { return m_tmRetry; }
 
 private:
 	friend class TileManager;
 
 	TileCoords m_coords;
-	std::wstring m_strUrl;
-	TileState m_state;
+	// set by TileManager, unique for each tile it creates
+	unsigned long long m_nGeneration = 0;
+	// only changed on the UI thread, but may be looked at from anywhere
+	std::atomic<TileState> m_state;
 	ComPtr<ID2D1Bitmap> m_pD2dBitmap;
-	long m_tmCreated;
+	std::shared_ptr<const DecodedImage> m_pPixels;
+	// memory accounted for this tile
+	size_t m_szBytes = 0;
+	// loaded by Prefetch() and not wanted by anyone yet; and still counted against prefetch budget
+	bool m_bPrefetched = false;
+	bool m_bPrefetchPending = false;
+	// layers are being loaded, or revalidated; the tile may be ready (with its previous bitmap)
+	bool m_bComposing = false;
+	// failures to load in a row, and when it may be tried again (HttpClient::now())
+	unsigned m_nFailures = 0;
+	ULONGLONG m_tmRetry = 0;
+	bool m_bBackingOff = false;
+	unsigned m_nDecodeWaitUs = 0, m_nDecodeUs = 0;
+	Tile* m_pLruPrev = nullptr;
+	Tile* m_pLruNext = nullptr;
 };
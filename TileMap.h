@@ -0,0 +1,124 @@
+#pragma once
+
+// TileMap.h: hash table from TileKey to objects it owns, for TileManager's tiles.  Open addressing
+// with linear probing over one flat array of (key, pointer) slots, kept at most half full, so a
+// lookup is a multiply and a shift, and then mostly a single cache line.  Objects are allocated
+// on their own, so that pointers to them stay valid when the table grows (tiles are linked into
+// an LRU list, and handed out by pointer).  Erasing shifts the following slots of the probe
+// sequence back instead of leaving tombstones, so lookups never get slower with churn.
+// Not thread safe; no iteration, owners which need to visit everything keep a list of their own
+
+#include "TileCoords.h"
+
+template <typename T>
+class TileMap
+{
+public:
+	TileMap() = default;
+
+	// no copy/assignment
+	TileMap& operator=(const TileMap&) = delete;
+	TileMap(const TileMap&) = delete;
+
+	// gets the object for a key, null if there is none
+	T* Find(TileKey key) const
+	{
+		if (m_vecSlots.empty()) {
+			return nullptr;
+		}
+		for (size_t n = Home(key); m_vecSlots[n].pValue; n = (n + 1) & m_nMask) {
+			if (m_vecSlots[n].key == key) {
+				return m_vecSlots[n].pValue.get();
+			}
+		}
+		return nullptr;
+	}
+
+	// gets the object for a key, constructing it from args if there is none.  The flag is true
+	// if it was constructed
+	template <typename... Args>
+	std::pair<T*, bool> TryEmplace(TileKey key, Args&&... args)
+	{
+		if ((m_nCount + 1) * 2 > m_vecSlots.size()) {
+			Grow();
+		}
+		size_t n = Home(key);
+		for (; m_vecSlots[n].pValue; n = (n + 1) & m_nMask) {
+			if (m_vecSlots[n].key == key) {
+				return { m_vecSlots[n].pValue.get(), false };
+			}
+		}
+		m_vecSlots[n].key = key;
+		m_vecSlots[n].pValue = std::make_unique<T>(std::forward<Args>(args)...);
+		m_nCount++;
+		return { m_vecSlots[n].pValue.get(), true };
+	}
+
+	// destroys the object for a key, if there is one
+	void Erase(TileKey key)
+	{
+		if (m_vecSlots.empty()) {
+			return;
+		}
+		size_t n = Home(key);
+		while (m_vecSlots[n].pValue && m_vecSlots[n].key != key) {
+			n = (n + 1) & m_nMask;
+		}
+		if (!m_vecSlots[n].pValue) {
+			return;
+		}
+		m_vecSlots[n].pValue.reset();
+		m_nCount--;
+		// close the gap: move back each following entry of the run which may be looked up
+		// through it, i. e. whose home slot is not between the gap and the entry itself
+		for (size_t nNext = (n + 1) & m_nMask; m_vecSlots[nNext].pValue; nNext = (nNext + 1) & m_nMask) {
+			size_t nHome = Home(m_vecSlots[nNext].key);
+			if (((nNext - nHome) & m_nMask) >= ((nNext - n) & m_nMask)) {
+				m_vecSlots[n] = std::move(m_vecSlots[nNext]);
+				n = nNext;
+			}
+		}
+	}
+
+	size_t size() const { return m_nCount; }
+
+private:
+	struct Slot
+	{
+		TileKey key = 0;
+		// null for an empty slot
+		std::unique_ptr<T> pValue;
+	};
+	std::vector<Slot> m_vecSlots;
+	size_t m_nMask = 0;
+	size_t m_nCount = 0;
+	unsigned m_nShift = 64;
+
+	// slot a key would be in without collisions.  Keys of nearby tiles differ in their low bits
+	// (see TileCoords::MakeKey()), so they are spread by Fibonacci hashing, taking the top bits
+	size_t Home(TileKey key) const
+	{
+		return (size_t)((key * 0x9E3779B97F4A7C15ull) >> m_nShift);
+	}
+
+	void Grow()
+	{
+		std::vector<Slot> vecOld = std::move(m_vecSlots);
+		size_t nSize = std::max<size_t>(vecOld.size() * 2, 64);
+		m_vecSlots = std::vector<Slot>(nSize);
+		m_nMask = nSize - 1;
+		m_nShift = 64;
+		for (size_t n = nSize; n > 1; n >>= 1) {
+			m_nShift--;
+		}
+		for (Slot& slot : vecOld) {
+			if (slot.pValue) {
+				size_t n = Home(slot.key);
+				while (m_vecSlots[n].pValue) {
+					n = (n + 1) & m_nMask;
+				}
+				m_vecSlots[n] = std::move(slot);
+			}
+		}
+	}
+};
@@ -0,0 +1,426 @@
+// TileScheduler.cpp: TileScheduler class implementation
+
+#include "framework.h"
+#include "Util.h"
+#include "TileScheduler.h"
+
+// how often in-flight requests are checked against deadline, ms
+static const DWORD DEADLINE_CHECK_INTERVAL = 1000;
+
+// Pump() calls on the stack of the current thread, innermost first
+struct PumpFrame
+{
+	const TileScheduler* pScheduler;
+	const PumpFrame* pOuter;
+};
+static thread_local const PumpFrame* t_pPumpFrames = nullptr;
+
+TileScheduler::TileScheduler(HttpClient& httpClient, UrlBuilder fnUrlBuilder, unsigned nMaxInFlight, unsigned nDeadlineMs)
+	: m_httpClient(httpClient), m_fnUrlBuilder(fnUrlBuilder), m_nMaxInFlight(nMaxInFlight), m_nDeadlineMs(nDeadlineMs)
+{
+	// deadlines need to be enforced even if nothing else happens, so check them on a timer
+	bool bTimerCreated = CreateTimerQueueTimer(&m_hDeadlineTimer, nullptr, StaticDeadlineTimerCallback, this,
+		DEADLINE_CHECK_INTERVAL, DEADLINE_CHECK_INTERVAL, WT_EXECUTEDEFAULT);
+	_ASSERT(bTimerCreated);
+}
+
+TileScheduler::~TileScheduler()
+{
+	// wait for the timer callback to finish, if running
+	DeleteTimerQueueTimer(nullptr, m_hDeadlineTimer, INVALID_HANDLE_VALUE);
+	CancelAll();
+}
+
+void TileScheduler::Request(TileCoords coords, unsigned nLayer, OnFinishCallback fnOnFinish, bool bDispatch, bool bPrefetch,
+	std::shared_ptr<const HttpCacheInfo> pValidators)
+{
+	{
+		std::lock_guard lock(m_mutex);
+		QueuedRequest request = { ++m_nLastSerial, coords, nLayer, fnOnFinish, bPrefetch, TIER_VISIBLE, 0, pValidators };
+		Prioritize(coords, bPrefetch, request.tier, request.nPriority);
+		m_vecQueue.push_back(std::move(request));
+		std::push_heap(m_vecQueue.begin(), m_vecQueue.end(), IsLessImportant);
+	}
+	if (bDispatch) {
+		Pump();
+	}
+}
+
+void TileScheduler::SetView(unsigned zoom, unsigned x, unsigned y, unsigned width, unsigned height)
+{
+	std::vector<OnFinishCallback> vecCancelled;
+	std::vector<HttpClient::RequestId> vecToCancel;
+	{
+		std::lock_guard lock(m_mutex);
+		// don't let completions start anything until the caller has queued requests
+		// for the new view and calls Dispatch()
+		m_bHoldDispatch = true;
+
+		if (!m_bHaveView || zoom != m_view.zoom) {
+			m_tmZoomChanged = m_httpClient.now();
+			m_bWaitingForFullScreen = true;
+		}
+		m_view = { zoom, x, y, width, height };
+		m_bHaveView = true;
+
+		// reprioritize queue and parked requests, dropping requests for tiles which are no longer wanted
+		auto isStale = [&](QueuedRequest& request) {
+			Prioritize(request.coords, request.bPrefetch, request.tier, request.nPriority);
+			if (request.tier == TIER_STALE) {
+				vecCancelled.push_back(std::move(request.fnOnFinish));
+				return true;
+			}
+			return false;
+		};
+		m_vecQueue.erase(std::remove_if(m_vecQueue.begin(), m_vecQueue.end(), isStale), m_vecQueue.end());
+		std::make_heap(m_vecQueue.begin(), m_vecQueue.end(), IsLessImportant);
+		m_vecParked.erase(std::remove_if(m_vecParked.begin(), m_vecParked.end(), isStale), m_vecParked.end());
+		m_stats.nCancelled += vecCancelled.size();
+
+		// cancel in-flight requests which are no longer wanted, or which are late anyway
+		unsigned long long nPriority;
+		for (InFlightRequest& request : m_vecInFlight) {
+			Prioritize(request.coords, request.bPrefetch, request.tier, nPriority);
+			if (request.tier == TIER_STALE) {
+				CancelInFlight(request, vecToCancel);
+			}
+		}
+		CollectExpired(vecToCancel);
+	}
+
+	for (auto& fnOnFinish : vecCancelled) {
+		fnOnFinish(-ERROR_INTERNET_OPERATION_CANCELLED, ResponseBuffer(), HttpCacheInfo());
+	}
+	// these call OnRequestFinished() synchronously
+	for (HttpClient::RequestId id : vecToCancel) {
+		m_httpClient.Cancel(id);
+	}
+}
+
+void TileScheduler::Dispatch()
+{
+	{
+		std::lock_guard lock(m_mutex);
+		m_bHoldDispatch = false;
+		CheckFullScreen();
+	}
+	Pump();
+}
+
+void TileScheduler::SetPrefetchLimits(unsigned nRing, unsigned nMaxInFlight)
+{
+	std::lock_guard lock(m_mutex);
+	m_nPrefetchRing = nRing;
+	m_nMaxPrefetchInFlight = nMaxInFlight;
+}
+
+void TileScheduler::SetThrottle(ThrottleCheck fnThrottle)
+{
+	m_fnThrottle = fnThrottle;
+}
+
+void TileScheduler::CancelAll()
+{
+	std::unique_lock lock(m_mutex);
+	while (true) {
+		std::vector<OnFinishCallback> vecCancelled;
+		std::vector<HttpClient::RequestId> vecToCancel;
+		for (QueuedRequest& request : m_vecQueue) {
+			vecCancelled.push_back(std::move(request.fnOnFinish));
+		}
+		m_vecQueue.clear();
+		for (QueuedRequest& request : m_vecParked) {
+			vecCancelled.push_back(std::move(request.fnOnFinish));
+		}
+		m_vecParked.clear();
+		m_stats.nCancelled += vecCancelled.size();
+		for (InFlightRequest& request : m_vecInFlight) {
+			CancelInFlight(request, vecToCancel);
+		}
+
+		if (!vecCancelled.empty() || !vecToCancel.empty()) {
+			lock.unlock();
+			for (auto& fnOnFinish : vecCancelled) {
+				fnOnFinish(-ERROR_INTERNET_OPERATION_CANCELLED, ResponseBuffer(), HttpCacheInfo());
+			}
+			for (HttpClient::RequestId id : vecToCancel) {
+				m_httpClient.Cancel(id);
+			}
+			lock.lock();
+			continue;
+		}
+		if (m_vecInFlight.empty() && !m_nFinishing) {
+			break;
+		}
+		// what is left has been cancelled already (or will be by Pump(), as soon as it has the id),
+		// or was being finished by HttpClient when we tried.  Look again when any of it is done,
+		// in case something was started meanwhile
+		m_cvFinished.wait(lock);
+	}
+}
+
+void TileScheduler::CheckDeadlines()
+{
+	std::vector<HttpClient::RequestId> vecToCancel;
+	bool bUnparked;
+	{
+		std::lock_guard lock(m_mutex);
+		CollectExpired(vecToCancel);
+		bUnparked = UnparkDue();
+	}
+	for (HttpClient::RequestId id : vecToCancel) {
+		m_httpClient.Cancel(id);
+	}
+	// nothing else may happen to start them, if all requests were for servers which are down
+	if (bUnparked) {
+		Pump();
+	}
+}
+
+TileScheduler::Stats TileScheduler::stats()
+{
+	std::lock_guard lock(m_mutex);
+	Stats stats = m_stats;
+	stats.nQueued = m_vecQueue.size();
+	stats.nInFlight = m_vecInFlight.size();
+	stats.nParked = m_vecParked.size();
+	return stats;
+}
+
+void TileScheduler::Prioritize(TileCoords coords, bool bPrefetch, Tier& tier, unsigned long long& nPriority)
+{
+	// until we know what is visible, everything is equally important
+	if (!m_bHaveView) {
+		tier = TIER_VISIBLE;
+		nPriority = 0;
+		return;
+	}
+
+	const View& v = m_view;
+	if (coords.zoom == v.zoom) {
+		if (coords.x >= v.x && coords.x <= v.x + v.width && coords.y >= v.y && coords.y <= v.y + v.height) {
+			tier = TIER_VISIBLE;
+		} else if (coords.x + 1 >= v.x && coords.x <= v.x + v.width + 1 && coords.y + 1 >= v.y && coords.y <= v.y + v.height + 1) {
+			tier = TIER_RING;
+		} else {
+			tier = TIER_STALE;
+		}
+	} else if (coords.zoom + 1 == v.zoom) {
+		// tiles covering the window at one zoom level above
+		bool bCovering = coords.x >= v.x / 2 && coords.x <= (v.x + v.width) / 2 &&
+			coords.y >= v.y / 2 && coords.y <= (v.y + v.height) / 2;
+		tier = bCovering ? TIER_OTHER_ZOOM : TIER_STALE;
+	} else if (coords.zoom == v.zoom + 1) {
+		// and one zoom level below
+		bool bCovering = coords.x >= v.x * 2 && coords.x <= (v.x + v.width) * 2 + 1 &&
+			coords.y >= v.y * 2 && coords.y <= (v.y + v.height) * 2 + 1;
+		tier = bCovering ? TIER_OTHER_ZOOM : TIER_STALE;
+	} else {
+		tier = TIER_STALE;
+	}
+
+	// speculative requests go after everything else, unless visible already; and are
+	// still wanted within a wider ring around the visible area
+	if (bPrefetch && tier != TIER_VISIBLE) {
+		bool bInRing = coords.zoom == v.zoom &&
+			coords.x + m_nPrefetchRing >= v.x && coords.x <= v.x + v.width + m_nPrefetchRing &&
+			coords.y + m_nPrefetchRing >= v.y && coords.y <= v.y + v.height + m_nPrefetchRing;
+		tier = tier != TIER_STALE || bInRing ? TIER_PREFETCH : TIER_STALE;
+	}
+
+	// within a tier, closer to the center of the view goes first.  Distance is measured
+	// in tiles of the tile's own zoom level
+	double dScale = std::ldexp(1.0, (int)coords.zoom - (int)v.zoom);
+	double dCenterX = (v.x + (v.width + 1) / 2.0) * dScale, dCenterY = (v.y + (v.height + 1) / 2.0) * dScale;
+	double dx = coords.x + 0.5 - dCenterX, dy = coords.y + 0.5 - dCenterY;
+	unsigned long long nDistance = (unsigned long long)std::min((dx * dx + dy * dy) * 16.0, 1e12);
+	nPriority = ((unsigned long long)tier << 48) | nDistance;
+}
+
+void TileScheduler::Pump()
+{
+	// called back from a request started below, on this very thread (e. g. failed right away):
+	// the loop there picks up whatever has changed once the request returns.  Going on here
+	// instead would nest one call deeper for each request in the queue
+	for (const PumpFrame* pFrame = t_pPumpFrames; pFrame; pFrame = pFrame->pOuter) {
+		if (pFrame->pScheduler == this) {
+			return;
+		}
+	}
+	PumpFrame frame = { this, t_pPumpFrames };
+	t_pPumpFrames = &frame;
+
+	while (true) {
+		unsigned long long nSerial;
+		std::wstring strUrl;
+		std::shared_ptr<const HttpCacheInfo> pValidators;
+		{
+			std::lock_guard lock(m_mutex);
+			if (m_bHoldDispatch || m_vecInFlight.size() >= m_nMaxInFlight) {
+				break;
+			}
+			UnparkDue();
+			if (m_vecQueue.empty()) {
+				break;
+			}
+			if (m_fnThrottle && m_fnThrottle()) {
+				m_stats.nThrottled++;
+				break;
+			}
+			// only prefetch requests are left if the top one is, and these only get a few slots
+			if (m_vecQueue.front().tier == TIER_PREFETCH) {
+				size_t nPrefetching = std::count_if(m_vecInFlight.begin(), m_vecInFlight.end(),
+					[](auto& request) { return request.tier == TIER_PREFETCH; });
+				if (nPrefetching >= m_nMaxPrefetchInFlight) {
+					break;
+				}
+			}
+			std::pop_heap(m_vecQueue.begin(), m_vecQueue.end(), IsLessImportant);
+			QueuedRequest& request = m_vecQueue.back();
+			strUrl = m_fnUrlBuilder(request.coords, request.nLayer);
+			// the circuit breaker of its server would just fail it, which is no news; and the
+			// tile would back off on its own.  Wait for the server instead
+			ULONGLONG tmRetry = m_httpClient.ServerRetryTime(strUrl);
+			if (tmRetry) {
+				if (m_vecParked.empty() || tmRetry < m_tmNextUnpark) {
+					m_tmNextUnpark = tmRetry;
+				}
+				request.tmParkedUntil = tmRetry;
+				m_vecParked.push_back(std::move(request));
+				m_vecQueue.pop_back();
+				continue;
+			}
+			if (request.tier == TIER_PREFETCH) {
+				m_stats.nPrefetchStarted++;
+			}
+			nSerial = request.nSerial;
+			pValidators = std::move(request.pValidators);
+			m_vecInFlight.push_back({ nSerial, request.coords, request.nLayer, std::move(request.fnOnFinish), request.bPrefetch, request.tier, 0, m_httpClient.now(), false });
+			m_vecQueue.pop_back();
+			m_stats.nStarted++;
+		}
+
+		// start the request outside the lock, as the callback might be called synchronously
+		HttpClient::RequestId id = m_httpClient.Get(strUrl,
+			[this, nSerial](int nStatus, ResponseBuffer buffer, const HttpCacheInfo& cacheInfo) {
+				OnRequestFinished(nSerial, nStatus, std::move(buffer), cacheInfo);
+			}, pValidators.get());
+
+		// remember request id, unless it is already finished; and cancel it if it was
+		// meant to be cancelled while we didn't have the id
+		bool bCancel = false;
+		{
+			std::lock_guard lock(m_mutex);
+			auto it = std::find_if(m_vecInFlight.begin(), m_vecInFlight.end(),
+				[=](auto& request) { return request.nSerial == nSerial; });
+			if (it != m_vecInFlight.end()) {
+				it->id = id;
+				bCancel = it->bCancel;
+			}
+		}
+		if (bCancel) {
+			m_httpClient.Cancel(id);
+		}
+	}
+
+	t_pPumpFrames = frame.pOuter;
+}
+
+void TileScheduler::OnRequestFinished(unsigned long long nSerial, int nStatus, ResponseBuffer buffer, const HttpCacheInfo& cacheInfo)
+{
+	OnFinishCallback fnOnFinish;
+	{
+		std::lock_guard lock(m_mutex);
+		auto it = std::find_if(m_vecInFlight.begin(), m_vecInFlight.end(),
+			[=](auto& request) { return request.nSerial == nSerial; });
+		_ASSERT(it != m_vecInFlight.end());
+		fnOnFinish = std::move(it->fnOnFinish);
+		m_vecInFlight.erase(it);
+		if (nStatus == -ERROR_INTERNET_OPERATION_CANCELLED) {
+			m_stats.nCancelled++;
+		} else {
+			m_stats.nCompleted++;
+		}
+		// the request is gone, but we are not done with the scheduler yet
+		m_nFinishing++;
+	}
+
+	fnOnFinish(nStatus, std::move(buffer), cacheInfo);
+
+	{
+		std::lock_guard lock(m_mutex);
+		CheckFullScreen();
+	}
+	Pump();
+
+	std::lock_guard lock(m_mutex);
+	m_nFinishing--;
+	m_cvFinished.notify_all();
+}
+
+void TileScheduler::CancelInFlight(InFlightRequest& request, std::vector<HttpClient::RequestId>& vecToCancel)
+{
+	if (request.bCancel) {
+		return;
+	}
+	request.bCancel = true;
+	// if we don't have id yet, Pump() will cancel it as soon as it gets one
+	if (request.id) {
+		vecToCancel.push_back(request.id);
+	}
+}
+
+void TileScheduler::CollectExpired(std::vector<HttpClient::RequestId>& vecToCancel)
+{
+	ULONGLONG tmNow = m_httpClient.now();
+	for (InFlightRequest& request : m_vecInFlight) {
+		if (!request.bCancel && tmNow - request.tmStarted > m_nDeadlineMs) {
+			PrintLnDebug(L"Tile {}/{}/{} missed deadline, cancelling", request.coords.zoom, request.coords.x, request.coords.y);
+			m_stats.nTimedOut++;
+			CancelInFlight(request, vecToCancel);
+		}
+	}
+}
+
+void TileScheduler::CheckFullScreen()
+{
+	// not while the caller is still queueing the tiles of a new view: the requests SetView()
+	// cancelled finish before any of them are there
+	if (!m_bWaitingForFullScreen || m_bHoldDispatch) {
+		return;
+	}
+	auto isVisible = [](auto& request) { return request.tier == TIER_VISIBLE; };
+	if (std::none_of(m_vecQueue.begin(), m_vecQueue.end(), isVisible) &&
+		std::none_of(m_vecInFlight.begin(), m_vecInFlight.end(), isVisible) &&
+		std::none_of(m_vecParked.begin(), m_vecParked.end(), isVisible)) {
+		m_bWaitingForFullScreen = false;
+		m_stats.nLastTimeToFullScreenMs = m_httpClient.now() - m_tmZoomChanged;
+	}
+}
+
+bool TileScheduler::UnparkDue()
+{
+	ULONGLONG tmNow = m_httpClient.now();
+	if (m_vecParked.empty() || tmNow < m_tmNextUnpark) {
+		return false;
+	}
+	// priorities are kept up to date by SetView() while parked
+	auto itDue = std::partition(m_vecParked.begin(), m_vecParked.end(), [=](auto& request) { return request.tmParkedUntil > tmNow; });
+	for (auto it = itDue; it != m_vecParked.end(); ++it) {
+		m_vecQueue.push_back(std::move(*it));
+		std::push_heap(m_vecQueue.begin(), m_vecQueue.end(), IsLessImportant);
+	}
+	m_vecParked.erase(itDue, m_vecParked.end());
+	m_tmNextUnpark = 0;
+	for (auto& request : m_vecParked) {
+		if (!m_tmNextUnpark || request.tmParkedUntil < m_tmNextUnpark) {
+			m_tmNextUnpark = request.tmParkedUntil;
+		}
+	}
+	return true;
+}
+
+void CALLBACK TileScheduler::StaticDeadlineTimerCallback(PVOID lpParameter, BOOLEAN bTimerOrWaitFired)
+{
+	reinterpret_cast<TileScheduler*>(lpParameter)->CheckDeadlines();
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+// TileScheduler.h: prioritized queue of tile requests, sitting between TileManager and HttpClient.
+// Requests are queued and only a limited number of them is sent to HttpClient at once.
+// Which ones go first is decided by the current view (SetView()): visible tiles, center-out,
+// then a ring of tiles around the visible area, then tiles at adjacent zoom levels
+// covering the visible area, and speculative (prefetch) requests last.  Prefetch requests
+// may be for tiles in a wider ring around the visible area, and only a few of them may be
+// in flight at once, leaving the bandwidth for the tiles which are actually needed.
+// Any other tiles are no longer wanted, and are dropped from the queue or cancelled if already
+// in flight.  Requests in flight for too long are cancelled too.
+// Requests to a server whose circuit breaker is open (see HttpClient) are not sent to be failed
+// right away, but parked until the server may be tried again, and then queued as they were.
+// Thread safe; callbacks may be called from either worker threads or the calling thread.
+
+#include "HttpClient.h"
+#include "TileCoords.h"
+
+class TileScheduler
+{
+public:
+	// same as for HttpClient.  Cancelled requests (because tile is no longer
+	// wanted or deadline was missed) get nStatus = -ERROR_INTERNET_OPERATION_CANCELLED
+	typedef HttpClient::OnFinishCallback OnFinishCallback;
+
+	// callback to produce tile URL at the moment the request is sent, for a tile of a layer
+	// (see TileManager::AddLayer()); layers are otherwise of no concern here
+	typedef std::function<std::wstring(TileCoords coords, unsigned nLayer)> UrlBuilder;
+
+	// callback to check whether new requests should be held off because the consumer
+	// of the responses cannot keep up (backpressure)
+	typedef std::function<bool()> ThrottleCheck;
+
+	static const unsigned DEFAULT_MAX_IN_FLIGHT = 8;
+	static const unsigned DEFAULT_DEADLINE_MS = 15000;
+	static const unsigned DEFAULT_PREFETCH_RING = 4;
+	static const unsigned DEFAULT_MAX_PREFETCH_IN_FLIGHT = 2;
+
+	TileScheduler(HttpClient& httpClient, UrlBuilder fnUrlBuilder,
+		unsigned nMaxInFlight = DEFAULT_MAX_IN_FLIGHT, unsigned nDeadlineMs = DEFAULT_DEADLINE_MS);
+	// cancels all requests, see CancelAll()
+	~TileScheduler();
+
+	// no copy/assignment
+	TileScheduler& operator=(const TileScheduler&) = delete;
+	TileScheduler(const TileScheduler&) = delete;
+
+	// queues a tile request, and starts it right away if it is important enough
+	// and there is a free slot.  If bDispatch is false, only queues it; Dispatch()
+	// should then be called after queueing a batch of requests.  bPrefetch marks a speculative
+	// request, which goes after all others unless the tile is visible.  pValidators makes it
+	// a conditional request (see HttpClient::Get())
+	void Request(TileCoords coords, unsigned nLayer, OnFinishCallback fnOnFinish, bool bDispatch = true, bool bPrefetch = false,
+		std::shared_ptr<const HttpCacheInfo> pValidators = nullptr);
+
+	// sets current view, as a window of tiles at a given zoom.  Reprioritizes queued requests,
+	// cancels requests which are no longer wanted and requests which have missed the deadline.
+	// Does not start new requests, Dispatch() should be called for that
+	void SetView(unsigned zoom, unsigned x, unsigned y, unsigned width, unsigned height);
+
+	// starts queued requests as long as there are free slots
+	void Dispatch();
+
+	// starts queued requests as long as there are free slots, unless on hold after SetView()
+	// or throttled.  Called internally whenever a request finishes; should be called by
+	// whoever set the throttle when the throttling condition clears.  A call made from a request
+	// callback called synchronously by Pump() itself returns right away, the outer call goes on
+	// with the queue instead, so that the stack does not grow with it
+	void Pump();
+
+	// sets how far (in tiles) around the visible area prefetch requests are still wanted,
+	// and how many of them may be in flight at once
+	void SetPrefetchLimits(unsigned nRing, unsigned nMaxInFlight);
+
+	// sets throttle check, called before starting every request.  Must be called before any
+	// requests are made
+	void SetThrottle(ThrottleCheck fnThrottle);
+
+	// cancels everything, queued and in flight, and waits for callbacks of requests in flight
+	// which were too far along to be cancelled (HttpClient calls them outside its lock).  No
+	// callbacks are running once it returns, unless requests are made meanwhile.  Must not be
+	// called from a request callback
+	void CancelAll();
+
+	// cancels in-flight requests which have missed the deadline, and queues again parked
+	// requests whose server may be tried again.  Called periodically on a timer anyway
+	void CheckDeadlines();
+
+	struct Stats
+	{
+		// requests parked while their server is down are not counted as queued
+		size_t nQueued, nInFlight, nParked;
+		unsigned long long nStarted, nCompleted, nCancelled, nTimedOut;
+		// times a request was not started because of throttling
+		unsigned long long nThrottled;
+		// prefetch requests started
+		unsigned long long nPrefetchStarted;
+		// time from the last zoom change until all visible tiles were loaded, ms
+		unsigned long long nLastTimeToFullScreenMs;
+	};
+	Stats stats();
+
+private:
+	// priority tiers, lower goes first
+	enum Tier
+	{
+		TIER_VISIBLE = 0,
+		TIER_RING = 1,
+		TIER_OTHER_ZOOM = 2,
+		TIER_PREFETCH = 3,
+		TIER_STALE = 4	// not wanted anymore
+	};
+
+	struct QueuedRequest
+	{
+		unsigned long long nSerial;
+		TileCoords coords;
+		unsigned nLayer;
+		OnFinishCallback fnOnFinish;
+		bool bPrefetch;
+		Tier tier;
+		// lower goes first, combines tier and distance from view center
+		unsigned long long nPriority;
+		std::shared_ptr<const HttpCacheInfo> pValidators;
+		// while parked, when its server may be tried again
+		ULONGLONG tmParkedUntil = 0;
+	};
+
+	struct InFlightRequest
+	{
+		unsigned long long nSerial;
+		TileCoords coords;
+		unsigned nLayer;
+		OnFinishCallback fnOnFinish;
+		bool bPrefetch;
+		Tier tier;
+		HttpClient::RequestId id;
+		ULONGLONG tmStarted;
+		// cancellation requested before we got request id from HttpClient
+		bool bCancel;
+	};
+
+	struct View
+	{
+		unsigned zoom, x, y, width, height;
+	};
+
+	HttpClient& m_httpClient;
+	UrlBuilder m_fnUrlBuilder;
+	ThrottleCheck m_fnThrottle;
+	unsigned m_nMaxInFlight;
+	unsigned m_nDeadlineMs;
+	unsigned m_nPrefetchRing = DEFAULT_PREFETCH_RING;
+	unsigned m_nMaxPrefetchInFlight = DEFAULT_MAX_PREFETCH_IN_FLIGHT;
+
+	// binary heap ordered by priority, top is the most important
+	std::vector<QueuedRequest> m_vecQueue;
+	std::vector<InFlightRequest> m_vecInFlight;
+	// requests to servers which are down, in no particular order, and the earliest time any
+	// of them may go
+	std::vector<QueuedRequest> m_vecParked;
+	ULONGLONG m_tmNextUnpark = 0;
+	std::mutex m_mutex;
+	// OnRequestFinished() calls under way, even past taking their request out of m_vecInFlight;
+	// CancelAll() waits on the condition until there are none
+	unsigned m_nFinishing = 0;
+	std::condition_variable m_cvFinished;
+	View m_view = { 0, 0, 0, 0, 0 };
+	bool m_bHaveView = false;
+	// set by SetView() until the next Dispatch()
+	bool m_bHoldDispatch = false;
+	unsigned long long m_nLastSerial = 0;
+	Stats m_stats = {};
+	// when the zoom last changed, and whether we're waiting for visible tiles since then
+	ULONGLONG m_tmZoomChanged = 0;
+	bool m_bWaitingForFullScreen = false;
+	// timer queue timer for CheckDeadlines()
+	HANDLE m_hDeadlineTimer = nullptr;
+
+	// computes tier and priority for a tile according to the current view
+	void Prioritize(TileCoords coords, bool bPrefetch, Tier& tier, unsigned long long& nPriority);
+
+	// called by HttpClient when a request completes
+	void OnRequestFinished(unsigned long long nSerial, int nStatus, ResponseBuffer buffer, const HttpCacheInfo& cacheInfo);
+
+	// marks in-flight request as cancelled, adding its id to the list of requests for
+	// which HttpClient::Cancel() must be called (outside of lock).  Must be called under lock
+	void CancelInFlight(InFlightRequest& request, std::vector<HttpClient::RequestId>& vecToCancel);
+	// same for requests that missed the deadline.  Must be called under lock
+	void CollectExpired(std::vector<HttpClient::RequestId>& vecToCancel);
+
+	// checks whether all visible tiles are done, for time-to-full-screen stats.  Must be called under lock
+	void CheckFullScreen();
+	// moves parked requests whose time has come back to the queue.  Returns whether there were
+	// any.  Must be called under lock
+	bool UnparkDue();
+
+	static void CALLBACK StaticDeadlineTimerCallback(PVOID lpParameter, BOOLEAN bTimerOrWaitFired);
+
+	// heap comparator: a goes after b
+	static bool IsLessImportant(const QueuedRequest& a, const QueuedRequest& b)
+	{
+		return a.nPriority > b.nPriority || (a.nPriority == b.nPriority && a.nSerial > b.nSerial);
+	}
+};
@@ -0,0 +1,332 @@
+// TileSeeder.cpp: TileSeeder class implementation
+
+#include "framework.h"
+#include "Util.h"
+#include "TileCache.h"
+#include "Projection.h"
+#include "Trace.h"
+#include "TileSeeder.h"
+
+// how often Pump() is called to start requests held back by rate limit, ms
+static const DWORD PUMP_INTERVAL = 100;
+
+struct TileSeeder::SavedState
+{
+	DWORD dwMagic;
+	DWORD dwVersion;
+	unsigned nSourceId;
+	SeedRegion region;
+	unsigned long long nCursor;
+	unsigned long long nSkipped, nDownloaded, nFailed, ullBytes;
+
+	// 'DEES', as a multi-character constant would be
+	static const DWORD MAGIC = 0x44454553;
+	static const DWORD VERSION = 1;
+};
+
+TileSeeder::TileSeeder(HttpClient& httpClient, TileCache& tileCache, std::wstring strBaseUrl, std::wstring strStatePath,
+	unsigned nMaxInFlight, double dMaxTilesPerSecond)
+	: m_httpClient(httpClient), m_tileCache(tileCache), m_strBaseUrl(strBaseUrl), m_strStatePath(strStatePath),
+	m_nSourceId(TileCache::SourceId(strBaseUrl)), m_nMaxInFlight(nMaxInFlight), m_dMaxTilesPerSecond(dMaxTilesPerSecond)
+{
+	bool bTimerCreated = CreateTimerQueueTimer(&m_hPumpTimer, nullptr, StaticPumpTimerCallback, this,
+		PUMP_INTERVAL, PUMP_INTERVAL, WT_EXECUTEDEFAULT);
+	_ASSERT(bTimerCreated);
+}
+
+TileSeeder::~TileSeeder()
+{
+	// wait for the timer callback to finish, if running
+	DeleteTimerQueueTimer(nullptr, m_hPumpTimer, INVALID_HANDLE_VALUE);
+	Stop();
+}
+
+TileSeeder::Estimate TileSeeder::EstimateRegion(const SeedRegion& region, unsigned long long ullBytesPerTile)
+{
+	MercatorPoint ptTopLeft = LatLngToMercator(region.dMaxLat, region.dMinLng);
+	MercatorPoint ptBottomRight = LatLngToMercator(region.dMinLat, region.dMaxLng);
+	unsigned long long nTiles = 0;
+	for (unsigned nZoom = region.nMinZoom; nZoom <= region.nMaxZoom; nZoom++) {
+		TileCoords topLeft = MercatorToTile(ptTopLeft, nZoom), bottomRight = MercatorToTile(ptBottomRight, nZoom);
+		nTiles += (unsigned long long)(bottomRight.x - topLeft.x + 1) * (bottomRight.y - topLeft.y + 1);
+	}
+	return { nTiles, nTiles * ullBytesPerTile };
+}
+
+void TileSeeder::Start(const SeedRegion& region)
+{
+	Stop();
+	{
+		std::lock_guard lock(m_mutex);
+		SetRegion(region);
+		m_nSkipped = m_nDownloaded = m_nFailed = m_ullBytes = 0;
+		m_bRunning = true;
+		SaveState();
+	}
+	PrintLnDebug(L"Seeding {} tiles, zoom {}-{}", m_nTotal, region.nMinZoom, region.nMaxZoom);
+	Pump();
+}
+
+bool TileSeeder::Resume()
+{
+	Stop();
+
+	HANDLE hFile = CreateFile(m_strStatePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	SavedState state;
+	DWORD dwRead = 0;
+	bool bRead = ReadFile(hFile, &state, sizeof(state), &dwRead, nullptr) && dwRead == sizeof(state);
+	CloseHandle(hFile);
+	if (!bRead || state.dwMagic != SavedState::MAGIC || state.dwVersion != SavedState::VERSION || state.nSourceId != m_nSourceId) {
+		return false;
+	}
+
+	{
+		std::lock_guard lock(m_mutex);
+		SetRegion(state.region);
+		m_nNext = std::min(state.nCursor, m_nTotal);
+		m_nSkipped = state.nSkipped;
+		m_nDownloaded = m_nDownloadedAtStart = state.nDownloaded;
+		m_nFailed = state.nFailed;
+		m_ullBytes = m_ullBytesAtStart = state.ullBytes;
+		m_bRunning = true;
+	}
+	PrintLnDebug(L"Resuming seeding at {} of {} tiles", state.nCursor, m_nTotal);
+	Pump();
+	return true;
+}
+
+void TileSeeder::Stop()
+{
+	std::vector<HttpClient::RequestId> vecToCancel;
+	{
+		std::lock_guard lock(m_mutex);
+		if (!m_bRunning) {
+			return;
+		}
+		// save before cancelling, requests in flight are not done
+		SaveState();
+		m_bRunning = false;
+		for (InFlightRequest& request : m_vecInFlight) {
+			if (!request.bCancel) {
+				request.bCancel = true;
+				// if we don't have id yet, Pump() will cancel it as soon as it gets one
+				if (request.id) {
+					vecToCancel.push_back(request.id);
+				}
+			}
+		}
+	}
+	// these call OnRequestFinished() synchronously
+	for (HttpClient::RequestId id : vecToCancel) {
+		m_httpClient.Cancel(id);
+	}
+
+	// and wait for requests which were finishing on other threads meanwhile, so that
+	// nothing from this job is left when the next one starts
+	std::unique_lock lock(m_mutex);
+	m_cvIdle.wait(lock, [this]() { return m_vecInFlight.empty(); });
+}
+
+TileSeeder::Stats TileSeeder::stats()
+{
+	std::lock_guard lock(m_mutex);
+	Stats stats;
+	stats.bRunning = m_bRunning;
+	stats.region = m_region;
+	stats.nTotal = m_nTotal;
+	stats.nDone = Cursor();
+	stats.nSkipped = m_nSkipped;
+	stats.nDownloaded = m_nDownloaded;
+	stats.nFailed = m_nFailed;
+	stats.ullBytes = m_ullBytes;
+	stats.ullEstimatedBytes = m_nTotal * (m_nDownloaded ? m_ullBytes / m_nDownloaded : DEFAULT_BYTES_PER_TILE);
+	stats.nElapsedMs = m_tmStarted ? GetTickCount64() - m_tmStarted : 0;
+	double dSeconds = stats.nElapsedMs / 1000.0;
+	stats.dTilesPerSecond = dSeconds > 0.0 ? (m_nDownloaded - m_nDownloadedAtStart) / dSeconds : 0.0;
+	stats.dBytesPerSecond = dSeconds > 0.0 ? (m_ullBytes - m_ullBytesAtStart) / dSeconds : 0.0;
+	return stats;
+}
+
+void TileSeeder::SetRegion(const SeedRegion& region)
+{
+	m_region = region;
+	m_vecZooms.clear();
+	m_nTotal = 0;
+	MercatorPoint ptTopLeft = LatLngToMercator(region.dMaxLat, region.dMinLng);
+	MercatorPoint ptBottomRight = LatLngToMercator(region.dMinLat, region.dMaxLng);
+	for (unsigned nZoom = region.nMinZoom; nZoom <= region.nMaxZoom; nZoom++) {
+		TileCoords topLeft = MercatorToTile(ptTopLeft, nZoom), bottomRight = MercatorToTile(ptBottomRight, nZoom);
+		unsigned nWidth = bottomRight.x - topLeft.x + 1;
+		unsigned long long nCount = (unsigned long long)nWidth * (bottomRight.y - topLeft.y + 1);
+		m_vecZooms.push_back({ nZoom, topLeft.x, topLeft.y, nWidth, m_nTotal, nCount });
+		m_nTotal += nCount;
+	}
+	m_nNext = 0;
+	m_nDownloadedAtStart = m_ullBytesAtStart = 0;
+	m_tmStarted = m_tmLastRefill = GetTickCount64();
+	m_dTokens = 1.0;
+	m_nUnsaved = 0;
+}
+
+TileCoords TileSeeder::TileAt(unsigned long long nIndex) const
+{
+	auto it = std::upper_bound(m_vecZooms.begin(), m_vecZooms.end(), nIndex,
+		[](unsigned long long nIndex, const ZoomRange& range) { return nIndex < range.nFirst + range.nCount; });
+	_ASSERT(it != m_vecZooms.end());
+	unsigned long long nOffset = nIndex - it->nFirst;
+	return TileCoords(it->x + (unsigned)(nOffset % it->nWidth), it->y + (unsigned)(nOffset / it->nWidth), it->nZoom);
+}
+
+unsigned long long TileSeeder::Cursor() const
+{
+	unsigned long long nCursor = m_nNext;
+	for (const InFlightRequest& request : m_vecInFlight) {
+		nCursor = std::min(nCursor, request.nIndex);
+	}
+	return nCursor;
+}
+
+void TileSeeder::Pump()
+{
+	while (true) {
+		unsigned long long nIndex;
+		TileCoords coords(0, 0, 0);
+		{
+			std::lock_guard lock(m_mutex);
+			if (!m_bRunning || m_vecInFlight.size() >= m_nMaxInFlight) {
+				break;
+			}
+			// skip what we have already, this doesn't cost any requests
+			while (m_nNext < m_nTotal && m_tileCache.Contains(m_nSourceId, TileAt(m_nNext))) {
+				m_nNext++;
+				m_nSkipped++;
+			}
+			if (m_nNext >= m_nTotal) {
+				break;
+			}
+			// while the server is down, hold off rather than fail tile after tile
+			if (!m_httpClient.IsServerAvailable(FormatTileUrl(m_strBaseUrl, TileAt(m_nNext)))) {
+				break;
+			}
+
+			// take a token, refilling the bucket first; it holds up to a second worth of them
+			ULONGLONG tmNow = GetTickCount64();
+			m_dTokens = std::min(m_dTokens + (tmNow - m_tmLastRefill) * m_dMaxTilesPerSecond / 1000.0, std::max(m_dMaxTilesPerSecond, 1.0));
+			m_tmLastRefill = tmNow;
+			if (m_dTokens < 1.0) {
+				break;
+			}
+			m_dTokens -= 1.0;
+
+			nIndex = m_nNext++;
+			coords = TileAt(nIndex);
+			m_vecInFlight.push_back({ nIndex, 0, false });
+		}
+
+		// start the request outside the lock, as the callback might be called synchronously
+		TraceAsyncBegin("SeedTile", nIndex);
+		HttpClient::RequestId id = m_httpClient.Get(FormatTileUrl(m_strBaseUrl, coords),
+			[this, nIndex, coords](int nStatus, ResponseBuffer buffer, const HttpCacheInfo& cacheInfo) {
+				OnRequestFinished(nIndex, coords, nStatus, std::move(buffer), cacheInfo);
+			});
+
+		// remember request id, unless it is already finished; and cancel it if it was
+		// meant to be cancelled while we didn't have the id
+		bool bCancel = false;
+		{
+			std::lock_guard lock(m_mutex);
+			auto it = std::find_if(m_vecInFlight.begin(), m_vecInFlight.end(),
+				[=](auto& request) { return request.nIndex == nIndex; });
+			if (it != m_vecInFlight.end()) {
+				it->id = id;
+				bCancel = it->bCancel;
+			}
+		}
+		if (bCancel) {
+			m_httpClient.Cancel(id);
+		}
+	}
+
+	// the job is done when all tiles were gone through, checked outside of the loop
+	// since the last request might have finished synchronously
+	std::lock_guard lock(m_mutex);
+	if (m_bRunning && m_nNext >= m_nTotal && m_vecInFlight.empty()) {
+		m_bRunning = false;
+		if (m_nFailed) {
+			// leave the job to be resumed, which will retry just the tiles that failed
+			PrintLnDebug(L"Seeding done, {} tiles failed", m_nFailed);
+			m_nNext = 0;
+			m_nFailed = 0;
+			SaveState();
+		} else {
+			PrintLnDebug(L"Seeding done, {} tiles downloaded, {} bytes", m_nDownloaded, m_ullBytes);
+			SaveState(true);
+		}
+	}
+}
+
+void TileSeeder::OnRequestFinished(unsigned long long nIndex, TileCoords coords, int nStatus, ResponseBuffer buffer, const HttpCacheInfo& cacheInfo)
+{
+	// this is a callback executing on a different (worker) thread!
+	TraceAsyncEnd("SeedTile", nIndex);
+	if (buffer) {
+		// the cache is thread safe on its own, no need to hold our lock for writing into it
+		m_tileCache.Write(m_nSourceId, coords, buffer.data(), buffer.size(), &cacheInfo);
+	}
+
+	{
+		std::lock_guard lock(m_mutex);
+		auto it = std::find_if(m_vecInFlight.begin(), m_vecInFlight.end(),
+			[=](auto& request) { return request.nIndex == nIndex; });
+		_ASSERT(it != m_vecInFlight.end());
+		m_vecInFlight.erase(it);
+
+		if (nStatus == 0) {
+			m_nDownloaded++;
+			m_ullBytes += buffer.size();
+		} else if (nStatus != -ERROR_INTERNET_OPERATION_CANCELLED) {
+			PrintLnDebug(L"Seeding tile {}/{}/{} failed: nStatus = {}", coords.zoom, coords.x, coords.y, nStatus);
+			m_nFailed++;
+		}
+		if (m_bRunning && ++m_nUnsaved >= SAVE_INTERVAL) {
+			SaveState();
+		}
+		if (m_vecInFlight.empty()) {
+			m_cvIdle.notify_all();
+		}
+	}
+	Pump();
+}
+
+void TileSeeder::SaveState(bool bDelete)
+{
+	m_nUnsaved = 0;
+	if (bDelete) {
+		DeleteFile(m_strStatePath.c_str());
+		return;
+	}
+
+	// write a new file and replace the old one with it, so that there's always a complete one
+	SavedState state = { SavedState::MAGIC, SavedState::VERSION, m_nSourceId, m_region, Cursor(),
+		m_nSkipped, m_nDownloaded, m_nFailed, m_ullBytes };
+	std::wstring strTempPath = m_strStatePath + L".tmp";
+	HANDLE hFile = CreateFile(strTempPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		PrintLnDebug(L"Failed to save seeding state to {}, error {}", strTempPath, GetLastError());
+		return;
+	}
+	DWORD dwWritten = 0;
+	bool bWritten = WriteFile(hFile, &state, sizeof(state), &dwWritten, nullptr) && dwWritten == sizeof(state);
+	CloseHandle(hFile);
+	if (!bWritten || !MoveFileEx(strTempPath.c_str(), m_strStatePath.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		PrintLnDebug(L"Failed to save seeding state to {}, error {}", m_strStatePath, GetLastError());
+	}
+}
+
+void CALLBACK TileSeeder::StaticPumpTimerCallback(PVOID lpParameter, BOOLEAN bTimerOrWaitFired)
+{
+	reinterpret_cast<TileSeeder*>(lpParameter)->Pump();
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+// TileSeeder.h: bulk download of all tiles of an area into TileCache, for use offline.
+// A seeding job is an area (lat/lng bounds) and a range of zoom levels; all tiles covering the
+// area at these levels are enumerated in a fixed order (by zoom, then row by row), so that a
+// single index, the cursor, describes progress.  Tiles already in the cache are skipped without
+// a request.  Downloads go straight to HttpClient (not TileScheduler, which only cares about the
+// current view), with a limit on requests in flight and a token bucket limiting the request
+// rate, so as to stay within tile servers' usage policies.
+// The job (area, cursor and counters) is saved to a small state file every now and then and when
+// stopped, so it can be resumed after the app is closed or crashes: at worst, a few tiles before
+// the saved cursor are checked against the cache once more.  The file is deleted when the job
+// is done, unless some tiles failed, in which case the cursor is rewound so that resuming
+// retries just these.  While the tile server's circuit breaker is open (see HttpClient), the job
+// holds off instead of failing tile after tile.
+// Thread safe; one job at a time.
+
+#include "HttpClient.h"
+#include "TileCoords.h"
+
+class TileCache;
+
+// area to seed: bounds in degrees and zoom levels, inclusive
+struct SeedRegion
+{
+	double dMinLat, dMinLng, dMaxLat, dMaxLng;
+	unsigned nMinZoom, nMaxZoom;
+};
+
+class TileSeeder
+{
+public:
+	static const unsigned DEFAULT_MAX_IN_FLIGHT = 2;
+	static constexpr double DEFAULT_MAX_TILES_PER_SECOND = 8.0;
+	// guess of an average tile size for estimates, until we have downloaded some
+	static const unsigned long long DEFAULT_BYTES_PER_TILE = 16 * 1024;
+
+	// strBaseUrl is as for TileManager.  strStatePath is where the job is saved for resuming
+	TileSeeder(HttpClient& httpClient, TileCache& tileCache, std::wstring strBaseUrl, std::wstring strStatePath,
+		unsigned nMaxInFlight = DEFAULT_MAX_IN_FLIGHT, double dMaxTilesPerSecond = DEFAULT_MAX_TILES_PER_SECOND);
+	// stops the job, if any, saving it
+	~TileSeeder();
+
+	// no copy/assignment
+	TileSeeder& operator=(const TileSeeder&) = delete;
+	TileSeeder(const TileSeeder&) = delete;
+
+	// number of tiles in a region, and a guess of their size in bytes
+	struct Estimate
+	{
+		unsigned long long nTiles, ullBytes;
+	};
+	static Estimate EstimateRegion(const SeedRegion& region, unsigned long long ullBytesPerTile = DEFAULT_BYTES_PER_TILE);
+
+	// starts a new job, replacing the current one (and any saved one)
+	void Start(const SeedRegion& region);
+	// resumes the job saved in the state file.  Returns false if there is none, or it is for
+	// a different tile server
+	bool Resume();
+	// stops the job, cancelling requests in flight (and waiting for them), and saves it for resuming
+	void Stop();
+
+	struct Stats
+	{
+		bool bRunning;
+		SeedRegion region;
+		// tiles in the job, and how many of them have been gone through (the cursor)
+		unsigned long long nTotal, nDone;
+		// tiles which were in the cache already, downloaded, or failed to download, since
+		// the job was started (including before resuming)
+		unsigned long long nSkipped, nDownloaded, nFailed;
+		// bytes downloaded, and estimate of the total size of the job based on the average so far
+		unsigned long long ullBytes, ullEstimatedBytes;
+		// throughput since the job was last started or resumed
+		unsigned long long nElapsedMs;
+		double dTilesPerSecond, dBytesPerSecond;
+	};
+	Stats stats();
+
+private:
+	// tiles of the job at one zoom level: a rectangle, and where it starts in the enumeration
+	struct ZoomRange
+	{
+		unsigned nZoom, x, y, nWidth;
+		unsigned long long nFirst, nCount;
+	};
+
+	struct InFlightRequest
+	{
+		unsigned long long nIndex;
+		HttpClient::RequestId id;
+		// cancellation requested before we got request id from HttpClient
+		bool bCancel;
+	};
+
+	// contents of the state file
+	struct SavedState;
+
+	HttpClient& m_httpClient;
+	TileCache& m_tileCache;
+	std::wstring m_strBaseUrl;
+	std::wstring m_strStatePath;
+	unsigned m_nSourceId;
+	unsigned m_nMaxInFlight;
+	double m_dMaxTilesPerSecond;
+
+	std::mutex m_mutex;
+	// signalled when the last request in flight finishes
+	std::condition_variable m_cvIdle;
+	bool m_bRunning = false;
+	SeedRegion m_region = {};
+	std::vector<ZoomRange> m_vecZooms;
+	unsigned long long m_nTotal = 0;
+	// next tile to go through
+	unsigned long long m_nNext = 0;
+	std::vector<InFlightRequest> m_vecInFlight;
+	unsigned long long m_nSkipped = 0, m_nDownloaded = 0, m_nFailed = 0, m_ullBytes = 0;
+	// for throughput: when the job was last (re)started, and counters at that moment
+	ULONGLONG m_tmStarted = 0;
+	unsigned long long m_nDownloadedAtStart = 0, m_ullBytesAtStart = 0;
+	// requests finished since the state was last saved
+	unsigned m_nUnsaved = 0;
+
+	// token bucket: requests which can be started right now, refilled at m_dMaxTilesPerSecond
+	double m_dTokens = 0.0;
+	ULONGLONG m_tmLastRefill = 0;
+	// timer queue timer for Pump(), which starts requests as tokens become available
+	HANDLE m_hPumpTimer = nullptr;
+
+	// sets up a job for a region, with the cursor at the beginning.  Must be called under lock
+	void SetRegion(const SeedRegion& region);
+	// coords of a tile by its index in the job
+	TileCoords TileAt(unsigned long long nIndex) const;
+	// the earliest tile not done yet, which is where the job resumes from.  Must be called under lock
+	unsigned long long Cursor() const;
+
+	// starts requests as long as there are tiles left, free slots and tokens
+	void Pump();
+	// called by HttpClient when a request completes
+	void OnRequestFinished(unsigned long long nIndex, TileCoords coords, int nStatus, ResponseBuffer buffer, const HttpCacheInfo& cacheInfo);
+
+	// writes the job to the state file, or deletes the file if bDelete.  Must be called under lock
+	void SaveState(bool bDelete = false);
+
+	// how often the state is saved, in finished requests
+	static const unsigned SAVE_INTERVAL = 64;
+
+	static void CALLBACK StaticPumpTimerCallback(PVOID lpParameter, BOOLEAN bTimerOrWaitFired);
+};
@@ -0,0 +1,221 @@
+// Trace.cpp: tracing implementation
+
+#include "framework.h"
+#include "Util.h"
+#include "Trace.h"
+
+enum TracePhase : char
+{
+	TP_COMPLETE = 'X',
+	TP_ASYNC_BEGIN = 'b',
+	TP_ASYNC_STEP = 'n',
+	TP_ASYNC_END = 'e'
+};
+
+struct TraceEvent
+{
+	const char* pszName;
+	// step name for TP_ASYNC_STEP
+	const char* pszStep;
+	// operation id for async events
+	unsigned long long nId;
+	long long tmStart, tmDuration;
+	TracePhase phase;
+};
+
+// events per thread; a tile load produces about 10, so this keeps the last several seconds of a busy map
+static const size_t TRACE_BUFFER_EVENTS = 8192;
+
+// ring buffer of a single thread
+struct TraceBuffer
+{
+	DWORD dwThreadId = GetCurrentThreadId();
+	std::string strThreadName;
+	// only taken by the owning thread, and by TraceDump()
+	std::mutex mutex;
+	std::vector<TraceEvent> vecEvents = std::vector<TraceEvent>(TRACE_BUFFER_EVENTS);
+	// where the next event goes, and whether the buffer is full already
+	size_t nNext = 0;
+	bool bWrapped = false;
+};
+
+static std::atomic<bool> g_bEnabled = true;
+static const std::chrono::steady_clock::time_point g_tmOrigin = std::chrono::steady_clock::now();
+
+// all buffers ever created, kept after their threads exit so that their events can still be dumped
+static std::mutex g_buffersMutex;
+static std::vector<std::shared_ptr<TraceBuffer>> g_vecBuffers;
+
+static thread_local std::shared_ptr<TraceBuffer> t_pBuffer;
+
+static TraceBuffer& GetThreadBuffer()
+{
+	if (!t_pBuffer) {
+		t_pBuffer = std::make_shared<TraceBuffer>();
+		std::lock_guard lock(g_buffersMutex);
+		g_vecBuffers.push_back(t_pBuffer);
+	}
+	return *t_pBuffer;
+}
+
+static void Record(const TraceEvent& event)
+{
+	TraceBuffer& buffer = GetThreadBuffer();
+	std::lock_guard lock(buffer.mutex);
+	buffer.vecEvents[buffer.nNext] = event;
+	if (++buffer.nNext == buffer.vecEvents.size()) {
+		buffer.nNext = 0;
+		buffer.bWrapped = true;
+	}
+}
+
+// appends a string as JSON string literal
+static void AppendJsonString(std::string& str, const char* psz)
+{
+	str += '"';
+	for (; *psz; psz++) {
+		if (*psz == '"' || *psz == '\\') {
+			str += '\\';
+		}
+		if ((unsigned char)*psz >= ' ') {
+			str += *psz;
+		}
+	}
+	str += '"';
+}
+
+void TraceSetEnabled(bool bEnabled)
+{
+	g_bEnabled = bEnabled;
+}
+
+bool TraceIsEnabled()
+{
+	return g_bEnabled.load(std::memory_order_relaxed);
+}
+
+void TraceSetThreadName(const char* pszName)
+{
+	TraceBuffer& buffer = GetThreadBuffer();
+	std::lock_guard lock(buffer.mutex);
+	buffer.strThreadName = pszName;
+}
+
+long long TraceNow()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - g_tmOrigin).count();
+}
+
+void TraceComplete(const char* pszName, long long tmStart, long long tmEnd)
+{
+	if (TraceIsEnabled()) {
+		Record({ pszName, nullptr, 0, tmStart, tmEnd - tmStart, TP_COMPLETE });
+	}
+}
+
+void TraceAsyncBegin(const char* pszName, unsigned long long nId)
+{
+	if (TraceIsEnabled()) {
+		Record({ pszName, nullptr, nId, TraceNow(), 0, TP_ASYNC_BEGIN });
+	}
+}
+
+void TraceAsyncStep(const char* pszName, unsigned long long nId, const char* pszStep)
+{
+	if (TraceIsEnabled()) {
+		Record({ pszName, pszStep, nId, TraceNow(), 0, TP_ASYNC_STEP });
+	}
+}
+
+void TraceAsyncEnd(const char* pszName, unsigned long long nId)
+{
+	if (TraceIsEnabled()) {
+		Record({ pszName, nullptr, nId, TraceNow(), 0, TP_ASYNC_END });
+	}
+}
+
+bool TraceDump(const std::wstring& strPath)
+{
+	std::vector<std::shared_ptr<TraceBuffer>> vecBuffers;
+	{
+		std::lock_guard lock(g_buffersMutex);
+		vecBuffers = g_vecBuffers;
+	}
+
+	// format everything in memory first, this is at most a few MB
+	DWORD dwProcessId = GetCurrentProcessId();
+	std::string strJson = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	bool bFirst = true;
+	for (auto& pBuffer : vecBuffers) {
+		std::vector<TraceEvent> vecEvents;
+		std::string strThreadName;
+		{
+			std::lock_guard lock(pBuffer->mutex);
+			// oldest first
+			if (pBuffer->bWrapped) {
+				vecEvents.assign(pBuffer->vecEvents.begin() + pBuffer->nNext, pBuffer->vecEvents.end());
+			}
+			vecEvents.insert(vecEvents.end(), pBuffer->vecEvents.begin(), pBuffer->vecEvents.begin() + pBuffer->nNext);
+			strThreadName = pBuffer->strThreadName;
+		}
+
+		if (!strThreadName.empty()) {
+			strJson += std::format("{}{{\"ph\":\"M\",\"pid\":{},\"tid\":{},\"name\":\"thread_name\",\"args\":{{\"name\":",
+				bFirst ? "" : ",\n", dwProcessId, pBuffer->dwThreadId);
+			AppendJsonString(strJson, strThreadName.c_str());
+			strJson += "}}";
+			bFirst = false;
+		}
+		for (const TraceEvent& event : vecEvents) {
+			strJson += std::format("{}{{\"ph\":\"{}\",\"pid\":{},\"tid\":{},\"ts\":{},\"name\":",
+				bFirst ? "" : ",\n", (char)event.phase, dwProcessId, pBuffer->dwThreadId, event.tmStart);
+			AppendJsonString(strJson, event.phase == TP_ASYNC_STEP ? event.pszStep : event.pszName);
+			if (event.phase == TP_COMPLETE) {
+				strJson += std::format(",\"dur\":{}}}", event.tmDuration);
+			} else {
+				// async events are grouped by category and id
+				strJson += ",\"cat\":";
+				AppendJsonString(strJson, event.pszName);
+				strJson += std::format(",\"id\":\"0x{:x}\"}}", event.nId);
+			}
+			bFirst = false;
+		}
+	}
+	strJson += "\n]}\n";
+	return WriteWholeFile(strPath, strJson);
+}
+
+void TraceHistogram::Record(long long nUs)
+{
+	nUs = std::max(nUs, 0ll);
+	unsigned nBucket = (unsigned)nUs;
+	if (nUs >= 4) {
+		// position of the top bit, and the next two bits below it
+		unsigned nExponent = 2;
+		while (nUs >> (nExponent + 1)) {
+			nExponent++;
+		}
+		nBucket = 4 * (nExponent - 1) + (unsigned)((nUs >> (nExponent - 2)) & 3);
+	}
+	m_nBuckets[std::min(nBucket, BUCKETS - 1)]++;
+	m_nCount++;
+	m_nTotalUs += nUs;
+	m_nMaxUs = std::max(m_nMaxUs, nUs);
+}
+
+long long TraceHistogram::Percentile(double dPercent) const
+{
+	unsigned long long nRank = (unsigned long long)std::ceil(m_nCount * dPercent / 100.0), nSeen = 0;
+	for (unsigned nBucket = 0; nBucket < BUCKETS; nBucket++) {
+		nSeen += m_nBuckets[nBucket];
+		if (nSeen >= nRank && nSeen > 0) {
+			if (nBucket < 4) {
+				return nBucket;
+			}
+			unsigned nExponent = nBucket / 4 + 1;
+			long long nUpper = ((4ll + nBucket % 4) << (nExponent - 2)) + (1ll << (nExponent - 2)) - 1;
+			return std::min(nUpper, m_nMaxUs);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+// Trace.h: lightweight tracing of what happens when, on which thread, for finding out where time goes.
+// Each thread records events into its own fixed-size ring buffer, so recording is cheap (a clock read
+// and a few stores, no allocations, a lock which is only ever contended while dumping) and old events
+// are simply overwritten.  Buffers of all threads can be dumped at any time as JSON in Chrome
+// trace event format, which can be opened in chrome://tracing or https://ui.perfetto.dev.
+// Event names and step names must be string literals (or otherwise live forever), as only
+// pointers to them are stored.
+
+// turns recording on or off (on by default).  Already recorded events are kept
+void TraceSetEnabled(bool bEnabled);
+bool TraceIsEnabled();
+
+// names the current thread in dumps
+void TraceSetThreadName(const char* pszName);
+
+// current time on the trace clock, in microseconds
+long long TraceNow();
+
+// records a complete event on the current thread, times as returned by TraceNow()
+void TraceComplete(const char* pszName, long long tmStart, long long tmEnd);
+
+// async events, which are not tied to a thread, e. g. for an HTTP request from start to finish.
+// nId identifies the operation and must be unique among operations with the same name in flight.
+// Steps mark points of interest in between
+void TraceAsyncBegin(const char* pszName, unsigned long long nId);
+void TraceAsyncStep(const char* pszName, unsigned long long nId, const char* pszStep);
+void TraceAsyncEnd(const char* pszName, unsigned long long nId);
+
+// writes all events recorded so far to a file.  Returns false on failure
+bool TraceDump(const std::wstring& strPath);
+
+// records a complete event for the lifetime of an object, use with TRACE_SCOPE() below
+class TraceScope
+{
+public:
+	TraceScope(const char* pszName) : m_pszName(pszName), m_tmStart(TraceIsEnabled() ? TraceNow() : -1) {}
+	~TraceScope()
+	{
+		if (m_tmStart >= 0) {
+			TraceComplete(m_pszName, m_tmStart, TraceNow());
+		}
+	}
+
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+	const char* m_pszName;
+	long long m_tmStart;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+// traces the rest of the enclosing block under a given name
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+
+// distribution of durations of a recurring operation, e. g. handling a mouse move, for percentiles.
+// Samples are counted in buckets growing by a quarter (four per power of two), so percentiles are
+// within 25% of exact, in constant time and memory no matter how many samples.  Not thread safe
+class TraceHistogram
+{
+public:
+	// adds a sample, microseconds
+	void Record(long long nUs);
+
+	unsigned long long count() const { return m_nCount; }
+	long long totalUs() const { return m_nTotalUs; }
+	long long maxUs() const { return m_nMaxUs; }
+	// duration which dPercent % of samples took at most, microseconds; 0 if there are no samples
+	long long Percentile(double dPercent) const;
+
+private:
+	// four buckets per power of two, up to 2^40 us, which is plenty
+	static const unsigned BUCKETS = 4 * 40;
+	unsigned long long m_nBuckets[BUCKETS] = {};
+	unsigned long long m_nCount = 0;
+	long long m_nTotalUs = 0, m_nMaxUs = 0;
+};
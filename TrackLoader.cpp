@@ -0,0 +1,414 @@
+// TrackLoader.cpp: GPX/GeoJSON track loading
+
+#include "framework.h"
+#include "PixelConvert.h"
+#include "Trace.h"
+#include "TrackLoader.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#ifdef _WIN32
+#include <intrin.h>
+#endif
+#define TRACKLOADER_X86
+#endif
+
+// files are not split into chunks smaller than this, not worth it
+static const size_t MIN_CHUNK_SIZE = 4 * 1024 * 1024;
+
+// points parsed from a part of the file
+struct TrackChunk
+{
+	const char* pBegin;
+	const char* pEnd;
+	// GeoJSON chunks other than the first start right at a position inside a "coordinates" array
+	bool bInCoordinates = false;
+	std::vector<double> vecLat, vecLng;
+	// local indexes of points starting a new track
+	std::vector<size_t> vecTrackStarts;
+	// a new track starts with the first point after this chunk
+	bool bTrailingBreak = false;
+	double dMinLat = 90.0, dMinLng = 180.0, dMaxLat = -90.0, dMaxLng = -180.0;
+};
+
+// Scanning helpers.  pEnd is always the end of the whole file, so that nothing is read past it
+
+static const char* FindByte(const char* p, const char* pEnd, char ch)
+{
+#ifdef TRACKLOADER_X86
+	if (GetSimdLevel() >= SIMD_SSE2) {
+		const __m128i needle = _mm_set1_epi8(ch);
+		for (; pEnd - p >= 16; p += 16) {
+			int nMask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), needle));
+			if (nMask) {
+#ifdef _MSC_VER
+				unsigned long nIndex;
+				_BitScanForward(&nIndex, nMask);
+#else
+				unsigned nIndex = __builtin_ctz(nMask);
+#endif
+				return p + nIndex;
+			}
+		}
+	}
+#endif
+	for (; p < pEnd; p++) {
+		if (*p == ch) {
+			return p;
+		}
+	}
+	return pEnd;
+}
+
+static bool StartsWith(const char* p, const char* pEnd, const char* pszPrefix, size_t nLength)
+{
+	return (size_t)(pEnd - p) >= nLength && !memcmp(p, pszPrefix, nLength);
+}
+
+static const char* FindString(const char* p, const char* pEnd, const char* pszNeedle, size_t nLength)
+{
+	for (p = FindByte(p, pEnd, pszNeedle[0]); p < pEnd; p = FindByte(p + 1, pEnd, pszNeedle[0])) {
+		if (StartsWith(p, pEnd, pszNeedle, nLength)) {
+			return p;
+		}
+	}
+	return pEnd;
+}
+
+static bool IsSpace(char ch)
+{
+	return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
+}
+
+static const char* SkipSpace(const char* p, const char* pEnd)
+{
+	while (p < pEnd && IsSpace(*p)) {
+		p++;
+	}
+	return p;
+}
+
+static bool IsNumberStart(char ch)
+{
+	return (ch >= '0' && ch <= '9') || ch == '-' || ch == '+' || ch == '.';
+}
+
+// Numbers.  Coordinates are plain decimals with up to 15 or so significant digits, which are parsed
+// here directly: the digits make up an integer which is divided by an exact power of ten, and that
+// is correctly rounded as long as the integer fits into 53 bits (Clinger's fast path), so the result
+// is the same as from_chars() gives, in about half the time.  Anything else (exponents, more
+// digits) goes to from_chars().  Digits are taken one at a time: coordinates rarely have runs of 8,
+// so converting 8 at a time as one 64-bit word only made this slower
+
+static const double POWERS_OF_TEN[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// adds digits at p to nMantissa, counting them.  Past 19 digits, nMantissa is garbage
+static const char* ParseDigits(const char* p, const char* pEnd, ULONGLONG& nMantissa, int& nDigits)
+{
+	// in a local, as a store through the reference could change *p as far as the compiler knows
+	ULONGLONG nValue = nMantissa;
+	const char* pStart = p;
+	for (; p < pEnd && (unsigned)(*p - '0') < 10; p++) {
+		nValue = nValue * 10 + (unsigned)(*p - '0');
+	}
+	nMantissa = nValue;
+	nDigits += (int)(p - pStart);
+	return p;
+}
+
+// parses a number, returning pointer past it, or null if there isn't one
+static const char* ParseNumber(const char* p, const char* pEnd, double& d)
+{
+	p = SkipSpace(p, pEnd);
+	// from_chars() doesn't accept explicit plus
+	if (p < pEnd && *p == '+') {
+		p++;
+	}
+	const char* pStart = p;
+	bool bNegative = p < pEnd && *p == '-';
+	ULONGLONG nMantissa = 0;
+	int nDigits = 0, nFraction = 0;
+	const char* q = ParseDigits(p + bNegative, pEnd, nMantissa, nDigits);
+	if (q < pEnd && *q == '.') {
+		const char* pFraction = q + 1;
+		q = ParseDigits(pFraction, pEnd, nMantissa, nDigits);
+		nFraction = (int)(q - pFraction);
+	}
+	if (nDigits && nDigits <= 19 && nMantissa <= (1ull << 53) && nFraction <= 22 && (q >= pEnd || (*q != 'e' && *q != 'E'))) {
+		d = (double)nMantissa / POWERS_OF_TEN[nFraction];
+		d = bNegative ? -d : d;
+		return q;
+	}
+	auto result = std::from_chars(pStart, pEnd, d);
+	return result.ec == std::errc() ? result.ptr : nullptr;
+}
+
+static void AddPoint(TrackChunk& chunk, double dLat, double dLng, bool& bNewTrack)
+{
+	if (bNewTrack) {
+		chunk.vecTrackStarts.push_back(chunk.vecLat.size());
+		bNewTrack = false;
+	}
+	chunk.vecLat.push_back(dLat);
+	chunk.vecLng.push_back(dLng);
+}
+
+// GPX
+
+static const char* FindGpxPoint(const char* p, const char* pEnd)
+{
+	for (p = FindByte(p, pEnd, '<'); p < pEnd; p = FindByte(p + 1, pEnd, '<')) {
+		if (StartsWith(p, pEnd, "<trkpt", 6) || StartsWith(p, pEnd, "<rtept", 6)) {
+			return p;
+		}
+	}
+	return pEnd;
+}
+
+// parses a numeric attribute of a tag, [p, pTagEnd)
+static bool ParseGpxAttribute(const char* p, const char* pTagEnd, const char* pszName, size_t nLength, double& d)
+{
+	for (p = FindString(p, pTagEnd, pszName, nLength); p < pTagEnd; p = FindString(p + 1, pTagEnd, pszName, nLength)) {
+		// must be a whole attribute name, which can't be at the start of the tag
+		if (!IsSpace(p[-1])) {
+			continue;
+		}
+		const char* q = SkipSpace(p + nLength, pTagEnd);
+		if (q >= pTagEnd || *q != '=') {
+			continue;
+		}
+		q = SkipSpace(q + 1, pTagEnd);
+		if (q >= pTagEnd || (*q != '"' && *q != '\'')) {
+			continue;
+		}
+		return ParseNumber(q + 1, pTagEnd, d) != nullptr;
+	}
+	return false;
+}
+
+static void ParseGpxChunk(TrackChunk& chunk, const char* pFileEnd)
+{
+	bool bNewTrack = false;
+	for (const char* p = FindByte(chunk.pBegin, pFileEnd, '<'); p < chunk.pEnd; p = FindByte(p + 1, pFileEnd, '<')) {
+		if (StartsWith(p, pFileEnd, "<trkpt", 6) || StartsWith(p, pFileEnd, "<rtept", 6)) {
+			const char* pTagEnd = FindByte(p, pFileEnd, '>');
+			double dLat, dLng;
+			if (ParseGpxAttribute(p, pTagEnd, "lat", 3, dLat) && ParseGpxAttribute(p, pTagEnd, "lon", 3, dLng)) {
+				AddPoint(chunk, dLat, dLng, bNewTrack);
+			}
+			p = pTagEnd - 1;
+		} else if (StartsWith(p, pFileEnd, "<trkseg", 7) || StartsWith(p, pFileEnd, "<rte", 4)) {
+			bNewTrack = true;
+		}
+	}
+	chunk.bTrailingBreak = bNewTrack;
+}
+
+// GeoJSON
+
+// finds a place to split GeoJSON: between two positions in the same array, "],[", returning
+// the second '['.  This could in theory be in some array in properties instead of coordinates,
+// which would result in a few garbage points
+static const char* FindGeoJsonSplit(const char* p, const char* pEnd)
+{
+	for (p = FindByte(p, pEnd, ']'); p < pEnd; p = FindByte(p + 1, pEnd, ']')) {
+		const char* q = SkipSpace(p + 1, pEnd);
+		if (q >= pEnd || *q != ',') {
+			continue;
+		}
+		q = SkipSpace(q + 1, pEnd);
+		if (q >= pEnd || *q != '[') {
+			continue;
+		}
+		const char* r = SkipSpace(q + 1, pEnd);
+		if (r < pEnd && IsNumberStart(*r)) {
+			return q;
+		}
+	}
+	return pEnd;
+}
+
+static void ParseGeoJsonChunk(TrackChunk& chunk, const char* pFileEnd)
+{
+	// no need to keep track of nesting: in coordinates, a '[' followed by a number starts
+	// a position, ']' right after a position ends the list of positions, i. e. the track,
+	// and anything but brackets, commas and whitespace ends coordinates altogether
+	static const char COORDINATES[] = "\"coordinates\"";
+	bool bIn = chunk.bInCoordinates, bNewTrack = false;
+	const char* p = chunk.pBegin;
+	while (p < chunk.pEnd) {
+		if (!bIn) {
+			p = FindString(p, chunk.pEnd, COORDINATES, sizeof(COORDINATES) - 1);
+			if (p >= chunk.pEnd) {
+				break;
+			}
+			p = SkipSpace(p + sizeof(COORDINATES) - 1, pFileEnd);
+			if (p < pFileEnd && *p == ':') {
+				p++;
+				bIn = true;
+				bNewTrack = true;
+			}
+			continue;
+		}
+
+		switch (*p) {
+		case '[': {
+			const char* q = SkipSpace(p + 1, pFileEnd);
+			if (q >= pFileEnd || !IsNumberStart(*q)) {
+				// nested array
+				p = q;
+				break;
+			}
+			// position: longitude, latitude, and maybe altitude, which we don't need
+			double dLat, dLng;
+			q = ParseNumber(q, pFileEnd, dLng);
+			q = q ? SkipSpace(q, pFileEnd) : nullptr;
+			q = q && q < pFileEnd && *q == ',' ? ParseNumber(q + 1, pFileEnd, dLat) : nullptr;
+			if (!q) {
+				bIn = false;
+				p++;
+				break;
+			}
+			AddPoint(chunk, dLat, dLng, bNewTrack);
+			p = FindByte(q, pFileEnd, ']');
+			p += p < pFileEnd;
+			break;
+		}
+		case ']':
+			bNewTrack = true;
+			p++;
+			break;
+		case ',':
+		case ' ':
+		case '\t':
+		case '\r':
+		case '\n':
+			p++;
+			break;
+		default:
+			bIn = false;
+			break;
+		}
+	}
+	chunk.bTrailingBreak = bNewTrack;
+}
+
+bool LoadTracks(const char* pData, size_t szLength, TrackData& data, unsigned nThreads)
+{
+	TRACE_SCOPE("LoadTracks");
+	const char* pEnd = pData + szLength;
+
+	// detect format by the first character, after UTF-8 BOM if any
+	const char* p = pData;
+	if (StartsWith(p, pEnd, "\xEF\xBB\xBF", 3)) {
+		p += 3;
+	}
+	p = SkipSpace(p, pEnd);
+	if (p >= pEnd || (*p != '<' && *p != '{' && *p != '[')) {
+		return false;
+	}
+	bool bGpx = *p == '<';
+
+	// split into chunks at point boundaries
+	if (!nThreads) {
+		nThreads = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+	size_t nChunks = std::clamp(szLength / MIN_CHUNK_SIZE, (size_t)1, (size_t)nThreads);
+	std::vector<TrackChunk> vecChunks(nChunks);
+	vecChunks[0].pBegin = p;
+	for (size_t i = 1; i < nChunks; i++) {
+		const char* pNominal = std::max(pData + szLength / nChunks * i, vecChunks[i - 1].pBegin);
+		vecChunks[i].pBegin = bGpx ? FindGpxPoint(pNominal, pEnd) : FindGeoJsonSplit(pNominal, pEnd);
+		vecChunks[i].bInCoordinates = !bGpx;
+		vecChunks[i - 1].pEnd = vecChunks[i].pBegin;
+	}
+	vecChunks[nChunks - 1].pEnd = pEnd;
+
+	// parse chunks in parallel, the first one on this thread
+	auto parse = [=](TrackChunk& chunk) {
+		TRACE_SCOPE("LoadTracks chunk");
+		if (bGpx) {
+			ParseGpxChunk(chunk, pEnd);
+		} else {
+			ParseGeoJsonChunk(chunk, pEnd);
+		}
+		for (size_t i = 0; i < chunk.vecLat.size(); i++) {
+			chunk.dMinLat = std::min(chunk.dMinLat, chunk.vecLat[i]);
+			chunk.dMaxLat = std::max(chunk.dMaxLat, chunk.vecLat[i]);
+			chunk.dMinLng = std::min(chunk.dMinLng, chunk.vecLng[i]);
+			chunk.dMaxLng = std::max(chunk.dMaxLng, chunk.vecLng[i]);
+		}
+	};
+	std::vector<std::thread> vecThreads;
+	for (size_t i = 1; i < nChunks; i++) {
+		vecThreads.emplace_back(parse, std::ref(vecChunks[i]));
+	}
+	parse(vecChunks[0]);
+	for (std::thread& thread : vecThreads) {
+		thread.join();
+	}
+
+	// and glue results together.  A chunk's first track continues the previous chunk's last one,
+	// unless there was a track break in between
+	size_t nPoints = 0;
+	for (TrackChunk& chunk : vecChunks) {
+		nPoints += chunk.vecLat.size();
+	}
+	data = TrackData();
+	data.vecLat.reserve(nPoints);
+	data.vecLng.reserve(nPoints);
+	bool bBreak = true;
+	for (TrackChunk& chunk : vecChunks) {
+		if (chunk.vecLat.empty()) {
+			bBreak = bBreak || chunk.bTrailingBreak;
+			continue;
+		}
+		size_t nBase = data.vecLat.size();
+		if (bBreak && (chunk.vecTrackStarts.empty() || chunk.vecTrackStarts[0] != 0)) {
+			data.vecTrackStarts.push_back(nBase);
+		}
+		for (size_t nStart : chunk.vecTrackStarts) {
+			data.vecTrackStarts.push_back(nBase + nStart);
+		}
+		data.vecLat.insert(data.vecLat.end(), chunk.vecLat.begin(), chunk.vecLat.end());
+		data.vecLng.insert(data.vecLng.end(), chunk.vecLng.begin(), chunk.vecLng.end());
+		data.dMinLat = std::min(data.dMinLat, chunk.dMinLat);
+		data.dMaxLat = std::max(data.dMaxLat, chunk.dMaxLat);
+		data.dMinLng = std::min(data.dMinLng, chunk.dMinLng);
+		data.dMaxLng = std::max(data.dMaxLng, chunk.dMaxLng);
+		bBreak = chunk.bTrailingBreak;
+		// free memory as we go, for large files this is a lot
+		chunk = TrackChunk();
+	}
+	return true;
+}
+
+bool LoadTracks(const std::wstring& strPath, TrackData& data, unsigned nThreads)
+{
+	HANDLE hFile = CreateFile(strPath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER liSize;
+	if (!GetFileSizeEx(hFile, &liSize) || liSize.QuadPart == 0 || (unsigned long long)liSize.QuadPart > SIZE_MAX) {
+		CloseHandle(hFile);
+		return false;
+	}
+
+	// the whole file is mapped at once, which for huge files needs a 64-bit build
+	bool bResult = false;
+	HANDLE hMapping = CreateFileMapping(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (hMapping) {
+		const char* pData = static_cast<const char*>(MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0));
+		if (pData) {
+			bResult = LoadTracks(pData, (size_t)liSize.QuadPart, data, nThreads);
+			UnmapViewOfFile(pData);
+		}
+		CloseHandle(hMapping);
+	}
+	CloseHandle(hFile);
+	return bResult;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+// TrackLoader.h: loading tracks from GPX and GeoJSON files, which can be gigabytes in size.
+// The file is memory-mapped and scanned for coordinates in a single pass, without building any
+// document tree: in GPX, lat/lon attributes of <trkpt>/<rtept> elements (a new track starts
+// with every <trkseg> and <rte>); in GeoJSON, positions in any "coordinates" arrays (every innermost
+// list of positions is a track, so LineStrings, MultiLineStrings and polygon rings all work).
+// Everything else is skipped with SSE2 byte scanning, and typical coordinates are parsed without
+// from_chars(), see TrackLoader.cpp.  Large files are split into chunks at
+// point boundaries and parsed in parallel, one thread per CPU.
+// Neither format is validated; garbage is either skipped or results in garbage points.
+
+// tracks loaded from a file, as flat arrays of coordinates in degrees (structure of arrays)
+struct TrackData
+{
+	std::vector<double> vecLat, vecLng;
+	// index of the first point of each track
+	std::vector<size_t> vecTrackStarts;
+	// bounds of all points; min > max if there are none
+	double dMinLat = 90.0, dMinLng = 180.0, dMaxLat = -90.0, dMaxLng = -180.0;
+
+	size_t trackCount() const { return vecTrackStarts.size(); }
+	// number of points in a track
+	size_t trackSize(size_t nTrack) const
+	{
+		return (nTrack + 1 < vecTrackStarts.size() ? vecTrackStarts[nTrack + 1] : vecLat.size()) - vecTrackStarts[nTrack];
+	}
+};
+
+// loads a file, GPX or GeoJSON (detected by its first character).  nThreads = 0 means one per CPU.
+// Returns false if the file could not be read or is neither format
+bool LoadTracks(const std::wstring& strPath, TrackData& data, unsigned nThreads = 0);
+
+// same from memory, e. g. for files mapped already
+bool LoadTracks(const char* pData, size_t szLength, TrackData& data, unsigned nThreads = 0);
@@ -0,0 +1,278 @@
+// TrackOverlay.cpp: TrackOverlay class implementation
+
+#include "framework.h"
+#include "Canvas.h"
+#include "Trace.h"
+#include "TrackOverlay.h"
+
+static unsigned long long MicrosecondsSince(std::chrono::steady_clock::time_point tmStart)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - tmStart).count();
+}
+
+TrackOverlay::TrackOverlay(unsigned nTileSize) : m_nTileSize(nTileSize),
+	m_color(D2D1::ColorF(D2D1::ColorF::Red, .8f))
+{
+}
+
+void TrackOverlay::AddTrack(const MercatorPoint* pPoints, size_t nPoints)
+{
+	TRACE_SCOPE("TrackOverlay::AddTrack");
+	auto tmStart = std::chrono::steady_clock::now();
+	if (nPoints < 2) {
+		// nothing to draw
+		return;
+	}
+
+	unsigned nBase = (unsigned)m_vecPoints.size();
+	m_vecPoints.insert(m_vecPoints.end(), pPoints, pPoints + nPoints);
+	m_vecTrackStarts.push_back(nBase);
+	// whatever is visible has to be culled again
+	m_bCulled = false;
+
+	std::vector<double> vecImportance;
+	ComputeImportance(pPoints, nPoints, vecImportance);
+
+	// simplified versions are nested, points kept at a zoom level are kept at all higher levels too
+	for (unsigned nLevel = 0; nLevel <= MAX_LEVEL; nLevel++) {
+		Level& level = m_levels[nLevel];
+		double dTolerance = TOLERANCE_PX / WorldSize(nLevel, m_nTileSize);
+		size_t nLevelStart = level.vecPoints.size();
+		for (size_t i = 0; i < nPoints; i++) {
+			if (vecImportance[i] >= dTolerance) {
+				level.vecPoints.push_back(nBase + (unsigned)i);
+				level.vecTrackStarts.push_back(level.vecPoints.size() == nLevelStart + 1);
+			}
+		}
+		for (size_t k = nLevelStart; k + 1 < level.vecPoints.size(); k++) {
+			AddSegment(level, nLevel, (unsigned)k);
+		}
+	}
+	m_nBuildUs += MicrosecondsSince(tmStart);
+}
+
+void TrackOverlay::Clear()
+{
+	m_vecPoints.clear();
+	m_vecTrackStarts.clear();
+	for (Level& level : m_levels) {
+		level = Level();
+	}
+	m_vecVisiblePoints.clear();
+	m_vecVisiblePolylines.clear();
+	m_bCulled = false;
+	m_nBuildUs = 0;
+}
+
+void TrackOverlay::ComputeImportance(const MercatorPoint* pPoints, size_t nPoints, std::vector<double>& vecImportance)
+{
+	vecImportance.assign(nPoints, 0.0);
+	vecImportance[0] = vecImportance[nPoints - 1] = std::numeric_limits<double>::infinity();
+
+	// iterative Douglas-Peucker, splitting at the farthest point from the segment between ends, as usual.
+	// A point's importance is capped by that of the split it is under, so that simplification
+	// at any tolerance is exactly what DP with that tolerance would produce
+	struct Span
+	{
+		size_t nFrom, nTo;
+		double dImportance;
+	};
+	std::vector<Span> vecStack = { { 0, nPoints - 1, std::numeric_limits<double>::infinity() } };
+	while (!vecStack.empty()) {
+		Span span = vecStack.back();
+		vecStack.pop_back();
+		if (span.nTo - span.nFrom < 2) {
+			continue;
+		}
+
+		// squared distance to the segment, not the line, so that backtracking points count too
+		MercatorPoint a = pPoints[span.nFrom], b = pPoints[span.nTo];
+		double dx = b.x - a.x, dy = b.y - a.y, dLength2 = dx * dx + dy * dy;
+		double dMax2 = -1.0;
+		size_t nMax = span.nFrom + 1;
+		for (size_t i = span.nFrom + 1; i < span.nTo; i++) {
+			double px = pPoints[i].x - a.x, py = pPoints[i].y - a.y;
+			double t = dLength2 > 0.0 ? std::clamp((px * dx + py * dy) / dLength2, 0.0, 1.0) : 0.0;
+			double ex = px - t * dx, ey = py - t * dy, d2 = ex * ex + ey * ey;
+			if (d2 > dMax2) {
+				dMax2 = d2;
+				nMax = i;
+			}
+		}
+
+		// all points exactly on the segment are equally unimportant, no need to go on splitting
+		if (dMax2 <= 0.0) {
+			continue;
+		}
+		double dImportance = std::min(std::sqrt(dMax2), span.dImportance);
+		vecImportance[nMax] = dImportance;
+		vecStack.push_back({ span.nFrom, nMax, dImportance });
+		vecStack.push_back({ nMax, span.nTo, dImportance });
+	}
+}
+
+void TrackOverlay::AddSegment(Level& level, unsigned nLevel, unsigned nIndex)
+{
+	if (level.vecTrackStarts[nIndex + 1]) {
+		return;
+	}
+
+	// walk through all tiles the segment crosses (Amanatides-Woo traversal), in tile units
+	int nTiles = 1 << nLevel;
+	double dTiles = nTiles;
+	MercatorPoint a = m_vecPoints[level.vecPoints[nIndex]], b = m_vecPoints[level.vecPoints[nIndex + 1]];
+	double ax = a.x * dTiles, ay = a.y * dTiles, dx = b.x * dTiles - ax, dy = b.y * dTiles - ay;
+	auto toTile = [=](double d) { return std::clamp((int)std::floor(d), 0, nTiles - 1); };
+	int x = toTile(ax), y = toTile(ay);
+	int nSteps = std::abs(toTile(ax + dx) - x) + std::abs(toTile(ay + dy) - y);
+	int nStepX = dx > 0 ? 1 : -1, nStepY = dy > 0 ? 1 : -1;
+	const double INF = std::numeric_limits<double>::infinity();
+	double tDeltaX = dx != 0.0 ? 1.0 / std::abs(dx) : INF, tDeltaY = dy != 0.0 ? 1.0 / std::abs(dy) : INF;
+	double tMaxX = dx > 0.0 ? (x + 1 - ax) / dx : dx < 0.0 ? (ax - x) / -dx : INF;
+	double tMaxY = dy > 0.0 ? (y + 1 - ay) / dy : dy < 0.0 ? (ay - y) / -dy : INF;
+	for (int nStep = 0; ; nStep++) {
+		// extend the run ending at the previous point if the track is still in this tile
+		std::vector<Run>& vecRuns = level.mapTiles[TileCoords::MakeKey(x, y, nLevel)];
+		if (!vecRuns.empty() && vecRuns.back().nEnd == nIndex) {
+			vecRuns.back().nEnd = nIndex + 1;
+		} else {
+			vecRuns.push_back({ nIndex, nIndex + 1 });
+			level.nRuns++;
+		}
+
+		if (nStep == nSteps) {
+			break;
+		}
+		if (tMaxX < tMaxY) {
+			x = std::clamp(x + nStepX, 0, nTiles - 1);
+			tMaxX += tDeltaX;
+		} else {
+			y = std::clamp(y + nStepY, 0, nTiles - 1);
+			tMaxY += tDeltaY;
+		}
+	}
+}
+
+void TrackOverlay::UpdateView(unsigned nZoom, const MercatorRect& rectView)
+{
+	// what is visible only changes when the view moves into other tiles of the level, which
+	// is rarely the case while panning (this is called on every mouse move)
+	unsigned nLevel = std::min(nZoom, MAX_LEVEL);
+	int nTiles = 1 << nLevel;
+	auto toTile = [=](double d) { return (unsigned)std::clamp((int)std::floor(d * nTiles), 0, nTiles - 1); };
+	unsigned x0 = toTile(rectView.left), x1 = toTile(rectView.right), y0 = toTile(rectView.top), y1 = toTile(rectView.bottom);
+	TileRange range = { nLevel, x0, y0, x1, y1 };
+	if (m_bCulled && range == m_culledRange) {
+		return;
+	}
+	m_culledRange = range;
+	m_bCulled = true;
+
+	TRACE_SCOPE("TrackOverlay::UpdateView");
+	auto tmStart = std::chrono::steady_clock::now();
+	m_vecVisiblePoints.clear();
+	m_vecVisiblePolylines.clear();
+	Level& level = m_levels[nLevel];
+
+	// collect runs in visible tiles.  If there are fewer non-empty tiles than visible ones, which
+	// is normal for low zoom levels, it is cheaper to go through them instead
+	m_vecRuns.clear();
+	if ((size_t)(x1 - x0 + 1) * (y1 - y0 + 1) > level.mapTiles.size()) {
+		for (auto& kv : level.mapTiles) {
+			TileCoords coords = TileCoords::FromKey(kv.first);
+			if (coords.x >= x0 && coords.x <= x1 && coords.y >= y0 && coords.y <= y1) {
+				m_vecRuns.insert(m_vecRuns.end(), kv.second.begin(), kv.second.end());
+			}
+		}
+	} else {
+		for (unsigned y = y0; y <= y1; y++) {
+			for (unsigned x = x0; x <= x1; x++) {
+				auto it = level.mapTiles.find(TileCoords::MakeKey(x, y, nLevel));
+				if (it != level.mapTiles.end()) {
+					m_vecRuns.insert(m_vecRuns.end(), it->second.begin(), it->second.end());
+				}
+			}
+		}
+	}
+
+	// a track crossing several visible tiles has a run in each of them; merge them back so
+	// that everything is drawn exactly once, with proper joins.  Runs of different tracks
+	// never touch, as no segment goes from one track to another
+	std::sort(m_vecRuns.begin(), m_vecRuns.end(), [](const Run& a, const Run& b) { return a.nBegin < b.nBegin; });
+	for (size_t i = 0; i < m_vecRuns.size(); ) {
+		Run run = m_vecRuns[i++];
+		while (i < m_vecRuns.size() && m_vecRuns[i].nBegin <= run.nEnd) {
+			run.nEnd = std::max(run.nEnd, m_vecRuns[i++].nEnd);
+		}
+
+		const double INF = std::numeric_limits<double>::infinity();
+		Polyline polyline = { m_vecVisiblePoints.size(), run.nEnd - run.nBegin + 1, { INF, INF, -INF, -INF } };
+		for (unsigned k = run.nBegin; k <= run.nEnd; k++) {
+			MercatorPoint pt = m_vecPoints[level.vecPoints[k]];
+			m_vecVisiblePoints.push_back(pt);
+			polyline.rectBounds.left = std::min(polyline.rectBounds.left, pt.x);
+			polyline.rectBounds.top = std::min(polyline.rectBounds.top, pt.y);
+			polyline.rectBounds.right = std::max(polyline.rectBounds.right, pt.x);
+			polyline.rectBounds.bottom = std::max(polyline.rectBounds.bottom, pt.y);
+		}
+		m_vecVisiblePolylines.push_back(polyline);
+	}
+	m_nLastCullUs = MicrosecondsSince(tmStart);
+}
+
+void TrackOverlay::Draw(Canvas& canvas, double dScale, double dOriginX, double dOriginY, const D2D1_RECT_F* pUpdateRect)
+{
+	if (m_vecVisiblePolylines.empty()) {
+		return;
+	}
+	TRACE_SCOPE("TrackOverlay::Draw");
+	auto tmStart = std::chrono::steady_clock::now();
+
+	// everything visible to screen coordinates at once
+	m_vecScreenPoints.resize(m_vecVisiblePoints.size());
+	MercatorToScreenBatch(m_vecVisiblePoints.data(), m_vecScreenPoints.data(), m_vecVisiblePoints.size(), dScale, dOriginX, dOriginY);
+
+	// update rectangle in Mercator coordinates, widened by line width
+	float fWidth = m_fWidth * canvas.dpiScale();
+	const double INF = std::numeric_limits<double>::infinity();
+	MercatorRect rectUpdate = { -INF, -INF, INF, INF };
+	if (pUpdateRect) {
+		rectUpdate = {
+			(pUpdateRect->left - fWidth + dOriginX) / dScale, (pUpdateRect->top - fWidth + dOriginY) / dScale,
+			(pUpdateRect->right + fWidth + dOriginX) / dScale, (pUpdateRect->bottom + fWidth + dOriginY) / dScale
+		};
+	}
+	for (const Polyline& polyline : m_vecVisiblePolylines) {
+		if (polyline.rectBounds.right >= rectUpdate.left && polyline.rectBounds.left <= rectUpdate.right &&
+			polyline.rectBounds.bottom >= rectUpdate.top && polyline.rectBounds.top <= rectUpdate.bottom) {
+			canvas.DrawPolyline(&m_vecScreenPoints[polyline.nStart], polyline.nCount, m_color, fWidth);
+		}
+	}
+	m_nLastDrawUs = MicrosecondsSince(tmStart);
+}
+
+void TrackOverlay::SetStyle(const D2D1_COLOR_F& color, float fWidth)
+{
+	m_color = color;
+	m_fWidth = fWidth;
+}
+
+TrackOverlay::Stats TrackOverlay::stats() const
+{
+	Stats stats = {};
+	stats.nTracks = m_vecTrackStarts.size();
+	stats.nPoints = m_vecPoints.size();
+	stats.szBytes = m_vecPoints.capacity() * sizeof(MercatorPoint) + m_vecTrackStarts.capacity() * sizeof(unsigned);
+	for (const Level& level : m_levels) {
+		// hash map nodes are estimated at key, vector and two pointers each
+		stats.szBytes += level.vecPoints.capacity() * sizeof(unsigned) + level.vecTrackStarts.capacity() / 8 +
+			level.nRuns * sizeof(Run) + level.mapTiles.size() * (sizeof(TileKey) + sizeof(std::vector<Run>) + 2 * sizeof(void*)) +
+			level.mapTiles.bucket_count() * sizeof(void*);
+	}
+	stats.nBuildUs = m_nBuildUs;
+	stats.nVisiblePoints = m_vecVisiblePoints.size();
+	stats.nVisiblePolylines = m_vecVisiblePolylines.size();
+	stats.nLastCullUs = m_nLastCullUs;
+	stats.nLastDrawUs = m_nLastDrawUs;
+	return stats;
+}
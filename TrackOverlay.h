@@ -0,0 +1,119 @@
+#pragma once
+
+// TrackOverlay.h: a layer of tracks (polylines, e. g. recorded GPS tracks) drawn over the map.
+// Tracks can have millions of points, so drawing everything on every frame is out of question.
+// Instead:
+// - every point gets a Douglas-Peucker importance when its track is added: the largest
+//   tolerance at which simplification still keeps it.  From that we know right away in which
+//   zoom levels the point is visible at all (simplified to TOLERANCE_PX pixels), and simplified
+//   versions for all zoom levels are built in one pass;
+// - for each zoom level, segments of the simplified tracks are bucketed into tiles of
+//   that zoom level, as runs of consecutive points, so that only runs intersecting
+//   the current view need to be looked at;
+// - visible runs are culled (UpdateView()) only when the view changes, and on every frame
+//   (Draw()) they are just projected to screen in one vectorized pass and drawn.
+// Not thread safe, meant to be used from the UI thread.
+
+#include "Projection.h"
+
+class Canvas;
+
+class TrackOverlay
+{
+public:
+	// nTileSize is the tile size of the map, in pixels, which defines what tolerance
+	// in pixels means at each zoom level
+	TrackOverlay(unsigned nTileSize);
+
+	// adds a track, in Mercator coordinates.  Takes time proportional to the number of
+	// points (times log of it), call UpdateView() afterwards to make it visible
+	void AddTrack(const MercatorPoint* pPoints, size_t nPoints);
+	// removes all tracks
+	void Clear();
+
+	// culls tracks to the current view, which is a rectangle on the map at a zoom level.  Does
+	// nothing if the view covers the same tiles as the last time
+	void UpdateView(unsigned nZoom, const MercatorRect& rectView);
+	// draws tracks visible in the last UpdateView() to a canvas.  dScale and dOriginX/Y are as in
+	// MercatorToScreenBatch().  If pUpdateRect is given, tracks entirely outside it are skipped
+	void Draw(Canvas& canvas, double dScale, double dOriginX, double dOriginY, const D2D1_RECT_F* pUpdateRect = nullptr);
+
+	// track color and width, in device independent pixels
+	void SetStyle(const D2D1_COLOR_F& color, float fWidth);
+
+	struct Stats
+	{
+		size_t nTracks, nPoints;
+		// memory used by points and indexes
+		size_t szBytes;
+		// total time spent in AddTrack(), microseconds
+		unsigned long long nBuildUs;
+		// points and polylines visible after the last UpdateView(), and how long culling took
+		size_t nVisiblePoints, nVisiblePolylines;
+		unsigned long long nLastCullUs;
+		// how long the last Draw() took, microseconds
+		unsigned long long nLastDrawUs;
+	};
+	Stats stats() const;
+
+	// simplification tolerance, in screen pixels
+	static constexpr double TOLERANCE_PX = 0.5;
+	// highest zoom level tracks are simplified for, higher levels use this one
+	static constexpr unsigned MAX_LEVEL = 18;
+
+private:
+	unsigned m_nTileSize;
+	D2D1_COLOR_F m_color;
+	float m_fWidth = 3.f;
+
+	// points of all tracks, one after another
+	std::vector<MercatorPoint> m_vecPoints;
+	// first point of each track
+	std::vector<unsigned> m_vecTrackStarts;
+
+	// a range of consecutive points in a level, [nBegin, nEnd], both ends inclusive
+	struct Run
+	{
+		unsigned nBegin, nEnd;
+	};
+	// simplified tracks for a zoom level
+	struct Level
+	{
+		// indexes of points (in m_vecPoints) kept at this level, with tracks one after another
+		std::vector<unsigned> vecPoints;
+		// for every point in vecPoints, whether it starts a new track
+		std::vector<bool> vecTrackStarts;
+		// tile key at this zoom level -> runs of vecPoints crossing that tile
+		std::unordered_map<TileKey, std::vector<Run>> mapTiles;
+		size_t nRuns = 0;
+	};
+	Level m_levels[MAX_LEVEL + 1];
+
+	// visible polylines, as ranges in m_vecVisiblePoints, with their bounds
+	struct Polyline
+	{
+		size_t nStart, nCount;
+		MercatorRect rectBounds;
+	};
+	std::vector<MercatorPoint> m_vecVisiblePoints;
+	std::vector<Polyline> m_vecVisiblePolylines;
+	// tiles of the level whose runs are in m_vecVisiblePolylines, both ends inclusive; not
+	// valid until the first UpdateView(), and after tracks change
+	struct TileRange
+	{
+		unsigned nLevel, x0, y0, x1, y1;
+		bool operator==(const TileRange&) const = default;
+	};
+	TileRange m_culledRange = {};
+	bool m_bCulled = false;
+	// scratch buffers
+	std::vector<D2D1_POINT_2F> m_vecScreenPoints;
+	std::vector<Run> m_vecRuns;
+
+	unsigned long long m_nBuildUs = 0, m_nLastCullUs = 0, m_nLastDrawUs = 0;
+
+	// computes Douglas-Peucker importance of points of a track, in Mercator units; for end points it is infinite
+	static void ComputeImportance(const MercatorPoint* pPoints, size_t nPoints, std::vector<double>& vecImportance);
+	// adds a segment from point nIndex to nIndex + 1 of the level to tiles it crosses
+	void AddSegment(Level& level, unsigned nLevel, unsigned nIndex);
+};
@@ -3,6 +3,7 @@
 
 // Util.cpp: some standalone functions
 
+#ifdef _WIN32
 std::wstring LoadStringFromResource(unsigned id)
 {
 	wchar_t buffer[1024];
@@ -11,3 +12,63 @@ std::wstring LoadStringFromResource(unsigned id)
 	}
 	return std::wstring(buffer);
 }
+
+
+std::wstring GetAppDataDirectory()
+{
+	PWSTR pszPath = nullptr;
+	if (FAILED(SHGetKnownFolderPath(FOLDERID_LocalAppData, 0, nullptr, &pszPath))) {
+		CoTaskMemFree(pszPath);
+		return L".";
+	}
+	std::wstring strPath = std::format(L"{}\\MapViewer", pszPath);
+	CoTaskMemFree(pszPath);
+	if (!CreateDirectory(strPath.c_str(), nullptr) && GetLastError() != ERROR_ALREADY_EXISTS) {
+		return L".";
+	}
+	return strPath;
+}
+#else
+std::wstring GetAppDataDirectory()
+{
+	// XDG data directory, as the local app data folder's counterpart
+	std::string strBase;
+	if (const char* pszDataHome = getenv("XDG_DATA_HOME"); pszDataHome && *pszDataHome) {
+		strBase = pszDataHome;
+	} else if (const char* pszHome = getenv("HOME"); pszHome && *pszHome) {
+		strBase = std::string(pszHome) + "/.local/share";
+	} else {
+		return L".";
+	}
+	std::wstring strPath = WidePath(strBase) + L"/MapViewer";
+	if (!CreateDirectory(strPath.c_str(), nullptr) && GetLastError() != ERROR_ALREADY_EXISTS) {
+		return L".";
+	}
+	return strPath;
+}
+#endif
+
+long long GetUnixTime()
+{
+	FILETIME ft;
+	GetSystemTimeAsFileTime(&ft);
+	return FileTimeToUnixTime(ft);
+}
+
+long long FileTimeToUnixTime(const FILETIME& ft)
+{
+	// FILETIME counts 100 ns intervals since 1601
+	return (long long)((((unsigned long long)ft.dwHighDateTime << 32) | ft.dwLowDateTime) / 10000000) - 11644473600ll;
+}
+
+bool WriteWholeFile(const std::wstring& strPath, const std::string& strData)
+{
+	HANDLE hFile = CreateFile(strPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	DWORD dwWritten = 0;
+	bool bResult = WriteFile(hFile, strData.data(), (DWORD)strData.size(), &dwWritten, nullptr) && dwWritten == strData.size();
+	CloseHandle(hFile);
+	return bResult;
+}
@@ -2,8 +2,22 @@
 
 // Util.h: some standalone functions
 
+#ifdef _WIN32
 // Loads a string from Win32 resources
 std::wstring LoadStringFromResource(unsigned id);
+#endif
+
+// Gets (creating if necessary) our directory for persistent data, in local app data
+// folder, e. g. C:\Users\<user>\AppData\Local\MapViewer (elsewhere, in XDG data directory,
+// e. g. ~/.local/share/MapViewer).  Falls back to current directory
+std::wstring GetAppDataDirectory();
+
+// Current time in seconds since 1970 (UTC), as HTTP cache expiry is kept in
+long long GetUnixTime();
+long long FileTimeToUnixTime(const FILETIME& ft);
+
+// Writes a whole file, replacing it if it exists.  Returns false on failure, see GetLastError()
+bool WriteWholeFile(const std::wstring& strPath, const std::string& strData);
 
 // Wrapper for OutputDebugString() + std::format()
 template<typename... Args>
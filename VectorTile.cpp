@@ -0,0 +1,238 @@
+// VectorTile.cpp: Mapbox Vector Tile decoding
+
+#include "framework.h"
+#include "VectorTile.h"
+
+// protocol buffer wire types
+enum WireType
+{
+	WT_VARINT = 0,
+	WT_FIXED64 = 1,
+	WT_LENGTH = 2,
+	WT_FIXED32 = 5
+};
+
+// Protocol buffer message reader: a sequence of fields, each a key (field number and wire type)
+// followed by a value.  All reads fail (return false) rather than go past the end
+class ProtoReader
+{
+public:
+	ProtoReader(const BYTE* p, const BYTE* pEnd) : m_p(p), m_pEnd(pEnd) {}
+
+	bool atEnd() const { return m_p >= m_pEnd; }
+
+	bool ReadVarint(unsigned long long& n)
+	{
+		n = 0;
+		for (unsigned nShift = 0; nShift < 64 && m_p < m_pEnd; nShift += 7) {
+			BYTE b = *m_p++;
+			n |= (unsigned long long)(b & 0x7f) << nShift;
+			if (!(b & 0x80)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool ReadKey(unsigned& nField, WireType& wireType)
+	{
+		unsigned long long n;
+		if (!ReadVarint(n)) {
+			return false;
+		}
+		nField = (unsigned)(n >> 3);
+		wireType = (WireType)(n & 7);
+		return true;
+	}
+
+	// length-delimited value: a nested message, string or packed repeated field
+	bool ReadBytes(const BYTE*& p, const BYTE*& pEnd)
+	{
+		unsigned long long n;
+		if (!ReadVarint(n) || n > (unsigned long long)(m_pEnd - m_p)) {
+			return false;
+		}
+		p = m_p;
+		pEnd = m_p + n;
+		m_p = pEnd;
+		return true;
+	}
+
+	bool Skip(WireType wireType)
+	{
+		unsigned long long n;
+		const BYTE *p, *pEnd;
+		switch (wireType) {
+		case WT_VARINT:
+			return ReadVarint(n);
+		case WT_FIXED64:
+			return Advance(8);
+		case WT_LENGTH:
+			return ReadBytes(p, pEnd);
+		case WT_FIXED32:
+			return Advance(4);
+		default:
+			// groups are deprecated and not used by MVT
+			return false;
+		}
+	}
+
+private:
+	const BYTE* m_p;
+	const BYTE* m_pEnd;
+
+	bool Advance(size_t n)
+	{
+		if ((size_t)(m_pEnd - m_p) < n) {
+			return false;
+		}
+		m_p += n;
+		return true;
+	}
+};
+
+// geometry commands
+enum GeometryCommand
+{
+	GC_MOVETO = 1,
+	GC_LINETO = 2,
+	GC_CLOSEPATH = 7
+};
+
+static int ZigZagDecode(unsigned n)
+{
+	return (int)(n >> 1) ^ -(int)(n & 1);
+}
+
+// decodes feature geometry, a packed sequence of commands and zigzag encoded deltas.  Every MoveTo
+// starts a new path.  ClosePath doesn't add a point, polygon rings are always closed anyway
+static bool DecodeGeometry(const BYTE* p, const BYTE* pEnd, VectorLayer& layer)
+{
+	ProtoReader reader(p, pEnd);
+	int x = 0, y = 0;
+	unsigned long long n;
+	while (!reader.atEnd()) {
+		if (!reader.ReadVarint(n)) {
+			return false;
+		}
+		unsigned nCommand = (unsigned)n & 7, nCount = (unsigned)(n >> 3);
+		if (nCommand == GC_CLOSEPATH) {
+			continue;
+		}
+		if (nCommand != GC_MOVETO && nCommand != GC_LINETO) {
+			return false;
+		}
+		for (unsigned i = 0; i < nCount; i++) {
+			unsigned long long dx, dy;
+			if (!reader.ReadVarint(dx) || !reader.ReadVarint(dy)) {
+				return false;
+			}
+			x += ZigZagDecode((unsigned)dx);
+			y += ZigZagDecode((unsigned)dy);
+			if (nCommand == GC_MOVETO) {
+				layer.vecPathStarts.push_back((unsigned)layer.vecPoints.size());
+			} else if (layer.vecPathStarts.empty()) {
+				// LineTo without MoveTo
+				return false;
+			}
+			layer.vecPoints.push_back({ x, y });
+		}
+	}
+	return true;
+}
+
+static bool DecodeFeature(const BYTE* p, const BYTE* pEnd, VectorLayer& layer)
+{
+	ProtoReader reader(p, pEnd);
+	VectorLayer::Feature feature = { VGT_UNKNOWN, (unsigned)layer.vecPathStarts.size(), 0 };
+	unsigned nField;
+	WireType wireType;
+	while (!reader.atEnd()) {
+		if (!reader.ReadKey(nField, wireType)) {
+			return false;
+		}
+		if (nField == 3 && wireType == WT_VARINT) {
+			unsigned long long n;
+			if (!reader.ReadVarint(n)) {
+				return false;
+			}
+			feature.type = n <= VGT_POLYGON ? (VectorGeometryType)n : VGT_UNKNOWN;
+		} else if (nField == 4 && wireType == WT_LENGTH) {
+			const BYTE *pGeometry, *pGeometryEnd;
+			if (!reader.ReadBytes(pGeometry, pGeometryEnd) || !DecodeGeometry(pGeometry, pGeometryEnd, layer)) {
+				return false;
+			}
+		} else if (!reader.Skip(wireType)) {
+			return false;
+		}
+	}
+	feature.nPaths = (unsigned)layer.vecPathStarts.size() - feature.nFirstPath;
+	if (feature.nPaths) {
+		layer.vecFeatures.push_back(feature);
+	}
+	return true;
+}
+
+static bool DecodeLayer(const BYTE* p, const BYTE* pEnd, VectorLayer& layer)
+{
+	ProtoReader reader(p, pEnd);
+	unsigned nField;
+	WireType wireType;
+	while (!reader.atEnd()) {
+		if (!reader.ReadKey(nField, wireType)) {
+			return false;
+		}
+		const BYTE *pValue, *pValueEnd;
+		if (nField == 1 && wireType == WT_LENGTH) {
+			if (!reader.ReadBytes(pValue, pValueEnd)) {
+				return false;
+			}
+			layer.strName.assign(reinterpret_cast<const char*>(pValue), pValueEnd - pValue);
+		} else if (nField == 2 && wireType == WT_LENGTH) {
+			if (!reader.ReadBytes(pValue, pValueEnd) || !DecodeFeature(pValue, pValueEnd, layer)) {
+				return false;
+			}
+		} else if (nField == 5 && wireType == WT_VARINT) {
+			unsigned long long n;
+			if (!reader.ReadVarint(n)) {
+				return false;
+			}
+			layer.nExtent = n ? (unsigned)n : 4096;
+		} else if (!reader.Skip(wireType)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool DecodeVectorTile(const void* pData, size_t szLength, VectorTile& tile)
+{
+	const BYTE* p = reinterpret_cast<const BYTE*>(pData);
+	ProtoReader reader(p, p + szLength);
+	unsigned nField;
+	WireType wireType;
+	while (!reader.atEnd()) {
+		if (!reader.ReadKey(nField, wireType)) {
+			return false;
+		}
+		if (nField == 3 && wireType == WT_LENGTH) {
+			const BYTE *pLayer, *pLayerEnd;
+			if (!reader.ReadBytes(pLayer, pLayerEnd) || !DecodeLayer(pLayer, pLayerEnd, tile.vecLayers.emplace_back())) {
+				return false;
+			}
+		} else if (!reader.Skip(wireType)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+const VectorLayer* VectorTile::layer(const std::string& strName) const
+{
+	for (const VectorLayer& layer : vecLayers) {
+		if (layer.strName == strName) {
+			return &layer;
+		}
+	}
+	return nullptr;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+// VectorTile.h: decoding of Mapbox Vector Tiles (MVT, https://github.com/mapbox/vector-tile-spec),
+// which are protocol buffers with layers of features, each feature a point, line or polygon
+// geometry in tile coordinates (0..extent, typically 4096) plus attributes.  Only geometry and
+// layer names are decoded, which is what drawing with a per-layer style needs; attributes are
+// skipped.  Geometry goes into compact flat arrays per layer: all points one after another,
+// grouped into paths (parts of multi-lines, polygon rings), grouped into features.
+// There's no protobuf library here, the wire format is simple enough to read by hand.
+
+// geometry types, as in the spec
+enum VectorGeometryType
+{
+	VGT_UNKNOWN = 0,
+	VGT_POINT = 1,
+	VGT_LINESTRING = 2,
+	VGT_POLYGON = 3
+};
+
+// point in tile coordinates; may be somewhat outside 0..extent, tiles have buffers around them
+struct VectorPoint
+{
+	int x, y;
+};
+
+struct VectorLayer
+{
+	std::string strName;
+	unsigned nExtent = 4096;
+
+	struct Feature
+	{
+		VectorGeometryType type;
+		// range in vecPathStarts
+		unsigned nFirstPath, nPaths;
+	};
+	std::vector<Feature> vecFeatures;
+	// index of the first point of each path in vecPoints; paths of a feature are consecutive,
+	// so a path ends where the next one starts
+	std::vector<unsigned> vecPathStarts;
+	std::vector<VectorPoint> vecPoints;
+
+	// points of a path
+	unsigned pathStart(unsigned nPath) const { return vecPathStarts[nPath]; }
+	unsigned pathEnd(unsigned nPath) const { return nPath + 1 < vecPathStarts.size() ? vecPathStarts[nPath + 1] : (unsigned)vecPoints.size(); }
+};
+
+struct VectorTile
+{
+	std::vector<VectorLayer> vecLayers;
+
+	// layer by name, or null
+	const VectorLayer* layer(const std::string& strName) const;
+};
+
+// decodes a tile from memory.  Returns false if it is not a valid protocol buffer message;
+// not much else can be checked, so garbage may still "decode" to nothing
+bool DecodeVectorTile(const void* pData, size_t szLength, VectorTile& tile);
@@ -0,0 +1,103 @@
+// VectorTileDecoder.cpp: VectorTileDecoder class implementation
+
+#include "framework.h"
+#include "Util.h"
+#include "Trace.h"
+#include "VectorTile.h"
+#include "VectorTileDecoder.h"
+
+VectorTileDecoder::VectorTileDecoder(unsigned nTileSize, unsigned nPixelSize, std::vector<VectorLayerStyle> vecStyle, UINT32 nBackgroundColor)
+	: m_nTileSize(nTileSize), m_nPixelSize(nPixelSize), m_vecStyle(vecStyle), m_nBackgroundColor(nBackgroundColor)
+{
+}
+
+std::vector<VectorLayerStyle> VectorTileDecoder::DefaultStyle()
+{
+	return {
+		{ "landcover", 0x80c8e0b0, 0, 0.f },
+		{ "landuse", 0x60e0dcd4, 0, 0.f },
+		{ "park", 0xffc8facc, 0, 0.f },
+		{ "water", 0xffaad3df, 0, 0.f },
+		{ "waterway", 0, 0xffaad3df, 1.f },
+		{ "aeroway", 0xffdadae0, 0xffbbbbcc, 1.f },
+		{ "building", 0xffd9d0c9, 0xffc4b6ab, 0.5f },
+		{ "transportation", 0, 0xffffffff, 1.5f },
+		{ "road", 0, 0xffffffff, 1.5f },
+		{ "boundary", 0, 0xff9e9cab, 1.f },
+		{ "admin", 0, 0xff9e9cab, 1.f }
+	};
+}
+
+bool VectorTileDecoder::Decode(const void* pData, size_t szLength, DecodedImage& image)
+{
+	if (szLength >= 2 && reinterpret_cast<const BYTE*>(pData)[0] == 0x1f && reinterpret_cast<const BYTE*>(pData)[1] == 0x8b) {
+		PrintLnDebug(L"Vector tile is gzip compressed, which is not supported");
+		return false;
+	}
+	VectorTile tile;
+	{
+		TRACE_SCOPE("DecodeVectorTile");
+		if (!DecodeVectorTile(pData, szLength, tile)) {
+			PrintLnDebug(L"Failed to decode vector tile at 0x{:x}", (intptr_t)pData);
+			return false;
+		}
+	}
+
+	TRACE_SCOPE("RasterizeVectorTile");
+	image.nWidth = image.nHeight = m_nPixelSize;
+	image.vecPixels.resize((size_t)image.stride() * image.nHeight);
+	UINT32 nBackground = PremultiplyColor(m_nBackgroundColor);
+	std::fill_n(reinterpret_cast<UINT32*>(image.vecPixels.data()), (size_t)image.nWidth * image.nHeight, nBackground);
+
+	// rasterizer and scratch buffer are reused across tiles on the same decode thread
+	thread_local Rasterizer rasterizer;
+	thread_local std::vector<D2D1_POINT_2F> vecPoints;
+	rasterizer.SetTarget(&image);
+	for (const VectorLayerStyle& style : m_vecStyle) {
+		if (const VectorLayer* pLayer = tile.layer(style.strLayer)) {
+			DrawLayer(*pLayer, style, rasterizer, vecPoints);
+		}
+	}
+	return true;
+}
+
+void VectorTileDecoder::DrawLayer(const VectorLayer& layer, const VectorLayerStyle& style, Rasterizer& rasterizer,
+	std::vector<D2D1_POINT_2F>& vecPoints)
+{
+	float fScale = (float)m_nPixelSize / layer.nExtent;
+	float fLineWidth = style.fLineWidth * m_nPixelSize / m_nTileSize;
+	auto toPixels = [&](unsigned nPath) {
+		vecPoints.clear();
+		for (unsigned i = layer.pathStart(nPath); i < layer.pathEnd(nPath); i++) {
+			vecPoints.push_back({ layer.vecPoints[i].x * fScale, layer.vecPoints[i].y * fScale });
+		}
+	};
+
+	// fills of all polygons of the layer at once (they don't overlap, normally), then lines
+	if (style.nFillColor >> 24) {
+		for (const VectorLayer::Feature& feature : layer.vecFeatures) {
+			if (feature.type == VGT_POLYGON) {
+				for (unsigned nPath = feature.nFirstPath; nPath < feature.nFirstPath + feature.nPaths; nPath++) {
+					toPixels(nPath);
+					rasterizer.AddPolygon(vecPoints.data(), vecPoints.size());
+				}
+			}
+		}
+		rasterizer.Fill(style.nFillColor);
+	}
+	if ((style.nLineColor >> 24) && fLineWidth > 0.f) {
+		for (const VectorLayer::Feature& feature : layer.vecFeatures) {
+			if (feature.type != VGT_LINESTRING && feature.type != VGT_POLYGON) {
+				continue;
+			}
+			for (unsigned nPath = feature.nFirstPath; nPath < feature.nFirstPath + feature.nPaths; nPath++) {
+				toPixels(nPath);
+				if (feature.type == VGT_POLYGON && !vecPoints.empty()) {
+					vecPoints.push_back(vecPoints.front());
+				}
+				rasterizer.AddPolyline(vecPoints.data(), vecPoints.size(), fLineWidth);
+			}
+		}
+		rasterizer.Fill(style.nLineColor);
+	}
+}
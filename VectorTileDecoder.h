@@ -0,0 +1,53 @@
+#pragma once
+
+// VectorTileDecoder.h: ImageDecoder for Mapbox Vector Tiles (see VectorTile.h), which decodes a tile
+// and draws it with a simple style into a bitmap, with Rasterizer.  To TileManager this is just
+// another image format: downloaded tiles (which are several times smaller than PNGs) are kept in
+// the disk cache as they are, and rasterized on DecodePool threads like any image is decoded.
+// The bitmap size is set up front and can be larger than the tile size in device independent
+// pixels, for sharp tiles on high DPI displays.
+// Tiles sent gzip compressed with Content-Encoding are decompressed by HttpClient; tiles stored
+// compressed on the server (sent as they are, without Content-Encoding) are not supported, and fail
+// to decode.
+
+#include "ImageDecoder.h"
+#include "Rasterizer.h"
+
+struct VectorLayer;
+
+// how to draw one layer: fill (polygons) and line (line strings, and outlines of polygons)
+// colors as straight 0xAARRGGBB, no fill/line if alpha is 0
+struct VectorLayerStyle
+{
+	std::string strLayer;
+	UINT32 nFillColor;
+	UINT32 nLineColor;
+	// line width, in pixels of a tile of the nominal size
+	float fLineWidth;
+};
+
+class VectorTileDecoder : public ImageDecoder
+{
+public:
+	// tiles are drawn into nPixelSize x nPixelSize bitmaps; nTileSize is the nominal tile size, which
+	// line widths in the style are relative to.  Layers are drawn in the order of vecStyle, layers
+	// not in it are not drawn at all
+	VectorTileDecoder(unsigned nTileSize, unsigned nPixelSize, std::vector<VectorLayerStyle> vecStyle = DefaultStyle(),
+		UINT32 nBackgroundColor = DEFAULT_BACKGROUND_COLOR);
+
+	bool Decode(const void* pData, size_t szLength, DecodedImage& image) override;
+
+	// style for the OpenMapTiles schema, used by most vector tile servers, with a few
+	// Mapbox Streets layer names thrown in
+	static std::vector<VectorLayerStyle> DefaultStyle();
+	static const UINT32 DEFAULT_BACKGROUND_COLOR = 0xfff2efe9;
+
+private:
+	unsigned m_nTileSize, m_nPixelSize;
+	std::vector<VectorLayerStyle> m_vecStyle;
+	UINT32 m_nBackgroundColor;
+
+	// draws a layer with a rasterizer set up for the image, using vecPoints as scratch space
+	void DrawLayer(const VectorLayer& layer, const VectorLayerStyle& style, Rasterizer& rasterizer,
+		std::vector<D2D1_POINT_2F>& vecPoints);
+};
@@ -0,0 +1,304 @@
+// WinInetTransport.cpp: WinInetTransport class implementation
+
+#include "framework.h"
+#include "Util.h"
+#include "Trace.h"
+#include "WinInetTransport.h"
+
+// TODO: should we pretend to be a browser?
+static const wchar_t USER_AGENT[] = L"MapViewer/0.1";
+
+WinInetTransport::WinInetTransport(unsigned nMaxConnectionsPerServer)
+{
+	// default per-server connection limits are quite low (2 for HTTP/1.1 servers by the spec, which
+	// WinInet followed for a long time); these can only be set globally
+	DWORD dwMaxConnections = nMaxConnectionsPerServer;
+	InternetSetOption(nullptr, INTERNET_OPTION_MAX_CONNS_PER_SERVER, &dwMaxConnections, sizeof(dwMaxConnections));
+	InternetSetOption(nullptr, INTERNET_OPTION_MAX_CONNS_PER_1_0_SERVER, &dwMaxConnections, sizeof(dwMaxConnections));
+
+	// open main WinInet handle for async requests and all defaults, and set a callback for it
+	m_hInternet = InternetOpen(USER_AGENT, INTERNET_OPEN_TYPE_PRECONFIG,
+		nullptr, nullptr, INTERNET_FLAG_ASYNC);
+	_ASSERT(m_hInternet);
+	InternetSetStatusCallback(m_hInternet, StaticInternetStatusCallback);
+	// have WinInet ask for gzip/deflate compressed responses and decompress them for us
+	BOOL bDecoding = TRUE;
+	InternetSetOption(m_hInternet, INTERNET_OPTION_HTTP_DECODING, &bDecoding, sizeof(bDecoding));
+}
+
+WinInetTransport::~WinInetTransport()
+{
+	for (auto& kv : m_mapConnections) {
+		InternetCloseHandle(kv.second);
+	}
+	InternetCloseHandle(m_hInternet);
+}
+
+void WinInetTransport::Start(RequestId id, const std::wstring& strUrl, const HttpCacheInfo* pValidators, OnFinishCallback fnOnFinish)
+{
+	// create a new HttpRequest instance to track request
+	HttpRequest* pRequest;
+	{
+		std::lock_guard lock(m_vecRequestsMutex);
+		pRequest = m_vecRequests.emplace_back(new HttpRequest(*this, id, strUrl, fnOnFinish)).get();
+	}
+	TraceAsyncBegin("HttpRequest", id);
+
+	// split URL into parts, we need host for the connection and path for the request
+	URL_COMPONENTS components = { sizeof(URL_COMPONENTS) };
+	components.dwSchemeLength = components.dwHostNameLength = components.dwUrlPathLength = components.dwExtraInfoLength = (DWORD)-1;
+	HINTERNET hConnection = nullptr;
+	if (InternetCrackUrl(strUrl.c_str(), 0, 0, &components)) {
+		hConnection = GetConnection(components);
+	}
+
+	// open request handle on the shared connection handle, this does not do any I/O yet
+	HINTERNET hRequest = nullptr;
+	if (hConnection) {
+		std::wstring strPath = std::wstring(components.lpszUrlPath, components.dwUrlPathLength) +
+			std::wstring(components.lpszExtraInfo, components.dwExtraInfoLength);
+		// always from the server, and not into WinInet cache either, as our callers have a cache of their own
+		DWORD dwFlags = INTERNET_FLAG_KEEP_CONNECTION | INTERNET_FLAG_NO_UI | INTERNET_FLAG_NO_COOKIES |
+			INTERNET_FLAG_RELOAD | INTERNET_FLAG_NO_CACHE_WRITE;
+		if (components.nScheme == INTERNET_SCHEME_HTTPS) {
+			dwFlags |= INTERNET_FLAG_SECURE;
+		}
+		hRequest = HttpOpenRequest(hConnection, L"GET", strPath.c_str(), nullptr, nullptr, nullptr,
+			dwFlags, reinterpret_cast<DWORD_PTR>(pRequest));
+	}
+	if (!hRequest) {
+		// can't even start, report right away; no WinInet callbacks will follow
+		DWORD dwError = GetLastError();
+		PrintLnDebug(L"Failed to open request for {}, error {}", strUrl, dwError);
+		Finish(*pRequest, -(int)dwError);
+		std::lock_guard lock(m_vecRequestsMutex);
+		std::erase_if(m_vecRequests, [&](auto& p) { return p.get() == pRequest; });
+		return;
+	}
+	{
+		std::lock_guard lock(m_vecRequestsMutex);
+		pRequest->hRequest = hRequest;
+		// cancelled already?  Unlikely but possible
+		if (pRequest->bFinished) {
+			Terminate(*pRequest);
+			return;
+		}
+	}
+
+	// validators are ASCII, per the spec
+	if (pValidators) {
+		if (!pValidators->strETag.empty()) {
+			pRequest->strHeaders += L"If-None-Match: " + std::wstring(pValidators->strETag.begin(), pValidators->strETag.end()) + L"\r\n";
+		}
+		if (!pValidators->strLastModified.empty()) {
+			pRequest->strHeaders += L"If-Modified-Since: " + std::wstring(pValidators->strLastModified.begin(), pValidators->strLastModified.end()) + L"\r\n";
+		}
+	}
+
+	// fire off async request.  Normally results in ERROR_IO_PENDING, and completion is reported in callback
+	if (!HttpSendRequest(hRequest, pRequest->strHeaders.empty() ? nullptr : pRequest->strHeaders.c_str(), (DWORD)pRequest->strHeaders.size(), nullptr, 0)) {
+		_ASSERT(GetLastError() == ERROR_IO_PENDING);
+	}
+}
+
+HINTERNET WinInetTransport::GetConnection(const URL_COMPONENTS& components)
+{
+	std::wstring strKey = std::format(L"{}://{}:{}",
+		std::wstring(components.lpszScheme, components.dwSchemeLength),
+		std::wstring(components.lpszHostName, components.dwHostNameLength),
+		components.nPort);
+
+	std::lock_guard lock(m_mapConnectionsMutex);
+	auto it = m_mapConnections.find(strKey);
+	if (it != m_mapConnections.end()) {
+		return it->second;
+	}
+
+	// for HTTP, InternetConnect() doesn't actually connect anywhere, and returns synchronously.
+	// No context, so no callbacks for this handle
+	HINTERNET hConnection = InternetConnect(m_hInternet,
+		std::wstring(components.lpszHostName, components.dwHostNameLength).c_str(), components.nPort,
+		nullptr, nullptr, INTERNET_SERVICE_HTTP, 0, 0);
+	if (hConnection) {
+		m_mapConnections[strKey] = hConnection;
+	}
+	return hConnection;
+}
+
+void WinInetTransport::Cancel(RequestId id)
+{
+	// lock is held throughout so that the request is not deleted meanwhile
+	std::lock_guard lock(m_vecRequestsMutex);
+	auto it = std::find_if(m_vecRequests.begin(), m_vecRequests.end(),
+		[=](auto& request) { return request->id == id; });
+	if (it != m_vecRequests.end()) {
+		// report right away; any further callbacks for this request will be ignored
+		if (Finish(**it, -ERROR_INTERNET_OPERATION_CANCELLED)) {
+			Terminate(**it);
+		}
+	}
+}
+
+bool WinInetTransport::Finish(HttpRequest& request, int nStatus, ResponseBuffer buffer)
+{
+	if (request.bFinished.exchange(true)) {
+		return false;
+	}
+	TraceAsyncEnd("HttpRequest", request.id);
+	request.fnOnFinish(nStatus, std::move(buffer), request.cacheInfo);
+	return true;
+}
+
+void WinInetTransport::ReadBody(HttpRequest& request)
+{
+	// reads complete synchronously whenever the data is already there, which is most of the time;
+	// keep going until one is pending, or the body is done
+	while (true) {
+		size_t szSpace;
+		request.buffers.lpvBuffer = request.body.GetSpace(szSpace);
+		request.buffers.dwBufferLength = (DWORD)std::min(szSpace, (size_t)MAXDWORD);
+		if (!InternetReadFileEx(request.hRequest, &request.buffers, IRF_ASYNC, reinterpret_cast<DWORD_PTR>(&request))) {
+			// otherwise expect ERROR_IO_PENDING, any other error is an acual error
+			DWORD dwError = GetLastError();
+			if (dwError != ERROR_IO_PENDING) {
+				Finish(request, -(int)dwError);
+				Terminate(request);
+			}
+			return;
+		}
+		if (!ReadCompleted(request, request.buffers.dwBufferLength)) {
+			return;
+		}
+	}
+}
+
+bool WinInetTransport::ReadCompleted(HttpRequest& request, DWORD dwRead)
+{
+	if (dwRead) {
+		request.body.Commit(dwRead);
+		return true;
+	}
+	// a read of 0 bytes means all is read successfully
+	Finish(request, 0, request.body.Finish());
+	Terminate(request);
+	return false;
+}
+
+// gets a header value as a narrow string (headers are ASCII), empty if there is none
+static std::string QueryHeader(HINTERNET hRequest, const char* pszName)
+{
+	// the name goes in the buffer the value comes back in
+	char buffer[256];
+	strcpy_s(buffer, pszName);
+	DWORD dwLength = sizeof(buffer);
+	DWORD dwIndex = 0;
+	if (!HttpQueryInfoA(hRequest, HTTP_QUERY_CUSTOM, buffer, &dwLength, &dwIndex)) {
+		return std::string();
+	}
+	return std::string(buffer, dwLength);
+}
+
+bool WinInetTransport::IsContentEncoded(HINTERNET hRequest)
+{
+	std::string strEncoding = QueryHeader(hRequest, "Content-Encoding");
+	return !strEncoding.empty() && _stricmp(strEncoding.c_str(), "identity") != 0;
+}
+
+void WinInetTransport::Terminate(HttpRequest& request)
+{
+	// close the request handle, if we already have it; if not, it'll be closed
+	// as soon as it is reported to us
+	std::lock_guard lock(m_vecRequestsMutex);
+	if (request.hRequest && !request.bClosed) {
+		request.bClosed = true;
+		InternetCloseHandle(request.hRequest);
+	}
+}
+
+void __stdcall WinInetTransport::StaticInternetStatusCallback(HINTERNET hInternet, DWORD_PTR dwContext, DWORD dwInternetStatus, LPVOID lpvStatusInformation, DWORD dwStatusInformationLength)
+{
+	HttpRequest* pRequest = reinterpret_cast<HttpRequest*>(dwContext);
+	pRequest->transport.InternetStatusCallback(*pRequest, hInternet, dwInternetStatus, lpvStatusInformation, dwStatusInformationLength);
+}
+
+void WinInetTransport::InternetStatusCallback(HttpRequest &request, HINTERNET hInternet, DWORD dwInternetStatus, LPVOID lpvStatusInformation, DWORD dwStatusInformationLength)
+{
+	//PrintLnDebug(L"InternetStatusCallback HINTERNET = 0{:x} dwInternetStatus = {}", (intptr_t) hInternet, dwInternetStatus);
+
+	switch (dwInternetStatus)
+	{
+	case INTERNET_STATUS_HANDLE_CREATED: {
+		// store request handle in HttpRequest (we might already have it from HttpOpenRequest())
+		INTERNET_ASYNC_RESULT* pResult = reinterpret_cast<INTERNET_ASYNC_RESULT*>(lpvStatusInformation);
+		std::lock_guard lock(m_vecRequestsMutex);
+		request.hRequest = reinterpret_cast<HINTERNET>(pResult->dwResult);
+		// might have been cancelled before we got the handle
+		if (request.bFinished) {
+			Terminate(request);
+		}
+		break;
+	}
+
+	case INTERNET_STATUS_CONNECTED_TO_SERVER:
+		// only for new connections, not for reused keep-alive ones
+		TraceAsyncStep("HttpRequest", request.id, "connected");
+		break;
+
+	case INTERNET_STATUS_REQUEST_COMPLETE: {
+		INTERNET_ASYNC_RESULT* pResult = reinterpret_cast<INTERNET_ASYNC_RESULT*>(lpvStatusInformation);
+		if (request.bFinished) {
+			// cancelled, nothing to do anymore
+			Terminate(request);
+		} else if (pResult->dwResult) {
+			// successul callback
+
+			if (!request.bReading) {
+				// response headers are in, must be a first callback
+				TraceAsyncStep("HttpRequest", request.id, "first byte");
+				DWORD dw = 0;
+				DWORD dwLength = sizeof(dw);
+				DWORD dwIndex = 0;
+
+				// check HTTP status
+				bool statusCodeRetrieved = HttpQueryInfo(request.hRequest, HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER, &dw, &dwLength, &dwIndex);
+				_ASSERT(statusCodeRetrieved);
+				// not modified has no body, but refreshes caching headers
+				ParseCacheHeaders(dw, [&](const char* pszName) { return QueryHeader(request.hRequest, pszName); }, request.cacheInfo);
+				// allow only 2xx status, otherwise bail out and don't bother reading response
+				if (dw < 200 || dw > 299) {
+					Finish(request, dw);
+					Terminate(request);
+					return;
+				}
+
+				// Content-Length is only a hint for the buffer size: chunked responses don't have it,
+				// and for compressed ones it is the length before WinInet decodes them
+				dwLength = sizeof(dw);
+				dwIndex = 0;
+				if (!HttpQueryInfo(request.hRequest, HTTP_QUERY_CONTENT_LENGTH | HTTP_QUERY_FLAG_NUMBER, &dw, &dwLength, &dwIndex) ||
+					IsContentEncoded(request.hRequest)) {
+					dw = 0;
+				}
+				request.body.Reset(dw);
+				request.bReading = true;
+				ReadBody(request);
+			} else if (ReadCompleted(request, request.buffers.dwBufferLength)) {
+				// an asynchronous read is done, and there's more to read
+				ReadBody(request);
+			}
+		} else {
+			// error callback, report and wrap up
+			Finish(request, -(int)pResult->dwError);
+			Terminate(request);
+		}
+		break;
+	}
+
+	case INTERNET_STATUS_HANDLE_CLOSING: {
+		// this is the last callback for the request, can delete it now
+		std::lock_guard lock(m_vecRequestsMutex);
+		std::erase_if(m_vecRequests, [&](auto& pRequest) { return pRequest.get() == &request; });
+		break;
+	}
+	}
+}
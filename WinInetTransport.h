@@ -0,0 +1,96 @@
+#pragma once
+
+// WinInetTransport.h: HttpTransport on WinInet's asynchronous API, for Windows.
+// WinInet's own cache is bypassed (see HttpClient.h), and compressed responses are decompressed
+// by it.  Requests to the same server share one WinInet connection handle, and WinInet keeps
+// a pool of persistent (keep-alive) connections under it.  WinInet doesn't pipeline requests.
+
+#include "HttpTransport.h"
+
+class WinInetTransport : public HttpTransport
+{
+public:
+	// nMaxConnectionsPerServer limits the number of simultaneous connections to one server.
+	// Note that this is a process-wide WinInet setting
+	WinInetTransport(unsigned nMaxConnectionsPerServer);
+	~WinInetTransport();
+
+	void Start(RequestId id, const std::wstring& strUrl, const HttpCacheInfo* pValidators, OnFinishCallback fnOnFinish) override;
+	void Cancel(RequestId id) override;
+
+private:
+	// base WinInet handle
+	HINTERNET m_hInternet;
+
+	// per-server connection handles, keyed by scheme://host:port, created as needed.
+	// WinInet reuses keep-alive connections for all requests made under the same handle
+	std::unordered_map<std::wstring, HINTERNET> m_mapConnections;
+	std::mutex m_mapConnectionsMutex;
+
+	// gets or creates connection handle for a parsed URL
+	HINTERNET GetConnection(const URL_COMPONENTS& components);
+
+	// structure for keeping track of a request
+	struct HttpRequest
+	{
+		WinInetTransport& transport;
+		RequestId id;
+		std::wstring strUrl;
+		OnFinishCallback fnOnFinish;
+		// extra request headers, kept until the request is sent
+		std::wstring strHeaders;
+		HttpCacheInfo cacheInfo;
+		HINTERNET hRequest = nullptr;
+		INTERNET_BUFFERS buffers = { sizeof(INTERNET_BUFFERS) };
+		ResponseBuilder body;
+		// response headers are in, and the body is being read
+		bool bReading = false;
+		// callback already called (request completed or cancelled)
+		std::atomic<bool> bFinished = false;
+		// request handle already closed
+		bool bClosed = false;
+
+		HttpRequest(WinInetTransport& transport, RequestId id, std::wstring strUrl, OnFinishCallback fnOnFinish) :
+			transport(transport), id(id), strUrl(strUrl), fnOnFinish(fnOnFinish) {}
+	};
+
+	// async callback, dwContext should be a pointer to HttpRequest
+	static void StaticInternetStatusCallback(
+		HINTERNET hInternet,
+		DWORD_PTR dwContext,
+		DWORD dwInternetStatus,
+		LPVOID lpvStatusInformation,
+		DWORD dwStatusInformationLength
+	);
+
+	// wrapped callback
+	void InternetStatusCallback(
+		HttpRequest &request,
+		HINTERNET hInternet,
+		DWORD dwInternetStatus,
+		LPVOID lpvStatusInformation,
+		DWORD dwStatusInformationLength
+	);
+
+	// whether a response is compressed (decompressed by WinInet as it is read)
+	static bool IsContentEncoded(HINTERNET hRequest);
+
+	// reads response body until a read is pending, or the body is done
+	void ReadBody(HttpRequest& request);
+	// takes dwRead bytes just read into the body; or, if there are none, finishes the request
+	// with the whole body.  Returns whether there is more to read
+	bool ReadCompleted(HttpRequest& request, DWORD dwRead);
+
+	// calls request callback with the response body, unless already called.  Returns false if
+	// callback was already called before
+	bool Finish(HttpRequest& request, int nStatus, ResponseBuffer buffer = ResponseBuffer());
+
+	// stop a request (if active).  HttpRequest structure is deleted only when WinInet
+	// reports its handle is closing, since it may still be referenced until then
+	void Terminate(HttpRequest& request);
+
+	// currently active requests, and a mutex to sync changes to it.  Recursive since
+	// Cancel() calls the request callback under it, which may make new requests
+	std::vector<std::unique_ptr<HttpRequest>> m_vecRequests;
+	std::recursive_mutex m_vecRequestsMutex;
+};
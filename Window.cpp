@@ -80,6 +80,14 @@ LRESULT Window::WndProc(UINT uMsg, WPARAM wParam, LPARAM lParam)
 		OnMouseMove((WORD) wParam, GET_X_LPARAM(lParam), GET_Y_LPARAM(lParam));
 		return 0;
 
+	case WM_KEYDOWN:
+		OnKeyDown((UINT)wParam);
+		return 0;
+
+	case WM_TIMER:
+		OnTimer(wParam);
+		return 0;
+
 	case WM_PAINT:
 		OnPaint();
 		return 0;
@@ -113,6 +121,14 @@ void Window::OnMouseMove(WORD wFlags, int x, int y)
 {
 }
 
+void Window::OnKeyDown(UINT nVirtKey)
+{
+}
+
+void Window::OnTimer(UINT_PTR nTimerId)
+{
+}
+
 void Window::OnPaint()
 {
 }
@@ -39,6 +39,8 @@ protected:
 	virtual void OnLButtonUp(WORD wFlags, int x, int y);
 	virtual void OnMouseWheel(WORD wFlags, int x, int y, int delta);
 	virtual void OnMouseMove(WORD wFlags, int x, int y);
+	virtual void OnKeyDown(UINT nVirtKey);
+	virtual void OnTimer(UINT_PTR nTimerId);
 	virtual void OnPaint();
 
 private:
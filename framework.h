@@ -4,6 +4,7 @@
 
 #pragma once
 
+#ifdef _WIN32
 #include "targetver.h"
 
 #define WIN32_LEAN_AND_MEAN             // Exclude rarely-used stuff from Windows headers
@@ -15,7 +16,10 @@
 #include <shlwapi.h>
 #include <wininet.h>
 #include <wincodec.h>
+#include <shlobj.h>
+#include <shellapi.h>
 #include <d2d1.h>
+#include <dwrite.h>
 
 // C RunTime Header Files
 #include <stdlib.h>
@@ -23,12 +27,30 @@
 #include <memory.h>
 #include <tchar.h>
 #include <crtdbg.h>
+#else
+// elsewhere, stand-ins for what the platform-neutral modules use, see Portable.h
+#include "Portable.h"
+#endif
 
 // C++ stdlib
 #include <string>
+#if __has_include(<format>)
 #include <format>
+#endif
 #include <functional>
+#include <memory>
+#include <vector>
+#include <map>
+#include <unordered_map>
 #include <algorithm>
 #include <mutex>
+#include <atomic>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <chrono>
 #include <cmath>
-#include <numbers>
\ No newline at end of file
+#include <numbers>
+#include <charconv>
+#include <random>
\ No newline at end of file